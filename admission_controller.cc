@@ -0,0 +1,232 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "admission_controller.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "metrics.h"
+
+namespace p11net {
+
+namespace {
+
+// The factor by which a slow or failed request lowers an adaptive limit.
+const double kDecreaseFactor = 0.9;
+
+}  // namespace
+
+AdmissionController::Permit::Permit(
+    std::shared_ptr<AdmissionController> controller)
+    : controller_(std::move(controller)),
+      start_(Clock::now()),
+      reported_(false) {}
+
+AdmissionController::Permit::~Permit() {
+  controller_->Release();
+}
+
+void AdmissionController::Permit::ReportSuccess() {
+  if (reported_)
+    return;
+  reported_ = true;
+  controller_->RecordOutcome(Clock::now() - start_, true);
+}
+
+void AdmissionController::Permit::ReportFailure() {
+  if (reported_)
+    return;
+  reported_ = true;
+  controller_->RecordOutcome(Clock::now() - start_, false);
+}
+
+AdmissionController::AdmissionController(
+    size_t max_limit,
+    size_t min_limit,
+    size_t queue_depth,
+    Clock::duration queue_timeout,
+    Clock::duration target_latency,
+    const std::vector<int>& lane_weights,
+    size_t reserved)
+    : max_limit_(std::max<size_t>(max_limit, 1)),
+      min_limit_(std::max<size_t>(std::min(min_limit, max_limit_), 1)),
+      queue_depth_(queue_depth),
+      queue_timeout_(queue_timeout),
+      target_latency_(target_latency),
+      reserved_(reserved),
+      rejected_counter_(Metrics::Get()->GetCounter(
+          "p11net_admission_rejected_total")),
+      limit_gauge_(Metrics::Get()->GetGauge("p11net_admission_limit")),
+      lanes_(std::max<size_t>(lane_weights.size(), 1)),
+      limit_(max_limit_),
+      reported_limit_(0),
+      in_flight_(0) {
+  for (size_t i = 0; i < lane_weights.size(); ++i)
+    lanes_[i].weight = std::max(lane_weights[i], 1);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  ReportLimit();
+}
+
+AdmissionController::~AdmissionController() {
+  limit_gauge_->Add(-static_cast<int64_t>(reported_limit_));
+}
+
+std::shared_ptr<AdmissionController::Permit> AdmissionController::Admit(
+    size_t lane) {
+  if (!Acquire(lane, 1, true))
+    return std::shared_ptr<Permit>();
+  return std::shared_ptr<Permit>(new Permit(shared_from_this()));
+}
+
+std::shared_ptr<AdmissionController::Permit> AdmissionController::TryAdmit(
+    size_t lane) {
+  if (!Acquire(lane, 1, false))
+    return std::shared_ptr<Permit>();
+  return std::shared_ptr<Permit>(new Permit(shared_from_this()));
+}
+
+bool AdmissionController::AdmitBatch(
+    size_t lane,
+    size_t count,
+    std::vector<std::shared_ptr<Permit>>* permits) {
+  if (count == 0)
+    return true;
+  if (!Acquire(lane, count, true))
+    return false;
+  for (size_t i = 0; i < count; ++i)
+    permits->push_back(std::shared_ptr<Permit>(new Permit(shared_from_this())));
+  return true;
+}
+
+bool AdmissionController::Acquire(size_t lane, size_t slots, bool wait) {
+  lane = std::min(lane, lanes_.size() - 1);
+  boost::unique_lock<boost::mutex> lock(lock_);
+  Lane& queue = lanes_[lane];
+  // Requests of the lane that are already waiting go first.
+  if (queue.waiters.empty() && HasSlots(lane, slots)) {
+    in_flight_ += slots;
+    return true;
+  }
+  if (!wait)
+    return false;
+  if (queue.waiting + slots > queue_depth_) {
+    rejected_counter_->Increment(slots);
+    return false;
+  }
+  Waiter waiter(slots);
+  queue.waiters.push_back(&waiter);
+  queue.waiting += slots;
+  waiter.wakeup.wait_for(
+      lock,
+      boost::chrono::microseconds(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              queue_timeout_).count()),
+      [&waiter] { return waiter.admitted; });
+  if (!waiter.admitted) {
+    queue.waiters.erase(
+        std::find(queue.waiters.begin(), queue.waiters.end(), &waiter));
+    queue.waiting -= slots;
+    rejected_counter_->Increment(slots);
+    // A batch may have held up smaller requests behind it.
+    Dispatch();
+    return false;
+  }
+  // Dispatch counted the requests as in flight.
+  return true;
+}
+
+size_t AdmissionController::limit() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  return static_cast<size_t>(limit_);
+}
+
+size_t AdmissionController::in_flight() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  return in_flight_;
+}
+
+bool AdmissionController::HasSlots(size_t lane, size_t slots) const {
+  const size_t limit = static_cast<size_t>(limit_);
+  // Other lanes leave the reserved slots, but always at least one, free.
+  const size_t available =
+      lane == 0 ? limit : limit - std::min(reserved_, limit - 1);
+  // A batch larger than the lane may fill needs all of it.
+  return in_flight_ + std::min(slots, available) <= available;
+}
+
+void AdmissionController::Dispatch() {
+  for (;;) {
+    // Weighted round robin over the lanes that have waiting requests and a
+    // slot for them; a new round starts once none of them has credit left.
+    Lane* next = NULL;
+    bool eligible = false;
+    for (size_t i = 0; i < lanes_.size() && !next; ++i) {
+      if (lanes_[i].waiters.empty() ||
+          !HasSlots(i, lanes_[i].waiters.front()->slots))
+        continue;
+      eligible = true;
+      if (lanes_[i].credit > 0)
+        next = &lanes_[i];
+    }
+    if (!eligible)
+      return;
+    if (!next) {
+      for (auto i = lanes_.begin(); i != lanes_.end(); ++i)
+        i->credit = i->weight;
+      continue;
+    }
+    // A batch spends a credit per request.
+    Waiter* waiter = next->waiters.front();
+    next->waiters.pop_front();
+    next->waiting -= waiter->slots;
+    next->credit -= static_cast<int>(waiter->slots);
+    waiter->admitted = true;
+    in_flight_ += waiter->slots;
+    waiter->wakeup.notify_one();
+  }
+}
+
+void AdmissionController::Release() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  CHECK_GT(in_flight_, 0u);
+  --in_flight_;
+  Dispatch();
+}
+
+void AdmissionController::RecordOutcome(const Clock::duration& latency,
+                                        bool success) {
+  if (target_latency_ == Clock::duration::zero())
+    return;
+  boost::lock_guard<boost::mutex> lock(lock_);
+  const Clock::time_point now = Clock::now();
+  if (success && latency <= target_latency_) {
+    // Additive increase: one more slot once a full limit's worth of requests
+    // was answered in time.
+    limit_ = std::min<double>(limit_ + 1 / limit_, max_limit_);
+    Dispatch();
+  } else if (now - last_decrease_ >= target_latency_) {
+    // Multiplicative decrease, once per target latency so that one slow
+    // round does not collapse the limit.
+    limit_ = std::max<double>(limit_ * kDecreaseFactor, min_limit_);
+    last_decrease_ = now;
+    VLOG(1) << "Admission limit lowered to " << limit_;
+  }
+  ReportLimit();
+}
+
+void AdmissionController::ReportLimit() {
+  const size_t limit = static_cast<size_t>(limit_);
+  if (limit == reported_limit_)
+    return;
+  limit_gauge_->Add(static_cast<int64_t>(limit) -
+                    static_cast<int64_t>(reported_limit_));
+  reported_limit_ = limit;
+}
+
+}  // namespace p11net
@@ -0,0 +1,169 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_ADMISSION_CONTROLLER_H_
+#define P11NET_ADMISSION_CONTROLLER_H_
+
+#include <stddef.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <base/macros.h>
+
+namespace p11net {
+
+class Counter;
+class Gauge;
+
+// AdmissionController bounds the number of requests in flight to the NetHSM.
+// A request that finds the limit reached waits for a slot if fewer than
+// 'queue_depth' requests are waiting already, for at most 'queue_timeout', and
+// is rejected otherwise; with a queue depth of zero, requests over the limit
+// fail right away. If a target latency is given, the limit adapts between
+// 'min_limit' and 'max_limit': it grows by one per round of requests answered
+// within the target, and shrinks by a tenth when a request is slower or
+// fails, at most once per target latency.
+//
+// Requests are admitted in lanes, e.g. one for interactive and one for bulk
+// requests. Each lane has its own queue. While requests wait in several lanes,
+// freed slots are handed out in proportion to the lane weights, starting with
+// lane 0, and a number of slots can be reserved for lane 0 altogether.
+//
+// A batch of requests is admitted as one: it waits in its lane until there
+// are slots for all of them, and counts towards the lane's queue depth with
+// each of its requests. Sample usage:
+//    std::shared_ptr<AdmissionController> admission(new AdmissionController(
+//        64, 4, 128, timeout, target_latency, {4, 1}, 8));
+//    std::shared_ptr<AdmissionController::Permit> permit =
+//        admission->Admit(lane);
+//    if (!permit)
+//      return;  // Overloaded.
+//    ...send the request...
+//    permit->ReportSuccess();
+class AdmissionController
+    : public std::enable_shared_from_this<AdmissionController> {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  // The right to send one request. Its slot is released when the permit is
+  // destroyed; it keeps the controller alive until then.
+  class Permit {
+   public:
+    ~Permit();
+    // Records the outcome of the request, which adjusts an adaptive limit.
+    // Only the first report counts.
+    void ReportSuccess();
+    void ReportFailure();
+
+   private:
+    friend class AdmissionController;
+    explicit Permit(std::shared_ptr<AdmissionController> controller);
+
+    std::shared_ptr<AdmissionController> controller_;
+    Clock::time_point start_;
+    bool reported_;
+
+    DISALLOW_COPY_AND_ASSIGN(Permit);
+  };
+
+  //  max_limit - The maximum number of requests in flight.
+  //  min_limit - The lowest the adaptive limit may go.
+  //  queue_depth - The maximum number of requests waiting in each lane.
+  //  queue_timeout - How long a request waits for a slot.
+  //  target_latency - The latency the adaptive limit aims for. Zero keeps the
+  //                   limit at 'max_limit'.
+  //  lane_weights - The weight of each lane; must not be empty.
+  //  reserved - The number of slots that only lane 0 may fill.
+  AdmissionController(size_t max_limit,
+                      size_t min_limit,
+                      size_t queue_depth,
+                      Clock::duration queue_timeout,
+                      Clock::duration target_latency,
+                      const std::vector<int>& lane_weights,
+                      size_t reserved);
+  virtual ~AdmissionController();
+
+  // Returns a permit for one request in the given lane, or NULL if the
+  // request is rejected. The controller must be owned by a shared_ptr.
+  std::shared_ptr<Permit> Admit(size_t lane);
+  // Like Admit, but never waits for a slot. This is meant for optional
+  // requests such as hedged duplicates.
+  std::shared_ptr<Permit> TryAdmit(size_t lane);
+  // Admits 'count' requests in the given lane together and appends a permit
+  // for each to 'permits', or returns false and appends nothing if the batch
+  // is rejected. A batch that would take the waiting requests of the lane
+  // past the queue depth is rejected right away. One that is larger than the
+  // limit waits until the whole limit is free and then exceeds it until its
+  // permits are released.
+  bool AdmitBatch(size_t lane,
+                  size_t count,
+                  std::vector<std::shared_ptr<Permit>>* permits);
+
+  // The current limit and the number of requests in flight.
+  size_t limit();
+  size_t in_flight();
+
+ private:
+  // A request, or a batch of them, waiting for slots.
+  struct Waiter {
+    explicit Waiter(size_t slots) : slots(slots), admitted(false) {}
+    boost::condition_variable wakeup;
+    // The number of slots the waiter needs.
+    const size_t slots;
+    // Set once the slots were handed to the waiter.
+    bool admitted;
+  };
+
+  struct Lane {
+    Lane() : waiting(0), weight(1), credit(0) {}
+    std::deque<Waiter*> waiters;
+    // The number of slots the waiters need, which the queue depth bounds.
+    size_t waiting;
+    int weight;
+    // The slots the lane may still receive in the current round.
+    int credit;
+  };
+
+  // Takes 'slots' slots in the given lane, waiting for them if 'wait' is
+  // set. Returns false if the request is rejected.
+  bool Acquire(size_t lane, size_t slots, bool wait);
+  // Returns true if 'slots' requests of the given lane may take free slots
+  // right away. lock_ must be held.
+  bool HasSlots(size_t lane, size_t slots) const;
+  // Hands free slots to waiting requests. lock_ must be held.
+  void Dispatch();
+  void Release();
+  void RecordOutcome(const Clock::duration& latency, bool success);
+  // Publishes limit_ to the limit gauge. lock_ must be held.
+  void ReportLimit();
+
+  const size_t max_limit_;
+  const size_t min_limit_;
+  const size_t queue_depth_;
+  const Clock::duration queue_timeout_;
+  const Clock::duration target_latency_;
+  const size_t reserved_;
+  Counter* rejected_counter_;
+  Gauge* limit_gauge_;
+  boost::mutex lock_;
+  std::vector<Lane> lanes_;
+  // The current limit. It is fractional so that it grows by one per round.
+  double limit_;
+  // The value of limit_ last published to the gauge.
+  size_t reported_limit_;
+  size_t in_flight_;
+  // The last time the limit was lowered.
+  Clock::time_point last_decrease_;
+
+  DISALLOW_COPY_AND_ASSIGN(AdmissionController);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_ADMISSION_CONTROLLER_H_
@@ -0,0 +1,125 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "attribute_map.h"
+
+#include <unordered_map>
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "brillo/secure_blob.h"
+#include "p11net.h"
+
+namespace p11net {
+
+namespace {
+
+// Values at least this long are shared.
+const size_t kMinSharedLength = 64;
+
+// The attributes that hold key material in some object class. An interned
+// value could be found by anyone who knows it and would outlive the objects
+// that held it in the table, so these are never interned.
+bool IsSensitiveAttribute(CK_ATTRIBUTE_TYPE type) {
+  switch (type) {
+    case CKA_VALUE:
+    case CKA_PRIVATE_EXPONENT:
+    case CKA_PRIME_1:
+    case CKA_PRIME_2:
+    case CKA_EXPONENT_1:
+    case CKA_EXPONENT_2:
+    case CKA_COEFFICIENT:
+      return true;
+    default:
+      return type == kKeyBlobAttribute || type == kAuthDataAttribute;
+  }
+}
+
+struct ValueHash {
+  size_t operator()(const std::string* value) const {
+    return std::hash<std::string>()(*value);
+  }
+};
+
+struct ValueEqual {
+  bool operator()(const std::string* a, const std::string* b) const {
+    return *a == *b;
+  }
+};
+
+// Key: The shared copy of an interned value, which stays in the table until
+//      its last holder releases it.
+// Value: That copy, for new holders.
+typedef std::unordered_map<const std::string*,
+                           std::weak_ptr<const std::string>,
+                           ValueHash,
+                           ValueEqual> InternTable;
+
+// The table and its lock are never destroyed, so that values can be released
+// during static destruction.
+InternTable& GetInternTable() {
+  static InternTable* table = new InternTable();
+  return *table;
+}
+
+boost::mutex& GetInternLock() {
+  static boost::mutex* lock = new boost::mutex();
+  return *lock;
+}
+
+void ZeroizeAndDelete(const std::string* value) {
+  std::string* mutable_value = const_cast<std::string*>(value);
+  brillo::SecureMemset(&(*mutable_value)[0], 0, mutable_value->size());
+  delete value;
+}
+
+// Releases an interned value. A holder that interned the same value after
+// the last one let go has replaced the entry, which then stays.
+void ReleaseInterned(const std::string* value) {
+  {
+    boost::lock_guard<boost::mutex> lock(GetInternLock());
+    InternTable& table = GetInternTable();
+    InternTable::iterator it = table.find(value);
+    if (it != table.end() && it->first == value)
+      table.erase(it);
+  }
+  ZeroizeAndDelete(value);
+}
+
+}  // namespace
+
+AttributeValue::AttributeValue(CK_ATTRIBUTE_TYPE type)
+    : sensitive_(IsSensitiveAttribute(type)) {}
+
+void AttributeValue::Assign(const std::string& value) {
+  if (value.length() < kMinSharedLength) {
+    inline_ = value;
+    shared_.reset();
+    return;
+  }
+  inline_.clear();
+  if (sensitive_) {
+    shared_.reset(new std::string(value), &ZeroizeAndDelete);
+    return;
+  }
+  // Releasing the previous value may take the lock, so that waits until the
+  // lock is released.
+  std::shared_ptr<const std::string> previous;
+  previous.swap(shared_);
+  boost::lock_guard<boost::mutex> lock(GetInternLock());
+  InternTable& table = GetInternTable();
+  InternTable::iterator it = table.find(&value);
+  if (it != table.end()) {
+    shared_ = it->second.lock();
+    if (shared_)
+      return;
+    // The last holder is releasing it and waits for the lock to erase it.
+    table.erase(it);
+  }
+  shared_.reset(new std::string(value), &ReleaseInterned);
+  table.emplace(shared_.get(), shared_);
+}
+
+}  // namespace p11net
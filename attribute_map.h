@@ -0,0 +1,159 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_ATTRIBUTE_MAP_H_
+#define P11NET_ATTRIBUTE_MAP_H_
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pkcs11/cryptoki.h"
+
+namespace p11net {
+
+// AttributeValue holds the value of a single attribute. Short values, such as
+// booleans, integers and most identifiers, are stored inline. Longer values,
+// such as moduli and certificates, are kept in one immutable,
+// reference-counted copy, which copies of an object share and which is
+// zeroized when its last holder lets go. Unless the attribute may hold key
+// material, that copy is also interned: objects holding the same long value
+// share it. Assigning a new value never affects other holders of the old one.
+class AttributeValue {
+ public:
+  AttributeValue() : sensitive_(false) {}
+  // A value of the attribute 'type', which decides whether it is interned.
+  explicit AttributeValue(CK_ATTRIBUTE_TYPE type);
+  AttributeValue(const std::string& value)  // NOLINT
+      : sensitive_(false) {
+    Assign(value);
+  }
+  AttributeValue& operator=(const std::string& value) {
+    Assign(value);
+    return *this;
+  }
+
+  const std::string& str() const { return shared_ ? *shared_ : inline_; }
+  operator const std::string&() const { return str(); }  // NOLINT
+  const char* data() const { return str().data(); }
+  size_t length() const { return str().length(); }
+  size_t size() const { return str().size(); }
+  bool empty() const { return str().empty(); }
+  char operator[](size_t index) const { return str()[index]; }
+
+  bool operator==(const AttributeValue& other) const {
+    if (shared_ && shared_ == other.shared_)
+      return true;
+    return str() == other.str();
+  }
+  bool operator!=(const AttributeValue& other) const {
+    return !(*this == other);
+  }
+  bool operator==(const std::string& other) const { return str() == other; }
+  bool operator!=(const std::string& other) const { return str() != other; }
+
+ private:
+  void Assign(const std::string& value);
+
+  std::string inline_;
+  std::shared_ptr<const std::string> shared_;
+  // Set if the value may be key material, which is never interned.
+  bool sensitive_;
+};
+
+// AttributeMap holds the attributes of an object as a vector sorted by type.
+// An object carries a few dozen attributes at most, so a lookup is a binary
+// search over contiguous memory and the whole map is a single allocation
+// besides the interned long values.
+// The interface follows the subset of std::map that objects need. Entries
+// also record whether the attribute was set by the user. Iterators and
+// references are invalidated when an attribute is added or removed.
+class AttributeMap {
+ public:
+  struct Entry {
+    Entry() : first(0), external(false) {}
+    explicit Entry(CK_ATTRIBUTE_TYPE type)
+        : first(type), second(type), external(false) {}
+    CK_ATTRIBUTE_TYPE first;
+    AttributeValue second;
+    // Set if the value was provided by the user rather than by P11Net.
+    bool external;
+  };
+  typedef Entry value_type;
+  typedef std::vector<Entry>::iterator iterator;
+  typedef std::vector<Entry>::const_iterator const_iterator;
+
+  iterator begin() { return entries_.begin(); }
+  iterator end() { return entries_.end(); }
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  void clear() { entries_.clear(); }
+
+  iterator find(CK_ATTRIBUTE_TYPE type) {
+    iterator it = LowerBound(type);
+    return (it != entries_.end() && it->first == type) ? it : entries_.end();
+  }
+  const_iterator find(CK_ATTRIBUTE_TYPE type) const {
+    const_iterator it = LowerBound(type);
+    return (it != entries_.end() && it->first == type) ? it : entries_.end();
+  }
+
+  // Returns the value of the given attribute, adding an empty one if needed.
+  AttributeValue& operator[](CK_ATTRIBUTE_TYPE type) {
+    iterator it = LowerBound(type);
+    if (it == entries_.end() || it->first != type)
+      it = entries_.insert(it, Entry(type));
+    return it->second;
+  }
+
+  size_t erase(CK_ATTRIBUTE_TYPE type) {
+    iterator it = find(type);
+    if (it == entries_.end())
+      return 0;
+    entries_.erase(it);
+    return 1;
+  }
+
+  // Marks every attribute as set by P11Net.
+  void ClearExternal() {
+    for (iterator it = entries_.begin(); it != entries_.end(); ++it)
+      it->external = false;
+  }
+
+  // Maps compare equal if they hold the same types and values, regardless of
+  // who set them.
+  bool operator==(const AttributeMap& other) const {
+    if (entries_.size() != other.entries_.size())
+      return false;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      if (entries_[i].first != other.entries_[i].first ||
+          entries_[i].second != other.entries_[i].second)
+        return false;
+    }
+    return true;
+  }
+  bool operator!=(const AttributeMap& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  static bool TypeLess(const Entry& entry, CK_ATTRIBUTE_TYPE type) {
+    return entry.first < type;
+  }
+  iterator LowerBound(CK_ATTRIBUTE_TYPE type) {
+    return std::lower_bound(entries_.begin(), entries_.end(), type, TypeLess);
+  }
+  const_iterator LowerBound(CK_ATTRIBUTE_TYPE type) const {
+    return std::lower_bound(entries_.begin(), entries_.end(), type, TypeLess);
+  }
+
+  std::vector<Entry> entries_;
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_ATTRIBUTE_MAP_H_
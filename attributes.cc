@@ -8,6 +8,8 @@
 #include <string>
 #include <vector>
 
+#include <google/protobuf/arena.h>
+
 #include "base/logging.h"
 
 #include "p11net_utility.h"
@@ -86,14 +88,17 @@ bool Attributes::SerializeInternal(CK_ATTRIBUTE_PTR attributes,
   // The PKCS #11 specification explicitly defines this as -1 cast to CK_ULONG.
   // See the C_GetAttributeValue section, page 133 in v2.20.
   const CK_ULONG kErrorIndicator = static_cast<CK_ULONG>(-1);
-  AttributeList attribute_list;
+  google::protobuf::Arena arena;
+  AttributeList* attribute_list =
+      google::protobuf::Arena::CreateMessage<AttributeList>(&arena);
+  attribute_list->mutable_attribute()->Reserve(num_attributes);
   for (CK_ULONG i = 0; i < num_attributes; ++i) {
     bool is_attribute_nested = IsAttributeNested(attributes[i].type);
     if (is_attribute_nested && !is_nesting_allowed) {
       LOG(ERROR) << "Nesting attempted and not allowed.";
       return false;
     }
-    Attribute* next = attribute_list.add_attribute();
+    Attribute* next = attribute_list->add_attribute();
     next->set_type(attributes[i].type);
     next->set_length(attributes[i].ulValueLen);
     if (!attributes[i].pValue || attributes[i].ulValueLen == kErrorIndicator) {
@@ -121,23 +126,25 @@ bool Attributes::SerializeInternal(CK_ATTRIBUTE_PTR attributes,
       return false;
     next->set_value(inner_serialized);
   }
-  return attribute_list.SerializeToString(serialized);
+  return attribute_list->SerializeToString(serialized);
 }
 
 bool Attributes::ParseInternal(const string& serialized,
                                bool is_nesting_allowed,
                                CK_ATTRIBUTE_PTR* attributes,
                                CK_ULONG* num_attributes) {
-  AttributeList attribute_list;
-  if (!attribute_list.ParseFromString(serialized)) {
+  google::protobuf::Arena arena;
+  AttributeList* attribute_list =
+      google::protobuf::Arena::CreateMessage<AttributeList>(&arena);
+  if (!attribute_list->ParseFromString(serialized)) {
     LOG(ERROR) << "Failed to parse proto-buffer.";
     return false;
   }
   std::unique_ptr<CK_ATTRIBUTE[]> attribute_array(
-      new CK_ATTRIBUTE[attribute_list.attribute_size()]);
+      new CK_ATTRIBUTE[attribute_list->attribute_size()]);
   CHECK(attribute_array.get());
-  for (int i = 0; i < attribute_list.attribute_size(); ++i) {
-    const Attribute& attribute = attribute_list.attribute(i);
+  for (int i = 0; i < attribute_list->attribute_size(); ++i) {
+    const Attribute& attribute = attribute_list->attribute(i);
     attribute_array[i].type = attribute.type();
     if (!attribute.has_value()) {
       // Only a length was requested, this is indicated in a CK_ATTRIBUTE by a
@@ -173,7 +180,7 @@ bool Attributes::ParseInternal(const string& serialized,
     attribute_array[i].pValue = inner_attribute_list;
   }
   *attributes = attribute_array.release();
-  *num_attributes = attribute_list.attribute_size();
+  *num_attributes = attribute_list->attribute_size();
   return true;
 }
 
@@ -181,22 +188,24 @@ bool Attributes::ParseAndFillInternal(const string& serialized,
                                       bool is_nesting_allowed,
                                       CK_ATTRIBUTE_PTR attributes,
                                       CK_ULONG num_attributes) {
-  AttributeList attribute_list;
+  google::protobuf::Arena arena;
+  AttributeList* attribute_list =
+      google::protobuf::Arena::CreateMessage<AttributeList>(&arena);
   if (!attributes) {
     LOG(ERROR) << "Attempted to fill NULL attribute array.";
     return false;
   }
-  if (!attribute_list.ParseFromString(serialized)) {
+  if (!attribute_list->ParseFromString(serialized)) {
     LOG(ERROR) << "Failed to parse proto-buffer.";
     return false;
   }
-  if (num_attributes != IntToValueLength(attribute_list.attribute_size())) {
+  if (num_attributes != IntToValueLength(attribute_list->attribute_size())) {
     LOG(ERROR) << "Attribute array size mismatch (expected=" << num_attributes
-               << ", actual=" << attribute_list.attribute_size() << ").";
+               << ", actual=" << attribute_list->attribute_size() << ").";
     return false;
   }
-  for (int i = 0; i < attribute_list.attribute_size(); ++i) {
-    const Attribute& attribute = attribute_list.attribute(i);
+  for (int i = 0; i < attribute_list->attribute_size(); ++i) {
+    const Attribute& attribute = attribute_list->attribute(i);
     if (attributes[i].type != attribute.type()) {
       LOG(ERROR) << "Attribute type mismatch (expected=" << attributes[i].type
                  << ", actual=" << attribute.type() << ").";
@@ -3,13 +3,342 @@
 // found in the LICENSE file.
 
 #include "base/logging.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/expressions.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
 #include <boost/log/utility/setup.hpp>
+#include <boost/make_shared.hpp>
+
+#include "base/macros.h"
 
 namespace logging {
 
+namespace {
+
+const char* kLogLevelEnv = "P11NET_LOG_LEVEL";
+const char* kLogAsyncEnv = "P11NET_LOG_ASYNC";
+const char* kLogBufferEnv = "P11NET_LOG_BUFFER";
+const char* kLogFormat = "p11net|%TimeStamp%|%Severity%|%Message%";
+
+const size_t kDefaultLogBuffer = 8192;
+// How long the writer thread sleeps when the queue is empty and it has no
+// eventfd to be woken by.
+const std::chrono::milliseconds kWriterIdleInterval(5);
+
+int ReadMinLogLevel() {
+  const char* value = std::getenv(kLogLevelEnv);
+  return value ? std::atoi(value) : 0;
+}
+
+std::atomic<int>& MinLogLevel() {
+  static std::atomic<int> level(ReadMinLogLevel());
+  return level;
+}
+
+// A bounded queue of messages that any number of threads push to without
+// locking and a single thread pops from. A cell keeps its string when it is
+// popped, so once the queue has warmed up pushing a message does not allocate.
+class MessageRing {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit MessageRing(size_t capacity)
+      : mask_(RoundUpToPowerOfTwo(capacity) - 1),
+        cells_(new Cell[mask_ + 1]),
+        enqueue_position_(0),
+        dequeue_position_(0) {
+    Reset();
+  }
+
+  // Empties the queue. Nothing may push or pop meanwhile.
+  void Reset() {
+    for (size_t i = 0; i <= mask_; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    enqueue_position_.store(0, std::memory_order_relaxed);
+    dequeue_position_ = 0;
+  }
+
+  // Returns false if the queue is full.
+  bool Push(const std::string& message) {
+    size_t position = enqueue_position_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[position & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t difference =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (difference == 0) {
+        if (enqueue_position_.compare_exchange_weak(
+                position, position + 1, std::memory_order_relaxed))
+          break;
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = enqueue_position_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->message.assign(message);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Appends the oldest message and a newline to 'output'. Returns false if the
+  // queue is empty. Only one thread may pop at a time.
+  bool PopTo(std::string* output) {
+    Cell* cell = &cells_[dequeue_position_ & mask_];
+    if (cell->sequence.load(std::memory_order_acquire) !=
+        dequeue_position_ + 1)
+      return false;
+    output->append(cell->message);
+    output->push_back('\n');
+    cell->sequence.store(dequeue_position_ + mask_ + 1,
+                         std::memory_order_release);
+    ++dequeue_position_;
+    return true;
+  }
+
+  // Returns true if PopTo would find no message. Only the popping thread may
+  // call this.
+  bool IsEmpty() const {
+    return cells_[dequeue_position_ & mask_].sequence.load(
+               std::memory_order_acquire) != dequeue_position_ + 1;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    std::string message;
+  };
+
+  static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t power = 2;
+    while (power < value)
+      power <<= 1;
+    return power;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<size_t> enqueue_position_;
+  size_t dequeue_position_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageRing);
+};
+
+// A sink backend that queues formatted records for a writer thread, which
+// writes them to stderr. Records are formatted by the logging thread but never
+// wait for I/O; a record that finds the queue full is dropped. The writer
+// sleeps on an eventfd while the queue is empty, and a record only costs a
+// write to it when the writer is asleep.
+class AsyncBackend
+    : public boost::log::sinks::basic_formatted_sink_backend<
+          char, boost::log::sinks::concurrent_feeding> {
+ public:
+  explicit AsyncBackend(size_t capacity)
+      : ring_(capacity),
+        dropped_(0),
+        event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        writer_idle_(false),
+        stopping_(false) {}
+  ~AsyncBackend() {
+    Stop();
+    if (event_fd_ >= 0)
+      close(event_fd_);
+  }
+
+  void consume(const boost::log::record_view& record,
+               const std::string& message) {
+    if (!ring_.Push(message))
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in WaitForRecords: either the writer sees the
+    // record, or this sees the writer idle.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_idle_.load(std::memory_order_relaxed))
+      WakeWriter();
+  }
+
+  // Writes all queued records.
+  void flush() {
+    std::lock_guard<std::mutex> lock(write_lock_);
+    Drain();
+  }
+
+  void Start() {
+    stopping_ = false;
+    writer_.reset(new std::thread(&AsyncBackend::WriteLoop, this));
+  }
+
+  void Stop() {
+    if (!writer_)
+      return;
+    stopping_ = true;
+    WakeWriter();
+    writer_->join();
+    writer_.reset();
+    flush();
+  }
+
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+
+ private:
+  void WriteLoop() {
+    while (!stopping_) {
+      bool wrote;
+      {
+        std::lock_guard<std::mutex> lock(write_lock_);
+        wrote = Drain();
+      }
+      if (!wrote)
+        WaitForRecords();
+    }
+  }
+
+  // Sleeps until a record is queued or the writer is stopped.
+  void WaitForRecords() {
+    if (event_fd_ < 0) {
+      std::this_thread::sleep_for(kWriterIdleInterval);
+      return;
+    }
+    writer_idle_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool idle;
+    {
+      std::lock_guard<std::mutex> lock(write_lock_);
+      idle = ring_.IsEmpty() &&
+             dropped_.load(std::memory_order_relaxed) == 0 && !stopping_;
+    }
+    if (idle) {
+      struct pollfd fd = {event_fd_, POLLIN, 0};
+      if (poll(&fd, 1, -1) > 0) {
+        uint64_t count;
+        ignore_result(read(event_fd_, &count, sizeof(count)));
+      }
+    }
+    writer_idle_.store(false, std::memory_order_relaxed);
+  }
+
+  void WakeWriter() {
+    if (event_fd_ < 0)
+      return;
+    const uint64_t one = 1;
+    ignore_result(write(event_fd_, &one, sizeof(one)));
+  }
+
+  // Writes the queued records with a single write. Returns false if there were
+  // none. Called with 'write_lock_' held.
+  bool Drain() {
+    buffer_.clear();
+    while (ring_.PopTo(&buffer_)) {}
+    uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      buffer_.append("p11net|||warning|Dropped " + std::to_string(dropped) +
+                     " log messages\n");
+    }
+    if (buffer_.empty())
+      return false;
+    fwrite(buffer_.data(), 1, buffer_.size(), stderr);
+    fflush(stderr);
+    return true;
+  }
+
+  MessageRing ring_;
+  std::atomic<uint64_t> dropped_;
+  int event_fd_;
+  // Set while the writer may be asleep on 'event_fd_'.
+  std::atomic<bool> writer_idle_;
+  // Serializes popping from the ring.
+  std::mutex write_lock_;
+  // Used only with 'write_lock_' held.
+  std::string buffer_;
+  std::atomic<bool> stopping_;
+  std::unique_ptr<std::thread> writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncBackend);
+};
+
+typedef boost::log::sinks::unlocked_sink<AsyncBackend> AsyncSink;
+
+// The backend of the asynchronous sink, or NULL if logging is synchronous.
+boost::shared_ptr<AsyncBackend> g_async_backend;
+
+void AsyncBackend::PrepareFork() {
+  g_async_backend->write_lock_.lock();
+}
+
+void AsyncBackend::ParentAfterFork() {
+  g_async_backend->write_lock_.unlock();
+}
+
+void AsyncBackend::ChildAfterFork() {
+  // The writer thread does not exist in the child; forget it without joining
+  // and start another one.
+  AsyncBackend* backend = g_async_backend.get();
+  ignore_result(backend->writer_.release());
+  // A thread of the parent may have claimed a cell it never fills in here,
+  // which would stall the queue, and the queued records are the parent's to
+  // write.
+  backend->ring_.Reset();
+  backend->dropped_ = 0;
+  // The eventfd is shared with the parent, whose writer it would wake.
+  if (backend->event_fd_ >= 0)
+    close(backend->event_fd_);
+  backend->event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  backend->writer_idle_ = false;
+  backend->write_lock_.unlock();
+  backend->Start();
+}
+
+void StopAsyncLogging() {
+  if (g_async_backend)
+    g_async_backend->Stop();
+}
+
+void AddAsyncLog() {
+  const char* value = std::getenv(kLogBufferEnv);
+  size_t capacity = value ? std::strtoul(value, NULL, 10) : 0;
+  g_async_backend = boost::make_shared<AsyncBackend>(
+      capacity > 0 ? capacity : kDefaultLogBuffer);
+  boost::shared_ptr<AsyncSink> sink =
+      boost::make_shared<AsyncSink>(g_async_backend);
+  sink->set_formatter(boost::log::parse_formatter(kLogFormat));
+  boost::log::core::get()->add_sink(sink);
+  g_async_backend->Start();
+  pthread_atfork(&AsyncBackend::PrepareFork, &AsyncBackend::ParentAfterFork,
+                 &AsyncBackend::ChildAfterFork);
+  // Queued messages are written before the process, or the library, goes.
+  std::atexit(&StopAsyncLogging);
+}
+
+}  // namespace
+
+int GetMinLogLevel() {
+  return MinLogLevel().load(std::memory_order_relaxed);
+}
+
+void SetMinLogLevel(int level) {
+  MinLogLevel().store(level, std::memory_order_relaxed);
+}
+
 void Init() {
   static bool initialized = false;
   if (initialized) return;
@@ -17,11 +346,15 @@ void Init() {
   boost::log::add_common_attributes();
   boost::log::register_simple_formatter_factory<
     boost::log::trivial::severity_level, char>("Severity");
-  boost::log::add_console_log(
-    std::clog,
-    boost::log::keywords::format =
-      "p11net|%TimeStamp%|%Severity%|%Message%"
- );
+  const char* async = std::getenv(kLogAsyncEnv);
+  if (!async || std::atoi(async) != 0) {
+    AddAsyncLog();
+  } else {
+    boost::log::add_console_log(
+      std::clog,
+      boost::log::keywords::format = kLogFormat
+    );
+  }
   // boost::log::core::get()->set_filter
   // (
   //     boost::log::trivial::severity >= boost::log::trivial::trace
@@ -29,4 +362,9 @@ void Init() {
   VLOG(1) << "Logging initialized.";
 }
 
+void Flush() {
+  if (g_async_backend)
+    g_async_backend->flush();
+}
+
 }  // namespace logging
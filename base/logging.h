@@ -20,12 +20,44 @@ namespace logging {
 // the min log level to negative values enables verbose logging.
 void Init();
 
+// Returns the minimum log level. This is read once from the P11NET_LOG_LEVEL
+// environment variable; e.g. P11NET_LOG_LEVEL=-2 enables VLOG(1) and VLOG(2).
+int GetMinLogLevel();
+void SetMinLogLevel(int level);
+
+// Writes the messages still queued for the log. The messages are written by a
+// background thread unless P11NET_LOG_ASYNC=0, so that logging never blocks
+// the caller; messages that find the queue full are dropped and counted.
+void Flush();
+
+// The log levels of LOG(severity).
+const int LOGGING_INFO = 0;
+const int LOGGING_WARNING = 1;
+const int LOGGING_ERROR = 2;
+const int LOGGING_FATAL = 3;
+
 }  // namespace logging
 
-// These macros are for LOG() and related logging commands.
-#define LOG(level) LOG_ ## level << " "
-#define PLOG(level) LOG_ ## level << "Error: " << strerror(errno) << "| "
-#define VLOG(level) LOG_DEBUG << __FILE__ << ":" << __LINE__ << "| "
+// The highest VLOG level compiled in. Higher levels compile to nothing,
+// whatever the runtime log level.
+#ifndef P11NET_MAX_VLOG_LEVEL
+#define P11NET_MAX_VLOG_LEVEL 2
+#endif
+
+// These macros are for LOG() and related logging commands. The stream
+// arguments of a disabled LOG or VLOG are not evaluated. The level check is a
+// loop rather than an if so that an else after the statement is not captured.
+#define LOG_IS_ON(level) \
+    (::logging::LOGGING_ ## level >= ::logging::GetMinLogLevel())
+#define VLOG_IS_ON(level) ((level) <= P11NET_MAX_VLOG_LEVEL && \
+                           -(level) >= ::logging::GetMinLogLevel())
+#define LOG_IF_ON(condition) \
+    for (bool log_is_on = (condition); log_is_on; log_is_on = false)
+#define LOG(level) LOG_IF_ON(LOG_IS_ON(level)) LOG_ ## level << " "
+#define PLOG(level) LOG_IF_ON(LOG_IS_ON(level)) \
+    LOG_ ## level << "Error: " << strerror(errno) << "| "
+#define VLOG(level) LOG_IF_ON(VLOG_IS_ON(level)) \
+    LOG_DEBUG << __FILE__ << ":" << __LINE__ << "| "
 
 #define LOG_TRACE BOOST_LOG_TRIVIAL(trace)
 #define LOG_DEBUG BOOST_LOG_TRIVIAL(debug)
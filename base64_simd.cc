@@ -0,0 +1,175 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "base64_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define P11NET_BASE64_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+#include "cppcodec/base64_url.hpp"
+
+namespace p11net {
+
+namespace {
+
+typedef cppcodec::base64_url Codec;
+
+#if defined(P11NET_BASE64_SSSE3)
+
+bool HasSSSE3() {
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  return has_ssse3;
+}
+
+// Encodes 12 bytes per iteration, reading 16 bytes at a time, while at least
+// 16 bytes of input remain. Returns the number of bytes consumed.
+__attribute__((target("ssse3")))
+size_t EncodeSSSE3(const uint8_t* binary, size_t binary_size, char* encoded) {
+  // Spreads each 3-byte group over a 32-bit lane as [b1 b0 b2 b1].
+  const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                        7, 6, 8, 7, 10, 9, 11, 10);
+  // Maps a 6-bit value class (see below) to its offset in the alphabet.
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '-' - 62,
+                                        '_' - 63, 'A', 0, 0);
+  size_t consumed = 0;
+  while (binary_size - consumed >= 16) {
+    __m128i in = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(binary + consumed));
+    in = _mm_shuffle_epi8(in, shuffle);
+    // Extract the four 6-bit values of each lane into separate bytes.
+    const __m128i hi = _mm_mulhi_epu16(
+        _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+        _mm_set1_epi32(0x04000040));
+    const __m128i lo = _mm_mullo_epi16(
+        _mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+        _mm_set1_epi32(0x01000010));
+    const __m128i values = _mm_or_si128(hi, lo);
+    // Class 13 for A-Z, 0 for a-z, 1-10 for 0-9, 11 for '-', 12 for '_'.
+    __m128i classes = _mm_subs_epu8(values, _mm_set1_epi8(51));
+    const __m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), values);
+    classes = _mm_or_si128(classes,
+                           _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+    const __m128i out = _mm_add_epi8(values,
+                                     _mm_shuffle_epi8(offsets, classes));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(encoded), out);
+    consumed += 12;
+    encoded += 16;
+  }
+  return consumed;
+}
+
+// Returns a mask of the bytes in 'in' that lie within [low, high].
+__attribute__((target("ssse3")))
+inline __m128i InRange(__m128i in, char low, char high) {
+  return _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(low - 1)),
+                       _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), in));
+}
+
+// Decodes 16 characters per iteration while at least 24 characters remain,
+// so the 16-byte stores stay within the output buffer and the final, possibly
+// padded, block is left to the scalar decoder. Stops early at the first block
+// containing a character outside the alphabet. Returns the number of
+// characters consumed.
+__attribute__((target("ssse3")))
+size_t DecodeSSSE3(const char* encoded, size_t encoded_size, uint8_t* binary) {
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                     14, 13, 12, -1, -1, -1, -1);
+  size_t consumed = 0;
+  while (encoded_size - consumed >= 24) {
+    const __m128i in = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(encoded + consumed));
+    const __m128i upper = InRange(in, 'A', 'Z');
+    const __m128i lower = InRange(in, 'a', 'z');
+    const __m128i digit = InRange(in, '0', '9');
+    const __m128i dash = _mm_cmpeq_epi8(in, _mm_set1_epi8('-'));
+    const __m128i underscore = _mm_cmpeq_epi8(in, _mm_set1_epi8('_'));
+    const __m128i valid = _mm_or_si128(
+        _mm_or_si128(upper, lower),
+        _mm_or_si128(digit, _mm_or_si128(dash, underscore)));
+    if (_mm_movemask_epi8(valid) != 0xffff)
+      break;
+    __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+    shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+    shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+    shift = _mm_or_si128(shift, _mm_and_si128(dash, _mm_set1_epi8(62 - '-')));
+    shift = _mm_or_si128(shift,
+                         _mm_and_si128(underscore, _mm_set1_epi8(63 - '_')));
+    const __m128i values = _mm_add_epi8(in, shift);
+    // Merge pairs of 6-bit values into 12 bits, then pairs of those into 24.
+    const __m128i merged = _mm_madd_epi16(
+        _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)),
+        _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(binary),
+                     _mm_shuffle_epi8(merged, pack));
+    consumed += 16;
+    binary += 12;
+  }
+  return consumed;
+}
+
+#endif  // P11NET_BASE64_SSSE3
+
+}  // namespace
+
+size_t Base64UrlEncodedSize(size_t binary_size) {
+  return Codec::encoded_size(binary_size);
+}
+
+size_t Base64UrlDecodedMaxSize(size_t encoded_size) {
+  return Codec::decoded_max_size(encoded_size);
+}
+
+size_t Base64UrlEncode(const uint8_t* binary, size_t binary_size,
+                       char* encoded) {
+  size_t consumed = 0;
+  size_t written = 0;
+#if defined(P11NET_BASE64_SSSE3)
+  if (HasSSSE3()) {
+    consumed = EncodeSSSE3(binary, binary_size, encoded);
+    written = consumed / 3 * 4;
+  }
+#endif
+  const size_t tail_size = Codec::encoded_size(binary_size - consumed);
+  // cppcodec writes a terminating NUL if there is room for it; give it no room
+  // so that a caller-owned buffer of the exact size is not overrun.
+  return written + Codec::encode(encoded + written, tail_size,
+                                 binary + consumed, binary_size - consumed);
+}
+
+std::string Base64UrlEncode(const std::string& binary) {
+  std::string encoded(Base64UrlEncodedSize(binary.size()), '\0');
+  encoded.resize(Base64UrlEncode(
+      reinterpret_cast<const uint8_t*>(binary.data()), binary.size(),
+      &encoded[0]));
+  return encoded;
+}
+
+size_t Base64UrlDecode(const char* encoded, size_t encoded_size,
+                       uint8_t* binary) {
+  size_t consumed = 0;
+  size_t written = 0;
+#if defined(P11NET_BASE64_SSSE3)
+  if (HasSSSE3()) {
+    consumed = DecodeSSSE3(encoded, encoded_size, binary);
+    written = consumed / 4 * 3;
+  }
+#endif
+  return written + Codec::decode(
+      binary + written, Codec::decoded_max_size(encoded_size - consumed),
+      encoded + consumed, encoded_size - consumed);
+}
+
+std::string Base64UrlDecode(const std::string& encoded) {
+  std::string binary(Base64UrlDecodedMaxSize(encoded.size()), '\0');
+  binary.resize(Base64UrlDecode(encoded.data(), encoded.size(),
+                                reinterpret_cast<uint8_t*>(&binary[0])));
+  return binary;
+}
+
+}  // namespace p11net
@@ -0,0 +1,39 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_BASE64_SIMD_H_
+#define P11NET_BASE64_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace p11net {
+
+// Padded base64url (RFC 4648, section 5) encoding and decoding, compatible
+// with cppcodec::base64_url. On x86 CPUs with SSSE3, blocks of 12 bytes are
+// processed with vector instructions; the choice is made once at runtime.
+// Everything else, including the final block and any input the vector path
+// cannot validate, goes through cppcodec, so errors are reported exactly as
+// cppcodec reports them (by throwing cppcodec::parse_error).
+
+size_t Base64UrlEncodedSize(size_t binary_size);
+size_t Base64UrlDecodedMaxSize(size_t encoded_size);
+
+// Writes the encoding of 'binary' to 'encoded', which must hold at least
+// Base64UrlEncodedSize(binary_size) characters. Returns the encoded size.
+size_t Base64UrlEncode(const uint8_t* binary, size_t binary_size,
+                       char* encoded);
+std::string Base64UrlEncode(const std::string& binary);
+
+// Writes the decoding of 'encoded' to 'binary', which must hold at least
+// Base64UrlDecodedMaxSize(encoded_size) bytes. Returns the decoded size.
+size_t Base64UrlDecode(const char* encoded, size_t encoded_size,
+                       uint8_t* binary);
+std::string Base64UrlDecode(const std::string& encoded);
+
+}  // namespace p11net
+
+#endif  // P11NET_BASE64_SIMD_H_
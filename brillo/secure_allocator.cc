@@ -0,0 +1,251 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "brillo/secure_allocator.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "brillo/secure_blob.h"
+
+namespace brillo {
+
+namespace {
+
+// Requests up to kMaxClassSize bytes are rounded up to a power of two from
+// kMinClassSize and served from the free list of that size class. Larger ones
+// get pages of their own.
+const size_t kMinClassSize = 16;
+const size_t kMaxClassSize = 4096;
+const size_t kNumClasses = 9;
+// Free lists are refilled by carving up arenas of this size.
+const size_t kArenaSize = 64 * 1024;
+// The most free blocks of a size class a thread keeps for itself. Beyond that
+// half of them go back to the pool, and an empty cache takes up to half from
+// it, so the pool lock is taken once per that many allocations.
+const size_t kMaxCachedBlocks = 32;
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct Pool {
+  Pool() {
+    for (size_t i = 0; i < kNumClasses; ++i)
+      free_lists[i] = NULL;
+  }
+  std::mutex lock;
+  FreeBlock* free_lists[kNumClasses];
+  // The arenas carved up so far. They are never unmapped.
+  std::vector<std::pair<void*, size_t>> arenas;
+  // Key: The pages of a request too large for the size classes.
+  // Value: Their size.
+  std::unordered_map<void*, size_t> mappings;
+  // Hands the cache of an exiting thread back to the pool.
+  pthread_key_t cache_key;
+};
+
+// The free blocks a thread keeps, so that most allocations take no lock. It
+// has no destructor, so that secrets freed late in the exit of a thread still
+// find it; the pool's key returns its blocks when the thread exits.
+struct ThreadCache {
+  FreeBlock* free_lists[kNumClasses];
+  size_t counts[kNumClasses];
+  bool registered;
+};
+
+thread_local ThreadCache g_thread_cache;
+
+size_t GetPageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+size_t GetClassIndex(size_t size) {
+  size_t index = 0;
+  for (size_t class_size = kMinClassSize; class_size < size; class_size <<= 1)
+    ++index;
+  return index;
+}
+
+void ProtectPages(void* memory, size_t size) {
+  if (mlock(memory, size) != 0) {
+    // Usually RLIMIT_MEMLOCK; the memory is still usable.
+    static std::atomic<bool> warned(false);
+    if (!warned.exchange(true))
+      PLOG(WARNING) << "Failed to lock memory for secrets into RAM";
+  }
+#ifdef MADV_DONTDUMP
+  madvise(memory, size, MADV_DONTDUMP);
+#endif
+}
+
+void* MapPages(size_t size) {
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << size << " bytes for secrets";
+    return NULL;
+  }
+  ProtectPages(memory, size);
+  return memory;
+}
+
+void PrepareFork();
+void ParentAfterFork();
+void ChildAfterFork();
+void FlushThreadCache(void* cache);
+
+Pool* GetPool() {
+  static Pool* pool = [] {
+    // A leaked instance, so that secrets freed during exit still find it.
+    Pool* pool = new Pool();
+    pthread_key_create(&pool->cache_key, &FlushThreadCache);
+    pthread_atfork(&PrepareFork, &ParentAfterFork, &ChildAfterFork);
+    return pool;
+  }();
+  return pool;
+}
+
+ThreadCache* GetThreadCache(Pool* pool) {
+  ThreadCache* cache = &g_thread_cache;
+  if (!cache->registered) {
+    cache->registered = true;
+    pthread_setspecific(pool->cache_key, cache);
+  }
+  return cache;
+}
+
+// Moves up to 'count' blocks of size class 'index' from 'from' to 'to'.
+void MoveBlocks(FreeBlock** from, FreeBlock** to, size_t index, size_t count,
+                size_t* moved) {
+  *moved = 0;
+  while (*moved < count && from[index]) {
+    FreeBlock* block = from[index];
+    from[index] = block->next;
+    block->next = to[index];
+    to[index] = block;
+    ++*moved;
+  }
+}
+
+void FlushThreadCache(void* memory) {
+  ThreadCache* cache = static_cast<ThreadCache*>(memory);
+  Pool* pool = GetPool();
+  std::lock_guard<std::mutex> lock(pool->lock);
+  for (size_t i = 0; i < kNumClasses; ++i) {
+    size_t moved;
+    MoveBlocks(cache->free_lists, pool->free_lists, i, cache->counts[i],
+               &moved);
+    cache->counts[i] = 0;
+  }
+  // A secret freed later in the exit of the thread registers it again.
+  cache->registered = false;
+}
+
+// The pool lock is held across fork so that the child does not inherit it
+// locked by a thread that no longer exists there.
+void PrepareFork() {
+  GetPool()->lock.lock();
+}
+
+void ParentAfterFork() {
+  GetPool()->lock.unlock();
+}
+
+void ChildAfterFork() {
+  Pool* pool = GetPool();
+  // Memory locks are not inherited across fork. The blocks the caches of
+  // other threads held stay locked with their arenas but are not used again.
+  for (auto i = pool->arenas.begin(); i != pool->arenas.end(); ++i)
+    ProtectPages(i->first, i->second);
+  for (auto i = pool->mappings.begin(); i != pool->mappings.end(); ++i)
+    ProtectPages(i->first, i->second);
+  pool->lock.unlock();
+}
+
+size_t RoundUpToPages(size_t size) {
+  const size_t page_size = GetPageSize();
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+}  // namespace
+
+void* SecureAlloc(size_t size) {
+  Pool* pool = GetPool();
+  if (size > kMaxClassSize) {
+    const size_t mapped = RoundUpToPages(size);
+    void* memory = MapPages(mapped);
+    if (memory) {
+      // Kept so that a forked child can lock the pages again.
+      std::lock_guard<std::mutex> lock(pool->lock);
+      pool->mappings[memory] = mapped;
+    }
+    return memory;
+  }
+  const size_t index = GetClassIndex(size);
+  const size_t class_size = kMinClassSize << index;
+  ThreadCache* cache = GetThreadCache(pool);
+  if (!cache->free_lists[index]) {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if (!pool->free_lists[index]) {
+      char* arena = static_cast<char*>(MapPages(kArenaSize));
+      if (!arena)
+        return NULL;
+      pool->arenas.push_back(std::make_pair(arena, kArenaSize));
+      for (size_t offset = 0; offset < kArenaSize; offset += class_size) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(arena + offset);
+        block->next = pool->free_lists[index];
+        pool->free_lists[index] = block;
+      }
+    }
+    MoveBlocks(pool->free_lists, cache->free_lists, index,
+               kMaxCachedBlocks / 2, &cache->counts[index]);
+  }
+  FreeBlock* block = cache->free_lists[index];
+  cache->free_lists[index] = block->next;
+  --cache->counts[index];
+  block->next = NULL;
+  return block;
+}
+
+void SecureFree(void* memory, size_t size) {
+  if (!memory)
+    return;
+  Pool* pool = GetPool();
+  if (size > kMaxClassSize) {
+    const size_t mapped = RoundUpToPages(size);
+    {
+      std::lock_guard<std::mutex> lock(pool->lock);
+      pool->mappings.erase(memory);
+    }
+    SecureMemset(memory, 0, mapped);
+    munmap(memory, mapped);
+    return;
+  }
+  const size_t index = GetClassIndex(size);
+  SecureMemset(memory, 0, kMinClassSize << index);
+  ThreadCache* cache = GetThreadCache(pool);
+  FreeBlock* block = static_cast<FreeBlock*>(memory);
+  block->next = cache->free_lists[index];
+  cache->free_lists[index] = block;
+  if (++cache->counts[index] > kMaxCachedBlocks) {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    size_t moved;
+    MoveBlocks(cache->free_lists, pool->free_lists, index,
+               kMaxCachedBlocks / 2, &moved);
+    cache->counts[index] -= moved;
+  }
+}
+
+}  // namespace brillo
@@ -0,0 +1,61 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBBRILLO_BRILLO_SECURE_ALLOCATOR_H_
+#define LIBBRILLO_BRILLO_SECURE_ALLOCATOR_H_
+
+#include <stddef.h>
+
+#include <new>
+
+#include "brillo_export.h"
+
+namespace brillo {
+
+// Allocates 'size' bytes for secrets. The memory comes from pages that are
+// locked into RAM, to keep it out of swap, and excluded from core dumps.
+// Small requests are served from per-size free lists, so allocating them
+// again after a free does not take a system call. Returns NULL on failure.
+BRILLO_EXPORT void* SecureAlloc(size_t size);
+
+// Zeroes and releases memory returned by SecureAlloc for the same 'size'.
+BRILLO_EXPORT void SecureFree(void* memory, size_t size);
+
+// SecureAllocator places the elements of a standard container in memory from
+// SecureAlloc, which is zeroed when the container frees it, including the old
+// buffer on reallocation.
+template <typename T>
+class SecureAllocator {
+ public:
+  typedef T value_type;
+
+  SecureAllocator() {}
+  template <typename U>
+  SecureAllocator(const SecureAllocator<U>&) {}
+
+  T* allocate(size_t count) {
+    void* memory = SecureAlloc(count * sizeof(T));
+    if (!memory)
+      throw std::bad_alloc();
+    return static_cast<T*>(memory);
+  }
+
+  void deallocate(T* memory, size_t count) {
+    SecureFree(memory, count * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) {
+  return false;
+}
+
+}  // namespace brillo
+
+#endif  // LIBBRILLO_BRILLO_SECURE_ALLOCATOR_H_
@@ -9,17 +9,20 @@
 #include <vector>
 
 #include "brillo_export.h"
+#include "brillo/secure_allocator.h"
 
 namespace brillo {
 
 using Blob = std::vector<uint8_t>;
+using SecureVector = std::vector<uint8_t, SecureAllocator<uint8_t>>;
 
-// SecureBlob erases the contents on destruction.  It does not guarantee erasure
-// on resize, assign, etc.
-class BRILLO_EXPORT SecureBlob : public Blob {
+// SecureBlob erases the contents on destruction. Its buffer comes from
+// SecureAlloc, so it stays out of swap and core dumps, and buffers left
+// behind when the blob grows are erased as well.
+class BRILLO_EXPORT SecureBlob : public SecureVector {
  public:
   SecureBlob() = default;
-  using Blob::vector;  // Inherit standard constructors from vector.
+  using SecureVector::vector;  // Inherit standard constructors from vector.
   explicit SecureBlob(const std::string& data);
   ~SecureBlob();
 
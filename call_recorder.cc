@@ -0,0 +1,160 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "call_recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+using std::string;
+
+namespace p11net {
+
+namespace Env {
+  // File that receives the call trace.
+  const char* kCallTraceFile = "P11NET_CALL_TRACE_FILE";
+}
+
+namespace {
+
+// Records are written to the trace file in chunks of about this size.
+const size_t kMaxBufferedBytes = 64 * 1024;
+
+struct CallTraceFile {
+  boost::mutex lock;
+  FILE* file = NULL;
+  // Function names by id.
+  std::vector<string> functions;
+  string buffer;
+};
+
+CallTraceFile& GetCallTraceFile() {
+  // Never destroyed, so that calls may still end during exit.
+  static CallTraceFile* trace_file = new CallTraceFile();
+  return *trace_file;
+}
+
+// The start of the recording, in steady clock nanoseconds.
+std::atomic<int64_t> g_recording_start(0);
+
+int64_t GetNowNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AppendBytes(const void* data, size_t length, string* out) {
+  out->append(reinterpret_cast<const char*>(data), length);
+}
+
+// Buffers the entry naming function 'id'. The caller holds the lock.
+void AppendFunctionEntry(uint16_t id, const string& name, string* out) {
+  const uint8_t type = kFunctionEntry;
+  const uint16_t length = static_cast<uint16_t>(name.size());
+  AppendBytes(&type, sizeof(type), out);
+  AppendBytes(&id, sizeof(id), out);
+  AppendBytes(&length, sizeof(length), out);
+  out->append(name);
+}
+
+// Writes the buffered entries. The caller holds the lock.
+void WriteBuffer(CallTraceFile* trace_file) {
+  if (!trace_file->buffer.empty() &&
+      fwrite(trace_file->buffer.data(), 1, trace_file->buffer.size(),
+             trace_file->file) != trace_file->buffer.size())
+    PLOG(WARNING) << "Failed to write the call trace";
+  trace_file->buffer.clear();
+  fflush(trace_file->file);
+}
+
+}  // namespace
+
+std::atomic<bool> CallRecorder::enabled_(false);
+
+void CallRecorder::Start() {
+  CallTraceFile& trace_file = GetCallTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  if (trace_file.file)
+    return;
+  const char* path = getenv(Env::kCallTraceFile);
+  if (!path || !*path)
+    return;
+  trace_file.file = fopen(path, "we");
+  if (!trace_file.file) {
+    PLOG(ERROR) << "Failed to open the call trace " << path;
+    return;
+  }
+  trace_file.buffer.clear();
+  AppendBytes(kCallTraceMagic, sizeof(kCallTraceMagic), &trace_file.buffer);
+  AppendBytes(&kCallTraceVersion, sizeof(kCallTraceVersion),
+              &trace_file.buffer);
+  for (size_t id = 0; id < trace_file.functions.size(); ++id)
+    AppendFunctionEntry(id, trace_file.functions[id], &trace_file.buffer);
+  g_recording_start.store(GetNowNanoseconds());
+  enabled_.store(true);
+  LOG(INFO) << "Recording PKCS #11 calls to " << path;
+}
+
+void CallRecorder::Stop() {
+  CallTraceFile& trace_file = GetCallTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  if (!trace_file.file)
+    return;
+  enabled_.store(false);
+  WriteBuffer(&trace_file);
+  fclose(trace_file.file);
+  trace_file.file = NULL;
+}
+
+uint16_t CallRecorder::GetFunctionId(const char* name) {
+  CallTraceFile& trace_file = GetCallTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  const uint16_t id = trace_file.functions.size();
+  trace_file.functions.push_back(name);
+  if (trace_file.file)
+    AppendFunctionEntry(id, name, &trace_file.buffer);
+  return id;
+}
+
+void CallRecorder::Record(const CallRecord& record) {
+  CallTraceFile& trace_file = GetCallTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  // Recording may have stopped while the call ran.
+  if (!trace_file.file)
+    return;
+  const uint8_t type = kCallEntry;
+  AppendBytes(&type, sizeof(type), &trace_file.buffer);
+  AppendBytes(&record, sizeof(record), &trace_file.buffer);
+  if (trace_file.buffer.size() >= kMaxBufferedBytes)
+    WriteBuffer(&trace_file);
+}
+
+uint64_t CallRecorder::GetElapsedNanoseconds() {
+  return GetNowNanoseconds() -
+         g_recording_start.load(std::memory_order_relaxed);
+}
+
+uint32_t CallRecorder::GetThreadNumber() {
+  static std::atomic<uint32_t> next_thread(1);
+  static thread_local const uint32_t thread = next_thread.fetch_add(1);
+  return thread;
+}
+
+void ScopedCallRecord::Finish() {
+  record_.duration_ns =
+      CallRecorder::GetElapsedNanoseconds() - record_.start_ns;
+  record_.thread = CallRecorder::GetThreadNumber();
+  if (output_size_)
+    record_.output_size = static_cast<uint32_t>(*output_size_);
+  CallRecorder::Record(record_);
+}
+
+}  // namespace p11net
@@ -0,0 +1,135 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_CALL_RECORDER_H_
+#define P11NET_CALL_RECORDER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+#include <base/macros.h>
+
+#include "pkcs11/cryptoki.h"
+
+namespace p11net {
+
+// The format of a call trace, as written by CallRecorder and read by
+// p11net_replay. A trace starts with kCallTraceMagic and kCallTraceVersion,
+// followed by entries that each start with a CallTraceEntryType byte:
+//    kFunctionEntry - a uint16_t function id, a uint16_t name length and the
+//                     name, e.g. "C_Sign". Precedes the first call of the id.
+//    kCallEntry     - a CallRecord.
+// Numbers are in host byte order. A trace holds no data, PINs or attribute
+// values, only what shapes the load: which calls were made when, on which
+// thread and session, and how much data they carried.
+const char kCallTraceMagic[8] = {'P', '1', '1', 'N', 'C', 'A', 'L', 'L'};
+const uint32_t kCallTraceVersion = 1;
+
+enum CallTraceEntryType : uint8_t {
+  kFunctionEntry = 1,
+  kCallEntry = 2,
+};
+
+struct CallRecord {
+  // When the call started, relative to the start of the recording.
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  // The session handle of the call, or the slot id for slot functions.
+  uint64_t handle;
+  // The mechanism the call initializes an operation with, or 0.
+  uint32_t mechanism;
+  // The recording's own number of the calling thread, starting at 1.
+  uint32_t thread;
+  // The length of the data or template passed in, and the length passed out.
+  uint32_t input_size;
+  uint32_t output_size;
+  uint16_t function;
+  uint16_t reserved;
+  uint32_t reserved2;
+};
+static_assert(sizeof(CallRecord) == 48, "CallRecord must be packed");
+
+// CallRecorder writes a call trace of every PKCS #11 call to the file named by
+// P11NET_CALL_TRACE_FILE, so that production traffic can be replayed against
+// the module with p11net_replay. With recording off, a call costs one relaxed
+// atomic load.
+class CallRecorder {
+ public:
+  // Opens the trace file if recording is configured. Does nothing if it is
+  // already open.
+  static void Start();
+  // Writes the buffered records to the trace file and closes it.
+  static void Stop();
+
+  static bool IsEnabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the id that identifies the named function in call traces.
+  static uint16_t GetFunctionId(const char* name);
+
+  // Buffers a finished call for the trace file.
+  static void Record(const CallRecord& record);
+
+  // The time since the start of the recording.
+  static uint64_t GetElapsedNanoseconds();
+  // Returns the recording's number of the calling thread.
+  static uint32_t GetThreadNumber();
+
+ private:
+  static std::atomic<bool> enabled_;
+
+  DISALLOW_COPY_AND_ASSIGN(CallRecorder);
+};
+
+// Records the enclosing PKCS #11 call when it returns. The output size is read
+// from 'output_size' at that time, if it is not NULL.
+class ScopedCallRecord {
+ public:
+  ScopedCallRecord(uint16_t function,
+                   CK_ULONG handle,
+                   CK_ULONG input_size,
+                   const CK_ULONG* output_size)
+      : output_size_(output_size), enabled_(CallRecorder::IsEnabled()) {
+    if (enabled_) {
+      record_ = CallRecord();
+      record_.function = function;
+      record_.handle = handle;
+      record_.input_size = static_cast<uint32_t>(input_size);
+      record_.start_ns = CallRecorder::GetElapsedNanoseconds();
+    }
+  }
+  ~ScopedCallRecord() {
+    if (enabled_)
+      Finish();
+  }
+
+  void SetMechanism(const CK_MECHANISM* mechanism) {
+    if (enabled_ && mechanism)
+      record_.mechanism = static_cast<uint32_t>(mechanism->mechanism);
+  }
+
+ private:
+  void Finish();
+
+  const CK_ULONG* output_size_;
+  const bool enabled_;
+  CallRecord record_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedCallRecord);
+};
+
+// Records the enclosing PKCS #11 entry point. The function id is looked up
+// once per function.
+#define P11NET_RECORD_CALL(handle, input_size, output_size)                 \
+  static const uint16_t call_record_function =                             \
+      p11net::CallRecorder::GetFunctionId(__func__);                      \
+  p11net::ScopedCallRecord call_record(call_record_function, (handle),     \
+                                       (input_size), (output_size))
+
+}  // namespace p11net
+
+#endif  // P11NET_CALL_RECORDER_H_
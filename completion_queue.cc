@@ -0,0 +1,152 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "completion_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+
+#include "p11net_ext.h"
+
+namespace p11net {
+
+CompletionQueue::CompletionQueue() : event_fd_(-1), next_id_(1) {
+  pthread_atfork(&CompletionQueue::PrepareFork,
+                 &CompletionQueue::ParentAfterFork,
+                 &CompletionQueue::ChildAfterFork);
+}
+
+CompletionQueue* CompletionQueue::Get() {
+  // Never destroyed: operations may complete on network threads after the
+  // module is finalized.
+  static CompletionQueue* queue = new CompletionQueue();
+  return queue;
+}
+
+int CompletionQueue::GetEventFd() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  if (event_fd_ < 0) {
+    event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ < 0) {
+      PLOG(ERROR) << "Failed to create the completion eventfd";
+      return -1;
+    }
+    if (!completed_.empty())
+      Signal();
+  }
+  return event_fd_;
+}
+
+uint64_t CompletionQueue::Add() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  const uint64_t id = next_id_++;
+  operations_[id];
+  return id;
+}
+
+void CompletionQueue::Discard(uint64_t id) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  operations_.erase(id);
+}
+
+void CompletionQueue::Complete(uint64_t id,
+                               CK_RV result,
+                               const std::string& data_out) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  auto it = operations_.find(id);
+  if (it == operations_.end())
+    return;  // Submitted before a fork.
+  Operation& operation = it->second;
+  operation.is_complete = true;
+  operation.result = result;
+  if (result == CKR_OK)
+    operation.data_out = data_out;
+  bool was_empty = completed_.empty();
+  completed_.push_back(id);
+  if (was_empty)
+    Signal();
+}
+
+void CompletionQueue::TakeCompleted(size_t max_count,
+                                    std::vector<uint64_t>* ids) {
+  CHECK(ids);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  const size_t count = std::min(max_count, completed_.size());
+  ids->assign(completed_.begin(), completed_.begin() + count);
+  completed_.erase(completed_.begin(), completed_.begin() + count);
+  if (event_fd_ >= 0 && completed_.empty()) {
+    uint64_t value;
+    if (read(event_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN)
+      PLOG(WARNING) << "Failed to reset the completion eventfd";
+  }
+}
+
+CK_RV CompletionQueue::Collect(uint64_t id,
+                               CK_BYTE_PTR data_out,
+                               CK_ULONG_PTR data_length) {
+  CHECK(data_length);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  auto it = operations_.find(id);
+  if (it == operations_.end())
+    return CKR_ARGUMENTS_BAD;
+  Operation& operation = it->second;
+  if (!operation.is_complete)
+    return CKR_P11NET_OPERATION_PENDING;
+  const CK_RV result = operation.result;
+  if (result == CKR_OK) {
+    const CK_ULONG length = operation.data_out.length();
+    if (!data_out) {
+      *data_length = length;
+      return CKR_OK;
+    }
+    if (*data_length < length) {
+      *data_length = length;
+      return CKR_BUFFER_TOO_SMALL;
+    }
+    memcpy(data_out, operation.data_out.data(), length);
+    *data_length = length;
+  }
+  // A collected operation that was never taken must not be reported later.
+  completed_.erase(std::remove(completed_.begin(), completed_.end(), id),
+                   completed_.end());
+  operations_.erase(it);
+  return result;
+}
+
+void CompletionQueue::Signal() {
+  if (event_fd_ < 0)
+    return;
+  const uint64_t value = 1;
+  if (write(event_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    PLOG(WARNING) << "Failed to signal the completion eventfd";
+}
+
+void CompletionQueue::PrepareFork() {
+  Get()->lock_.lock();
+}
+
+void CompletionQueue::ParentAfterFork() {
+  Get()->lock_.unlock();
+}
+
+void CompletionQueue::ChildAfterFork() {
+  CompletionQueue* queue = Get();
+  if (queue->event_fd_ >= 0) {
+    close(queue->event_fd_);
+    queue->event_fd_ = -1;
+  }
+  queue->operations_.clear();
+  queue->completed_.clear();
+  queue->lock_.unlock();
+}
+
+}  // namespace p11net
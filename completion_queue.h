@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_COMPLETION_QUEUE_H_
+#define P11NET_COMPLETION_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/thread/mutex.hpp>
+
+#include "pkcs11/cryptoki.h"
+
+namespace p11net {
+
+// CompletionQueue holds the operations submitted through the non-blocking
+// vendor extension, see p11net_ext.h. Each operation gets an id when it is
+// submitted. When it completes, its result is kept until collected and an
+// eventfd becomes readable, so that an event loop can wait for completions
+// along with its sockets. There is one queue per process. Sample usage:
+//    CompletionQueue* queue = CompletionQueue::Get();
+//    uint64_t id = queue->Add();
+//    ...start the operation, which calls queue->Complete(id, rv, output)...
+//    poll() on queue->GetEventFd(), then:
+//    queue->TakeCompleted(max_count, &ids);
+//    queue->Collect(id, buffer, &buffer_length);
+class CompletionQueue {
+ public:
+  static CompletionQueue* Get();
+
+  // Returns the eventfd that is readable while completed operations wait to
+  // be taken, or -1 if it cannot be created.
+  int GetEventFd();
+
+  // Registers a new pending operation and returns its id.
+  uint64_t Add();
+  // Forgets an operation that was registered but could not be started.
+  void Discard(uint64_t id);
+  // Stores the result of an operation and signals the eventfd. The output is
+  // only kept if 'result' is CKR_OK.
+  void Complete(uint64_t id, CK_RV result, const std::string& data_out);
+
+  // Moves the ids of up to 'max_count' operations that completed since they
+  // were last taken to 'ids'. The eventfd stays readable while more remain.
+  void TakeCompleted(size_t max_count, std::vector<uint64_t>* ids);
+  // Returns the result of an operation and copies its output following the
+  // output buffer convention of PKCS #11 section 11.2. The operation is
+  // forgotten unless it is pending, 'data_out' is NULL or too small.
+  CK_RV Collect(uint64_t id, CK_BYTE_PTR data_out, CK_ULONG_PTR data_length);
+
+ private:
+  struct Operation {
+    Operation() : is_complete(false), result(CKR_OK) {}
+    bool is_complete;
+    CK_RV result;
+    std::string data_out;
+  };
+
+  CompletionQueue();
+  // Writes to the eventfd. lock_ must be held.
+  void Signal();
+
+  // Fork handlers. Operations in flight belong to the parent, and the child
+  // must not share the parent's eventfd.
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+
+  boost::mutex lock_;
+  int event_fd_;
+  uint64_t next_id_;
+  std::map<uint64_t, Operation> operations_;
+  // Completed operations not taken yet, oldest first.
+  std::deque<uint64_t> completed_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompletionQueue);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_COMPLETION_QUEUE_H_
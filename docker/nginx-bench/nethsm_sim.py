@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+# A NetHSM on the network for the handshake benchmark: it serves the key
+# listing, the keys and their certificates, and the PKCS #1 and ECDSA sign and
+# PKCS #1 decrypt actions the way p11net requests them, so the benchmark also
+# measures p11net's HTTP clients, connection pools and JSON handling. Each key
+# action waits a log-normal latency first, like P11NET_BACKEND=sim does.
+# Sample usage:
+#    nethsm_sim.py --port 8080 --latency-us 2000 \
+#      --key sim-0=/bench/sim-key.pem,/bench/sim-cert.pem
+#
+# It speaks clear-text HTTP/1.1 and ignores the credentials.
+
+import argparse
+import base64
+import http.server
+import json
+import math
+import random
+import socketserver
+import sys
+import time
+
+from cryptography.hazmat.backends import default_backend
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric import ec, rsa, utils
+
+API_PATH = '/api/v0/keys'
+
+# The NetHSM key types of the curves p11net knows.
+EC_KEY_TYPES = {
+    'secp256r1': 'EC_P256',
+    'secp384r1': 'EC_P384',
+    'secp521r1': 'EC_P521',
+}
+
+# The hashes ECDSA digests are taken for, by their size.
+DIGESTS = {
+    32: hashes.SHA256(),
+    48: hashes.SHA384(),
+    64: hashes.SHA512(),
+}
+
+
+def b64(data):
+    return base64.urlsafe_b64encode(data).decode('ascii')
+
+
+def unb64(text):
+    return base64.urlsafe_b64decode(text + '=' * (-len(text) % 4))
+
+
+def int_bytes(value, size=None):
+    if size is None:
+        size = (value.bit_length() + 7) // 8
+    return value.to_bytes(size, 'big')
+
+
+class Key(object):
+    def __init__(self, key_id, key_file, cert_file):
+        with open(key_file, 'rb') as f:
+            self.private = serialization.load_pem_private_key(
+                f.read(), None, default_backend())
+        self.cert = None
+        if cert_file:
+            with open(cert_file, 'rb') as f:
+                self.cert = f.read()
+        self.key_id = key_id
+        public = self.private.public_key().public_numbers()
+        if isinstance(self.private, rsa.RSAPrivateKey):
+            self.type = 'RSA'
+            self.purpose = 'sign,encrypt'
+            self.public = {'modulus': b64(int_bytes(public.n)),
+                           'publicExponent': b64(int_bytes(public.e))}
+            # The padding is done here rather than by the library, which only
+            # signs what it hashed itself.
+            numbers = self.private.private_numbers()
+            self.p, self.q = numbers.p, numbers.q
+            self.dp, self.dq, self.qinv = (numbers.dmp1, numbers.dmq1,
+                                           numbers.iqmp)
+            self.size = (public.n.bit_length() + 7) // 8
+        elif isinstance(self.private, ec.EllipticCurvePrivateKey):
+            self.type = EC_KEY_TYPES[self.private.curve.name]
+            self.purpose = 'sign'
+            size = (self.private.curve.key_size + 7) // 8
+            point = b'\x04' + int_bytes(public.x, size) + int_bytes(public.y,
+                                                                   size)
+            self.public = {'data': b64(point)}
+        else:
+            raise ValueError('unsupported key in ' + key_file)
+
+    def describe(self):
+        return {'data': {'id': self.key_id, 'type': self.type,
+                         'purpose': self.purpose, 'publicKey': self.public}}
+
+    def rsa_private(self, value):
+        # Chinese remaindering, as the NetHSM does.
+        m1 = pow(value, self.dp, self.p)
+        m2 = pow(value, self.dq, self.q)
+        h = (self.qinv * (m1 - m2)) % self.p
+        return int_bytes(m2 + h * self.q, self.size)
+
+    def pkcs1_sign(self, message):
+        if self.type != 'RSA' or len(message) > self.size - 11:
+            return None
+        padded = (b'\x00\x01' + b'\xff' * (self.size - len(message) - 3) +
+                  b'\x00' + message)
+        return self.rsa_private(int.from_bytes(padded, 'big'))
+
+    def pkcs1_decrypt(self, encrypted):
+        if self.type != 'RSA' or len(encrypted) != self.size:
+            return None
+        padded = self.rsa_private(int.from_bytes(encrypted, 'big'))
+        end = padded.find(b'\x00', 2)
+        if padded[:2] != b'\x00\x02' or end < 10:
+            return None
+        return padded[end + 1:]
+
+    def ecdsa_sign(self, digest):
+        if self.type == 'RSA' or len(digest) not in DIGESTS:
+            return None
+        # A DER-encoded ECDSA-Sig-Value, like the NetHSM returns.
+        return self.private.sign(
+            digest, ec.ECDSA(utils.Prehashed(DIGESTS[len(digest)])))
+
+
+# The key actions: the path below the key, the input and output fields and
+# the operation.
+ACTIONS = {
+    '/actions/pkcs1/sign': ('message', 'signedMessage', Key.pkcs1_sign),
+    '/actions/pkcs1/decrypt': ('encrypted', 'decrypted', Key.pkcs1_decrypt),
+    '/actions/ecdsa/sign': ('message', 'signedMessage', Key.ecdsa_sign),
+}
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    # Connections persist, like the NetHSM's.
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status, body=b'', content_type='application/json'):
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def reply_json(self, document):
+        self.reply(200, json.dumps(document).encode('utf-8'))
+
+    # Returns the key 'path' is below, if any, and the rest of the path.
+    def find_key(self, path):
+        if not path.startswith(API_PATH + '/'):
+            return None, ''
+        key_id, _, rest = path[len(API_PATH) + 1:].partition('/')
+        return self.server.keys.get(key_id), '/' + rest if rest else ''
+
+    def do_GET(self):
+        path = self.path.split('?')[0]
+        if path == API_PATH:
+            self.reply_json({'data': [
+                {'location': API_PATH + '/' + key_id}
+                for key_id in sorted(self.server.keys)]})
+            return
+        key, rest = self.find_key(path)
+        if key and not rest:
+            self.reply_json(key.describe())
+        elif key and rest == '/cert' and key.cert:
+            self.reply(200, key.cert, 'application/x-pem-file')
+        else:
+            self.reply(404)
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        key, rest = self.find_key(self.path.split('?')[0])
+        if not key or rest not in ACTIONS:
+            self.reply(404)
+            return
+        input_field, output_field, operation = ACTIONS[rest]
+        try:
+            output = operation(key, unb64(json.loads(
+                body.decode('utf-8'))[input_field]))
+        except (ValueError, KeyError, TypeError):
+            output = None
+        if output is None:
+            self.reply(400)
+            return
+        self.server.wait()
+        self.reply_json({'data': {output_field: b64(output)}})
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024
+
+    def __init__(self, address, keys, latency_us, latency_sigma):
+        http.server.HTTPServer.__init__(self, address, Handler)
+        self.keys = keys
+        self.latency_us = latency_us
+        self.latency_sigma = latency_sigma
+
+    def wait(self):
+        latency = self.latency_us
+        if latency > 0 and self.latency_sigma > 0:
+            latency = random.lognormvariate(math.log(latency),
+                                            self.latency_sigma)
+        if latency > 0:
+            time.sleep(latency / 1e6)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--address', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--key', action='append', required=True,
+                        metavar='ID=KEY_PEM[,CERT_PEM]')
+    parser.add_argument('--latency-us', type=int, default=0,
+                        help='the median latency of a key action')
+    parser.add_argument('--latency-sigma', type=int, default=0,
+                        help='the spread of the latency, in percent')
+    args = parser.parse_args()
+    keys = {}
+    for spec in args.key:
+        key_id, _, files = spec.partition('=')
+        key_file, _, cert_file = files.partition(',')
+        keys[key_id] = Key(key_id, key_file, cert_file)
+    server = Server((args.address, args.port), keys, args.latency_us,
+                    args.latency_sigma / 100.0)
+    sys.stderr.write('Simulating a NetHSM with %d keys on %s:%d\n' %
+                     (len(keys), args.address, args.port))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
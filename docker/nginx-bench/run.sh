@@ -0,0 +1,129 @@
+#!/bin/bash
+# Runs nginx with its TLS key in p11net against a simulated or real NetHSM,
+# drives full handshakes at it with wrk and reports the handshake rate, the
+# latency percentiles and the CPU and memory of every nginx worker.
+#
+# Without P11NET_URL the module talks to nethsm_sim.py, a NetHSM simulated on
+# the network with a key generated here, so every handshake goes through the
+# HTTP client of the module; P11NET_SIM_LATENCY_US and P11NET_SIM_LATENCY_SIGMA
+# shape the latency of its key actions. P11NET_BACKEND=sim simulates the
+# NetHSM inside the module instead, which leaves the network out. With
+# P11NET_URL, P11NET_USER and P11NET_PASSWORD it uses that NetHSM; then
+# BENCH_KEY names the key and BENCH_CERT a certificate for it, e.g. mounted
+# with -v. Sample usage:
+#    docker run --rm -e BENCH_WORKERS=4 -e P11NET_SIM_LATENCY_US=5000 \
+#      p11net-nginx-bench
+#
+# Settings:
+#    BENCH_WORKERS     - nginx worker processes (default: the number of CPUs).
+#    BENCH_CONNECTIONS - concurrent client connections (default: 64).
+#    BENCH_THREADS     - wrk threads (default: 4).
+#    BENCH_DURATION    - seconds to measure (default: 30).
+#    BENCH_WARMUP      - seconds of load before measuring (default: 5).
+#    BENCH_KEY         - the identifier of the key (default: sim-0).
+#    BENCH_CERT        - the certificate of the key (generated for sim keys).
+#    BENCH_SIM_PORT    - the port of the simulated NetHSM (default: 8080).
+
+set -e
+
+WORKERS=${BENCH_WORKERS:-$(nproc)}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+THREADS=${BENCH_THREADS:-4}
+DURATION=${BENCH_DURATION:-30}
+WARMUP=${BENCH_WARMUP:-5}
+KEY=${BENCH_KEY:-sim-0}
+CERT=${BENCH_CERT:-}
+SIM_PORT=${BENCH_SIM_PORT:-8080}
+URL=https://127.0.0.1/
+
+export OPENSSL_CONF=/bench/openssl.cnf
+
+if [ -z "$P11NET_URL" ]; then
+  export P11NET_SIM_KEYS=${P11NET_SIM_KEYS:-1}
+  if [ -z "$P11NET_SIM_KEY_FILE" ]; then
+    export P11NET_SIM_KEY_FILE=/bench/sim-key.pem
+    openssl genrsa -out "$P11NET_SIM_KEY_FILE" 2048 2>/dev/null
+  fi
+  if [ -z "$CERT" ]; then
+    CERT=/bench/sim-cert.pem
+    openssl req -new -x509 -days 1 -subj /CN=localhost \
+      -key "$P11NET_SIM_KEY_FILE" -out "$CERT"
+  fi
+fi
+if [ -z "$P11NET_URL" ] && [ "$P11NET_BACKEND" != sim ]; then
+  SIM_KEYS=()
+  for i in $(seq 0 $((P11NET_SIM_KEYS - 1))); do
+    SIM_KEYS+=(--key "sim-$i=$P11NET_SIM_KEY_FILE,$CERT")
+  done
+  python3 /bench/nethsm_sim.py --port "$SIM_PORT" "${SIM_KEYS[@]}" \
+    --latency-us "${P11NET_SIM_LATENCY_US:-2000}" \
+    --latency-sigma "${P11NET_SIM_LATENCY_SIGMA:-25}" &
+  SIM_PID=$!
+  export P11NET_URL=http://127.0.0.1:$SIM_PORT
+  export P11NET_USER=${P11NET_USER:-bench}
+  export P11NET_PASSWORD=${P11NET_PASSWORD:-bench}
+  for i in $(seq 50); do
+    curl -sf "$P11NET_URL/api/v0/keys" > /dev/null && break
+    sleep 0.2
+  done
+elif [ -n "$P11NET_URL" ] && [ -z "$CERT" ]; then
+  echo "BENCH_CERT must name the certificate of $KEY." >&2
+  exit 2
+fi
+
+sed -e "s|@WORKERS@|$WORKERS|" -e "s|@CERT@|$CERT|" -e "s|@KEY@|$KEY|" \
+  /bench/nginx.conf > /etc/nginx/nginx.conf
+nginx
+trap 'nginx -s quit; [ -n "$SIM_PID" ] && kill "$SIM_PID"' EXIT
+
+# Wait for the workers to complete a handshake.
+for i in $(seq 50); do
+  openssl s_client -connect 127.0.0.1:443 < /dev/null > /dev/null 2>&1 && break
+  sleep 0.2
+done
+WORKER_PIDS=$(pgrep -f "nginx: worker process")
+if [ -z "$WORKER_PIDS" ]; then
+  echo "nginx did not start:" >&2
+  cat /var/log/nginx/error.log >&2
+  exit 1
+fi
+
+# Prints the user plus system CPU ticks of a process.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Prints a field of /proc/<pid>/status in kB.
+status_kb() {
+  awk -v field="$2:" '$1 == field { print $2 }' "/proc/$1/status"
+}
+
+if [ "$WARMUP" -gt 0 ]; then
+  wrk -t"$THREADS" -c"$CONNECTIONS" -d"${WARMUP}s" \
+    -H "Connection: close" "$URL" > /dev/null
+fi
+
+declare -A START_TICKS
+for pid in $WORKER_PIDS; do
+  START_TICKS[$pid]=$(cpu_ticks "$pid")
+done
+
+echo "== $WORKERS workers, $CONNECTIONS connections, ${DURATION}s, key $KEY"
+# "Connection: close" makes every request a new connection, and nginx
+# resumes no sessions, so each request costs one full handshake.
+wrk -t"$THREADS" -c"$CONNECTIONS" -d"${DURATION}s" --latency \
+  -H "Connection: close" "$URL" | tee /bench/wrk.out
+
+RATE=$(awk '/^Requests\/sec:/ { print $2 }' /bench/wrk.out)
+echo
+echo "Full handshakes/sec: $RATE"
+echo
+TICK=$(getconf CLK_TCK)
+printf "%-8s %8s %10s %10s\n" worker "cpu %" "rss kB" "peak kB"
+for pid in $WORKER_PIDS; do
+  ticks=$(( $(cpu_ticks "$pid") - ${START_TICKS[$pid]} ))
+  cpu=$(awk -v t="$ticks" -v hz="$TICK" -v d="$DURATION" \
+    'BEGIN { printf "%.1f", 100 * t / hz / d }')
+  printf "%-8s %8s %10s %10s\n" "$pid" "$cpu" \
+    "$(status_kb "$pid" VmRSS)" "$(status_kb "$pid" VmHWM)"
+done
@@ -0,0 +1,124 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "entropy_pool.h"
+
+#include <algorithm>
+
+#include <boost/thread/lock_guard.hpp>
+
+#include <base/logging.h>
+
+namespace p11net {
+
+EntropyPool::EntropyPool(size_t capacity,
+                         size_t low_water,
+                         size_t chunk_size,
+                         const Source& source)
+    : buffer_(capacity > 0 ? capacity : 1),
+      low_water_(std::min(low_water, buffer_.size())),
+      chunk_size_(chunk_size > 0 ? chunk_size : 1),
+      source_(source),
+      head_(0),
+      tail_(0),
+      refilling_(false),
+      stopping_(false) {}
+
+EntropyPool::~EntropyPool() {
+  stopping_ = true;
+  boost::unique_lock<boost::mutex> lock(refill_lock_);
+  refill_done_.wait(lock, [this] { return !refilling_; });
+}
+
+bool EntropyPool::Take(size_t num_bytes, std::string* random_data) {
+  if (num_bytes > buffer_.size()) {
+    Refill();
+    return false;
+  }
+  const size_t capacity = buffer_.size();
+  uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t tail = 0;
+  do {
+    tail = tail_.load(std::memory_order_acquire);
+    if (tail - head < num_bytes) {
+      Refill();
+      return false;
+    }
+    // Copy before claiming: if the refill overwrote these bytes, another
+    // reader has advanced head_ past them and the claim below fails.
+    random_data->resize(num_bytes);
+    const size_t start = head % capacity;
+    const size_t first = std::min(num_bytes, capacity - start);
+    std::copy(buffer_.begin() + start, buffer_.begin() + start + first,
+              random_data->begin());
+    std::copy(buffer_.begin(), buffer_.begin() + (num_bytes - first),
+              random_data->begin() + first);
+  } while (!head_.compare_exchange_weak(head, head + num_bytes,
+                                        std::memory_order_acq_rel));
+  if (tail - (head + num_bytes) < low_water_)
+    Refill();
+  return true;
+}
+
+void EntropyPool::Refill() {
+  if (stopping_ || GetFreeSpace() < chunk_size_)
+    return;
+  bool expected = false;
+  if (!refilling_.compare_exchange_strong(expected, true))
+    return;
+  RequestChunk();
+}
+
+void EntropyPool::RequestChunk() {
+  pplx::task<boost::optional<std::string>> chunk;
+  try {
+    chunk = source_(chunk_size_);
+  }
+  catch (std::exception& e) {
+    LOG(WARNING) << "Failed to request random data: " << e.what();
+    FinishRefill();
+    return;
+  }
+  chunk.then([this](pplx::task<boost::optional<std::string>> completed) {
+    boost::optional<std::string> data;
+    try {
+      data = completed.get();
+    }
+    catch (std::exception& e) {
+      LOG(WARNING) << "Failed to request random data: " << e.what();
+    }
+    if (!data || data->empty() || Store(*data) == 0 || stopping_ ||
+        GetFreeSpace() < chunk_size_) {
+      FinishRefill();
+      return;
+    }
+    RequestChunk();
+  });
+}
+
+size_t EntropyPool::Store(const std::string& data) {
+  const size_t capacity = buffer_.size();
+  const uint64_t tail = tail_.load(std::memory_order_relaxed);
+  const size_t count = std::min(data.size(), GetFreeSpace());
+  for (size_t i = 0; i < count; ++i)
+    buffer_[(tail + i) % capacity] = data[i];
+  tail_.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+size_t EntropyPool::GetFreeSpace() const {
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  const uint64_t tail = tail_.load(std::memory_order_acquire);
+  return buffer_.size() - static_cast<size_t>(tail - head);
+}
+
+void EntropyPool::FinishRefill() {
+  // The destructor may return as soon as refilling_ is clear, so the
+  // condition variable is signaled before the lock is given up.
+  boost::lock_guard<boost::mutex> lock(refill_lock_);
+  refilling_ = false;
+  refill_done_.notify_all();
+}
+
+}  // namespace p11net
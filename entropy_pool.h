@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_ENTROPY_POOL_H_
+#define P11NET_ENTROPY_POOL_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <pplx/pplxtasks.h>
+#include <base/macros.h>
+
+namespace p11net {
+
+// EntropyPool buffers random bytes obtained from a slow source, such as the
+// NetHSM random endpoint, so that callers are served from memory. Bytes are
+// kept in a ring buffer that readers consume without taking a lock. Whenever
+// the buffer falls below its low-water mark, chunks are requested from the
+// source in the background until the buffer is full again. Sample usage:
+//    EntropyPool pool(65536, 16384, 1024, source);
+//    pool.Refill();
+//    std::string bytes;
+//    if (!pool.Take(32, &bytes)) {
+//      // The pool has drained; use another source.
+//    }
+class EntropyPool {
+ public:
+  // Requests the given number of random bytes. The task yields an empty
+  // result if the source failed; it may yield fewer bytes than requested.
+  typedef std::function<pplx::task<boost::optional<std::string>>(size_t)>
+      Source;
+
+  //  capacity - The size of the ring buffer in bytes.
+  //  low_water - A refill starts when fewer bytes than this are buffered.
+  //  chunk_size - The number of bytes requested from 'source' at a time.
+  EntropyPool(size_t capacity,
+              size_t low_water,
+              size_t chunk_size,
+              const Source& source);
+  // Waits for an outstanding refill to finish.
+  virtual ~EntropyPool();
+
+  // Moves 'num_bytes' bytes out of the pool into 'random_data'. Returns false,
+  // and leaves the pool untouched, if fewer bytes are buffered.
+  bool Take(size_t num_bytes, std::string* random_data);
+
+  // Starts filling the pool in the background unless a refill is already
+  // running or the pool is full.
+  void Refill();
+
+ private:
+  // Requests the next chunk from the source and keeps doing so until the pool
+  // is full or the source fails. Only the thread that owns the refill calls
+  // this.
+  void RequestChunk();
+  // Appends 'data' to the ring buffer, up to the free space. Only the thread
+  // that owns the refill calls this. Returns the number of bytes stored.
+  size_t Store(const std::string& data);
+  // Returns the number of bytes that can be stored right now.
+  size_t GetFreeSpace() const;
+  void FinishRefill();
+
+  std::vector<char> buffer_;
+  size_t low_water_;
+  size_t chunk_size_;
+  Source source_;
+  // Monotonic read and write positions; the buffered bytes are those between
+  // head_ and tail_, modulo the capacity. Readers advance head_ with a
+  // compare-and-swap, the single refill advances tail_.
+  std::atomic<uint64_t> head_;
+  std::atomic<uint64_t> tail_;
+  std::atomic<bool> refilling_;
+  std::atomic<bool> stopping_;
+  boost::mutex refill_lock_;
+  boost::condition_variable refill_done_;
+
+  DISALLOW_COPY_AND_ASSIGN(EntropyPool);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_ENTROPY_POOL_H_
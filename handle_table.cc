@@ -0,0 +1,54 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "handle_table.h"
+
+#include <base/logging.h>
+
+namespace p11net {
+
+HandleTable::HandleTable() : num_pages_(0) {}
+
+HandleTable::~HandleTable() {}
+
+void HandleTable::Insert(int handle, std::shared_ptr<const Object> object) {
+  CHECK_GE(handle, 0);
+  CHECK(object);
+  const size_t page = static_cast<size_t>(handle) >> kPageBits;
+  if (page >= pages_.size())
+    pages_.resize(page + 1);
+  if (!pages_[page]) {
+    pages_[page].reset(new Page());
+    ++num_pages_;
+  }
+  std::shared_ptr<const Object>& entry =
+      pages_[page]->objects[handle & kPageMask];
+  if (!entry)
+    ++pages_[page]->count;
+  entry = std::move(object);
+}
+
+void HandleTable::Erase(int handle) {
+  if (handle < 0)
+    return;
+  const size_t page = static_cast<size_t>(handle) >> kPageBits;
+  if (page >= pages_.size() || !pages_[page])
+    return;
+  std::shared_ptr<const Object>& entry =
+      pages_[page]->objects[handle & kPageMask];
+  if (!entry)
+    return;
+  entry.reset();
+  if (--pages_[page]->count == 0) {
+    pages_[page].reset();
+    --num_pages_;
+  }
+}
+
+void HandleTable::Clear() {
+  pages_.clear();
+  num_pages_ = 0;
+}
+
+}  // namespace p11net
@@ -0,0 +1,84 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_HANDLE_TABLE_H_
+#define P11NET_HANDLE_TABLE_H_
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace p11net {
+
+class Object;
+
+// HandleTable maps object handles to the objects they refer to. Handles come
+// from a sequential HandleGenerator, so they are small and dense; the table
+// is an array of fixed-size pages indexed by handle, and a lookup is two
+// loads instead of a tree walk. Pages are allocated on first use and freed
+// once they hold no object, so the memory held tracks the live handles. The
+// table owns its objects. It is not thread-safe.
+class HandleTable {
+ public:
+  HandleTable();
+  virtual ~HandleTable();
+
+  // Returns the object with the given handle, or NULL if there is none.
+  const Object* Find(int handle) const {
+    const std::shared_ptr<const Object>* entry = FindEntry(handle);
+    return entry ? entry->get() : NULL;
+  }
+  // As above, sharing ownership of the object so that it outlives its
+  // removal from the table.
+  std::shared_ptr<const Object> FindShared(int handle) const {
+    const std::shared_ptr<const Object>* entry = FindEntry(handle);
+    return entry ? *entry : std::shared_ptr<const Object>();
+  }
+
+  // Adds 'object', which must not be NULL, under 'handle', replacing any
+  // object already there.
+  void Insert(int handle, std::shared_ptr<const Object> object);
+  // Removes and releases the object with the given handle, if any.
+  void Erase(int handle);
+  // Removes and releases all objects.
+  void Clear();
+
+  // Returns the bytes held by the table, not counting the objects.
+  size_t GetMemoryUsage() const {
+    return pages_.capacity() * sizeof(pages_[0]) + num_pages_ * sizeof(Page);
+  }
+
+ private:
+  static const size_t kPageBits = 10;
+  static const size_t kPageSize = 1 << kPageBits;
+  static const size_t kPageMask = kPageSize - 1;
+
+  struct Page {
+    Page() : count(0) {}
+    std::array<std::shared_ptr<const Object>, kPageSize> objects;
+    // The number of non-NULL entries in 'objects'.
+    size_t count;
+  };
+
+  const std::shared_ptr<const Object>* FindEntry(int handle) const {
+    if (handle < 0)
+      return NULL;
+    const size_t page = static_cast<size_t>(handle) >> kPageBits;
+    if (page >= pages_.size() || !pages_[page])
+      return NULL;
+    return &pages_[page]->objects[handle & kPageMask];
+  }
+
+  std::vector<std::unique_ptr<Page>> pages_;
+  // The number of allocated pages.
+  size_t num_pages_;
+
+  DISALLOW_COPY_AND_ASSIGN(HandleTable);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_HANDLE_TABLE_H_
@@ -0,0 +1,222 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "host_resolver.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <boost/chrono.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "metrics.h"
+
+namespace p11net {
+
+namespace {
+
+// Records are looked up again no sooner than this, however short their TTL,
+// and failed lookups are retried this often.
+const int kMinTtlSeconds = 5;
+// The largest DNS answer read; NetHSM hosts have a few addresses at most.
+const int kMaxAnswerSize = 4096;
+
+// Returns the smallest TTL of the A and AAAA records of 'host', CNAMEs on
+// the way included, or -1 if the DNS does not know the host, e.g. because
+// it comes from /etc/hosts.
+int LookupTtl(const std::string& host) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  if (res_ninit(&state) != 0)
+    return -1;
+  int ttl = -1;
+  const int types[] = {ns_t_a, ns_t_aaaa};
+  for (size_t i = 0; i < arraysize(types); ++i) {
+    unsigned char answer[kMaxAnswerSize];
+    const int length = res_nsearch(&state, host.c_str(), ns_c_in, types[i],
+                                   answer, sizeof(answer));
+    ns_msg message;
+    if (length < 0 || ns_initparse(answer, length, &message) < 0)
+      continue;
+    for (int j = 0; j < ns_msg_count(message, ns_s_an); ++j) {
+      ns_rr record;
+      if (ns_parserr(&message, ns_s_an, j, &record) < 0)
+        break;
+      const int record_ttl = static_cast<int>(ns_rr_ttl(record));
+      if (ttl < 0 || record_ttl < ttl)
+        ttl = record_ttl;
+    }
+  }
+  res_nclose(&state);
+  return ttl;
+}
+
+}  // namespace
+
+HostResolver::HostResolver(const std::string& host,
+                           int port,
+                           std::chrono::seconds max_ttl)
+    : host_(host),
+      port_(port),
+      max_ttl_(std::max(max_ttl, std::chrono::seconds(kMinTtlSeconds))),
+      generation_(0),
+      stopping_(false),
+      lookups_(Metrics::Get()->GetCounter(
+          "p11net_dns_lookups_total",
+          "host=\"" + host + "\",result=\"ok\"")),
+      failed_lookups_(Metrics::Get()->GetCounter(
+          "p11net_dns_lookups_total",
+          "host=\"" + host + "\",result=\"failed\"")) {}
+
+HostResolver::~HostResolver() {
+  {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  wakeup_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+bool HostResolver::Start() {
+  if (thread_.joinable())
+    return true;
+  const std::chrono::seconds ttl = Resolve();
+  thread_ = boost::thread(&HostResolver::RefreshLoop, this, ttl);
+  return ttl != std::chrono::seconds::zero();
+}
+
+std::shared_ptr<const HostResolver::Addresses> HostResolver::addresses()
+    const {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  return addresses_;
+}
+
+uint64_t HostResolver::generation() const {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  return generation_;
+}
+
+// static
+bool HostResolver::ParseUrl(const std::string& url,
+                            std::string* host,
+                            int* port) {
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == std::string::npos)
+    return false;
+  const size_t begin = scheme_end + 3;
+  std::string authority =
+      url.substr(begin, url.find_first_of("/?#", begin) - begin);
+  const size_t at = authority.rfind('@');
+  if (at != std::string::npos)
+    authority.erase(0, at + 1);
+  // Bracketed IPv6 addresses need no resolving.
+  if (authority.empty() || authority[0] == '[')
+    return false;
+  int parsed_port = url.compare(0, scheme_end, "https") == 0 ? 443 : 80;
+  const size_t colon = authority.rfind(':');
+  if (colon != std::string::npos) {
+    char* end = NULL;
+    const long value = strtol(authority.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 65535)
+      return false;
+    parsed_port = static_cast<int>(value);
+    authority.resize(colon);
+  }
+  struct in_addr address;
+  if (authority.empty() ||
+      inet_pton(AF_INET, authority.c_str(), &address) == 1)
+    return false;
+  *host = authority;
+  *port = parsed_port;
+  return true;
+}
+
+std::chrono::seconds HostResolver::Resolve() {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  struct addrinfo* result = NULL;
+  const int error = getaddrinfo(host_.c_str(), std::to_string(port_).c_str(),
+                                &hints, &result);
+  std::shared_ptr<Addresses> addresses(new Addresses());
+  for (struct addrinfo* i = result; error == 0 && i; i = i->ai_next) {
+    char buffer[INET6_ADDRSTRLEN];
+    std::string address;
+    if (i->ai_family == AF_INET6) {
+      const struct sockaddr_in6* in6 =
+          reinterpret_cast<const struct sockaddr_in6*>(i->ai_addr);
+      if (!inet_ntop(AF_INET6, &in6->sin6_addr, buffer, sizeof(buffer)))
+        continue;
+      address.append("[").append(buffer).append("]");
+    } else if (i->ai_family == AF_INET) {
+      const struct sockaddr_in* in =
+          reinterpret_cast<const struct sockaddr_in*>(i->ai_addr);
+      if (!inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer)))
+        continue;
+      address = buffer;
+    } else {
+      continue;
+    }
+    if (std::find(addresses->begin(), addresses->end(), address) ==
+        addresses->end())
+      addresses->push_back(address);
+  }
+  if (result)
+    freeaddrinfo(result);
+  if (addresses->empty()) {
+    failed_lookups_->Increment();
+    LOG(WARNING) << "Failed to resolve " << host_ << ": "
+                 << (error ? gai_strerror(error) : "no addresses")
+                 << "; keeping the previous addresses";
+    return std::chrono::seconds::zero();
+  }
+  lookups_->Increment();
+  const int record_ttl = LookupTtl(host_);
+  std::chrono::seconds ttl = max_ttl_;
+  if (record_ttl >= 0)
+    ttl = std::min(ttl, std::chrono::seconds(record_ttl));
+  ttl = std::max(ttl, std::chrono::seconds(kMinTtlSeconds));
+  boost::lock_guard<boost::mutex> lock(lock_);
+  if (!addresses_ || *addresses_ != *addresses) {
+    std::string joined;
+    for (auto i = addresses->begin(); i != addresses->end(); ++i)
+      joined.append(joined.empty() ? "" : ", ").append(*i);
+    LOG(INFO) << host_ << " resolves to " << joined << " for "
+              << ttl.count() << "s";
+    addresses_ = addresses;
+    ++generation_;
+  }
+  return ttl;
+}
+
+void HostResolver::RefreshLoop(std::chrono::seconds ttl) {
+  boost::unique_lock<boost::mutex> lock(lock_);
+  while (!stopping_) {
+    const std::chrono::seconds wait =
+        ttl == std::chrono::seconds::zero()
+            ? std::chrono::seconds(kMinTtlSeconds)
+            : ttl;
+    wakeup_.wait_for(lock, boost::chrono::seconds(wait.count()),
+                     [this] { return stopping_; });
+    if (stopping_)
+      break;
+    lock.unlock();
+    ttl = Resolve();
+    lock.lock();
+  }
+}
+
+}  // namespace p11net
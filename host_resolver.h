@@ -0,0 +1,86 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_HOST_RESOLVER_H_
+#define P11NET_HOST_RESOLVER_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace p11net {
+
+class Counter;
+
+// HostResolver keeps the addresses of one host resolved ahead of the
+// connections that need them. A thread of its own looks the host up again
+// when the DNS records of the last lookup expire, capped at 'max_ttl', and
+// keeps the previous addresses while lookups fail, so that a reconnect after
+// a failover never waits for DNS nor fails because the resolver is briefly
+// down. Sample usage:
+//    HostResolver resolver("nethsm.example.com", 8443,
+//                          std::chrono::seconds(300));
+//    resolver.Start();
+//    std::shared_ptr<const HostResolver::Addresses> addresses =
+//        resolver.addresses();
+class HostResolver {
+ public:
+  // Numeric addresses in the order getaddrinfo prefers them, IPv6 ones in
+  // brackets.
+  typedef std::vector<std::string> Addresses;
+
+  HostResolver(const std::string& host,
+               int port,
+               std::chrono::seconds max_ttl);
+  virtual ~HostResolver();
+
+  // Looks the host up once and starts the thread that keeps the addresses
+  // fresh. Returns false if the first lookup failed; the thread retries it.
+  bool Start();
+
+  // Returns the addresses of the last successful lookup, or NULL if there
+  // was none yet.
+  std::shared_ptr<const Addresses> addresses() const;
+  // Changes whenever the addresses do.
+  uint64_t generation() const;
+
+  const std::string& host() const { return host_; }
+  int port() const { return port_; }
+
+  // Parses the host and port of 'url'. Returns false if the host is a
+  // numeric address, which needs no resolving, or 'url' has no host.
+  static bool ParseUrl(const std::string& url, std::string* host, int* port);
+
+ private:
+  // Looks the host up and stores the addresses if it succeeds. Returns how
+  // long they stay valid, or zero if the lookup failed.
+  std::chrono::seconds Resolve();
+  void RefreshLoop(std::chrono::seconds ttl);
+
+  const std::string host_;
+  const int port_;
+  const std::chrono::seconds max_ttl_;
+  mutable boost::mutex lock_;
+  std::shared_ptr<const Addresses> addresses_;
+  uint64_t generation_;
+  bool stopping_;
+  boost::condition_variable wakeup_;
+  boost::thread thread_;
+  Counter* lookups_;
+  Counter* failed_lookups_;
+
+  DISALLOW_COPY_AND_ASSIGN(HostResolver);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_HOST_RESOLVER_H_
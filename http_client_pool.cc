@@ -0,0 +1,72 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "http_client_pool.h"
+
+#include <boost/thread/lock_guard.hpp>
+
+#include <base/logging.h>
+
+using web::http::client::http_client;
+using web::http::client::http_client_config;
+
+namespace p11net {
+
+HttpClientPool::HttpClientPool(const std::string& url,
+                               const http_client_config& config,
+                               size_t size)
+    : url_(url),
+      config_(config),
+      size_(size > 0 ? size : 1),
+      entries_(new Entry[size_]),
+      num_entries_(0) {}
+
+HttpClientPool::~HttpClientPool() {}
+
+std::shared_ptr<http_client> HttpClientPool::Acquire() {
+  // Prefer the first idle client so that recently used, warm clients are
+  // reused before cold ones.
+  size_t count = num_entries_.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; ++i) {
+    int idle = 0;
+    if (entries_[i].leases.compare_exchange_strong(idle, 1))
+      return Lease(i);
+  }
+  if (count < size_) {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    count = num_entries_.load(std::memory_order_relaxed);
+    if (count < size_) {
+      VLOG(1) << "Creating HTTP client " << count << " for " << url_;
+      entries_[count].client = std::make_shared<http_client>(url_, config_);
+      entries_[count].leases = 1;
+      num_entries_.store(count + 1, std::memory_order_release);
+      return Lease(count);
+    }
+  }
+  // Every client is busy; share the least busy one.
+  size_t index = 0;
+  for (size_t i = 1; i < count; ++i) {
+    if (entries_[i].leases.load(std::memory_order_relaxed) <
+        entries_[index].leases.load(std::memory_order_relaxed))
+      index = i;
+  }
+  ++entries_[index].leases;
+  return Lease(index);
+}
+
+std::shared_ptr<http_client> HttpClientPool::Lease(size_t index) {
+  // The lease returns the client to the pool once the last reference is
+  // dropped.
+  return std::shared_ptr<http_client>(
+      entries_[index].client.get(),
+      [this, index](http_client*) { Release(index); });
+}
+
+void HttpClientPool::Release(size_t index) {
+  CHECK_LT(index, num_entries_.load(std::memory_order_relaxed));
+  const int leases = entries_[index].leases--;
+  CHECK_GT(leases, 0);
+}
+
+}  // namespace p11net
@@ -0,0 +1,74 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_HTTP_CLIENT_POOL_H_
+#define P11NET_HTTP_CLIENT_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+#include <cpprest/http_client.h>
+#include <base/macros.h>
+
+namespace p11net {
+
+// HttpClientPool maintains a bounded set of HTTP clients for a single NetHSM
+// endpoint. Each client keeps its connections alive between requests, so a
+// request handed a client that has been used before runs on a warm connection
+// without a new TCP or TLS handshake. Clients are created lazily, up to the
+// configured size. Sample usage:
+//    HttpClientPool pool(url, config, 4);
+//    std::shared_ptr<web::http::client::http_client> client = pool.Acquire();
+//    client->request(web::http::methods::GET, path);
+// The client stays leased to the caller until the last copy of the returned
+// pointer is released. Leases should be held for the duration of a request,
+// including any asynchronous continuation that consumes the response, and
+// must not outlive the pool. Leasing and releasing a client does not take a
+// lock; only creating one does.
+class HttpClientPool {
+ public:
+  // 'size' is the maximum number of clients; a value of zero is treated as 1.
+  HttpClientPool(const std::string& url,
+                 const web::http::client::http_client_config& config,
+                 size_t size);
+  virtual ~HttpClientPool();
+
+  // Leases the least busy client. If every client is busy and the pool is not
+  // full, a new client is created. Otherwise a busy client is shared; clients
+  // are thread-safe and queue requests on their own connections.
+  std::shared_ptr<web::http::client::http_client> Acquire();
+
+  // Returns the endpoint URL of this pool.
+  const std::string& url() const { return url_; }
+
+ private:
+  struct Entry {
+    Entry() : leases(0) {}
+    // Set once, before the entry is published through num_entries_.
+    std::shared_ptr<web::http::client::http_client> client;
+    // The number of outstanding leases of this client.
+    std::atomic<int> leases;
+  };
+
+  // Returns a lease of 'index', for which the caller has counted a lease.
+  std::shared_ptr<web::http::client::http_client> Lease(size_t index);
+  void Release(size_t index);
+
+  std::string url_;
+  web::http::client::http_client_config config_;
+  size_t size_;
+  // An array of size_ entries, of which the first num_entries_ hold a client.
+  std::unique_ptr<Entry[]> entries_;
+  std::atomic<size_t> num_entries_;
+  // Serializes the creation of clients.
+  boost::mutex lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpClientPool);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_HTTP_CLIENT_POOL_H_
@@ -0,0 +1,409 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "http_transport.h"
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "host_resolver.h"
+
+#ifndef NO_HTTP2
+#include <curl/curl.h>
+#endif
+
+namespace p11net {
+
+pplx::task<HttpTransport::Response> HttpTransport::Post(
+    const std::string& path,
+    const std::string& body,
+    const Headers& headers) {
+  pplx::task_completion_event<Response> done;
+  Post(path, body, headers, std::chrono::milliseconds::zero(),
+       [done](Response* response, const std::string& error) {
+         if (response)
+           done.set(std::move(*response));
+         else
+           done.set_exception(std::runtime_error(error));
+       });
+  return pplx::create_task(done);
+}
+
+#ifdef NO_HTTP2
+
+struct HttpTransport::State {};
+struct HttpTransport::Transfer {};
+
+HttpTransport::HttpTransport(const std::string& url,
+                             const std::string& user,
+                             const std::string& password,
+                             std::chrono::seconds timeout,
+                             size_t max_connections,
+                             Protocol protocol)
+    : url_(url),
+      user_(user),
+      password_(password),
+      timeout_(timeout),
+      max_connections_(max_connections),
+      protocol_(protocol),
+      resolver_(NULL) {}
+
+HttpTransport::~HttpTransport() {}
+
+void HttpTransport::Stop() {}
+
+bool HttpTransport::Init() {
+  LOG(WARNING) << "libcurl is not supported by this build; using cpprest.";
+  return false;
+}
+
+void HttpTransport::Post(const std::string& path,
+                         const std::string& body,
+                         const Headers& headers,
+                         std::chrono::milliseconds timeout,
+                         const Callback& callback) {
+  callback(NULL, "libcurl is not supported");
+}
+
+void HttpTransport::Run() {}
+
+void HttpTransport::Finish(Transfer* transfer, int result) {}
+
+#else  // NO_HTTP2
+
+namespace {
+
+// How long the transfer thread sleeps when nothing happens.
+const int kPollTimeoutMs = 1000;
+// The most finished transfers kept for reuse.
+const size_t kMaxIdleTransfers = 64;
+// How long a connection attempt to the preferred address family runs before
+// one to the other family races it. NetHSMs sit on the local network, where
+// an address that has not answered by then is unlikely to.
+const long kHappyEyeballsTimeoutMs = 100;
+
+size_t AppendBody(char* data, size_t size, size_t count, void* body) {
+  static_cast<std::string*>(body)->append(data, size * count);
+  return size * count;
+}
+
+// Calls 'callback' without letting anything it throws unwind the transfer
+// thread, which would take the process down and leave the transfer half
+// recycled.
+void RunCallback(const HttpTransport::Callback& callback,
+                 HttpTransport::Response* response,
+                 const std::string& error) {
+  try {
+    callback(response, error);
+  }
+  catch (std::exception& e) {
+    LOG(ERROR) << "Transfer callback failed: " << e.what();
+  }
+  catch (...) {
+    LOG(ERROR) << "Transfer callback failed";
+  }
+}
+
+}  // namespace
+
+struct HttpTransport::State {
+  State() : multi(NULL), stopping(false), resolved_generation(0) {}
+  CURLM* multi;
+  boost::mutex lock;
+  // Posted transfers the thread has not picked up yet.
+  std::vector<Transfer*> submitted;
+  // Finished transfers whose easy handles and buffers can be reused.
+  std::vector<Transfer*> idle;
+  bool stopping;
+  // The generation of the resolver's addresses last handed to libcurl.
+  uint64_t resolved_generation;
+  // Transfers added to the multi handle. Only the thread touches these.
+  std::set<Transfer*> active;
+  boost::thread thread;
+};
+
+struct HttpTransport::Transfer {
+  Transfer() : easy(NULL), headers(NULL), resolve(NULL) { error[0] = '\0'; }
+  CURL* easy;
+  curl_slist* headers;
+  // New addresses for the host, which libcurl loads into the DNS cache of
+  // the multi handle when the transfer starts.
+  curl_slist* resolve;
+  std::string url;
+  std::string request;
+  std::string response;
+  Callback callback;
+  char error[CURL_ERROR_SIZE];
+};
+
+HttpTransport::HttpTransport(const std::string& url,
+                             const std::string& user,
+                             const std::string& password,
+                             std::chrono::seconds timeout,
+                             size_t max_connections,
+                             Protocol protocol)
+    : url_(url),
+      user_(user),
+      password_(password),
+      timeout_(timeout),
+      max_connections_(std::max<size_t>(max_connections, 1)),
+      protocol_(protocol),
+      resolver_(NULL) {}
+
+HttpTransport::~HttpTransport() {
+  Stop();
+}
+
+void HttpTransport::Stop() {
+  if (!state_ || !state_->multi)
+    return;
+  {
+    boost::lock_guard<boost::mutex> lock(state_->lock);
+    state_->stopping = true;
+  }
+  curl_multi_wakeup(state_->multi);
+  if (state_->thread.joinable())
+    state_->thread.join();
+  // Fail whatever the thread left behind.
+  for (auto i = state_->submitted.begin(); i != state_->submitted.end(); ++i)
+    Finish(*i, CURLE_ABORTED_BY_CALLBACK);
+  state_->submitted.clear();
+  while (!state_->active.empty()) {
+    Transfer* transfer = *state_->active.begin();
+    curl_multi_remove_handle(state_->multi, transfer->easy);
+    state_->active.erase(transfer);
+    Finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+  }
+  for (auto i = state_->idle.begin(); i != state_->idle.end(); ++i) {
+    curl_easy_cleanup((*i)->easy);
+    delete *i;
+  }
+  state_->idle.clear();
+  curl_multi_cleanup(state_->multi);
+  // Posts from here on fail right away, as the transport is stopping.
+  state_->multi = NULL;
+}
+
+bool HttpTransport::Init() {
+  if (state_)
+    return true;
+  // Not thread-safe, so it is done once up front rather than implicitly by
+  // the first transfer.
+  static std::once_flag global_init;
+  std::call_once(global_init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+  curl_version_info_data* version = curl_version_info(CURLVERSION_NOW);
+  if (protocol_ == kHttp2 && !(version->features & CURL_VERSION_HTTP2)) {
+    LOG(WARNING) << "libcurl " << version->version
+                 << " lacks HTTP/2; using cpprest.";
+    return false;
+  }
+  std::unique_ptr<State> state(new State());
+  state->multi = curl_multi_init();
+  if (!state->multi) {
+    LOG(ERROR) << "Failed to create a libcurl multi handle.";
+    return false;
+  }
+  const long pipelining =
+      protocol_ == kHttp2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING;
+  curl_multi_setopt(state->multi, CURLMOPT_PIPELINING, pipelining);
+  // Requests beyond this wait in libcurl for a connection to free up.
+  curl_multi_setopt(state->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    static_cast<long>(max_connections_));
+  state_ = std::move(state);
+  state_->thread = boost::thread(&HttpTransport::Run, this);
+  return true;
+}
+
+void HttpTransport::Post(const std::string& path,
+                         const std::string& body,
+                         const Headers& headers,
+                         std::chrono::milliseconds timeout,
+                         const Callback& callback) {
+  CHECK(state_);
+  Transfer* transfer = NULL;
+  {
+    boost::lock_guard<boost::mutex> lock(state_->lock);
+    if (!state_->idle.empty()) {
+      transfer = state_->idle.back();
+      state_->idle.pop_back();
+    }
+  }
+  if (transfer) {
+    curl_easy_reset(transfer->easy);
+    transfer->error[0] = '\0';
+  } else {
+    transfer = new Transfer();
+  }
+  transfer->callback = callback;
+  transfer->url.assign(url_).append(path);
+  transfer->request.assign(body);
+  transfer->response.clear();
+  transfer->headers =
+      curl_slist_append(NULL, "Content-Type: application/json");
+  for (auto i = headers.begin(); i != headers.end(); ++i) {
+    transfer->headers = curl_slist_append(
+        transfer->headers, (i->first + ": " + i->second).c_str());
+  }
+  if (!transfer->easy)
+    transfer->easy = curl_easy_init();
+  if (!transfer->easy) {
+    Finish(transfer, CURLE_OUT_OF_MEMORY);
+    return;
+  }
+  CURL* easy = transfer->easy;
+  curl_easy_setopt(easy, CURLOPT_URL, transfer->url.c_str());
+  curl_easy_setopt(easy, CURLOPT_POST, 1L);
+  curl_easy_setopt(easy, CURLOPT_POSTFIELDS, transfer->request.data());
+  curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE,
+                   static_cast<long>(transfer->request.size()));
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+  if (resolver_) {
+    std::shared_ptr<const HostResolver::Addresses> addresses;
+    {
+      boost::lock_guard<boost::mutex> lock(state_->lock);
+      const uint64_t generation = resolver_->generation();
+      if (generation != state_->resolved_generation) {
+        state_->resolved_generation = generation;
+        addresses = resolver_->addresses();
+      }
+    }
+    if (addresses) {
+      // Entries set this way replace the previous ones and never expire, so
+      // libcurl resolves nothing itself.
+      std::string entry = resolver_->host() + ":" +
+                          std::to_string(resolver_->port()) + ":";
+      for (auto i = addresses->begin(); i != addresses->end(); ++i)
+        entry.append(i == addresses->begin() ? "" : ",").append(*i);
+      transfer->resolve = curl_slist_append(NULL, entry.c_str());
+      curl_easy_setopt(easy, CURLOPT_RESOLVE, transfer->resolve);
+    }
+  }
+  curl_easy_setopt(easy, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+                   kHappyEyeballsTimeoutMs);
+  if (protocol_ == kHttp2) {
+    // Clear-text endpoints have no ALPN to negotiate HTTP/2 with.
+    const bool is_tls = url_.compare(0, 6, "https:") == 0;
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+                     is_tls ? CURL_HTTP_VERSION_2TLS
+                            : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    // Wait for a connection that can take another stream rather than
+    // opening a new one.
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+  } else {
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  }
+  curl_easy_setopt(easy, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+  curl_easy_setopt(easy, CURLOPT_USERNAME, user_.c_str());
+  curl_easy_setopt(easy, CURLOPT_PASSWORD, password_.c_str());
+  std::chrono::milliseconds limit =
+      std::chrono::duration_cast<std::chrono::milliseconds>(timeout_);
+  if (timeout > std::chrono::milliseconds::zero())
+    limit = std::min(limit, timeout);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(limit.count()));
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &AppendBody);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer->response);
+  curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, transfer->error);
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+  {
+    boost::lock_guard<boost::mutex> lock(state_->lock);
+    if (!state_->stopping) {
+      state_->submitted.push_back(transfer);
+      transfer = NULL;
+    }
+  }
+  if (transfer)
+    Finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+  else
+    curl_multi_wakeup(state_->multi);
+}
+
+void HttpTransport::Run() {
+  std::vector<Transfer*> submitted;
+  while (true) {
+    {
+      boost::lock_guard<boost::mutex> lock(state_->lock);
+      if (state_->stopping)
+        return;
+      submitted.swap(state_->submitted);
+    }
+    for (auto i = submitted.begin(); i != submitted.end(); ++i) {
+      CURLMcode added = curl_multi_add_handle(state_->multi, (*i)->easy);
+      if (added != CURLM_OK) {
+        LOG(ERROR) << "Failed to start a request to " << url_ << ": "
+                   << curl_multi_strerror(added);
+        if ((*i)->resolve) {
+          // Hand the addresses to the next transfer instead.
+          boost::lock_guard<boost::mutex> lock(state_->lock);
+          state_->resolved_generation = 0;
+        }
+        Finish(*i, CURLE_FAILED_INIT);
+        continue;
+      }
+      state_->active.insert(*i);
+    }
+    submitted.clear();
+    int running = 0;
+    curl_multi_perform(state_->multi, &running);
+    int queued = 0;
+    while (CURLMsg* message = curl_multi_info_read(state_->multi, &queued)) {
+      if (message->msg != CURLMSG_DONE)
+        continue;
+      Transfer* transfer = NULL;
+      curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+      CHECK(transfer);
+      const CURLcode result = message->data.result;
+      curl_multi_remove_handle(state_->multi, transfer->easy);
+      state_->active.erase(transfer);
+      Finish(transfer, result);
+    }
+    curl_multi_poll(state_->multi, NULL, 0, kPollTimeoutMs, NULL);
+  }
+}
+
+void HttpTransport::Finish(Transfer* transfer, int result) {
+  Callback callback;
+  callback.swap(transfer->callback);
+  if (result == CURLE_OK) {
+    long status = 0;
+    curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &status);
+    Response response;
+    response.status = static_cast<int>(status);
+    response.body.swap(transfer->response);
+    RunCallback(callback, &response, std::string());
+    // Keep the buffer for the next response.
+    transfer->response.swap(response.body);
+  } else {
+    const std::string error =
+        transfer->error[0] ? transfer->error
+                           : curl_easy_strerror(static_cast<CURLcode>(result));
+    VLOG(1) << "Request to " << transfer->url << " failed: " << error;
+    RunCallback(callback, NULL, error);
+  }
+  curl_slist_free_all(transfer->headers);
+  transfer->headers = NULL;
+  curl_slist_free_all(transfer->resolve);
+  transfer->resolve = NULL;
+  if (transfer->easy) {
+    boost::lock_guard<boost::mutex> lock(state_->lock);
+    if (!state_->stopping && state_->idle.size() < kMaxIdleTransfers) {
+      state_->idle.push_back(transfer);
+      return;
+    }
+  }
+  if (transfer->easy)
+    curl_easy_cleanup(transfer->easy);
+  delete transfer;
+}
+
+#endif  // NO_HTTP2
+
+}  // namespace p11net
@@ -0,0 +1,121 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_HTTP_TRANSPORT_H_
+#define P11NET_HTTP_TRANSPORT_H_
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <pplx/pplxtasks.h>
+
+namespace p11net {
+
+class HostResolver;
+
+// HttpTransport sends requests to a single NetHSM endpoint from one thread of
+// its own, which drives all transfers with libcurl's multi interface over
+// persistent connections. Over HTTP/2, concurrent requests are multiplexed as
+// streams over a few connections, so a burst of key actions does not need a
+// TCP and TLS handshake per request and a slow response does not hold up the
+// ones behind it. Over HTTP/1.1, each connection carries one request at a
+// time. Completions are delivered to a callback on the transfer thread, and
+// the handles of finished transfers are reused, so a request allocates
+// nothing in the steady state. Sample usage:
+//    HttpTransport transport(url, user, password, timeout, 2,
+//                            HttpTransport::kHttp2);
+//    if (!transport.Init())
+//      return;  // Use the cpprest client instead.
+//    transport.Post(path, body, headers, std::chrono::milliseconds::zero(),
+//        [](HttpTransport::Response* response, const std::string& error) {
+//          ...
+//        });
+// Modules built without libcurl (NO_HTTP2) have a transport that fails Init.
+class HttpTransport {
+ public:
+  enum Protocol {
+    kHttp2,
+    kHttp11,
+  };
+  struct Response {
+    Response() : status(0) {}
+    int status;
+    std::string body;
+  };
+  typedef std::vector<std::pair<std::string, std::string>> Headers;
+  // Receives the response, which it may take the body of, or NULL and the
+  // error if no response arrived. It runs on the transfer thread and must not
+  // block.
+  typedef std::function<void(Response* response, const std::string& error)>
+      Callback;
+
+  //  url - The base URL of the endpoint. Over HTTP/2, plain http URLs speak
+  //        it without upgrade and https URLs negotiate it with ALPN.
+  //  timeout - The limit for a whole request.
+  //  max_connections - The most connections to open to the endpoint.
+  HttpTransport(const std::string& url,
+                const std::string& user,
+                const std::string& password,
+                std::chrono::seconds timeout,
+                size_t max_connections,
+                Protocol protocol);
+  virtual ~HttpTransport();
+
+  // Starts the transfer thread. Returns false if the protocol is not
+  // available.
+  bool Init();
+
+  // Stops the transfer thread and fails the requests in flight. The
+  // transport takes no requests afterwards.
+  void Stop();
+
+  // Makes connections go to the addresses 'resolver' keeps for the host of
+  // the URL instead of resolving it first. This must be called before Init.
+  void set_resolver(HostResolver* resolver) { resolver_ = resolver; }
+
+  // Posts a JSON body to 'path' below the base URL and calls 'callback' with
+  // the outcome. A non-zero 'timeout' shortens the limit of the transport for
+  // this request.
+  void Post(const std::string& path,
+            const std::string& body,
+            const Headers& headers,
+            std::chrono::milliseconds timeout,
+            const Callback& callback);
+  // As above, with the limit of the transport and a task that fails with
+  // std::runtime_error if no response arrives.
+  pplx::task<Response> Post(const std::string& path,
+                            const std::string& body,
+                            const Headers& headers);
+
+  const std::string& url() const { return url_; }
+  Protocol protocol() const { return protocol_; }
+
+ private:
+  struct State;
+  struct Transfer;
+
+  void Run();
+  // Completes a transfer and recycles it.
+  void Finish(Transfer* transfer, int result);
+
+  const std::string url_;
+  const std::string user_;
+  const std::string password_;
+  const std::chrono::seconds timeout_;
+  const size_t max_connections_;
+  const Protocol protocol_;
+  HostResolver* resolver_;
+  std::unique_ptr<State> state_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpTransport);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_HTTP_TRANSPORT_H_
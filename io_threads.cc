@@ -0,0 +1,194 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "io_threads.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <base/logging.h>
+#include <cpprest/version.h>
+#include <pplx/pplxtasks.h>
+#include <pplx/threadpool.h>
+
+namespace p11net {
+
+namespace {
+
+// The size of the shared pool of cpprest releases that cannot resize it.
+const size_t kFixedPoolThreads = 40;
+// How long the pinning tasks wait for each other to occupy every thread.
+const int kPinTimeoutMs = 1000;
+
+#if CPPREST_VERSION_MAJOR > 2 || \
+    (CPPREST_VERSION_MAJOR == 2 && CPPREST_VERSION_MINOR >= 10)
+#define P11NET_CAN_SIZE_THREADPOOL
+#endif
+
+std::mutex g_lock;
+bool g_configured = false;
+size_t g_num_threads = 0;
+std::string g_cpus;
+// The process the threads of the pool run in.
+std::atomic<pid_t> g_pool_pid(getpid());
+
+// Pins the threads of a pool of 'num_threads'. Each of as many tasks pins the
+// thread it runs on and then waits for the others, so that no thread runs two
+// of them. Returns false if some thread may not be pinned.
+bool PinThreads(size_t num_threads, const cpu_set_t& cpus) {
+  struct Rendezvous {
+    Rendezvous() : arrived(0), failed(false) {}
+    std::mutex lock;
+    std::condition_variable all_arrived;
+    size_t arrived;
+    bool failed;
+  };
+  std::shared_ptr<Rendezvous> rendezvous = std::make_shared<Rendezvous>();
+  std::vector<pplx::task<void>> tasks;
+  for (size_t i = 0; i < num_threads; ++i) {
+    tasks.push_back(pplx::create_task([rendezvous, num_threads, cpus] {
+      const bool pinned =
+          pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+      std::unique_lock<std::mutex> lock(rendezvous->lock);
+      if (!pinned)
+        rendezvous->failed = true;
+      if (++rendezvous->arrived == num_threads) {
+        rendezvous->all_arrived.notify_all();
+        return;
+      }
+      if (!rendezvous->all_arrived.wait_for(
+              lock, std::chrono::milliseconds(kPinTimeoutMs),
+              [&] { return rendezvous->arrived == num_threads; }))
+        rendezvous->failed = true;
+    }));
+  }
+  pplx::when_all(tasks.begin(), tasks.end()).wait();
+  return !rendezvous->failed;
+}
+
+}  // namespace
+
+bool ConfigureIoThreads(size_t num_threads, const std::string& cpus) {
+  std::lock_guard<std::mutex> lock(g_lock);
+  if (g_configured) {
+    if (num_threads != g_num_threads || cpus != g_cpus) {
+      LOG(WARNING) << "The I/O threads are configured once per process; "
+                   << "keeping " << g_num_threads << " threads on CPUs '"
+                   << g_cpus << "'.";
+    }
+    return true;
+  }
+  g_configured = true;
+  g_num_threads = num_threads;
+  g_cpus = cpus;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (!cpus.empty() && !ParseCpuList(cpus, &cpu_set)) {
+    LOG(ERROR) << "Invalid CPU list for the I/O threads: " << cpus;
+    return false;
+  }
+  // Pinned threads default to one per CPU.
+  if (num_threads == 0 && !cpus.empty())
+    num_threads = CPU_COUNT(&cpu_set);
+#ifdef P11NET_CAN_SIZE_THREADPOOL
+  if (num_threads > 0) {
+    try {
+      crossplat::threadpool::initialize_with_threads(num_threads);
+    } catch (const std::exception& e) {
+      // Something used cpprest before the module was initialized.
+      LOG(WARNING) << "Failed to size the I/O thread pool: " << e.what();
+      return false;
+    }
+  }
+#else
+  if (num_threads > 0 && num_threads != kFixedPoolThreads) {
+    LOG(WARNING) << "This cpprest release always runs "
+                 << kFixedPoolThreads << " I/O threads.";
+  }
+  num_threads = kFixedPoolThreads;
+#endif
+  if (cpus.empty())
+    return true;
+  if (!PinThreads(num_threads, cpu_set)) {
+    LOG(WARNING) << "Failed to pin all I/O threads to CPUs " << cpus;
+    return false;
+  }
+  LOG(INFO) << "Pinned " << num_threads << " I/O threads to CPUs " << cpus;
+  return true;
+}
+
+void EnsureIoThreads() {
+  const pid_t pid = getpid();
+  if (g_pool_pid.exchange(pid) == pid)
+    return;
+  // g_lock may have been held by a thread of the parent; the configuration
+  // is read as it was copied.
+  size_t num_threads = g_num_threads > 0 ? g_num_threads : kFixedPoolThreads;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  const bool pin = !g_cpus.empty() && ParseCpuList(g_cpus, &cpus);
+  if (pin && g_num_threads == 0)
+    num_threads = CPU_COUNT(&cpus);
+  boost::asio::io_service& service =
+      crossplat::threadpool::shared_instance().service();
+  // The reactor of the parent's pool shares its epoll descriptor with the
+  // parent.
+  service.notify_fork(boost::asio::io_service::fork_child);
+  for (size_t i = 0; i < num_threads; ++i) {
+    std::thread([&service, pin, cpus] {
+      if (pin)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+      service.run();
+    }).detach();
+  }
+  VLOG(1) << "Started " << num_threads << " I/O threads in process " << pid;
+}
+
+bool ParseCpuList(const std::string& list, cpu_set_t* set) {
+  CPU_ZERO(set);
+  std::istringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    char* end = NULL;
+    const long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (end == range.c_str())
+      return false;
+    if (*end == '-') {
+      const char* from = end + 1;
+      last = strtol(from, &end, 10);
+      if (end == from)
+        return false;
+    }
+    if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+      return false;
+    for (long cpu = first; cpu <= last; ++cpu)
+      CPU_SET(cpu, set);
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+bool GetNumaNodeCpus(int node, std::string* cpus) {
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+  if (!std::getline(file, *cpus) || cpus->empty()) {
+    LOG(ERROR) << "Failed to read the CPUs of NUMA node " << node;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace p11net
@@ -0,0 +1,39 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_IO_THREADS_H_
+#define P11NET_IO_THREADS_H_
+
+#include <sched.h>
+#include <stddef.h>
+
+#include <string>
+
+namespace p11net {
+
+// Sizes the cpprest thread pool, which runs the HTTP clients and the task
+// continuations of the process, and optionally pins its threads to 'cpus',
+// a list like "0-7,16-23". Zero threads keeps the cpprest default size; an
+// empty list leaves the threads unpinned. The pool can only be sized before
+// its first use, so this takes effect on the first call of the process and
+// later calls only log a warning if they ask for something else. Returns
+// false if the configuration could not be applied.
+bool ConfigureIoThreads(size_t num_threads, const std::string& cpus);
+
+// Makes sure the cpprest thread pool has threads in this process. A forked
+// child inherits the pool without its threads, so that no HTTP request or
+// task continuation would ever run; the first call in the child runs the
+// pool on new threads, as many as it had and pinned as they were. Other
+// calls do nothing.
+void EnsureIoThreads();
+
+// Parses a CPU list in the format of cpuset(7) into 'set'.
+bool ParseCpuList(const std::string& list, cpu_set_t* set);
+
+// Gets the CPU list of a NUMA node from sysfs.
+bool GetNumaNodeCpus(int node, std::string* cpus);
+
+}  // namespace p11net
+
+#endif  // P11NET_IO_THREADS_H_
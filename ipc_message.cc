@@ -0,0 +1,189 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ipc_message.h"
+
+#include <string.h>
+
+namespace p11net {
+
+void IpcWriter::Write(bool value) {
+  Write(static_cast<uint8_t>(value ? 1 : 0));
+}
+
+void IpcWriter::Write(uint8_t value) {
+  data_.push_back(value);
+}
+
+void IpcWriter::Write(uint32_t value) {
+  WriteBytes(&value, sizeof(value));
+}
+
+void IpcWriter::Write(uint64_t value) {
+  WriteBytes(&value, sizeof(value));
+}
+
+void IpcWriter::Write(const std::string& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  WriteBytes(value.data(), value.size());
+}
+
+void IpcWriter::Write(const std::string* value) {
+  Write(value != NULL);
+  if (value)
+    Write(*value);
+}
+
+void IpcWriter::Write(const std::vector<uint8_t>& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  WriteBytes(value.data(), value.size());
+}
+
+void IpcWriter::Write(const brillo::SecureBlob& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  WriteBytes(value.data(), value.size());
+}
+
+void IpcWriter::Write(const std::vector<uint32_t>& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  WriteBytes(value.data(), value.size() * sizeof(uint32_t));
+}
+
+void IpcWriter::Write(const std::vector<uint64_t>& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  WriteBytes(value.data(), value.size() * sizeof(uint64_t));
+}
+
+void IpcWriter::Write(const std::vector<std::vector<uint8_t>>& value) {
+  Write(static_cast<uint32_t>(value.size()));
+  for (auto i = value.begin(); i != value.end(); ++i)
+    Write(*i);
+}
+
+void IpcWriter::WriteBytes(const void* bytes, size_t size) {
+  const uint8_t* begin = static_cast<const uint8_t*>(bytes);
+  data_.insert(data_.end(), begin, begin + size);
+}
+
+bool IpcReader::Read(bool* value) {
+  uint8_t byte = 0;
+  if (!Read(&byte))
+    return false;
+  *value = byte != 0;
+  return true;
+}
+
+bool IpcReader::Read(uint8_t* value) {
+  return ReadBytes(value, sizeof(*value));
+}
+
+bool IpcReader::Read(uint32_t* value) {
+  return ReadBytes(value, sizeof(*value));
+}
+
+bool IpcReader::Read(uint64_t* value) {
+  return ReadBytes(value, sizeof(*value));
+}
+
+bool IpcReader::Peek(uint64_t* value) {
+  const size_t offset = offset_;
+  if (!Read(value))
+    return false;
+  offset_ = offset;
+  return true;
+}
+
+bool IpcReader::Read(std::string* value) {
+  size_t length = 0;
+  if (!ReadLength(1, &length))
+    return false;
+  value->assign(reinterpret_cast<const char*>(data_.data()) + offset_, length);
+  offset_ += length;
+  return true;
+}
+
+bool IpcReader::Read(boost::optional<std::string>* value) {
+  bool present = false;
+  if (!Read(&present))
+    return false;
+  if (!present) {
+    *value = boost::none;
+    return true;
+  }
+  std::string string;
+  if (!Read(&string))
+    return false;
+  *value = std::move(string);
+  return true;
+}
+
+bool IpcReader::Read(std::vector<uint8_t>* value) {
+  size_t length = 0;
+  if (!ReadLength(1, &length))
+    return false;
+  value->resize(length);
+  return ReadBytes(value->data(), length);
+}
+
+bool IpcReader::Read(brillo::SecureBlob* value) {
+  size_t length = 0;
+  if (!ReadLength(1, &length))
+    return false;
+  value->resize(length);
+  return ReadBytes(value->data(), length);
+}
+
+bool IpcReader::Read(std::vector<uint32_t>* value) {
+  size_t length = 0;
+  if (!ReadLength(sizeof(uint32_t), &length))
+    return false;
+  value->resize(length);
+  return ReadBytes(value->data(), length * sizeof(uint32_t));
+}
+
+bool IpcReader::Read(std::vector<uint64_t>* value) {
+  size_t length = 0;
+  if (!ReadLength(sizeof(uint64_t), &length))
+    return false;
+  value->resize(length);
+  return ReadBytes(value->data(), length * sizeof(uint64_t));
+}
+
+bool IpcReader::Read(std::vector<std::vector<uint8_t>>* value) {
+  size_t length = 0;
+  // Each element takes at least its length.
+  if (!ReadLength(sizeof(uint32_t), &length))
+    return false;
+  value->resize(length);
+  for (size_t i = 0; i < length; ++i) {
+    if (!Read(&(*value)[i]))
+      return false;
+  }
+  return true;
+}
+
+bool IpcReader::ReadBytes(void* bytes, size_t size) {
+  if (!ok_ || data_.size() - offset_ < size) {
+    ok_ = false;
+    return false;
+  }
+  if (size > 0)
+    memcpy(bytes, data_.data() + offset_, size);
+  offset_ += size;
+  return true;
+}
+
+bool IpcReader::ReadLength(size_t element_size, size_t* length) {
+  uint32_t count = 0;
+  if (!Read(&count))
+    return false;
+  if ((data_.size() - offset_) / element_size < count) {
+    ok_ = false;
+    return false;
+  }
+  *length = count;
+  return true;
+}
+
+}  // namespace p11net
@@ -0,0 +1,196 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_IPC_MESSAGE_H_
+#define P11NET_IPC_MESSAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/optional.hpp>
+#include <brillo/secure_blob.h>
+
+namespace p11net {
+
+// The methods of P11NetInterface as numbered in the messages between
+// P11NetProxyImpl and P11NetDaemon. Append new methods; the numbers of
+// existing ones must not change while clients of an older module may run.
+enum IpcMethod : uint32_t {
+  kIpcGetSlotList = 1,
+  kIpcGetSlotInfo,
+  kIpcGetTokenInfo,
+  kIpcGetMechanismList,
+  kIpcGetMechanismInfo,
+  kIpcInitToken,
+  kIpcInitPIN,
+  kIpcSetPIN,
+  kIpcOpenSession,
+  kIpcCloseSession,
+  kIpcCloseAllSessions,
+  kIpcGetSessionInfo,
+  kIpcSetSessionPriority,
+  kIpcSignBatch,
+  kIpcDecryptBatch,
+  kIpcGetOperationState,
+  kIpcSetOperationState,
+  kIpcLogin,
+  kIpcLogout,
+  kIpcCreateObject,
+  kIpcCopyObject,
+  kIpcDestroyObject,
+  kIpcGetObjectSize,
+  kIpcGetAttributeValue,
+  kIpcSetAttributeValue,
+  kIpcFindObjectsInit,
+  kIpcFindObjects,
+  kIpcFindObjectsFinal,
+  kIpcEncryptInit,
+  kIpcEncrypt,
+  kIpcEncryptUpdate,
+  kIpcEncryptFinal,
+  kIpcEncryptCancel,
+  kIpcDecryptInit,
+  kIpcDecrypt,
+  kIpcDecryptUpdate,
+  kIpcDecryptFinal,
+  kIpcDecryptCancel,
+  kIpcDigestInit,
+  kIpcDigest,
+  kIpcDigestUpdate,
+  kIpcDigestKey,
+  kIpcDigestFinal,
+  kIpcDigestCancel,
+  kIpcSignInit,
+  kIpcSign,
+  kIpcSignUpdate,
+  kIpcSignFinal,
+  kIpcSignCancel,
+  kIpcSignRecoverInit,
+  kIpcSignRecover,
+  kIpcVerifyInit,
+  kIpcVerify,
+  kIpcVerifyUpdate,
+  kIpcVerifyFinal,
+  kIpcVerifyCancel,
+  kIpcVerifyRecoverInit,
+  kIpcVerifyRecover,
+  kIpcDigestEncryptUpdate,
+  kIpcDecryptDigestUpdate,
+  kIpcSignEncryptUpdate,
+  kIpcDecryptVerifyUpdate,
+  kIpcGenerateKey,
+  kIpcGenerateKeyPair,
+  kIpcWrapKey,
+  kIpcUnwrapKey,
+  kIpcDeriveKey,
+  kIpcSeedRandom,
+  kIpcGenerateRandom,
+  // Not a P11NetInterface method: takes the sequence number of the last slot
+  // events seen and returns the current one and the slots with events since.
+  kIpcGetSlotEvents,
+};
+
+// IpcWriter builds a message: a request starts with its IpcMethod and a
+// response with the result of the call, and both continue with the arguments
+// in the order of the P11NetInterface method. Both ends run on the same host,
+// so numbers are in host byte order. Byte strings and arrays are preceded by
+// their uint32_t length, and an optional string by a bool. Sample usage:
+//    IpcWriter request(kIpcLogin);
+//    request.Write(isolate_credential, session_id, user_type, pin);
+class IpcWriter {
+ public:
+  IpcWriter() {}
+  explicit IpcWriter(IpcMethod method) { Write(static_cast<uint32_t>(method)); }
+
+  void Write(bool value);
+  void Write(uint8_t value);
+  void Write(uint32_t value);
+  void Write(uint64_t value);
+  void Write(const std::string& value);
+  // Writes whether 'value' is NULL and then the string it points to, if any.
+  void Write(const std::string* value);
+  void Write(const std::vector<uint8_t>& value);
+  void Write(const brillo::SecureBlob& value);
+  void Write(const std::vector<uint32_t>& value);
+  void Write(const std::vector<uint64_t>& value);
+  void Write(const std::vector<std::vector<uint8_t>>& value);
+
+  template <typename T, typename U, typename... Rest>
+  void Write(const T& value, const U& next, const Rest&... rest) {
+    Write(value);
+    Write(next, rest...);
+  }
+
+  const std::vector<uint8_t>& data() const { return data_; }
+  std::vector<uint8_t>* mutable_data() { return &data_; }
+
+ private:
+  void WriteBytes(const void* bytes, size_t size);
+
+  std::vector<uint8_t> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(IpcWriter);
+};
+
+// IpcReader takes apart a message built by IpcWriter. A read past the end of
+// the message or of a malformed length fails, as do all reads after it.
+class IpcReader {
+ public:
+  IpcReader() : offset_(0), ok_(true) {}
+
+  bool Read(bool* value);
+  bool Read(uint8_t* value);
+  bool Read(uint32_t* value);
+  bool Read(uint64_t* value);
+  bool Read(std::string* value);
+  bool Read(boost::optional<std::string>* value);
+  bool Read(std::vector<uint8_t>* value);
+  bool Read(brillo::SecureBlob* value);
+  bool Read(std::vector<uint32_t>* value);
+  bool Read(std::vector<uint64_t>* value);
+  bool Read(std::vector<std::vector<uint8_t>>* value);
+
+  // Reads several values in order. Returns true if all of them were read.
+  template <typename T, typename U, typename... Rest>
+  bool Read(T* value, U* next, Rest*... rest) {
+    Read(value);
+    return Read(next, rest...);
+  }
+
+  // Reads the next value without moving past it.
+  bool Peek(uint64_t* value);
+  // Skips the rest of the message.
+  void Discard() { offset_ = data_.size(); }
+
+  // Returns true if the whole message was read without error.
+  bool IsComplete() const { return ok_ && offset_ == data_.size(); }
+  bool ok() const { return ok_; }
+
+  // Starts reading a new message.
+  std::vector<uint8_t>* Reset() {
+    offset_ = 0;
+    ok_ = true;
+    return &data_;
+  }
+
+ private:
+  bool ReadBytes(void* bytes, size_t size);
+  // Reads a uint32_t length and checks that as many elements of
+  // 'element_size' bytes remain.
+  bool ReadLength(size_t element_size, size_t* length);
+
+  std::vector<uint8_t> data_;
+  size_t offset_;
+  bool ok_;
+
+  DISALLOW_COPY_AND_ASSIGN(IpcReader);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_IPC_MESSAGE_H_
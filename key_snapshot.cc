@@ -0,0 +1,242 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "key_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <base/logging.h>
+
+namespace p11net {
+
+namespace {
+
+const char kMagic[8] = {'P', '1', '1', 'N', 'S', 'N', 'A', 'P'};
+const uint32_t kVersion = 1;
+// Set in the header flags if the inventory is complete.
+const uint32_t kCompleteFlag = 1;
+
+// Writes all of 'data' to 'fd'. Returns true on success.
+bool WriteAll(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+}  // namespace
+
+// The file starts with this header, followed by 'num_keys' index entries and
+// then the strings they refer to. Offsets are relative to the start of the
+// file.
+struct KeySnapshot::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t num_keys;
+  uint32_t endpoint_offset;
+  uint32_t endpoint_length;
+  uint32_t reserved;
+};
+
+struct KeySnapshot::IndexEntry {
+  uint32_t id_offset;
+  uint32_t id_length;
+  uint32_t record_offset;
+  uint32_t record_length;
+};
+
+KeySnapshot::KeySnapshot()
+    : data_(NULL), size_(0), num_keys_(0), complete_(false) {}
+
+KeySnapshot::~KeySnapshot() {
+  Close();
+}
+
+bool KeySnapshot::Write(const boost::filesystem::path& path,
+                        const KeyInventory& inventory) {
+  std::vector<const KeyRecord*> records;
+  for (int i = 0; i < inventory.key_size(); ++i)
+    records.push_back(&inventory.key(i));
+  std::sort(records.begin(), records.end(),
+            [](const KeyRecord* a, const KeyRecord* b) {
+              return a->id() < b->id();
+            });
+  std::string strings(inventory.endpoint());
+  std::vector<IndexEntry> entries(records.size());
+  const size_t strings_offset =
+      sizeof(Header) + records.size() * sizeof(IndexEntry);
+  for (size_t i = 0; i < records.size(); ++i) {
+    std::string record;
+    if (!records[i]->SerializeToString(&record)) {
+      LOG(ERROR) << "Failed to serialize key " << records[i]->id();
+      return false;
+    }
+    entries[i].id_offset = strings_offset + strings.size();
+    entries[i].id_length = records[i]->id().size();
+    strings += records[i]->id();
+    entries[i].record_offset = strings_offset + strings.size();
+    entries[i].record_length = record.size();
+    strings += record;
+  }
+  if (strings_offset + strings.size() > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Key inventory too large for a snapshot.";
+    return false;
+  }
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.flags = inventory.complete() ? kCompleteFlag : 0;
+  header.num_keys = records.size();
+  header.endpoint_offset = strings_offset;
+  header.endpoint_length = inventory.endpoint().size();
+  std::string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!entries.empty()) {
+    contents.append(reinterpret_cast<const char*>(entries.data()),
+                    entries.size() * sizeof(IndexEntry));
+  }
+  contents += strings;
+
+  // Readers keep the file they mapped; new readers see the renamed one.
+  const std::string temp_path = path.string() + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to create " << temp_path;
+    return false;
+  }
+  bool written = WriteAll(fd, contents) && fsync(fd) == 0;
+  if (!written)
+    PLOG(ERROR) << "Failed to write " << temp_path;
+  close(fd);
+  if (!written || rename(temp_path.c_str(), path.string().c_str()) != 0) {
+    if (written)
+      PLOG(ERROR) << "Failed to replace " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool KeySnapshot::Open(const boost::filesystem::path& path) {
+  Close();
+  int fd = open(path.string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      PLOG(WARNING) << "Failed to open " << path;
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(Header)) {
+    LOG(WARNING) << "Ignoring truncated key snapshot " << path;
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map " << path;
+    return false;
+  }
+  data_ = static_cast<const char*>(mapping);
+  size_ = info.st_size;
+
+  // Validate the whole index once so that lookups need no bounds checks.
+  const Header* header = reinterpret_cast<const Header*>(data_);
+  const uint64_t index_end =
+      sizeof(Header) + static_cast<uint64_t>(header->num_keys) *
+                           sizeof(IndexEntry);
+  bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+               header->version == kVersion && index_end <= size_ &&
+               static_cast<uint64_t>(header->endpoint_offset) +
+                       header->endpoint_length <= size_;
+  if (valid) {
+    num_keys_ = header->num_keys;
+    const IndexEntry* entries = index();
+    for (size_t i = 0; valid && i < num_keys_; ++i) {
+      valid = static_cast<uint64_t>(entries[i].id_offset) +
+                      entries[i].id_length <= size_ &&
+              static_cast<uint64_t>(entries[i].record_offset) +
+                      entries[i].record_length <= size_ &&
+              (i == 0 || GetKeyId(i - 1) < GetKeyId(i));
+    }
+  }
+  if (!valid) {
+    LOG(WARNING) << "Ignoring invalid key snapshot " << path;
+    Close();
+    return false;
+  }
+  endpoint_.assign(data_ + header->endpoint_offset, header->endpoint_length);
+  complete_ = (header->flags & kCompleteFlag) != 0;
+  return true;
+}
+
+std::string KeySnapshot::GetKeyId(size_t index) const {
+  CHECK_LT(index, num_keys_);
+  const IndexEntry& entry = this->index()[index];
+  return std::string(data_ + entry.id_offset, entry.id_length);
+}
+
+bool KeySnapshot::GetRecord(size_t index, KeyRecord* record) const {
+  CHECK_LT(index, num_keys_);
+  const IndexEntry& entry = this->index()[index];
+  if (!record->ParseFromArray(data_ + entry.record_offset,
+                              entry.record_length)) {
+    LOG(WARNING) << "Ignoring corrupt snapshot record " << GetKeyId(index);
+    return false;
+  }
+  return true;
+}
+
+bool KeySnapshot::Find(const std::string& key_id, KeyRecord* record) const {
+  size_t low = 0;
+  size_t high = num_keys_;
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    const IndexEntry& entry = index()[middle];
+    const int order = key_id.compare(
+        0, std::string::npos, data_ + entry.id_offset, entry.id_length);
+    if (order == 0)
+      return GetRecord(middle, record);
+    if (order < 0)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  return false;
+}
+
+const KeySnapshot::IndexEntry* KeySnapshot::index() const {
+  return reinterpret_cast<const IndexEntry*>(data_ + sizeof(Header));
+}
+
+void KeySnapshot::Close() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+  data_ = NULL;
+  size_ = 0;
+  num_keys_ = 0;
+  endpoint_.clear();
+  complete_ = false;
+}
+
+}  // namespace p11net
@@ -0,0 +1,77 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_KEY_SNAPSHOT_H_
+#define P11NET_KEY_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <base/macros.h>
+#include <boost/filesystem/path.hpp>
+
+#include "proto_bindings/key_inventory.pb.h"
+
+namespace p11net {
+
+// KeySnapshot is a read-only, memory-mapped copy of a key inventory. The file
+// holds a fixed-layout index of the keys, sorted by identifier, followed by
+// the serialized KeyRecord of every key. Opening a snapshot only validates
+// the index; a record is parsed when it is asked for, and every process that
+// maps the file shares one page-cache copy of it. The layout uses the host
+// byte order since the file is a cache of the local machine. Sample usage:
+//    KeySnapshot::Write(path, inventory);
+//    KeySnapshot snapshot;
+//    KeyRecord record;
+//    if (snapshot.Open(path) && snapshot.Find("mykey", &record)) { ... }
+class KeySnapshot {
+ public:
+  KeySnapshot();
+  virtual ~KeySnapshot();
+
+  // Writes 'inventory' to 'path', replacing any previous snapshot atomically
+  // so that processes that mapped it keep a consistent copy. Returns true on
+  // success.
+  static bool Write(const boost::filesystem::path& path,
+                    const KeyInventory& inventory);
+
+  // Maps the snapshot at 'path' and validates its index. Returns false if the
+  // file does not exist or is not a valid snapshot.
+  bool Open(const boost::filesystem::path& path);
+
+  // The endpoint and completeness of the inventory the snapshot was taken of.
+  const std::string& endpoint() const { return endpoint_; }
+  bool complete() const { return complete_; }
+  // The number of keys in the snapshot.
+  size_t size() const { return num_keys_; }
+
+  // Returns the identifier of the key at 'index', in identifier order.
+  std::string GetKeyId(size_t index) const;
+  // Parses the record of the key at 'index'. Returns false if it is corrupt.
+  bool GetRecord(size_t index, KeyRecord* record) const;
+  // Parses the record of the key with the given identifier. Returns false if
+  // there is no such key.
+  bool Find(const std::string& key_id, KeyRecord* record) const;
+
+ private:
+  struct Header;
+  struct IndexEntry;
+
+  const IndexEntry* index() const;
+  void Close();
+
+  const char* data_;
+  size_t size_;
+  size_t num_keys_;
+  std::string endpoint_;
+  bool complete_;
+
+  DISALLOW_COPY_AND_ASSIGN(KeySnapshot);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_KEY_SNAPSHOT_H_
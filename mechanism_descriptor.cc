@@ -0,0 +1,138 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mechanism_descriptor.h"
+
+#include <base/macros.h>
+
+namespace p11net {
+
+namespace {
+
+// The key type of mechanisms that take no key.
+const CK_KEY_TYPE kNoKey = CKK_VENDOR_DEFINED;
+const CK_FLAGS kRSAFlags = CKF_HW | CKF_SIGN | CKF_VERIFY;
+// The NetHSM signs with uncompressed keys on named prime curves.
+const CK_FLAGS kECFlags = CKF_HW | CKF_SIGN | CKF_VERIFY | CKF_EC_F_P |
+                          CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS;
+const CK_FLAGS kCipherFlags = CKF_ENCRYPT | CKF_DECRYPT;
+const CK_FLAGS kHMACFlags = CKF_SIGN | CKF_VERIFY;
+const int kRSADigestInfo = kMechanismRSA | kMechanismDigestInfo;
+
+// Each entry lists, in order: the type, the mechanism info, the key type, the
+// kinds, the ciphers, the digest and its DigestInfo algorithm.
+const MechanismDescriptor kMechanismDescriptors[] = {
+  {CKM_RSA_PKCS_KEY_PAIR_GEN, {512, 2048, CKF_GENERATE_KEY_PAIR | CKF_HW},
+   CKK_RSA, 0},
+  {CKM_RSA_PKCS, {512, 2048, kRSAFlags | kCipherFlags}, CKK_RSA,
+   kMechanismRSA},
+  {CKM_MD5_RSA_PKCS, {512, 2048, kRSAFlags}, CKK_RSA, kRSADigestInfo, {},
+   EVP_md5, DigestAlgorithm::MD5},
+  {CKM_SHA1_RSA_PKCS, {512, 2048, kRSAFlags}, CKK_RSA, kRSADigestInfo, {},
+   EVP_sha1, DigestAlgorithm::SHA1},
+  {CKM_SHA256_RSA_PKCS, {512, 2048, kRSAFlags}, CKK_RSA, kRSADigestInfo, {},
+   EVP_sha256, DigestAlgorithm::SHA256},
+  {CKM_SHA384_RSA_PKCS, {512, 2048, kRSAFlags}, CKK_RSA, kRSADigestInfo, {},
+   EVP_sha384, DigestAlgorithm::SHA384},
+  {CKM_SHA512_RSA_PKCS, {512, 2048, kRSAFlags}, CKK_RSA, kRSADigestInfo, {},
+   EVP_sha512, DigestAlgorithm::SHA512},
+  {CKM_ECDSA, {256, 521, kECFlags}, CKK_EC, kMechanismECDSA},
+  {CKM_ECDSA_SHA1, {256, 521, kECFlags}, CKK_EC, kMechanismECDSA, {},
+   EVP_sha1},
+  {CKM_ECDSA_SHA256, {256, 521, kECFlags}, CKK_EC, kMechanismECDSA, {},
+   EVP_sha256},
+  {CKM_ECDSA_SHA384, {256, 521, kECFlags}, CKK_EC, kMechanismECDSA, {},
+   EVP_sha384},
+  {CKM_ECDSA_SHA512, {256, 521, kECFlags}, CKK_EC, kMechanismECDSA, {},
+   EVP_sha512},
+  {CKM_MD5, {0, 0, CKF_DIGEST}, kNoKey, 0, {}, EVP_md5},
+  {CKM_SHA_1, {0, 0, CKF_DIGEST}, kNoKey, 0, {}, EVP_sha1},
+  {CKM_SHA256, {0, 0, CKF_DIGEST}, kNoKey, 0, {}, EVP_sha256},
+  {CKM_SHA384, {0, 0, CKF_DIGEST}, kNoKey, 0, {}, EVP_sha384},
+  {CKM_SHA512, {0, 0, CKF_DIGEST}, kNoKey, 0, {}, EVP_sha512},
+  {CKM_GENERIC_SECRET_KEY_GEN, {8, 1024, CKF_GENERATE}, CKK_GENERIC_SECRET,
+   0},
+  {CKM_MD5_HMAC, {0, 0, kHMACFlags}, CKK_GENERIC_SECRET, kMechanismHMAC, {},
+   EVP_md5},
+  {CKM_SHA_1_HMAC, {0, 0, kHMACFlags}, CKK_GENERIC_SECRET, kMechanismHMAC, {},
+   EVP_sha1},
+  {CKM_SHA256_HMAC, {0, 0, kHMACFlags}, CKK_GENERIC_SECRET, kMechanismHMAC,
+   {}, EVP_sha256},
+  {CKM_SHA512_HMAC, {0, 0, kHMACFlags}, CKK_GENERIC_SECRET, kMechanismHMAC,
+   {}, EVP_sha512},
+  {CKM_SHA384_HMAC, {0, 0, kHMACFlags}, CKK_GENERIC_SECRET, kMechanismHMAC,
+   {}, EVP_sha384},
+  {CKM_DES_KEY_GEN, {0, 0, CKF_GENERATE}, CKK_DES, 0},
+  {CKM_DES_ECB, {0, 0, kCipherFlags}, CKK_DES, 0,
+   {EVP_des_ecb, EVP_des_ecb, EVP_des_ecb}},
+  {CKM_DES_CBC, {0, 0, kCipherFlags}, CKK_DES, 0,
+   {EVP_des_cbc, EVP_des_cbc, EVP_des_cbc}},
+  {CKM_DES_CBC_PAD, {0, 0, kCipherFlags}, CKK_DES, kMechanismPadded,
+   {EVP_des_cbc, EVP_des_cbc, EVP_des_cbc}},
+  {CKM_DES3_KEY_GEN, {0, 0, CKF_GENERATE}, CKK_DES3, 0},
+  {CKM_DES3_ECB, {0, 0, kCipherFlags}, CKK_DES3, 0,
+   {EVP_des_ede3, EVP_des_ede3, EVP_des_ede3}},
+  {CKM_DES3_CBC, {0, 0, kCipherFlags}, CKK_DES3, 0,
+   {EVP_des_ede3_cbc, EVP_des_ede3_cbc, EVP_des_ede3_cbc}},
+  {CKM_DES3_CBC_PAD, {0, 0, kCipherFlags}, CKK_DES3, kMechanismPadded,
+   {EVP_des_ede3_cbc, EVP_des_ede3_cbc, EVP_des_ede3_cbc}},
+  {CKM_AES_KEY_GEN, {16, 32, CKF_GENERATE}, CKK_AES, 0},
+  {CKM_AES_ECB, {16, 32, kCipherFlags}, CKK_AES, 0,
+   {EVP_aes_128_ecb, EVP_aes_192_ecb, EVP_aes_256_ecb}},
+  {CKM_AES_CBC, {16, 32, kCipherFlags}, CKK_AES, 0,
+   {EVP_aes_128_cbc, EVP_aes_192_cbc, EVP_aes_256_cbc}},
+  {CKM_AES_CBC_PAD, {16, 32, kCipherFlags}, CKK_AES, kMechanismPadded,
+   {EVP_aes_128_cbc, EVP_aes_192_cbc, EVP_aes_256_cbc}}
+};
+
+CK_FLAGS GetOperationFlag(OperationType operation) {
+  switch (operation) {
+    case kEncrypt:
+      return CKF_ENCRYPT;
+    case kDecrypt:
+      return CKF_DECRYPT;
+    case kDigest:
+      return CKF_DIGEST;
+    case kSign:
+      return CKF_SIGN;
+    case kVerify:
+      return CKF_VERIFY;
+    default:
+      return 0;
+  }
+}
+
+}  // namespace
+
+bool MechanismDescriptor::Supports(OperationType operation) const {
+  return info.flags & GetOperationFlag(operation);
+}
+
+const EVP_CIPHER* MechanismDescriptor::GetCipher(size_t key_size) const {
+  const size_t index = (key_size == 16) ? 0 : (key_size == 24) ? 1 : 2;
+  return ciphers[index] ? ciphers[index]() : NULL;
+}
+
+std::string MechanismDescriptor::GetDERDigestInfo() const {
+  if (!(flags & kMechanismDigestInfo))
+    return std::string();
+  return GetDigestAlgorithmEncoding(digest_algorithm);
+}
+
+const MechanismDescriptor* GetMechanismDescriptor(
+    CK_MECHANISM_TYPE mechanism) {
+  // A linear search; the table is small and this runs once per operation.
+  for (size_t i = 0; i < arraysize(kMechanismDescriptors); ++i) {
+    if (kMechanismDescriptors[i].type == mechanism)
+      return &kMechanismDescriptors[i];
+  }
+  return NULL;
+}
+
+const MechanismDescriptor* GetMechanismDescriptors(size_t* count) {
+  *count = arraysize(kMechanismDescriptors);
+  return kMechanismDescriptors;
+}
+
+}  // namespace p11net
@@ -0,0 +1,74 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_MECHANISM_DESCRIPTOR_H_
+#define P11NET_MECHANISM_DESCRIPTOR_H_
+
+#include <stddef.h>
+
+#include <string>
+
+#include <openssl/evp.h>
+
+#include "p11net_utility.h"
+#include "pkcs11/cryptoki.h"
+#include "session.h"
+
+namespace p11net {
+
+// The kinds of mechanism in MechanismDescriptor::flags.
+enum MechanismKind {
+  kMechanismRSA = 1 << 0,
+  kMechanismECDSA = 1 << 1,
+  kMechanismHMAC = 1 << 2,
+  // Block ciphers that add and strip PKCS #7 padding.
+  kMechanismPadded = 1 << 3,
+  // RSA signatures over a DigestInfo of digest_algorithm.
+  kMechanismDigestInfo = 1 << 4,
+};
+
+// MechanismDescriptor holds everything the module knows about a mechanism in
+// one place: what C_GetMechanismInfo reports, which operations and keys it
+// takes and the OpenSSL primitives that implement it. The session resolves
+// the descriptor once when an operation starts; the rest of the operation
+// reads it instead of dispatching on the mechanism type again.
+struct MechanismDescriptor {
+  CK_MECHANISM_TYPE type;
+  // The operations that may use the mechanism are those whose CKF_ENCRYPT,
+  // CKF_DECRYPT, CKF_DIGEST, CKF_SIGN or CKF_VERIFY flag is set.
+  CK_MECHANISM_INFO info;
+  // The type of key the operations take.
+  CK_KEY_TYPE key_type;
+  int flags;
+  // The cipher for keys of 16 bytes, 24 bytes and any other size, or NULL if
+  // the mechanism is not a cipher.
+  const EVP_CIPHER* (*ciphers[3])();
+  // The digest the mechanism applies to its input, if any.
+  const EVP_MD* (*digest)();
+  DigestAlgorithm digest_algorithm;
+
+  bool IsRSA() const { return flags & kMechanismRSA; }
+  bool IsECDSA() const { return flags & kMechanismECDSA; }
+  bool IsHMAC() const { return flags & kMechanismHMAC; }
+  bool IsPaddingEnabled() const { return flags & kMechanismPadded; }
+  // Returns true if 'operation' may use the mechanism.
+  bool Supports(OperationType operation) const;
+  // Returns NULL if the mechanism does not digest its input.
+  const EVP_MD* GetDigest() const { return digest ? digest() : NULL; }
+  const EVP_CIPHER* GetCipher(size_t key_size) const;
+  // Returns the DER DigestInfo prefix of RSA signatures; empty for mechanisms
+  // that take the DigestInfo from the caller, like CKM_RSA_PKCS.
+  std::string GetDERDigestInfo() const;
+};
+
+// Returns the descriptor of 'mechanism', or NULL if it is not supported.
+const MechanismDescriptor* GetMechanismDescriptor(CK_MECHANISM_TYPE mechanism);
+
+// Returns all descriptors, including those of key generation mechanisms, and
+// stores their number in 'count'.
+const MechanismDescriptor* GetMechanismDescriptors(size_t* count);
+
+}  // namespace p11net
+
+#endif  // P11NET_MECHANISM_DESCRIPTOR_H_
@@ -0,0 +1,371 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "p11net_utility.h"
+
+using std::string;
+
+namespace p11net {
+
+namespace Env {
+  // File that receives the metrics dump.
+  const char* kMetricsFile = "P11NET_METRICS_FILE";
+  // Seconds between two dumps to the metrics file. Zero or unset only dumps
+  // it on C_Finalize.
+  const char* kMetricsInterval = "P11NET_METRICS_INTERVAL";
+}
+
+namespace {
+
+const double kPercentiles[] = {50, 90, 99, 99.9};
+
+// Returns the label set of a sample: 'labels' with 'extra' appended.
+string FormatLabels(const string& labels, const string& extra) {
+  if (labels.empty() && extra.empty())
+    return string();
+  if (labels.empty() || extra.empty())
+    return "{" + labels + extra + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+// The phases collected for the current StartupReport.
+struct StartupPhases {
+  boost::mutex lock;
+  // Set under 'lock' while a StartupReport runs; phases read it without.
+  std::atomic<bool> collecting{false};
+  // The path and duration, in microseconds, of every phase in the order they
+  // began.
+  std::vector<std::pair<string, int64_t>> phases;
+};
+
+StartupPhases& GetStartupPhases() {
+  static StartupPhases* phases = new StartupPhases();
+  return *phases;
+}
+
+// The path of the startup phase the calling thread is in.
+thread_local string g_startup_phase_path;
+
+}  // namespace
+
+Histogram::Histogram() : count_(0), sum_(0), max_(0) {
+  for (int i = 0; i < kNumBuckets; ++i)
+    buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::Record(uint64_t value) {
+  buckets_[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Histogram::GetPercentile(double percentile) const {
+  const uint64_t total = count();
+  if (total == 0)
+    return 0;
+  // The rank of the sample that the percentile falls on, starting at one.
+  uint64_t rank = static_cast<uint64_t>(percentile / 100 * total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank)
+      return GetBucketLowerBound(i);
+  }
+  // Samples recorded while we scanned the buckets.
+  return max();
+}
+
+int Histogram::GetBucket(uint64_t value) {
+  const uint64_t kMaxValue = (static_cast<uint64_t>(1) << kMaxValueBits) - 1;
+  if (value > kMaxValue)
+    value = kMaxValue;
+  if (value < static_cast<uint64_t>(kSubBuckets))
+    return static_cast<int>(value);
+  // Values in [2^n, 2^(n+1)) share a group of kSubBuckets buckets, each
+  // 2^(n - kSubBucketBits) wide.
+  const int high_bit = 63 - __builtin_clzll(value);
+  const int shift = high_bit - kSubBucketBits;
+  const int group = shift + 1;
+  return group * kSubBuckets +
+         static_cast<int>((value >> shift) - kSubBuckets);
+}
+
+uint64_t Histogram::GetBucketLowerBound(int bucket) {
+  const int group = bucket / kSubBuckets;
+  const uint64_t sub_bucket = bucket % kSubBuckets;
+  if (group == 0)
+    return sub_bucket;
+  return (kSubBuckets + sub_bucket) << (group - 1);
+}
+
+Metrics::Metrics() : dump_interval_(0), stopping_(false) {
+  pthread_atfork(&Metrics::PrepareFork, &Metrics::ParentAfterFork,
+                 &Metrics::ChildAfterFork);
+}
+
+Metrics* Metrics::Get() {
+  // Never destroyed: metrics may be recorded by threads that outlive static
+  // destruction, e.g. pending HTTP requests.
+  static Metrics* metrics = new Metrics();
+  return metrics;
+}
+
+Counter* Metrics::GetCounter(const string& name, const string& labels) {
+  const Key key(name, labels);
+  {
+    boost::shared_lock<boost::shared_mutex> lock(lock_);
+    auto it = counters_.find(key);
+    if (it != counters_.end())
+      return it->second.get();
+  }
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  std::unique_ptr<Counter>& counter = counters_[key];
+  if (!counter)
+    counter.reset(new Counter());
+  return counter.get();
+}
+
+Gauge* Metrics::GetGauge(const string& name, const string& labels) {
+  const Key key(name, labels);
+  {
+    boost::shared_lock<boost::shared_mutex> lock(lock_);
+    auto it = gauges_.find(key);
+    if (it != gauges_.end())
+      return it->second.get();
+  }
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  std::unique_ptr<Gauge>& gauge = gauges_[key];
+  if (!gauge)
+    gauge.reset(new Gauge());
+  return gauge.get();
+}
+
+Histogram* Metrics::GetHistogram(const string& name, const string& labels) {
+  const Key key(name, labels);
+  {
+    boost::shared_lock<boost::shared_mutex> lock(lock_);
+    auto it = histograms_.find(key);
+    if (it != histograms_.end())
+      return it->second.get();
+  }
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  std::unique_ptr<Histogram>& histogram = histograms_[key];
+  if (!histogram)
+    histogram.reset(new Histogram());
+  return histogram.get();
+}
+
+string Metrics::Dump() {
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
+  std::ostringstream out;
+  const string* last_name = NULL;
+  for (auto it = counters_.begin(); it != counters_.end(); ++it) {
+    const string& name = it->first.first;
+    if (!last_name || *last_name != name)
+      out << "# TYPE " << name << " counter\n";
+    last_name = &name;
+    out << name << FormatLabels(it->first.second, string()) << " "
+        << it->second->value() << "\n";
+  }
+  last_name = NULL;
+  for (auto it = gauges_.begin(); it != gauges_.end(); ++it) {
+    const string& name = it->first.first;
+    if (!last_name || *last_name != name)
+      out << "# TYPE " << name << " gauge\n";
+    last_name = &name;
+    out << name << FormatLabels(it->first.second, string()) << " "
+        << it->second->value() << "\n";
+  }
+  last_name = NULL;
+  for (auto it = histograms_.begin(); it != histograms_.end(); ++it) {
+    const string& name = it->first.first;
+    const string& labels = it->first.second;
+    const Histogram& histogram = *it->second;
+    if (!last_name || *last_name != name)
+      out << "# TYPE " << name << " summary\n";
+    last_name = &name;
+    for (double percentile : kPercentiles) {
+      std::ostringstream quantile;
+      quantile << "quantile=\"" << percentile / 100 << "\"";
+      out << name << FormatLabels(labels, quantile.str()) << " "
+          << histogram.GetPercentile(percentile) << "\n";
+    }
+    const string label_set = FormatLabels(labels, string());
+    out << name << "_sum" << label_set << " " << histogram.sum() << "\n";
+    out << name << "_count" << label_set << " " << histogram.count() << "\n";
+    out << name << "_max" << label_set << " " << histogram.max() << "\n";
+  }
+  return out.str();
+}
+
+bool Metrics::DumpToFile(const string& path) {
+  const string temp_path = path + ".tmp";
+  {
+    std::ofstream file(temp_path.c_str(), std::ios::out | std::ios::trunc);
+    file << Dump();
+    file.close();
+    if (!file) {
+      LOG(ERROR) << "Failed to write " << temp_path;
+      remove(temp_path.c_str());
+      return false;
+    }
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to replace " << path;
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void Metrics::StartDumping() {
+  boost::lock_guard<boost::mutex> lock(dump_lock_);
+  if (!dump_path_.empty())
+    return;
+  const char* path = getenv(Env::kMetricsFile);
+  if (!path || !*path)
+    return;
+  dump_path_ = path;
+  dump_interval_ = std::chrono::seconds(GetEnvInt(Env::kMetricsInterval, 0));
+  stopping_ = false;
+  if (dump_interval_.count() > 0)
+    dump_thread_.reset(new boost::thread(&Metrics::DumpLoop, this));
+}
+
+void Metrics::StopDumping() {
+  string path;
+  {
+    boost::lock_guard<boost::mutex> lock(dump_lock_);
+    path.swap(dump_path_);
+    stopping_ = true;
+  }
+  dump_wakeup_.notify_all();
+  if (dump_thread_) {
+    dump_thread_->join();
+    dump_thread_.reset();
+  }
+  if (!path.empty())
+    DumpToFile(path);
+}
+
+void Metrics::DumpLoop() {
+  boost::unique_lock<boost::mutex> lock(dump_lock_);
+  while (!stopping_) {
+    const boost::chrono::seconds interval(dump_interval_.count());
+    if (dump_wakeup_.wait_for(lock, interval) == boost::cv_status::timeout &&
+        !stopping_) {
+      const string path = dump_path_;
+      lock.unlock();
+      DumpToFile(path);
+      lock.lock();
+    }
+  }
+}
+
+void Metrics::PrepareFork() {
+  Metrics* metrics = Get();
+  metrics->dump_lock_.lock();
+  metrics->lock_.lock();
+}
+
+void Metrics::ParentAfterFork() {
+  Metrics* metrics = Get();
+  metrics->lock_.unlock();
+  metrics->dump_lock_.unlock();
+}
+
+void Metrics::ChildAfterFork() {
+  Metrics* metrics = Get();
+  // The dump thread does not exist in the child; forget it without joining.
+  ignore_result(metrics->dump_thread_.release());
+  metrics->dump_path_.clear();
+  ParentAfterFork();
+}
+
+ScopedStartupPhase::ScopedStartupPhase(const char* name, bool standalone)
+    : parent_path_length_(g_startup_phase_path.size()),
+      report_index_(-1) {
+  // Phases that run again after startup, e.g. LoadTokenInternal on a later
+  // login, cost nothing then.
+  StartupPhases& startup = GetStartupPhases();
+  active_ = standalone || parent_path_length_ > 0 || startup.collecting;
+  if (!active_)
+    return;
+  start_ = std::chrono::steady_clock::now();
+  if (!g_startup_phase_path.empty())
+    g_startup_phase_path.push_back('/');
+  g_startup_phase_path.append(name);
+  boost::lock_guard<boost::mutex> lock(startup.lock);
+  if (startup.collecting) {
+    report_index_ = startup.phases.size();
+    startup.phases.push_back(std::make_pair(g_startup_phase_path, 0));
+  }
+}
+
+ScopedStartupPhase::~ScopedStartupPhase() {
+  if (!active_)
+    return;
+  const int64_t duration =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+  const string path = g_startup_phase_path;
+  g_startup_phase_path.resize(parent_path_length_);
+  Metrics::Get()->GetHistogram("p11net_startup_phase_duration_us",
+                               "phase=\"" + path + "\"")->Record(duration);
+  StartupPhases& startup = GetStartupPhases();
+  boost::lock_guard<boost::mutex> lock(startup.lock);
+  if (report_index_ >= 0 &&
+      static_cast<size_t>(report_index_) < startup.phases.size()) {
+    startup.phases[report_index_].second = duration;
+  } else if (parent_path_length_ == 0) {
+    LOG(INFO) << "Startup phase " << path << " took " << duration / 1000.0
+              << " ms";
+  }
+}
+
+StartupReport::StartupReport() {
+  StartupPhases& startup = GetStartupPhases();
+  {
+    boost::lock_guard<boost::mutex> lock(startup.lock);
+    startup.collecting = true;
+    startup.phases.clear();
+  }
+  phase_.reset(new ScopedStartupPhase("C_Initialize"));
+}
+
+StartupReport::~StartupReport() {
+  phase_.reset();
+  StartupPhases& startup = GetStartupPhases();
+  boost::lock_guard<boost::mutex> lock(startup.lock);
+  startup.collecting = false;
+  std::ostringstream report;
+  for (size_t i = 0; i < startup.phases.size(); ++i) {
+    report << (i ? ", " : "") << startup.phases[i].first << " "
+           << startup.phases[i].second / 1000.0 << " ms";
+  }
+  startup.phases.clear();
+  LOG(INFO) << "Startup phases: " << report.str();
+}
+
+}  // namespace p11net
@@ -0,0 +1,221 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_METRICS_H_
+#define P11NET_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace p11net {
+
+// A monotonically increasing count. Updates are a single relaxed atomic add.
+class Counter {
+ public:
+  Counter() : value_(0) {}
+
+  void Increment(uint64_t delta = 1) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_;
+
+  DISALLOW_COPY_AND_ASSIGN(Counter);
+};
+
+// A value that goes up and down, e.g. the bytes held by a cache. Updates are
+// a single relaxed atomic add.
+class Gauge {
+ public:
+  Gauge() : value_(0) {}
+
+  void Add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_;
+
+  DISALLOW_COPY_AND_ASSIGN(Gauge);
+};
+
+// A lock-free histogram of non-negative values with logarithmic buckets: every
+// power of two is split into kSubBuckets linear buckets, which bounds the
+// relative error of a reported percentile by 1/kSubBuckets. Recording a value
+// is a few relaxed atomic adds and never allocates.
+class Histogram {
+ public:
+  Histogram();
+
+  void Record(uint64_t value);
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  // Returns the lower bound of the bucket holding the given percentile
+  // (0-100), or zero if nothing was recorded.
+  uint64_t GetPercentile(double percentile) const;
+
+ private:
+  static const int kSubBucketBits = 4;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  // Values are capped at 2^40, e.g. about 12 days in microseconds.
+  static const int kMaxValueBits = 40;
+  static const int kNumBuckets =
+      (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+  static int GetBucket(uint64_t value);
+  static uint64_t GetBucketLowerBound(int bucket);
+
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+// Metrics owns every counter, gauge and histogram of the process. Metrics are
+// identified by a name and an optional Prometheus label set, e.g.
+// GetHistogram("p11net_call_duration_us", "function=\"C_Sign\""). They are
+// created on first use and live as long as the process, so callers cache the
+// returned pointers. Sample usage:
+//    static Counter* errors = Metrics::Get()->GetCounter("p11net_errors");
+//    errors->Increment();
+//    std::string text = Metrics::Get()->Dump();
+class Metrics {
+ public:
+  // Returns the process-wide instance.
+  static Metrics* Get();
+
+  Counter* GetCounter(const std::string& name,
+                      const std::string& labels = std::string());
+  Gauge* GetGauge(const std::string& name,
+                  const std::string& labels = std::string());
+  Histogram* GetHistogram(const std::string& name,
+                          const std::string& labels = std::string());
+
+  // Returns every metric in the Prometheus text exposition format. Histograms
+  // are reported as summaries with their count, sum, maximum and the 50th,
+  // 90th, 99th and 99.9th percentiles.
+  std::string Dump();
+  // Writes Dump() to 'path', replacing the file atomically. Returns true on
+  // success.
+  bool DumpToFile(const std::string& path);
+
+  // Starts rewriting the file named by P11NET_METRICS_FILE, if set, every
+  // P11NET_METRICS_INTERVAL seconds. Does nothing if already started.
+  void StartDumping();
+  // Stops the periodic dump and writes the file one last time.
+  void StopDumping();
+
+ private:
+  typedef std::pair<std::string, std::string> Key;
+
+  Metrics();
+  void DumpLoop();
+
+  // Fork handlers. The child gets no dump thread, and the locks might have
+  // been held by a thread that only exists in the parent.
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+
+  boost::shared_mutex lock_;
+  std::map<Key, std::unique_ptr<Counter>> counters_;
+  std::map<Key, std::unique_ptr<Gauge>> gauges_;
+  std::map<Key, std::unique_ptr<Histogram>> histograms_;
+
+  std::string dump_path_;
+  std::chrono::seconds dump_interval_;
+  std::unique_ptr<boost::thread> dump_thread_;
+  boost::mutex dump_lock_;
+  boost::condition_variable dump_wakeup_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(Metrics);
+};
+
+// Records the lifetime of the object in a histogram, in microseconds.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(Histogram* histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() {
+    histogram_->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedLatency);
+};
+
+// Times a phase of module startup, e.g. loading a token. Phases nest per
+// thread and are named by their path, e.g. "C_Initialize/LoadTokenInternal".
+// The duration of every phase is recorded in p11net_startup_phase_duration_us;
+// phases within C_Initialize are also reported by the enclosing StartupReport.
+// Outside C_Initialize, only 'standalone' phases, which the caller runs once,
+// e.g. the first LoadKeys, and the phases nested in them are timed; such an
+// outermost phase is logged once it ends.
+class ScopedStartupPhase {
+ public:
+  explicit ScopedStartupPhase(const char* name, bool standalone = false);
+  ~ScopedStartupPhase();
+
+ private:
+  // Whether the phase is timed.
+  bool active_;
+  // The length of the path of the enclosing phase.
+  size_t parent_path_length_;
+  // The entry of the phase in the startup report, or -1.
+  int report_index_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedStartupPhase);
+};
+
+// Collects the startup phases that run during the lifetime of the object, the
+// C_Initialize call, and logs their durations once it ends.
+class StartupReport {
+ public:
+  StartupReport();
+  ~StartupReport();
+
+ private:
+  std::unique_ptr<ScopedStartupPhase> phase_;
+
+  DISALLOW_COPY_AND_ASSIGN(StartupReport);
+};
+
+// Records the duration of the enclosing PKCS #11 entry point in
+// p11net_call_duration_us.
+#define P11NET_TIME_CALL() \
+  static p11net::Histogram* const call_duration_histogram = \
+      p11net::Metrics::Get()->GetHistogram( \
+          "p11net_call_duration_us", \
+          std::string("function=\"") + __func__ + "\""); \
+  p11net::ScopedLatency call_duration(call_duration_histogram)
+
+}  // namespace p11net
+
+#endif  // P11NET_METRICS_H_
@@ -0,0 +1,379 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "multi_digest.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <openssl/sha.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define P11NET_MULTI_DIGEST_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "metrics.h"
+#include "p11net_utility.h"
+
+using std::string;
+using std::vector;
+
+namespace p11net {
+
+namespace Env {
+  // Microseconds a single-part SHA-256 digest waits for concurrent digests to
+  // share the vector lanes with. Zero or unset disables the engine.
+  const char* kMultiDigestWindow = "P11NET_MULTI_DIGEST_WINDOW_US";
+}
+
+namespace {
+
+const size_t kLanes = 8;
+const size_t kBlockBytes = 64;
+const size_t kDigestBytes = 32;
+// Lanes run in lockstep until the longest message is hashed, so a long message
+// would leave the others idle; EVP hashes those.
+const size_t kMaxLaneMessageBytes = 4096;
+
+bool EVPDigest(const EVP_MD* md, const string& data, string* digest) {
+  unsigned char buffer[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  if (!EVP_Digest(data.data(), data.length(), buffer, &length, md, NULL))
+    return false;
+  digest->assign(reinterpret_cast<char*>(buffer), length);
+  return true;
+}
+
+#if defined(P11NET_MULTI_DIGEST_AVX2)
+
+const uint32_t kInitialState[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const uint32_t kRoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint8_t kZeroBlock[kBlockBytes] = {0};
+
+bool HasAVX2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+inline uint32_t LoadBigEndian(const uint8_t* bytes) {
+  return (static_cast<uint32_t>(bytes[0]) << 24) |
+         (static_cast<uint32_t>(bytes[1]) << 16) |
+         (static_cast<uint32_t>(bytes[2]) << 8) |
+         static_cast<uint32_t>(bytes[3]);
+}
+
+inline void StoreBigEndian(uint32_t value, uint8_t* bytes) {
+  bytes[0] = static_cast<uint8_t>(value >> 24);
+  bytes[1] = static_cast<uint8_t>(value >> 16);
+  bytes[2] = static_cast<uint8_t>(value >> 8);
+  bytes[3] = static_cast<uint8_t>(value);
+}
+
+// The padded blocks of the message in one lane: the full blocks are read in
+// place and the last one or two, which hold the padding, are built in 'tail'.
+// An unused lane has no blocks.
+struct Lane {
+  Lane() : data(NULL), full_blocks(0), blocks(0) {}
+
+  const uint8_t* Block(size_t index) const {
+    if (index < full_blocks)
+      return data + index * kBlockBytes;
+    if (index < blocks)
+      return tail + (index - full_blocks) * kBlockBytes;
+    return kZeroBlock;
+  }
+
+  const uint8_t* data;
+  size_t full_blocks;
+  size_t blocks;
+  uint8_t tail[2 * kBlockBytes];
+};
+
+void PrepareLane(const string& message, Lane* lane) {
+  const size_t length = message.length();
+  const size_t rest = length % kBlockBytes;
+  lane->data = reinterpret_cast<const uint8_t*>(message.data());
+  lane->full_blocks = length / kBlockBytes;
+  // The padding is a 0x80 byte, zeros and the length in bits as 8 bytes.
+  const size_t tail_bytes = (rest + 9 > kBlockBytes ? 2 : 1) * kBlockBytes;
+  lane->blocks = lane->full_blocks + tail_bytes / kBlockBytes;
+  memset(lane->tail, 0, tail_bytes);
+  memcpy(lane->tail, lane->data + lane->full_blocks * kBlockBytes, rest);
+  lane->tail[rest] = 0x80;
+  const uint64_t bits = static_cast<uint64_t>(length) * 8;
+  for (size_t i = 0; i < 8; ++i)
+    lane->tail[tail_bytes - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+}
+
+__attribute__((target("avx2")))
+inline __m256i Rotate(__m256i x, int bits) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, bits),
+                         _mm256_slli_epi32(x, 32 - bits));
+}
+
+__attribute__((target("avx2")))
+inline __m256i Add(__m256i a, __m256i b) {
+  return _mm256_add_epi32(a, b);
+}
+
+__attribute__((target("avx2")))
+inline __m256i Xor3(__m256i a, __m256i b, __m256i c) {
+  return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+// Runs SHA-256 on the eight lanes side by side, one block of each per
+// iteration. A lane whose blocks are used up keeps its state.
+__attribute__((target("avx2")))
+void HashLanesAVX2(const Lane* lanes, uint8_t digests[][kDigestBytes]) {
+  __m256i state[8];
+  for (int i = 0; i < 8; ++i)
+    state[i] = _mm256_set1_epi32(kInitialState[i]);
+  int32_t block_counts[kLanes];
+  size_t max_blocks = 0;
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    block_counts[lane] = static_cast<int32_t>(lanes[lane].blocks);
+    max_blocks = std::max(max_blocks, lanes[lane].blocks);
+  }
+  const __m256i counts =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block_counts));
+  for (size_t index = 0; index < max_blocks; ++index) {
+    const uint8_t* block[kLanes];
+    for (size_t lane = 0; lane < kLanes; ++lane)
+      block[lane] = lanes[lane].Block(index);
+    __m256i w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = _mm256_setr_epi32(
+          LoadBigEndian(block[0] + 4 * i), LoadBigEndian(block[1] + 4 * i),
+          LoadBigEndian(block[2] + 4 * i), LoadBigEndian(block[3] + 4 * i),
+          LoadBigEndian(block[4] + 4 * i), LoadBigEndian(block[5] + 4 * i),
+          LoadBigEndian(block[6] + 4 * i), LoadBigEndian(block[7] + 4 * i));
+    }
+    for (int i = 16; i < 64; ++i) {
+      const __m256i s0 = Xor3(Rotate(w[i - 15], 7), Rotate(w[i - 15], 18),
+                              _mm256_srli_epi32(w[i - 15], 3));
+      const __m256i s1 = Xor3(Rotate(w[i - 2], 17), Rotate(w[i - 2], 19),
+                              _mm256_srli_epi32(w[i - 2], 10));
+      w[i] = Add(Add(w[i - 16], s0), Add(w[i - 7], s1));
+    }
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      const __m256i s1 = Xor3(Rotate(e, 6), Rotate(e, 11), Rotate(e, 25));
+      const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                          _mm256_andnot_si256(e, g));
+      const __m256i t1 = Add(Add(Add(h, s1), ch),
+                             Add(_mm256_set1_epi32(kRoundConstants[i]), w[i]));
+      const __m256i s0 = Xor3(Rotate(a, 2), Rotate(a, 13), Rotate(a, 22));
+      const __m256i maj = _mm256_or_si256(
+          _mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+      h = g;
+      g = f;
+      f = e;
+      e = Add(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = Add(t1, Add(s0, maj));
+    }
+    const __m256i working[8] = {a, b, c, d, e, f, g, h};
+    const __m256i active =
+        _mm256_cmpgt_epi32(counts, _mm256_set1_epi32(index));
+    for (int i = 0; i < 8; ++i) {
+      state[i] = _mm256_blendv_epi8(state[i], Add(state[i], working[i]),
+                                    active);
+    }
+  }
+  uint32_t words[8][kLanes];
+  for (int i = 0; i < 8; ++i)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    for (int i = 0; i < 8; ++i)
+      StoreBigEndian(words[i][lane], digests[lane] + 4 * i);
+  }
+}
+
+#else
+
+bool HasAVX2() {
+  return false;
+}
+
+#endif
+
+}  // namespace
+
+MultiDigest::MultiDigest()
+    : window_(std::max(GetEnvInt(Env::kMultiDigestWindow, 0), 0)),
+      has_lanes_(HasAVX2()),
+      callers_(0),
+      lane_messages_(Metrics::Get()->GetCounter(
+          "p11net_multi_digest_lane_messages_total")),
+      batch_sizes_(Metrics::Get()->GetHistogram(
+          "p11net_multi_digest_batch_size")) {
+  open_.reserve(kLanes);
+  pthread_atfork(&MultiDigest::PrepareFork,
+                 &MultiDigest::ParentAfterFork,
+                 &MultiDigest::ChildAfterFork);
+}
+
+MultiDigest* MultiDigest::Get() {
+  // Never destroyed, like the metrics it records to.
+  static MultiDigest* engine = new MultiDigest();
+  return engine;
+}
+
+bool MultiDigest::Digest(const EVP_MD* md,
+                         const string& data,
+                         string* digest) {
+  if (!UsesLanes(md, data.length()))
+    return EVPDigest(md, data, digest);
+  // Alone, there is nobody to wait for.
+  if (++callers_ < 2) {
+    --callers_;
+    return EVPDigest(md, data, digest);
+  }
+  Request request;
+  request.data = &data;
+  request.done = false;
+  boost::unique_lock<boost::mutex> lock(lock_);
+  if (open_.size() >= kLanes) {
+    // The batch is full and about to be hashed.
+    lock.unlock();
+    --callers_;
+    return EVPDigest(md, data, digest);
+  }
+  open_.push_back(&request);
+  if (open_.size() == 1) {
+    batch_full_.wait_for(lock, window_,
+                         [this] { return open_.size() >= kLanes; });
+    Request* batch[kLanes];
+    const size_t count = open_.size();
+    std::copy(open_.begin(), open_.end(), batch);
+    open_.clear();
+    lock.unlock();
+    HashBatch(batch, count);
+    lock.lock();
+    for (size_t i = 0; i < count; ++i)
+      batch[i]->done = true;
+    batch_done_.notify_all();
+  } else {
+    if (open_.size() == kLanes)
+      batch_full_.notify_one();
+    batch_done_.wait(lock, [&request] { return request.done; });
+  }
+  lock.unlock();
+  --callers_;
+  digest->assign(reinterpret_cast<char*>(request.digest),
+                 sizeof(request.digest));
+  return true;
+}
+
+bool MultiDigest::DigestAll(const EVP_MD* md,
+                            const vector<string>& data,
+                            vector<string>* digests) {
+  digests->assign(data.size(), string());
+  Request requests[kLanes];
+  Request* batch[kLanes];
+  size_t indices[kLanes];
+  size_t count = 0;
+  for (size_t i = 0; i < data.size(); ++i) {
+    if (!UsesLanes(md, data[i].length())) {
+      if (!EVPDigest(md, data[i], &(*digests)[i]))
+        return false;
+      continue;
+    }
+    requests[count].data = &data[i];
+    batch[count] = &requests[count];
+    indices[count] = i;
+    if (++count < kLanes)
+      continue;
+    FinishBatch(batch, indices, count, digests);
+    count = 0;
+  }
+  // The last messages may not fill the lanes, and may be followed by ones
+  // that went through EVP_Digest.
+  if (count > 0)
+    FinishBatch(batch, indices, count, digests);
+  return true;
+}
+
+void MultiDigest::FinishBatch(Request* const* requests,
+                              const size_t* indices,
+                              size_t count,
+                              vector<string>* digests) {
+  HashBatch(requests, count);
+  for (size_t i = 0; i < count; ++i) {
+    (*digests)[indices[i]].assign(
+        reinterpret_cast<char*>(requests[i]->digest), kDigestBytes);
+  }
+}
+
+bool MultiDigest::UsesLanes(const EVP_MD* md, size_t length) const {
+  return IsEnabled() && has_lanes_ && EVP_MD_type(md) == NID_sha256 &&
+         length <= kMaxLaneMessageBytes;
+}
+
+void MultiDigest::HashBatch(Request* const* requests, size_t count) {
+  batch_sizes_->Record(count);
+#if defined(P11NET_MULTI_DIGEST_AVX2)
+  if (count >= 2) {
+    Lane lanes[kLanes];
+    for (size_t i = 0; i < count; ++i)
+      PrepareLane(*requests[i]->data, &lanes[i]);
+    uint8_t digests[kLanes][kDigestBytes];
+    HashLanesAVX2(lanes, digests);
+    for (size_t i = 0; i < count; ++i)
+      memcpy(requests[i]->digest, digests[i], kDigestBytes);
+    lane_messages_->Increment(count);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < count; ++i) {
+    const string& data = *requests[i]->data;
+    SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.length(),
+           requests[i]->digest);
+  }
+}
+
+void MultiDigest::PrepareFork() {
+  Get()->lock_.lock();
+}
+
+void MultiDigest::ParentAfterFork() {
+  Get()->lock_.unlock();
+}
+
+void MultiDigest::ChildAfterFork() {
+  MultiDigest* engine = Get();
+  engine->open_.clear();
+  engine->callers_ = 0;
+  engine->lock_.unlock();
+}
+
+}  // namespace p11net
@@ -0,0 +1,100 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_MULTI_DIGEST_H_
+#define P11NET_MULTI_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <openssl/evp.h>
+
+namespace p11net {
+
+class Counter;
+class Histogram;
+
+// MultiDigest computes SHA-256 digests of short messages eight at a time, one
+// message per 32-bit lane of the AVX2 registers. Single-part digests from
+// concurrent sessions are gathered into a batch: the first caller waits up to
+// P11NET_MULTI_DIGEST_WINDOW_US microseconds for others to fill the lanes,
+// then hashes the batch for everyone in it. Other digests, long messages,
+// CPUs without AVX2 and callers with nobody to share the lanes with go
+// through EVP_Digest. The engine is off unless the window is set; it pays for
+// itself on CPUs without the SHA extensions, which OpenSSL uses on its own.
+// There is one engine per process. Sample usage:
+//    std::string digest;
+//    if (!MultiDigest::Get()->Digest(EVP_sha256(), message, &digest))
+//      return CKR_FUNCTION_FAILED;
+class MultiDigest {
+ public:
+  static MultiDigest* Get();
+
+  // Returns true if digests may be batched at all.
+  bool IsEnabled() const { return window_.count() > 0; }
+
+  // Computes the 'md' digest of 'data' into 'digest', sharing the lanes with
+  // concurrent callers. Returns false on failure.
+  bool Digest(const EVP_MD* md, const std::string& data, std::string* digest);
+  // Computes the 'md' digests of every message in 'data' into 'digests'. The
+  // messages are spread over the lanes right away, without waiting for other
+  // callers. Returns false on failure.
+  bool DigestAll(const EVP_MD* md,
+                 const std::vector<std::string>& data,
+                 std::vector<std::string>* digests);
+
+ private:
+  // A message waiting in a batch; owned by the caller that waits for it.
+  struct Request {
+    const std::string* data;
+    uint8_t digest[32];
+    bool done;
+  };
+
+  MultiDigest();
+  // Returns true if the 'md' digest of a message of 'length' bytes can be
+  // computed in a lane.
+  bool UsesLanes(const EVP_MD* md, size_t length) const;
+  // Hashes up to eight requests, in lanes when there are at least two.
+  void HashBatch(Request* const* requests, size_t count);
+  // Hashes a batch of DigestAll and stores the digest of each request at its
+  // index in 'digests'.
+  void FinishBatch(Request* const* requests,
+                   const size_t* indices,
+                   size_t count,
+                   std::vector<std::string>* digests);
+
+  // Fork handlers. A batch that is gathering in the parent belongs to
+  // threads that do not exist in the child.
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+
+  boost::chrono::microseconds window_;
+  bool has_lanes_;
+  // The number of callers in Digest that could share the lanes.
+  std::atomic<int> callers_;
+  boost::mutex lock_;
+  // The batch that is gathering; its first request belongs to the caller
+  // that hashes it.
+  std::vector<Request*> open_;
+  boost::condition_variable batch_full_;
+  boost::condition_variable batch_done_;
+  Counter* lane_messages_;
+  Histogram* batch_sizes_;
+
+  DISALLOW_COPY_AND_ASSIGN(MultiDigest);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_MULTI_DIGEST_H_
@@ -5,16 +5,79 @@
 #ifndef P11NET_NET_UTILITY_H_
 #define P11NET_NET_UTILITY_H_
 
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
 #include <boost/optional.hpp>
 
 namespace p11net {
 
+class Object;
+
+// A key action endpoint of the NetHSM and the fields of its request and
+// response.
+struct KeyAction {
+  KeyAction(const std::string& location,
+            const char* action,
+            const char* input_field,
+            const char* output_field)
+      : path(location + action),
+        endpoint(path.substr(path.rfind('/') + 1)),
+        input_field(input_field),
+        output_field(output_field) {}
+
+  // The request path, e.g. /keys/webserver/actions/pkcs1/sign.
+  const std::string path;
+  // The last component of the path, which labels the request in metrics.
+  const std::string endpoint;
+  const std::string input_field;
+  const std::string output_field;
+};
+
+// KeyTarget is what a NetHSM operation needs to know about a key, resolved
+// once from its location: the key identifier, which routes its requests and
+// selects its cached signatures, and the request paths of its actions. It is
+// immutable, so operations in flight share it. Sample usage:
+//    std::shared_ptr<const KeyTarget> key =
+//        std::make_shared<KeyTarget>("/keys/webserver");
+//    net_utility->Sign(key, digest_info, kInteractivePriority);
+struct KeyTarget {
+  explicit KeyTarget(const std::string& location)
+      : location(location),
+        key_id(location.substr(location.rfind('/') + 1)),
+        decrypt(location, "/actions/pkcs1/decrypt", "encrypted", "decrypted"),
+        sign(location, "/actions/pkcs1/sign", "message", "signedMessage"),
+        ecdsa_sign(location, "/actions/ecdsa/sign", "message",
+                   "signedMessage") {}
+
+  // The location of the key, e.g. /keys/webserver.
+  const std::string location;
+  const std::string key_id;
+  const KeyAction decrypt;
+  const KeyAction sign;
+  const KeyAction ecdsa_sign;
+};
+
+// The scheduling class of a NetHSM request. When requests have to wait for
+// the NetHSM, interactive ones, e.g. TLS handshake signatures, are served
+// ahead of bulk ones.
+enum RequestPriority {
+  kInteractivePriority,
+  kBulkPriority,
+  kNumRequestPriorities
+};
+
 // NetUtility is a high-level interface to NetHSM services. In practice, only a
 // single instance of this class is necessary to provide network services across
 // multiple logical tokens and sessions.
 class NetUtility {
  public:
+  // Receives the result of an asynchronous operation. An empty result
+  // indicates that the operation failed.
+  typedef std::function<void(const boost::optional<std::string>&)>
+      ResultCallback;
+
   virtual ~NetUtility() {}
 
   // Performs initialization tasks.
@@ -22,7 +85,33 @@ class NetUtility {
   // Returns true on success.
   virtual bool Init() = 0;
 
-  virtual bool LoadKeys(const std::string& key_id) = 0;
+  // Makes the NetHSM keys that may match the given search template available
+  // in the token object pool. A template with CKA_ID or CKA_LABEL loads only
+  // that key; a template no NetHSM key can match loads nothing. Keys that were
+  // loaded recently are served from the key inventory cache without contacting
+  // the NetHSM. Returns true on success.
+  virtual bool LoadKeys(const Object& search_template) = 0;
+
+  // Discards the key inventory cache so that the next LoadKeys call fetches
+  // the keys from the NetHSM again. Objects already in the token object pool
+  // are left in place.
+  virtual void InvalidateKeys() = 0;
+
+  // Returns the objects of an evicted NetHSM key to the token object pool,
+  // under the handles they had, if 'handle' was one of them. Keys are evicted
+  // when the number of keys in the pool is capped. Returns true if the objects
+  // were restored.
+  virtual bool RestoreObject(int handle) = 0;
+
+  // Records a use of the token object 'object' so that the NetHSM key it
+  // belongs to, if any, is not evicted while it is in use.
+  virtual void MarkKeyUsed(const Object& object) = 0;
+  // Fetches the value of the certificate object with the given handle from
+  // the NetHSM if it is still a stub. Certificates of NetHSM keys are listed
+  // without their value, which is only fetched once it is read. A stub whose
+  // key turns out to have no certificate is deleted. Returns false if the
+  // NetHSM could not be reached.
+  virtual bool LoadCertificate(int handle) = 0;
 
   // Retrieves the public components of an RSA key pair. Returns true on
   // success.
@@ -30,11 +119,74 @@ class NetUtility {
   //                           std::string* public_exponent,
   //                           std::string* modulus) = 0;
 
-  virtual boost::optional<std::string> Decrypt(const std::string& key_id,
-                                               const std::string& input) = 0;
+  virtual boost::optional<std::string> Decrypt(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority) = 0;
+
+  virtual boost::optional<std::string> Sign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority) = 0;
+
+  // Signs a digest with an EC key. Returns the DER-encoded ECDSA-Sig-Value.
+  virtual boost::optional<std::string> ECDSASign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& digest,
+      RequestPriority priority) = 0;
+
+  // Returns true if the last Decrypt, Sign or ECDSASign of the calling thread
+  // failed because the NetHSM was at its request limit, rather than because
+  // the request itself failed. After DecryptAsync or SignAsync, returns true if
+  // the request was turned away for that reason.
+  virtual bool LastCallRejected() = 0;
+
+  // Returns how long a Decrypt, Sign or ECDSASign may take before it fails,
+  // or zero if there is no limit. Callers of the non-blocking variants give
+  // up waiting for the callback after as long.
+  virtual std::chrono::milliseconds GetOperationDeadline() = 0;
+
+  // Non-blocking variants of Decrypt and Sign. These return immediately and
+  // invoke 'callback' exactly once when the NetHSM has answered. The callback
+  // may run on a network worker thread and must not block. A request that
+  // would have to wait for a slot under the request limit is turned away
+  // rather than queued.
+  virtual void DecryptAsync(const std::shared_ptr<const KeyTarget>& key,
+                            const std::string& input,
+                            RequestPriority priority,
+                            const ResultCallback& callback) = 0;
+  virtual void SignAsync(const std::shared_ptr<const KeyTarget>& key,
+                         const std::string& input,
+                         RequestPriority priority,
+                         const ResultCallback& callback) = 0;
+
+  // Generates an RSA key pair on the NetHSM and makes it available in the
+  // token object pool. An empty key_id lets the NetHSM choose the identifier.
+  // The key is usable for signing if 'for_signing' is true, for decryption
+  // otherwise. Returns the identifier of the new key, or an empty result on
+  // failure.
+  virtual boost::optional<std::string> GenerateKeyPair(
+      int modulus_bits,
+      const std::string& key_id,
+      bool for_signing) = 0;
+
+  // Non-blocking variant of GenerateKeyPair. 'callback' receives the
+  // identifier of the new key once it is in the token object pool.
+  virtual void GenerateKeyPairAsync(int modulus_bits,
+                                    const std::string& key_id,
+                                    bool for_signing,
+                                    const ResultCallback& callback) = 0;
+
+  // Sets a callback invoked with false when the NetHSM becomes unreachable
+  // and with true when it is reachable again. It runs on a background thread
+  // and must not block. This must be called before Init.
+  virtual void SetReachabilityCallback(
+      const std::function<void(bool)>& callback) = 0;
 
-  virtual boost::optional<std::string> Sign(const std::string& key_id,
-                                            const std::string& input) = 0;
+  // Fills 'random_data' with 'num_bytes' random bytes from the NetHSM. Returns
+  // false if the NetHSM is not configured as a random source or cannot serve
+  // the request right now; the caller should then use its own generator.
+  virtual bool GenerateRandom(int num_bytes, std::string* random_data) = 0;
 };
 
 }  // namespace p11net
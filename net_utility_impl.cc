@@ -4,14 +4,50 @@
 
 #include "net_utility_impl.h"
 
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <random>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread/lock_guard.hpp>
+
 #include <base/logging.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <pplx/threadpool.h>
+
+#include "cppcodec/parse_error.hpp"
 
-#include "cppcodec/base64_default_url.hpp"
+#include "base64_simd.h"
+#include "http_transport.h"
+#include "io_threads.h"
+#include "metrics.h"
+#include "nethsm_cluster.h"
+#include "nethsm_codec.h"
+#include "shared_key_cache.h"
+#include "tracing.h"
 
 #include "p11net_factory.h"
 #include "object.h"
 #include "object_pool.h"
+#include "object_store.h"
 #include "p11net.h"
+#include "p11net_utility.h"
 #include "nlohmann/json.hpp"
 
 using JSON = nlohmann::json;
@@ -23,189 +59,3025 @@ namespace Env {
   const char* kUrl = "P11NET_URL";
   const char* kUser = "P11NET_USER";
   const char* kPassword = "P11NET_PASSWORD";
+  // Lifetime of cached key inventory entries, in seconds.
+  const char* kKeyCacheTtl = "P11NET_KEY_CACHE_TTL";
+  // How long past its lifetime an entry is still served, in seconds, while
+  // it is fetched again in the background, e.g. during a NetHSM outage.
+  // Beyond it, lookups wait for the NetHSM. Zero always waits.
+  const char* kKeyCacheMaxStale = "P11NET_KEY_CACHE_MAX_STALE";
+  // Maximum number of concurrent key requests while loading the inventory.
+  const char* kMaxInflightKeyFetches = "P11NET_MAX_INFLIGHT_KEY_FETCHES";
+  // Maximum number of pooled HTTP clients per NetHSM endpoint.
+  const char* kHttpPoolSize = "P11NET_HTTP_POOL_SIZE";
+  // Timeout for a single HTTP request, in seconds.
+  const char* kHttpTimeout = "P11NET_HTTP_TIMEOUT";
+  // Interval between NetHSM health probes, in seconds. Zero disables probing.
+  const char* kHealthCheckInterval = "P11NET_HEALTH_CHECK_INTERVAL";
+  // Deadline for a blocking Sign or Decrypt, in milliseconds. Zero waits for
+  // the HTTP timeout instead.
+  const char* kOperationDeadline = "P11NET_OPERATION_DEADLINE_MS";
+  // Latency percentile (1-99) after which a Sign or Decrypt is hedged with a
+  // duplicate request to another node. Zero disables hedging.
+  const char* kHedgePercentile = "P11NET_HEDGE_PERCENTILE";
+  // The number of times a Sign, Decrypt or key request is retried after it
+  // got no response or a server error. Requests without a response go to
+  // another node right away; the others first wait for a random backoff of
+  // up to P11NET_RETRY_BACKOFF_MS, doubling with every retry. Retries never
+  // go past the operation deadline. Zero disables retries.
+  const char* kMaxRetries = "P11NET_MAX_RETRIES";
+  const char* kRetryBackoff = "P11NET_RETRY_BACKOFF_MS";
+  // Consecutive failures after which a node is skipped, and for how many
+  // seconds. Zero failures disables the circuit breaker.
+  const char* kBreakerFailures = "P11NET_BREAKER_FAILURES";
+  const char* kBreakerCooldown = "P11NET_BREAKER_COOLDOWN";
+  // Set to "affinity" to route the requests for a key to the node it maps to
+  // on a consistent hash ring, rather than to the least busy node.
+  const char* kRouting = "P11NET_ROUTING";
+  // How far the preferred node of a key may exceed the mean number of
+  // outstanding requests before requests spill over, in percent.
+  const char* kAffinityLoadFactor = "P11NET_AFFINITY_LOAD_FACTOR";
+  // Set to "http2" to multiplex Sign and Decrypt requests as HTTP/2 streams
+  // over up to P11NET_HTTP2_CONNECTIONS connections per node, or to "curl" to
+  // send them over up to P11NET_HTTP_POOL_SIZE persistent HTTP/1.1
+  // connections. Either way a libcurl thread per node drives the requests in
+  // place of the cpprest client. Over https, libcurl speaks HTTP/1.1 to a
+  // node that does not offer HTTP/2; clear-text nodes must speak HTTP/2. If
+  // libcurl lacks HTTP/2, every node stays on the cpprest client.
+  const char* kTransport = "P11NET_TRANSPORT";
+  const char* kHttp2Connections = "P11NET_HTTP2_CONNECTIONS";
+  // The longest the libcurl transports use the addresses of a NetHSM host
+  // before looking it up again, in seconds; shorter DNS record TTLs take
+  // precedence. Lookups run in the background, so connections never wait
+  // for DNS, and the last addresses stay in use while lookups fail. Zero
+  // resolves the host whenever a connection is opened.
+  const char* kDnsCacheTtl = "P11NET_DNS_CACHE_TTL";
+  // The number of network I/O threads of the process, which run the HTTP
+  // clients and their continuations, and the CPUs to pin them to, either as a
+  // list like "0-7,16-23" or as the CPUs of a NUMA node. Pinned threads
+  // default to one per CPU; otherwise zero keeps the size cpprest picks. The
+  // first module initialized in a process configures the threads for all
+  // appliances.
+  const char* kIoThreads = "P11NET_IO_THREADS";
+  const char* kIoCpus = "P11NET_IO_CPUS";
+  const char* kIoNumaNode = "P11NET_IO_NUMA_NODE";
+  // Interval between background refreshes of the key inventory, in seconds.
+  // Zero disables the refresher.
+  const char* kKeyRefreshInterval = "P11NET_KEY_REFRESH_INTERVAL";
+  // Lifetime of cached "key does not exist" answers, in seconds. Zero
+  // disables the negative cache.
+  const char* kNegativeCacheTtl = "P11NET_NEGATIVE_CACHE_TTL";
+  // Whether the certificates of NetHSM keys are listed as CKO_CERTIFICATE
+  // objects (1) or not (0, the default). Their value is only fetched from the
+  // NetHSM when it is first read.
+  const char* kCertificates = "P11NET_CERTIFICATES";
+  // Set to "nethsm" to serve C_GenerateRandom from the NetHSM.
+  const char* kRandomSource = "P11NET_RANDOM_SOURCE";
+  // The number of NetHSM random bytes buffered in memory.
+  const char* kRandomPoolSize = "P11NET_RANDOM_POOL_SIZE";
+  // Whether C_GenerateRandom falls back to OpenSSL when the buffer is empty
+  // (1, the default) or waits for the NetHSM (0).
+  const char* kRandomFallback = "P11NET_RANDOM_FALLBACK";
+  // Window in microseconds during which concurrent sign requests for the same
+  // key are coalesced into one burst. Zero disables coalescing.
+  const char* kSignCoalesceWindow = "P11NET_SIGN_COALESCE_WINDOW_US";
+  // The number of HTTP clients per NetHSM node to connect in the background
+  // during initialization, which also loads the key inventory then. Zero
+  // defers both to the first request.
+  const char* kPrewarmConnections = "P11NET_PREWARM_CONNECTIONS";
+  // The shm_open name, e.g. "/p11net-keys", of a key inventory shared by
+  // every process on the host. Unset keeps the inventory per process.
+  const char* kSharedKeyCache = "P11NET_SHARED_KEY_CACHE";
+  // The size of the shared key inventory segment, in bytes.
+  const char* kSharedKeyCacheSize = "P11NET_SHARED_KEY_CACHE_SIZE";
+  // The maximum number of NetHSM keys whose objects are kept in the token
+  // object pool. Beyond it, the least recently used keys are evicted and
+  // restored from the key inventory when they are used again. Zero, the
+  // default, keeps every key.
+  const char* kMaxResidentKeys = "P11NET_MAX_RESIDENT_KEYS";
+  // How long a key must go unused before it may be evicted, in seconds.
+  const char* kKeyEvictionIdle = "P11NET_KEY_EVICTION_IDLE";
+  // The maximum number of Sign and Decrypt requests in flight to the NetHSM.
+  // Requests beyond it wait or fail with CKR_DEVICE_ERROR. Zero, the default,
+  // sets no limit.
+  const char* kMaxInflightActions = "P11NET_MAX_INFLIGHT_ACTIONS";
+  // The number of requests that may wait for a slot, and for how long, in
+  // milliseconds. Zero fails requests over the limit right away.
+  const char* kActionQueueDepth = "P11NET_ACTION_QUEUE_DEPTH";
+  const char* kActionQueueTimeout = "P11NET_ACTION_QUEUE_TIMEOUT_MS";
+  // The latency in milliseconds the request limit adapts to, lowering it
+  // while requests are slower and raising it again while they are faster,
+  // down to P11NET_MIN_INFLIGHT_ACTIONS. Zero keeps the limit fixed.
+  const char* kActionTargetLatency = "P11NET_ACTION_TARGET_LATENCY_MS";
+  const char* kMinInflightActions = "P11NET_MIN_INFLIGHT_ACTIONS";
+  // While requests wait for a slot, freed slots go to interactive and bulk
+  // requests in the ratio of these weights. The reserve is the number of
+  // slots bulk requests may not fill, so that interactive requests find one
+  // free even while bulk requests saturate the limit.
+  const char* kInteractiveWeight = "P11NET_INTERACTIVE_WEIGHT";
+  const char* kBulkWeight = "P11NET_BULK_WEIGHT";
+  const char* kInteractiveReserve = "P11NET_INTERACTIVE_RESERVE";
+  // A comma-separated list of the identifiers of the keys whose signatures
+  // are cached, or "*" for all keys. PKCS #1 v1.5 signatures are
+  // deterministic, so a repeated input is signed without a round trip. Up to
+  // P11NET_SIGNATURE_CACHE_SIZE signatures are served for
+  // P11NET_SIGNATURE_CACHE_TTL seconds.
+  const char* kSignatureCacheKeys = "P11NET_SIGNATURE_CACHE_KEYS";
+  const char* kSignatureCacheSize = "P11NET_SIGNATURE_CACHE_SIZE";
+  const char* kSignatureCacheTtl = "P11NET_SIGNATURE_CACHE_TTL";
+}
+
+const int kDefaultKeyCacheTtlSeconds = 300;
+const int kDefaultKeyCacheMaxStaleSeconds = 3600;
+const int kDefaultMaxInflightKeyFetches = 16;
+const int kDefaultKeyRefreshIntervalSeconds = 60;
+const int kDefaultNegativeCacheTtlSeconds = 10;
+const int kDefaultRandomPoolSize = 65536;
+const int kDefaultSharedKeyCacheSize = 4 << 20;
+const int kDefaultKeyEvictionIdleSeconds = 60;
+const int kDefaultActionQueueTimeoutMs = 1000;
+const int kDefaultMinInflightActions = 4;
+const int kDefaultInteractiveWeight = 4;
+const int kDefaultBulkWeight = 1;
+const int kDefaultSignatureCacheSize = 1024;
+const int kDefaultSignatureCacheTtlSeconds = 60;
+
+// Whether the last key action of the thread was rejected by admission control.
+thread_local bool g_last_call_rejected = false;
+// The name of the mapped key inventory snapshot in the token directory.
+const char kKeySnapshotFile[] = "keys.snapshot";
+// The largest request the NetHSM random endpoint accepts.
+const size_t kMaxRandomRequestBytes = 1024;
+// The maximum number of key identifiers remembered as missing.
+const size_t kMaxMissingKeys = 1024;
+const int kDefaultHttpPoolSize = 8;
+const int kDefaultHttpTimeoutSeconds = 30;
+const int kDefaultHealthCheckIntervalSeconds = 5;
+const int kDefaultOperationDeadlineMs = 10000;
+const int kDefaultMaxRetries = 2;
+const int kDefaultRetryBackoffMs = 20;
+// The retry backoff stops doubling after this many retries.
+const int kMaxRetryBackoffDoublings = 6;
+const int kDefaultBreakerFailures = 3;
+const int kDefaultBreakerCooldownSeconds = 10;
+const int kDefaultAffinityLoadFactor = 125;
+const int kDefaultHttp2Connections = 2;
+const int kDefaultDnsCacheTtlSeconds = 300;
+// The number of recent latencies kept to compute the hedging delay, and the
+// number required before hedging starts.
+const size_t kMaxLatencySamples = 256;
+const size_t kMinLatencySamples = 32;
+// The hedge delay is recomputed after this many new latency samples.
+const size_t kHedgeDelayInterval = 32;
+// Responses with this status or above mark the node as failed.
+const int kMinServerErrorStatus = 500;
+
+namespace {
+
+// Fails a request task if the NetHSM answered with a server error, which,
+// unlike a client error, may go away when the request is retried.
+class ServerError : public std::runtime_error {
+ public:
+  explicit ServerError(int status)
+      : std::runtime_error("NetHSM answered with status " +
+                           std::to_string(status)) {}
+};
+
+// Returns true if 'task' failed. 'responded' is set if the NetHSM answered
+// with a server error, and cleared if no response arrived.
+template <typename T>
+bool RequestFailed(const pplx::task<T>& task, bool* responded) {
+  try {
+    task.get();
+  }
+  catch (ServerError&) {
+    *responded = true;
+    return true;
+  }
+  catch (...) {
+    *responded = false;
+    return true;
+  }
+  return false;
+}
+
+// Starts a timer on the cpprest thread pool that calls 'callback' after
+// 'delay', with an error if the timer is cancelled first. The timer must be
+// kept until then.
+std::shared_ptr<boost::asio::steady_timer> StartTimer(
+    const std::chrono::steady_clock::duration& delay,
+    const std::function<void(const boost::system::error_code&)>& callback) {
+  std::shared_ptr<boost::asio::steady_timer> timer =
+      std::make_shared<boost::asio::steady_timer>(
+          crossplat::threadpool::shared_instance().service(), delay);
+  timer->async_wait(callback);
+  return timer;
+}
+
+// Returns a task that completes after 'delay' without taking a thread of the
+// pool meanwhile.
+pplx::task<void> After(const std::chrono::steady_clock::duration& delay) {
+  if (delay == std::chrono::steady_clock::duration::zero())
+    return pplx::task_from_result();
+  pplx::task_completion_event<void> done;
+  std::shared_ptr<boost::asio::steady_timer> timer =
+      StartTimer(delay, [done](const boost::system::error_code&) {
+        done.set();
+      });
+  // The task keeps the timer until it fires.
+  return pplx::create_task(done).then([timer] {});
+}
+
+// Returns how long a request may take to end by 'deadline', at least a
+// millisecond, or zero if there is no deadline.
+std::chrono::milliseconds GetRequestTimeout(
+    const std::chrono::steady_clock::time_point& deadline) {
+  if (deadline == std::chrono::steady_clock::time_point::max())
+    return std::chrono::milliseconds::zero();
+  return std::max(std::chrono::milliseconds(1),
+                  std::chrono::duration_cast<std::chrono::milliseconds>(
+                      deadline - std::chrono::steady_clock::now()));
+}
+
+std::mt19937_64& GetRandomEngine() {
+  static thread_local std::mt19937_64 engine(std::random_device{}());
+  return engine;
+}
+
+// Incremented in the child process after every fork.
+std::atomic<unsigned> g_fork_generation(0);
+
+// The live NetUtilityImpl instances, whose locks are held across fork so that
+// the child does not inherit them locked.
+boost::mutex& GetInstancesLock() {
+  static boost::mutex* lock = new boost::mutex();
+  return *lock;
+}
+
+std::set<NetUtilityImpl*>& GetInstances() {
+  static std::set<NetUtilityImpl*>* instances = new std::set<NetUtilityImpl*>();
+  return *instances;
+}
+
+// Within a trace, starts the span of a request to an API endpoint and adds the
+// traceparent and X-Request-ID headers that carry its context to the NetHSM.
+std::shared_ptr<TraceSpan> StartRequestSpan(const std::string& endpoint,
+                                            HttpTransport::Headers* headers) {
+  std::shared_ptr<TraceSpan> span = Tracing::StartAsyncSpan("NetHSM request");
+  if (span) {
+    span->SetAttribute("endpoint", endpoint);
+    const std::string trace_parent = span->GetTraceParent();
+    headers->push_back(std::make_pair("traceparent", trace_parent));
+    // The trace and span identifiers.
+    headers->push_back(
+        std::make_pair("X-Request-ID", trace_parent.substr(3, 49)));
+  }
+  return span;
 }
 
+// Sends a request to an API endpoint. Within a trace, the request gets a span,
+// returned in 'span', and carries its context to the NetHSM in the traceparent
+// and X-Request-ID headers. Continuations that capture 'span' must be attached
+// in a later statement, as the evaluation order of a chained call is
+// unspecified. Cancelling 'token' abandons the request.
+pplx::task<web::http::http_response> SendRequest(
+    web::http::client::http_client* client,
+    const web::http::method& method,
+    const std::string& endpoint,
+    const std::string& path,
+    const std::string& body,
+    std::shared_ptr<TraceSpan>* span,
+    const pplx::cancellation_token& token) {
+  web::http::http_request request(method);
+  request.set_request_uri(path);
+  if (!body.empty())
+    request.set_body(body, "application/json");
+  HttpTransport::Headers headers;
+  *span = StartRequestSpan(endpoint, &headers);
+  for (auto i = headers.begin(); i != headers.end(); ++i)
+    request.headers().add(i->first, i->second);
+  return client->request(request, token);
+}
+
+// Sends a GET of key metadata to an API endpoint, like SendRequest. The
+// response may be compressed. Given the validators of a cached copy, the
+// NetHSM is asked to answer 304 Not Modified if the copy is still current.
+pplx::task<web::http::http_response> SendMetadataRequest(
+    web::http::client::http_client* client,
+    const std::string& endpoint,
+    const std::string& path,
+    const std::string& etag,
+    const std::string& last_modified,
+    std::shared_ptr<TraceSpan>* span) {
+  web::http::http_request request(web::http::methods::GET);
+  request.set_request_uri(path);
+  // Sends Accept-Encoding for the codecs cpprest was built with, if any.
+  request.set_decompress_factories();
+  HttpTransport::Headers headers;
+  *span = StartRequestSpan(endpoint, &headers);
+  if (!etag.empty())
+    headers.push_back(std::make_pair("If-None-Match", etag));
+  if (!last_modified.empty())
+    headers.push_back(std::make_pair("If-Modified-Since", last_modified));
+  for (auto i = headers.begin(); i != headers.end(); ++i)
+    request.headers().add(i->first, i->second);
+  return client->request(request);
+}
+
+// The HTTP metrics of an endpoint.
+struct ResponseMetrics {
+  ResponseMetrics() : duration(NULL) {}
+  Histogram* duration;
+  // Key: A response status.
+  // Value: The count of responses with it.
+  std::unordered_map<std::string, Counter*> responses;
+};
+
+// Records the outcome of a request to an API endpoint, started at 'start', in
+// the HTTP metrics and ends its span, if any. Requests that got no response
+// have the status "error".
+void RecordResponse(const std::string& endpoint,
+                    const std::chrono::steady_clock::time_point& start,
+                    const std::string& status,
+                    TraceSpan* span) {
+  if (span) {
+    span->SetAttribute("status", status);
+    span->End();
+  }
+  // Every response is recorded, so each thread looks the metrics up once per
+  // endpoint and status rather than building their labels every time.
+  static thread_local std::unordered_map<std::string, ResponseMetrics> cache;
+  ResponseMetrics& metrics = cache[endpoint];
+  if (!metrics.duration) {
+    metrics.duration = Metrics::Get()->GetHistogram(
+        "p11net_http_request_duration_us", "endpoint=\"" + endpoint + "\"");
+  }
+  metrics.duration->Record(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count());
+  Counter*& responses = metrics.responses[status];
+  if (!responses) {
+    responses = Metrics::Get()->GetCounter(
+        "p11net_http_responses_total",
+        "endpoint=\"" + endpoint + "\",status=\"" + status + "\"");
+  }
+  responses->Increment();
+}
+
+void RecordResponse(const std::string& endpoint,
+                    const std::chrono::steady_clock::time_point& start,
+                    int status,
+                    TraceSpan* span) {
+  RecordResponse(endpoint, start, std::to_string(status), span);
+}
+
+// Records the outcome of a key action request and reports it to the node that
+// served it and to the admission controller, if any. A 'status' of zero means
+// that no response arrived.
+void ReportActionResponse(AdmissionController::Permit* permit,
+                          NetHsmCluster::Connection* connection,
+                          const std::string& endpoint,
+                          const std::chrono::steady_clock::time_point& start,
+                          int status,
+                          TraceSpan* span) {
+  if (status == 0)
+    RecordResponse(endpoint, start, "error", span);
+  else
+    RecordResponse(endpoint, start, status, span);
+  const bool failed = status == 0 || status >= kMinServerErrorStatus;
+  if (failed)
+    connection->ReportFailure();
+  else
+    connection->ReportSuccess();
+  if (permit && failed)
+    permit->ReportFailure();
+  else if (permit)
+    permit->ReportSuccess();
+}
+
+// Extracts the base64url field 'output_field' of the data of an action
+// response.
+boost::optional<std::string> DecodeActionOutput(
+    const std::string& response_body,
+    const std::string& output_field) {
+  VLOG(2) << "Response: " << response_body;
+  std::string decoded;
+  boost::optional<std::string> result;
+  if (DecodeActionResponse(response_body, output_field, &decoded)) {
+    result = std::move(decoded);
+    return result;
+  }
+  // Not the expected shape; let the JSON parser have a look.
+  try {
+    auto const json = JSON::parse(response_body);
+    result = Base64UrlDecode(
+        json.at("data").at(output_field).get<std::string>());
+  }
+  catch (JSON::exception& e) {
+    VLOG(1) << "Invalid JSON structure: " << e.what();
+    result = boost::none;
+  }
+  catch (cppcodec::parse_error& e) {
+    VLOG(1) << "Invalid action output encoding: " << e.what();
+    result = boost::none;
+  }
+  return result;
+}
+
+}  // namespace
+
 namespace Purpose {
   const std::string kEncrypt = "encrypt";
   const std::string kSign = "sign";
 }
 
+namespace KeyType {
+  const std::string kRSA = "RSA";
+}
+
+namespace {
+
+// The NetHSM EC key types and their named curves.
+struct ECKeyType {
+  const char* type;
+  int curve_nid;
+};
+
+const ECKeyType kECKeyTypes[] = {
+  {"EC_P256", NID_X9_62_prime256v1},
+  {"EC_P384", NID_secp384r1},
+  {"EC_P521", NID_secp521r1},
+};
+
+// Records from before EC support carry no type.
+bool IsRSAKey(const KeyRecord& record) {
+  return !record.has_type() || record.type() == KeyType::kRSA;
+}
+
+// Returns the curve of an EC key, or NID_undef for other key types.
+int GetKeyCurve(const KeyRecord& record) {
+  for (size_t i = 0; i < arraysize(kECKeyTypes); ++i) {
+    if (record.type() == kECKeyTypes[i].type)
+      return kECKeyTypes[i].curve_nid;
+  }
+  return NID_undef;
+}
+
+// Returns the DER encoding of an OpenSSL object by its i2d function.
+template <typename Encoder, typename T>
+std::string EncodeDER(Encoder encode, T* object) {
+  const int length = encode(object, NULL);
+  if (length <= 0)
+    return std::string();
+  std::string der(length, '\0');
+  unsigned char* buffer =
+      reinterpret_cast<unsigned char*>(const_cast<char*>(der.data()));
+  encode(object, &buffer);
+  return der;
+}
+
+// Parses a certificate the NetHSM returned, which is PEM or DER encoded, into
+// the attributes of an X.509 certificate object.
+bool ParseCertificate(const std::string& body,
+                      std::string* value,
+                      std::string* subject,
+                      std::string* issuer,
+                      std::string* serial_number) {
+  BIO* bio = BIO_new_mem_buf(const_cast<char*>(body.data()), body.size());
+  if (!bio)
+    return false;
+  X509* certificate = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+  if (!certificate) {
+    const unsigned char* buffer =
+        reinterpret_cast<const unsigned char*>(body.data());
+    certificate = d2i_X509(NULL, &buffer, body.size());
+  }
+  if (!certificate)
+    return false;
+  *value = EncodeDER(i2d_X509, certificate);
+  *subject = EncodeDER(i2d_X509_NAME, X509_get_subject_name(certificate));
+  *issuer = EncodeDER(i2d_X509_NAME, X509_get_issuer_name(certificate));
+  *serial_number = EncodeDER(i2d_ASN1_INTEGER,
+                             X509_get_serialNumber(certificate));
+  X509_free(certificate);
+  return !value->empty();
+}
+
+}  // namespace
+
 NetUtilityImpl::NetUtilityImpl(std::shared_ptr<ObjectPool> token_object_pool,
-                               std::shared_ptr<P11NetFactory> factory)
-    : token_object_pool_(token_object_pool),
-      factory_(factory)
-  {}
+                               std::shared_ptr<P11NetFactory> factory,
+                               const boost::filesystem::path& token_path,
+                               int appliance)
+    : is_initialized_(false),
+      token_object_pool_(token_object_pool),
+      factory_(factory),
+      token_path_(token_path),
+      appliance_(appliance),
+      key_cache_ttl_(std::chrono::seconds(kDefaultKeyCacheTtlSeconds)),
+      max_stale_(std::chrono::seconds(kDefaultKeyCacheMaxStaleSeconds)),
+      max_inflight_key_fetches_(kDefaultMaxInflightKeyFetches),
+      negative_cache_ttl_(std::chrono::seconds(
+          kDefaultNegativeCacheTtlSeconds)),
+      certificates_(false),
+      keys_loaded_(false),
+      max_resident_keys_(0),
+      eviction_idle_time_(std::chrono::seconds(kDefaultKeyEvictionIdleSeconds)),
+      reported_cache_bytes_(0),
+      shared_sequence_(0),
+      random_fallback_(true),
+      refresh_interval_(0),
+      stopping_(false),
+      sign_coalesce_window_(0),
+      operation_deadline_(std::chrono::milliseconds(
+          kDefaultOperationDeadlineMs)),
+      hedge_percentile_(0),
+      max_retries_(kDefaultMaxRetries),
+      retry_backoff_(std::chrono::milliseconds(kDefaultRetryBackoffMs)),
+      latency_samples_(new std::atomic<Clock::rep>[kMaxLatencySamples]()),
+      num_latency_samples_(0),
+      hedge_delay_(0),
+      fork_generation_(g_fork_generation.load()) {
+  static std::once_flag register_fork_handlers;
+  std::call_once(register_fork_handlers, [] {
+    pthread_atfork(&NetUtilityImpl::PrepareFork,
+                   &NetUtilityImpl::ParentAfterFork,
+                   &NetUtilityImpl::ChildAfterFork);
+  });
+  boost::lock_guard<boost::mutex> lock(GetInstancesLock());
+  GetInstances().insert(this);
+}
 
-NetUtilityImpl::~NetUtilityImpl() {}
+NetUtilityImpl::~NetUtilityImpl() {
+  {
+    boost::lock_guard<boost::mutex> lock(GetInstancesLock());
+    GetInstances().erase(this);
+  }
+  StopRefresher();
+  WaitForRevalidation();
+  random_pool_.reset();
+  if (cluster_)
+    cluster_->Stop();
+  Metrics::Get()->GetGauge("p11net_key_cache_bytes")
+      ->Add(-reported_cache_bytes_);
+}
 
 bool NetUtilityImpl::Init() {
   VLOG(1) << __PRETTY_FUNCTION__;
-  const std::string url = std::getenv(Env::kUrl);
-  const std::string user = std::getenv(Env::kUser);
-  const std::string password = std::getenv(Env::kPassword);
+  StopRefresher();
+  WaitForRevalidation();
+  random_pool_.reset();
+  endpoint_ = GetApplianceEnv(Env::kUrl);
+  const std::vector<std::string> urls = NetHsmCluster::ParseUrls(endpoint_);
+  if (urls.empty()) {
+    LOG(ERROR) << GetApplianceEnvName(Env::kUrl)
+               << " does not name any NetHSM.";
+    return false;
+  }
+  sign_coalesce_window_ = std::chrono::microseconds(
+      GetEnvInt(Env::kSignCoalesceWindow, 0));
+  operation_deadline_ = std::chrono::milliseconds(
+      GetEnvInt(Env::kOperationDeadline, kDefaultOperationDeadlineMs));
+  hedge_percentile_ = std::min(GetEnvInt(Env::kHedgePercentile, 0), 99);
+  max_retries_ = std::max(GetEnvInt(Env::kMaxRetries, kDefaultMaxRetries), 0);
+  retry_backoff_ = std::chrono::milliseconds(std::max(
+      GetEnvInt(Env::kRetryBackoff, kDefaultRetryBackoffMs), 1));
+  ConfigureIoThreadsFromEnv();
+  CreateAdmissionController();
+  CreateSignatureCache();
+  if (cluster_)
+    cluster_->Stop();
+  CreateCluster(urls);
+  key_cache_ttl_ = std::chrono::seconds(
+      GetEnvInt(Env::kKeyCacheTtl, kDefaultKeyCacheTtlSeconds));
+  max_stale_ = std::chrono::seconds(std::max(
+      GetEnvInt(Env::kKeyCacheMaxStale, kDefaultKeyCacheMaxStaleSeconds), 0));
+  max_inflight_key_fetches_ = std::max(
+      1, GetEnvInt(Env::kMaxInflightKeyFetches, kDefaultMaxInflightKeyFetches));
+  negative_cache_ttl_ = std::chrono::seconds(
+      GetEnvInt(Env::kNegativeCacheTtl, kDefaultNegativeCacheTtlSeconds));
+  refresh_interval_ = std::chrono::seconds(
+      GetEnvInt(Env::kKeyRefreshInterval, kDefaultKeyRefreshIntervalSeconds));
+  max_resident_keys_ = std::max(GetEnvInt(Env::kMaxResidentKeys, 0), 0);
+  certificates_ = GetEnvInt(Env::kCertificates, 0) != 0;
+  eviction_idle_time_ = std::chrono::seconds(
+      GetEnvInt(Env::kKeyEvictionIdle, kDefaultKeyEvictionIdleSeconds));
+  CreateRandomPool();
+  InvalidateKeys();
+  {
+    boost::lock_guard<boost::mutex> lock(load_lock_);
+    listed_locations_.clear();
+    listing_validators_ = Validators();
+  }
+  is_initialized_ = true;
+  shared_key_cache_.reset();
+  shared_sequence_ = 0;
+  const char* shared_key_cache = std::getenv(Env::kSharedKeyCache);
+  if (shared_key_cache) {
+    // Each appliance publishes its inventory under a name of its own.
+    std::string name = shared_key_cache;
+    if (appliance_ > 0)
+      name += "-" + std::to_string(appliance_);
+    shared_key_cache_.reset(new SharedKeyCache(
+        name,
+        GetEnvInt(Env::kSharedKeyCacheSize, kDefaultSharedKeyCacheSize)));
+    if (!shared_key_cache_->Open())
+      shared_key_cache_.reset();
+  }
+  // Serve the keys known from the last run, or published by another process,
+  // right away and bring them up to date in the background. The first pass of
+  // the refresher loads the keys if it runs.
+  bool restored = LoadSnapshot();
+  {
+    boost::lock_guard<boost::mutex> lock(load_lock_);
+    restored = ImportSharedInventory() || restored;
+  }
+  const size_t prewarm_connections =
+      std::max(GetEnvInt(Env::kPrewarmConnections, 0), 0);
+  const bool refreshing = refresh_interval_ != std::chrono::seconds::zero();
+  if (refreshing)
+    StartRefresher();
+  if (prewarm_connections > 0 || (restored && !refreshing)) {
+    revalidation_thread_ = boost::thread([this, prewarm_connections,
+                                          refreshing] {
+      if (prewarm_connections > 0)
+        cluster_->Warm(prewarm_connections);
+      if (!refreshing) {
+        boost::lock_guard<boost::mutex> lock(load_lock_);
+        FetchKeys(std::string(), std::string());
+      }
+    });
+  }
+  return true;
+}
+
+void NetUtilityImpl::CreateCluster(const std::vector<std::string>& urls) {
+  const std::string user = GetApplianceEnv(Env::kUser);
+  const std::string password = GetApplianceEnv(Env::kPassword);
   web::http::client::http_client_config config;
   web::http::client::credentials creds(user, password);
   config.set_credentials(creds);
-  client_.emplace(url, config);
-  is_initialized_ = true;
+  config.set_timeout(std::chrono::seconds(
+      GetEnvInt(Env::kHttpTimeout, kDefaultHttpTimeoutSeconds)));
+  cluster_.reset(new NetHsmCluster(
+      urls, config, GetEnvInt(Env::kHttpPoolSize, kDefaultHttpPoolSize),
+      std::chrono::seconds(GetEnvInt(Env::kHealthCheckInterval,
+                                     kDefaultHealthCheckIntervalSeconds)),
+      GetEnvInt(Env::kBreakerFailures, kDefaultBreakerFailures),
+      std::chrono::seconds(GetEnvInt(Env::kBreakerCooldown,
+                                     kDefaultBreakerCooldownSeconds))));
+  cluster_->set_reachability_callback(reachability_callback_);
+  const char* routing = std::getenv(Env::kRouting);
+  if (routing && std::string(routing) == "affinity") {
+    cluster_->EnableKeyAffinity(
+        GetEnvInt(Env::kAffinityLoadFactor, kDefaultAffinityLoadFactor) /
+        100.0);
+  }
+  const char* transport = std::getenv(Env::kTransport);
+  const std::chrono::seconds timeout(
+      GetEnvInt(Env::kHttpTimeout, kDefaultHttpTimeoutSeconds));
+  const std::chrono::seconds dns_ttl(std::max(
+      GetEnvInt(Env::kDnsCacheTtl, kDefaultDnsCacheTtlSeconds), 0));
+  if (transport && std::string(transport) == "http2") {
+    cluster_->EnableTransport(
+        HttpTransport::kHttp2, user, password, timeout,
+        std::max(GetEnvInt(Env::kHttp2Connections, kDefaultHttp2Connections),
+                 1),
+        dns_ttl);
+  } else if (transport && std::string(transport) == "curl") {
+    cluster_->EnableTransport(
+        HttpTransport::kHttp11, user, password, timeout,
+        std::max(GetEnvInt(Env::kHttpPoolSize, kDefaultHttpPoolSize), 1),
+        dns_ttl);
+  }
+  cluster_->Start();
+}
+
+std::string NetUtilityImpl::GetApplianceEnvName(const char* name) const {
+  if (appliance_ == 0)
+    return name;
+  return std::string(name) + "_" + std::to_string(appliance_);
+}
+
+std::string NetUtilityImpl::GetApplianceEnv(const char* name) const {
+  const char* value = std::getenv(GetApplianceEnvName(name).c_str());
+  return value ? value : "";
+}
+
+void NetUtilityImpl::ConfigureIoThreadsFromEnv() {
+  std::string cpus;
+  const char* io_cpus = std::getenv(Env::kIoCpus);
+  if (io_cpus) {
+    cpus = io_cpus;
+  } else if (std::getenv(Env::kIoNumaNode) &&
+             !GetNumaNodeCpus(GetEnvInt(Env::kIoNumaNode, 0), &cpus)) {
+    cpus.clear();
+  }
+  ConfigureIoThreads(std::max(GetEnvInt(Env::kIoThreads, 0), 0), cpus);
+}
+
+void NetUtilityImpl::CreateRandomPool() {
+  const char* random_source = std::getenv(Env::kRandomSource);
+  if (!random_source || std::string(random_source) != "nethsm")
+    return;
+  const size_t pool_size = std::max(
+      GetEnvInt(Env::kRandomPoolSize, kDefaultRandomPoolSize),
+      static_cast<int>(kMaxRandomRequestBytes));
+  random_fallback_ = GetEnvInt(Env::kRandomFallback, 1) != 0;
+  random_pool_.reset(new EntropyPool(
+      pool_size, pool_size / 4, kMaxRandomRequestBytes,
+      [this](size_t num_bytes) { return RequestRandom(num_bytes); }));
+  random_pool_->Refill();
+}
+
+void NetUtilityImpl::CreateAdmissionController() {
+  admission_.reset();
+  const int max_inflight = GetEnvInt(Env::kMaxInflightActions, 0);
+  if (max_inflight <= 0)
+    return;
+  std::vector<int> lane_weights(kNumRequestPriorities);
+  lane_weights[kInteractivePriority] = std::max(
+      GetEnvInt(Env::kInteractiveWeight, kDefaultInteractiveWeight), 1);
+  lane_weights[kBulkPriority] =
+      std::max(GetEnvInt(Env::kBulkWeight, kDefaultBulkWeight), 1);
+  admission_.reset(new AdmissionController(
+      max_inflight,
+      std::max(GetEnvInt(Env::kMinInflightActions, kDefaultMinInflightActions),
+               1),
+      std::max(GetEnvInt(Env::kActionQueueDepth, 0), 0),
+      std::chrono::milliseconds(GetEnvInt(Env::kActionQueueTimeout,
+                                          kDefaultActionQueueTimeoutMs)),
+      std::chrono::milliseconds(
+          std::max(GetEnvInt(Env::kActionTargetLatency, 0), 0)),
+      lane_weights,
+      std::max(GetEnvInt(Env::kInteractiveReserve, 0), 0)));
+}
+
+void NetUtilityImpl::CreateSignatureCache() {
+  signature_cache_.reset();
+  const char* keys = std::getenv(Env::kSignatureCacheKeys);
+  if (!keys || !*keys)
+    return;
+  std::vector<std::string> parts;
+  boost::split(parts, keys, [](char c) { return c == ','; });
+  std::set<std::string> key_ids;
+  for (auto i = parts.begin(); i != parts.end(); ++i) {
+    boost::trim(*i);
+    if (!i->empty())
+      key_ids.insert(*i);
+  }
+  const int size =
+      GetEnvInt(Env::kSignatureCacheSize, kDefaultSignatureCacheSize);
+  if (key_ids.empty() || size <= 0)
+    return;
+  signature_cache_.reset(new SignatureCache(
+      size,
+      std::chrono::seconds(std::max(
+          GetEnvInt(Env::kSignatureCacheTtl, kDefaultSignatureCacheTtlSeconds),
+          0)),
+      key_ids));
+}
+
+bool NetUtilityImpl::IsSignatureCached(const std::string& key_id) const {
+  return signature_cache_ && signature_cache_->IsEnabled(key_id);
+}
+
+bool NetUtilityImpl::Admit(
+    RequestPriority priority,
+    bool wait,
+    std::shared_ptr<AdmissionController::Permit>* permit) {
+  CheckFork();
+  g_last_call_rejected = false;
+  if (!admission_)
+    return true;
+  *permit = wait ? admission_->Admit(priority)
+                 : admission_->TryAdmit(priority);
+  if (*permit)
+    return true;
+  VLOG(1) << "NetHSM request limit reached";
+  g_last_call_rejected = true;
+  return false;
+}
+
+bool NetUtilityImpl::LastCallRejected() {
+  return g_last_call_rejected;
+}
+
+std::chrono::milliseconds NetUtilityImpl::GetOperationDeadline() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      operation_deadline_);
+}
+
+NetHsmCluster* NetUtilityImpl::GetCluster() {
+  CheckFork();
+  return cluster_.get();
+}
+
+void NetUtilityImpl::CheckFork() {
+  if (fork_generation_.load(std::memory_order_acquire) !=
+      g_fork_generation.load(std::memory_order_relaxed))
+    RecoverFromFork();
+}
+
+void NetUtilityImpl::RecoverFromFork() {
+  boost::lock_guard<boost::mutex> lock(fork_lock_);
+  const unsigned generation = g_fork_generation.load();
+  if (fork_generation_.load() == generation)
+    return;
+  if (is_initialized_) {
+    LOG(INFO) << "Reconnecting to the NetHSM in forked process " << getpid();
+    // The threads of the parent process do not exist in the child, and its
+    // connections belong to the parent. Their state is abandoned rather than
+    // joined or closed; the key inventory and token objects are kept.
+    if (refresh_thread_.joinable())
+      refresh_thread_.detach();
+    if (revalidation_thread_.joinable())
+      revalidation_thread_.detach();
+    // The HTTP clients and the task continuations run on the cpprest pool.
+    EnsureIoThreads();
+    ignore_result(random_pool_.release());
+    {
+      boost::lock_guard<boost::mutex> batches_lock(sign_batches_lock_);
+      sign_batches_.clear();
+    }
+    {
+      // The parent's revalidations will not finish here, and the keys they
+      // were for must not look busy forever.
+      boost::lock_guard<boost::mutex> stale_lock(stale_lock_);
+      revalidating_keys_.clear();
+    }
+    {
+      // The parent's fetches will not complete here.
+      boost::lock_guard<boost::mutex> fetches_lock(certificate_fetches_lock_);
+      certificate_fetches_.clear();
+    }
+    if (cluster_) {
+      ignore_result(cluster_.release());
+      CreateCluster(NetHsmCluster::ParseUrls(endpoint_));
+    }
+    if (admission_) {
+      // Its count includes the parent's requests, and its lock may be held.
+      ignore_result(new std::shared_ptr<AdmissionController>(
+          std::move(admission_)));
+      CreateAdmissionController();
+    }
+    if (signature_cache_) {
+      // Its lock may be held by a thread of the parent.
+      ignore_result(new std::shared_ptr<SignatureCache>(
+          std::move(signature_cache_)));
+      CreateSignatureCache();
+    }
+  }
+  fork_generation_.store(generation, std::memory_order_release);
+  // These issue requests through GetCluster, which must not recover again.
+  // The caller may hold load_lock_, which comes before refresh_lock_.
+  if (is_initialized_) {
+    CreateRandomPool();
+    StartRefresher();
+  }
+}
+
+void NetUtilityImpl::PrepareFork() {
+  GetInstancesLock().lock();
+  std::set<NetUtilityImpl*>& instances = GetInstances();
+  // Only the locks that are never held across NetHSM requests are taken, so
+  // a fork does not wait for a sync to finish; load_lock_ and refresh_lock_
+  // are replaced in the child instead.
+  for (auto i = instances.begin(); i != instances.end(); ++i) {
+    (*i)->keys_lock_.lock();
+    (*i)->sign_batches_lock_.lock();
+    (*i)->certificate_fetches_lock_.lock();
+    (*i)->stale_lock_.lock();
+  }
+}
+
+void NetUtilityImpl::ParentAfterFork() {
+  std::set<NetUtilityImpl*>& instances = GetInstances();
+  for (auto i = instances.begin(); i != instances.end(); ++i) {
+    (*i)->stale_lock_.unlock();
+    (*i)->certificate_fetches_lock_.unlock();
+    (*i)->sign_batches_lock_.unlock();
+    (*i)->keys_lock_.unlock();
+  }
+  GetInstancesLock().unlock();
+}
+
+void NetUtilityImpl::ChildAfterFork() {
+  std::set<NetUtilityImpl*>& instances = GetInstances();
+  for (auto i = instances.begin(); i != instances.end(); ++i) {
+    NetUtilityImpl* instance = *i;
+    // A thread of the parent may have held these, and it does not exist
+    // here. They are constructed anew over the old ones, which are not
+    // destroyed since they may be locked.
+    new (&instance->load_lock_) boost::mutex();
+    new (&instance->refresh_lock_) boost::mutex();
+    new (&instance->refresh_wakeup_) boost::condition_variable();
+    // A load that was in flight is abandoned; its listing may not have been
+    // applied, so the next sync lists the keys in full.
+    instance->listed_locations_.clear();
+    instance->listing_validators_ = Validators();
+  }
+  ParentAfterFork();
+  // Each instance reconnects on its next use.
+  ++g_fork_generation;
+}
+
+bool NetUtilityImpl::LoadKeys(const Object& search_template) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  static Histogram* const load_duration = Metrics::Get()->GetHistogram(
+      "p11net_load_keys_duration_us");
+  ScopedLatency latency(load_duration);
+  P11NET_TRACE_SPAN("load keys");
+  std::string key_id;
+  std::string purpose;
+  if (!GetKeyFilter(search_template, certificates_, &key_id, &purpose)) {
+    VLOG(1) << "Search template cannot match a NetHSM key";
+    return true;
+  }
+  // An enumeration lists the evicted keys too.
+  if (key_id.empty() && HasEvictedKeys()) {
+    boost::lock_guard<boost::mutex> lock(load_lock_);
+    RestoreEvictedKeys();
+  }
+  if (IsCached(key_id, purpose) && !IsEvicted(key_id))
+    return true;
+  // Expired metadata is still good while the NetHSM is asked again, and
+  // keeps lookups from waiting on it while it is unreachable.
+  if (IsStale(key_id, purpose) && !IsEvicted(key_id)) {
+    static Counter* const stale_hits = Metrics::Get()->GetCounter(
+        "p11net_key_cache_stale_hits_total");
+    stale_hits->Increment();
+    RevalidateInBackground(key_id, purpose);
+    return true;
+  }
+  // Only one thread talks to the NetHSM at a time; the others find the result
+  // in the cache once it is their turn.
+  boost::lock_guard<boost::mutex> lock(load_lock_);
+  if (IsEvicted(key_id))
+    return RestoreKey(key_id);
+  if (IsCached(key_id, purpose))
+    return true;
+  std::unique_ptr<ScopedStartupPhase> startup_phase;
+  if (!keys_loaded_) {
+    keys_loaded_ = true;
+    startup_phase.reset(new ScopedStartupPhase("first LoadKeys", true));
+  }
+  // The last run may have known the key.
+  if (snapshot_) {
+    if (key_id.empty())
+      InsertSnapshotKeys();
+    else
+      InsertSnapshotKey(key_id);
+    if (IsCached(key_id, purpose))
+      return true;
+  }
+  // Another process may have fetched the key already.
+  if (ImportSharedInventory() && IsCached(key_id, purpose))
+    return true;
+  return FetchKeys(key_id, purpose);
+}
+
+bool NetUtilityImpl::GetKeyFilter(const Object& search_template,
+                                  bool certificates,
+                                  std::string* key_id,
+                                  std::string* purpose) {
+  // The NetHSM only holds RSA and EC key pairs and their certificates, which
+  // are token objects labeled with the key identifier.
+  if (search_template.IsAttributePresent(CKA_CLASS)) {
+    CK_OBJECT_CLASS object_class = search_template.GetObjectClass();
+    if (object_class != CKO_PUBLIC_KEY && object_class != CKO_PRIVATE_KEY &&
+        (object_class != CKO_CERTIFICATE || !certificates))
+      return false;
+  }
+  if (search_template.IsAttributePresent(CKA_CERTIFICATE_TYPE) &&
+      search_template.GetAttributeInt(CKA_CERTIFICATE_TYPE, 0) != CKC_X_509)
+    return false;
+  if (search_template.IsAttributePresent(CKA_KEY_TYPE)) {
+    CK_KEY_TYPE key_type = search_template.GetAttributeInt(CKA_KEY_TYPE, 0);
+    if (key_type != CKK_RSA && key_type != CKK_EC)
+      return false;
+  }
+  if (search_template.IsAttributePresent(CKA_TOKEN) &&
+      !search_template.IsTokenObject())
+    return false;
+  key_id->clear();
+  if (search_template.IsAttributePresent(CKA_ID))
+    *key_id = search_template.GetAttributeString(CKA_ID);
+  if (search_template.IsAttributePresent(CKA_LABEL)) {
+    const std::string label = search_template.GetAttributeString(CKA_LABEL);
+    if (!key_id->empty() && *key_id != label)
+      return false;
+    *key_id = label;
+  }
+  const bool for_signing = search_template.GetAttributeBool(CKA_SIGN, false) ||
+      search_template.GetAttributeBool(CKA_VERIFY, false);
+  const bool for_encrypting =
+      search_template.GetAttributeBool(CKA_DECRYPT, false) ||
+      search_template.GetAttributeBool(CKA_ENCRYPT, false);
+  // An RSA key may have both purposes, so a template asking for both is
+  // left to the pool to match.
+  if (for_signing && !for_encrypting)
+    *purpose = Purpose::kSign;
+  else if (for_encrypting && !for_signing)
+    *purpose = Purpose::kEncrypt;
+  else
+    purpose->clear();
   return true;
 }
 
-bool NetUtilityImpl::LoadKeys(const std::string& key_id) {
+void NetUtilityImpl::InvalidateKeys() {
   VLOG(1) << __PRETTY_FUNCTION__;
-  std::vector<std::string> locations;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  loaded_keys_.clear();
+  all_keys_loaded_ = boost::none;
+  loaded_purposes_.clear();
+  missing_keys_.clear();
+  missing_certificates_.clear();
+}
+
+boost::optional<NetUtilityImpl::Clock::time_point>
+NetUtilityImpl::GetListingLoaded(const std::string& purpose) const {
+  boost::optional<Clock::time_point> loaded = all_keys_loaded_;
+  auto it = purpose.empty() ? loaded_purposes_.end()
+                            : loaded_purposes_.find(purpose);
+  if (it != loaded_purposes_.end() && (!loaded || *loaded < it->second))
+    loaded = it->second;
+  return loaded;
+}
+
+bool NetUtilityImpl::IsCached(const std::string& key_id,
+                              const std::string& purpose) {
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
   if (key_id.empty()) {
-    VLOG(1) << "Fetching key locations";
-    auto response = client_->request(
-      web::http::methods::GET, kApiPath + "keys").get();
-    VLOG(1) << "Received response status code: " << response.status_code();
-    auto const json = JSON::parse(response.extract_utf8string().get());
-    VLOG(1) << "Response:\n" << json.dump(2);
-    try {
-      auto const arr = json.at("data");
-      for (auto i = arr.begin(); i != arr.end(); ++i) {
-        locations.push_back(i->at("location"));
-      }
+    const boost::optional<Clock::time_point> loaded =
+        GetListingLoaded(purpose);
+    if (loaded && IsFresh(*loaded)) {
+      VLOG(1) << "Key inventory served from cache";
+      return true;
     }
-    catch (JSON::exception& e) {
-      VLOG(1) << "Invalid JSON structure: " << e.what();
-      return false;
+    return false;
+  }
+  auto const it = loaded_keys_.find(key_id);
+  if (it != loaded_keys_.end() && IsFresh(it->second)) {
+    VLOG(1) << "Key " << key_id << " served from cache";
+    if (resident_index_.count(key_id))
+      TouchKey(key_id);
+    return true;
+  }
+  auto const missing = missing_keys_.find(key_id);
+  if (missing != missing_keys_.end()) {
+    if (Clock::now() - missing->second < negative_cache_ttl_) {
+      VLOG(1) << "Key " << key_id << " is known to be missing";
+      return true;
     }
-    //nethsm_keys_loaded_ = true;
-  } else {
-    locations.push_back(kApiPath + "keys/" + key_id);
+    missing_keys_.erase(missing);
+  }
+  return false;
+}
+
+bool NetUtilityImpl::IsStale(const std::string& key_id,
+                             const std::string& purpose) {
+  if (max_stale_ == Clock::duration::zero())
+    return false;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  const Clock::time_point now = Clock::now();
+  if (key_id.empty()) {
+    const boost::optional<Clock::time_point> loaded =
+        GetListingLoaded(purpose);
+    return loaded && now - *loaded < key_cache_ttl_ + max_stale_;
+  }
+  auto const it = loaded_keys_.find(key_id);
+  return it != loaded_keys_.end() &&
+         now - it->second < key_cache_ttl_ + max_stale_;
+}
+
+void NetUtilityImpl::RevalidateInBackground(const std::string& key_id,
+                                            const std::string& purpose) {
+  {
+    boost::lock_guard<boost::mutex> lock(stale_lock_);
+    if (!revalidating_keys_.insert(key_id).second)
+      return;
+  }
+  VLOG(1) << "Revalidating stale key " << key_id << " in the background";
+  pplx::create_task([this, key_id, purpose] {
+    {
+      boost::lock_guard<boost::mutex> lock(load_lock_);
+      // Another lookup may have waited for the NetHSM meanwhile.
+      if (!IsCached(key_id, purpose) && !FetchKeys(key_id, purpose))
+        LOG(WARNING) << "Failed to revalidate key " << key_id
+                     << "; serving it from the cache";
+    }
+    boost::lock_guard<boost::mutex> lock(stale_lock_);
+    revalidating_keys_.erase(key_id);
+    stale_done_.notify_all();
+  });
+}
+
+void NetUtilityImpl::AddMissingKey(const std::string& key_id) {
+  if (negative_cache_ttl_ == Clock::duration::zero())
+    return;
+  const Clock::time_point now = Clock::now();
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  if (missing_keys_.size() >= kMaxMissingKeys) {
+    for (auto i = missing_keys_.begin(); i != missing_keys_.end();) {
+      if (now - i->second >= negative_cache_ttl_)
+        i = missing_keys_.erase(i);
+      else
+        ++i;
+    }
+  }
+  if (missing_keys_.size() >= kMaxMissingKeys) {
+    missing_keys_.erase(std::min_element(
+        missing_keys_.begin(), missing_keys_.end(),
+        [](const std::pair<const std::string, Clock::time_point>& a,
+           const std::pair<const std::string, Clock::time_point>& b) {
+          return a.second < b.second;
+        }));
+  }
+  missing_keys_[key_id] = now;
+}
+
+bool NetUtilityImpl::FetchKeys(const std::string& key_id,
+                               const std::string& purpose) {
+  if (key_id.empty())
+    return SyncKeys(true, purpose);
+  std::vector<std::string> missing;
+  bool result = FetchLocations(
+      std::vector<std::string>(1, kApiPath + "keys/" + key_id), &missing);
+  if (!missing.empty()) {
+    AddMissingKey(key_id);
+    return true;
+  }
+  SaveSnapshot();
+  return result;
+}
+
+bool NetUtilityImpl::SyncKeys(bool refetch, const std::string& purpose) {
+  VLOG(1) << "Synchronizing key inventory";
+  // Every known key is compared with the listing.
+  InsertSnapshotKeys();
+  std::vector<std::string> locations;
+  if (!FetchKeyLocations(&locations))
+    return false;
+  const std::set<std::string> listed(locations.begin(), locations.end());
+  std::set<std::string> known;
+  std::set<std::string> skipped;
+  std::vector<std::string> removed;
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    // Keys removed by an earlier listing that did not come back are gone.
+    PruneStableHandles();
+    for (auto i = inventory_.begin(); i != inventory_.end(); ++i) {
+      if (!listed.count(i->second.location())) {
+        removed.push_back(i->first);
+        continue;
+      }
+      known.insert(i->second.location());
+      if (!purpose.empty() &&
+          !boost::contains(i->second.purpose(), purpose))
+        skipped.insert(i->second.location());
+    }
+  }
+  for (auto i = removed.begin(); i != removed.end(); ++i) {
+    LOG(INFO) << "Key " << *i << " was removed from the NetHSM.";
+    RemoveKeyObjects(*i);
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    inventory_.erase(*i);
+    loaded_keys_.erase(*i);
   }
+  std::vector<std::string> wanted;
   for (auto i = locations.begin(); i != locations.end(); ++i) {
-    auto const loc = *i;
-    VLOG(1) << "Fetching key " << loc;
-    auto response = client_->request(web::http::methods::GET, loc).get();
-    VLOG(1) << "Received response status code: " << response.status_code();
-    auto const json = JSON::parse(response.extract_utf8string().get());
-    VLOG(1) << "Response:\n" << json.dump(2);
+    if (!known.count(*i) || (refetch && !skipped.count(*i)))
+      wanted.push_back(*i);
+  }
+  bool result = FetchLocations(wanted, NULL);
+  {
+    // Keys that are still listed are as current as the listing itself.
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    const Clock::time_point now = Clock::now();
+    for (auto i = inventory_.begin(); i != inventory_.end(); ++i) {
+      if (known.count(i->second.location()))
+        loaded_keys_[i->first] = now;
+    }
+    // Keys without the purpose were not fetched again, so only an unfiltered
+    // sync completes the inventory; a filtered one serves later lookups for
+    // the same purpose.
+    if (result && purpose.empty()) {
+      all_keys_loaded_ = now;
+      loaded_purposes_.clear();
+    } else if (result) {
+      loaded_purposes_[purpose] = now;
+    }
+    // Keys created since a lookup missed them are in the listing now.
+    missing_keys_.clear();
+  }
+  SaveSnapshot();
+  return result;
+}
 
-    std::string id, modulus, public_exponent, purpose;
-    bool forEncrypting, forSigning;
+bool NetUtilityImpl::FetchLocations(
+    const std::vector<std::string>& locations,
+    std::vector<std::string>* missing) {
+  // Keep up to max_inflight_key_fetches_ requests outstanding and insert the
+  // keys in the order they were requested as the responses arrive.
+  bool result = true;
+  std::deque<std::pair<std::string, pplx::task<MetadataResponse>>> inflight;
+  auto next = locations.begin();
+  while (next != locations.end() || !inflight.empty()) {
+    while (next != locations.end() &&
+           inflight.size() < max_inflight_key_fetches_) {
+      inflight.push_back(std::make_pair(
+          *next, RequestKey(*next, GetKeyValidators(*next))));
+      ++next;
+    }
+    const std::string& loc = inflight.front().first;
+    MetadataResponse response;
+    bool received = true;
     try {
-      id = json.at("data").at("id");
-      modulus = base64::decode<std::string>(
-        json.at("data").at("publicKey").at("modulus")
-        .get<std::string>());
-      public_exponent = base64::decode<std::string>(
-        json.at("data").at("publicKey").at("publicExponent")
-        .get<std::string>());
-      purpose = json.at("data").at("purpose");
-      forEncrypting = boost::contains(purpose, Purpose::kEncrypt);
-      forSigning = boost::contains(purpose, Purpose::kSign);
-    }
-    catch (JSON::exception& e) {
-      VLOG(1) << "Invalid JSON structure: " << e.what();
+      response = inflight.front().second.get();
+    }
+    catch (std::exception& e) {
+      LOG(WARNING) << "Failed to fetch key " << loc << ": " << e.what();
+      received = false;
+    }
+    KeyRecord record;
+    if (received && response.not_modified) {
+      // The known record and objects are still current.
+      VLOG(1) << "Key " << loc << " is unchanged";
+      boost::lock_guard<boost::mutex> lock(keys_lock_);
+      loaded_keys_[loc.substr(loc.rfind('/') + 1)] = Clock::now();
+    } else if (received && response.body.empty()) {
+      VLOG(1) << "Key " << loc << " does not exist";
+      if (missing)
+        missing->push_back(loc);
+    } else if (received && ParseKey(loc, response.body, &record) &&
+        InsertKeyObjects(record)) {
+      if (!response.validators.etag.empty())
+        record.set_etag(response.validators.etag);
+      if (!response.validators.last_modified.empty())
+        record.set_last_modified(response.validators.last_modified);
+      boost::lock_guard<boost::mutex> lock(keys_lock_);
+      loaded_keys_[record.id()] = Clock::now();
+      inventory_[record.id()] = record;
+    } else {
+      result = false;
+    }
+    inflight.pop_front();
+  }
+  return result;
+}
+
+bool NetUtilityImpl::FetchKeyLocations(std::vector<std::string>* locations) {
+  const Clock::time_point start = Clock::now();
+  std::shared_ptr<TraceSpan> span;
+  bool responded = false;
+  try {
+    auto response = SendMetadataRequest(
+        GetCluster()->Acquire()->client(), "keys", kApiPath + "keys",
+        listing_validators_.etag, listing_validators_.last_modified,
+        &span).get();
+    VLOG(1) << "Received response status code: " << response.status_code();
+    RecordResponse("keys", start, response.status_code(), span.get());
+    responded = true;
+    if (response.status_code() == web::http::status_codes::Unauthorized ||
+        response.status_code() == web::http::status_codes::Forbidden) {
+      LOG(ERROR) << "The NetHSM rejected the credentials of "
+                 << GetApplianceEnvName(Env::kUser) << ".";
       return false;
     }
+    if (response.status_code() == web::http::status_codes::NotModified) {
+      VLOG(1) << "Key listing is unchanged";
+      *locations = listed_locations_;
+      return true;
+    }
+    // An error body must not be taken for an empty listing, which would
+    // remove every known key.
+    if (response.status_code() != web::http::status_codes::OK) {
+      LOG(WARNING) << "Failed to fetch key locations: status "
+                   << response.status_code();
+      return false;
+    }
+    // A listing is only sent back with its validators once it has parsed.
+    listing_validators_ = Validators();
+    Validators validators;
+    response.headers().match("ETag", validators.etag);
+    response.headers().match("Last-Modified", validators.last_modified);
+    const std::string body = response.extract_utf8string().get();
+    VLOG(2) << "Response:\n" << body;
+    // Pick the locations out of {"data": [{"location": ...}, ...]} as the
+    // parser reaches them and discard everything else, so that no document
+    // is built for large inventories.
+    std::string top_key;
+    std::string key;
+    bool in_data = false;
+    bool has_data = false;
+    JSON::parser_callback_t callback =
+        [&](int depth, JSON::parse_event_t event, JSON& parsed) {
+      switch (event) {
+        case JSON::parse_event_t::key:
+          key = parsed.get<std::string>();
+          if (depth == 1) {
+            top_key = key;
+            in_data = false;
+          }
+          return true;
+        case JSON::parse_event_t::value:
+          if (in_data && depth == 3 && key == "location" &&
+              parsed.is_string())
+            locations->push_back(parsed.get<std::string>());
+          return false;
+        case JSON::parse_event_t::array_start:
+          if (depth == 1 && top_key == "data")
+            in_data = has_data = true;
+          return true;
+        case JSON::parse_event_t::object_start:
+          return true;
+        default:
+          return false;
+      }
+    };
+    JSON::parse(body, callback);
+    // Anything but {"data": [...]} is not a listing, however it parsed.
+    if (!has_data) {
+      LOG(WARNING) << "Failed to fetch key locations: the response has no "
+                   << "data array";
+      locations->clear();
+      return false;
+    }
+    listed_locations_ = *locations;
+    listing_validators_ = validators;
+  }
+  catch (JSON::exception& e) {
+    VLOG(1) << "Invalid JSON structure: " << e.what();
+    return false;
+  }
+  catch (std::exception& e) {
+    LOG(WARNING) << "Failed to fetch key locations: " << e.what();
+    if (!responded)
+      RecordResponse("keys", start, "error", span.get());
+    return false;
+  }
+  return true;
+}
+
+pplx::task<NetUtilityImpl::MetadataResponse> NetUtilityImpl::RequestKey(
+    const std::string& loc,
+    const Validators& validators) {
+  VLOG(1) << "Fetching key " << loc;
+  return RequestKey(loc, validators, GetCluster()->AcquireForKey(loc),
+                    GetRetryDeadline(Clock::now()), 0);
+}
 
-    std::unique_ptr<Object> public_object(factory_->CreateObject());
-    CHECK(public_object.get());
-    public_object->SetAttributeString(CKA_ID, id);
-    public_object->SetAttributeString(CKA_LABEL, id);
-    public_object->SetAttributeInt(CKA_CLASS, CKO_PUBLIC_KEY);
-    public_object->SetAttributeInt(CKA_KEY_TYPE, CKK_RSA);
-    public_object->SetAttributeBool(CKA_MODIFIABLE, false);
-    public_object->SetAttributeBool(CKA_TOKEN, true);
+pplx::task<NetUtilityImpl::MetadataResponse> NetUtilityImpl::RequestKey(
+    const std::string& loc,
+    const Validators& validators,
+    std::shared_ptr<NetHsmCluster::Connection> connection,
+    const Clock::time_point& deadline,
+    int attempt) {
+  const Clock::time_point start = Clock::now();
+  const size_t node = connection->node();
+  std::shared_ptr<TraceSpan> span;
+  pplx::task<web::http::http_response> sent = SendMetadataRequest(
+      connection->client(), "key", loc, validators.etag,
+      validators.last_modified, &span);
+  pplx::task<MetadataResponse> received =
+      sent.then([connection, start, span](web::http::http_response response) {
+        VLOG(1) << "Received response status code: "
+                << response.status_code();
+        RecordResponse("key", start, response.status_code(), span.get());
+        if (response.status_code() >= kMinServerErrorStatus)
+          throw ServerError(response.status_code());
+        MetadataResponse result;
+        if (response.status_code() == web::http::status_codes::NotModified)
+          result.not_modified = true;
+        if (response.status_code() == web::http::status_codes::NotFound ||
+            result.not_modified)
+          return pplx::task_from_result(result);
+        response.headers().match("ETag", result.validators.etag);
+        response.headers().match("Last-Modified",
+                                 result.validators.last_modified);
+        return response.extract_utf8string().then(
+            [result](const std::string& body) mutable {
+              result.body = body;
+              return result;
+            });
+      });
+  return received.then([this, loc, validators, deadline, attempt, node](
+                           pplx::task<MetadataResponse> completed) {
+    bool responded = false;
+    Clock::duration delay;
+    if (!RequestFailed(completed, &responded) ||
+        !GetRetryDelay(attempt, responded, deadline, &delay))
+      return completed;
+    VLOG(1) << "Retrying request for key " << loc;
+    const std::string reason = responded ? "server_error" : "no_response";
+    Metrics::Get()->GetCounter("p11net_retries_total",
+                               "endpoint=\"key\",reason=\"" + reason + "\"")
+        ->Increment();
+    return After(delay).then([this, loc, validators, deadline, attempt, node,
+                              responded] {
+      return RequestKey(loc, validators,
+                        responded ? GetCluster()->AcquireForKey(loc)
+                                  : GetCluster()->AcquireForKey(loc, node),
+                        deadline, attempt + 1);
+    });
+  });
+}
+
+NetUtilityImpl::Validators NetUtilityImpl::GetKeyValidators(
+    const std::string& loc) {
+  // Key locations end with the key identifier.
+  const std::string key_id = loc.substr(loc.rfind('/') + 1);
+  Validators validators;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  auto it = inventory_.find(key_id);
+  // An evicted key's record is current too; it is rebuilt from it when used.
+  if (it != inventory_.end() && it->second.location() == loc) {
+    validators.etag = it->second.etag();
+    validators.last_modified = it->second.last_modified();
+  }
+  return validators;
+}
+
+bool NetUtilityImpl::ParseKey(const std::string& loc,
+                              const std::string& body,
+                              KeyRecord* record) {
+  try {
+    auto const json = JSON::parse(body);
+    VLOG(2) << "Response:\n" << json.dump(2);
+    auto const& data = json.at("data");
+    record->set_id(data.at("id").get<std::string>());
+    auto const& public_key = data.at("publicKey");
+    record->set_type(data.value("type", KeyType::kRSA));
+    if (IsRSAKey(*record)) {
+      record->set_modulus(Base64UrlDecode(
+        public_key.at("modulus").get<std::string>()));
+      record->set_public_exponent(Base64UrlDecode(
+        public_key.at("publicExponent").get<std::string>()));
+    } else {
+      // EC keys carry their uncompressed public point instead.
+      record->set_modulus(std::string());
+      record->set_public_exponent(std::string());
+      if (GetKeyCurve(*record) != NID_undef)
+        record->set_ec_point(Base64UrlDecode(
+          public_key.at("data").get<std::string>()));
+    }
+    record->set_purpose(data.at("purpose").get<std::string>());
+    record->set_location(loc);
+  }
+  catch (JSON::exception& e) {
+    VLOG(1) << "Invalid JSON structure: " << e.what();
+    return false;
+  }
+  catch (cppcodec::parse_error& e) {
+    VLOG(1) << "Invalid public key encoding: " << e.what();
+    return false;
+  }
+  return true;
+}
+
+bool NetUtilityImpl::CreateKeyObjects(P11NetFactory* factory,
+                                      const KeyRecord& record,
+                                      std::unique_ptr<Object>* public_key,
+                                      std::unique_ptr<Object>* private_key) {
+  const std::string& id = record.id();
+  const std::string& modulus = record.modulus();
+  const std::string& public_exponent = record.public_exponent();
+  const bool is_rsa = IsRSAKey(record);
+  std::string ec_params;
+  if (!is_rsa) {
+    ec_params = GetECParameters(GetKeyCurve(record));
+    if (ec_params.empty()) {
+      LOG(ERROR) << "Key " << id << " has unsupported type " << record.type();
+      return false;
+    }
+  }
+  // The NetHSM cannot decrypt with EC keys.
+  bool forEncrypting = is_rsa &&
+                       boost::contains(record.purpose(), Purpose::kEncrypt);
+  bool forSigning = boost::contains(record.purpose(), Purpose::kSign);
+
+  std::unique_ptr<Object> public_object(factory->CreateObject());
+  CHECK(public_object.get());
+  public_object->SetAttributeString(CKA_ID, id);
+  public_object->SetAttributeString(CKA_LABEL, id);
+  public_object->SetAttributeInt(CKA_CLASS, CKO_PUBLIC_KEY);
+  public_object->SetAttributeInt(CKA_KEY_TYPE, is_rsa ? CKK_RSA : CKK_EC);
+  public_object->SetAttributeBool(CKA_MODIFIABLE, false);
+  public_object->SetAttributeBool(CKA_TOKEN, true);
+  if (is_rsa) {
     public_object->SetAttributeString(CKA_PUBLIC_EXPONENT, public_exponent);
     public_object->SetAttributeString(CKA_MODULUS, modulus);
     int modulus_bits = modulus.size()*8;
     public_object->SetAttributeInt(CKA_MODULUS_BITS, modulus_bits);
-    if (forEncrypting) {
-      public_object->SetAttributeBool(CKA_ENCRYPT, true);
-    }
-    if (forSigning) {
-      public_object->SetAttributeBool(CKA_VERIFY, true);
-    }
-
-    std::unique_ptr<Object> private_object(factory_->CreateObject());
-    CHECK(private_object.get());
-    private_object->SetAttributeString(CKA_ID, id);
-    private_object->SetAttributeString(CKA_LABEL, id);
-    private_object->SetAttributeInt(CKA_CLASS, CKO_PRIVATE_KEY);
-    private_object->SetAttributeInt(CKA_KEY_TYPE, CKK_RSA);
-    private_object->SetAttributeBool(CKA_MODIFIABLE, false);
-    private_object->SetAttributeBool(CKA_TOKEN, true);
-    private_object->SetAttributeBool(CKA_PRIVATE, true);
-    private_object->SetAttributeBool(CKA_SENSITIVE, true);
-    private_object->SetAttributeBool(CKA_EXTRACTABLE, false);
-    private_object->SetAttributeBool(CKA_ALWAYS_SENSITIVE, true);
-    private_object->SetAttributeBool(CKA_NEVER_EXTRACTABLE, true);
+  } else {
+    public_object->SetAttributeString(CKA_EC_PARAMS, ec_params);
+    public_object->SetAttributeString(CKA_EC_POINT,
+                                      EncodeECPoint(record.ec_point()));
+  }
+  if (forEncrypting) {
+    public_object->SetAttributeBool(CKA_ENCRYPT, true);
+  }
+  if (forSigning) {
+    public_object->SetAttributeBool(CKA_VERIFY, true);
+  }
+
+  std::unique_ptr<Object> private_object(factory->CreateObject());
+  CHECK(private_object.get());
+  private_object->SetAttributeString(CKA_ID, id);
+  private_object->SetAttributeString(CKA_LABEL, id);
+  private_object->SetAttributeInt(CKA_CLASS, CKO_PRIVATE_KEY);
+  private_object->SetAttributeInt(CKA_KEY_TYPE, is_rsa ? CKK_RSA : CKK_EC);
+  private_object->SetAttributeBool(CKA_MODIFIABLE, false);
+  private_object->SetAttributeBool(CKA_TOKEN, true);
+  private_object->SetAttributeBool(CKA_PRIVATE, true);
+  private_object->SetAttributeBool(CKA_SENSITIVE, true);
+  private_object->SetAttributeBool(CKA_EXTRACTABLE, false);
+  private_object->SetAttributeBool(CKA_ALWAYS_SENSITIVE, true);
+  private_object->SetAttributeBool(CKA_NEVER_EXTRACTABLE, true);
+  private_object->SetAttributeString(kKeyLocationAttribute, record.location());
+  if (is_rsa) {
     private_object->SetAttributeString(CKA_PUBLIC_EXPONENT, public_exponent);
-    private_object->SetAttributeString(kKeyLocationAttribute, loc);
     private_object->SetAttributeString(CKA_MODULUS, modulus);
-    if (forEncrypting) {
-      private_object->SetAttributeBool(CKA_DECRYPT, true);
+  } else {
+    private_object->SetAttributeString(CKA_EC_PARAMS, ec_params);
+  }
+  if (forEncrypting) {
+    private_object->SetAttributeBool(CKA_DECRYPT, true);
+  }
+  if (forSigning) {
+    private_object->SetAttributeBool(CKA_SIGN, true);
+  }
+
+  if (public_object->FinalizeNewObject() != CKR_OK)
+    return false;
+  if (private_object->FinalizeNewObject() != CKR_OK)
+    return false;
+  *public_key = std::move(public_object);
+  *private_key = std::move(private_object);
+  return true;
+}
+
+bool NetUtilityImpl::CreateCertificateStub(
+    P11NetFactory* factory,
+    const KeyRecord& record,
+    std::unique_ptr<Object>* certificate) {
+  std::unique_ptr<Object> object(factory->CreateObject());
+  CHECK(object.get());
+  object->SetAttributeString(CKA_ID, record.id());
+  object->SetAttributeString(CKA_LABEL, record.id());
+  object->SetAttributeInt(CKA_CLASS, CKO_CERTIFICATE);
+  object->SetAttributeInt(CKA_CERTIFICATE_TYPE, CKC_X_509);
+  object->SetAttributeBool(CKA_MODIFIABLE, false);
+  object->SetAttributeBool(CKA_TOKEN, true);
+  // Filled in by LoadCertificate.
+  object->SetAttributeString(CKA_SUBJECT, std::string());
+  object->SetAttributeString(CKA_VALUE, std::string());
+  object->SetAttributeString(kCertificateLocationAttribute,
+                             record.location() + "/cert");
+  if (object->FinalizeNewObject() != CKR_OK)
+    return false;
+  *certificate = std::move(object);
+  return true;
+}
+
+bool NetUtilityImpl::InsertKeyObjects(const KeyRecord& record) {
+  // An evicted key is rebuilt from its updated record once it is used again.
+  if (IsEvicted(record.id()))
+    return true;
+  // Keys of other types, e.g. Ed25519 ones, are left out of the token.
+  if (!IsRSAKey(record) && GetKeyCurve(record) == NID_undef) {
+    VLOG(1) << "Skipping key " << record.id() << " of type " << record.type();
+    return true;
+  }
+  std::unique_ptr<Object> public_object;
+  std::unique_ptr<Object> private_object;
+  if (!CreateKeyObjects(factory_.get(), record, &public_object,
+                        &private_object))
+    return false;
+  std::unique_ptr<Object> certificate_object;
+  if (certificates_ && !IsCertificateMissing(record.id()) &&
+      !CreateCertificateStub(factory_.get(), record, &certificate_object))
+    return false;
+  // Every object is built before the pool is touched. The key's objects then
+  // go into the pool together, replacing the stale ones under a single lock
+  // of the pool, or none of them do.
+  bool public_unchanged = false;
+  bool private_unchanged = false;
+  bool certificate_unchanged = !certificate_object;
+  std::vector<const Object*> stale;
+  if (!FindStale(public_object.get(), false, &public_unchanged, &stale) ||
+      !FindStale(private_object.get(), false, &private_unchanged, &stale))
+    return false;
+  // The certificate of a replaced key is fetched again.
+  if (certificate_object &&
+      !FindStale(certificate_object.get(),
+                 !public_unchanged || !private_unchanged,
+                 &certificate_unchanged, &stale))
+    return false;
+  std::vector<Object*> batch;
+  if (!public_unchanged)
+    batch.push_back(public_object.get());
+  if (!private_unchanged)
+    batch.push_back(private_object.get());
+  if (!certificate_unchanged)
+    batch.push_back(certificate_object.get());
+  if (!batch.empty()) {
+    // Objects that replace stale ones have their handles already.
+    std::vector<Object*> added;
+    for (auto i = batch.begin(); i != batch.end(); ++i) {
+      if ((*i)->handle() <= 0)
+        added.push_back(*i);
     }
-    if (forSigning) {
-      private_object->SetAttributeBool(CKA_SIGN, true);
+    ReuseHandles(record.id(), batch);
+    if (!PutKeyObjects(stale, batch)) {
+      // A handle may have been taken meanwhile; fall back to new ones.
+      for (auto i = added.begin(); i != added.end(); ++i)
+        (*i)->set_handle(0);
+      if (!PutKeyObjects(stale, batch))
+        return false;
+      ReuseHandles(record.id(), batch);
     }
+    if (!public_unchanged)
+      public_object.release();
+    if (!private_unchanged)
+      private_object.release();
+    if (!certificate_unchanged)
+      certificate_object.release();
+  }
+  if (max_resident_keys_ > 0) {
+    {
+      boost::lock_guard<boost::mutex> lock(keys_lock_);
+      TouchKey(record.id());
+    }
+    EvictColdKeys();
+  }
+  return true;
+}
 
-    if (public_object->FinalizeNewObject() != CKR_OK)
-      continue;
-    if (private_object->FinalizeNewObject() != CKR_OK)
+bool NetUtilityImpl::PutKeyObjects(const std::vector<const Object*>& stale,
+                                   const std::vector<Object*>& batch) {
+  if (stale.empty())
+    return token_object_pool_->InsertBatch(batch);
+  return token_object_pool_->ReplaceBatch(stale, batch);
+}
+
+void NetUtilityImpl::ReuseHandles(const std::string& key_id,
+                                  const std::vector<Object*>& batch) {
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  StableHandles& stable = stable_handles_[key_id];
+  stable.removed = Clock::time_point();
+  KeyHandles& handles = stable.handles;
+  for (auto i = batch.begin(); i != batch.end(); ++i) {
+    int* handle = NULL;
+    switch ((*i)->GetObjectClass()) {
+      case CKO_PUBLIC_KEY:
+        handle = &handles.public_handle;
+        break;
+      case CKO_PRIVATE_KEY:
+        handle = &handles.private_handle;
+        break;
+      case CKO_CERTIFICATE:
+        handle = &handles.certificate_handle;
+        break;
+      default:
+        continue;
+    }
+    if ((*i)->handle() > 0)
+      *handle = (*i)->handle();
+    else if (*handle > 0)
+      (*i)->set_handle(*handle);
+  }
+}
+
+bool NetUtilityImpl::LoadSnapshot() {
+  snapshot_.reset();
+  if (token_path_.empty())
+    return false;
+  std::unique_ptr<KeySnapshot> snapshot(new KeySnapshot());
+  if (snapshot->Open(token_path_ / kKeySnapshotFile)) {
+    if (snapshot->endpoint() != endpoint_) {
+      LOG(INFO) << "Ignoring key inventory snapshot of "
+                << snapshot->endpoint();
+      return false;
+    }
+    LOG(INFO) << "Mapped " << snapshot->size()
+              << " keys from the key inventory snapshot.";
+    snapshot_ = std::move(snapshot);
+    snapshot_loaded_ = Clock::now();
+    return true;
+  }
+  std::string blob;
+  {
+    std::unique_ptr<ObjectStore> store(
+        factory_->CreateObjectStore(token_path_));
+    if (!store || !store->GetInternalBlob(kKeyInventory, &blob))
+      return false;
+  }
+  KeyInventory inventory;
+  if (!inventory.ParseFromString(blob)) {
+    LOG(WARNING) << "Ignoring unparsable key inventory snapshot.";
+    return false;
+  }
+  if (inventory.endpoint() != endpoint_) {
+    LOG(INFO) << "Ignoring key inventory snapshot of " << inventory.endpoint();
+    return false;
+  }
+  ApplyInventory(inventory, false);
+  LOG(INFO) << "Loaded " << inventory.key_size()
+            << " keys from the key inventory snapshot.";
+  return true;
+}
+
+bool NetUtilityImpl::ImportSharedInventory() {
+  if (!shared_key_cache_)
+    return false;
+  uint64_t sequence = 0;
+  std::string blob;
+  if (!shared_key_cache_->Read(&sequence, &blob))
+    return false;
+  // Only a new publication renews the cache entries, so that keys go stale
+  // here when the writer stops refreshing them.
+  if (sequence == shared_sequence_)
+    return false;
+  KeyInventory inventory;
+  if (!inventory.ParseFromString(blob)) {
+    LOG(WARNING) << "Ignoring unparsable shared key inventory.";
+    return false;
+  }
+  if (inventory.endpoint() != endpoint_) {
+    VLOG(1) << "Ignoring shared key inventory of " << inventory.endpoint();
+    return false;
+  }
+  ApplyInventory(inventory, inventory.complete());
+  shared_sequence_ = sequence;
+  VLOG(1) << "Imported " << inventory.key_size()
+          << " keys from the shared key inventory.";
+  return true;
+}
+
+void NetUtilityImpl::InsertSnapshotKey(const std::string& key_id) {
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    if (inventory_.count(key_id))
+      return;
+  }
+  KeyRecord record;
+  if (!snapshot_->Find(key_id, &record) || !InsertKeyObjects(record))
+    return;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  loaded_keys_[key_id] = snapshot_loaded_;
+  inventory_[key_id] = record;
+}
+
+void NetUtilityImpl::InsertSnapshotKeys() {
+  if (!snapshot_)
+    return;
+  for (size_t i = 0; i < snapshot_->size(); ++i)
+    InsertSnapshotKey(snapshot_->GetKeyId(i));
+  if (snapshot_->complete()) {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    if (!all_keys_loaded_)
+      all_keys_loaded_ = snapshot_loaded_;
+  }
+  snapshot_.reset();
+}
+
+void NetUtilityImpl::ApplyInventory(const KeyInventory& inventory,
+                                    bool remove_unlisted) {
+  if (remove_unlisted) {
+    // The inventory supersedes the snapshot of the last run.
+    snapshot_.reset();
+    std::set<std::string> listed;
+    for (int i = 0; i < inventory.key_size(); ++i)
+      listed.insert(inventory.key(i).id());
+    std::vector<std::string> removed;
+    {
+      boost::lock_guard<boost::mutex> lock(keys_lock_);
+      for (auto i = inventory_.begin(); i != inventory_.end(); ++i) {
+        if (!listed.count(i->first))
+          removed.push_back(i->first);
+      }
+    }
+    for (auto i = removed.begin(); i != removed.end(); ++i) {
+      RemoveKeyObjects(*i);
+      boost::lock_guard<boost::mutex> lock(keys_lock_);
+      inventory_.erase(*i);
+      loaded_keys_.erase(*i);
+    }
+  }
+  const Clock::time_point now = Clock::now();
+  for (int i = 0; i < inventory.key_size(); ++i) {
+    const KeyRecord& record = inventory.key(i);
+    if (!InsertKeyObjects(record))
       continue;
-    if (!token_object_pool_->Insert(public_object.get()))
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    loaded_keys_[record.id()] = now;
+    inventory_[record.id()] = record;
+  }
+  if (inventory.complete()) {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    all_keys_loaded_ = now;
+  }
+}
+
+void NetUtilityImpl::ReportCacheMemory() {
+  static Gauge* const cache_bytes = Metrics::Get()->GetGauge(
+      "p11net_key_cache_bytes");
+  // Tree and hash nodes cost about this much beyond their keys and values.
+  const size_t kNodeBytes = 48;
+  size_t bytes = 0;
+  for (auto i = inventory_.begin(); i != inventory_.end(); ++i) {
+    const KeyRecord& record = i->second;
+    bytes += kNodeBytes + sizeof(record) + i->first.size() +
+             record.id().size() + record.modulus().size() +
+             record.public_exponent().size() + record.purpose().size() +
+             record.location().size() + record.type().size() +
+             record.ec_point().size();
+  }
+  for (auto i = loaded_keys_.begin(); i != loaded_keys_.end(); ++i)
+    bytes += kNodeBytes + sizeof(*i) + i->first.size();
+  for (auto i = missing_keys_.begin(); i != missing_keys_.end(); ++i)
+    bytes += kNodeBytes + sizeof(*i) + i->first.size();
+  // Resident keys are listed and indexed, evicted ones by id and by handle.
+  for (auto i = resident_keys_.begin(); i != resident_keys_.end(); ++i)
+    bytes += 2 * (kNodeBytes + sizeof(*i) + i->first.size());
+  for (auto i = evicted_keys_.begin(); i != evicted_keys_.end(); ++i)
+    bytes += 3 * (kNodeBytes + sizeof(*i) + i->first.size());
+  for (auto i = stable_handles_.begin(); i != stable_handles_.end(); ++i)
+    bytes += kNodeBytes + sizeof(*i) + i->first.size();
+  cache_bytes->Add(static_cast<int64_t>(bytes) - reported_cache_bytes_);
+  reported_cache_bytes_ = bytes;
+}
+
+void NetUtilityImpl::SaveSnapshot() {
+  {
+    // The inventory changed; this is also the cue to account for it.
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    ReportCacheMemory();
+  }
+  const bool publish =
+      shared_key_cache_ && shared_key_cache_->TryBecomeWriter();
+  if (token_path_.empty() && !publish)
+    return;
+  KeyInventory inventory;
+  inventory.set_endpoint(endpoint_);
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    inventory.set_complete(static_cast<bool>(all_keys_loaded_));
+    for (auto i = inventory_.begin(); i != inventory_.end(); ++i)
+      *inventory.add_key() = i->second;
+  }
+  // Keys of the mapped snapshot that were not looked up yet are still known.
+  if (snapshot_) {
+    for (size_t i = 0; i < snapshot_->size(); ++i) {
+      const std::string key_id = snapshot_->GetKeyId(i);
+      KeyRecord record;
+      bool known = false;
+      {
+        boost::lock_guard<boost::mutex> lock(keys_lock_);
+        known = inventory_.count(key_id) != 0;
+      }
+      if (!known && snapshot_->GetRecord(i, &record))
+        *inventory.add_key() = record;
+    }
+  }
+  std::string blob;
+  if (!inventory.SerializeToString(&blob)) {
+    LOG(WARNING) << "Failed to serialize the key inventory.";
+    return;
+  }
+  if (publish) {
+    shared_key_cache_->Publish(blob);
+    // The next import would only return what was just published.
+    uint64_t sequence = 0;
+    std::string published;
+    if (shared_key_cache_->Read(&sequence, &published))
+      shared_sequence_ = sequence;
+  }
+  if (token_path_.empty())
+    return;
+  if (!KeySnapshot::Write(token_path_ / kKeySnapshotFile, inventory))
+    LOG(WARNING) << "Failed to save the key inventory snapshot.";
+}
+
+void NetUtilityImpl::WaitForRevalidation() {
+  if (revalidation_thread_.joinable())
+    revalidation_thread_.join();
+  boost::unique_lock<boost::mutex> lock(stale_lock_);
+  stale_done_.wait(lock, [this] { return revalidating_keys_.empty(); });
+}
+
+boost::optional<std::string> NetUtilityImpl::GenerateKeyPair(
+    int modulus_bits,
+    const std::string& key_id,
+    bool for_signing) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  return Wait(StartKeyGeneration(modulus_bits, key_id, for_signing));
+}
+
+void NetUtilityImpl::GenerateKeyPairAsync(int modulus_bits,
+                                          const std::string& key_id,
+                                          bool for_signing,
+                                          const ResultCallback& callback) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  Notify(StartKeyGeneration(modulus_bits, key_id, for_signing), callback);
+}
+
+pplx::task<boost::optional<std::string>> NetUtilityImpl::StartKeyGeneration(
+    int modulus_bits,
+    const std::string& key_id,
+    bool for_signing) {
+  JSON request;
+  request["purpose"] = for_signing ? Purpose::kSign : Purpose::kEncrypt;
+  request["length"] = modulus_bits;
+  if (!key_id.empty())
+    request["id"] = key_id;
+  VLOG(2) << "Request: " << request.dump();
+  const Clock::time_point start = Clock::now();
+  auto connection = GetCluster()->Acquire();
+  std::shared_ptr<TraceSpan> span;
+  pplx::task<web::http::http_response> sent = SendRequest(
+      connection->client(), web::http::methods::POST, "generate",
+      kApiPath + "keys/generate", request.dump(), &span,
+      pplx::cancellation_token::none());
+  return sent
+      .then([connection, start, span](web::http::http_response response) {
+        VLOG(1) << "Received response status code: "
+                << response.status_code();
+        RecordResponse("generate", start, response.status_code(), span.get());
+        if (response.status_code() >= kMinServerErrorStatus)
+          connection->ReportFailure();
+        else
+          connection->ReportSuccess();
+        boost::optional<std::string> id;
+        if (response.status_code() >= 300) {
+          LOG(ERROR) << "Key generation failed with status "
+                     << response.status_code();
+          return pplx::task_from_result(id);
+        }
+        // The NetHSM names the new key in the Location header.
+        std::string location;
+        if (response.headers().match("Location", location)) {
+          id = location.substr(location.rfind('/') + 1);
+          return pplx::task_from_result(id);
+        }
+        return response.extract_utf8string().then(
+            [](const std::string& body) {
+              boost::optional<std::string> id;
+              try {
+                id = JSON::parse(body).at("id").get<std::string>();
+              }
+              catch (JSON::exception& e) {
+                VLOG(1) << "Invalid JSON structure: " << e.what();
+              }
+              return id;
+            });
+      })
+      .then([this](const boost::optional<std::string>& id) {
+        if (!id)
+          return id;
+        LOG(INFO) << "Generated key " << *id << " on the NetHSM.";
+        boost::lock_guard<boost::mutex> lock(load_lock_);
+        {
+          boost::lock_guard<boost::mutex> keys_lock(keys_lock_);
+          missing_keys_.erase(*id);
+        }
+        if (!FetchKeys(*id, std::string()))
+          return boost::optional<std::string>();
+        return id;
+      });
+}
+
+void NetUtilityImpl::SetReachabilityCallback(
+    const std::function<void(bool)>& callback) {
+  reachability_callback_ = callback;
+}
+
+bool NetUtilityImpl::GenerateRandom(int num_bytes, std::string* random_data) {
+  CheckFork();
+  if (!random_pool_ || num_bytes < 0)
+    return false;
+  if (random_pool_->Take(num_bytes, random_data))
+    return true;
+  if (random_fallback_) {
+    VLOG(1) << "Random pool drained";
+    return false;
+  }
+  // Wait for the NetHSM, one request at a time.
+  random_data->clear();
+  while (random_data->size() < static_cast<size_t>(num_bytes)) {
+    boost::optional<std::string> chunk = Wait(RequestRandom(std::min(
+        kMaxRandomRequestBytes, num_bytes - random_data->size())));
+    if (!chunk || chunk->empty())
+      return false;
+    random_data->append(*chunk);
+  }
+  random_data->resize(num_bytes);
+  return true;
+}
+
+pplx::task<boost::optional<std::string>> NetUtilityImpl::RequestRandom(
+    size_t num_bytes) {
+  VLOG(1) << "Requesting " << num_bytes << " random bytes";
+  JSON request;
+  request["length"] = num_bytes;
+  const Clock::time_point start = Clock::now();
+  auto connection = GetCluster()->Acquire();
+  std::shared_ptr<TraceSpan> span;
+  pplx::task<web::http::http_response> sent = SendRequest(
+      connection->client(), web::http::methods::POST, "random",
+      kApiPath + "random", request.dump(), &span,
+      pplx::cancellation_token::none());
+  return sent
+      .then([connection, start, span](web::http::http_response response) {
+        VLOG(1) << "Received response status code: "
+                << response.status_code();
+        RecordResponse("random", start, response.status_code(), span.get());
+        if (response.status_code() >= kMinServerErrorStatus)
+          connection->ReportFailure();
+        else
+          connection->ReportSuccess();
+        return response.extract_utf8string();
+      })
+      .then([](const std::string& body) {
+        boost::optional<std::string> result;
+        try {
+          result = Base64UrlDecode(
+            JSON::parse(body).at("random").get<std::string>());
+        }
+        catch (JSON::exception& e) {
+          VLOG(1) << "Invalid JSON structure: " << e.what();
+        }
+        catch (cppcodec::parse_error& e) {
+          VLOG(1) << "Invalid random data encoding: " << e.what();
+        }
+        return result;
+      });
+}
+
+void NetUtilityImpl::RemoveKeyObjects(const std::string& key_id) {
+  std::unique_ptr<Object> search_template(factory_->CreateObject());
+  CHECK(search_template.get());
+  search_template->SetAttributeString(CKA_ID, key_id);
+  search_template->SetAttributeBool(CKA_TOKEN, true);
+  std::vector<const Object*> existing;
+  KeyHandles handles;
+  if (token_object_pool_->Find(search_template.get(), &existing) &&
+      !existing.empty()) {
+    for (auto i = existing.begin(); i != existing.end(); ++i) {
+      if ((*i)->GetObjectClass() == CKO_PUBLIC_KEY)
+        handles.public_handle = (*i)->handle();
+      else if ((*i)->GetObjectClass() == CKO_PRIVATE_KEY)
+        handles.private_handle = (*i)->handle();
+      else if ((*i)->GetObjectClass() == CKO_CERTIFICATE)
+        handles.certificate_handle = (*i)->handle();
+    }
+    token_object_pool_->DeleteBatch(existing);
+  }
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  // Should the key come back, its objects get their handles again.
+  if (!existing.empty()) {
+    StableHandles& stable = stable_handles_[key_id];
+    if (handles.public_handle)
+      stable.handles.public_handle = handles.public_handle;
+    if (handles.private_handle)
+      stable.handles.private_handle = handles.private_handle;
+    if (handles.certificate_handle)
+      stable.handles.certificate_handle = handles.certificate_handle;
+    stable.removed = Clock::now();
+  }
+  auto resident = resident_index_.find(key_id);
+  if (resident != resident_index_.end()) {
+    resident_keys_.erase(resident->second);
+    resident_index_.erase(resident);
+  }
+  auto evicted = evicted_keys_.find(key_id);
+  if (evicted != evicted_keys_.end()) {
+    evicted_handles_.erase(evicted->second.public_handle);
+    evicted_handles_.erase(evicted->second.private_handle);
+    evicted_handles_.erase(evicted->second.certificate_handle);
+    evicted_keys_.erase(evicted);
+  }
+  missing_certificates_.erase(key_id);
+  if (signature_cache_)
+    signature_cache_->EraseKey(key_id);
+}
+
+bool NetUtilityImpl::HasEvictedKeys() {
+  if (max_resident_keys_ == 0)
+    return false;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  return !evicted_keys_.empty();
+}
+
+void NetUtilityImpl::RestoreEvictedKeys() {
+  std::vector<std::string> key_ids;
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    for (auto i = evicted_keys_.begin(); i != evicted_keys_.end(); ++i)
+      key_ids.push_back(i->first);
+  }
+  for (auto i = key_ids.begin(); i != key_ids.end(); ++i)
+    RestoreKey(*i);
+}
+
+bool NetUtilityImpl::IsEvicted(const std::string& key_id) {
+  if (max_resident_keys_ == 0 || key_id.empty())
+    return false;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  return evicted_keys_.count(key_id) > 0;
+}
+
+void NetUtilityImpl::TouchKey(const std::string& key_id) {
+  const Clock::time_point now = Clock::now();
+  auto it = resident_index_.find(key_id);
+  if (it == resident_index_.end()) {
+    resident_keys_.push_front(std::make_pair(key_id, now));
+    resident_index_[key_id] = resident_keys_.begin();
+    return;
+  }
+  it->second->second = now;
+  resident_keys_.splice(resident_keys_.begin(), resident_keys_, it->second);
+}
+
+void NetUtilityImpl::TouchResidentKey(const std::string& key_id) {
+  if (max_resident_keys_ == 0)
+    return;
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  if (resident_index_.count(key_id))
+    TouchKey(key_id);
+}
+
+void NetUtilityImpl::EvictColdKeys() {
+  if (max_resident_keys_ == 0)
+    return;
+  static Counter* const evictions = Metrics::Get()->GetCounter(
+      "p11net_key_evictions_total");
+  std::vector<std::string> victims;
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    const Clock::time_point now = Clock::now();
+    // Keys in use stay, even above the limit.
+    while (resident_keys_.size() > max_resident_keys_ &&
+           now - resident_keys_.back().second >= eviction_idle_time_) {
+      victims.push_back(resident_keys_.back().first);
+      resident_index_.erase(resident_keys_.back().first);
+      resident_keys_.pop_back();
+    }
+  }
+  for (auto i = victims.begin(); i != victims.end(); ++i) {
+    std::unique_ptr<Object> search_template(factory_->CreateObject());
+    CHECK(search_template.get());
+    search_template->SetAttributeString(CKA_ID, *i);
+    search_template->SetAttributeBool(CKA_TOKEN, true);
+    std::vector<const Object*> existing;
+    if (!token_object_pool_->Find(search_template.get(), &existing))
       continue;
-    if (!token_object_pool_->Insert(private_object.get())) {
-      token_object_pool_->Delete(public_object.get());
+    KeyHandles evicted;
+    for (auto j = existing.begin(); j != existing.end(); ++j) {
+      if ((*j)->GetObjectClass() == CKO_PUBLIC_KEY)
+        evicted.public_handle = (*j)->handle();
+      else if ((*j)->GetObjectClass() == CKO_PRIVATE_KEY)
+        evicted.private_handle = (*j)->handle();
+      else if ((*j)->GetObjectClass() == CKO_CERTIFICATE)
+        evicted.certificate_handle = (*j)->handle();
+    }
+    if (!existing.empty() && !token_object_pool_->DeleteBatch(existing))
       continue;
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    evicted_keys_[*i] = evicted;
+    if (evicted.public_handle)
+      evicted_handles_[evicted.public_handle] = *i;
+    if (evicted.private_handle)
+      evicted_handles_[evicted.private_handle] = *i;
+    if (evicted.certificate_handle)
+      evicted_handles_[evicted.certificate_handle] = *i;
+    evictions->Increment();
+  }
+  if (victims.empty())
+    return;
+  VLOG(1) << "Evicted " << victims.size() << " idle keys";
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  ReportCacheMemory();
+}
+
+bool NetUtilityImpl::RestoreKey(const std::string& key_id) {
+  static Counter* const restores = Metrics::Get()->GetCounter(
+      "p11net_key_restores_total");
+  KeyHandles evicted;
+  KeyRecord record;
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    auto it = evicted_keys_.find(key_id);
+    if (it == evicted_keys_.end())
+      return true;
+    evicted = it->second;
+    auto known = inventory_.find(key_id);
+    if (known == inventory_.end()) {
+      LOG(WARNING) << "No inventory record for evicted key " << key_id;
+      return false;
     }
-    public_object.release();
-    private_object.release();
+    record = known->second;
+  }
+  std::unique_ptr<Object> public_object;
+  std::unique_ptr<Object> private_object;
+  if (!CreateKeyObjects(factory_.get(), record, &public_object,
+                        &private_object))
+    return false;
+  public_object->set_handle(evicted.public_handle);
+  private_object->set_handle(evicted.private_handle);
+  std::vector<Object*> batch = {public_object.get(), private_object.get()};
+  // The certificate comes back as a stub and is fetched again when read.
+  std::unique_ptr<Object> certificate_object;
+  if (evicted.certificate_handle) {
+    if (!CreateCertificateStub(factory_.get(), record, &certificate_object))
+      return false;
+    certificate_object->set_handle(evicted.certificate_handle);
+    batch.push_back(certificate_object.get());
   }
+  if (!token_object_pool_->InsertBatch(batch)) {
+    LOG(WARNING) << "Failed to restore evicted key " << key_id;
+    return false;
+  }
+  public_object.release();
+  private_object.release();
+  certificate_object.release();
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    evicted_handles_.erase(evicted.public_handle);
+    evicted_handles_.erase(evicted.private_handle);
+    evicted_handles_.erase(evicted.certificate_handle);
+    evicted_keys_.erase(key_id);
+    TouchKey(key_id);
+  }
+  restores->Increment();
+  VLOG(1) << "Restored evicted key " << key_id;
+  EvictColdKeys();
   return true;
 }
 
-boost::optional<std::string> NetUtilityImpl::Decrypt(
-    const std::string& key_loc,
-    const std::string& encrypted_data) {
-  VLOG(1) << __PRETTY_FUNCTION__;
-  std::string encrypted_data_b64 = base64::encode(encrypted_data);
-  JSON body;
-  body["encrypted"] = encrypted_data_b64;
-  VLOG(1) << "Request:\n" << body.dump(2);
-  auto response = client_->request(web::http::methods::POST,
-    key_loc + "/actions/pkcs1/decrypt", body.dump(), "application/json").get();
-  VLOG(1) << "Received response status code: " << response.status_code();
-  auto const json = JSON::parse(response.extract_utf8string().get());
-  VLOG(1) << "Response:\n" << json.dump(2);
-  std::string result;
+bool NetUtilityImpl::RestoreObject(int handle) {
+  if (max_resident_keys_ == 0)
+    return false;
+  std::string key_id;
+  {
+    boost::lock_guard<boost::mutex> lock(keys_lock_);
+    auto it = evicted_handles_.find(handle);
+    if (it == evicted_handles_.end())
+      return false;
+    key_id = it->second;
+  }
+  boost::lock_guard<boost::mutex> lock(load_lock_);
+  return RestoreKey(key_id);
+}
+
+void NetUtilityImpl::MarkKeyUsed(const Object& object) {
+  if (max_resident_keys_ == 0 ||
+      (!object.IsAttributePresent(kKeyLocationAttribute) &&
+       !object.IsAttributePresent(kCertificateLocationAttribute)))
+    return;
+  TouchResidentKey(object.GetAttributeString(CKA_ID));
+}
+
+bool NetUtilityImpl::LoadCertificate(int handle) {
+  std::shared_ptr<const Object> object;
+  // An evicted certificate comes back as a stub.
+  const bool found = token_object_pool_->FindByHandle(handle, &object) ||
+      (RestoreObject(handle) &&
+       token_object_pool_->FindByHandle(handle, &object));
+  if (!found || !object->IsAttributePresent(kCertificateLocationAttribute) ||
+      !object->GetAttributeString(CKA_VALUE).empty())
+    return true;
+  P11NET_TRACE_SPAN("load certificate");
+  const std::string loc =
+      object->GetAttributeString(kCertificateLocationAttribute);
+  const Clock::time_point deadline = GetRetryDeadline(Clock::now());
+  std::shared_future<boost::optional<std::string>> fetch =
+      FetchCertificate(loc);
+  if (deadline != Clock::time_point::max() &&
+      fetch.wait_until(deadline) != std::future_status::ready) {
+    LOG(WARNING) << "Fetching certificate " << loc
+                 << " exceeded the operation deadline";
+    return false;
+  }
+  const boost::optional<std::string>& body = fetch.get();
+  if (!body)
+    return false;
+  boost::lock_guard<boost::mutex> lock(certificate_lock_);
+  // Another reader of the stub may have filled it in meanwhile.
+  if (!token_object_pool_->FindByHandle(handle, &object) ||
+      !object->GetAttributeString(CKA_VALUE).empty())
+    return true;
+  const std::string key_id = object->GetAttributeString(CKA_ID);
+  if (body->empty()) {
+    VLOG(1) << "Key " << key_id << " has no certificate";
+    {
+      boost::lock_guard<boost::mutex> keys_lock(keys_lock_);
+      if (negative_cache_ttl_ > Clock::duration::zero())
+        missing_certificates_[key_id] = Clock::now();
+    }
+    token_object_pool_->Delete(object.get());
+    return true;
+  }
+  std::string value;
+  std::string subject;
+  std::string issuer;
+  std::string serial_number;
+  if (!ParseCertificate(*body, &value, &subject, &issuer, &serial_number)) {
+    LOG(WARNING) << "Invalid certificate for key " << key_id;
+    return false;
+  }
+  // Readers may hold the stub, so the certificate takes its place as a new
+  // object rather than being written into it.
+  std::unique_ptr<Object> certificate(factory_->CreateObject());
+  CHECK(certificate.get());
+  if (certificate->Copy(object.get()) != CKR_OK)
+    return false;
+  certificate->SetAttributeString(CKA_VALUE, value);
+  certificate->SetAttributeString(CKA_SUBJECT, subject);
+  certificate->SetAttributeString(CKA_ISSUER, issuer);
+  certificate->SetAttributeString(CKA_SERIAL_NUMBER, serial_number);
+  if (certificate->FinalizeNewObject() != CKR_OK)
+    return false;
+  certificate->set_handle(handle);
+  if (!token_object_pool_->ReplaceBatch(
+          std::vector<const Object*>(1, object.get()),
+          std::vector<Object*>(1, certificate.get())))
+    return false;
+  certificate.release();
+  return true;
+}
+
+bool NetUtilityImpl::IsCertificateMissing(const std::string& key_id) {
+  boost::lock_guard<boost::mutex> lock(keys_lock_);
+  auto it = missing_certificates_.find(key_id);
+  if (it == missing_certificates_.end())
+    return false;
+  if (Clock::now() - it->second < negative_cache_ttl_)
+    return true;
+  missing_certificates_.erase(it);
+  return false;
+}
+
+std::shared_future<boost::optional<std::string>>
+NetUtilityImpl::FetchCertificate(const std::string& loc) {
+  boost::lock_guard<boost::mutex> lock(certificate_fetches_lock_);
+  auto it = certificate_fetches_.find(loc);
+  if (it != certificate_fetches_.end())
+    return it->second;
+  std::shared_ptr<std::promise<boost::optional<std::string>>> promise =
+      std::make_shared<std::promise<boost::optional<std::string>>>();
+  std::shared_future<boost::optional<std::string>> fetch =
+      promise->get_future().share();
+  pplx::task<std::string> request;
   try {
-    result = base64::decode<std::string>(
-      json.at("data").at("decrypted").get<std::string>());
+    request = RequestCertificate(loc);
   }
-  catch (JSON::exception& e) {
-    VLOG(1) << "Invalid JSON structure: " << e.what();
+  catch (std::exception& e) {
+    LOG(WARNING) << "Failed to fetch certificate " << loc << ": " << e.what();
+    promise->set_value(boost::none);
+    return fetch;
   }
-  return result;
+  certificate_fetches_[loc] = fetch;
+  request.then([this, loc, promise](pplx::task<std::string> sent) {
+    boost::optional<std::string> body;
+    try {
+      body = sent.get();
+    }
+    catch (std::exception& e) {
+      LOG(WARNING) << "Failed to fetch certificate " << loc << ": "
+                   << e.what();
+    }
+    {
+      boost::lock_guard<boost::mutex> lock(certificate_fetches_lock_);
+      certificate_fetches_.erase(loc);
+    }
+    promise->set_value(body);
+  });
+  return fetch;
+}
+
+pplx::task<std::string> NetUtilityImpl::RequestCertificate(
+    const std::string& loc) {
+  VLOG(1) << "Fetching certificate " << loc;
+  const Clock::time_point start = Clock::now();
+  std::shared_ptr<NetHsmCluster::Connection> connection =
+      GetCluster()->AcquireForKey(loc);
+  std::shared_ptr<TraceSpan> span;
+  pplx::task<web::http::http_response> sent = SendRequest(
+      connection->client(), web::http::methods::GET, "cert", loc,
+      std::string(), &span, pplx::cancellation_token::none());
+  // Certificates may be stored in binary form, so the body is taken as is.
+  return sent.then([connection, start, span](
+                       web::http::http_response response) {
+    RecordResponse("cert", start, response.status_code(), span.get());
+    if (response.status_code() == web::http::status_codes::NotFound)
+      return pplx::task_from_result(std::string());
+    if (response.status_code() != web::http::status_codes::OK)
+      throw ServerError(response.status_code());
+    return response.extract_vector().then(
+        [](const std::vector<unsigned char>& body) {
+          return std::string(body.begin(), body.end());
+        });
+  });
+}
+
+void NetUtilityImpl::StartRefresher() {
+  boost::lock_guard<boost::mutex> lock(refresh_lock_);
+  if (refresh_interval_ == std::chrono::seconds::zero() ||
+      refresh_thread_.joinable())
+    return;
+  stopping_ = false;
+  refresh_thread_ = boost::thread(&NetUtilityImpl::RefreshLoop, this);
+}
+
+void NetUtilityImpl::StopRefresher() {
+  {
+    boost::lock_guard<boost::mutex> lock(refresh_lock_);
+    stopping_ = true;
+  }
+  refresh_wakeup_.notify_all();
+  if (refresh_thread_.joinable())
+    refresh_thread_.join();
+}
+
+void NetUtilityImpl::RefreshLoop() {
+  boost::unique_lock<boost::mutex> lock(refresh_lock_);
+  while (!stopping_) {
+    // load_lock_ comes before refresh_lock_, which is therefore let go of
+    // first.
+    lock.unlock();
+    {
+      boost::lock_guard<boost::mutex> load_lock(load_lock_);
+      // With a shared inventory, only the writer refreshes it from the NetHSM
+      // and the other processes pick up what it publishes.
+      if (shared_key_cache_ && !shared_key_cache_->TryBecomeWriter()) {
+        ImportSharedInventory();
+      } else {
+        // The first pass after a restored snapshot refetches every key; later
+        // passes only fetch keys that are new to the listing.
+        InsertSnapshotKeys();
+        bool refetch = false;
+        {
+          boost::lock_guard<boost::mutex> keys_lock(keys_lock_);
+          refetch = !all_keys_loaded_ || inventory_.empty();
+        }
+        SyncKeys(refetch, std::string());
+      }
+      EvictColdKeys();
+    }
+    lock.lock();
+    refresh_wakeup_.wait_for(lock,
+                             boost::chrono::seconds(refresh_interval_.count()),
+                             [this] { return stopping_; });
+  }
+}
+
+bool NetUtilityImpl::FindStale(Object* object,
+                               bool key_replaced,
+                               bool* unchanged,
+                               std::vector<const Object*>* stale) {
+  std::unique_ptr<Object> search_template(factory_->CreateObject());
+  CHECK(search_template.get());
+  search_template->SetAttributeString(CKA_ID,
+                                      object->GetAttributeString(CKA_ID));
+  search_template->SetAttributeInt(CKA_CLASS, object->GetObjectClass());
+  search_template->SetAttributeBool(CKA_TOKEN, true);
+  std::vector<const Object*> existing;
+  if (!token_object_pool_->Find(search_template.get(), &existing))
+    return false;
+  *unchanged = false;
+  for (auto i = existing.begin(); i != existing.end(); ++i) {
+    // A certificate whose value was fetched differs from a fresh stub.
+    const bool same_certificate =
+        !key_replaced &&
+        object->IsAttributePresent(kCertificateLocationAttribute) &&
+        (*i)->GetAttributeString(kCertificateLocationAttribute) ==
+            object->GetAttributeString(kCertificateLocationAttribute);
+    if (same_certificate ||
+        *(*i)->GetAttributeMap() == *object->GetAttributeMap()) {
+      // The key is unchanged; keep the existing object and its handle.
+      *unchanged = true;
+      return true;
+    }
+  }
+  if (!existing.empty()) {
+    VLOG(1) << "Replacing stale objects for key "
+            << object->GetAttributeString(CKA_ID);
+    object->set_handle(existing.front()->handle());
+    stale->insert(stale->end(), existing.begin(), existing.end());
+    // The replaced key signs differently.
+    if (signature_cache_)
+      signature_cache_->EraseKey(object->GetAttributeString(CKA_ID));
+  }
+  return true;
+}
+
+void NetUtilityImpl::PruneStableHandles() {
+  const Clock::time_point now = Clock::now();
+  for (auto i = stable_handles_.begin(); i != stable_handles_.end();) {
+    if (i->second.removed != Clock::time_point() &&
+        now - i->second.removed >= negative_cache_ttl_)
+      i = stable_handles_.erase(i);
+    else
+      ++i;
+  }
+}
+
+bool NetUtilityImpl::IsFresh(const Clock::time_point& loaded) const {
+  return Clock::now() - loaded < key_cache_ttl_;
+}
+
+boost::optional<std::string> NetUtilityImpl::Decrypt(
+    const std::shared_ptr<const KeyTarget>& key,
+    const std::string& encrypted_data,
+    RequestPriority priority) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  TouchResidentKey(key->key_id);
+  return RunAction(key, key->decrypt, encrypted_data, priority);
 }
 
 boost::optional<std::string> NetUtilityImpl::Sign(
-    const std::string& key_loc,
-    const std::string& data) {
+    const std::shared_ptr<const KeyTarget>& key,
+    const std::string& data,
+    RequestPriority priority) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  TouchResidentKey(key->key_id);
+  if (!IsSignatureCached(key->key_id))
+    return SignOnNetHsm(key, data, priority);
+  CheckFork();
+  boost::optional<std::string> signature =
+      signature_cache_->Lookup(key->key_id, data);
+  if (signature) {
+    g_last_call_rejected = false;
+    return signature;
+  }
+  signature = SignOnNetHsm(key, data, priority);
+  if (signature)
+    signature_cache_->Insert(key->key_id, data, *signature);
+  return signature;
+}
+
+boost::optional<std::string> NetUtilityImpl::ECDSASign(
+    const std::shared_ptr<const KeyTarget>& key,
+    const std::string& digest,
+    RequestPriority priority) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  TouchResidentKey(key->key_id);
+  // ECDSA signatures are randomized, so they are neither cached nor
+  // coalesced.
+  return RunAction(key, key->ecdsa_sign, digest, priority);
+}
+
+boost::optional<std::string> NetUtilityImpl::SignOnNetHsm(
+    const std::shared_ptr<const KeyTarget>& key,
+    const std::string& data,
+    RequestPriority priority) {
+  if (sign_coalesce_window_ == std::chrono::microseconds::zero())
+    return RunAction(key, key->sign, data, priority);
+  // The first request for a key opens a batch and dispatches it when the
+  // coalescing window closes; later requests for the same key join the batch
+  // and wait for their result.
+  std::shared_ptr<PendingSign> pending = std::make_shared<PendingSign>();
+  pending->input = data;
+  pending->priority = priority;
+  std::future<boost::optional<std::string>> result =
+      pending->result.get_future();
+  bool is_leader;
+  {
+    boost::lock_guard<boost::mutex> lock(sign_batches_lock_);
+    std::vector<std::shared_ptr<PendingSign>>& batch =
+        sign_batches_[key->location];
+    is_leader = batch.empty();
+    batch.push_back(pending);
+  }
+  if (is_leader) {
+    std::this_thread::sleep_for(sign_coalesce_window_);
+    DispatchSignBatch(key);
+  }
+  boost::optional<std::string> signature = result.get();
+  g_last_call_rejected = pending->rejected;
+  return signature;
+}
+
+void NetUtilityImpl::DispatchSignBatch(
+    const std::shared_ptr<const KeyTarget>& key) {
+  std::vector<std::shared_ptr<PendingSign>> batch;
+  {
+    boost::lock_guard<boost::mutex> lock(sign_batches_lock_);
+    auto it = sign_batches_.find(key->location);
+    CHECK(it != sign_batches_.end());
+    batch.swap(it->second);
+    sign_batches_.erase(it);
+  }
+  VLOG(1) << "Dispatching " << batch.size() << " coalesced sign requests";
+  CheckFork();
+  // The requests of each priority are admitted together, so the batch waits
+  // for its slots once rather than once per request, and is admitted or
+  // rejected as a whole.
+  std::vector<std::shared_ptr<AdmissionController::Permit>> permits(
+      batch.size());
+  std::vector<bool> admitted(batch.size(), true);
+  for (int priority = 0; admission_ && priority < kNumRequestPriorities;
+       ++priority) {
+    std::vector<size_t> members;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (batch[i]->priority == priority)
+        members.push_back(i);
+    }
+    std::vector<std::shared_ptr<AdmissionController::Permit>> granted;
+    if (!admission_->AdmitBatch(priority, members.size(), &granted)) {
+      VLOG(1) << "NetHSM request limit reached";
+      for (auto i = members.begin(); i != members.end(); ++i)
+        admitted[*i] = false;
+      continue;
+    }
+    for (size_t i = 0; i < members.size(); ++i)
+      permits[members[i]] = std::move(granted[i]);
+  }
+  // Issue the whole burst before waiting on any response so the requests are
+  // spread over the pooled connections.
+  const Clock::time_point start = Clock::now();
+  std::vector<std::future<boost::optional<std::string>>> results;
+  results.reserve(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (!admitted[i]) {
+      // An invalid future marks the rejected request.
+      results.push_back(std::future<boost::optional<std::string>>());
+      continue;
+    }
+    results.push_back(ToFuture(PostActionWithRetry(
+        std::move(permits[i]), GetCluster()->AcquireForKey(key->location),
+        key, &key->sign, batch[i]->input, batch[i]->priority,
+        GetRetryDeadline(start), 0)));
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    boost::optional<std::string> result;
+    if (results[i].valid() && WaitForDeadline(&results[i], start))
+      result = results[i].get();
+    batch[i]->rejected = !results[i].valid();
+    batch[i]->result.set_value(result);
+  }
+}
+
+void NetUtilityImpl::DecryptAsync(const std::shared_ptr<const KeyTarget>& key,
+                                  const std::string& encrypted_data,
+                                  RequestPriority priority,
+                                  const ResultCallback& callback) {
+  VLOG(1) << __PRETTY_FUNCTION__;
+  TouchResidentKey(key->key_id);
+  // The caller collects completions later and must not block here.
+  std::shared_ptr<AdmissionController::Permit> permit;
+  if (!Admit(priority, false, &permit)) {
+    callback(boost::none);
+    return;
+  }
+  Notify(PostActionWithRetry(std::move(permit),
+                             GetCluster()->AcquireForKey(key->location), key,
+                             &key->decrypt, encrypted_data, priority,
+                             GetRetryDeadline(Clock::now()), 0),
+         callback);
+}
+
+void NetUtilityImpl::SignAsync(const std::shared_ptr<const KeyTarget>& key,
+                               const std::string& data,
+                               RequestPriority priority,
+                               const ResultCallback& callback) {
   VLOG(1) << __PRETTY_FUNCTION__;
-  std::string data_b64 = base64::encode(data);
-  JSON body;
-  body["message"] = data_b64;
-  VLOG(1) << "Request:\n" << body.dump(2);
-  auto response = client_->request(web::http::methods::POST,
-    key_loc + "/actions/pkcs1/sign", body.dump(), "application/json").get();
-  VLOG(1) << "Received response status code: " << response.status_code();
-  auto const json = JSON::parse(response.extract_utf8string().get());
-  VLOG(1) << "Response:\n" << json.dump(2);
-  std::string result;
+  TouchResidentKey(key->key_id);
+  const bool is_cached = IsSignatureCached(key->key_id);
+  if (is_cached) {
+    CheckFork();
+    boost::optional<std::string> signature =
+        signature_cache_->Lookup(key->key_id, data);
+    if (signature) {
+      g_last_call_rejected = false;
+      callback(signature);
+      return;
+    }
+  }
+  // The caller collects completions later and must not block here.
+  std::shared_ptr<AdmissionController::Permit> permit;
+  if (!Admit(priority, false, &permit)) {
+    callback(boost::none);
+    return;
+  }
+  ResultCallback on_result = callback;
+  if (is_cached) {
+    std::shared_ptr<SignatureCache> cache = signature_cache_;
+    on_result = [cache, key, data, callback](
+        const boost::optional<std::string>& signature) {
+      if (signature)
+        cache->Insert(key->key_id, data, *signature);
+      callback(signature);
+    };
+  }
+  Notify(PostActionWithRetry(std::move(permit),
+                             GetCluster()->AcquireForKey(key->location), key,
+                             &key->sign, data, priority,
+                             GetRetryDeadline(Clock::now()), 0),
+         on_result);
+}
+
+boost::optional<std::string> NetUtilityImpl::RunAction(
+    const std::shared_ptr<const KeyTarget>& key,
+    const KeyAction& action,
+    const std::string& input,
+    RequestPriority priority) {
+  const Clock::time_point start = Clock::now();
+  std::shared_ptr<AdmissionController::Permit> permit;
+  if (!Admit(priority, true, &permit))
+    return boost::none;
+  std::shared_ptr<ActionOutcome> outcome = std::make_shared<ActionOutcome>();
+  std::future<boost::optional<std::string>> result =
+      outcome->result.get_future();
+  std::shared_ptr<NetHsmCluster::Connection> primary =
+      GetCluster()->AcquireForKey(key->location);
+  const size_t primary_node = primary->node();
+  Complete(outcome,
+           PostActionWithRetry(std::move(permit), std::move(primary), key,
+                               &action, input, priority,
+                               GetRetryDeadline(start), 0));
+  // A hedge needs another node to go to; on a single one it would only queue
+  // behind the request it duplicates.
+  boost::optional<Clock::duration> hedge_delay;
+  if (GetCluster()->size() >= 2)
+    hedge_delay = GetHedgeDelay();
+  if (hedge_delay &&
+      result.wait_until(start + *hedge_delay) != std::future_status::ready) {
+    // A hedged duplicate only goes out if there is a slot to spare.
+    std::shared_ptr<AdmissionController::Permit> hedge_permit;
+    if (admission_)
+      hedge_permit = admission_->TryAdmit(priority);
+    if (!admission_ || hedge_permit) {
+      VLOG(1) << "Hedging request to " << action.path;
+      Complete(outcome,
+               PostAction(std::move(hedge_permit),
+                          GetCluster()->AcquireForKey(key->location,
+                                                      primary_node),
+                          key, &action, input, GetRetryDeadline(start)));
+    }
+  }
+  if (!WaitForDeadline(&result, start))
+    return boost::none;
+  boost::optional<std::string> value = result.get();
+  if (value)
+    RecordLatency(Clock::now() - start);
+  return value;
+}
+
+pplx::task<boost::optional<std::string>> NetUtilityImpl::PostAction(
+    std::shared_ptr<AdmissionController::Permit> permit,
+    std::shared_ptr<NetHsmCluster::Connection> connection,
+    std::shared_ptr<const KeyTarget> key,
+    const KeyAction* action,
+    const std::string& input,
+    const Clock::time_point& deadline) {
+  // Reuse the request buffer of the calling thread; cpprest copies the body.
+  static thread_local std::string body;
+  EncodeActionRequest(action->input_field, input, &body);
+  VLOG(2) << "Request: " << body;
+  // Label by the action, e.g. "sign", rather than by the key.
+  const std::string& endpoint = action->endpoint;
+  const Clock::time_point start = Clock::now();
+  // No attempt outlives the operation it belongs to.
+  const std::chrono::milliseconds timeout = GetRequestTimeout(deadline);
+  std::shared_ptr<TraceSpan> span;
+  if (HttpTransport* transport = connection->transport()) {
+    // The response is decoded on the transfer thread, so the request takes
+    // a single task.
+    HttpTransport::Headers headers;
+    span = StartRequestSpan(endpoint, &headers);
+    pplx::task_completion_event<boost::optional<std::string>> done;
+    transport->Post(
+        action->path, body, headers, timeout,
+        [permit, connection, key, action, start, span, done](
+            HttpTransport::Response* response, const std::string& error) {
+          if (!response) {
+            ReportActionResponse(permit.get(), connection.get(),
+                                 action->endpoint, start, 0, span.get());
+            done.set_exception(std::runtime_error(error));
+            return;
+          }
+          VLOG(1) << "Received response status code: " << response->status;
+          ReportActionResponse(permit.get(), connection.get(),
+                               action->endpoint, start, response->status,
+                               span.get());
+          if (response->status >= kMinServerErrorStatus)
+            done.set_exception(ServerError(response->status));
+          else
+            done.set(DecodeActionOutput(response->body, action->output_field));
+        });
+    return pplx::create_task(done);
+  }
+  pplx::cancellation_token_source cancel;
+  std::shared_ptr<boost::asio::steady_timer> timer;
+  if (timeout > std::chrono::milliseconds::zero()) {
+    timer = StartTimer(timeout, [cancel](const boost::system::error_code& e) {
+      if (!e)
+        cancel.cancel();
+    });
+  }
+  pplx::task<web::http::http_response> sent = SendRequest(
+      connection->client(), web::http::methods::POST, endpoint, action->path,
+      body, &span, cancel.get_token());
+  pplx::task<std::string> received =
+      sent.then([permit, connection, key, action, start, span, timer](
+                    pplx::task<web::http::http_response> request) {
+        if (timer)
+          timer->cancel();
+        web::http::http_response response;
+        try {
+          response = request.get();
+        }
+        catch (...) {
+          ReportActionResponse(permit.get(), connection.get(),
+                               action->endpoint, start, 0, span.get());
+          throw;
+        }
+        VLOG(1) << "Received response status code: "
+                << response.status_code();
+        ReportActionResponse(permit.get(), connection.get(), action->endpoint,
+                             start, response.status_code(), span.get());
+        if (response.status_code() >= kMinServerErrorStatus)
+          throw ServerError(response.status_code());
+        return response.extract_utf8string();
+      });
+  return received.then([key, action](const std::string& response_body) {
+    return DecodeActionOutput(response_body, action->output_field);
+  });
+}
+
+pplx::task<boost::optional<std::string>> NetUtilityImpl::PostActionWithRetry(
+    std::shared_ptr<AdmissionController::Permit> permit,
+    std::shared_ptr<NetHsmCluster::Connection> connection,
+    std::shared_ptr<const KeyTarget> key,
+    const KeyAction* action,
+    const std::string& input,
+    RequestPriority priority,
+    const Clock::time_point& deadline,
+    int attempt) {
+  const size_t node = connection->node();
+  pplx::task<boost::optional<std::string>> sent =
+      PostAction(std::move(permit), std::move(connection), key, action, input,
+                 deadline);
+  return sent.then([this, key, action, input, priority, deadline, attempt,
+                    node](pplx::task<boost::optional<std::string>> completed) {
+    bool responded = false;
+    Clock::duration delay;
+    if (!RequestFailed(completed, &responded) ||
+        !GetRetryDelay(attempt, responded, deadline, &delay))
+      return completed;
+    std::shared_ptr<AdmissionController::Permit> retry_permit;
+    if (admission_) {
+      retry_permit = admission_->TryAdmit(priority);
+      if (!retry_permit)
+        return completed;
+    }
+    VLOG(1) << "Retrying request to " << action->path;
+    const std::string reason = responded ? "server_error" : "no_response";
+    Metrics::Get()->GetCounter("p11net_retries_total",
+                               "endpoint=\"" + action->endpoint +
+                                   "\",reason=\"" + reason + "\"")
+        ->Increment();
+    return After(delay).then([this, retry_permit, key, action, input,
+                              priority, deadline, attempt, node, responded] {
+      // Without a response the node may be down, so the retry goes elsewhere.
+      return PostActionWithRetry(
+          retry_permit,
+          responded ? GetCluster()->AcquireForKey(key->location)
+                    : GetCluster()->AcquireForKey(key->location, node),
+          key, action, input, priority, deadline, attempt + 1);
+    });
+  });
+}
+
+NetUtilityImpl::Clock::time_point NetUtilityImpl::GetRetryDeadline(
+    const Clock::time_point& start) const {
+  if (operation_deadline_ == Clock::duration::zero())
+    return Clock::time_point::max();
+  return start + operation_deadline_;
+}
+
+bool NetUtilityImpl::GetRetryDelay(int attempt,
+                                   bool responded,
+                                   const Clock::time_point& deadline,
+                                   Clock::duration* delay) {
+  if (attempt >= max_retries_)
+    return false;
+  *delay = Clock::duration::zero();
+  if (responded) {
+    // A random delay up to the ceiling, so that the clients an overloaded
+    // NetHSM turned away do not come back in lockstep.
+    const Clock::duration ceiling =
+        retry_backoff_ * (1 << std::min(attempt, kMaxRetryBackoffDoublings));
+    *delay = Clock::duration(std::uniform_int_distribution<Clock::rep>(
+        0, ceiling.count())(GetRandomEngine()));
+  }
+  return Clock::now() + *delay < deadline;
+}
+
+boost::optional<std::string> NetUtilityImpl::Wait(
+    const pplx::task<boost::optional<std::string>>& task) {
   try {
-    result = base64::decode<std::string>(
-      json.at("data").at("signedMessage").get<std::string>());
+    return task.get();
   }
-  catch (JSON::exception& e) {
-    VLOG(1) << "Invalid JSON structure: " << e.what();
+  catch (std::exception& e) {
+    LOG(ERROR) << "NetHSM request failed: " << e.what();
   }
-  return result;
+  return boost::none;
+}
+
+void NetUtilityImpl::Notify(
+    const pplx::task<boost::optional<std::string>>& task,
+    const ResultCallback& callback) {
+  task.then([callback](pplx::task<boost::optional<std::string>> completed) {
+    callback(Wait(completed));
+  });
+}
+
+std::future<boost::optional<std::string>> NetUtilityImpl::ToFuture(
+    const pplx::task<boost::optional<std::string>>& task) {
+  std::shared_ptr<std::promise<boost::optional<std::string>>> promise =
+      std::make_shared<std::promise<boost::optional<std::string>>>();
+  task.then([promise](pplx::task<boost::optional<std::string>> completed) {
+    promise->set_value(Wait(completed));
+  });
+  return promise->get_future();
+}
+
+void NetUtilityImpl::Complete(
+    std::shared_ptr<ActionOutcome> outcome,
+    const pplx::task<boost::optional<std::string>>& task) {
+  {
+    boost::lock_guard<boost::mutex> lock(outcome->lock);
+    ++outcome->pending;
+  }
+  task.then([outcome](pplx::task<boost::optional<std::string>> completed) {
+    boost::optional<std::string> result = Wait(completed);
+    boost::lock_guard<boost::mutex> lock(outcome->lock);
+    --outcome->pending;
+    if (outcome->done)
+      return;
+    // The first successful response wins; a failure is only reported once
+    // every request has failed.
+    if (result || outcome->pending == 0) {
+      outcome->done = true;
+      outcome->result.set_value(result);
+    }
+  });
+}
+
+bool NetUtilityImpl::WaitForDeadline(
+    std::future<boost::optional<std::string>>* result,
+    const Clock::time_point& start) {
+  if (operation_deadline_ == Clock::duration::zero()) {
+    result->wait();
+    return true;
+  }
+  if (result->wait_until(start + operation_deadline_) ==
+      std::future_status::ready)
+    return true;
+  LOG(WARNING) << "NetHSM operation exceeded its deadline of "
+               << std::chrono::duration_cast<std::chrono::milliseconds>(
+                      operation_deadline_).count() << "ms";
+  return false;
+}
+
+void NetUtilityImpl::RecordLatency(const Clock::duration& latency) {
+  if (hedge_percentile_ == 0)
+    return;
+  const uint64_t sample = num_latency_samples_.fetch_add(1);
+  latency_samples_[sample % kMaxLatencySamples].store(
+      latency.count(), std::memory_order_relaxed);
+  const uint64_t count = sample + 1;
+  if (count >= kMinLatencySamples && count % kHedgeDelayInterval == 0)
+    UpdateHedgeDelay(std::min<uint64_t>(count, kMaxLatencySamples));
+}
+
+boost::optional<NetUtilityImpl::Clock::duration>
+NetUtilityImpl::GetHedgeDelay() {
+  if (hedge_percentile_ == 0)
+    return boost::none;
+  const Clock::rep delay = hedge_delay_.load(std::memory_order_relaxed);
+  if (delay == 0)
+    return boost::none;
+  return Clock::duration(delay);
+}
+
+void NetUtilityImpl::UpdateHedgeDelay(size_t num_samples) {
+  // Samples written concurrently may be missed or counted from the previous
+  // round; the percentile is an estimate either way.
+  std::vector<Clock::rep> samples(num_samples);
+  for (size_t i = 0; i < num_samples; ++i)
+    samples[i] = latency_samples_[i].load(std::memory_order_relaxed);
+  size_t index = samples.size() * hedge_percentile_ / 100;
+  if (index >= samples.size())
+    index = samples.size() - 1;
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  hedge_delay_.store(std::max<Clock::rep>(samples[index], 1),
+                     std::memory_order_relaxed);
 }
 
 }  // namespace p11net
@@ -7,33 +7,604 @@
 
 #include "net_utility.h"
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/filesystem/path.hpp>
 #include <boost/optional.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <cpprest/http_client.h>
 #include <base/macros.h>
 
+#include "admission_controller.h"
+#include "entropy_pool.h"
+#include "nethsm_cluster.h"
+#include "key_snapshot.h"
+#include "proto_bindings/key_inventory.pb.h"
+#include "signature_cache.h"
+
 namespace p11net {
 
+class Object;
 class ObjectPool;
 class P11NetFactory;
+class SharedKeyCache;
 
 class NetUtilityImpl : public NetUtility {
  public:
-  explicit NetUtilityImpl(std::shared_ptr<ObjectPool> token_object_pool,
-                          std::shared_ptr<P11NetFactory> factory);
+  // If 'token_path' is not empty, the key inventory is persisted in the token
+  // database at that path and restored from there by Init. Appliance 0 is the
+  // NetHSM named by P11NET_URL, P11NET_USER and P11NET_PASSWORD; appliance N
+  // is the one named by P11NET_URL_N, P11NET_USER_N and P11NET_PASSWORD_N.
+  NetUtilityImpl(std::shared_ptr<ObjectPool> token_object_pool,
+                 std::shared_ptr<P11NetFactory> factory,
+                 const boost::filesystem::path& token_path,
+                 int appliance);
   virtual ~NetUtilityImpl();
   virtual bool Init();
-  virtual bool LoadKeys(const std::string& key_id);
-  virtual boost::optional<std::string> Decrypt(const std::string& key_id,
-                                               const std::string& input);
-  virtual boost::optional<std::string> Sign(const std::string& key_id,
-                                            const std::string& input);
+  virtual bool LoadKeys(const Object& search_template);
+  virtual void InvalidateKeys();
+  virtual bool RestoreObject(int handle);
+  virtual void MarkKeyUsed(const Object& object);
+  virtual bool LoadCertificate(int handle);
+  virtual bool LastCallRejected();
+  virtual std::chrono::milliseconds GetOperationDeadline();
+  virtual boost::optional<std::string> Decrypt(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority);
+  virtual boost::optional<std::string> Sign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority);
+  virtual boost::optional<std::string> ECDSASign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& digest,
+      RequestPriority priority);
+  virtual void DecryptAsync(const std::shared_ptr<const KeyTarget>& key,
+                            const std::string& input,
+                            RequestPriority priority,
+                            const ResultCallback& callback);
+  virtual void SignAsync(const std::shared_ptr<const KeyTarget>& key,
+                         const std::string& input,
+                         RequestPriority priority,
+                         const ResultCallback& callback);
+  virtual boost::optional<std::string> GenerateKeyPair(
+      int modulus_bits,
+      const std::string& key_id,
+      bool for_signing);
+  virtual void GenerateKeyPairAsync(int modulus_bits,
+                                    const std::string& key_id,
+                                    bool for_signing,
+                                    const ResultCallback& callback);
+  virtual void SetReachabilityCallback(
+      const std::function<void(bool)>& callback);
+  virtual bool GenerateRandom(int num_bytes, std::string* random_data);
+
+  // Creates the finalized public and private key objects of a NetHSM key.
+  // Returns true on success.
+  static bool CreateKeyObjects(P11NetFactory* factory,
+                               const KeyRecord& record,
+                               std::unique_ptr<Object>* public_key,
+                               std::unique_ptr<Object>* private_key);
+  // Creates the finalized stub of the certificate of a NetHSM key, which
+  // LoadCertificate completes. Returns true on success.
+  static bool CreateCertificateStub(P11NetFactory* factory,
+                                    const KeyRecord& record,
+                                    std::unique_ptr<Object>* certificate);
 
  private:
+  typedef std::chrono::steady_clock Clock;
+
+  // A sign request waiting in a coalescing batch.
+  struct PendingSign {
+    PendingSign() : priority(kInteractivePriority), rejected(false) {}
+    std::string input;
+    RequestPriority priority;
+    std::promise<boost::optional<std::string>> result;
+    // Set with an empty result if admission control rejected the request.
+    bool rejected;
+  };
+
+  // The validators of a cached NetHSM response. A conditional request with
+  // them is answered with 304 Not Modified if the resource did not change.
+  struct Validators {
+    std::string etag;
+    std::string last_modified;
+  };
+
+  // The response to a conditional GET of key metadata.
+  struct MetadataResponse {
+    MetadataResponse() : not_modified(false) {}
+    // Set if the resource did not change since 'validators' were sent.
+    bool not_modified;
+    // The body, or empty if the resource does not exist.
+    std::string body;
+    // The validators of the response, if the NetHSM sent any.
+    Validators validators;
+  };
+
+  // The shared result of an operation and its hedged duplicates.
+  struct ActionOutcome {
+    ActionOutcome() : pending(0), done(false) {}
+    boost::mutex lock;
+    std::promise<boost::optional<std::string>> result;
+    // The number of requests that have not completed yet.
+    int pending;
+    // Set once 'result' has been fulfilled.
+    bool done;
+  };
+
+  // Creates and starts cluster_ for the given node URLs.
+  void CreateCluster(const std::vector<std::string>& urls);
+  // Returns the name of the variable that configures 'name' for this
+  // appliance, e.g. P11NET_URL_2 for P11NET_URL.
+  std::string GetApplianceEnvName(const char* name) const;
+  // Returns the value of that variable, or an empty string if it is not set.
+  std::string GetApplianceEnv(const char* name) const;
+  // Creates random_pool_ if the NetHSM is configured as the random source.
+  void CreateRandomPool();
+  // Sizes and pins the network I/O threads, before the first HTTP client of
+  // the process is created.
+  void ConfigureIoThreadsFromEnv();
+  // Creates admission_ if a request limit is configured.
+  void CreateAdmissionController();
+  // Creates signature_cache_ if any key has its signatures cached.
+  void CreateSignatureCache();
+  // Returns true if 'key_id' is a key whose signatures are cached.
+  bool IsSignatureCached(const std::string& key_id) const;
+  // Signs on the NetHSM, coalescing requests if configured.
+  boost::optional<std::string> SignOnNetHsm(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& data,
+      RequestPriority priority);
+  // Admits a key action of the given priority to the NetHSM. Returns false,
+  // and marks the calling thread's last call as rejected, if the request
+  // limit does not let it through. 'permit' receives the permit, or NULL if
+  // there is no limit. Without 'wait', a request that would have to queue for
+  // a slot is rejected right away.
+  bool Admit(RequestPriority priority,
+             bool wait,
+             std::shared_ptr<AdmissionController::Permit>* permit);
+  // Returns the cluster to send requests to, reconnecting first if the
+  // process has forked since it was created.
+  NetHsmCluster* GetCluster();
+  // Reconnects if the process has forked since the last check.
+  void CheckFork();
+  // Replaces the network state inherited from the parent process with fresh
+  // connections and threads, keeping the key inventory and token objects.
+  void RecoverFromFork();
+  // pthread_atfork handlers. The short data locks of every instance are held
+  // across fork so that the child does not inherit them locked; the child
+  // replaces the locks that may be held across NetHSM requests.
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+
+  // Determines which NetHSM keys 'search_template' can match. Returns false
+  // if it cannot match any. Otherwise 'key_id' receives the identifier of the
+  // only key it can match, or is empty, and 'purpose' receives the purpose the
+  // key must have, or is empty, e.g. for a template that asks for both
+  // signing and decryption. Certificates match only if 'certificates' is set.
+  static bool GetKeyFilter(const Object& search_template,
+                           bool certificates,
+                           std::string* key_id,
+                           std::string* purpose);
+  // Returns true if the given key, or the complete listing for an empty
+  // key_id, is in the cache and has not expired. For an empty key_id, a
+  // listing synced for 'purpose' is as good as the complete one.
+  bool IsCached(const std::string& key_id,
+                const std::string& purpose = std::string());
+  // Returns true if the given key, or the complete listing for an empty
+  // key_id, is in the cache and expired less than max_stale_ ago, so that it
+  // may be served while it is revalidated. 'purpose' counts as for IsCached.
+  bool IsStale(const std::string& key_id,
+               const std::string& purpose = std::string());
+  // Returns the time the listing was last synced for the keys with 'purpose',
+  // or in full for any purpose, if ever. keys_lock_ must be held.
+  boost::optional<Clock::time_point> GetListingLoaded(
+      const std::string& purpose) const;
+  // Fetches the given key, or all keys for an empty key_id, on a background
+  // task unless such a fetch is under way already. The cached metadata stays
+  // in place if the fetch fails.
+  void RevalidateInBackground(const std::string& key_id,
+                              const std::string& purpose);
+  // Fetches the given key, or all keys for an empty key_id, from the NetHSM
+  // into the token object pool and the cache. For a full fetch, known keys
+  // without the given purpose are not fetched again. load_lock_ must be held.
+  bool FetchKeys(const std::string& key_id, const std::string& purpose);
+  // Lists the keys on the NetHSM, removes the objects of keys that are no
+  // longer listed and fetches the keys that are new. If 'refetch' is true,
+  // keys that are already known are fetched again as well, unless 'purpose' is
+  // set and they do not have it. Only a sync without 'purpose' marks the
+  // complete listing as loaded. load_lock_ must be held.
+  bool SyncKeys(bool refetch, const std::string& purpose);
+  // Fetches the keys at the given locations with a bounded number of requests
+  // in flight. Locations the NetHSM reports as absent are appended to
+  // 'missing', if not NULL.
+  bool FetchLocations(const std::vector<std::string>& locations,
+                      std::vector<std::string>* missing);
+  // Remembers that the NetHSM has no key with the given identifier.
+  void AddMissingKey(const std::string& key_id);
+  // Fetches the locations of all keys from the NetHSM. The listing is
+  // requested conditionally and the last one is reused if it did not change.
+  // load_lock_ must be held.
+  bool FetchKeyLocations(std::vector<std::string>* locations);
+  // Starts fetching a single key from the NetHSM. The task yields the
+  // response, whose body is empty if the key does not exist. A key that was
+  // fetched before is requested with the 'validators' of that response.
+  // Failed requests are retried like key actions.
+  pplx::task<MetadataResponse> RequestKey(const std::string& location,
+                                          const Validators& validators);
+  // Sends attempt 'attempt' of RequestKey on 'connection'.
+  pplx::task<MetadataResponse> RequestKey(
+      const std::string& location,
+      const Validators& validators,
+      std::shared_ptr<NetHsmCluster::Connection> connection,
+      const Clock::time_point& deadline,
+      int attempt);
+  // Returns the validators of the response the known key at 'location' was
+  // parsed from, which are empty if the key is not known.
+  Validators GetKeyValidators(const std::string& location);
+  // Parses a key description received from the NetHSM.
+  bool ParseKey(const std::string& location,
+                const std::string& body,
+                KeyRecord* record);
+  // Inserts the public and private objects of a key, and the stub of its
+  // certificate if certificates_ is set, into the token object pool.
+  bool InsertKeyObjects(const KeyRecord& record);
+  // Returns true if the key is known to have no certificate.
+  bool IsCertificateMissing(const std::string& key_id);
+  // Starts fetching the certificate at the given location from the NetHSM.
+  // The task yields the body of the response, or an empty body if there is
+  // no certificate.
+  pplx::task<std::string> RequestCertificate(const std::string& location);
+  // Returns the outcome of fetching the certificate at 'location', which
+  // concurrent callers share: the body, empty if there is none, or nothing
+  // if the fetch failed.
+  std::shared_future<boost::optional<std::string>> FetchCertificate(
+      const std::string& location);
+  // Maps the key inventory persisted by a previous run, if any. Its keys are
+  // inserted into the pool when first looked up. Falls back to the legacy
+  // snapshot in the object store, which is loaded right away. Returns true if
+  // a snapshot was loaded.
+  bool LoadSnapshot();
+  // Inserts the key with the given identifier from the mapped snapshot unless
+  // it is known already. load_lock_ must be held.
+  void InsertSnapshotKey(const std::string& key_id);
+  // Inserts every key of the mapped snapshot that is not known yet and
+  // releases the mapping. load_lock_ must be held.
+  void InsertSnapshotKeys();
+  // Imports the inventory published in the shared key cache if it changed
+  // since the last import. Returns true if keys were imported. load_lock_
+  // must be held.
+  bool ImportSharedInventory();
+  // Inserts the keys of 'inventory' and marks them as cached. If
+  // 'remove_unlisted' is set, known keys missing from it are removed.
+  void ApplyInventory(const KeyInventory& inventory, bool remove_unlisted);
+  // Persists the current key inventory and publishes it in the shared key
+  // cache if this process is its writer.
+  void SaveSnapshot();
+  // Brings this instance's share of p11net_key_cache_bytes up to date with
+  // the estimated size of the key cache state. keys_lock_ must be held.
+  void ReportCacheMemory();
+  // Waits for the background revalidation started by Init, if any, and for
+  // those started by RevalidateInBackground.
+  void WaitForRevalidation();
+  // Generates a key pair on the NetHSM and loads it. The task yields the
+  // identifier of the new key.
+  pplx::task<boost::optional<std::string>> StartKeyGeneration(
+      int modulus_bits,
+      const std::string& key_id,
+      bool for_signing);
+  // Requests random bytes from the NetHSM.
+  pplx::task<boost::optional<std::string>> RequestRandom(size_t num_bytes);
+  // Deletes the token objects of the given key.
+  void RemoveKeyObjects(const std::string& key_id);
+  // Returns true if the objects of the given key were evicted.
+  bool IsEvicted(const std::string& key_id);
+  // Returns true if the objects of any key were evicted.
+  bool HasEvictedKeys();
+  // Returns the objects of every evicted key to the pool. load_lock_ must be
+  // held.
+  void RestoreEvictedKeys();
+  // Marks the given key as used, which moves it to the end of the eviction
+  // order. keys_lock_ must be held.
+  void TouchKey(const std::string& key_id);
+  // Marks the given key as used if it is resident.
+  void TouchResidentKey(const std::string& key_id);
+  // Evicts the least recently used keys that have been idle for
+  // eviction_idle_time_ until at most max_resident_keys_ keys are left in the
+  // token object pool. load_lock_ must be held.
+  void EvictColdKeys();
+  // Returns the objects of an evicted key to the token object pool, built from
+  // its inventory record, under their old handles. load_lock_ must be held.
+  bool RestoreKey(const std::string& key_id);
+  // Starts and stops the background inventory refresher.
+  void StartRefresher();
+  void StopRefresher();
+  void RefreshLoop();
+  // Finds the objects in the pool with the same CKA_ID and CKA_CLASS as
+  // 'object' and appends them to 'stale' unless one of them is equivalent to
+  // it, in which case 'unchanged' is set and nothing is appended. 'object'
+  // takes over the handle of the object it replaces. A certificate that was
+  // fetched counts as equivalent to a stub of the same location unless
+  // 'key_replaced' says that the key it certifies changed.
+  bool FindStale(Object* object,
+                 bool key_replaced,
+                 bool* unchanged,
+                 std::vector<const Object*>* stale);
+  // Forgets the handles of keys that left the NetHSM at least the negative
+  // cache TTL ago. keys_lock_ must be held.
+  void PruneStableHandles();
+  // Inserts 'batch' into the token object pool, in place of the 'stale'
+  // objects if there are any, in one step.
+  bool PutKeyObjects(const std::vector<const Object*>& stale,
+                     const std::vector<Object*>& batch);
+  // Gives the objects in 'batch' that have no handle yet the handles the
+  // objects of their class of key 'key_id' had last, and records the others.
+  // keys_lock_ must not be held.
+  void ReuseHandles(const std::string& key_id,
+                    const std::vector<Object*>& batch);
+  // Runs a blocking key action within the operation deadline, retrying it if
+  // it fails and hedging it to a second node if it takes longer than the
+  // configured latency percentile.
+  // The request goes to 'action', one of the actions of 'key', routed by the
+  // key.
+  boost::optional<std::string> RunAction(
+      const std::shared_ptr<const KeyTarget>& key,
+      const KeyAction& action,
+      const std::string& input,
+      RequestPriority priority);
+  // Posts 'input' to the given key action endpoint and decodes the result.
+  //  permit - The admission permit of the request, or NULL. It is held until
+  //           the response arrives.
+  //  connection - The leased connection to send the request on.
+  //  key - The key, which keeps 'action' alive until the response arrives.
+  //  action - The action endpoint, one of the actions of 'key'. Its input
+  //           field receives 'input', base64 encoded, and its output field of
+  //           the response holds the base64 encoded result.
+  //  deadline - When to give up waiting for the response, at the latest.
+  // The task yields an empty result if the response is malformed.
+  pplx::task<boost::optional<std::string>> PostAction(
+      std::shared_ptr<AdmissionController::Permit> permit,
+      std::shared_ptr<NetHsmCluster::Connection> connection,
+      std::shared_ptr<const KeyTarget> key,
+      const KeyAction* action,
+      const std::string& input,
+      const Clock::time_point& deadline);
+  // Like PostAction, but retries a request that got no response or a server
+  // error, up to max_retries_ times and not past 'deadline'. The first attempt
+  // is 'attempt' and goes out on 'connection'. A request that got no response
+  // is retried on another node right away, one the NetHSM failed after a
+  // backoff. Retries need a spare admission slot, like hedges.
+  pplx::task<boost::optional<std::string>> PostActionWithRetry(
+      std::shared_ptr<AdmissionController::Permit> permit,
+      std::shared_ptr<NetHsmCluster::Connection> connection,
+      std::shared_ptr<const KeyTarget> key,
+      const KeyAction* action,
+      const std::string& input,
+      RequestPriority priority,
+      const Clock::time_point& deadline,
+      int attempt);
+  // Returns the time after which an operation started at 'start' is no
+  // longer retried.
+  Clock::time_point GetRetryDeadline(const Clock::time_point& start) const;
+  // Decides whether to retry a request after attempt 'attempt' failed, and
+  // returns the backoff in 'delay'. 'responded' is set if the NetHSM answered
+  // the request with a server error rather than not at all.
+  bool GetRetryDelay(int attempt,
+                     bool responded,
+                     const Clock::time_point& deadline,
+                     Clock::duration* delay);
+  // Blocks until 'task' completes. Returns its result, or an empty result if
+  // the request failed.
+  static boost::optional<std::string> Wait(
+      const pplx::task<boost::optional<std::string>>& task);
+  // Invokes 'callback' with the result of 'task' once it completes.
+  static void Notify(const pplx::task<boost::optional<std::string>>& task,
+                     const ResultCallback& callback);
+  // Returns a future that receives the result of 'task'.
+  static std::future<boost::optional<std::string>> ToFuture(
+      const pplx::task<boost::optional<std::string>>& task);
+  // Adds 'task' to the requests racing for 'outcome'.
+  static void Complete(std::shared_ptr<ActionOutcome> outcome,
+                       const pplx::task<boost::optional<std::string>>& task);
+  // Waits for 'result' until the operation deadline counted from 'start'.
+  // Returns false if the deadline passed first.
+  bool WaitForDeadline(std::future<boost::optional<std::string>>* result,
+                       const Clock::time_point& start);
+  // Records the latency of a successful operation for hedging.
+  void RecordLatency(const Clock::duration& latency);
+  // Returns the delay after which an operation is hedged, if hedging is
+  // enabled and enough latencies have been recorded.
+  boost::optional<Clock::duration> GetHedgeDelay();
+  // Recomputes hedge_delay_ from the first 'num_samples' latency samples.
+  void UpdateHedgeDelay(size_t num_samples);
+  // Sends every sign request queued for 'key' and fulfills their results.
+  // The requests of a priority are admitted as one batch, which waits for
+  // slots for all of them and counts towards the queue depth of the lane with
+  // each of them; a rejected batch fails all of its requests.
+  void DispatchSignBatch(const std::shared_ptr<const KeyTarget>& key);
+  // Returns true if the cache entry stamped with 'loaded' has not expired.
+  bool IsFresh(const Clock::time_point& loaded) const;
+
   bool is_initialized_;
-  boost::optional<web::http::client::http_client> client_;
+  std::unique_ptr<NetHsmCluster> cluster_;
+  // Passed on to every cluster created by Init.
+  NetHsmCluster::ReachabilityCallback reachability_callback_;
   std::shared_ptr<ObjectPool> token_object_pool_;
   std::shared_ptr<P11NetFactory> factory_;
+  boost::filesystem::path token_path_;
+  const int appliance_;
+  // The P11NET_URL value; a snapshot is only used for the same endpoint.
+  std::string endpoint_;
+  // How long a loaded key is served from the cache.
+  Clock::duration key_cache_ttl_;
+  // How long past key_cache_ttl_ an expired key is still served while it is
+  // revalidated in the background; zero revalidates before serving.
+  Clock::duration max_stale_;
+  // The maximum number of key requests outstanding during LoadKeys.
+  size_t max_inflight_key_fetches_;
+  // Key: A key identifier.
+  // Value: The time the key was last fetched from the NetHSM.
+  std::map<std::string, Clock::time_point> loaded_keys_;
+  // The time the complete key listing was last fetched, if ever.
+  boost::optional<Clock::time_point> all_keys_loaded_;
+  // Key: A key purpose.
+  // Value: The time the listing was last synced for the keys with that
+  // purpose alone.
+  std::map<std::string, Clock::time_point> loaded_purposes_;
+  // How long a missing key is remembered as such.
+  Clock::duration negative_cache_ttl_;
+  // Key: A key identifier the NetHSM reported as absent.
+  // Value: The time of that report.
+  std::map<std::string, Clock::time_point> missing_keys_;
+  // Whether the keys' certificates are listed as certificate objects.
+  bool certificates_;
+  // Key: The identifier of a key the NetHSM reported to have no certificate.
+  // Value: The time of that report. Expires like missing_keys_.
+  std::map<std::string, Clock::time_point> missing_certificates_;
+  // Serializes filling in fetched certificates.
+  boost::mutex certificate_lock_;
+  // Key: The location of a certificate being fetched.
+  // Value: The outcome of the fetch, shared by the readers of its stub.
+  std::map<std::string, std::shared_future<boost::optional<std::string>>>
+      certificate_fetches_;
+  boost::mutex certificate_fetches_lock_;
+  // Key: A key identifier.
+  // Value: The metadata of the key, as persisted in the snapshot.
+  std::map<std::string, KeyRecord> inventory_;
+  // Guards the cache state above.
+  boost::mutex keys_lock_;
+  // Serializes fetching keys from the NetHSM, and is held across the
+  // requests. The locks of an instance are taken in this order: load_lock_,
+  // fork_lock_, refresh_lock_, then keys_lock_, sign_batches_lock_,
+  // certificate_fetches_lock_ and stale_lock_ as PrepareFork takes them.
+  // The fork handlers take only the last four, which are never held across
+  // a NetHSM request.
+  boost::mutex load_lock_;
+  // The snapshot mapped by LoadSnapshot until all of its keys are inserted,
+  // and the time it was mapped, which counts as the time its keys were loaded.
+  // Guarded by load_lock_.
+  std::unique_ptr<KeySnapshot> snapshot_;
+  Clock::time_point snapshot_loaded_;
+  // Whether a search has loaded keys yet, which is timed as a startup phase.
+  // Guarded by load_lock_.
+  bool keys_loaded_;
+  // The last key listing and the validators of its response, which is reused
+  // while the NetHSM reports it as not modified. Guarded by load_lock_.
+  std::vector<std::string> listed_locations_;
+  Validators listing_validators_;
+  // The handles of the objects of a key.
+  struct KeyHandles {
+    KeyHandles()
+        : public_handle(0), private_handle(0), certificate_handle(0) {}
+    // The handles of the objects, or 0 if the key had no such object.
+    int public_handle;
+    int private_handle;
+    int certificate_handle;
+  };
+  typedef std::list<std::pair<std::string, Clock::time_point>> ResidentList;
+  // The maximum number of keys with objects in the token object pool, or zero
+  // for no limit.
+  size_t max_resident_keys_;
+  // How long a key must go unused before it may be evicted.
+  Clock::duration eviction_idle_time_;
+  // The keys with objects in the pool and the time of their last use, most
+  // recently used first, with an index by key identifier. Only maintained if
+  // max_resident_keys_ is set. Guarded by keys_lock_.
+  ResidentList resident_keys_;
+  std::unordered_map<std::string, ResidentList::iterator> resident_index_;
+  // Key: A key identifier.
+  // Value: The objects of the key, which were evicted. The key's inventory
+  // record is kept to rebuild them. Guarded by keys_lock_.
+  std::map<std::string, KeyHandles> evicted_keys_;
+  // Key: The handle of an evicted object.
+  // Value: The identifier of its key. Guarded by keys_lock_.
+  std::unordered_map<int, std::string> evicted_handles_;
+  // The handles a key's objects were last inserted under.
+  struct StableHandles {
+    KeyHandles handles;
+    // When the key's objects were removed, or the epoch while they are in
+    // the pool.
+    Clock::time_point removed;
+  };
+  // Key: A key identifier.
+  // Value: The handles its objects were last inserted under. Objects that
+  // replace them after a refresh, or come back after the key was briefly
+  // missing from the NetHSM, get the same handles, so clients may keep the
+  // handles they found. A key that stays away for the negative cache TTL is
+  // gone for good and its entry is pruned. Guarded by keys_lock_.
+  std::unordered_map<std::string, StableHandles> stable_handles_;
+  // The key cache bytes last reported to the gauge. Guarded by keys_lock_.
+  int64_t reported_cache_bytes_;
+  // The key inventory shared with other processes, if configured.
+  std::unique_ptr<SharedKeyCache> shared_key_cache_;
+  // The sequence number of the last publication imported or published.
+  uint64_t shared_sequence_;
+  // Warms up connections and refreshes a restored snapshot from the NetHSM
+  // in the background after Init. It waits on load_lock_ and for the NetHSM,
+  // so it has a thread of its own rather than a worker of the task pool.
+  boost::thread revalidation_thread_;
+  // The keys being revalidated by RevalidateInBackground, with an empty
+  // identifier for the complete listing. Guarded by stale_lock_, which
+  // stale_done_ signals once a revalidation ends.
+  std::set<std::string> revalidating_keys_;
+  boost::mutex stale_lock_;
+  boost::condition_variable stale_done_;
+  // Buffers NetHSM random data; NULL unless the NetHSM is the random source.
+  std::unique_ptr<EntropyPool> random_pool_;
+  // Whether GenerateRandom defers to the caller when the pool has drained,
+  // rather than waiting for the NetHSM.
+  bool random_fallback_;
+  // Zero if the key inventory is only fetched on demand.
+  std::chrono::seconds refresh_interval_;
+  boost::thread refresh_thread_;
+  boost::mutex refresh_lock_;
+  boost::condition_variable refresh_wakeup_;
+  bool stopping_;
+  // Zero if sign requests are sent immediately.
+  std::chrono::microseconds sign_coalesce_window_;
+  // Key: A key location.
+  // Value: Sign requests for that key waiting to be dispatched.
+  std::map<std::string, std::vector<std::shared_ptr<PendingSign>>>
+      sign_batches_;
+  boost::mutex sign_batches_lock_;
+  // Zero if blocking operations wait for the HTTP timeout.
+  Clock::duration operation_deadline_;
+  // Zero if hedging is disabled.
+  int hedge_percentile_;
+  // Zero if failed requests are not retried.
+  int max_retries_;
+  // The backoff ceiling of the first retry after a server error.
+  Clock::duration retry_backoff_;
+  // Bounds the key actions in flight to the NetHSM; NULL if unbounded.
+  std::shared_ptr<AdmissionController> admission_;
+  // Recent signatures of the keys that opted in; NULL if none did.
+  std::shared_ptr<SignatureCache> signature_cache_;
+  // A ring buffer of recent operation latencies, in clock ticks, written
+  // without a lock. It has kMaxLatencySamples entries.
+  std::unique_ptr<std::atomic<Clock::rep>[]> latency_samples_;
+  // The number of latencies recorded so far.
+  std::atomic<uint64_t> num_latency_samples_;
+  // The current hedge delay in clock ticks, or zero if there is none yet. It
+  // is recomputed from the samples periodically rather than on every call.
+  std::atomic<Clock::rep> hedge_delay_;
+  // The fork generation the network state was created in.
+  std::atomic<unsigned> fork_generation_;
+  // Serializes RecoverFromFork.
+  boost::mutex fork_lock_;
 
   DISALLOW_COPY_AND_ASSIGN(NetUtilityImpl);
 };
@@ -0,0 +1,343 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "net_utility_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+#include <cpprest/http_client.h>
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+
+#include "net_utility_impl.h"
+#include "object.h"
+#include "object_pool.h"
+#include "p11net_factory.h"
+#include "p11net_utility.h"
+#include "proto_bindings/key_inventory.pb.h"
+
+using std::string;
+
+namespace p11net {
+
+namespace Env {
+  const char* kSimKeys = "P11NET_SIM_KEYS";
+  const char* kSimKeyBits = "P11NET_SIM_KEY_BITS";
+  const char* kSimKeyFile = "P11NET_SIM_KEY_FILE";
+  const char* kSimLatency = "P11NET_SIM_LATENCY_US";
+  const char* kSimLatencySigma = "P11NET_SIM_LATENCY_SIGMA";
+  const char* kSimErrorRate = "P11NET_SIM_ERROR_RATE";
+}
+
+namespace {
+
+const int kDefaultSimKeys = 16;
+const int kDefaultSimKeyBits = 2048;
+const int kMinSimKeyBits = 1024;
+const int kDefaultSimLatencyUs = 2000;
+const int kDefaultSimLatencySigma = 25;
+const int kErrorRateScale = 1000000;
+// Generating RSA keys is slow, so at most this many are generated at Init and
+// any further keys share them. This keeps large inventories quick to set up.
+const int kMaxDistinctKeys = 8;
+const char kSimKeyLocationPrefix[] = "/api/v0/keys/";
+const char kSimPurposeAll[] = "sign,encrypt";
+
+std::mt19937_64& GetRandomEngine() {
+  static thread_local std::mt19937_64 engine(std::random_device{}());
+  return engine;
+}
+
+std::shared_ptr<RSA> GenerateRSAKey(int modulus_bits) {
+  std::unique_ptr<BIGNUM, void (*)(BIGNUM*)> exponent(BN_new(), BN_free);
+  std::shared_ptr<RSA> rsa(RSA_new(), RSA_free);
+  if (!exponent || !rsa || !BN_set_word(exponent.get(), RSA_F4) ||
+      !RSA_generate_key_ex(rsa.get(), modulus_bits, exponent.get(), NULL)) {
+    LOG(ERROR) << "Failed to generate a simulated key: " << GetOpenSSLError();
+    return std::shared_ptr<RSA>();
+  }
+  return rsa;
+}
+
+std::shared_ptr<RSA> ReadRSAKey(const char* path) {
+  FILE* file = fopen(path, "re");
+  if (!file) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::shared_ptr<RSA>();
+  }
+  RSA* rsa = PEM_read_RSAPrivateKey(file, NULL, NULL, NULL);
+  fclose(file);
+  if (!rsa) {
+    LOG(ERROR) << "Failed to read a simulated key from " << path << ": "
+               << GetOpenSSLError();
+    return std::shared_ptr<RSA>();
+  }
+  return std::shared_ptr<RSA>(rsa, RSA_free);
+}
+
+string ConvertFromBIGNUM(const BIGNUM* bignum) {
+  string big_integer(BN_num_bytes(bignum), 0);
+  BN_bn2bin(bignum, ConvertStringToByteBuffer(big_integer.data()));
+  return big_integer;
+}
+
+}  // namespace
+
+NetUtilitySim::NetUtilitySim(std::shared_ptr<ObjectPool> token_object_pool,
+                             std::shared_ptr<P11NetFactory> factory)
+    : token_object_pool_(token_object_pool),
+      factory_(factory),
+      median_latency_(kDefaultSimLatencyUs),
+      latency_sigma_(kDefaultSimLatencySigma / 100.0),
+      error_rate_(0),
+      keys_inserted_(false) {}
+
+NetUtilitySim::~NetUtilitySim() {}
+
+bool NetUtilitySim::Init() {
+  median_latency_ = std::chrono::microseconds(
+      GetEnvInt(Env::kSimLatency, kDefaultSimLatencyUs));
+  latency_sigma_ =
+      GetEnvInt(Env::kSimLatencySigma, kDefaultSimLatencySigma) / 100.0;
+  error_rate_ = std::min(GetEnvInt(Env::kSimErrorRate, 0), kErrorRateScale);
+  boost::lock_guard<boost::shared_mutex> lock(keys_lock_);
+  if (!keys_.empty())
+    return true;
+  const int num_keys = GetEnvInt(Env::kSimKeys, kDefaultSimKeys);
+  const int modulus_bits = std::max(
+      kMinSimKeyBits, GetEnvInt(Env::kSimKeyBits, kDefaultSimKeyBits));
+  std::vector<std::shared_ptr<RSA>> distinct_keys;
+  const char* key_file = getenv(Env::kSimKeyFile);
+  if (key_file) {
+    std::shared_ptr<RSA> rsa = ReadRSAKey(key_file);
+    if (!rsa)
+      return false;
+    distinct_keys.push_back(rsa);
+  }
+  for (int i = 0; !key_file && i < std::min(num_keys, kMaxDistinctKeys);
+       ++i) {
+    std::shared_ptr<RSA> rsa = GenerateRSAKey(modulus_bits);
+    if (!rsa)
+      return false;
+    distinct_keys.push_back(rsa);
+  }
+  for (int i = 0; i < num_keys; ++i) {
+    SimKey& key = keys_[kSimKeyLocationPrefix + ("sim-" + std::to_string(i))];
+    key.rsa = distinct_keys[i % distinct_keys.size()];
+    key.purpose = kSimPurposeAll;
+  }
+  LOG(INFO) << "Simulating a NetHSM with " << num_keys << " keys.";
+  return true;
+}
+
+bool NetUtilitySim::LoadKeys(const Object& search_template) {
+  // The first search loads the whole inventory, like a cold token would.
+  boost::lock_guard<boost::shared_mutex> lock(keys_lock_);
+  if (keys_inserted_)
+    return true;
+  for (auto it = keys_.begin(); it != keys_.end(); ++it) {
+    if (!InsertKeyObjects(it->first, it->second))
+      return false;
+  }
+  keys_inserted_ = true;
+  return true;
+}
+
+void NetUtilitySim::InvalidateKeys() {
+  // The simulated inventory never changes behind our back.
+}
+
+bool NetUtilitySim::RestoreObject(int handle) {
+  // Simulated keys are never evicted.
+  return false;
+}
+
+void NetUtilitySim::MarkKeyUsed(const Object& object) {}
+
+bool NetUtilitySim::LoadCertificate(int handle) {
+  // Simulated keys have no certificates.
+  return true;
+}
+
+bool NetUtilitySim::LastCallRejected() {
+  return false;
+}
+
+std::chrono::milliseconds NetUtilitySim::GetOperationDeadline() {
+  // The simulated NetHSM always answers.
+  return std::chrono::milliseconds::zero();
+}
+
+boost::optional<string> NetUtilitySim::Decrypt(
+    const std::shared_ptr<const KeyTarget>& key,
+    const string& input,
+    RequestPriority priority) {
+  std::shared_ptr<RSA> rsa = GetKey(key->location);
+  if (!rsa || !SimulateRoundTrip())
+    return boost::none;
+  string output(RSA_size(rsa.get()), 0);
+  int length = RSA_private_decrypt(
+      input.length(), ConvertStringToByteBuffer(input.data()),
+      ConvertStringToByteBuffer(output.data()), rsa.get(), RSA_PKCS1_PADDING);
+  if (length == -1) {
+    VLOG(1) << "Simulated decryption failed: " << GetOpenSSLError();
+    return boost::none;
+  }
+  output.resize(length);
+  return output;
+}
+
+boost::optional<string> NetUtilitySim::Sign(
+    const std::shared_ptr<const KeyTarget>& key,
+    const string& input,
+    RequestPriority priority) {
+  std::shared_ptr<RSA> rsa = GetKey(key->location);
+  if (!rsa || !SimulateRoundTrip())
+    return boost::none;
+  string output(RSA_size(rsa.get()), 0);
+  int length = RSA_private_encrypt(
+      input.length(), ConvertStringToByteBuffer(input.data()),
+      ConvertStringToByteBuffer(output.data()), rsa.get(), RSA_PKCS1_PADDING);
+  if (length == -1) {
+    VLOG(1) << "Simulated signing failed: " << GetOpenSSLError();
+    return boost::none;
+  }
+  output.resize(length);
+  return output;
+}
+
+boost::optional<string> NetUtilitySim::ECDSASign(
+    const std::shared_ptr<const KeyTarget>& key,
+    const string& digest,
+    RequestPriority priority) {
+  // The simulated NetHSM only holds RSA keys.
+  LOG(ERROR) << "Unknown simulated EC key " << key->location;
+  return boost::none;
+}
+
+void NetUtilitySim::DecryptAsync(const std::shared_ptr<const KeyTarget>& key,
+                                 const string& input,
+                                 RequestPriority priority,
+                                 const ResultCallback& callback) {
+  pplx::create_task([this, key, input, priority, callback] {
+    callback(Decrypt(key, input, priority));
+  });
+}
+
+void NetUtilitySim::SignAsync(const std::shared_ptr<const KeyTarget>& key,
+                              const string& input,
+                              RequestPriority priority,
+                              const ResultCallback& callback) {
+  pplx::create_task([this, key, input, priority, callback] {
+    callback(Sign(key, input, priority));
+  });
+}
+
+boost::optional<string> NetUtilitySim::GenerateKeyPair(int modulus_bits,
+                                                       const string& key_id,
+                                                       bool for_signing) {
+  if (!SimulateRoundTrip())
+    return boost::none;
+  std::shared_ptr<RSA> rsa = GenerateRSAKey(modulus_bits);
+  if (!rsa)
+    return boost::none;
+  boost::lock_guard<boost::shared_mutex> lock(keys_lock_);
+  const string id =
+      key_id.empty() ? "sim-" + std::to_string(keys_.size()) : key_id;
+  const string key_loc = kSimKeyLocationPrefix + id;
+  if (keys_.count(key_loc)) {
+    LOG(ERROR) << "Key " << id << " already exists.";
+    return boost::none;
+  }
+  SimKey key;
+  key.rsa = rsa;
+  key.purpose = for_signing ? "sign" : "encrypt";
+  // Otherwise the first LoadKeys inserts it with the others.
+  if (keys_inserted_ && !InsertKeyObjects(key_loc, key))
+    return boost::none;
+  keys_[key_loc] = key;
+  return id;
+}
+
+void NetUtilitySim::GenerateKeyPairAsync(int modulus_bits,
+                                         const string& key_id,
+                                         bool for_signing,
+                                         const ResultCallback& callback) {
+  pplx::create_task([this, modulus_bits, key_id, for_signing, callback] {
+    callback(GenerateKeyPair(modulus_bits, key_id, for_signing));
+  });
+}
+
+void NetUtilitySim::SetReachabilityCallback(
+    const std::function<void(bool)>& callback) {
+  // The simulated NetHSM is always reachable.
+}
+
+bool NetUtilitySim::GenerateRandom(int num_bytes, string* random_data) {
+  // Like a NetHSM that is not configured as a random source.
+  return false;
+}
+
+bool NetUtilitySim::InsertKeyObjects(const string& key_loc,
+                                     const SimKey& key) {
+  KeyRecord record;
+  record.set_id(key_loc.substr(key_loc.rfind('/') + 1));
+  record.set_modulus(ConvertFromBIGNUM(key.rsa->n));
+  record.set_public_exponent(ConvertFromBIGNUM(key.rsa->e));
+  record.set_purpose(key.purpose);
+  record.set_location(key_loc);
+  std::unique_ptr<Object> public_object;
+  std::unique_ptr<Object> private_object;
+  if (!NetUtilityImpl::CreateKeyObjects(factory_.get(), record, &public_object,
+                                        &private_object))
+    return false;
+  std::vector<Object*> batch = {public_object.get(), private_object.get()};
+  if (!token_object_pool_->InsertBatch(batch))
+    return false;
+  public_object.release();
+  private_object.release();
+  return true;
+}
+
+bool NetUtilitySim::SimulateRoundTrip() {
+  std::mt19937_64& engine = GetRandomEngine();
+  if (error_rate_ > 0 &&
+      std::uniform_int_distribution<int>(0, kErrorRateScale - 1)(engine) <
+          error_rate_) {
+    VLOG(1) << "Simulating a failed NetHSM request";
+    return false;
+  }
+  if (median_latency_.count() <= 0)
+    return true;
+  double latency = median_latency_.count();
+  if (latency_sigma_ > 0) {
+    latency = std::lognormal_distribution<double>(
+        std::log(latency), latency_sigma_)(engine);
+  }
+  std::this_thread::sleep_for(
+      std::chrono::microseconds(static_cast<int64_t>(latency)));
+  return true;
+}
+
+std::shared_ptr<RSA> NetUtilitySim::GetKey(const string& key_loc) {
+  boost::shared_lock<boost::shared_mutex> lock(keys_lock_);
+  auto it = keys_.find(key_loc);
+  if (it == keys_.end()) {
+    LOG(ERROR) << "Unknown simulated key " << key_loc;
+    return std::shared_ptr<RSA>();
+  }
+  return it->second.rsa;
+}
+
+}  // namespace p11net
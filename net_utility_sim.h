@@ -0,0 +1,116 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_NET_UTILITY_SIM_H_
+#define P11NET_NET_UTILITY_SIM_H_
+
+#include "net_utility.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <base/macros.h>
+#include <boost/optional.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <openssl/rsa.h>
+
+namespace p11net {
+
+class ObjectPool;
+class P11NetFactory;
+
+// NetUtilitySim is a simulated NetHSM. It serves the NetUtility interface from
+// RSA keys generated in memory, so that the module can be profiled and load
+// tested without an appliance. Every operation is delayed by a latency drawn
+// from a log-normal distribution and fails at a configurable rate. It is
+// selected with P11NET_BACKEND=sim and configured with:
+//    P11NET_SIM_KEYS          - the number of keys, "sim-0" to "sim-<N-1>",
+//                               usable for signing and decryption.
+//    P11NET_SIM_KEY_BITS      - the modulus size of the keys.
+//    P11NET_SIM_KEY_FILE      - a PEM RSA private key that every key uses
+//                               instead of generated ones, so that a
+//                               certificate can be issued for it.
+//    P11NET_SIM_LATENCY_US    - the median latency of an operation.
+//    P11NET_SIM_LATENCY_SIGMA - the spread of the latency, in percent of the
+//                               log-normal sigma; zero makes it constant.
+//    P11NET_SIM_ERROR_RATE    - the share of failed operations, per million.
+class NetUtilitySim : public NetUtility {
+ public:
+  NetUtilitySim(std::shared_ptr<ObjectPool> token_object_pool,
+                std::shared_ptr<P11NetFactory> factory);
+  virtual ~NetUtilitySim();
+  virtual bool Init();
+  virtual bool LoadKeys(const Object& search_template);
+  virtual void InvalidateKeys();
+  virtual bool RestoreObject(int handle);
+  virtual void MarkKeyUsed(const Object& object);
+  virtual bool LoadCertificate(int handle);
+  virtual bool LastCallRejected();
+  virtual std::chrono::milliseconds GetOperationDeadline();
+  virtual boost::optional<std::string> Decrypt(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority);
+  virtual boost::optional<std::string> Sign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& input,
+      RequestPriority priority);
+  virtual boost::optional<std::string> ECDSASign(
+      const std::shared_ptr<const KeyTarget>& key,
+      const std::string& digest,
+      RequestPriority priority);
+  virtual void DecryptAsync(const std::shared_ptr<const KeyTarget>& key,
+                            const std::string& input,
+                            RequestPriority priority,
+                            const ResultCallback& callback);
+  virtual void SignAsync(const std::shared_ptr<const KeyTarget>& key,
+                         const std::string& input,
+                         RequestPriority priority,
+                         const ResultCallback& callback);
+  virtual boost::optional<std::string> GenerateKeyPair(
+      int modulus_bits,
+      const std::string& key_id,
+      bool for_signing);
+  virtual void GenerateKeyPairAsync(int modulus_bits,
+                                    const std::string& key_id,
+                                    bool for_signing,
+                                    const ResultCallback& callback);
+  virtual void SetReachabilityCallback(
+      const std::function<void(bool)>& callback);
+  virtual bool GenerateRandom(int num_bytes, std::string* random_data);
+
+ private:
+  struct SimKey {
+    std::shared_ptr<RSA> rsa;
+    // The NetHSM purposes of the key, e.g. "sign".
+    std::string purpose;
+  };
+
+  // Inserts the objects of the key at 'key_loc' in the pool.
+  bool InsertKeyObjects(const std::string& key_loc, const SimKey& key);
+  // Waits for a simulated round trip. Returns false if the operation is to
+  // fail.
+  bool SimulateRoundTrip();
+  // Returns the key at the given location, or NULL.
+  std::shared_ptr<RSA> GetKey(const std::string& key_loc);
+
+  std::shared_ptr<ObjectPool> token_object_pool_;
+  std::shared_ptr<P11NetFactory> factory_;
+  std::chrono::microseconds median_latency_;
+  double latency_sigma_;
+  int error_rate_;
+  // Keys by location.
+  boost::shared_mutex keys_lock_;
+  std::map<std::string, SimKey> keys_;
+  // Whether the keys are in the pool.
+  bool keys_inserted_;
+
+  DISALLOW_COPY_AND_ASSIGN(NetUtilitySim);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_NET_UTILITY_SIM_H_
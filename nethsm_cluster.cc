@@ -0,0 +1,407 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nethsm_cluster.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include <base/logging.h>
+
+#include "host_resolver.h"
+#include "http_transport.h"
+#include "http_client_pool.h"
+#include "metrics.h"
+
+using web::http::client::http_client;
+using web::http::client::http_client_config;
+
+namespace p11net {
+
+namespace {
+
+const char* kHealthPath = "/api/v0/health/ready";
+// The number of points each node has on the hash ring. More points even out
+// the shares of the nodes.
+const int kRingPointsPerNode = 160;
+const int kRingShareScale = 1000;
+// The number of positions on the hash ring, 2^64.
+const double kRingSize = 18446744073709551616.0;
+
+// Places a string on the hash ring. FNV-1a with a final mix keeps the ring the
+// same across processes and hosts, so keys map to the same nodes everywhere.
+uint64_t HashRingPosition(const std::string& value) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < value.size(); ++i) {
+    hash ^= static_cast<unsigned char>(value[i]);
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+}  // namespace
+
+NetHsmCluster::Connection::Connection(NetHsmCluster* cluster,
+                                      size_t node,
+                                      std::shared_ptr<http_client> client,
+                                      HttpTransport* transport)
+    : cluster_(cluster),
+      node_(node),
+      client_(client),
+      transport_(transport) {
+}
+
+NetHsmCluster::Connection::~Connection() {
+  cluster_->Release(node_);
+}
+
+void NetHsmCluster::Connection::ReportSuccess() {
+  cluster_->RecordSuccess(node_);
+}
+
+void NetHsmCluster::Connection::ReportFailure() {
+  cluster_->RecordFailure(node_);
+}
+
+NetHsmCluster::NetHsmCluster(const std::vector<std::string>& urls,
+                             const http_client_config& config,
+                             size_t pool_size,
+                             std::chrono::seconds probe_interval,
+                             int failure_threshold,
+                             std::chrono::seconds cooldown)
+    : healthy_nodes_(urls.size()),
+      probe_interval_(probe_interval),
+      failure_threshold_(failure_threshold),
+      cooldown_(cooldown),
+      load_factor_(0),
+      stopping_(false) {
+  CHECK(!urls.empty());
+  for (auto i = urls.begin(); i != urls.end(); ++i) {
+    std::unique_ptr<Node> node(new Node);
+    node->url = *i;
+    node->pool.reset(new HttpClientPool(*i, config, pool_size));
+    node->outstanding = 0;
+    node->healthy = true;
+    node->consecutive_failures = 0;
+    node->open_until = 0;
+    node->preferred_requests = NULL;
+    node->spillover_requests = NULL;
+    node->ring_share = NULL;
+    node->reported_ring_share = 0;
+    nodes_.push_back(std::move(node));
+  }
+}
+
+NetHsmCluster::~NetHsmCluster() {
+  Stop();
+  // Failing the requests in flight reports back to their nodes, so every
+  // node must still be there.
+  for (auto i = nodes_.begin(); i != nodes_.end(); ++i) {
+    if ((*i)->transport)
+      (*i)->transport->Stop();
+  }
+  for (auto i = nodes_.begin(); i != nodes_.end(); ++i) {
+    if ((*i)->ring_share)
+      (*i)->ring_share->Add(-(*i)->reported_ring_share);
+  }
+}
+
+void NetHsmCluster::EnableKeyAffinity(double load_factor) {
+  load_factor_ = std::max(load_factor, 1.0);
+  ring_.clear();
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    for (int j = 0; j < kRingPointsPerNode; ++j) {
+      ring_.push_back(std::make_pair(
+          HashRingPosition(nodes_[i]->url + "#" + std::to_string(j)), i));
+    }
+  }
+  std::sort(ring_.begin(), ring_.end());
+  // Each point owns the arc that ends at it.
+  std::vector<double> shares(nodes_.size(), 0);
+  for (size_t i = 0; i < ring_.size(); ++i) {
+    const size_t previous = (i + ring_.size() - 1) % ring_.size();
+    shares[ring_[i].second] +=
+        static_cast<double>(ring_[i].first - ring_[previous].first) /
+        kRingSize;
+  }
+  Metrics* metrics = Metrics::Get();
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    Node* node = nodes_[i].get();
+    const std::string node_label = "node=\"" + node->url + "\"";
+    node->preferred_requests = metrics->GetCounter(
+        "p11net_route_requests_total", node_label + ",route=\"preferred\"");
+    node->spillover_requests = metrics->GetCounter(
+        "p11net_route_requests_total", node_label + ",route=\"spillover\"");
+    node->ring_share =
+        metrics->GetGauge("p11net_route_ring_share_permille", node_label);
+    const int64_t share = llround(shares[i] * kRingShareScale);
+    node->ring_share->Add(share - node->reported_ring_share);
+    node->reported_ring_share = share;
+    LOG(INFO) << "NetHSM node " << node->url << " holds " << share / 10.0
+              << "% of the key hash ring";
+  }
+}
+
+void NetHsmCluster::Start() {
+  boost::lock_guard<boost::mutex> lock(probe_lock_);
+  if (probe_interval_ == std::chrono::seconds::zero() ||
+      probe_thread_.joinable())
+    return;
+  stopping_ = false;
+  probe_thread_ = boost::thread(&NetHsmCluster::ProbeLoop, this);
+}
+
+void NetHsmCluster::Stop() {
+  {
+    boost::lock_guard<boost::mutex> lock(probe_lock_);
+    stopping_ = true;
+  }
+  probe_wakeup_.notify_all();
+  if (probe_thread_.joinable())
+    probe_thread_.join();
+}
+
+std::shared_ptr<NetHsmCluster::Connection> NetHsmCluster::Acquire() {
+  return Acquire(nodes_.size());
+}
+
+std::shared_ptr<NetHsmCluster::Connection> NetHsmCluster::Acquire(
+    size_t excluded_node) {
+  const Clock::time_point now = Clock::now();
+  std::vector<bool> available(nodes_.size());
+  for (size_t i = 0; i < nodes_.size(); ++i)
+    available[i] = IsAvailable(i, now);
+  // Pass 0: available nodes other than the excluded one. Pass 1: any
+  // available node. Pass 2: any node at all.
+  size_t best = nodes_.size();
+  for (int pass = 0; pass < 3 && best == nodes_.size(); ++pass) {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      if (pass < 2 && !available[i])
+        continue;
+      if (pass == 0 && i == excluded_node)
+        continue;
+      if (best == nodes_.size() ||
+          nodes_[i]->outstanding < nodes_[best]->outstanding)
+        best = i;
+    }
+  }
+  return AcquireNode(best);
+}
+
+void NetHsmCluster::EnableTransport(HttpTransport::Protocol protocol,
+                                    const std::string& user,
+                                    const std::string& password,
+                                    std::chrono::seconds timeout,
+                                    size_t connections,
+                                    std::chrono::seconds dns_ttl) {
+  for (auto i = nodes_.begin(); i != nodes_.end(); ++i) {
+    std::unique_ptr<HttpTransport> transport(new HttpTransport(
+        (*i)->url, user, password, timeout, connections, protocol));
+    std::unique_ptr<HostResolver> resolver;
+    std::string host;
+    int port = 0;
+    if (dns_ttl > std::chrono::seconds::zero() &&
+        HostResolver::ParseUrl((*i)->url, &host, &port)) {
+      resolver.reset(new HostResolver(host, port, dns_ttl));
+      transport->set_resolver(resolver.get());
+    }
+    if (!transport->Init())
+      continue;
+    // Failing lookups are retried in the background; until one succeeds,
+    // libcurl resolves the host itself.
+    if (resolver)
+      resolver->Start();
+    (*i)->resolver = std::move(resolver);
+    LOG(INFO) << "Sending key actions to " << (*i)->url << " over "
+              << (protocol == HttpTransport::kHttp2 ? "HTTP/2" : "HTTP/1.1")
+              << " with libcurl";
+    (*i)->transport = std::move(transport);
+  }
+}
+
+std::shared_ptr<NetHsmCluster::Connection> NetHsmCluster::AcquireForKey(
+    const std::string& key) {
+  return AcquireForKey(key, nodes_.size());
+}
+
+std::shared_ptr<NetHsmCluster::Connection> NetHsmCluster::AcquireForKey(
+    const std::string& key,
+    size_t excluded_node) {
+  if (ring_.empty())
+    return Acquire(excluded_node);
+  const Clock::time_point now = Clock::now();
+  int total_outstanding = 0;
+  for (size_t i = 0; i < nodes_.size(); ++i)
+    total_outstanding += nodes_[i]->outstanding;
+  // Bounded loads: counting this request, no node takes more than its fair
+  // share times the load factor.
+  const int max_load = std::max(
+      1, static_cast<int>(ceil(load_factor_ * (total_outstanding + 1) /
+                               nodes_.size())));
+  auto point = std::lower_bound(
+      ring_.begin(), ring_.end(),
+      std::make_pair(HashRingPosition(key), static_cast<size_t>(0)));
+  std::vector<bool> visited(nodes_.size());
+  size_t remaining = nodes_.size();
+  bool preferred = true;
+  for (size_t i = 0; i < ring_.size() && remaining > 0; ++i, ++point) {
+    if (point == ring_.end())
+      point = ring_.begin();
+    const size_t node = point->second;
+    if (visited[node])
+      continue;
+    visited[node] = true;
+    --remaining;
+    if (node != excluded_node && IsAvailable(node, now) &&
+        nodes_[node]->outstanding < max_load) {
+      (preferred ? nodes_[node]->preferred_requests
+                 : nodes_[node]->spillover_requests)->Increment();
+      return AcquireNode(node);
+    }
+    preferred = false;
+  }
+  // Every node is unavailable or busy.
+  return Acquire(excluded_node);
+}
+
+void NetHsmCluster::Warm(size_t clients) {
+  std::vector<pplx::task<void>> probes;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    // Hold every lease until its probe completes so that the pool hands out
+    // a different client each time.
+    for (size_t j = 0; j < clients; ++j) {
+      std::shared_ptr<http_client> client = nodes_[i]->pool->Acquire();
+      const std::string url = nodes_[i]->url;
+      probes.push_back(
+          client->request(web::http::methods::GET, kHealthPath)
+              .then([client, url](pplx::task<web::http::http_response> probe) {
+                try {
+                  probe.get();
+                }
+                catch (std::exception& e) {
+                  VLOG(1) << "Warming up a client of " << url << " failed: "
+                          << e.what();
+                }
+              }));
+    }
+  }
+  for (auto i = probes.begin(); i != probes.end(); ++i)
+    i->wait();
+  VLOG(1) << "Warmed up " << probes.size() << " NetHSM clients";
+}
+
+std::vector<std::string> NetHsmCluster::ParseUrls(const std::string& urls) {
+  std::vector<std::string> parts;
+  boost::split(parts, urls, [](char c) { return c == ','; });
+  std::vector<std::string> result;
+  for (auto i = parts.begin(); i != parts.end(); ++i) {
+    std::string url = boost::trim_copy(*i);
+    if (!url.empty())
+      result.push_back(url);
+  }
+  return result;
+}
+
+bool NetHsmCluster::IsAvailable(size_t node, const Clock::time_point& now) {
+  if (!nodes_[node]->healthy)
+    return false;
+  return now.time_since_epoch().count() >=
+      nodes_[node]->open_until.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<NetHsmCluster::Connection> NetHsmCluster::AcquireNode(
+    size_t node) {
+  CHECK_LT(node, nodes_.size());
+  ++nodes_[node]->outstanding;
+  return std::shared_ptr<Connection>(
+      new Connection(this, node, nodes_[node]->pool->Acquire(),
+                     nodes_[node]->transport.get()));
+}
+
+void NetHsmCluster::Release(size_t node) {
+  CHECK_LT(node, nodes_.size());
+  --nodes_[node]->outstanding;
+}
+
+void NetHsmCluster::SetHealthy(size_t node, bool healthy) {
+  CHECK_LT(node, nodes_.size());
+  if (nodes_[node]->healthy.exchange(healthy) == healthy)
+    return;
+  LOG(WARNING) << "NetHSM node " << nodes_[node]->url
+               << (healthy ? " is back in rotation" : " is unavailable");
+  // Only the probe thread changes the health of nodes, so the transitions
+  // between zero and one healthy node are seen in order.
+  const size_t healthy_nodes = healthy ? ++healthy_nodes_ : --healthy_nodes_;
+  if (healthy_nodes == (healthy ? 1u : 0u)) {
+    LOG(WARNING) << "NetHSM cluster is "
+                 << (healthy ? "reachable again" : "unreachable");
+    if (reachability_callback_)
+      reachability_callback_(healthy);
+  }
+}
+
+void NetHsmCluster::RecordSuccess(size_t node) {
+  CHECK_LT(node, nodes_.size());
+  // Most requests succeed against a closed breaker; avoid writing the shared
+  // counter in that case.
+  if (nodes_[node]->consecutive_failures.load(std::memory_order_relaxed) == 0)
+    return;
+  boost::lock_guard<boost::mutex> lock(breaker_lock_);
+  nodes_[node]->consecutive_failures = 0;
+}
+
+void NetHsmCluster::RecordFailure(size_t node) {
+  CHECK_LT(node, nodes_.size());
+  if (failure_threshold_ <= 0)
+    return;
+  boost::lock_guard<boost::mutex> lock(breaker_lock_);
+  Node* n = nodes_[node].get();
+  if (++n->consecutive_failures < failure_threshold_)
+    return;
+  // Open (or, after a failed trial request, reopen) the breaker. The counter
+  // is kept at the threshold so that a single failure reopens it.
+  n->consecutive_failures = failure_threshold_;
+  n->open_until = (Clock::now() + cooldown_).time_since_epoch().count();
+  LOG(WARNING) << "NetHSM node " << n->url << " failed "
+               << failure_threshold_ << " times in a row; skipping it for "
+               << std::chrono::duration_cast<std::chrono::seconds>(
+                      cooldown_).count() << "s";
+}
+
+bool NetHsmCluster::Probe(size_t node) {
+  try {
+    auto client = nodes_[node]->pool->Acquire();
+    auto response =
+        client->request(web::http::methods::GET, kHealthPath).get();
+    return response.status_code() == web::http::status_codes::OK;
+  }
+  catch (std::exception& e) {
+    VLOG(1) << "Health probe of " << nodes_[node]->url << " failed: "
+            << e.what();
+  }
+  return false;
+}
+
+void NetHsmCluster::ProbeLoop() {
+  boost::unique_lock<boost::mutex> lock(probe_lock_);
+  while (!stopping_) {
+    lock.unlock();
+    for (size_t i = 0; i < nodes_.size(); ++i)
+      SetHealthy(i, Probe(i));
+    lock.lock();
+    probe_wakeup_.wait_for(lock,
+                           boost::chrono::seconds(probe_interval_.count()),
+                           [this] { return stopping_; });
+  }
+}
+
+}  // namespace p11net
@@ -0,0 +1,209 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_NETHSM_CLUSTER_H_
+#define P11NET_NETHSM_CLUSTER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <cpprest/http_client.h>
+#include <base/macros.h>
+
+#include "http_transport.h"
+
+namespace p11net {
+
+class Counter;
+class Gauge;
+class HostResolver;
+class HttpClientPool;
+
+// NetHsmCluster balances requests across a set of replicated NetHSM nodes.
+// Each node has its own HttpClientPool. Requests are routed to the available
+// node with the fewest outstanding requests. A node is unavailable while its
+// background health probe fails, or while its circuit breaker is open: after
+// a number of consecutive failed requests the node is skipped for a cooldown
+// period, after which requests are let through again.
+//
+// With key affinity enabled, requests for a key go to the node the key maps
+// to on a consistent hash ring, so that each node serves a stable subset of
+// the keys. A request spills over to the next node on the ring while the
+// preferred one is unavailable or has more than 'load_factor' times the mean
+// number of outstanding requests. Sample usage:
+//    NetHsmCluster cluster(urls, config, pool_size, probe_interval);
+//    cluster.Start();
+//    std::shared_ptr<NetHsmCluster::Connection> connection =
+//        cluster.Acquire();
+//    connection->client()->request(web::http::methods::GET, path);
+class NetHsmCluster {
+ public:
+  // A leased client of one node. The node counts the request as outstanding
+  // until the connection is released.
+  class Connection {
+   public:
+    ~Connection();
+    web::http::client::http_client* client() const { return client_.get(); }
+    // The transport for key actions of the node, or NULL if they go through
+    // client() like other requests.
+    HttpTransport* transport() const { return transport_; }
+    size_t node() const { return node_; }
+    // Records the outcome of a request sent through this connection.
+    void ReportSuccess();
+    void ReportFailure();
+
+   private:
+    friend class NetHsmCluster;
+    Connection(NetHsmCluster* cluster,
+               size_t node,
+               std::shared_ptr<web::http::client::http_client> client,
+               HttpTransport* transport);
+
+    NetHsmCluster* cluster_;
+    size_t node_;
+    std::shared_ptr<web::http::client::http_client> client_;
+    HttpTransport* transport_;
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+  };
+
+  // Receives true when the cluster becomes reachable again and false when no
+  // node passes its health probe any more.
+  typedef std::function<void(bool)> ReachabilityCallback;
+
+  //  urls - The base URLs of the nodes; must not be empty.
+  //  pool_size - The maximum number of HTTP clients per node.
+  //  probe_interval - The time between health probes. Zero disables probing.
+  //  failure_threshold - The number of consecutive failures that opens the
+  //                      circuit breaker of a node. Zero disables the breaker.
+  //  cooldown - How long an open circuit breaker skips its node.
+  NetHsmCluster(const std::vector<std::string>& urls,
+                const web::http::client::http_client_config& config,
+                size_t pool_size,
+                std::chrono::seconds probe_interval,
+                int failure_threshold,
+                std::chrono::seconds cooldown);
+  virtual ~NetHsmCluster();
+
+  // Starts the background health probe. This may be called multiple times.
+  void Start();
+  // Stops the background health probe and waits for it to exit.
+  void Stop();
+
+  // Leases a client of the available node with the fewest outstanding
+  // requests. If no node is available, all nodes are considered.
+  std::shared_ptr<Connection> Acquire();
+  // Like Acquire, but prefers any node other than 'excluded_node'. This is
+  // used to send a hedged request somewhere other than the original.
+  std::shared_ptr<Connection> Acquire(size_t excluded_node);
+  // Leases a client of the node 'key' maps to, or of the next eligible node
+  // on the hash ring, preferring nodes other than 'excluded_node'. Without key
+  // affinity this is the same as Acquire.
+  std::shared_ptr<Connection> AcquireForKey(const std::string& key);
+  std::shared_ptr<Connection> AcquireForKey(const std::string& key,
+                                            size_t excluded_node);
+
+  // Builds the hash ring and routes AcquireForKey by it from then on. The
+  // share of the ring each node holds is reported in the metrics. This must
+  // be called before Start.
+  void EnableKeyAffinity(double load_factor);
+
+  // Gives every node a transport for key actions speaking 'protocol' over up
+  // to 'connections' connections for the connections to offer. Nodes whose
+  // transport cannot start stay on the cpprest client. Unless 'dns_ttl' is
+  // zero, the transports connect to addresses resolved in the background
+  // and cached for up to 'dns_ttl'. This must be called before Start.
+  void EnableTransport(HttpTransport::Protocol protocol,
+                       const std::string& user,
+                       const std::string& password,
+                       std::chrono::seconds timeout,
+                       size_t connections,
+                       std::chrono::seconds dns_ttl);
+
+  size_t size() const { return nodes_.size(); }
+
+  // Opens up to 'clients' pooled clients per node by sending each of them a
+  // health probe, so that later requests find warm connections. Returns once
+  // every probe has finished.
+  void Warm(size_t clients);
+
+  // Sets the callback invoked from the probe thread when the reachability of
+  // the cluster changes. This must be called before Start.
+  void set_reachability_callback(const ReachabilityCallback& callback) {
+    reachability_callback_ = callback;
+  }
+
+  // Splits a comma-separated list of URLs as accepted by P11NET_URL.
+  static std::vector<std::string> ParseUrls(const std::string& urls);
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Node {
+    std::string url;
+    std::unique_ptr<HttpClientPool> pool;
+    // Outlives the transport, which reads its addresses.
+    std::unique_ptr<HostResolver> resolver;
+    std::unique_ptr<HttpTransport> transport;
+    std::atomic<int> outstanding;
+    // Set by the health probe.
+    std::atomic<bool> healthy;
+    // Circuit breaker state. It is read without a lock on every request;
+    // breaker_lock_ serializes the transitions after a failure.
+    std::atomic<int> consecutive_failures;
+    // The time, since the clock's epoch, until which the breaker is open.
+    std::atomic<Clock::rep> open_until;
+    // Requests routed by key affinity to their preferred node, and requests
+    // that spilled over to this node.
+    Counter* preferred_requests;
+    Counter* spillover_requests;
+    // The share of the hash ring the node holds, in thousandths.
+    Gauge* ring_share;
+    int64_t reported_ring_share;
+  };
+
+  // Returns true if the node may receive requests.
+  bool IsAvailable(size_t node, const Clock::time_point& now);
+  std::shared_ptr<Connection> AcquireNode(size_t node);
+  void Release(size_t node);
+  void SetHealthy(size_t node, bool healthy);
+  void RecordSuccess(size_t node);
+  void RecordFailure(size_t node);
+  // Sends a readiness probe to the given node. Returns true if it is ready.
+  bool Probe(size_t node);
+  void ProbeLoop();
+
+  std::vector<std::unique_ptr<Node>> nodes_;
+  // The number of nodes passing their health probe.
+  std::atomic<size_t> healthy_nodes_;
+  ReachabilityCallback reachability_callback_;
+  std::chrono::seconds probe_interval_;
+  int failure_threshold_;
+  Clock::duration cooldown_;
+  // The points of the hash ring and the nodes owning them, in ring order.
+  // Empty without key affinity.
+  std::vector<std::pair<uint64_t, size_t>> ring_;
+  double load_factor_;
+  boost::mutex breaker_lock_;
+  boost::thread probe_thread_;
+  boost::mutex probe_lock_;
+  boost::condition_variable probe_wakeup_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(NetHsmCluster);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_NETHSM_CLUSTER_H_
@@ -0,0 +1,77 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nethsm_codec.h"
+
+#include "cppcodec/parse_error.hpp"
+
+#include "base64_simd.h"
+
+namespace p11net {
+
+namespace {
+
+bool IsJSONWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+}  // namespace
+
+void EncodeActionRequest(const std::string& field,
+                         const std::string& input,
+                         std::string* body) {
+  const size_t encoded_size = Base64UrlEncodedSize(input.size());
+  // {"<field>":"<encoded>"}
+  body->resize(field.size() + encoded_size + 7);
+  char* out = &(*body)[0];
+  *out++ = '{';
+  *out++ = '"';
+  out = std::copy(field.begin(), field.end(), out);
+  *out++ = '"';
+  *out++ = ':';
+  *out++ = '"';
+  out += Base64UrlEncode(reinterpret_cast<const uint8_t*>(input.data()),
+                         input.size(), out);
+  *out++ = '"';
+  *out++ = '}';
+  body->resize(out - body->data());
+}
+
+bool DecodeActionResponse(const std::string& body,
+                          const std::string& field,
+                          std::string* output) {
+  const std::string key = "\"" + field + "\"";
+  size_t pos = body.find(key);
+  if (pos == std::string::npos)
+    return false;
+  pos += key.size();
+  while (pos < body.size() && IsJSONWhitespace(body[pos]))
+    ++pos;
+  if (pos >= body.size() || body[pos] != ':')
+    return false;
+  ++pos;
+  while (pos < body.size() && IsJSONWhitespace(body[pos]))
+    ++pos;
+  if (pos >= body.size() || body[pos] != '"')
+    return false;
+  ++pos;
+  const size_t end = body.find('"', pos);
+  if (end == std::string::npos)
+    return false;
+  // Base64 never needs escaping; leave anything escaped to the full parser.
+  if (body.find('\\', pos) < end)
+    return false;
+  try {
+    output->resize(Base64UrlDecodedMaxSize(end - pos));
+    size_t size = Base64UrlDecode(body.data() + pos, end - pos,
+                                  reinterpret_cast<uint8_t*>(&(*output)[0]));
+    output->resize(size);
+  }
+  catch (cppcodec::parse_error&) {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace p11net
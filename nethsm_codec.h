@@ -0,0 +1,32 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_NETHSM_CODEC_H_
+#define P11NET_NETHSM_CODEC_H_
+
+#include <string>
+
+namespace p11net {
+
+// Encoding and decoding of the fixed-shape bodies used by NetHSM key actions
+// (sign, decrypt). These avoid building a JSON document for every request.
+
+// Writes {"<field>":"<base64 of input>"} to 'body', replacing its contents.
+// The capacity of 'body' is reused, so callers on a hot path should pass a
+// buffer that outlives the call.
+void EncodeActionRequest(const std::string& field,
+                         const std::string& input,
+                         std::string* body);
+
+// Finds the string member 'field' in a key action response and base64 decodes
+// it into 'output'. This is a minimal scanner, not a JSON parser: it returns
+// false if the member is missing, is not a plain string, or is not valid
+// base64, in which case the caller should fall back to a full parse.
+bool DecodeActionResponse(const std::string& body,
+                          const std::string& field,
+                          std::string* output);
+
+}  // namespace p11net
+
+#endif  // P11NET_NETHSM_CODEC_H_
@@ -5,15 +5,16 @@
 #ifndef P11NET_OBJECT_H_
 #define P11NET_OBJECT_H_
 
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
 
+#include "attribute_map.h"
 #include "pkcs11/cryptoki.h"
 
 namespace p11net {
 
-typedef std::map<CK_ATTRIBUTE_TYPE, std::string> AttributeMap;
-
 // Object policies can differ depending on the stage an object is at in its
 // lifecycle.
 enum ObjectStage {
@@ -23,6 +24,13 @@ enum ObjectStage {
   kNumObjectStages
 };
 
+// CachedKey holds key material derived from an object's attributes, such as
+// a parsed OpenSSL key, which is expensive to rebuild for every operation.
+class CachedKey {
+ public:
+  virtual ~CachedKey() {}
+};
+
 // Object is the interface for a PKCS #11 object.  This component manages all
 // object attributes and provides query and modify access to attributes
 // according to the current object policy.
@@ -94,6 +102,12 @@ class Object {
   virtual void RemoveAttribute(CK_ATTRIBUTE_TYPE type) = 0;
   // Provides a read-only map of all existing attributes.
   virtual const AttributeMap* GetAttributeMap() const = 0;
+  // Returns the key derived from this object's attributes, calling 'create' to
+  // build it if there is none. The key is shared by all users of the object
+  // and is dropped whenever an attribute changes. 'create' must not return
+  // NULL.
+  virtual std::shared_ptr<const CachedKey> GetCachedKey(
+      const std::function<CachedKey*()>& create) const = 0;
   // Get / set handle as seen by PKCS #11 clients.
   virtual int handle() const = 0;
   virtual void set_handle(int handle) = 0;
@@ -7,6 +7,7 @@
 #include <string>
 
 #include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
 
 #include "p11net_factory.h"
 #include "p11net_utility.h"
@@ -62,7 +63,7 @@ CK_RV ObjectImpl::FinalizeNewObject() {
   for (it = attributes_.begin(); it != attributes_.end(); ++it) {
     // Only external attributes have this policy enforced.  Internally, we need
     // to be able to set attributes like CKA_LOCAL which the user cannot.
-    if (external_attributes_.find(it->first) != external_attributes_.end()) {
+    if (it->external) {
       if (!policy_->IsModifyAllowed(it->first, it->second)) {
         return CKR_ATTRIBUTE_READ_ONLY;
       }
@@ -78,6 +79,8 @@ CK_RV ObjectImpl::FinalizeNewObject() {
 CK_RV ObjectImpl::Copy(const Object* original) {
   stage_ = kCopy;
   attributes_ = *original->GetAttributeMap();
+  attributes_.ClearExternal();
+  ClearCachedKey();
   policy_.reset();
   if (!SetPolicyByClass())
     return CKR_TEMPLATE_INCOMPLETE;
@@ -125,8 +128,9 @@ CK_RV ObjectImpl::SetAttributes(const CK_ATTRIBUTE_PTR attributes,
       if (!policy_->IsModifyAllowed(attributes[i].type, value))
         return CKR_ATTRIBUTE_READ_ONLY;
     }
-    external_attributes_.insert(attributes[i].type);
     attributes_[attributes[i].type] = value;
+    attributes_.find(attributes[i].type)->external = true;
+    ClearCachedKey();
   }
   if (policy_.get()) {
     if (!policy_->IsObjectComplete())
@@ -151,6 +155,7 @@ bool ObjectImpl::GetAttributeBool(CK_ATTRIBUTE_TYPE type,
 
 void ObjectImpl::SetAttributeBool(CK_ATTRIBUTE_TYPE type, bool value) {
   attributes_[type] = string(1, value ? 1 : 0);
+  ClearCachedKey();
 }
 
 int ObjectImpl::GetAttributeInt(CK_ATTRIBUTE_TYPE type,
@@ -174,6 +179,7 @@ void ObjectImpl::SetAttributeInt(CK_ATTRIBUTE_TYPE type, int value) {
   CK_ULONG long_value = value;
   attributes_[type] = string(reinterpret_cast<const char*>(&long_value),
                              sizeof(CK_ULONG));
+  ClearCachedKey();
 }
 
 string ObjectImpl::GetAttributeString(CK_ATTRIBUTE_TYPE type) const {
@@ -186,16 +192,33 @@ string ObjectImpl::GetAttributeString(CK_ATTRIBUTE_TYPE type) const {
 void ObjectImpl::SetAttributeString(CK_ATTRIBUTE_TYPE type,
                                     const string& value) {
   attributes_[type] = value;
+  ClearCachedKey();
 }
 
 void ObjectImpl::RemoveAttribute(CK_ATTRIBUTE_TYPE type) {
   attributes_.erase(type);
+  ClearCachedKey();
 }
 
 const AttributeMap* ObjectImpl::GetAttributeMap() const {
   return &attributes_;
 }
 
+std::shared_ptr<const CachedKey> ObjectImpl::GetCachedKey(
+    const std::function<CachedKey*()>& create) const {
+  boost::lock_guard<boost::mutex> lock(cached_key_lock_);
+  if (!cached_key_) {
+    cached_key_.reset(create());
+    CHECK(cached_key_);
+  }
+  return cached_key_;
+}
+
+void ObjectImpl::ClearCachedKey() {
+  boost::lock_guard<boost::mutex> lock(cached_key_lock_);
+  cached_key_.reset();
+}
+
 bool ObjectImpl::SetPolicyByClass() {
   if (!IsAttributePresent(CKA_CLASS)) {
     LOG(ERROR) << "Missing object class attribute.";
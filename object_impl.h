@@ -8,10 +8,10 @@
 #include "object.h"
 
 #include <memory>
-#include <set>
 #include <string>
 
 #include <base/macros.h>
+#include <boost/thread/mutex.hpp>
 
 #include "pkcs11/cryptoki.h"
 
@@ -48,6 +48,8 @@ class ObjectImpl : public Object {
                                   const std::string& value);
   virtual void RemoveAttribute(CK_ATTRIBUTE_TYPE type);
   virtual const AttributeMap* GetAttributeMap() const;
+  virtual std::shared_ptr<const CachedKey> GetCachedKey(
+      const std::function<CachedKey*()>& create) const;
   virtual int handle() const {return handle_;}
   virtual void set_handle(int handle) {handle_ = handle;}
   virtual int store_id() const {return store_id_;}
@@ -56,14 +58,17 @@ class ObjectImpl : public Object {
  private:
   P11NetFactory* factory_;
   ObjectStage stage_;
+  // Tracks which attributes have been set by the user in Entry::external.
   AttributeMap attributes_;
-  // Tracks attributes which have been set by the user.
-  std::set<CK_ATTRIBUTE_TYPE> external_attributes_;
   std::unique_ptr<ObjectPolicy> policy_;
   int handle_;
   int store_id_;
+  // Built from attributes_ on demand; cleared after every modification.
+  mutable std::shared_ptr<const CachedKey> cached_key_;
+  mutable boost::mutex cached_key_lock_;
 
   bool SetPolicyByClass();
+  void ClearCachedKey();
 
   DISALLOW_COPY_AND_ASSIGN(ObjectImpl);
 };
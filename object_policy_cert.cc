@@ -6,6 +6,7 @@
 
 #include <base/logging.h>
 
+#include "p11net.h"
 #include "p11net_utility.h"
 
 namespace p11net {
@@ -30,11 +31,15 @@ static const AttributePolicy kCertPolicies[] = {
   {CKA_HASH_OF_SUBJECT_PUBLIC_KEY, false, {false, false, true}, false},
   {CKA_HASH_OF_ISSUER_PUBLIC_KEY, false, {false, false, true}, false},
   {CKA_JAVA_MIDP_SECURITY_DOMAIN, false, {false, false, true}, false},
-  {CKA_OWNER, false, {false, false, true}, false}
+  {CKA_OWNER, false, {false, false, true}, false},
+  {kCertificateLocationAttribute, true, {true, true, true}, false}
 };
 
 ObjectPolicyCert::ObjectPolicyCert() {
-  AddPolicies(kCertPolicies, arraysize(kCertPolicies));
+  static const AttributePolicyTable table(ObjectPolicyCommon::GetPolicyTable(),
+                                          kCertPolicies,
+                                          arraysize(kCertPolicies));
+  policies_ = &table;
 }
 
 ObjectPolicyCert::~ObjectPolicyCert() {}
@@ -50,6 +55,9 @@ bool ObjectPolicyCert::IsObjectComplete() {
       LOG(ERROR) << "Attribute is required: CKA_OWNER";
       return false;
     }
+  } else if (object_->IsAttributePresent(kCertificateLocationAttribute)) {
+    // The certificate of a NetHSM key; its value is fetched when first read.
+    return true;
   } else {
     if (!object_->IsAttributePresent(CKA_SUBJECT)) {
       LOG(ERROR) << "Attribute is required: CKA_SUBJECT";
@@ -4,7 +4,7 @@
 
 #include "object_policy_common.h"
 
-#include <map>
+#include <algorithm>
 
 #include <base/logging.h>
 #include <base/macros.h>
@@ -12,7 +12,7 @@
 #include "p11net_utility.h"
 #include "object.h"
 
-using std::map;
+using std::vector;
 
 namespace p11net {
 
@@ -31,10 +31,41 @@ static const AttributePolicy kCommonPolicies[] = {
   {CKA_LABEL, false, {false, false, false}, false}
 };
 
-ObjectPolicyCommon::ObjectPolicyCommon() : object_(NULL) {
-  AddPolicies(kCommonPolicies, arraysize(kCommonPolicies));
+static bool PolicyTypeLess(const AttributePolicy& policy,
+                           CK_ATTRIBUTE_TYPE type) {
+  return policy.type_ < type;
 }
 
+AttributePolicyTable::AttributePolicyTable(const AttributePolicyTable* base,
+                                           const AttributePolicy* policies,
+                                           size_t num_policies) {
+  if (base)
+    policies_ = base->policies_;
+  policies_.reserve(policies_.size() + num_policies);
+  for (size_t i = 0; i < num_policies; ++i) {
+    vector<AttributePolicy>::iterator it =
+        std::lower_bound(policies_.begin(), policies_.end(),
+                         policies[i].type_, PolicyTypeLess);
+    if (it != policies_.end() && it->type_ == policies[i].type_)
+      *it = policies[i];
+    else
+      policies_.insert(it, policies[i]);
+  }
+}
+
+const AttributePolicy* AttributePolicyTable::Find(
+    CK_ATTRIBUTE_TYPE type) const {
+  vector<AttributePolicy>::const_iterator it =
+      std::lower_bound(policies_.begin(), policies_.end(), type,
+                       PolicyTypeLess);
+  if (it == policies_.end() || it->type_ != type)
+    return NULL;
+  return &(*it);
+}
+
+ObjectPolicyCommon::ObjectPolicyCommon()
+    : object_(NULL), policies_(GetPolicyTable()) {}
+
 ObjectPolicyCommon::~ObjectPolicyCommon() {}
 
 void ObjectPolicyCommon::Init(Object* object) {
@@ -45,8 +76,8 @@ bool ObjectPolicyCommon::IsReadAllowed(CK_ATTRIBUTE_TYPE type) {
   CHECK(object_);
   if (object_->GetAttributeBool(CKA_SENSITIVE, true) ||
       !object_->GetAttributeBool(CKA_EXTRACTABLE, false)) {
-    map<CK_ATTRIBUTE_TYPE, AttributePolicy>::iterator it = policies_.find(type);
-    if (it != policies_.end() && it->second.is_sensitive_) {
+    const AttributePolicy* policy = policies_->Find(type);
+    if (policy && policy->is_sensitive_) {
       LOG(WARNING) << "Attribute is sensitive: " << AttributeToString(type);
       return false;
     }
@@ -57,11 +88,11 @@ bool ObjectPolicyCommon::IsReadAllowed(CK_ATTRIBUTE_TYPE type) {
 bool ObjectPolicyCommon::IsModifyAllowed(CK_ATTRIBUTE_TYPE type,
                                          const std::string& value) {
   CHECK(object_);
-  map<CK_ATTRIBUTE_TYPE, AttributePolicy>::iterator it = policies_.find(type);
-  if (it != policies_.end()) {
+  const AttributePolicy* policy = policies_->Find(type);
+  if (policy) {
     ObjectStage stage = object_->GetStage();
     CHECK(stage < kNumObjectStages);
-    if (it->second.is_readonly_[stage]) {
+    if (policy->is_readonly_[stage]) {
       LOG(WARNING) << "Attribute is read-only: " << AttributeToString(type);
       return false;
     }
@@ -82,10 +113,11 @@ bool ObjectPolicyCommon::IsModifyAllowed(CK_ATTRIBUTE_TYPE type,
 
 bool ObjectPolicyCommon::IsObjectComplete() {
   CHECK(object_);
-  map<CK_ATTRIBUTE_TYPE, AttributePolicy>::iterator it;
-  for (it = policies_.begin(); it != policies_.end(); ++it) {
-    if (it->second.is_required_ && !object_->IsAttributePresent(it->first)) {
-      LOG(ERROR) << "Attribute is required: " << AttributeToString(it->first);
+  const vector<AttributePolicy>& policies = policies_->policies();
+  vector<AttributePolicy>::const_iterator it;
+  for (it = policies.begin(); it != policies.end(); ++it) {
+    if (it->is_required_ && !object_->IsAttributePresent(it->type_)) {
+      LOG(ERROR) << "Attribute is required: " << AttributeToString(it->type_);
       return false;
     }
   }
@@ -104,11 +136,10 @@ void ObjectPolicyCommon::SetDefaultAttributes() {
     object_->SetAttributeString(CKA_LABEL, "");
 }
 
-void ObjectPolicyCommon::AddPolicies(const AttributePolicy* policies,
-                                     int num_policies) {
-  for (int i = 0; i < num_policies; ++i) {
-    policies_[policies[i].type_] = policies[i];
-  }
+const AttributePolicyTable* ObjectPolicyCommon::GetPolicyTable() {
+  static const AttributePolicyTable table(NULL, kCommonPolicies,
+                                          arraysize(kCommonPolicies));
+  return &table;
 }
 
 bool ObjectPolicyCommon::IsPrivateClass() {
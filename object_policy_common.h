@@ -7,8 +7,8 @@
 
 #include "object_policy.h"
 
-#include <map>
 #include <string>
+#include <vector>
 
 #include "object.h"
 
@@ -21,6 +21,25 @@ struct AttributePolicy {
   bool is_required_;
 };
 
+// A set of attribute policies sorted by type. Each policy class builds its
+// table once from its own policies and those of its parent, and all instances
+// of the class share it, so creating an object does not allocate policies.
+class AttributePolicyTable {
+ public:
+  // Merges 'policies' into those of 'base', which may be NULL. A policy
+  // replaces a policy of 'base' for the same attribute.
+  AttributePolicyTable(const AttributePolicyTable* base,
+                       const AttributePolicy* policies,
+                       size_t num_policies);
+
+  // Returns the policy for the given attribute or NULL if there is none.
+  const AttributePolicy* Find(CK_ATTRIBUTE_TYPE type) const;
+  const std::vector<AttributePolicy>& policies() const { return policies_; }
+
+ private:
+  std::vector<AttributePolicy> policies_;
+};
+
 // Enforces policies that are common to all object types.
 class ObjectPolicyCommon : public ObjectPolicy {
  public:
@@ -35,9 +54,11 @@ class ObjectPolicyCommon : public ObjectPolicy {
 
  protected:
   Object* object_;  // The object this policy is associated with.
-  std::map<CK_ATTRIBUTE_TYPE, AttributePolicy> policies_;
-  // Helps sub-classes add more policies.
-  void AddPolicies(const AttributePolicy* policies, int size);
+  // The shared policy table of the most derived class. Sub-classes point this
+  // at their own table in their constructor.
+  const AttributePolicyTable* policies_;
+  // Returns the policies common to all object types.
+  static const AttributePolicyTable* GetPolicyTable();
   // Determines whether the object is private based on object class.
   bool IsPrivateClass();
 };
@@ -22,7 +22,10 @@ static const AttributePolicy kDataPolicies[] = {
 };
 
 ObjectPolicyData::ObjectPolicyData() {
-  AddPolicies(kDataPolicies, arraysize(kDataPolicies));
+  static const AttributePolicyTable table(ObjectPolicyCommon::GetPolicyTable(),
+                                          kDataPolicies,
+                                          arraysize(kDataPolicies));
+  policies_ = &table;
 }
 
 ObjectPolicyData::~ObjectPolicyData() {}
@@ -23,11 +23,18 @@ static const AttributePolicy kKeyPolicies[] = {
 };
 
 ObjectPolicyKey::ObjectPolicyKey() {
-  AddPolicies(kKeyPolicies, arraysize(kKeyPolicies));
+  policies_ = GetPolicyTable();
 }
 
 ObjectPolicyKey::~ObjectPolicyKey() {}
 
+const AttributePolicyTable* ObjectPolicyKey::GetPolicyTable() {
+  static const AttributePolicyTable table(ObjectPolicyCommon::GetPolicyTable(),
+                                          kKeyPolicies,
+                                          arraysize(kKeyPolicies));
+  return &table;
+}
+
 void ObjectPolicyKey::SetDefaultAttributes() {
   ObjectPolicyCommon::SetDefaultAttributes();
   CK_ATTRIBUTE_TYPE empty[] = {
@@ -15,6 +15,10 @@ class ObjectPolicyKey : public ObjectPolicyCommon {
   ObjectPolicyKey();
   virtual ~ObjectPolicyKey();
   virtual void SetDefaultAttributes();
+
+ protected:
+  // Returns the policies common to all key types.
+  static const AttributePolicyTable* GetPolicyTable();
 };
 
 }  // namespace p11net
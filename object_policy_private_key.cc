@@ -25,21 +25,26 @@ static const AttributePolicy kPrivateKeyPolicies[] = {
   {CKA_UNWRAP_TEMPLATE, false, {false, false, true}, false},
   {CKA_ALWAYS_AUTHENTICATE, false, {false, false, true}, false},
   // RSA-specific attributes.
-  {CKA_MODULUS, false, {false, false, true}, true},
-  {CKA_PUBLIC_EXPONENT, false, {false, false, true}, true},
+  {CKA_MODULUS, false, {false, false, true}, false},
+  {CKA_PUBLIC_EXPONENT, false, {false, false, true}, false},
   {CKA_PRIVATE_EXPONENT, true, {false, false, true}, false},
   {CKA_PRIME_1, true, {false, false, true}, false},
   {CKA_PRIME_2, true, {false, false, true}, false},
   {CKA_EXPONENT_1, true, {false, false, true}, false},
   {CKA_EXPONENT_2, true, {false, false, true}, false},
   {CKA_COEFFICIENT, true, {false, false, true}, false},
+  // EC-specific attributes.
+  {CKA_EC_PARAMS, false, {false, false, true}, false},
   {kKeyBlobAttribute, true, {false, true, true}, false},
   {kAuthDataAttribute, true, {false, true, true}, false},
   {kKeyLocationAttribute, true, {false, true, true}, false},
 };
 
 ObjectPolicyPrivateKey::ObjectPolicyPrivateKey() {
-  AddPolicies(kPrivateKeyPolicies, arraysize(kPrivateKeyPolicies));
+  static const AttributePolicyTable table(ObjectPolicyKey::GetPolicyTable(),
+                                          kPrivateKeyPolicies,
+                                          arraysize(kPrivateKeyPolicies));
+  policies_ = &table;
 }
 
 ObjectPolicyPrivateKey::~ObjectPolicyPrivateKey() {}
@@ -47,6 +52,20 @@ ObjectPolicyPrivateKey::~ObjectPolicyPrivateKey() {}
 bool ObjectPolicyPrivateKey::IsObjectComplete() {
   if (!ObjectPolicyCommon::IsObjectComplete())
     return false;
+  if (object_->GetAttributeInt(CKA_KEY_TYPE, -1) == CKK_EC) {
+    // EC private keys only live on the NetHSM.
+    if (!object_->IsAttributePresent(CKA_EC_PARAMS) ||
+        !object_->IsAttributePresent(kKeyLocationAttribute)) {
+      LOG(ERROR) << "EC private key attributes are required.";
+      return false;
+    }
+    return true;
+  }
+  if (!object_->IsAttributePresent(CKA_MODULUS) ||
+      !object_->IsAttributePresent(CKA_PUBLIC_EXPONENT)) {
+    LOG(ERROR) << "RSA key attributes are required.";
+    return false;
+  }
   // Either a private exponent or a key location must exist.
   if (!object_->IsAttributePresent(CKA_PRIVATE_EXPONENT) &&
       !object_->IsAttributePresent(kKeyLocationAttribute)) {
@@ -4,6 +4,7 @@
 
 #include "object_policy_public_key.h"
 
+#include <base/logging.h>
 #include <base/macros.h>
 
 namespace p11net {
@@ -15,20 +16,46 @@ namespace p11net {
 // read-only.copy - True if attribute cannot be set with C_CopyObject.
 // read-only.modify - True if attribute cannot be set with C_SetAttributeValue.
 // required - True if attribute is required for a valid object.
+// Attributes specific to a key type are required by IsObjectComplete.
 static const AttributePolicy kPublicKeyPolicies[] = {
   {CKA_TRUSTED, false, {true, true, true}, false},
   {CKA_WRAP_TEMPLATE, false, {false, false, true}, false},
   // RSA-specific attributes.
-  {CKA_MODULUS, false, {false, false, true}, true},
-  {CKA_PUBLIC_EXPONENT, false, {false, false, true}, true},
+  {CKA_MODULUS, false, {false, false, true}, false},
+  {CKA_PUBLIC_EXPONENT, false, {false, false, true}, false},
+  // EC-specific attributes.
+  {CKA_EC_PARAMS, false, {false, false, true}, false},
+  {CKA_EC_POINT, false, {false, false, true}, false},
 };
 
 ObjectPolicyPublicKey::ObjectPolicyPublicKey() {
-  AddPolicies(kPublicKeyPolicies, arraysize(kPublicKeyPolicies));
+  static const AttributePolicyTable table(ObjectPolicyKey::GetPolicyTable(),
+                                          kPublicKeyPolicies,
+                                          arraysize(kPublicKeyPolicies));
+  policies_ = &table;
 }
 
 ObjectPolicyPublicKey::~ObjectPolicyPublicKey() {}
 
+bool ObjectPolicyPublicKey::IsObjectComplete() {
+  if (!ObjectPolicyCommon::IsObjectComplete())
+    return false;
+  if (object_->GetAttributeInt(CKA_KEY_TYPE, -1) == CKK_EC) {
+    if (!object_->IsAttributePresent(CKA_EC_PARAMS) ||
+        !object_->IsAttributePresent(CKA_EC_POINT)) {
+      LOG(ERROR) << "EC key attributes are required.";
+      return false;
+    }
+    return true;
+  }
+  if (!object_->IsAttributePresent(CKA_MODULUS) ||
+      !object_->IsAttributePresent(CKA_PUBLIC_EXPONENT)) {
+    LOG(ERROR) << "RSA key attributes are required.";
+    return false;
+  }
+  return true;
+}
+
 void ObjectPolicyPublicKey::SetDefaultAttributes() {
   ObjectPolicyKey::SetDefaultAttributes();
   CK_ATTRIBUTE_TYPE false_values[] = {
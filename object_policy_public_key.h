@@ -14,6 +14,7 @@ class ObjectPolicyPublicKey : public ObjectPolicyKey {
  public:
   ObjectPolicyPublicKey();
   virtual ~ObjectPolicyPublicKey();
+  virtual bool IsObjectComplete();
   virtual void SetDefaultAttributes();
 };
 
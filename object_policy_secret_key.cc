@@ -28,7 +28,10 @@ static const AttributePolicy kSecretKeyPolicies[] = {
 };
 
 ObjectPolicySecretKey::ObjectPolicySecretKey() {
-  AddPolicies(kSecretKeyPolicies, arraysize(kSecretKeyPolicies));
+  static const AttributePolicyTable table(ObjectPolicyKey::GetPolicyTable(),
+                                          kSecretKeyPolicies,
+                                          arraysize(kSecretKeyPolicies));
+  policies_ = &table;
 }
 
 ObjectPolicySecretKey::~ObjectPolicySecretKey() {}
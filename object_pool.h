@@ -5,6 +5,7 @@
 #ifndef P11NET_OBJECT_POOL_H_
 #define P11NET_OBJECT_POOL_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -31,6 +32,8 @@ enum InternalBlobId {
   kLegacyPublicRootKey,
   // A hash of the authorization data.
   kAuthDataHash,
+  // A snapshot of the NetHSM key inventory (a serialized KeyInventory).
+  kKeyInventory,
 };
 
 // An ObjectPool instance manages a collection of objects.  A persistent object
@@ -57,19 +60,47 @@ class ObjectPool {
   virtual bool SetEncryptionKey(const brillo::SecureBlob& key) = 0;
   // This method takes ownership of the 'object' pointer on success.
   virtual bool Insert(Object* object) = 0;
+  // Inserts several objects at once: either all of them are inserted or none
+  // is. Like 'Insert', this method takes ownership of the objects on success.
+  // Objects that already have a handle, e.g. objects returned to the pool
+  // after an eviction, keep it; it must not be in use.
+  virtual bool InsertBatch(const std::vector<Object*>& objects) = 0;
   // Imports an object from an external source. Like 'Insert', this method takes
   // ownership of the 'object' pointer on success.
   virtual bool Import(Object* object) = 0;
   // Deletes an existing object.
   virtual bool Delete(const Object* object) = 0;
+  // Deletes several existing objects at once: either all of them are deleted
+  // or none is.
+  virtual bool DeleteBatch(const std::vector<const Object*>& objects) = 0;
+  // Replaces existing objects with new ones at once: either all of them are
+  // replaced or none is, and no reader sees some of the old objects gone and
+  // the new ones missing. A new object may take the handle of an old one.
+  // Like 'Insert', this method takes ownership of the new objects on success.
+  virtual bool ReplaceBatch(const std::vector<const Object*>& old_objects,
+                            const std::vector<Object*>& new_objects) = 0;
   // Deletes all existing objects.
   virtual bool DeleteAll() = 0;
   // Finds all objects matching the search template and appends them to the
   // supplied vector.
   virtual bool Find(const Object* search_template,
                     std::vector<const Object*>* matching_objects) = 0;
+  // Like Find, but appends at most 'max_count' matching objects and only those
+  // with a handle greater than 'after_handle', in ascending handle order. A
+  // search can be resumed by passing the handle of the last object returned.
+  virtual bool FindFrom(const Object* search_template,
+                        int after_handle,
+                        size_t max_count,
+                        std::vector<const Object*>* matching_objects) = 0;
   // Finds an object by handle. Returns false if the handle does not exist.
   virtual bool FindByHandle(int handle, const Object** object) = 0;
+  // As above, sharing ownership of the object, which stays valid after it
+  // is deleted from the pool, e.g. when its NetHSM key is evicted.
+  virtual bool FindByHandle(int handle,
+                            std::shared_ptr<const Object>* object) = 0;
+  // Returns an estimate of the bytes held by the objects in the pool and by
+  // its indexes.
+  virtual size_t GetMemoryUsage() = 0;
   // Returns a modifiable version of the given object.
   virtual Object* GetModifiableObject(const Object* object) = 0;
   // Flushes a modified object to persistent storage.
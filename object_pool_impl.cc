@@ -6,16 +6,20 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <base/logging.h>
 #include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+#include <google/protobuf/arena.h>
 
 #include "p11net.h"
 #include "p11net_factory.h"
 #include "p11net_utility.h"
 #include "handle_generator.h"
+#include "metrics.h"
 #include "object.h"
 #include "object_store.h"
 #include "proto_bindings/attributes.pb.h"
@@ -28,20 +32,91 @@ using std::vector;
 
 namespace p11net {
 
+namespace {
+
+// The attributes clients typically search by.
+const CK_ATTRIBUTE_TYPE kIndexedAttributes[] = {
+  CKA_ID, CKA_LABEL, CKA_CLASS, CKA_KEY_TYPE
+};
+
+// An empty posting list for values no object holds.
+const ObjectSet kNoObjects;
+
+// The approximate overhead of a map node or a hash table entry, not counting
+// the key and value, used to estimate the memory held by the indexes.
+const size_t kNodeBytes = 48;
+
+// The number of entries of the per-thread handle cache of FindByHandle. A
+// thread works with a few keys at a time, so a small direct-mapped cache
+// catches nearly all repeated lookups.
+const size_t kHandleCacheSize = 16;
+
+// A handle resolved by FindByHandle on this thread, valid for the pool with
+// the given identifier as long as its epoch is current.
+// The entry shares ownership of the object, so a pointer handed out from it
+// stays valid when the object leaves the pool.
+struct CachedHandle {
+  CachedHandle() : pool_id(0), epoch(0), handle(0) {}
+  uint64_t pool_id;
+  uint64_t epoch;
+  int handle;
+  std::shared_ptr<const Object> object;
+};
+
+CachedHandle* GetHandleCache() {
+  // Pool identifiers start at 1, so fresh entries match no pool.
+  static thread_local CachedHandle cache[kHandleCacheSize];
+  return cache;
+}
+
+std::atomic<uint64_t> g_next_pool_id(1);
+
+// The duration and number of results of Find and FindFrom.
+Histogram* GetFindDurationHistogram() {
+  static Histogram* const histogram = Metrics::Get()->GetHistogram(
+      "p11net_pool_find_duration_us");
+  return histogram;
+}
+
+Histogram* GetFindResultsHistogram() {
+  static Histogram* const histogram = Metrics::Get()->GetHistogram(
+      "p11net_pool_find_results");
+  return histogram;
+}
+
+}  // namespace
+
 ObjectPoolImpl::ObjectPoolImpl(std::shared_ptr<P11NetFactory> factory,
                                std::shared_ptr<HandleGenerator> handle_generator,
                                std::unique_ptr<ObjectStore> store)
-    : factory_(factory),
+    : object_bytes_(0),
+      index_bytes_(0),
+      reported_object_bytes_(0),
+      reported_index_bytes_(0),
+      factory_(factory),
       handle_generator_(handle_generator),
-      store_(std::move(store))
+      store_(std::move(store)),
+      id_(g_next_pool_id++),
+      epoch_(0)
   {
+    // Only token pools are created with a store.
+    const string labels = store_ ? "pool=\"token\"" : "pool=\"session\"";
+    object_bytes_gauge_ = Metrics::Get()->GetGauge(
+        "p11net_pool_object_bytes", labels);
+    index_bytes_gauge_ = Metrics::Get()->GetGauge(
+        "p11net_pool_index_bytes", labels);
     store_.reset();
+    for (CK_ATTRIBUTE_TYPE type : kIndexedAttributes)
+      indexes_[type];
   }
 
-ObjectPoolImpl::~ObjectPoolImpl() {}
+ObjectPoolImpl::~ObjectPoolImpl() {
+  object_bytes_gauge_->Add(-reported_object_bytes_);
+  index_bytes_gauge_->Add(-reported_index_bytes_);
+}
 
 bool ObjectPoolImpl::Init() {
-  boost::lock_guard<boost::mutex> lock(lock_);
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
   if (store_.get()) {
     if (!LoadPublicObjects())
       return false;
@@ -50,21 +125,21 @@ bool ObjectPoolImpl::Init() {
 }
 
 bool ObjectPoolImpl::GetInternalBlob(int blob_id, string* blob) {
-  boost::lock_guard<boost::mutex> lock(lock_);
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
   if (store_.get())
     return store_->GetInternalBlob(blob_id, blob);
   return false;
 }
 
 bool ObjectPoolImpl::SetInternalBlob(int blob_id, const string& blob) {
-  boost::lock_guard<boost::mutex> lock(lock_);
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
   if (store_.get())
     return store_->SetInternalBlob(blob_id, blob);
   return false;
 }
 
 bool ObjectPoolImpl::SetEncryptionKey(const SecureBlob& key) {
-  boost::lock_guard<boost::mutex> lock(lock_);
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
   if (key.empty())
     LOG(WARNING) << "WARNING: Private object services will not be available.";
   if (store_.get() && !key.empty()) {
@@ -82,8 +157,8 @@ bool ObjectPoolImpl::Insert(Object* object) {
 }
 
 bool ObjectPoolImpl::Import(Object* object) {
-  boost::lock_guard<boost::mutex> lock(lock_);
-  if (objects_.find(object) != objects_.end())
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  if (Contains(object))
     return false;
   if (store_.get()) {
     ObjectBlob serialized;
@@ -100,28 +175,151 @@ bool ObjectPoolImpl::Import(Object* object) {
     object->set_store_id(store_id);
   }
   object->set_handle(handle_generator_->CreateHandle());
-  objects_.insert(object);
-  handle_object_map_[object->handle()] = shared_ptr<const Object>(object);
+  objects_[object->handle()] = object;
+  handle_table_.Insert(object->handle(), shared_ptr<const Object>(object));
+  AddToIndexes(object);
+  ReportMemoryUsage();
+  return true;
+}
+
+bool ObjectPoolImpl::InsertBatch(const vector<Object*>& objects) {
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  std::set<const Object*> batch;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    if (Contains(objects[i]) || !batch.insert(objects[i]).second)
+      return false;
+    if (objects[i]->handle() > 0 && handle_table_.Find(objects[i]->handle()))
+      return false;
+  }
+  if (store_.get()) {
+    vector<ObjectBlob> serialized(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      // Normalize the attribute values as Import does.
+      if (!Serialize(objects[i], &serialized[i]) ||
+          !Parse(serialized[i], objects[i]))
+        return false;
+    }
+    vector<int> store_ids;
+    if (!store_->InsertObjectBlobs(serialized, &store_ids))
+      return false;
+    for (size_t i = 0; i < objects.size(); ++i)
+      objects[i]->set_store_id(store_ids[i]);
+  }
+  for (size_t i = 0; i < objects.size(); ++i) {
+    Object* object = objects[i];
+    if (object->handle() <= 0)
+      object->set_handle(handle_generator_->CreateHandle());
+    objects_[object->handle()] = object;
+    handle_table_.Insert(object->handle(), shared_ptr<const Object>(object));
+    AddToIndexes(object);
+  }
+  ReportMemoryUsage();
   return true;
 }
 
 bool ObjectPoolImpl::Delete(const Object* object) {
-  boost::lock_guard<boost::mutex> lock(lock_);
-  if (objects_.find(object) == objects_.end())
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  if (!Contains(object))
     return false;
+  InvalidateHandleCaches();
   if (store_.get()) {
     if (!store_->DeleteObjectBlob(object->store_id()))
       return false;
   }
-  handle_object_map_.erase(object->handle());
-  objects_.erase(object);
+  RemoveFromIndexes(object);
+  handle_table_.Erase(object->handle());
+  objects_.erase(object->handle());
+  ReportMemoryUsage();
+  return true;
+}
+
+bool ObjectPoolImpl::DeleteBatch(const vector<const Object*>& objects) {
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  ObjectBlobChanges changes;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    if (!Contains(objects[i]))
+      return false;
+    changes.deletions.push_back(objects[i]->store_id());
+  }
+  // The blobs are removed with a single write.
+  if (store_.get() && !store_->CommitChanges(changes, NULL))
+    return false;
+  InvalidateHandleCaches();
+  for (size_t i = 0; i < objects.size(); ++i) {
+    RemoveFromIndexes(objects[i]);
+    handle_table_.Erase(objects[i]->handle());
+    objects_.erase(objects[i]->handle());
+  }
+  ReportMemoryUsage();
+  return true;
+}
+
+bool ObjectPoolImpl::ReplaceBatch(const vector<const Object*>& old_objects,
+                                  const vector<Object*>& new_objects) {
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  std::set<int> freed_handles;
+  ObjectBlobChanges changes;
+  for (size_t i = 0; i < old_objects.size(); ++i) {
+    if (!Contains(old_objects[i]) ||
+        !freed_handles.insert(old_objects[i]->handle()).second)
+      return false;
+    changes.deletions.push_back(old_objects[i]->store_id());
+  }
+  std::set<const Object*> batch;
+  std::set<int> taken_handles;
+  for (size_t i = 0; i < new_objects.size(); ++i) {
+    const int handle = new_objects[i]->handle();
+    if (Contains(new_objects[i]) || !batch.insert(new_objects[i]).second)
+      return false;
+    if (handle > 0 && ((handle_table_.Find(handle) &&
+                        freed_handles.count(handle) == 0) ||
+                       !taken_handles.insert(handle).second))
+      return false;
+  }
+  if (store_.get()) {
+    changes.insertions.resize(new_objects.size());
+    for (size_t i = 0; i < new_objects.size(); ++i) {
+      // Normalize the attribute values as Import does.
+      if (!Serialize(new_objects[i], &changes.insertions[i]) ||
+          !Parse(changes.insertions[i], new_objects[i]))
+        return false;
+    }
+    // The old blobs go and the new ones come with a single write.
+    vector<int> store_ids;
+    if (!store_->CommitChanges(changes, &store_ids))
+      return false;
+    for (size_t i = 0; i < new_objects.size(); ++i)
+      new_objects[i]->set_store_id(store_ids[i]);
+  }
+  InvalidateHandleCaches();
+  for (size_t i = 0; i < old_objects.size(); ++i) {
+    RemoveFromIndexes(old_objects[i]);
+    handle_table_.Erase(old_objects[i]->handle());
+    objects_.erase(old_objects[i]->handle());
+  }
+  for (size_t i = 0; i < new_objects.size(); ++i) {
+    Object* object = new_objects[i];
+    if (object->handle() <= 0)
+      object->set_handle(handle_generator_->CreateHandle());
+    objects_[object->handle()] = object;
+    handle_table_.Insert(object->handle(), shared_ptr<const Object>(object));
+    AddToIndexes(object);
+  }
+  ReportMemoryUsage();
   return true;
 }
 
 bool ObjectPoolImpl::DeleteAll() {
-  boost::lock_guard<boost::mutex> lock(lock_);
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  InvalidateHandleCaches();
   objects_.clear();
-  handle_object_map_.clear();
+  handle_table_.Clear();
+  for (auto it = indexes_.begin(); it != indexes_.end(); ++it)
+    it->second.clear();
+  indexed_values_.clear();
+  object_bytes_ = 0;
+  index_bytes_ = 0;
+  ReportMemoryUsage();
   if (store_.get())
     return store_->DeleteAllObjectBlobs();
   return true;
@@ -129,21 +327,73 @@ bool ObjectPoolImpl::DeleteAll() {
 
 bool ObjectPoolImpl::Find(const Object* search_template,
                           vector<const Object*>* matching_objects) {
-  boost::lock_guard<boost::mutex> lock(lock_);
-  for (ObjectSet::iterator it = objects_.begin(); it != objects_.end(); ++it) {
-    if (Matches(search_template, *it))
-      matching_objects->push_back(*it);
+  ScopedLatency latency(GetFindDurationHistogram());
+  const size_t initial_size = matching_objects->size();
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
+  const ObjectSet* candidates = GetCandidates(search_template);
+  if (!candidates)
+    candidates = &objects_;
+  for (ObjectSet::const_iterator it = candidates->begin();
+       it != candidates->end(); ++it) {
+    if (Matches(search_template, it->second))
+      matching_objects->push_back(it->second);
   }
+  GetFindResultsHistogram()->Record(matching_objects->size() - initial_size);
+  return true;
+}
+
+bool ObjectPoolImpl::FindFrom(const Object* search_template,
+                              int after_handle,
+                              size_t max_count,
+                              vector<const Object*>* matching_objects) {
+  ScopedLatency latency(GetFindDurationHistogram());
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
+  const ObjectSet* candidates = GetCandidates(search_template);
+  if (!candidates)
+    candidates = &objects_;
+  size_t count = 0;
+  for (ObjectSet::const_iterator it = candidates->upper_bound(after_handle);
+       it != candidates->end() && count < max_count; ++it) {
+    if (Matches(search_template, it->second)) {
+      matching_objects->push_back(it->second);
+      ++count;
+    }
+  }
+  GetFindResultsHistogram()->Record(count);
   return true;
 }
 
 bool ObjectPoolImpl::FindByHandle(int handle, const Object** object) {
-  boost::lock_guard<boost::mutex> lock(lock_);
   CHECK(object);
-  HandleObjectMap::iterator it = handle_object_map_.find(handle);
-  if (it == handle_object_map_.end())
+  std::shared_ptr<const Object> found;
+  if (!FindByHandle(handle, &found))
+    return false;
+  *object = found.get();
+  return true;
+}
+
+bool ObjectPoolImpl::FindByHandle(int handle,
+                                  std::shared_ptr<const Object>* object) {
+  CHECK(object);
+  // Repeated lookups are served from the thread's cache without touching the
+  // lock or the handle table.
+  CachedHandle* cached =
+      &GetHandleCache()[static_cast<unsigned>(handle) % kHandleCacheSize];
+  if (cached->pool_id == id_ && cached->handle == handle &&
+      cached->epoch == epoch_.load(std::memory_order_acquire)) {
+    *object = cached->object;
+    return true;
+  }
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
+  std::shared_ptr<const Object> found = handle_table_.FindShared(handle);
+  if (!found)
     return false;
-  *object = it->second.get();
+  // The epoch cannot change while the lock is held.
+  cached->pool_id = id_;
+  cached->epoch = epoch_.load(std::memory_order_relaxed);
+  cached->handle = handle;
+  cached->object = found;
+  object->swap(found);
   return true;
 }
 
@@ -152,9 +402,14 @@ Object* ObjectPoolImpl::GetModifiableObject(const Object* object) {
 }
 
 bool ObjectPoolImpl::Flush(const Object* object) {
-  boost::lock_guard<boost::mutex> lock(lock_);
-  if (objects_.find(object) == objects_.end())
+  boost::lock_guard<boost::shared_mutex> lock(lock_);
+  if (!Contains(object))
     return false;
+  InvalidateHandleCaches();
+  // The object was modified in place; index its new values.
+  RemoveFromIndexes(object);
+  AddToIndexes(object);
+  ReportMemoryUsage();
   if (store_.get()) {
     ObjectBlob serialized;
     if (!Serialize(object, &serialized))
@@ -178,14 +433,97 @@ bool ObjectPoolImpl::Matches(const Object* object_template,
   return true;
 }
 
+void ObjectPoolImpl::AddToIndexes(const Object* object) {
+  IndexedObject& indexed = indexed_values_[object];
+  indexed.size = object->GetSize();
+  object_bytes_ += indexed.size;
+  index_bytes_ += kNodeBytes + sizeof(indexed);
+  for (auto it = indexes_.begin(); it != indexes_.end(); ++it) {
+    if (!object->IsAttributePresent(it->first))
+      continue;
+    string value = object->GetAttributeString(it->first);
+    it->second[value][object->handle()] = object;
+    // The value is held by the posting list and by 'indexed'.
+    index_bytes_ += 2 * (kNodeBytes + value.size());
+    indexed.values.push_back(std::make_pair(it->first, value));
+  }
+}
+
+void ObjectPoolImpl::RemoveFromIndexes(const Object* object) {
+  auto indexed = indexed_values_.find(object);
+  if (indexed == indexed_values_.end())
+    return;
+  const IndexedObject& values = indexed->second;
+  object_bytes_ -= values.size;
+  index_bytes_ -= kNodeBytes + sizeof(values);
+  for (auto it = values.values.begin(); it != values.values.end(); ++it) {
+    index_bytes_ -= 2 * (kNodeBytes + it->second.size());
+    AttributeIndex& index = indexes_[it->first];
+    AttributeIndex::iterator posting = index.find(it->second);
+    if (posting == index.end())
+      continue;
+    posting->second.erase(object->handle());
+    if (posting->second.empty())
+      index.erase(posting);
+  }
+  indexed_values_.erase(indexed);
+}
+
+const ObjectSet* ObjectPoolImpl::GetCandidates(const Object* search_template) {
+  // Every match holds all template values, so the smallest posting list of an
+  // indexed template attribute bounds the result.
+  const ObjectSet* candidates = NULL;
+  for (auto it = indexes_.begin(); it != indexes_.end(); ++it) {
+    if (!search_template->IsAttributePresent(it->first))
+      continue;
+    AttributeIndex::const_iterator posting =
+        it->second.find(search_template->GetAttributeString(it->first));
+    if (posting == it->second.end())
+      return &kNoObjects;
+    if (!candidates || posting->second.size() < candidates->size())
+      candidates = &posting->second;
+  }
+  return candidates;
+}
+
+size_t ObjectPoolImpl::GetIndexBytes() const {
+  return index_bytes_ + objects_.size() * (kNodeBytes + sizeof(int)) +
+         handle_table_.GetMemoryUsage();
+}
+
+void ObjectPoolImpl::ReportMemoryUsage() {
+  const int64_t object_bytes = object_bytes_;
+  const int64_t index_bytes = GetIndexBytes();
+  object_bytes_gauge_->Add(object_bytes - reported_object_bytes_);
+  index_bytes_gauge_->Add(index_bytes - reported_index_bytes_);
+  reported_object_bytes_ = object_bytes;
+  reported_index_bytes_ = index_bytes;
+}
+
+void ObjectPoolImpl::InvalidateHandleCaches() {
+  epoch_.fetch_add(1, std::memory_order_release);
+}
+
+size_t ObjectPoolImpl::GetMemoryUsage() {
+  boost::shared_lock<boost::shared_mutex> lock(lock_);
+  return object_bytes_ + GetIndexBytes();
+}
+
+bool ObjectPoolImpl::Contains(const Object* object) const {
+  ObjectSet::const_iterator it = objects_.find(object->handle());
+  return it != objects_.end() && it->second == object;
+}
+
 bool ObjectPoolImpl::Parse(const ObjectBlob& object_blob, Object* object) {
-  AttributeList attribute_list;
-  if (!attribute_list.ParseFromString(object_blob.blob)) {
+  google::protobuf::Arena arena;
+  AttributeList* attribute_list =
+      google::protobuf::Arena::CreateMessage<AttributeList>(&arena);
+  if (!attribute_list->ParseFromString(object_blob.blob)) {
     LOG(ERROR) << "Failed to parse proto-buffer.";
     return false;
   }
-  for (int i = 0; i < attribute_list.attribute_size(); ++i) {
-    const Attribute& attribute = attribute_list.attribute(i);
+  for (int i = 0; i < attribute_list->attribute_size(); ++i) {
+    const Attribute& attribute = attribute_list->attribute(i);
     if (!attribute.has_value()) {
       LOG(WARNING) << "No value found for attribute: " << attribute.type();
       continue;
@@ -211,14 +549,17 @@ bool ObjectPoolImpl::Parse(const ObjectBlob& object_blob, Object* object) {
 bool ObjectPoolImpl::Serialize(const Object* object, ObjectBlob* serialized) {
   const AttributeMap* attribute_map = object->GetAttributeMap();
   AttributeMap::const_iterator it;
-  AttributeList attribute_list;
+  google::protobuf::Arena arena;
+  AttributeList* attribute_list =
+      google::protobuf::Arena::CreateMessage<AttributeList>(&arena);
+  attribute_list->mutable_attribute()->Reserve(attribute_map->size());
   for (it = attribute_map->begin(); it != attribute_map->end(); ++it) {
-    Attribute* next = attribute_list.add_attribute();
+    Attribute* next = attribute_list->add_attribute();
     next->set_type(it->first);
     next->set_length(it->second.length());
-    next->set_value(it->second);
+    next->set_value(it->second.str());
   }
-  if (!attribute_list.SerializeToString(&serialized->blob)) {
+  if (!attribute_list->SerializeToString(&serialized->blob)) {
     LOG(ERROR) << "Failed to serialize object.";
     return false;
   }
@@ -234,17 +575,20 @@ bool ObjectPoolImpl::LoadBlobs(const map<int, ObjectBlob>& object_blobs) {
     if (Parse(it->second, object.get())) {
       object->set_handle(handle_generator_->CreateHandle());
       object->set_store_id(it->first);
-      objects_.insert(object.get());
-      handle_object_map_[object->handle()] = object;
+      objects_[object->handle()] = object.get();
+      handle_table_.Insert(object->handle(), object);
+      AddToIndexes(object.get());
     } else {
       LOG(WARNING) << "Object not parsable: " << it->first;
     }
   }
+  ReportMemoryUsage();
   return true;
 }
 
 bool ObjectPoolImpl::LoadPublicObjects() {
   CHECK(store_.get());
+  ScopedStartupPhase startup_phase("LoadPublicObjects");
   map<int, ObjectBlob> object_blobs;
   if (!store_->LoadPublicObjectBlobs(&object_blobs))
     return false;
@@ -253,6 +597,7 @@ bool ObjectPoolImpl::LoadPublicObjects() {
 
 bool ObjectPoolImpl::LoadPrivateObjects() {
   CHECK(store_.get());
+  ScopedStartupPhase startup_phase("LoadPrivateObjects");
   map<int, ObjectBlob> object_blobs;
   if (!store_->LoadPrivateObjectBlobs(&object_blobs))
     return false;
@@ -7,26 +7,36 @@
 
 #include "object_pool.h"
 
+#include <stdint.h>
+
+#include <atomic>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <base/macros.h>
-#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
+#include "handle_table.h"
 #include "object_store.h"
 
 namespace p11net {
 
 class P11NetFactory;
+class Gauge;
 class HandleGenerator;
 
 // Key: Object handle.
-// Value: Object shared pointer.
-typedef std::map<int, std::shared_ptr<const Object>> HandleObjectMap;
-typedef std::set<const Object*> ObjectSet;
+// Value: The object with that handle.
+// Ordered by handle so that searches can resume where they left off.
+typedef std::map<int, const Object*> ObjectSet;
+// Key: An attribute value.
+// Value: The objects holding that value.
+typedef std::unordered_map<std::string, ObjectSet> AttributeIndex;
 
 class ObjectPoolImpl : public ObjectPool {
  public:
@@ -43,12 +53,22 @@ class ObjectPoolImpl : public ObjectPool {
   virtual bool SetInternalBlob(int blob_id, const std::string& blob);
   virtual bool SetEncryptionKey(const brillo::SecureBlob& key);
   virtual bool Insert(Object* object);
+  virtual bool InsertBatch(const std::vector<Object*>& objects);
   virtual bool Import(Object* object);
   virtual bool Delete(const Object* object);
+  virtual bool DeleteBatch(const std::vector<const Object*>& objects);
+  virtual bool ReplaceBatch(const std::vector<const Object*>& old_objects,
+                            const std::vector<Object*>& new_objects);
   virtual bool DeleteAll();
   virtual bool Find(const Object* search_template,
                     std::vector<const Object*>* matching_objects);
+  virtual bool FindFrom(const Object* search_template,
+                        int after_handle,
+                        size_t max_count,
+                        std::vector<const Object*>* matching_objects);
   virtual bool FindByHandle(int handle, const Object** object);
+  virtual bool FindByHandle(int handle, std::shared_ptr<const Object>* object);
+  virtual size_t GetMemoryUsage();
   virtual Object* GetModifiableObject(const Object* object);
   virtual bool Flush(const Object* object);
 
@@ -57,19 +77,70 @@ class ObjectPoolImpl : public ObjectPool {
   // attributes and those values match the template values. This function
   // returns true if the given object matches the given template.
   bool Matches(const Object* object_template, const Object* object);
+  // Returns true if 'object' is in the pool.
+  bool Contains(const Object* object) const;
   bool Parse(const ObjectBlob& object_blob, Object* object);
   bool Serialize(const Object* object, ObjectBlob* serialized);
   bool LoadBlobs(const std::map<int, ObjectBlob>& object_blobs);
   bool LoadPublicObjects();
   bool LoadPrivateObjects();
+  // Adds the indexed attributes of 'object' to the attribute indexes.
+  void AddToIndexes(const Object* object);
+  // Removes 'object' from the attribute indexes, using the values recorded by
+  // AddToIndexes. The object may have been modified in the meantime.
+  void RemoveFromIndexes(const Object* object);
+  // Returns the objects that may match 'search_template' according to the
+  // attribute indexes, or NULL if the template has no indexed attribute.
+  const ObjectSet* GetCandidates(const Object* search_template);
+  // Returns the estimated bytes held by the indexes, including objects_ and
+  // handle_table_.
+  size_t GetIndexBytes() const;
+  // Brings the pool's share of the memory gauges up to date. Must be called
+  // with 'lock_' held exclusively after every change to the pool.
+  void ReportMemoryUsage();
+  // Invalidates the handles cached by FindByHandle. Must be called with
+  // 'lock_' held exclusively before objects are deleted or rewritten.
+  void InvalidateHandleCaches();
+
+  // The attribute values under which an object is indexed, and its size at
+  // the time.
+  struct IndexedObject {
+    int size;
+    std::vector<std::pair<CK_ATTRIBUTE_TYPE, std::string>> values;
+  };
 
-  // Allows us to quickly check whether an object exists in the pool.
+  // Allows us to quickly check whether an object exists in the pool, and to
+  // walk the pool in handle order.
   ObjectSet objects_;
-  HandleObjectMap handle_object_map_;
+  HandleTable handle_table_;
+  // Key: An attribute type that is commonly used in search templates.
+  // Value: The index of objects by their value for that attribute.
+  std::map<CK_ATTRIBUTE_TYPE, AttributeIndex> indexes_;
+  // Key: An object in the pool.
+  // Value: The attribute values under which it is indexed.
+  std::map<const Object*, IndexedObject> indexed_values_;
+  // The sum of the sizes of the indexed objects, and the estimated bytes of
+  // their index entries.
+  size_t object_bytes_;
+  size_t index_bytes_;
+  // The process-wide gauges of pools of this kind, and what this pool has
+  // added to them.
+  Gauge* object_bytes_gauge_;
+  Gauge* index_bytes_gauge_;
+  int64_t reported_object_bytes_;
+  int64_t reported_index_bytes_;
   std::shared_ptr<P11NetFactory> factory_;
   std::shared_ptr<HandleGenerator> handle_generator_;
   std::unique_ptr<ObjectStore> store_;
-  boost::mutex lock_;
+  // Held shared by Find, FindByHandle and GetInternalBlob, which run on every
+  // PKCS #11 call, and exclusively by everything that modifies the pool.
+  boost::shared_mutex lock_;
+  // Identifies the pool in the per-thread handle caches of FindByHandle; never
+  // reused, unlike the pool's address.
+  const uint64_t id_;
+  // Bumped by InvalidateHandleCaches. A cached handle is only used while the
+  // epoch it was cached at is current.
+  std::atomic<uint64_t> epoch_;
 
   DISALLOW_COPY_AND_ASSIGN(ObjectPoolImpl);
 };
@@ -7,6 +7,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 
@@ -20,6 +21,18 @@ struct ObjectBlob {
   bool is_private;
 };
 
+// A group of object blob mutations that ObjectStore::CommitChanges stores
+// together.
+struct ObjectBlobChanges {
+  // New blobs; their identifiers are assigned on commit.
+  std::vector<ObjectBlob> insertions;
+  // Key: The identifier of an existing blob.
+  // Value: The blob that replaces it.
+  std::map<int, ObjectBlob> updates;
+  // The identifiers of blobs to delete.
+  std::vector<int> deletions;
+};
+
 // An object store provides persistent storage of object blobs and internal
 // blobs. All stored blobs are encrypted. Object properties (e.g. object class)
 // are not necessarily encrypted.
@@ -46,6 +59,15 @@ class ObjectStore {
   // Inserts a new blob.
   virtual bool InsertObjectBlob(const ObjectBlob& blob,
                                 int* blob_id) = 0;
+  // Inserts several blobs in a single write; either all of them are stored or
+  // none is. On success, 'blob_ids' receives the new identifiers in order.
+  virtual bool InsertObjectBlobs(const std::vector<ObjectBlob>& blobs,
+                                 std::vector<int>* blob_ids) = 0;
+  // Applies all of the given changes in a single write; either all of them
+  // are stored or none is. On success, 'inserted_ids' receives the
+  // identifiers of the inserted blobs in order.
+  virtual bool CommitChanges(const ObjectBlobChanges& changes,
+                             std::vector<int>* inserted_ids) = 0;
   // Deletes an existing object blob.
   virtual bool DeleteObjectBlob(int blob_id) = 0;
   // Deletes all object blobs.
@@ -9,6 +9,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 namespace p11net {
 
@@ -36,6 +37,26 @@ class ObjectStoreFake : public ObjectStore {
     object_blobs_[*handle] = blob;
     return true;
   }
+  virtual bool InsertObjectBlobs(const std::vector<ObjectBlob>& blobs,
+                                 std::vector<int>* handles) {
+    for (size_t i = 0; i < blobs.size(); ++i) {
+      handles->push_back(++last_handle_);
+      object_blobs_[last_handle_] = blobs[i];
+    }
+    return true;
+  }
+  virtual bool CommitChanges(const ObjectBlobChanges& changes,
+                             std::vector<int>* inserted_ids) {
+    for (size_t i = 0; i < changes.insertions.size(); ++i) {
+      inserted_ids->push_back(++last_handle_);
+      object_blobs_[last_handle_] = changes.insertions[i];
+    }
+    for (auto it = changes.updates.begin(); it != changes.updates.end(); ++it)
+      object_blobs_[it->first] = it->second;
+    for (size_t i = 0; i < changes.deletions.size(); ++i)
+      object_blobs_.erase(changes.deletions[i]);
+    return true;
+  }
   virtual bool DeleteObjectBlob(int handle) {
     object_blobs_.erase(handle);
     return true;
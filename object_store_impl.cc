@@ -4,6 +4,7 @@
 
 #include "object_store_impl.h"
 
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <string>
@@ -12,8 +13,11 @@
 #include <base/logging.h>
 #include <boost/filesystem/operations.hpp>
 #include <brillo/secure_blob.h>
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
 #include <leveldb/env.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 #ifndef NO_MEMENV
 #include <leveldb/helpers/memenv.h>
 #endif
@@ -21,6 +25,7 @@
 #include <metrics/metrics_library.h>
 #endif
 
+#include "metrics.h"
 #include "p11net_utility.h"
 #include "pkcs11/cryptoki.h"
 
@@ -59,12 +64,32 @@ class MetricsWrapper {
 
 namespace p11net {
 
+namespace Env {
+  // The size of the database block cache, in bytes. Zero keeps the leveldb
+  // default.
+  const char* kDatabaseBlockCacheSize = "P11NET_DB_BLOCK_CACHE_SIZE";
+  // Bits per key of the database bloom filter. Zero disables the filter.
+  const char* kDatabaseBloomBits = "P11NET_DB_BLOOM_BITS";
+  // The size of the database write buffer, in bytes. Zero keeps the leveldb
+  // default.
+  const char* kDatabaseWriteBufferSize = "P11NET_DB_WRITE_BUFFER_SIZE";
+  // Whether database blocks are compressed with snappy (1, the default) or
+  // stored uncompressed (0).
+  const char* kDatabaseCompression = "P11NET_DB_COMPRESSION";
+  // Set to 1 to keep the database in memory only, e.g. in ephemeral
+  // containers. Requires a build with leveldb's memenv.
+  const char* kDatabaseInMemory = "P11NET_DB_IN_MEMORY";
+}
+
+const int kDefaultDatabaseBloomBits = 10;
+
 const char ObjectStoreImpl::kInternalBlobKeyPrefix[] = "InternalBlob";
 const char ObjectStoreImpl::kPublicBlobKeyPrefix[] = "PublicBlob";
 const char ObjectStoreImpl::kPrivateBlobKeyPrefix[] = "PrivateBlob";
 const char ObjectStoreImpl::kBlobKeySeparator[] = "&";
 const char ObjectStoreImpl::kDatabaseVersionKey[] = "DBVersion";
 const char ObjectStoreImpl::kIDTrackerKey[] = "NextBlobID";
+const int ObjectStoreImpl::kIDReservationSize = 1024;
 const int ObjectStoreImpl::kAESKeySizeBytes = 32;
 const int ObjectStoreImpl::kHMACSizeBytes = 64;
 const char ObjectStoreImpl::kDatabaseDirectory[] = "database";
@@ -74,20 +99,41 @@ const char ObjectStoreImpl::kObfuscationKey[] = {
     '\x8b', '\x05', '\x1c', '\xd2', '\x8b', '\xac', '\x2d', '\xba', '\x5e',
     '\x14', '\x9c', '\xae', '\x57', '\xfb', '\x04', '\x13', '\x92', '\xc0',
     '\x84', '\x2a', '\xea', '\xf6', '\xfb'};
-const int ObjectStoreImpl::kBlobVersion = 1;
+const int ObjectStoreImpl::kBlobVersion = 2;
+const int ObjectStoreImpl::kLegacyBlobVersion = 1;
 
-ObjectStoreImpl::ObjectStoreImpl() {}
+ObjectStoreImpl::ObjectStoreImpl() : next_id_(0), id_reservation_end_(0) {}
 
 ObjectStoreImpl::~ObjectStoreImpl() {}
 
 bool ObjectStoreImpl::Init(const boost::filesystem::path& database_path) {
   MetricsWrapper metrics;
+  ScopedStartupPhase startup_phase("ObjectStoreImpl::Init");
 
   LOG(INFO) << "Opening database in: " << database_path;
   leveldb::Options options;
   options.create_if_missing = true;
   options.paranoid_checks = true;
-  if (database_path == ":memory:") {
+  const int block_cache_size = GetEnvInt(Env::kDatabaseBlockCacheSize, 0);
+  if (block_cache_size > 0) {
+    block_cache_.reset(leveldb::NewLRUCache(block_cache_size));
+    options.block_cache = block_cache_.get();
+  }
+  // Blob lookups are point reads, which the filter answers without touching
+  // tables that do not hold the key.
+  const int bloom_bits =
+      GetEnvInt(Env::kDatabaseBloomBits, kDefaultDatabaseBloomBits);
+  if (bloom_bits > 0) {
+    filter_policy_.reset(leveldb::NewBloomFilterPolicy(bloom_bits));
+    options.filter_policy = filter_policy_.get();
+  }
+  const int write_buffer_size = GetEnvInt(Env::kDatabaseWriteBufferSize, 0);
+  if (write_buffer_size > 0)
+    options.write_buffer_size = write_buffer_size;
+  if (GetEnvInt(Env::kDatabaseCompression, 1) == 0)
+    options.compression = leveldb::kNoCompression;
+  if (database_path == ":memory:" ||
+      GetEnvInt(Env::kDatabaseInMemory, 0) == 1) {
 #ifndef NO_MEMENV
     // Memory only environment, useful for testing.
     LOG(INFO) << "Using memory-only environment.";
@@ -104,6 +150,12 @@ bool ObjectStoreImpl::Init(const boost::filesystem::path& database_path) {
   leveldb::Status status = leveldb::DB::Open(options,
                                              database_name.string(),
                                              &db);
+  if (status.IsIOError()) {
+    // Most likely the database is locked by another process. It is not
+    // corrupted, so leave it alone rather than repairing or recreating it.
+    LOG(ERROR) << "Failed to open database: " << status.ToString();
+    return false;
+  }
   if (!status.ok()) {
     LOG(ERROR) << "Failed to open database: " << status.ToString();
     metrics.SendUMAEvent("P11Net.DatabaseCorrupted");
@@ -146,6 +198,11 @@ bool ObjectStoreImpl::Init(const boost::filesystem::path& database_path) {
       return false;
     }
   }
+  if (!ReadInt(kIDTrackerKey, &next_id_)) {
+    LOG(ERROR) << "Failed to read ID tracker.";
+    return false;
+  }
+  id_reservation_end_ = next_id_;
   return true;
 }
 
@@ -177,72 +234,124 @@ bool ObjectStoreImpl::SetEncryptionKey(const SecureBlob& key) {
 
 bool ObjectStoreImpl::InsertObjectBlob(const ObjectBlob& blob,
                                        int* handle) {
-  if (blob.is_private && key_.empty()) {
-    LOG(ERROR) << "The store encryption key has not been initialized.";
+  vector<int> handles;
+  if (!InsertObjectBlobs(vector<ObjectBlob>(1, blob), &handles))
     return false;
+  *handle = handles[0];
+  return true;
+}
+
+bool ObjectStoreImpl::InsertObjectBlobs(const vector<ObjectBlob>& blobs,
+                                        vector<int>* handles) {
+  ObjectBlobChanges changes;
+  changes.insertions = blobs;
+  return CommitChanges(changes, handles);
+}
+
+bool ObjectStoreImpl::CommitChanges(const ObjectBlobChanges& changes,
+                                    vector<int>* inserted_ids) {
+  // IDs come from the current reservation. When it runs out, the next one is
+  // committed together with the blobs.
+  leveldb::WriteBatch batch;
+  const int first_id = next_id_;
+  int reservation_end = id_reservation_end_;
+  if (!changes.insertions.empty()) {
+    if (changes.insertions.size() > static_cast<size_t>(
+            std::numeric_limits<int>::max() - first_id)) {
+      LOG(ERROR) << "Object ID overflow.";
+      return false;
+    }
+    const int num_ids = static_cast<int>(changes.insertions.size());
+    if (num_ids > id_reservation_end_ - first_id) {
+      reservation_end =
+          first_id + std::min(std::max(num_ids, kIDReservationSize),
+                              std::numeric_limits<int>::max() - first_id);
+      batch.Put(kIDTrackerKey, std::to_string(reservation_end));
+    }
+    for (size_t i = 0; i < changes.insertions.size(); ++i) {
+      const ObjectBlob& blob = changes.insertions[i];
+      if (blob.is_private && key_.empty()) {
+        LOG(ERROR) << "The store encryption key has not been initialized.";
+        return false;
+      }
+      ObjectBlob encrypted_blob;
+      if (!Encrypt(blob, &encrypted_blob)) {
+        LOG(ERROR) << "Failed to encrypt object blob.";
+        return false;
+      }
+      BlobType type = blob.is_private ? kPrivate : kPublic;
+      batch.Put(CreateBlobKey(type, first_id + static_cast<int>(i)),
+                encrypted_blob.blob);
+    }
+  }
+  for (auto it = changes.updates.begin(); it != changes.updates.end(); ++it) {
+    BlobType type = GetBlobType(it->first);
+    if (it->second.is_private != (type == kPrivate)) {
+      LOG(ERROR) << "Object privacy mismatch.";
+      return false;
+    }
+    ObjectBlob encrypted_blob;
+    if (!Encrypt(it->second, &encrypted_blob)) {
+      LOG(ERROR) << "Failed to encrypt object blob.";
+      return false;
+    }
+    batch.Put(CreateBlobKey(type, it->first), encrypted_blob.blob);
+  }
+  for (size_t i = 0; i < changes.deletions.size(); ++i) {
+    const int handle = changes.deletions[i];
+    batch.Delete(CreateBlobKey(GetBlobType(handle), handle));
   }
-  if (!GetNextID(handle)) {
-    LOG(ERROR) << "Failed to generate blob identifier.";
+  if (!CommitBatch(&batch)) {
+    LOG(ERROR) << "Failed to write object blobs.";
     return false;
   }
-  blob_type_map_[*handle] = blob.is_private ? kPrivate : kPublic;
-  return UpdateObjectBlob(*handle, blob);
+  next_id_ = first_id + static_cast<int>(changes.insertions.size());
+  id_reservation_end_ = reservation_end;
+  for (size_t i = 0; i < changes.deletions.size(); ++i)
+    blob_type_map_.erase(changes.deletions[i]);
+  for (size_t i = 0; i < changes.insertions.size(); ++i) {
+    int handle = first_id + static_cast<int>(i);
+    blob_type_map_[handle] =
+        changes.insertions[i].is_private ? kPrivate : kPublic;
+    inserted_ids->push_back(handle);
+  }
+  return true;
 }
 
 bool ObjectStoreImpl::DeleteObjectBlob(int handle) {
-  leveldb::WriteOptions options;
-  options.sync = true;
-  string db_key = CreateBlobKey(GetBlobType(handle), handle);
-  leveldb::Status status = db_->Delete(options, db_key);
-  if (!status.ok()) {
-    LOG(ERROR) << "Failed to delete blob: " << status.ToString();
-    return false;
-  }
-  return true;
+  ObjectBlobChanges changes;
+  changes.deletions.push_back(handle);
+  return CommitChanges(changes, NULL);
 }
 
 bool ObjectStoreImpl::DeleteAllObjectBlobs() {
-  vector<string> blobs_to_delete;
+  leveldb::WriteBatch batch;
   std::unique_ptr<leveldb::Iterator>
       it(db_->NewIterator(leveldb::ReadOptions()));
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     BlobType type;
     int id = 0;
     if (ParseBlobKey(it->key().ToString(), &type, &id) && type != kInternal)
-      blobs_to_delete.push_back(it->key().ToString());
-  }
-  bool deleted_all = true;
-  for (size_t i = 0; i < blobs_to_delete.size(); ++i) {
-    leveldb::WriteOptions options;
-    options.sync = true;
-    leveldb::Status status = db_->Delete(options, blobs_to_delete[i]);
-    if (!status.ok()) {
-      LOG(ERROR) << "Failed to delete blob: " << status.ToString();
-      deleted_all = false;
-    }
+      batch.Delete(it->key());
   }
-  return deleted_all;
-}
-
-bool ObjectStoreImpl::UpdateObjectBlob(int handle, const ObjectBlob& blob) {
-  ObjectBlob encrypted_blob;
-  BlobType type = GetBlobType(handle);
-  if (blob.is_private != (type == kPrivate)) {
-    LOG(ERROR) << "Object privacy mismatch.";
+  if (!CommitBatch(&batch)) {
+    LOG(ERROR) << "Failed to delete blobs.";
     return false;
   }
-  if (!Encrypt(blob, &encrypted_blob)) {
-    LOG(ERROR) << "Failed to encrypt object blob.";
-    return false;
-  }
-  if (!WriteBlob(CreateBlobKey(type, handle), encrypted_blob.blob)) {
-    LOG(ERROR) << "Failed to write object blob.";
-  }
+  blob_type_map_.clear();
   return true;
 }
 
+bool ObjectStoreImpl::UpdateObjectBlob(int handle, const ObjectBlob& blob) {
+  ObjectBlobChanges changes;
+  changes.updates[handle] = blob;
+  return CommitChanges(changes, NULL);
+}
+
 bool ObjectStoreImpl::LoadPublicObjectBlobs(map<int, ObjectBlob>* blobs) {
-  return LoadObjectBlobs(kPublic, blobs);
+  map<int, ObjectBlob> sealed;
+  ReadObjectBlobs(kPublic, &sealed);
+  return DecryptObjectBlobs(sealed, blobs);
 }
 
 bool ObjectStoreImpl::LoadPrivateObjectBlobs(map<int, ObjectBlob>* blobs) {
@@ -250,30 +359,58 @@ bool ObjectStoreImpl::LoadPrivateObjectBlobs(map<int, ObjectBlob>* blobs) {
     LOG(ERROR) << "The store encryption key has not been initialized.";
     return false;
   }
-  return LoadObjectBlobs(kPrivate, blobs);
+  map<int, ObjectBlob> sealed;
+  ReadObjectBlobs(kPrivate, &sealed);
+  return DecryptObjectBlobs(sealed, blobs);
+}
+
+bool ObjectStoreImpl::DecryptObjectBlobs(const map<int, ObjectBlob>& sealed,
+                                         map<int, ObjectBlob>* blobs) {
+  // Blobs in the legacy format are upgraded with a single write once they have
+  // all been decrypted.
+  leveldb::WriteBatch upgrades;
+  int num_upgrades = 0;
+  for (auto it = sealed.begin(); it != sealed.end(); ++it) {
+    ObjectBlob blob;
+    bool is_legacy = false;
+    if (!Decrypt(it->second, &blob, &is_legacy)) {
+      LOG(WARNING) << "Failed to decrypt object blob.";
+      continue;
+    }
+    ObjectBlob upgraded_blob;
+    if (is_legacy && Encrypt(blob, &upgraded_blob)) {
+      upgrades.Put(CreateBlobKey(GetBlobType(it->first), it->first),
+                   upgraded_blob.blob);
+      ++num_upgrades;
+    }
+    (*blobs)[it->first] = blob;
+  }
+  if (num_upgrades > 0) {
+    if (CommitBatch(&upgrades))
+      LOG(INFO) << "Upgraded " << num_upgrades << " object blobs.";
+    else
+      LOG(WARNING) << "Failed to upgrade object blobs.";
+  }
+  return true;
 }
 
-bool ObjectStoreImpl::LoadObjectBlobs(BlobType type,
+void ObjectStoreImpl::ReadObjectBlobs(BlobType type,
                                       map<int, ObjectBlob>* blobs) {
+  static Histogram* const scan_duration = Metrics::Get()->GetHistogram(
+      "p11net_store_duration_us", "operation=\"scan\"");
+  ScopedLatency latency(scan_duration);
   std::unique_ptr<leveldb::Iterator>
       it(db_->NewIterator(leveldb::ReadOptions()));
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     BlobType it_type;
     int id = 0;
     if (ParseBlobKey(it->key().ToString(), &it_type, &id) && type == it_type) {
-      ObjectBlob encrypted_blob;
+      ObjectBlob& encrypted_blob = (*blobs)[id];
       encrypted_blob.is_private = (type == kPrivate);
       encrypted_blob.blob = it->value().ToString();
-      ObjectBlob blob;
-      if (!Decrypt(encrypted_blob, &blob)) {
-        LOG(WARNING) << "Failed to decrypt object blob.";
-        continue;
-      }
-      (*blobs)[id] = blob;
       blob_type_map_[id] = type;
     }
   }
-  return true;
 }
 
 bool ObjectStoreImpl::Encrypt(const ObjectBlob& plain_text,
@@ -286,17 +423,19 @@ bool ObjectStoreImpl::Encrypt(const ObjectBlob& plain_text,
   SecureBlob obfuscation_key(std::begin(kObfuscationKey),
                              std::end(kObfuscationKey));
   SecureBlob& key = plain_text.is_private ? key_ : obfuscation_key;
-  string cipher_text_no_hmac;
-  if (!RunCipher(true, key, string(), plain_text.blob, &cipher_text_no_hmac))
-    return false;
-  // Prepend a version header and include it in the MAC.
+  // Prepend a version header and authenticate it along with the blob.
   string version_header(1, static_cast<char>(kBlobVersion));
-  cipher_text->blob = AppendHMAC(version_header + cipher_text_no_hmac, key);
+  string sealed;
+  if (!RunAuthenticatedCipher(true, key, version_header, plain_text.blob,
+                              &sealed))
+    return false;
+  cipher_text->blob = version_header + sealed;
   return true;
 }
 
 bool ObjectStoreImpl::Decrypt(const ObjectBlob& cipher_text,
-                              ObjectBlob* plain_text) {
+                              ObjectBlob* plain_text,
+                              bool* is_legacy) {
   if (cipher_text.is_private && key_.empty()) {
     LOG(ERROR) << "The store encryption key has not been initialized.";
     return false;
@@ -305,6 +444,20 @@ bool ObjectStoreImpl::Decrypt(const ObjectBlob& cipher_text,
   SecureBlob obfuscation_key(std::begin(kObfuscationKey),
                              std::end(kObfuscationKey));
   SecureBlob& key = cipher_text.is_private ? key_ : obfuscation_key;
+  if (cipher_text.blob.empty()) {
+    LOG(ERROR) << "Failed to verify blob integrity.";
+    return false;
+  }
+  int blob_version = static_cast<int>(cipher_text.blob[0]);
+  if (is_legacy)
+    *is_legacy = (blob_version == kLegacyBlobVersion);
+  if (blob_version == kBlobVersion) {
+    return RunAuthenticatedCipher(false,
+                                  key,
+                                  cipher_text.blob.substr(0, 1),
+                                  cipher_text.blob.substr(1),
+                                  &plain_text->blob);
+  }
   string cipher_text_no_hmac;
   if (!VerifyAndStripHMAC(cipher_text.blob,
                           key,
@@ -312,7 +465,7 @@ bool ObjectStoreImpl::Decrypt(const ObjectBlob& cipher_text,
     return false;
   // Check and strip the version header.
   int version = static_cast<int>(cipher_text_no_hmac[0]);
-  if (version != kBlobVersion) {
+  if (version != kLegacyBlobVersion) {
     LOG(ERROR) << "Blob found with unknown version.";
     return false;
   }
@@ -392,23 +545,10 @@ bool ObjectStoreImpl::ParseBlobKey(const string& key,
   return true;
 }
 
-bool ObjectStoreImpl::GetNextID(int* next_id) {
-  if (!ReadInt(kIDTrackerKey, next_id)) {
-    LOG(ERROR) << "Failed to read ID tracker.";
-    return false;
-  }
-  if (*next_id == std::numeric_limits<int>::max()) {
-    LOG(ERROR) << "Object ID overflow.";
-    return false;
-  }
-  if (!WriteInt(kIDTrackerKey, *next_id + 1)) {
-    LOG(ERROR) << "Failed to write ID tracker.";
-    return false;
-  }
-  return true;
-}
-
 bool ObjectStoreImpl::ReadBlob(const string& key, string* value) {
+  static Histogram* const read_duration = Metrics::Get()->GetHistogram(
+      "p11net_store_duration_us", "operation=\"read\"");
+  ScopedLatency latency(read_duration);
   leveldb::Status status = db_->Get(leveldb::ReadOptions(), key, value);
   if (!status.ok()) {
     if (!status.IsNotFound())
@@ -427,6 +567,9 @@ bool ObjectStoreImpl::ReadInt(const string& key, int* value) {
 }
 
 bool ObjectStoreImpl::WriteBlob(const string& key, const string& value) {
+  static Histogram* const write_duration = Metrics::Get()->GetHistogram(
+      "p11net_store_duration_us", "operation=\"write\"");
+  ScopedLatency latency(write_duration);
   leveldb::WriteOptions options;
   options.sync = true;
   leveldb::Status status = db_->Put(options, key, value);
@@ -441,6 +584,20 @@ bool ObjectStoreImpl::WriteInt(const string& key, int value) {
   return WriteBlob(key, std::to_string(value));
 }
 
+bool ObjectStoreImpl::CommitBatch(leveldb::WriteBatch* batch) {
+  static Histogram* const commit_duration = Metrics::Get()->GetHistogram(
+      "p11net_store_duration_us", "operation=\"commit\"");
+  ScopedLatency latency(commit_duration);
+  leveldb::WriteOptions options;
+  options.sync = true;
+  leveldb::Status status = db_->Write(options, batch);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to write to database: " << status.ToString();
+    return false;
+  }
+  return true;
+}
+
 ObjectStoreImpl::BlobType ObjectStoreImpl::GetBlobType(int blob_id) {
   map<int, BlobType>::iterator it = blob_type_map_.find(blob_id);
   if (it == blob_type_map_.end())
@@ -14,8 +14,11 @@
 #include <boost/filesystem/path.hpp>
 #include <base/macros.h>
 #include <brillo/secure_blob.h>
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
 #include <leveldb/env.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 
 namespace p11net {
 
@@ -35,6 +38,10 @@ class ObjectStoreImpl : public ObjectStore {
   virtual bool SetInternalBlob(int blob_id, const std::string& blob);
   virtual bool SetEncryptionKey(const brillo::SecureBlob& key);
   virtual bool InsertObjectBlob(const ObjectBlob& blob, int* handle);
+  virtual bool InsertObjectBlobs(const std::vector<ObjectBlob>& blobs,
+                                 std::vector<int>* handles);
+  virtual bool CommitChanges(const ObjectBlobChanges& changes,
+                             std::vector<int>* inserted_ids);
   virtual bool DeleteObjectBlob(int handle);
   virtual bool DeleteAllObjectBlobs();
   virtual bool UpdateObjectBlob(int handle, const ObjectBlob& blob);
@@ -48,16 +55,23 @@ class ObjectStoreImpl : public ObjectStore {
     kPublic
   };
 
-  // Loads all object of a given type.
-  bool LoadObjectBlobs(BlobType type, std::map<int, ObjectBlob>* blobs);
+  // Reads all objects of a given type without decrypting them.
+  void ReadObjectBlobs(BlobType type, std::map<int, ObjectBlob>* blobs);
 
-  // Encrypts an object blob with a random IV and appends an HMAC.
+  // Verifies and decrypts blobs returned by ReadObjectBlobs. Blobs that fail
+  // to decrypt are left out of 'blobs'.
+  bool DecryptObjectBlobs(const std::map<int, ObjectBlob>& sealed,
+                          std::map<int, ObjectBlob>* blobs);
+
+  // Encrypts an object blob with AES-GCM in the current blob format.
   bool Encrypt(const ObjectBlob& plain_text,
                ObjectBlob* cipher_text);
 
-  // Verifies and decrypts an object blob.
+  // Verifies and decrypts an object blob in the current or the legacy format.
+  // If 'is_legacy' is not NULL, it is set when the blob should be rewritten.
   bool Decrypt(const ObjectBlob& cipher_text,
-               ObjectBlob* plain_text);
+               ObjectBlob* plain_text,
+               bool* is_legacy);
 
   // Computes an HMAC and appends it to the given input.
   std::string AppendHMAC(const std::string& input,
@@ -76,9 +90,6 @@ class ObjectStoreImpl : public ObjectStore {
   // success.
   bool ParseBlobKey(const std::string& key, BlobType* type, int* blob_id);
 
-  // Computes and returns the next (unused) blob id;
-  bool GetNextID(int* next_id);
-
   // Reads a blob from the database. Returns true on success.
   bool ReadBlob(const std::string& key, std::string* value);
 
@@ -91,6 +102,9 @@ class ObjectStoreImpl : public ObjectStore {
   // Writes an integer to the database. Returns true on success.
   bool WriteInt(const std::string& key, int value);
 
+  // Commits 'batch' with a single synced write. Returns true on success.
+  bool CommitBatch(leveldb::WriteBatch* batch);
+
   // Returns the blob type for the specified blob. If 'blob_id' is unknown,
   // kInternal is returned.
   BlobType GetBlobType(int blob_id);
@@ -105,8 +119,11 @@ class ObjectStoreImpl : public ObjectStore {
   // database is not new.
   static const char kDatabaseVersionKey[];
   // The database key for the ID tracker, which always holds a value larger than
-  // any object blob ID in use.
+  // any object blob ID in use. It records the end of the current reservation
+  // rather than the next ID handed out.
   static const char kIDTrackerKey[];
+  // The number of blob IDs reserved with a single write of the ID tracker.
+  static const int kIDReservationSize;
   static const int kAESKeySizeBytes;
   static const int kHMACSizeBytes;
   // The leveldb directory.
@@ -115,13 +132,24 @@ class ObjectStoreImpl : public ObjectStore {
   static const char kCorruptDatabaseDirectory[];
   // An obfuscation key used for public objects.
   static const char kObfuscationKey[];
-  // The current blob format version.
+  // The current blob format version: AES-256-GCM, authenticating the version.
   static const int kBlobVersion;
+  // The previous blob format version: AES-256-CBC followed by an HMAC-SHA512
+  // over the version and the cipher-text. Such blobs are still read and are
+  // rewritten in the current format when loaded.
+  static const int kLegacyBlobVersion;
 
   brillo::SecureBlob key_;
+  // The environment, block cache and filter policy must outlive 'db_'.
   std::unique_ptr<leveldb::Env> env_;
+  std::unique_ptr<leveldb::Cache> block_cache_;
+  std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
   std::unique_ptr<leveldb::DB> db_;
   std::map<int, BlobType> blob_type_map_;
+  // IDs in [next_id_, id_reservation_end_) are reserved and unused. A restart
+  // skips what is left of the reservation.
+  int next_id_;
+  int id_reservation_end_;
 
 //  friend class TestObjectStoreEncryption;
 //  FRIEND_TEST(TestObjectStoreEncryption, EncryptionInit);
@@ -0,0 +1,134 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "object_store_memory.h"
+
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+
+using brillo::SecureBlob;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace p11net {
+
+ObjectStoreMemory::ObjectStoreMemory() : has_key_(false), next_id_(1) {}
+
+ObjectStoreMemory::~ObjectStoreMemory() {}
+
+bool ObjectStoreMemory::GetInternalBlob(int blob_id, string* blob) {
+  map<int, string>::const_iterator it = internal_blobs_.find(blob_id);
+  if (it == internal_blobs_.end())
+    return false;
+  *blob = it->second;
+  return true;
+}
+
+bool ObjectStoreMemory::SetInternalBlob(int blob_id, const string& blob) {
+  internal_blobs_[blob_id] = blob;
+  return true;
+}
+
+bool ObjectStoreMemory::SetEncryptionKey(const SecureBlob& key) {
+  if (key.empty()) {
+    LOG(ERROR) << "Unexpected empty encryption key.";
+    return false;
+  }
+  has_key_ = true;
+  return true;
+}
+
+bool ObjectStoreMemory::InsertObjectBlob(const ObjectBlob& blob, int* handle) {
+  vector<int> handles;
+  if (!InsertObjectBlobs(vector<ObjectBlob>(1, blob), &handles))
+    return false;
+  *handle = handles[0];
+  return true;
+}
+
+bool ObjectStoreMemory::InsertObjectBlobs(const vector<ObjectBlob>& blobs,
+                                          vector<int>* handles) {
+  ObjectBlobChanges changes;
+  changes.insertions = blobs;
+  return CommitChanges(changes, handles);
+}
+
+bool ObjectStoreMemory::CommitChanges(const ObjectBlobChanges& changes,
+                                      vector<int>* inserted_ids) {
+  // Validate everything first so that the changes apply all or nothing.
+  if (changes.insertions.size() > static_cast<size_t>(
+          std::numeric_limits<int>::max() - next_id_)) {
+    LOG(ERROR) << "Object ID overflow.";
+    return false;
+  }
+  for (size_t i = 0; i < changes.insertions.size(); ++i) {
+    if (changes.insertions[i].is_private && !has_key_) {
+      LOG(ERROR) << "The store encryption key has not been initialized.";
+      return false;
+    }
+  }
+  for (auto it = changes.updates.begin(); it != changes.updates.end(); ++it) {
+    map<int, ObjectBlob>::const_iterator existing =
+        object_blobs_.find(it->first);
+    if (existing != object_blobs_.end() &&
+        existing->second.is_private != it->second.is_private) {
+      LOG(ERROR) << "Object privacy mismatch.";
+      return false;
+    }
+  }
+  for (size_t i = 0; i < changes.insertions.size(); ++i) {
+    object_blobs_[next_id_] = changes.insertions[i];
+    inserted_ids->push_back(next_id_++);
+  }
+  for (auto it = changes.updates.begin(); it != changes.updates.end(); ++it)
+    object_blobs_[it->first] = it->second;
+  for (size_t i = 0; i < changes.deletions.size(); ++i)
+    object_blobs_.erase(changes.deletions[i]);
+  return true;
+}
+
+bool ObjectStoreMemory::DeleteObjectBlob(int handle) {
+  object_blobs_.erase(handle);
+  return true;
+}
+
+bool ObjectStoreMemory::DeleteAllObjectBlobs() {
+  object_blobs_.clear();
+  return true;
+}
+
+bool ObjectStoreMemory::UpdateObjectBlob(int handle, const ObjectBlob& blob) {
+  ObjectBlobChanges changes;
+  changes.updates[handle] = blob;
+  return CommitChanges(changes, NULL);
+}
+
+bool ObjectStoreMemory::LoadPublicObjectBlobs(map<int, ObjectBlob>* blobs) {
+  LoadObjectBlobs(false, blobs);
+  return true;
+}
+
+bool ObjectStoreMemory::LoadPrivateObjectBlobs(map<int, ObjectBlob>* blobs) {
+  if (!has_key_) {
+    LOG(ERROR) << "The store encryption key has not been initialized.";
+    return false;
+  }
+  LoadObjectBlobs(true, blobs);
+  return true;
+}
+
+void ObjectStoreMemory::LoadObjectBlobs(bool is_private,
+                                        map<int, ObjectBlob>* blobs) {
+  for (auto it = object_blobs_.begin(); it != object_blobs_.end(); ++it) {
+    if (it->second.is_private == is_private)
+      (*blobs)[it->first] = it->second;
+  }
+}
+
+}  // namespace p11net
@@ -0,0 +1,59 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_OBJECT_STORE_MEMORY_H_
+#define P11NET_OBJECT_STORE_MEMORY_H_
+
+#include "object_store.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace p11net {
+
+// An object store that keeps all blobs in process memory and never touches the
+// filesystem. It is meant for stateless deployments, such as containers, where
+// every token object is fetched from the NetHSM again on startup. Blobs are not
+// encrypted; like the objects of the pool itself, they only live as long as
+// the process. As with ObjectStoreImpl, private blobs are only accessible once
+// an encryption key has been set.
+class ObjectStoreMemory : public ObjectStore {
+ public:
+  ObjectStoreMemory();
+  virtual ~ObjectStoreMemory();
+
+  // ObjectStore methods.
+  virtual bool GetInternalBlob(int blob_id, std::string* blob);
+  virtual bool SetInternalBlob(int blob_id, const std::string& blob);
+  virtual bool SetEncryptionKey(const brillo::SecureBlob& key);
+  virtual bool InsertObjectBlob(const ObjectBlob& blob, int* handle);
+  virtual bool InsertObjectBlobs(const std::vector<ObjectBlob>& blobs,
+                                 std::vector<int>* handles);
+  virtual bool CommitChanges(const ObjectBlobChanges& changes,
+                             std::vector<int>* inserted_ids);
+  virtual bool DeleteObjectBlob(int handle);
+  virtual bool DeleteAllObjectBlobs();
+  virtual bool UpdateObjectBlob(int handle, const ObjectBlob& blob);
+  virtual bool LoadPublicObjectBlobs(std::map<int, ObjectBlob>* blobs);
+  virtual bool LoadPrivateObjectBlobs(std::map<int, ObjectBlob>* blobs);
+
+ private:
+  // Copies the blobs of the given privacy into 'blobs'.
+  void LoadObjectBlobs(bool is_private, std::map<int, ObjectBlob>* blobs);
+
+  bool has_key_;
+  int next_id_;
+  std::map<int, std::string> internal_blobs_;
+  std::map<int, ObjectBlob> object_blobs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ObjectStoreMemory);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_OBJECT_STORE_MEMORY_H_
@@ -7,20 +7,36 @@
 
 #include "p11net.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <string>
 #include <vector>
 
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
 #include "base/macros.h"
 #include "base/logging.h"
 
 #include "attributes.h"
+#include "call_recorder.h"
+#include "completion_queue.h"
 #include "p11net_service.h"
 #include "p11net_utility.h"
 #include "isolate.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "p11net_ext.h"
 #include "pkcs11/cryptoki.h"
 #include "p11net_factory_impl.h"
+#include "p11net_proxy.h"
 #include "slot_manager_impl.h"
 
 using std::string;
@@ -32,26 +48,149 @@ static const CK_BYTE kP11NetLibraryVersionMinor = 1;
 // The global proxy instance. This is valid only when g_is_initialized is true.
 static p11net::P11NetInterface* g_proxy = NULL;
 
+// The in-process service behind g_proxy, or NULL when using a mock proxy or
+// forwarding calls to p11netd. Attribute calls are dispatched to it directly,
+// skipping the serialization that a proxy in another process needs.
+static p11net::P11NetServiceImpl* g_service = NULL;
+
 // Set to true when using a mock proxy.
 static bool g_is_using_mock = false;
 
 // Set to true when C_Initialize has been called successfully.
 // When not using a mock proxy this is synonymous with (g_proxy != NULL).
-static bool g_is_initialized = false;
+// Threads blocked in C_WaitForSlotEvent read it while C_Finalize clears it.
+static std::atomic<bool> g_is_initialized(false);
 
 // Set to the user's isolate credential (if it exists) in C_Initialize in order
 // to provide access to the user's private slots.
 static brillo::SecureBlob* g_user_isolate = NULL;
 
+// A self-pipe that wakes threads blocked in C_WaitForSlotEvent. It is created
+// on first use and kept open for the lifetime of the library so that a waiter
+// never polls a closed descriptor. Both ends are non-blocking.
+static int g_slot_event_pipe[2] = {-1, -1};
+
+// Slots with an event not yet reported by C_WaitForSlotEvent, oldest first.
+static std::deque<CK_SLOT_ID>* g_slot_events = NULL;
+static boost::mutex* g_slot_events_lock = NULL;
+
+static bool InitSlotEvents();
+
+// Gives a forked child its own slot event pipe and queue. The threads that
+// waited on the inherited ones exist only in the parent, and the queue lock
+// may have been held by one of them.
+static void ResetSlotEventsInChild() {
+  if (g_slot_event_pipe[0] < 0)
+    return;
+  close(g_slot_event_pipe[0]);
+  close(g_slot_event_pipe[1]);
+  g_slot_event_pipe[0] = g_slot_event_pipe[1] = -1;
+  InitSlotEvents();
+}
+
+static void RegisterForkHandler() {
+  pthread_atfork(NULL, NULL, ResetSlotEventsInChild);
+}
+
+// Creates the slot event pipe and queue if needed. Returns false on failure.
+static bool InitSlotEvents() {
+  static pthread_once_t fork_handler_once = PTHREAD_ONCE_INIT;
+  pthread_once(&fork_handler_once, RegisterForkHandler);
+  if (g_slot_event_pipe[0] >= 0)
+    return true;
+  int fds[2];
+  if (pipe(fds) != 0) {
+    PLOG(ERROR) << "Failed to create the slot event pipe";
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  g_slot_events = new std::deque<CK_SLOT_ID>();
+  g_slot_events_lock = new boost::mutex();
+  g_slot_event_pipe[0] = fds[0];
+  g_slot_event_pipe[1] = fds[1];
+  return true;
+}
+
+// Wakes every thread blocked in C_WaitForSlotEvent. This only writes to the
+// pipe and is therefore safe to call from a signal handler.
+static void WakeSlotEventWaiters() {
+  if (g_slot_event_pipe[1] < 0)
+    return;
+  const char wakeup = 0;
+  // A full pipe already wakes the waiters.
+  ssize_t ignored = write(g_slot_event_pipe[1], &wakeup, 1);
+  (void)ignored;
+}
+
+// Queues an event for the given slot and wakes the waiters.
+static void PostSlotEvent(int slot_id) {
+  {
+    boost::lock_guard<boost::mutex> lock(*g_slot_events_lock);
+    // A slot with a pending event is reported once.
+    if (std::find(g_slot_events->begin(), g_slot_events->end(),
+                  static_cast<CK_SLOT_ID>(slot_id)) == g_slot_events->end())
+      g_slot_events->push_back(slot_id);
+  }
+  WakeSlotEventWaiters();
+}
+
+// Reads every pending wakeup from the slot event pipe.
+static void DrainSlotEventPipe() {
+  char buffer[64];
+  while (read(g_slot_event_pipe[0], buffer, sizeof(buffer)) > 0) {}
+}
+
+// Takes the oldest pending slot event. Returns false if there is none, in
+// which case stale wakeups are drained from the pipe.
+static bool TakeSlotEvent(CK_SLOT_ID* slot_id) {
+  boost::lock_guard<boost::mutex> lock(*g_slot_events_lock);
+  if (g_slot_events->empty()) {
+    DrainSlotEventPipe();
+    // The wakeup of C_Finalize may have been among those drained; the pipe
+    // must stay readable until every other waiter has returned too.
+    if (!g_is_initialized)
+      WakeSlotEventWaiters();
+    return false;
+  }
+  *slot_id = g_slot_events->front();
+  g_slot_events->pop_front();
+  return true;
+}
+
+// Forgets the events of a previous initialization, and the wakeup C_Finalize
+// left in the pipe.
+static void ClearSlotEvents() {
+  boost::lock_guard<boost::mutex> lock(*g_slot_events_lock);
+  g_slot_events->clear();
+  DrainSlotEventPipe();
+}
+
 // Tear down helper.
 static void TearDown() {
   if (g_is_initialized && !g_is_using_mock && g_proxy) {
     delete g_proxy;
     delete g_user_isolate;
   }
+  g_service = NULL;
   g_is_initialized = false;
 }
 
+// Returns true if the given template can be passed to g_service as is. Nested
+// attribute arrays take the serialized path, which defines their ownership.
+static bool CanDispatchDirectly(CK_ATTRIBUTE_PTR attributes,
+                                CK_ULONG num_attributes) {
+  if (!g_service)
+    return false;
+  for (CK_ULONG i = 0; i < num_attributes; ++i) {
+    if (p11net::Attributes::IsAttributeNested(attributes[i].type))
+      return false;
+  }
+  return true;
+}
+
 // This function implements the output handling convention described in
 // PKCS #11 section 11.2.  This method handles the following cases:
 // 1) Caller passes a NULL buffer.
@@ -95,6 +234,7 @@ EXPORT_SPEC void EnableMockProxy(P11NetInterface* proxy,
   g_user_isolate = isolate_credential;
   g_is_using_mock = true;
   g_is_initialized = is_initialized;
+  InitSlotEvents();
 }
 
 EXPORT_SPEC void DisableMockProxy() {
@@ -113,9 +253,13 @@ EXPORT_SPEC void DisableMockProxy() {
 // PKCS #11 v2.20 section 11.4 page 102.
 // Connects to the D-Bus service.
 CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, NULL);
   if (g_is_initialized)
     return CKR_CRYPTOKI_ALREADY_INITIALIZED;
   logging::Init();
+  p11net::StartupReport startup_report;
   // Validate args (if any).
   if (pInitArgs) {
     CK_C_INITIALIZE_ARGS_PTR args =
@@ -133,12 +277,24 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
       LOG_CK_RV_AND_RETURN(CKR_CANT_LOCK);
     }
   }
+  if (!InitSlotEvents())
+    LOG_CK_RV_AND_RETURN(CKR_GENERAL_ERROR);
+  ClearSlotEvents();
   // If we're not using a mock proxy instance we need to create one.
-  if (!g_is_using_mock) {
+  if (!g_is_using_mock && !p11net::P11NetProxyImpl::GetDaemonSocket().empty()) {
+    std::unique_ptr<p11net::P11NetProxyImpl> proxy =
+        p11net::P11NetProxyImpl::Create();
+    proxy->SetSlotEventCallback(PostSlotEvent);
+    if (!proxy->Init())
+      LOG_CK_RV_AND_RETURN(CKR_DEVICE_ERROR);
+    g_proxy = proxy.release();
+    g_user_isolate = new brillo::SecureBlob(16);
+  } else if (!g_is_using_mock) {
     std::shared_ptr<p11net::P11NetFactoryImpl>
       factory(new p11net::P11NetFactoryImpl());
     std::shared_ptr<p11net::SlotManagerImpl>
       slot_mgr(new p11net::SlotManagerImpl(factory, true));
+    slot_mgr->SetSlotEventCallback(PostSlotEvent);
     if (!slot_mgr->Init())
         LOG_CK_RV_AND_RETURN(CKR_GENERAL_ERROR);
     std::unique_ptr<p11net::P11NetServiceImpl>
@@ -146,7 +302,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
     CHECK(proxy.get());
     if (!proxy->Init())
       LOG_CK_RV_AND_RETURN(CKR_GENERAL_ERROR);
-    g_proxy = proxy.release();
+    g_service = proxy.release();
+    g_proxy = g_service;
 
     g_user_isolate = new brillo::SecureBlob(16);
 //    p11net::IsolateCredentialManager isolate_manager;
@@ -155,6 +312,9 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
   }
   CHECK(g_proxy);
   CHECK(g_user_isolate);
+  p11net::Metrics::Get()->StartDumping();
+  p11net::Tracing::Start();
+  p11net::CallRecorder::Start();
 
   g_is_initialized = true;
   VLOG(1) << __func__ << " - CKR_OK";
@@ -164,10 +324,18 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
 // PKCS #11 v2.20 section 11.4 page 104.
 // Closes the D-Bus service connection.
 CK_RV C_Finalize(CK_VOID_PTR pReserved) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(pReserved, CKR_ARGUMENTS_BAD);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   TearDown();
+  WakeSlotEventWaiters();
+  p11net::Metrics::Get()->StopDumping();
+  p11net::Tracing::Stop();
+  p11net::CallRecorder::Stop();
   VLOG(1) << __func__ << " - CKR_OK";
+  logging::Flush();
   return CKR_OK;
 }
 
@@ -175,6 +343,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved) {
 // Provide library info locally.
 // TODO(dkrahn): i18n of strings - crosbug.com/20637
 CK_RV C_GetInfo(CK_INFO_PTR pInfo) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pInfo, CKR_ARGUMENTS_BAD);
   pInfo->cryptokiVersion.major = CRYPTOKI_VERSION_MAJOR;
@@ -194,6 +365,9 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo) {
 
 // PKCS #11 v2.20 section 11.4 page 106.
 CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!ppFunctionList, CKR_ARGUMENTS_BAD);
   logging::Init();
   static CK_VERSION version = {2, 20};
@@ -215,6 +389,9 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
 CK_RV C_GetSlotList(CK_BBOOL tokenPresent,
                     CK_SLOT_ID_PTR pSlotList,
                     CK_ULONG_PTR pulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, pulCount);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pulCount, CKR_ARGUMENTS_BAD);
   vector<uint64_t> slot_list;
@@ -235,8 +412,17 @@ CK_RV C_GetSlotList(CK_BBOOL tokenPresent,
 
 // PKCS #11 v2.20 section 11.5 page 108.
 CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pInfo, CKR_ARGUMENTS_BAD);
+  if (g_service) {
+    CK_RV result = g_service->GetSlotInfoDirect(*g_user_isolate, slotID, pInfo);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint8_t> slot_description;
   vector<uint8_t> manufacturer_id;
   CK_RV result = g_proxy->GetSlotInfo(
@@ -262,8 +448,18 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) {
 
 // PKCS #11 v2.20 section 11.5 page 109.
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pInfo, CKR_ARGUMENTS_BAD);
+  if (g_service) {
+    CK_RV result =
+        g_service->GetTokenInfoDirect(*g_user_isolate, slotID, pInfo);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint8_t> label;
   vector<uint8_t> manufacturer_id;
   vector<uint8_t> model;
@@ -308,23 +504,35 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
 }
 
 // PKCS #11 v2.20 section 11.5 page 110.
-// Currently, slot events via D-Bus are not supported because no slot events
-// occur with TPM-based tokens.  We want this call to behave properly so we'll
-// block the calling thread (if not CKF_DONT_BLOCK) until C_Finalize is called.
+// A slot event is reported when the NetHSM behind the slot becomes unreachable
+// or reachable again. The calling thread blocks (if not CKF_DONT_BLOCK) until
+// such an event occurs or C_Finalize is called.
 CK_RV C_WaitForSlotEvent(CK_FLAGS flags,
                          CK_SLOT_ID_PTR pSlot,
                          CK_VOID_PTR pReserved) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(0, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pSlot, CKR_ARGUMENTS_BAD);
-  // Currently, all supported tokens are not removable - i.e. no slot events.
+  LOG_CK_RV_AND_RETURN_IF(g_slot_event_pipe[0] < 0, CKR_GENERAL_ERROR);
+  if (TakeSlotEvent(pSlot))
+    return CKR_OK;
   if (CKF_DONT_BLOCK & flags)
     return CKR_NO_EVENT;
-  // Block until C_Finalize.  A simple mechanism is used here because any
-  // synchronization primitive will be a problem if C_Finalize is called in a
-  // signal handler.
+  // Block on the self-pipe rather than a synchronization primitive because
+  // C_Finalize may be called in a signal handler.
   while (g_is_initialized) {
-    const useconds_t kPollInterval = 3000000;  // 3 seconds
-    usleep(kPollInterval);
+    struct pollfd fd = {g_slot_event_pipe[0], POLLIN, 0};
+    if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+      PLOG(ERROR) << "Failed to wait for slot events";
+      LOG_CK_RV_AND_RETURN(CKR_GENERAL_ERROR);
+    }
+    // The pipe stays readable after C_Finalize, so every waiter returns.
+    if (!g_is_initialized)
+      break;
+    if (TakeSlotEvent(pSlot))
+      return CKR_OK;
   }
   return CKR_CRYPTOKI_NOT_INITIALIZED;
 }
@@ -333,8 +541,20 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,
 CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
                          CK_MECHANISM_TYPE_PTR pMechanismList,
                          CK_ULONG_PTR pulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, pulCount);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pulCount, CKR_ARGUMENTS_BAD);
+  if (g_service) {
+    CK_RV result = g_service->GetMechanismListDirect(*g_user_isolate,
+                                                     slotID,
+                                                     pMechanismList,
+                                                     pulCount);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint64_t> mechanism_list;
   CK_RV result = g_proxy->GetMechanismList(*g_user_isolate,
                                            slotID, &mechanism_list);
@@ -357,6 +577,9 @@ CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
 CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID,
                          CK_MECHANISM_TYPE type,
                          CK_MECHANISM_INFO_PTR pInfo) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pInfo, CKR_ARGUMENTS_BAD);
   vector<uint64_t> mechanism_list;
@@ -377,6 +600,9 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
                   CK_UTF8CHAR_PTR pPin,
                   CK_ULONG ulPinLen,
                   CK_UTF8CHAR_PTR pLabel) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pLabel, CKR_ARGUMENTS_BAD);
   string pin = p11net::ConvertCharBufferToString(pPin, ulPinLen);
@@ -393,6 +619,9 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 CK_RV C_InitPIN(CK_SESSION_HANDLE hSession,
                 CK_UTF8CHAR_PTR pPin,
                 CK_ULONG ulPinLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   string pin = p11net::ConvertCharBufferToString(pPin, ulPinLen);
   string* pin_ptr = (!pPin) ? NULL : &pin;
@@ -408,6 +637,9 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
                CK_ULONG ulOldLen,
                CK_UTF8CHAR_PTR pNewPin,
                CK_ULONG ulNewLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   string old_pin = p11net::ConvertCharBufferToString(pOldPin, ulOldLen);
   string* old_pin_ptr = (!pOldPin) ? NULL : &old_pin;
@@ -426,6 +658,9 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,
                     CK_VOID_PTR pApplication,
                     CK_NOTIFY Notify,
                     CK_SESSION_HANDLE_PTR phSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!phSession, CKR_ARGUMENTS_BAD);
   // pApplication and Notify are intentionally ignored.  We don't support
@@ -440,6 +675,9 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,
 
 // PKCS #11 v2.20 section 11.6 page 118.
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->CloseSession(*g_user_isolate, hSession);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -449,6 +687,9 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession) {
 
 // PKCS #11 v2.20 section 11.6 page 120.
 CK_RV C_CloseAllSessions(CK_SLOT_ID slotID) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(slotID, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->CloseAllSessions(*g_user_isolate, slotID);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -458,6 +699,9 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID) {
 
 // PKCS #11 v2.20 section 11.6 page 120.
 CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pInfo, CKR_ARGUMENTS_BAD);
 
@@ -477,6 +721,9 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
 CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession,
                           CK_BYTE_PTR pOperationState,
                           CK_ULONG_PTR pulOperationStateLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulOperationStateLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pulOperationStateLen, CKR_ARGUMENTS_BAD);
 
@@ -502,6 +749,9 @@ CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,
                           CK_ULONG ulOperationStateLen,
                           CK_OBJECT_HANDLE hEncryptionKey,
                           CK_OBJECT_HANDLE hAuthenticationKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulOperationStateLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pOperationState, CKR_ARGUMENTS_BAD);
 
@@ -523,6 +773,9 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,
               CK_USER_TYPE userType,
               CK_UTF8CHAR_PTR pPin,
               CK_ULONG ulPinLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   string pin = p11net::ConvertCharBufferToString(pPin, ulPinLen);
   string* pin_ptr = (!pPin) ? NULL : &pin;
@@ -534,6 +787,9 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,
 
 // PKCS #11 v2.20 section 11.6 page 127.
 CK_RV C_Logout(CK_SESSION_HANDLE hSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->Logout(*g_user_isolate, hSession);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -546,9 +802,23 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,
                      CK_ATTRIBUTE_PTR pTemplate,
                      CK_ULONG ulCount,
                      CK_OBJECT_HANDLE_PTR phObject) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (pTemplate == NULL_PTR || phObject == NULL_PTR)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplate, ulCount)) {
+    CK_RV result = g_service->CreateObjectDirect(
+        *g_user_isolate,
+        hSession,
+        pTemplate,
+        ulCount,
+        p11net::PreservedCK_ULONG(phObject));
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   p11net::Attributes attributes(pTemplate, ulCount);
   vector<uint8_t> serialized_attributes;
   if (!attributes.Serialize(&serialized_attributes))
@@ -569,9 +839,24 @@ CK_RV C_CopyObject(CK_SESSION_HANDLE hSession,
                    CK_ATTRIBUTE_PTR pTemplate,
                    CK_ULONG ulCount,
                    CK_OBJECT_HANDLE_PTR phNewObject) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (pTemplate == NULL_PTR || phNewObject == NULL_PTR)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplate, ulCount)) {
+    CK_RV result = g_service->CopyObjectDirect(
+        *g_user_isolate,
+        hSession,
+        hObject,
+        pTemplate,
+        ulCount,
+        p11net::PreservedCK_ULONG(phNewObject));
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   p11net::Attributes attributes(pTemplate, ulCount);
   vector<uint8_t> serialized_attributes;
   if (!attributes.Serialize(&serialized_attributes))
@@ -589,6 +874,9 @@ CK_RV C_CopyObject(CK_SESSION_HANDLE hSession,
 
 // PKCS #11 v2.20 section 11.7 page 131.
 CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->DestroyObject(*g_user_isolate, hSession, hObject);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -600,6 +888,9 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
 CK_RV C_GetObjectSize(CK_SESSION_HANDLE hSession,
                       CK_OBJECT_HANDLE hObject,
                       CK_ULONG_PTR pulSize) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulSize);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pulSize, CKR_ARGUMENTS_BAD);
   CK_RV result = g_proxy->GetObjectSize(*g_user_isolate,
@@ -616,8 +907,26 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,
                           CK_OBJECT_HANDLE hObject,
                           CK_ATTRIBUTE_PTR pTemplate,
                           CK_ULONG ulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pTemplate, CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplate, ulCount)) {
+    // The service fills the caller's template in place.
+    CK_RV result = g_service->GetAttributeValueDirect(*g_user_isolate,
+                                                      hSession,
+                                                      hObject,
+                                                      pTemplate,
+                                                      ulCount);
+    if (result != CKR_OK &&
+        result != CKR_ATTRIBUTE_TYPE_INVALID &&
+        result != CKR_ATTRIBUTE_SENSITIVE &&
+        result != CKR_BUFFER_TOO_SMALL)
+      LOG_CK_RV_AND_RETURN(result);
+    VLOG(1) << __func__ << " - " << p11net::CK_RVToString(result);
+    return result;
+  }
   p11net::Attributes attributes(pTemplate, ulCount);
   vector<uint8_t> serialized_attributes_in;
   if (!attributes.Serialize(&serialized_attributes_in))
@@ -646,8 +955,21 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,
                           CK_OBJECT_HANDLE hObject,
                           CK_ATTRIBUTE_PTR pTemplate,
                           CK_ULONG ulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pTemplate, CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplate, ulCount)) {
+    CK_RV result = g_service->SetAttributeValueDirect(*g_user_isolate,
+                                                      hSession,
+                                                      hObject,
+                                                      pTemplate,
+                                                      ulCount);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   p11net::Attributes attributes(pTemplate, ulCount);
   vector<uint8_t> serialized_attributes;
   if (!attributes.Serialize(&serialized_attributes))
@@ -665,8 +987,18 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,
 CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,
                         CK_ATTRIBUTE_PTR pTemplate,
                         CK_ULONG ulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pTemplate && ulCount > 0, CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplate, ulCount)) {
+    CK_RV result = g_service->FindObjectsInitDirect(*g_user_isolate, hSession,
+                                                    pTemplate, ulCount);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   p11net::Attributes attributes(pTemplate, ulCount);
   vector<uint8_t> serialized_attributes;
   if (!attributes.Serialize(&serialized_attributes))
@@ -683,6 +1015,9 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,
                     CK_OBJECT_HANDLE_PTR phObject,
                     CK_ULONG ulMaxObjectCount,
                     CK_ULONG_PTR pulObjectCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulMaxObjectCount, pulObjectCount);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!phObject || !pulObjectCount, CKR_ARGUMENTS_BAD);
   vector<uint64_t> object_list;
@@ -701,6 +1036,9 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,
 
 // PKCS #11 v2.20 section 11.7 page 138.
 CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->FindObjectsFinal(*g_user_isolate, hSession);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -712,6 +1050,10 @@ CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
 CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession,
                     CK_MECHANISM_PTR pMechanism,
                     CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   CK_RV result = g_proxy->EncryptInit(
@@ -733,11 +1075,25 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,
                 CK_ULONG ulDataLen,
                 CK_BYTE_PTR pEncryptedData,
                 CK_ULONG_PTR pulEncryptedDataLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, pulEncryptedDataLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if ((!pData && ulDataLen > 0) || !pulEncryptedDataLen) {
     g_proxy->EncryptCancel(*g_user_isolate, hSession);
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
   }
+  if (g_service) {
+    CK_RV result = g_service->EncryptDirect(*g_user_isolate,
+                                            hSession,
+                                            pData,
+                                            ulDataLen,
+                                            pEncryptedData,
+                                            pulEncryptedDataLen);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint8_t> data_out;
   uint64_t data_out_length;
   uint64_t max_out_length =
@@ -765,6 +1121,9 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,
                       CK_ULONG ulPartLen,
                       CK_BYTE_PTR pEncryptedPart,
                       CK_ULONG_PTR pulEncryptedPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, pulEncryptedPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pPart || !pulEncryptedPartLen) {
     g_proxy->EncryptCancel(*g_user_isolate, hSession);
@@ -795,6 +1154,9 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,
 CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,
                      CK_BYTE_PTR pLastEncryptedPart,
                      CK_ULONG_PTR pulLastEncryptedPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulLastEncryptedPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pulLastEncryptedPartLen) {
     g_proxy->EncryptCancel(*g_user_isolate, hSession);
@@ -823,6 +1185,10 @@ CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,
 CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,
                     CK_MECHANISM_PTR pMechanism,
                     CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   CK_RV result = g_proxy->DecryptInit(
@@ -844,11 +1210,25 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,
                 CK_ULONG ulEncryptedDataLen,
                 CK_BYTE_PTR pData,
                 CK_ULONG_PTR pulDataLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulEncryptedDataLen, pulDataLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if ((!pEncryptedData && ulEncryptedDataLen > 0) || !pulDataLen) {
     g_proxy->DecryptCancel(*g_user_isolate, hSession);
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
   }
+  if (g_service) {
+    CK_RV result = g_service->DecryptDirect(*g_user_isolate,
+                                            hSession,
+                                            pEncryptedData,
+                                            ulEncryptedDataLen,
+                                            pData,
+                                            pulDataLen);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint8_t> data_out;
   uint64_t data_out_length;
   uint64_t max_out_length = pData ? static_cast<uint64_t>(*pulDataLen) : 0;
@@ -876,6 +1256,9 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,
                       CK_ULONG ulEncryptedPartLen,
                       CK_BYTE_PTR pPart,
                       CK_ULONG_PTR pulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulEncryptedPartLen, pulPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pEncryptedPart || !pulPartLen) {
     g_proxy->DecryptCancel(*g_user_isolate, hSession);
@@ -906,6 +1289,9 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,
 CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,
                      CK_BYTE_PTR pLastPart,
                      CK_ULONG_PTR pulLastPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulLastPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pulLastPartLen) {
     g_proxy->DecryptCancel(*g_user_isolate, hSession);
@@ -933,6 +1319,10 @@ CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,
 // PKCS #11 v2.20 section 11.10 page 148.
 CK_RV C_DigestInit(CK_SESSION_HANDLE hSession,
                    CK_MECHANISM_PTR pMechanism) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
@@ -953,6 +1343,9 @@ CK_RV C_Digest(CK_SESSION_HANDLE hSession,
                CK_ULONG ulDataLen,
                CK_BYTE_PTR pDigest,
                CK_ULONG_PTR pulDigestLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, pulDigestLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if ((!pData && ulDataLen > 0) || !pulDigestLen) {
     g_proxy->DigestCancel(*g_user_isolate, hSession);
@@ -982,6 +1375,9 @@ CK_RV C_Digest(CK_SESSION_HANDLE hSession,
 CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession,
                      CK_BYTE_PTR pPart,
                      CK_ULONG ulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pPart) {
     g_proxy->DigestCancel(*g_user_isolate, hSession);
@@ -998,6 +1394,9 @@ CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession,
 
 // PKCS #11 v2.20 section 11.10 page 150.
 CK_RV C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   CK_RV result = g_proxy->DigestKey(*g_user_isolate, hSession, hKey);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
@@ -1009,6 +1408,9 @@ CK_RV C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey) {
 CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession,
                     CK_BYTE_PTR pDigest,
                     CK_ULONG_PTR pulDigestLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulDigestLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pulDigestLen) {
     g_proxy->DigestCancel(*g_user_isolate, hSession);
@@ -1036,6 +1438,10 @@ CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession,
 CK_RV C_SignInit(CK_SESSION_HANDLE hSession,
                  CK_MECHANISM_PTR pMechanism,
                  CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
@@ -1057,11 +1463,25 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,
              CK_ULONG ulDataLen,
              CK_BYTE_PTR pSignature,
              CK_ULONG_PTR pulSignatureLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, pulSignatureLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if ((!pData && ulDataLen > 0) || !pulSignatureLen) {
     g_proxy->SignCancel(*g_user_isolate, hSession);
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
   }
+  if (g_service) {
+    CK_RV result = g_service->SignDirect(*g_user_isolate,
+                                         hSession,
+                                         pData,
+                                         ulDataLen,
+                                         pSignature,
+                                         pulSignatureLen);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
   vector<uint8_t> data_out;
   uint64_t data_out_length;
   uint64_t max_out_length =
@@ -1087,6 +1507,9 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,
 CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession,
                    CK_BYTE_PTR pPart,
                    CK_ULONG ulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pPart) {
     g_proxy->SignCancel(*g_user_isolate, hSession);
@@ -1105,6 +1528,9 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession,
 CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,
                   CK_BYTE_PTR pSignature,
                   CK_ULONG_PTR pulSignatureLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulSignatureLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pulSignatureLen) {
     g_proxy->SignCancel(*g_user_isolate, hSession);
@@ -1133,6 +1559,10 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,
 CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,
                         CK_MECHANISM_PTR pMechanism,
                         CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
@@ -1154,6 +1584,9 @@ CK_RV C_SignRecover(CK_SESSION_HANDLE hSession,
                     CK_ULONG ulDataLen,
                     CK_BYTE_PTR pSignature,
                     CK_ULONG_PTR pulSignatureLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, pulSignatureLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if ((!pData && ulDataLen > 0) || !pulSignatureLen)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1182,6 +1615,10 @@ CK_RV C_SignRecover(CK_SESSION_HANDLE hSession,
 CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,
                    CK_MECHANISM_PTR pMechanism,
                    CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
@@ -1203,6 +1640,9 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,
                CK_ULONG ulDataLen,
                CK_BYTE_PTR pSignature,
                CK_ULONG ulSignatureLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pSignature || (!pData && ulDataLen > 0)) {
     g_proxy->VerifyCancel(*g_user_isolate, hSession);
@@ -1222,6 +1662,9 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,
 CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,
                      CK_BYTE_PTR pPart,
                      CK_ULONG ulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pPart) {
     g_proxy->VerifyCancel(*g_user_isolate, hSession);
@@ -1240,6 +1683,9 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,
 CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,
                     CK_BYTE_PTR pSignature,
                     CK_ULONG ulSignatureLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulSignatureLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pSignature) {
     g_proxy->VerifyCancel(*g_user_isolate, hSession);
@@ -1258,6 +1704,10 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,
 CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession,
                           CK_MECHANISM_PTR pMechanism,
                           CK_OBJECT_HANDLE hKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pMechanism, CKR_ARGUMENTS_BAD);
   vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
@@ -1280,6 +1730,9 @@ CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,
                       CK_ULONG ulSignatureLen,
                       CK_BYTE_PTR pData,
                       CK_ULONG_PTR pulDataLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulSignatureLen, pulDataLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pSignature || !pulDataLen)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1309,6 +1762,9 @@ CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,
                             CK_ULONG ulPartLen,
                             CK_BYTE_PTR pEncryptedPart,
                             CK_ULONG_PTR pulEncryptedPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, pulEncryptedPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pPart || !pulEncryptedPartLen, CKR_ARGUMENTS_BAD);
   vector<uint8_t> data_out;
@@ -1338,6 +1794,9 @@ CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession,
                             CK_ULONG ulEncryptedPartLen,
                             CK_BYTE_PTR pPart,
                             CK_ULONG_PTR pulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulEncryptedPartLen, pulPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pEncryptedPart || !pulPartLen, CKR_ARGUMENTS_BAD);
   vector<uint8_t> data_out;
@@ -1366,6 +1825,9 @@ CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession,
                           CK_ULONG ulPartLen,
                           CK_BYTE_PTR pEncryptedPart,
                           CK_ULONG_PTR pulEncryptedPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPartLen, pulEncryptedPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pPart || !pulEncryptedPartLen, CKR_ARGUMENTS_BAD);
   vector<uint8_t> data_out;
@@ -1395,6 +1857,9 @@ CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession,
                             CK_ULONG ulEncryptedPartLen,
                             CK_BYTE_PTR pPart,
                             CK_ULONG_PTR pulPartLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulEncryptedPartLen, pulPartLen);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   LOG_CK_RV_AND_RETURN_IF(!pEncryptedPart || !pulPartLen, CKR_ARGUMENTS_BAD);
   vector<uint8_t> data_out;
@@ -1423,6 +1888,10 @@ CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession,
                     CK_ATTRIBUTE_PTR pTemplate,
                     CK_ULONG ulCount,
                     CK_OBJECT_HANDLE_PTR phKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pMechanism || (!pTemplate && ulCount > 0) || !phKey)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1453,6 +1922,10 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,
                         CK_ULONG ulPrivateKeyAttributeCount,
                         CK_OBJECT_HANDLE_PTR phPublicKey,
                         CK_OBJECT_HANDLE_PTR phPrivateKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulPublicKeyAttributeCount, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pMechanism ||
       (!pPublicKeyTemplate && ulPublicKeyAttributeCount > 0) ||
@@ -1491,6 +1964,10 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,
                 CK_OBJECT_HANDLE hKey,
                 CK_BYTE_PTR pWrappedKey,
                 CK_ULONG_PTR pulWrappedKeyLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, pulWrappedKeyLen);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pMechanism || !pulWrappedKeyLen)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1529,6 +2006,10 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,
                   CK_ATTRIBUTE_PTR pTemplate,
                   CK_ULONG ulAttributeCount,
                   CK_OBJECT_HANDLE_PTR phKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulWrappedKeyLen, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pMechanism || !pWrappedKey || !phKey)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1559,6 +2040,10 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,
                   CK_ATTRIBUTE_PTR pTemplate,
                   CK_ULONG ulAttributeCount,
                   CK_OBJECT_HANDLE_PTR phKey) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulAttributeCount, NULL);
+  call_record.SetMechanism(pMechanism);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pMechanism || !phKey)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1585,6 +2070,9 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,
 CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession,
                    CK_BYTE_PTR pSeed,
                    CK_ULONG ulSeedLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulSeedLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!pSeed || ulSeedLen == 0)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1601,6 +2089,9 @@ CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession,
 CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,
                        CK_BYTE_PTR RandomData,
                        CK_ULONG ulRandomLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulRandomLen, NULL);
   LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
   if (!RandomData || ulRandomLen == 0)
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
@@ -1616,10 +2107,343 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,
 
 // PKCS #11 v2.20 section 11.16 page 185.
 CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   return CKR_FUNCTION_NOT_PARALLEL;
 }
 
 // PKCS #11 v2.20 section 11.16 page 186.
 CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
   return CKR_FUNCTION_NOT_PARALLEL;
 }
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_GetMetrics(CK_BYTE_PTR pMetrics, CK_ULONG_PTR pulMetricsLen) {
+  LOG_CK_RV_AND_RETURN_IF(!pulMetricsLen, CKR_ARGUMENTS_BAD);
+  const string metrics = p11net::Metrics::Get()->Dump();
+  if (!pMetrics) {
+    *pulMetricsLen = metrics.size();
+    return CKR_OK;
+  }
+  if (*pulMetricsLen < metrics.size()) {
+    *pulMetricsLen = metrics.size();
+    return CKR_BUFFER_TOO_SMALL;
+  }
+  memcpy(pMetrics, metrics.data(), metrics.size());
+  *pulMetricsLen = metrics.size();
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_SetSessionPriority(CK_SESSION_HANDLE hSession,
+                                  CK_ULONG ulPriority) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, 0, NULL);
+  LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+  CK_RV result = g_proxy->SetSessionPriority(*g_user_isolate, hSession,
+                                             ulPriority);
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// Runs a batch of C_P11Net_SignBatch or C_P11Net_DecryptBatch and copies the
+// outputs to the items.
+static CK_RV OperationBatch(p11net::OperationType operation,
+                            CK_SESSION_HANDLE hSession,
+                            CK_MECHANISM_PTR pMechanism,
+                            CK_OBJECT_HANDLE hKey,
+                            CK_P11NET_BATCH_ITEM_PTR pItems,
+                            CK_ULONG ulCount) {
+  LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+  LOG_CK_RV_AND_RETURN_IF(!pMechanism || (!pItems && ulCount > 0),
+                          CKR_ARGUMENTS_BAD);
+  vector<vector<uint8_t>> inputs(ulCount);
+  for (CK_ULONG i = 0; i < ulCount; ++i) {
+    LOG_CK_RV_AND_RETURN_IF(!pItems[i].pInput && pItems[i].ulInputLen > 0,
+                            CKR_ARGUMENTS_BAD);
+    inputs[i] = p11net::ConvertByteBufferToVector(pItems[i].pInput,
+                                                  pItems[i].ulInputLen);
+  }
+  vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
+      reinterpret_cast<CK_BYTE_PTR>(pMechanism->pParameter),
+      pMechanism->ulParameterLen);
+  vector<vector<uint8_t>> outputs;
+  vector<uint32_t> results;
+  CK_RV result = (operation == p11net::kSign) ?
+      g_proxy->SignBatch(*g_user_isolate, hSession, pMechanism->mechanism,
+                         parameter, hKey, inputs, &outputs, &results) :
+      g_proxy->DecryptBatch(*g_user_isolate, hSession, pMechanism->mechanism,
+                            parameter, hKey, inputs, &outputs, &results);
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  LOG_CK_RV_AND_RETURN_IF(outputs.size() != ulCount ||
+                              results.size() != ulCount,
+                          CKR_GENERAL_ERROR);
+  for (CK_ULONG i = 0; i < ulCount; ++i) {
+    CK_P11NET_BATCH_ITEM& item = pItems[i];
+    item.rv = results[i];
+    if (item.rv != CKR_OK)
+      continue;
+    if (!item.pOutput || item.ulOutputLen < outputs[i].size())
+      item.rv = CKR_BUFFER_TOO_SMALL;
+    else if (!outputs[i].empty())
+      memcpy(item.pOutput, outputs[i].data(), outputs[i].size());
+    item.ulOutputLen = outputs[i].size();
+  }
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_SignBatch(CK_SESSION_HANDLE hSession,
+                         CK_MECHANISM_PTR pMechanism,
+                         CK_OBJECT_HANDLE hKey,
+                         CK_P11NET_BATCH_ITEM_PTR pItems,
+                         CK_ULONG ulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
+  call_record.SetMechanism(pMechanism);
+  return OperationBatch(p11net::kSign, hSession, pMechanism, hKey, pItems,
+                        ulCount);
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_DecryptBatch(CK_SESSION_HANDLE hSession,
+                            CK_MECHANISM_PTR pMechanism,
+                            CK_OBJECT_HANDLE hKey,
+                            CK_P11NET_BATCH_ITEM_PTR pItems,
+                            CK_ULONG ulCount) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulCount, NULL);
+  call_record.SetMechanism(pMechanism);
+  return OperationBatch(p11net::kDecrypt, hSession, pMechanism, hKey, pItems,
+                        ulCount);
+}
+
+// Submits a sign or decrypt operation of C_P11Net_SignSubmit or
+// C_P11Net_DecryptSubmit.
+static CK_RV OperationSubmit(p11net::OperationType operation,
+                             CK_SESSION_HANDLE hSession,
+                             CK_MECHANISM_PTR pMechanism,
+                             CK_OBJECT_HANDLE hKey,
+                             CK_BYTE_PTR pData,
+                             CK_ULONG ulDataLen,
+                             CK_ULONG_PTR pulOperation) {
+  LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+  LOG_CK_RV_AND_RETURN_IF(!pMechanism || (!pData && ulDataLen > 0) ||
+                              !pulOperation,
+                          CKR_ARGUMENTS_BAD);
+  vector<uint8_t> parameter = p11net::ConvertByteBufferToVector(
+      reinterpret_cast<CK_BYTE_PTR>(pMechanism->pParameter),
+      pMechanism->ulParameterLen);
+  vector<uint8_t> data = p11net::ConvertByteBufferToVector(pData, ulDataLen);
+  uint64_t operation_id = 0;
+  CK_RV result = (operation == p11net::kSign) ?
+      g_proxy->SignSubmit(*g_user_isolate, hSession, pMechanism->mechanism,
+                          parameter, hKey, data, &operation_id) :
+      g_proxy->DecryptSubmit(*g_user_isolate, hSession, pMechanism->mechanism,
+                             parameter, hKey, data, &operation_id);
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  *pulOperation = operation_id;
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_SignSubmit(CK_SESSION_HANDLE hSession,
+                          CK_MECHANISM_PTR pMechanism,
+                          CK_OBJECT_HANDLE hKey,
+                          CK_BYTE_PTR pData,
+                          CK_ULONG ulDataLen,
+                          CK_ULONG_PTR pulOperation) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulDataLen, NULL);
+  call_record.SetMechanism(pMechanism);
+  return OperationSubmit(p11net::kSign, hSession, pMechanism, hKey, pData,
+                         ulDataLen, pulOperation);
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_DecryptSubmit(CK_SESSION_HANDLE hSession,
+                             CK_MECHANISM_PTR pMechanism,
+                             CK_OBJECT_HANDLE hKey,
+                             CK_BYTE_PTR pEncryptedData,
+                             CK_ULONG ulEncryptedDataLen,
+                             CK_ULONG_PTR pulOperation) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulEncryptedDataLen, NULL);
+  call_record.SetMechanism(pMechanism);
+  return OperationSubmit(p11net::kDecrypt, hSession, pMechanism, hKey,
+                         pEncryptedData, ulEncryptedDataLen, pulOperation);
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_GetCompletionFd(int* pFd) {
+  LOG_CK_RV_AND_RETURN_IF(!pFd, CKR_ARGUMENTS_BAD);
+  int fd = p11net::CompletionQueue::Get()->GetEventFd();
+  LOG_CK_RV_AND_RETURN_IF(fd < 0, CKR_HOST_MEMORY);
+  *pFd = fd;
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_GetCompleted(CK_ULONG_PTR pOperations, CK_ULONG_PTR pulCount) {
+  LOG_CK_RV_AND_RETURN_IF(!pulCount || (!pOperations && *pulCount > 0),
+                          CKR_ARGUMENTS_BAD);
+  vector<uint64_t> ids;
+  p11net::CompletionQueue::Get()->TakeCompleted(*pulCount, &ids);
+  std::copy(ids.begin(), ids.end(), pOperations);
+  *pulCount = ids.size();
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_Collect(CK_ULONG ulOperation,
+                       CK_BYTE_PTR pOutput,
+                       CK_ULONG_PTR pulOutputLen) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  LOG_CK_RV_AND_RETURN_IF(!pulOutputLen, CKR_ARGUMENTS_BAD);
+  CK_RV result = p11net::CompletionQueue::Get()->Collect(ulOperation, pOutput,
+                                                         pulOutputLen);
+  if (result == CKR_P11NET_OPERATION_PENDING)
+    return result;
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// Reads the attributes of each object through the proxy for
+// C_P11Net_GetAttributeValues and C_P11Net_FindObjectsWithAttributes when not
+// dispatching directly.
+static void GetAttributeValuesSerialized(CK_SESSION_HANDLE hSession,
+                                         const CK_OBJECT_HANDLE* phObjects,
+                                         CK_ULONG ulObjectCount,
+                                         CK_ATTRIBUTE_PTR pTemplates,
+                                         CK_ULONG ulAttributeCount,
+                                         CK_RV* pResults) {
+  for (CK_ULONG i = 0; i < ulObjectCount; ++i) {
+    p11net::Attributes attributes(&pTemplates[i * ulAttributeCount],
+                                  ulAttributeCount);
+    vector<uint8_t> serialized_attributes_in;
+    if (!attributes.Serialize(&serialized_attributes_in)) {
+      pResults[i] = CKR_TEMPLATE_INCONSISTENT;
+      continue;
+    }
+    vector<uint8_t> serialized_attributes_out;
+    pResults[i] = g_proxy->GetAttributeValue(*g_user_isolate,
+                                             hSession,
+                                             phObjects[i],
+                                             serialized_attributes_in,
+                                             &serialized_attributes_out);
+    if (pResults[i] == CKR_OK ||
+        pResults[i] == CKR_ATTRIBUTE_TYPE_INVALID ||
+        pResults[i] == CKR_ATTRIBUTE_SENSITIVE ||
+        pResults[i] == CKR_BUFFER_TOO_SMALL)
+      CHECK(attributes.ParseAndFill(serialized_attributes_out));
+  }
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_GetAttributeValues(CK_SESSION_HANDLE hSession,
+                                  CK_OBJECT_HANDLE_PTR phObjects,
+                                  CK_ULONG ulObjectCount,
+                                  CK_ATTRIBUTE_PTR pTemplates,
+                                  CK_ULONG ulAttributeCount,
+                                  CK_RV CK_PTR pResults) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulObjectCount, NULL);
+  LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+  LOG_CK_RV_AND_RETURN_IF((!phObjects || !pResults) && ulObjectCount > 0,
+                          CKR_ARGUMENTS_BAD);
+  LOG_CK_RV_AND_RETURN_IF(!pTemplates && ulAttributeCount > 0,
+                          CKR_ARGUMENTS_BAD);
+  // The templates all have the same types, so the first one decides.
+  if (CanDispatchDirectly(pTemplates, ulAttributeCount)) {
+    CK_RV result = g_service->GetAttributeValuesDirect(*g_user_isolate,
+                                                       hSession,
+                                                       phObjects,
+                                                       ulObjectCount,
+                                                       pTemplates,
+                                                       ulAttributeCount,
+                                                       pResults);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
+  GetAttributeValuesSerialized(hSession, phObjects, ulObjectCount, pTemplates,
+                               ulAttributeCount, pResults);
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_FindObjectsWithAttributes(CK_SESSION_HANDLE hSession,
+                                         CK_OBJECT_HANDLE_PTR phObject,
+                                         CK_ULONG ulMaxObjectCount,
+                                         CK_ULONG_PTR pulObjectCount,
+                                         CK_ATTRIBUTE_PTR pTemplates,
+                                         CK_ULONG ulAttributeCount,
+                                         CK_RV CK_PTR pResults) {
+  P11NET_TIME_CALL();
+  P11NET_TRACE_CALL();
+  P11NET_RECORD_CALL(hSession, ulMaxObjectCount, pulObjectCount);
+  LOG_CK_RV_AND_RETURN_IF(!g_is_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+  LOG_CK_RV_AND_RETURN_IF(!phObject || !pulObjectCount || !pResults,
+                          CKR_ARGUMENTS_BAD);
+  LOG_CK_RV_AND_RETURN_IF(!pTemplates && ulAttributeCount > 0,
+                          CKR_ARGUMENTS_BAD);
+  if (CanDispatchDirectly(pTemplates, ulAttributeCount)) {
+    CK_RV result = g_service->FindObjectsWithAttributesDirect(
+        *g_user_isolate, hSession, ulMaxObjectCount, phObject, pulObjectCount,
+        pTemplates, ulAttributeCount, pResults);
+    LOG_CK_RV_AND_RETURN_IF_ERR(result);
+    VLOG(1) << __func__ << " - CKR_OK";
+    return CKR_OK;
+  }
+  vector<uint64_t> object_list;
+  CK_RV result = g_proxy->FindObjects(*g_user_isolate, hSession,
+                                      ulMaxObjectCount, &object_list);
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  LOG_CK_RV_AND_RETURN_IF(object_list.size() > ulMaxObjectCount,
+                          CKR_GENERAL_ERROR);
+  *pulObjectCount = static_cast<CK_ULONG>(object_list.size());
+  for (size_t i = 0; i < object_list.size(); i++) {
+    phObject[i] = static_cast<CK_OBJECT_HANDLE>(object_list[i]);
+  }
+  GetAttributeValuesSerialized(hSession, phObject, *pulObjectCount,
+                               pTemplates, ulAttributeCount, pResults);
+  VLOG(1) << __func__ << " - CKR_OK";
+  return CKR_OK;
+}
+
+// P11Net vendor extension, see p11net_ext.h.
+CK_RV C_P11Net_GetFunctionList(CK_P11NET_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+  static CK_P11NET_FUNCTION_LIST function_list = {
+    {P11NET_FUNCTION_LIST_VERSION_MAJOR, P11NET_FUNCTION_LIST_VERSION_MINOR},
+    &C_P11Net_GetMetrics,
+    &C_P11Net_SetSessionPriority,
+    &C_P11Net_SignBatch,
+    &C_P11Net_DecryptBatch,
+    &C_P11Net_SignSubmit,
+    &C_P11Net_DecryptSubmit,
+    &C_P11Net_GetCompletionFd,
+    &C_P11Net_GetCompleted,
+    &C_P11Net_Collect,
+    &C_P11Net_GetAttributeValues,
+    &C_P11Net_FindObjectsWithAttributes
+  };
+  LOG_CK_RV_AND_RETURN_IF(!ppFunctionList, CKR_ARGUMENTS_BAD);
+  *ppFunctionList = &function_list;
+  return CKR_OK;
+}
@@ -10,6 +10,17 @@
 
 #include "pkcs11/cryptoki.h"
 
+// ECDSA mechanisms of PKCS #11 v2.40, which pkcs11t.h predates.
+#ifndef CKM_ECDSA_SHA256
+#define CKM_ECDSA_SHA256 0x00001044
+#endif
+#ifndef CKM_ECDSA_SHA384
+#define CKM_ECDSA_SHA384 0x00001045
+#endif
+#ifndef CKM_ECDSA_SHA512
+#define CKM_ECDSA_SHA512 0x00001046
+#endif
+
 namespace p11net {
 
 extern const char* kP11NetServicePath;
@@ -19,6 +30,7 @@ extern const CK_ATTRIBUTE_TYPE kKeyBlobAttribute;
 extern const CK_ATTRIBUTE_TYPE kAuthDataAttribute;
 extern const CK_ATTRIBUTE_TYPE kLegacyAttribute;
 extern const CK_ATTRIBUTE_TYPE kKeyLocationAttribute;
+extern const CK_ATTRIBUTE_TYPE kCertificateLocationAttribute;
 
 }  // namespace p11net
 
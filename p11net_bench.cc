@@ -0,0 +1,379 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// p11net_bench loads a PKCS #11 module and measures the throughput and latency
+// of a workload against it. Sample usage:
+//    p11net_bench --module=./libp11net.so --workload=sign --threads=8
+//        --sessions=16 --duration=30 --pin=1234 --label=mykey
+// Workloads:
+//    sign    - C_SignInit and C_Sign with CKM_SHA256_RSA_PKCS.
+//    decrypt - C_DecryptInit and C_Decrypt with CKM_RSA_PKCS of a message
+//              encrypted once with the matching public key.
+//    find    - C_FindObjectsInit, C_FindObjects and C_FindObjectsFinal for the
+//              private key.
+//    login   - C_Initialize, C_OpenSession, C_Login, a search for the private
+//              key and C_Finalize, i.e. the cost of loading the token. Always
+//              runs on one thread.
+// Every thread owns sessions/threads sessions and uses them in turn, since a
+// PKCS #11 session runs one operation at a time.
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pkcs11/cryptoki.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char kUsage[] =
+    "Usage: p11net_bench --module=PATH [--workload=sign|decrypt|find|login]\n"
+    "           [--threads=N] [--sessions=M] [--duration=SECONDS]\n"
+    "           [--warmup=SECONDS] [--slot=ID] [--pin=PIN] [--label=LABEL]\n";
+
+struct Options {
+  string module;
+  string workload = "sign";
+  int threads = 1;
+  int sessions = 0;
+  int duration = 10;
+  int warmup = 1;
+  CK_SLOT_ID slot = 0;
+  string pin;
+  string label;
+};
+
+// The latencies, in microseconds, and error count of one thread.
+struct ThreadResult {
+  vector<uint32_t> latencies;
+  uint64_t errors = 0;
+  CK_RV last_error = CKR_OK;
+};
+
+CK_FUNCTION_LIST_PTR g_functions = NULL;
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  std::map<string, string> values;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+      fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
+      return false;
+    }
+    values[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+  }
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    const string& name = it->first;
+    const string& value = it->second;
+    if (name == "module")
+      options->module = value;
+    else if (name == "workload")
+      options->workload = value;
+    else if (name == "threads")
+      options->threads = atoi(value.c_str());
+    else if (name == "sessions")
+      options->sessions = atoi(value.c_str());
+    else if (name == "duration")
+      options->duration = atoi(value.c_str());
+    else if (name == "warmup")
+      options->warmup = atoi(value.c_str());
+    else if (name == "slot")
+      options->slot = strtoul(value.c_str(), NULL, 0);
+    else if (name == "pin")
+      options->pin = value;
+    else if (name == "label")
+      options->label = value;
+    else {
+      fprintf(stderr, "Unknown option: --%s\n", name.c_str());
+      return false;
+    }
+  }
+  if (options->module.empty() || options->threads < 1 ||
+      options->duration < 1 || options->warmup < 0)
+    return false;
+  if (options->workload == "login")
+    options->threads = 1;
+  // At least one session per thread.
+  options->sessions = std::max(options->sessions, options->threads);
+  return options->workload == "sign" || options->workload == "decrypt" ||
+         options->workload == "find" || options->workload == "login";
+}
+
+bool LoadModule(const string& path) {
+  void* module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!module) {
+    fprintf(stderr, "Failed to load %s: %s\n", path.c_str(), dlerror());
+    return false;
+  }
+  CK_C_GetFunctionList get_function_list = reinterpret_cast<
+      CK_C_GetFunctionList>(dlsym(module, "C_GetFunctionList"));
+  if (!get_function_list || get_function_list(&g_functions) != CKR_OK) {
+    fprintf(stderr, "%s is not a PKCS #11 module.\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Check(CK_RV rv, const char* function) {
+  if (rv == CKR_OK)
+    return true;
+  fprintf(stderr, "%s failed: 0x%lx\n", function, rv);
+  return false;
+}
+
+// Opens a session on the slot.
+bool OpenSession(const Options& options, CK_SESSION_HANDLE* session) {
+  return Check(g_functions->C_OpenSession(options.slot, CKF_SERIAL_SESSION,
+                                          NULL, NULL, session),
+               "C_OpenSession");
+}
+
+bool Login(const Options& options, CK_SESSION_HANDLE session) {
+  if (options.pin.empty())
+    return true;
+  CK_RV rv = g_functions->C_Login(
+      session, CKU_USER,
+      reinterpret_cast<CK_UTF8CHAR_PTR>(const_cast<char*>(options.pin.data())),
+      options.pin.size());
+  return rv == CKR_USER_ALREADY_LOGGED_IN || Check(rv, "C_Login");
+}
+
+// Finds the first key of the given class, with the label if one was given.
+CK_RV FindKey(const Options& options,
+              CK_SESSION_HANDLE session,
+              CK_OBJECT_CLASS key_class,
+              CK_OBJECT_HANDLE* key) {
+  CK_ATTRIBUTE search_template[] = {
+    {CKA_CLASS, &key_class, sizeof(key_class)},
+    {CKA_LABEL, const_cast<char*>(options.label.data()), options.label.size()},
+  };
+  const CK_ULONG num_attributes = options.label.empty() ? 1 : 2;
+  CK_RV rv = g_functions->C_FindObjectsInit(session, search_template,
+                                            num_attributes);
+  if (rv != CKR_OK)
+    return rv;
+  CK_ULONG count = 0;
+  rv = g_functions->C_FindObjects(session, key, 1, &count);
+  CK_RV final_rv = g_functions->C_FindObjectsFinal(session);
+  if (rv == CKR_OK && count == 0)
+    rv = CKR_KEY_HANDLE_INVALID;
+  return rv != CKR_OK ? rv : final_rv;
+}
+
+// Encrypts a message with the public key matching the label, for the decrypt
+// workload.
+bool PrepareCipherText(const Options& options,
+                       CK_SESSION_HANDLE session,
+                       vector<CK_BYTE>* cipher_text) {
+  CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+  if (!Check(FindKey(options, session, CKO_PUBLIC_KEY, &public_key),
+             "Finding the public key"))
+    return false;
+  CK_MECHANISM mechanism = {CKM_RSA_PKCS, NULL, 0};
+  CK_BYTE message[32];
+  memset(message, 0x5a, sizeof(message));
+  if (!Check(g_functions->C_EncryptInit(session, &mechanism, public_key),
+             "C_EncryptInit"))
+    return false;
+  CK_ULONG length = 0;
+  if (!Check(g_functions->C_Encrypt(session, message, sizeof(message), NULL,
+                                    &length),
+             "C_Encrypt"))
+    return false;
+  cipher_text->resize(length);
+  if (!Check(g_functions->C_Encrypt(session, message, sizeof(message),
+                                    cipher_text->data(), &length),
+             "C_Encrypt"))
+    return false;
+  cipher_text->resize(length);
+  return true;
+}
+
+// Runs one operation of the workload on 'session'.
+CK_RV RunOperation(const Options& options,
+                   CK_SESSION_HANDLE session,
+                   CK_OBJECT_HANDLE private_key,
+                   const vector<CK_BYTE>& cipher_text) {
+  CK_BYTE output[1024];
+  CK_ULONG output_length = sizeof(output);
+  if (options.workload == "sign") {
+    CK_MECHANISM mechanism = {CKM_SHA256_RSA_PKCS, NULL, 0};
+    CK_BYTE data[64];
+    memset(data, 0xa5, sizeof(data));
+    CK_RV rv = g_functions->C_SignInit(session, &mechanism, private_key);
+    if (rv != CKR_OK)
+      return rv;
+    return g_functions->C_Sign(session, data, sizeof(data), output,
+                               &output_length);
+  }
+  if (options.workload == "decrypt") {
+    CK_MECHANISM mechanism = {CKM_RSA_PKCS, NULL, 0};
+    CK_RV rv = g_functions->C_DecryptInit(session, &mechanism, private_key);
+    if (rv != CKR_OK)
+      return rv;
+    return g_functions->C_Decrypt(
+        session, const_cast<CK_BYTE_PTR>(cipher_text.data()),
+        cipher_text.size(), output, &output_length);
+  }
+  CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+  return FindKey(options, session, CKO_PRIVATE_KEY, &key);
+}
+
+// Loads the token from scratch: the login workload.
+CK_RV RunLoginCycle(const Options& options) {
+  CK_RV rv = g_functions->C_Initialize(NULL);
+  if (rv != CKR_OK)
+    return rv;
+  CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+  rv = g_functions->C_OpenSession(options.slot, CKF_SERIAL_SESSION, NULL, NULL,
+                                  &session);
+  if (rv == CKR_OK && !options.pin.empty()) {
+    rv = g_functions->C_Login(
+        session, CKU_USER,
+        reinterpret_cast<CK_UTF8CHAR_PTR>(
+            const_cast<char*>(options.pin.data())),
+        options.pin.size());
+  }
+  if (rv == CKR_OK) {
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    rv = FindKey(options, session, CKO_PRIVATE_KEY, &key);
+  }
+  CK_RV finalize_rv = g_functions->C_Finalize(NULL);
+  return rv != CKR_OK ? rv : finalize_rv;
+}
+
+void RunThread(const Options& options,
+               const vector<CK_SESSION_HANDLE>& sessions,
+               CK_OBJECT_HANDLE private_key,
+               const vector<CK_BYTE>& cipher_text,
+               const Clock::time_point& measure_start,
+               const Clock::time_point& end,
+               ThreadResult* result) {
+  size_t next_session = 0;
+  for (Clock::time_point now = Clock::now(); now < end;) {
+    CK_RV rv = options.workload == "login" ?
+        RunLoginCycle(options) :
+        RunOperation(options, sessions[next_session], private_key,
+                     cipher_text);
+    next_session = (next_session + 1) % std::max<size_t>(sessions.size(), 1);
+    const Clock::time_point done = Clock::now();
+    if (now >= measure_start && done < end) {
+      if (rv == CKR_OK) {
+        result->latencies.push_back(static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                done - now).count()));
+      } else {
+        ++result->errors;
+        result->last_error = rv;
+      }
+    }
+    now = done;
+  }
+}
+
+// Returns the latency at the given percentile (0-100) of sorted latencies.
+uint32_t GetPercentile(const vector<uint32_t>& sorted, double percentile) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = static_cast<size_t>(percentile / 100 * sorted.size());
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+void Report(const Options& options, const vector<ThreadResult>& results) {
+  vector<uint32_t> latencies;
+  uint64_t errors = 0;
+  CK_RV last_error = CKR_OK;
+  for (const ThreadResult& result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(),
+                     result.latencies.end());
+    errors += result.errors;
+    if (result.errors)
+      last_error = result.last_error;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("workload:   %s\n", options.workload.c_str());
+  printf("threads:    %d\n", options.threads);
+  printf("sessions:   %d\n", options.sessions);
+  printf("operations: %zu\n", latencies.size());
+  printf("errors:     %llu", static_cast<unsigned long long>(errors));
+  if (errors)
+    printf(" (last 0x%lx)", last_error);
+  printf("\n");
+  printf("throughput: %.1f ops/s\n",
+         static_cast<double>(latencies.size()) / options.duration);
+  printf("latency:    p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+         GetPercentile(latencies, 50), GetPercentile(latencies, 99),
+         GetPercentile(latencies, 99.9),
+         latencies.empty() ? 0 : latencies.back());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  if (!LoadModule(options.module))
+    return 1;
+
+  // Sessions and keys are set up before the clock starts, except for the
+  // login workload, which measures exactly that.
+  vector<vector<CK_SESSION_HANDLE>> sessions(options.threads);
+  CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+  vector<CK_BYTE> cipher_text;
+  if (options.workload != "login") {
+    if (!Check(g_functions->C_Initialize(NULL), "C_Initialize"))
+      return 1;
+    for (int i = 0; i < options.sessions; ++i) {
+      CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+      if (!OpenSession(options, &session))
+        return 1;
+      sessions[i % options.threads].push_back(session);
+    }
+    if (!Login(options, sessions[0][0]))
+      return 1;
+    if (!Check(FindKey(options, sessions[0][0], CKO_PRIVATE_KEY, &private_key),
+               "Finding the private key"))
+      return 1;
+    if (options.workload == "decrypt" &&
+        !PrepareCipherText(options, sessions[0][0], &cipher_text))
+      return 1;
+  }
+
+  const Clock::time_point measure_start =
+      Clock::now() + std::chrono::seconds(options.warmup);
+  const Clock::time_point end =
+      measure_start + std::chrono::seconds(options.duration);
+  vector<ThreadResult> results(options.threads);
+  vector<std::thread> threads;
+  for (int i = 0; i < options.threads; ++i) {
+    threads.push_back(std::thread(RunThread, std::cref(options),
+                                  std::cref(sessions[i]), private_key,
+                                  std::cref(cipher_text), measure_start, end,
+                                  &results[i]));
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  if (options.workload != "login")
+    g_functions->C_Finalize(NULL);
+  Report(options, results);
+  return 0;
+}
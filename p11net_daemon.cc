@@ -0,0 +1,1122 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "p11net_daemon.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <boost/optional.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "ipc_message.h"
+#include "pkcs11/cryptoki.h"
+#include "shm_channel.h"
+
+using brillo::SecureBlob;
+
+namespace p11net {
+
+namespace {
+
+// The connections the socket queues before they are accepted.
+const int kListenBacklog = 128;
+
+const std::string* OptionalToPointer(
+    const boost::optional<std::string>& value) {
+  return value ? &*value : NULL;
+}
+
+// Returns true if the first argument of 'method' is a session handle.
+bool TakesSession(uint32_t method) {
+  return method == kIpcInitPIN || method == kIpcSetPIN ||
+         method == kIpcCloseSession ||
+         (method >= kIpcGetSessionInfo && method <= kIpcGenerateRandom);
+}
+
+}  // namespace
+
+P11NetDaemon::P11NetDaemon(P11NetInterface* service,
+                           const std::string& socket_path,
+                           size_t ring_size)
+    : service_(service),
+      socket_path_(socket_path),
+      ring_size_(ring_size),
+      listen_socket_(-1),
+      event_sequence_(1) {}
+
+P11NetDaemon::~P11NetDaemon() {
+  if (listen_socket_ >= 0) {
+    close(listen_socket_);
+    unlink(socket_path_.c_str());
+  }
+}
+
+bool P11NetDaemon::Init() {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "The daemon socket path is too long: " << socket_path_;
+    return false;
+  }
+  memcpy(address.sun_path, socket_path_.data(), socket_path_.size());
+  listen_socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_socket_ < 0) {
+    PLOG(ERROR) << "Failed to create a socket";
+    return false;
+  }
+  // A daemon that did not shut down cleanly left its socket behind.
+  unlink(socket_path_.c_str());
+  // The socket is created without access for other users, so that none of
+  // them can connect before the chmod below.
+  mode_t old_umask = umask(S_IXUSR | S_IXGRP | S_IRWXO);
+  int result = bind(listen_socket_,
+                    reinterpret_cast<struct sockaddr*>(&address),
+                    sizeof(address));
+  umask(old_umask);
+  if (result != 0 || listen(listen_socket_, kListenBacklog) != 0) {
+    PLOG(ERROR) << "Failed to listen on " << socket_path_;
+    close(listen_socket_);
+    listen_socket_ = -1;
+    return false;
+  }
+  // Processes of the daemon's user and group may connect.
+  chmod(socket_path_.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  LOG(INFO) << "Listening for modules on " << socket_path_;
+  return true;
+}
+
+void P11NetDaemon::Run() {
+  CHECK_GE(listen_socket_, 0);
+  while (true) {
+    int socket = accept4(listen_socket_, NULL, NULL, SOCK_CLOEXEC);
+    if (socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+          errno == ENFILE)
+        continue;
+      PLOG(ERROR) << "Failed to accept a connection on " << socket_path_;
+      return;
+    }
+    boost::thread(&P11NetDaemon::Serve, this, socket).detach();
+  }
+}
+
+void P11NetDaemon::Serve(int socket) {
+  struct ucred peer;
+  socklen_t peer_size = sizeof(peer);
+  if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0) {
+    PLOG(WARNING) << "Failed to identify a module";
+    close(socket);
+    return;
+  }
+  std::unique_ptr<ShmChannel> channel = ShmChannel::Accept(socket, ring_size_);
+  if (!channel)
+    return;
+  VLOG(1) << "Process " << peer.pid << " connected.";
+  std::shared_ptr<Client> client = AddConnection(peer.pid);
+  IpcReader request;
+  IpcWriter response;
+  while (channel->Receive(request.Reset())) {
+    response.mutable_data()->clear();
+    if (!Dispatch(client.get(), &request, &response) ||
+        !request.IsComplete()) {
+      LOG(WARNING) << "Malformed request from process " << peer.pid;
+      break;
+    }
+    if (!channel->Send(response.data()))
+      break;
+  }
+  RemoveConnection(peer.pid, client);
+}
+
+std::shared_ptr<P11NetDaemon::Client> P11NetDaemon::AddConnection(pid_t pid) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  std::shared_ptr<Client>& client = clients_[pid];
+  if (!client)
+    client = std::make_shared<Client>();
+  ++client->connections;
+  return client;
+}
+
+void P11NetDaemon::RemoveConnection(pid_t pid,
+                                    const std::shared_ptr<Client>& client) {
+  {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    if (--client->connections > 0)
+      return;
+    clients_.erase(pid);
+  }
+  boost::lock_guard<boost::mutex> lock(client->lock);
+  if (!client->sessions.empty()) {
+    LOG(INFO) << "Closing " << client->sessions.size()
+              << " sessions left open by process " << pid;
+  }
+  for (auto i = client->sessions.begin(); i != client->sessions.end(); ++i)
+    service_->CloseSession(i->second.isolate_credential, i->first);
+  client->sessions.clear();
+}
+
+void P11NetDaemon::PostSlotEvent(int slot_id) {
+  boost::lock_guard<boost::mutex> lock(events_lock_);
+  slot_events_[slot_id] = ++event_sequence_;
+}
+
+bool P11NetDaemon::OwnsSession(Client* client, uint64_t session_id) {
+  boost::lock_guard<boost::mutex> lock(client->lock);
+  return client->sessions.count(session_id) > 0;
+}
+
+bool P11NetDaemon::Dispatch(Client* client,
+                            IpcReader* request,
+                            IpcWriter* response) {
+  uint32_t method = 0;
+  SecureBlob isolate_credential;
+  if (!request->Read(&method, &isolate_credential))
+    return false;
+  if (TakesSession(method)) {
+    // Session handles are shared by all processes of the daemon; one must
+    // not reach the sessions of another.
+    uint64_t session_id = 0;
+    if (!request->Peek(&session_id))
+      return false;
+    if (!OwnsSession(client, session_id)) {
+      request->Discard();
+      response->Write(static_cast<uint32_t>(CKR_SESSION_HANDLE_INVALID));
+      return true;
+    }
+  }
+  switch (method) {
+    case kIpcGetSlotEvents: {
+      uint64_t sequence = 0;
+      std::vector<uint64_t> slots;
+      if (!request->Read(&sequence))
+        return false;
+      {
+        boost::lock_guard<boost::mutex> lock(events_lock_);
+        // A caller without a sequence number only learns the current one.
+        for (auto i = slot_events_.begin();
+             sequence > 0 && i != slot_events_.end(); ++i) {
+          if (i->second > sequence)
+            slots.push_back(i->first);
+        }
+        sequence = event_sequence_;
+      }
+      response->Write(static_cast<uint32_t>(CKR_OK), sequence, slots);
+      return true;
+    }
+    case kIpcGetSlotList: {
+      bool token_present = false;
+      std::vector<uint64_t> slot_list;
+      if (!request->Read(&token_present))
+        return false;
+      const uint32_t result = service_->GetSlotList(
+          isolate_credential, token_present, &slot_list);
+      response->Write(result, slot_list);
+      return true;
+    }
+    case kIpcGetSlotInfo: {
+      uint64_t slot_id = 0;
+      std::vector<uint8_t> slot_description;
+      std::vector<uint8_t> manufacturer_id;
+      uint64_t flags = 0;
+      uint8_t hardware_version_major = 0;
+      uint8_t hardware_version_minor = 0;
+      uint8_t firmware_version_major = 0;
+      uint8_t firmware_version_minor = 0;
+      if (!request->Read(&slot_id))
+        return false;
+      const uint32_t result = service_->GetSlotInfo(
+          isolate_credential, slot_id, &slot_description, &manufacturer_id,
+          &flags, &hardware_version_major, &hardware_version_minor,
+          &firmware_version_major, &firmware_version_minor);
+      response->Write(result, slot_description, manufacturer_id, flags,
+                      hardware_version_major, hardware_version_minor,
+                      firmware_version_major, firmware_version_minor);
+      return true;
+    }
+    case kIpcGetTokenInfo: {
+      uint64_t slot_id = 0;
+      std::vector<uint8_t> label;
+      std::vector<uint8_t> manufacturer_id;
+      std::vector<uint8_t> model;
+      std::vector<uint8_t> serial_number;
+      uint64_t flags = 0;
+      uint64_t max_session_count = 0;
+      uint64_t session_count = 0;
+      uint64_t max_session_count_rw = 0;
+      uint64_t session_count_rw = 0;
+      uint64_t max_pin_len = 0;
+      uint64_t min_pin_len = 0;
+      uint64_t total_public_memory = 0;
+      uint64_t free_public_memory = 0;
+      uint64_t total_private_memory = 0;
+      uint64_t free_private_memory = 0;
+      uint8_t hardware_version_major = 0;
+      uint8_t hardware_version_minor = 0;
+      uint8_t firmware_version_major = 0;
+      uint8_t firmware_version_minor = 0;
+      if (!request->Read(&slot_id))
+        return false;
+      const uint32_t result = service_->GetTokenInfo(
+          isolate_credential, slot_id, &label, &manufacturer_id, &model,
+          &serial_number, &flags, &max_session_count, &session_count,
+          &max_session_count_rw, &session_count_rw, &max_pin_len, &min_pin_len,
+          &total_public_memory, &free_public_memory, &total_private_memory,
+          &free_private_memory, &hardware_version_major,
+          &hardware_version_minor, &firmware_version_major,
+          &firmware_version_minor);
+      response->Write(result, label, manufacturer_id, model, serial_number,
+                      flags, max_session_count, session_count,
+                      max_session_count_rw, session_count_rw, max_pin_len,
+                      min_pin_len, total_public_memory, free_public_memory,
+                      total_private_memory, free_private_memory,
+                      hardware_version_major, hardware_version_minor,
+                      firmware_version_major, firmware_version_minor);
+      return true;
+    }
+    case kIpcGetMechanismList: {
+      uint64_t slot_id = 0;
+      std::vector<uint64_t> mechanism_list;
+      if (!request->Read(&slot_id))
+        return false;
+      const uint32_t result = service_->GetMechanismList(
+          isolate_credential, slot_id, &mechanism_list);
+      response->Write(result, mechanism_list);
+      return true;
+    }
+    case kIpcGetMechanismInfo: {
+      uint64_t slot_id = 0;
+      uint64_t mechanism_type = 0;
+      uint64_t min_key_size = 0;
+      uint64_t max_key_size = 0;
+      uint64_t flags = 0;
+      if (!request->Read(&slot_id, &mechanism_type))
+        return false;
+      const uint32_t result = service_->GetMechanismInfo(
+          isolate_credential, slot_id, mechanism_type, &min_key_size,
+          &max_key_size, &flags);
+      response->Write(result, min_key_size, max_key_size, flags);
+      return true;
+    }
+    case kIpcInitToken: {
+      uint64_t slot_id = 0;
+      boost::optional<std::string> so_pin;
+      std::vector<uint8_t> label;
+      if (!request->Read(&slot_id, &so_pin, &label))
+        return false;
+      const uint32_t result = service_->InitToken(
+          isolate_credential, slot_id, OptionalToPointer(so_pin), label);
+      response->Write(result);
+      return true;
+    }
+    case kIpcInitPIN: {
+      uint64_t session_id = 0;
+      boost::optional<std::string> pin;
+      if (!request->Read(&session_id, &pin))
+        return false;
+      const uint32_t result = service_->InitPIN(
+          isolate_credential, session_id, OptionalToPointer(pin));
+      response->Write(result);
+      return true;
+    }
+    case kIpcSetPIN: {
+      uint64_t session_id = 0;
+      boost::optional<std::string> old_pin;
+      boost::optional<std::string> new_pin;
+      if (!request->Read(&session_id, &old_pin, &new_pin))
+        return false;
+      const uint32_t result = service_->SetPIN(
+          isolate_credential, session_id, OptionalToPointer(old_pin),
+          OptionalToPointer(new_pin));
+      response->Write(result);
+      return true;
+    }
+    case kIpcOpenSession: {
+      uint64_t slot_id = 0;
+      uint64_t flags = 0;
+      uint64_t session = 0;
+      if (!request->Read(&slot_id, &flags))
+        return false;
+      const uint32_t result = service_->OpenSession(
+          isolate_credential, slot_id, flags, &session);
+      if (result == CKR_OK) {
+        boost::lock_guard<boost::mutex> lock(client->lock);
+        Client::Session& info = client->sessions[session];
+        info.slot_id = slot_id;
+        info.isolate_credential = isolate_credential;
+      }
+      response->Write(result, session);
+      return true;
+    }
+    case kIpcCloseSession: {
+      uint64_t session = 0;
+      if (!request->Read(&session))
+        return false;
+      const uint32_t result = service_->CloseSession(
+          isolate_credential, session);
+      if (result == CKR_OK) {
+        boost::lock_guard<boost::mutex> lock(client->lock);
+        client->sessions.erase(session);
+      }
+      response->Write(result);
+      return true;
+    }
+    case kIpcCloseAllSessions: {
+      uint64_t slot_id = 0;
+      if (!request->Read(&slot_id))
+        return false;
+      // The sessions of other processes on the slot stay open.
+      std::vector<uint64_t> sessions;
+      {
+        boost::lock_guard<boost::mutex> lock(client->lock);
+        for (auto i = client->sessions.begin();
+             i != client->sessions.end();) {
+          if (i->second.slot_id == slot_id) {
+            sessions.push_back(i->first);
+            i = client->sessions.erase(i);
+          } else {
+            ++i;
+          }
+        }
+      }
+      for (auto i = sessions.begin(); i != sessions.end(); ++i)
+        service_->CloseSession(isolate_credential, *i);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcGetSessionInfo: {
+      uint64_t session_id = 0;
+      uint64_t slot_id = 0;
+      uint64_t state = 0;
+      uint64_t flags = 0;
+      uint64_t device_error = 0;
+      if (!request->Read(&session_id))
+        return false;
+      const uint32_t result = service_->GetSessionInfo(
+          isolate_credential, session_id, &slot_id, &state, &flags,
+          &device_error);
+      response->Write(result, slot_id, state, flags, device_error);
+      return true;
+    }
+    case kIpcSetSessionPriority: {
+      uint64_t session_id = 0;
+      uint64_t priority = 0;
+      if (!request->Read(&session_id, &priority))
+        return false;
+      const uint32_t result = service_->SetSessionPriority(
+          isolate_credential, session_id, priority);
+      response->Write(result);
+      return true;
+    }
+    case kIpcSignBatch: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      std::vector<std::vector<uint8_t>> inputs;
+      std::vector<std::vector<uint8_t>> outputs;
+      std::vector<uint32_t> results;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle, &inputs))
+        return false;
+      const uint32_t result = service_->SignBatch(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle, inputs, &outputs, &results);
+      response->Write(result, outputs, results);
+      return true;
+    }
+    case kIpcDecryptBatch: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      std::vector<std::vector<uint8_t>> inputs;
+      std::vector<std::vector<uint8_t>> outputs;
+      std::vector<uint32_t> results;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle, &inputs))
+        return false;
+      const uint32_t result = service_->DecryptBatch(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle, inputs, &outputs, &results);
+      response->Write(result, outputs, results);
+      return true;
+    }
+    case kIpcGetOperationState: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> operation_state;
+      if (!request->Read(&session_id))
+        return false;
+      const uint32_t result = service_->GetOperationState(
+          isolate_credential, session_id, &operation_state);
+      response->Write(result, operation_state);
+      return true;
+    }
+    case kIpcSetOperationState: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> operation_state;
+      uint64_t encryption_key_handle = 0;
+      uint64_t authentication_key_handle = 0;
+      if (!request->Read(&session_id, &operation_state, &encryption_key_handle,
+                         &authentication_key_handle))
+        return false;
+      const uint32_t result = service_->SetOperationState(
+          isolate_credential, session_id, operation_state,
+          encryption_key_handle, authentication_key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcLogin: {
+      uint64_t session_id = 0;
+      uint64_t user_type = 0;
+      boost::optional<std::string> pin;
+      if (!request->Read(&session_id, &user_type, &pin))
+        return false;
+      const uint32_t result = service_->Login(
+          isolate_credential, session_id, user_type, OptionalToPointer(pin));
+      response->Write(result);
+      return true;
+    }
+    case kIpcLogout: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      const uint32_t result = service_->Logout(isolate_credential, session_id);
+      response->Write(result);
+      return true;
+    }
+    case kIpcCreateObject: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> attributes;
+      uint64_t new_object_handle = 0;
+      if (!request->Read(&session_id, &attributes))
+        return false;
+      const uint32_t result = service_->CreateObject(
+          isolate_credential, session_id, attributes, &new_object_handle);
+      response->Write(result, new_object_handle);
+      return true;
+    }
+    case kIpcCopyObject: {
+      uint64_t session_id = 0;
+      uint64_t object_handle = 0;
+      std::vector<uint8_t> attributes;
+      uint64_t new_object_handle = 0;
+      if (!request->Read(&session_id, &object_handle, &attributes))
+        return false;
+      const uint32_t result = service_->CopyObject(
+          isolate_credential, session_id, object_handle, attributes,
+          &new_object_handle);
+      response->Write(result, new_object_handle);
+      return true;
+    }
+    case kIpcDestroyObject: {
+      uint64_t session_id = 0;
+      uint64_t object_handle = 0;
+      if (!request->Read(&session_id, &object_handle))
+        return false;
+      const uint32_t result = service_->DestroyObject(
+          isolate_credential, session_id, object_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcGetObjectSize: {
+      uint64_t session_id = 0;
+      uint64_t object_handle = 0;
+      uint64_t object_size = 0;
+      if (!request->Read(&session_id, &object_handle))
+        return false;
+      const uint32_t result = service_->GetObjectSize(
+          isolate_credential, session_id, object_handle, &object_size);
+      response->Write(result, object_size);
+      return true;
+    }
+    case kIpcGetAttributeValue: {
+      uint64_t session_id = 0;
+      uint64_t object_handle = 0;
+      std::vector<uint8_t> attributes_in;
+      std::vector<uint8_t> attributes_out;
+      if (!request->Read(&session_id, &object_handle, &attributes_in))
+        return false;
+      const uint32_t result = service_->GetAttributeValue(
+          isolate_credential, session_id, object_handle, attributes_in,
+          &attributes_out);
+      response->Write(result, attributes_out);
+      return true;
+    }
+    case kIpcSetAttributeValue: {
+      uint64_t session_id = 0;
+      uint64_t object_handle = 0;
+      std::vector<uint8_t> attributes;
+      if (!request->Read(&session_id, &object_handle, &attributes))
+        return false;
+      const uint32_t result = service_->SetAttributeValue(
+          isolate_credential, session_id, object_handle, attributes);
+      response->Write(result);
+      return true;
+    }
+    case kIpcFindObjectsInit: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> attributes;
+      if (!request->Read(&session_id, &attributes))
+        return false;
+      const uint32_t result = service_->FindObjectsInit(
+          isolate_credential, session_id, attributes);
+      response->Write(result);
+      return true;
+    }
+    case kIpcFindObjects: {
+      uint64_t session_id = 0;
+      uint64_t max_object_count = 0;
+      std::vector<uint64_t> object_list;
+      if (!request->Read(&session_id, &max_object_count))
+        return false;
+      const uint32_t result = service_->FindObjects(
+          isolate_credential, session_id, max_object_count, &object_list);
+      response->Write(result, object_list);
+      return true;
+    }
+    case kIpcFindObjectsFinal: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      const uint32_t result = service_->FindObjectsFinal(
+          isolate_credential, session_id);
+      response->Write(result);
+      return true;
+    }
+    case kIpcEncryptInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->EncryptInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcEncrypt: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->Encrypt(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcEncryptUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->EncryptUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcEncryptFinal: {
+      uint64_t session_id = 0;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &max_out_length))
+        return false;
+      const uint32_t result = service_->EncryptFinal(
+          isolate_credential, session_id, max_out_length, &actual_out_length,
+          &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcEncryptCancel: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      service_->EncryptCancel(isolate_credential, session_id);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcDecryptInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->DecryptInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcDecrypt: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->Decrypt(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcDecryptUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->DecryptUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcDecryptFinal: {
+      uint64_t session_id = 0;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &max_out_length))
+        return false;
+      const uint32_t result = service_->DecryptFinal(
+          isolate_credential, session_id, max_out_length, &actual_out_length,
+          &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcDecryptCancel: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      service_->DecryptCancel(isolate_credential, session_id);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcDigestInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter))
+        return false;
+      const uint32_t result = service_->DigestInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter);
+      response->Write(result);
+      return true;
+    }
+    case kIpcDigest: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> digest;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->Digest(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &digest);
+      response->Write(result, actual_out_length, digest);
+      return true;
+    }
+    case kIpcDigestUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      if (!request->Read(&session_id, &data_in))
+        return false;
+      const uint32_t result = service_->DigestUpdate(
+          isolate_credential, session_id, data_in);
+      response->Write(result);
+      return true;
+    }
+    case kIpcDigestKey: {
+      uint64_t session_id = 0;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &key_handle))
+        return false;
+      const uint32_t result = service_->DigestKey(
+          isolate_credential, session_id, key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcDigestFinal: {
+      uint64_t session_id = 0;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> digest;
+      if (!request->Read(&session_id, &max_out_length))
+        return false;
+      const uint32_t result = service_->DigestFinal(
+          isolate_credential, session_id, max_out_length, &actual_out_length,
+          &digest);
+      response->Write(result, actual_out_length, digest);
+      return true;
+    }
+    case kIpcDigestCancel: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      service_->DigestCancel(isolate_credential, session_id);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcSignInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->SignInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcSign: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> signature;
+      if (!request->Read(&session_id, &data, &max_out_length))
+        return false;
+      const uint32_t result = service_->Sign(
+          isolate_credential, session_id, data, max_out_length,
+          &actual_out_length, &signature);
+      response->Write(result, actual_out_length, signature);
+      return true;
+    }
+    case kIpcSignUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_part;
+      if (!request->Read(&session_id, &data_part))
+        return false;
+      const uint32_t result = service_->SignUpdate(
+          isolate_credential, session_id, data_part);
+      response->Write(result);
+      return true;
+    }
+    case kIpcSignFinal: {
+      uint64_t session_id = 0;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> signature;
+      if (!request->Read(&session_id, &max_out_length))
+        return false;
+      const uint32_t result = service_->SignFinal(
+          isolate_credential, session_id, max_out_length, &actual_out_length,
+          &signature);
+      response->Write(result, actual_out_length, signature);
+      return true;
+    }
+    case kIpcSignCancel: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      service_->SignCancel(isolate_credential, session_id);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcSignRecoverInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->SignRecoverInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcSignRecover: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> signature;
+      if (!request->Read(&session_id, &data, &max_out_length))
+        return false;
+      const uint32_t result = service_->SignRecover(
+          isolate_credential, session_id, data, max_out_length,
+          &actual_out_length, &signature);
+      response->Write(result, actual_out_length, signature);
+      return true;
+    }
+    case kIpcVerifyInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->VerifyInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcVerify: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data;
+      std::vector<uint8_t> signature;
+      if (!request->Read(&session_id, &data, &signature))
+        return false;
+      const uint32_t result = service_->Verify(
+          isolate_credential, session_id, data, signature);
+      response->Write(result);
+      return true;
+    }
+    case kIpcVerifyUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_part;
+      if (!request->Read(&session_id, &data_part))
+        return false;
+      const uint32_t result = service_->VerifyUpdate(
+          isolate_credential, session_id, data_part);
+      response->Write(result);
+      return true;
+    }
+    case kIpcVerifyFinal: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> signature;
+      if (!request->Read(&session_id, &signature))
+        return false;
+      const uint32_t result = service_->VerifyFinal(
+          isolate_credential, session_id, signature);
+      response->Write(result);
+      return true;
+    }
+    case kIpcVerifyCancel: {
+      uint64_t session_id = 0;
+      if (!request->Read(&session_id))
+        return false;
+      service_->VerifyCancel(isolate_credential, session_id);
+      response->Write(static_cast<uint32_t>(CKR_OK));
+      return true;
+    }
+    case kIpcVerifyRecoverInit: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &key_handle))
+        return false;
+      const uint32_t result = service_->VerifyRecoverInit(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          key_handle);
+      response->Write(result);
+      return true;
+    }
+    case kIpcVerifyRecover: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> signature;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data;
+      if (!request->Read(&session_id, &signature, &max_out_length))
+        return false;
+      const uint32_t result = service_->VerifyRecover(
+          isolate_credential, session_id, signature, max_out_length,
+          &actual_out_length, &data);
+      response->Write(result, actual_out_length, data);
+      return true;
+    }
+    case kIpcDigestEncryptUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->DigestEncryptUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcDecryptDigestUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->DecryptDigestUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcSignEncryptUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->SignEncryptUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcDecryptVerifyUpdate: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> data_in;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> data_out;
+      if (!request->Read(&session_id, &data_in, &max_out_length))
+        return false;
+      const uint32_t result = service_->DecryptVerifyUpdate(
+          isolate_credential, session_id, data_in, max_out_length,
+          &actual_out_length, &data_out);
+      response->Write(result, actual_out_length, data_out);
+      return true;
+    }
+    case kIpcGenerateKey: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      std::vector<uint8_t> attributes;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &attributes))
+        return false;
+      const uint32_t result = service_->GenerateKey(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          attributes, &key_handle);
+      response->Write(result, key_handle);
+      return true;
+    }
+    case kIpcGenerateKeyPair: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      std::vector<uint8_t> public_attributes;
+      std::vector<uint8_t> private_attributes;
+      uint64_t public_key_handle = 0;
+      uint64_t private_key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &public_attributes, &private_attributes))
+        return false;
+      const uint32_t result = service_->GenerateKeyPair(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          public_attributes, private_attributes, &public_key_handle,
+          &private_key_handle);
+      response->Write(result, public_key_handle, private_key_handle);
+      return true;
+    }
+    case kIpcWrapKey: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t wrapping_key_handle = 0;
+      uint64_t key_handle = 0;
+      uint64_t max_out_length = 0;
+      uint64_t actual_out_length = 0;
+      std::vector<uint8_t> wrapped_key;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &wrapping_key_handle, &key_handle, &max_out_length))
+        return false;
+      const uint32_t result = service_->WrapKey(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          wrapping_key_handle, key_handle, max_out_length, &actual_out_length,
+          &wrapped_key);
+      response->Write(result, actual_out_length, wrapped_key);
+      return true;
+    }
+    case kIpcUnwrapKey: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t wrapping_key_handle = 0;
+      std::vector<uint8_t> wrapped_key;
+      std::vector<uint8_t> attributes;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &wrapping_key_handle, &wrapped_key, &attributes))
+        return false;
+      const uint32_t result = service_->UnwrapKey(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          wrapping_key_handle, wrapped_key, attributes, &key_handle);
+      response->Write(result, key_handle);
+      return true;
+    }
+    case kIpcDeriveKey: {
+      uint64_t session_id = 0;
+      uint64_t mechanism_type = 0;
+      std::vector<uint8_t> mechanism_parameter;
+      uint64_t base_key_handle = 0;
+      std::vector<uint8_t> attributes;
+      uint64_t key_handle = 0;
+      if (!request->Read(&session_id, &mechanism_type, &mechanism_parameter,
+                         &base_key_handle, &attributes))
+        return false;
+      const uint32_t result = service_->DeriveKey(
+          isolate_credential, session_id, mechanism_type, mechanism_parameter,
+          base_key_handle, attributes, &key_handle);
+      response->Write(result, key_handle);
+      return true;
+    }
+    case kIpcSeedRandom: {
+      uint64_t session_id = 0;
+      std::vector<uint8_t> seed;
+      if (!request->Read(&session_id, &seed))
+        return false;
+      const uint32_t result = service_->SeedRandom(
+          isolate_credential, session_id, seed);
+      response->Write(result);
+      return true;
+    }
+    case kIpcGenerateRandom: {
+      uint64_t session_id = 0;
+      uint64_t num_bytes = 0;
+      std::vector<uint8_t> random_data;
+      if (!request->Read(&session_id, &num_bytes))
+        return false;
+      const uint32_t result = service_->GenerateRandom(
+          isolate_credential, session_id, num_bytes, &random_data);
+      response->Write(result, random_data);
+      return true;
+    }
+  }
+  LOG(WARNING) << "Unknown method " << method;
+  return false;
+}
+
+}  // namespace p11net
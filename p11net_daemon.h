@@ -0,0 +1,106 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_P11NET_DAEMON_H_
+#define P11NET_P11NET_DAEMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/thread/mutex.hpp>
+#include <brillo/secure_blob.h>
+
+#include "p11net_interface.h"
+
+namespace p11net {
+
+class IpcReader;
+class IpcWriter;
+
+// P11NetDaemon serves the P11NetProxyImpl of modules on a UNIX socket and
+// runs their calls on one P11NetInterface, normally the P11NetServiceImpl of
+// p11netd. Each connection gets a ShmChannel and a thread that runs its calls
+// one after another. The daemon trusts the processes that can connect to its
+// socket; they share the daemon's login state. It keeps track of the sessions
+// each process opened, so that C_CloseAllSessions only closes the caller's,
+// calls on the sessions of other processes fail with
+// CKR_SESSION_HANDLE_INVALID, and the sessions of a process are closed once
+// its last channel closes. Slot events are kept for the modules to poll.
+// Sample usage:
+//    P11NetDaemon daemon(service, "/run/p11net/socket", 1 << 20);
+//    if (!daemon.Init())
+//      return 1;
+//    daemon.Run();
+class P11NetDaemon {
+ public:
+  //  service - The calls are run on it. Not owned.
+  //  socket_path - Where to listen for modules. An existing socket there is
+  //                replaced.
+  //  ring_size - The bytes of each ring of a channel, which bounds the size of
+  //              requests and responses.
+  P11NetDaemon(P11NetInterface* service,
+               const std::string& socket_path,
+               size_t ring_size);
+  ~P11NetDaemon();
+
+  // Listens on the socket.
+  bool Init();
+  // Accepts connections until the socket fails.
+  void Run();
+
+  // Records that the state of a slot changed, for the modules to report from
+  // C_WaitForSlotEvent. It may be called on any thread.
+  void PostSlotEvent(int slot_id);
+
+ private:
+  // The state of a module process, shared by its connections.
+  struct Client {
+    struct Session {
+      uint64_t slot_id;
+      brillo::SecureBlob isolate_credential;
+    };
+    Client() : connections(0) {}
+    // Guarded by the lock of the daemon.
+    size_t connections;
+    boost::mutex lock;
+    std::map<uint64_t, Session> sessions;
+  };
+
+  // Runs the calls of a connection until it closes. Takes 'socket'.
+  void Serve(int socket);
+  // Registers a connection of process 'pid' and returns the process's state.
+  std::shared_ptr<Client> AddConnection(pid_t pid);
+  // Forgets a connection and closes the sessions of its process if it was
+  // the last one.
+  void RemoveConnection(pid_t pid, const std::shared_ptr<Client>& client);
+  // Runs one request and writes its response. Returns false if the request
+  // is malformed.
+  bool Dispatch(Client* client, IpcReader* request, IpcWriter* response);
+  // Returns true if 'client' opened the session.
+  bool OwnsSession(Client* client, uint64_t session_id);
+
+  P11NetInterface* service_;
+  const std::string socket_path_;
+  const size_t ring_size_;
+  int listen_socket_;
+  boost::mutex lock_;
+  std::map<pid_t, std::shared_ptr<Client>> clients_;
+  boost::mutex events_lock_;
+  // Counts the slot events; each slot maps to the number of its last one.
+  uint64_t event_sequence_;
+  std::map<uint64_t, uint64_t> slot_events_;
+
+  DISALLOW_COPY_AND_ASSIGN(P11NetDaemon);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_P11NET_DAEMON_H_
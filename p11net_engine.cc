@@ -0,0 +1,528 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// An OpenSSL engine that serves the keys of the NetHSM straight from
+// NetUtility, for TLS servers that would otherwise reach them through a
+// PKCS #11 engine, the C_* functions, P11NetServiceImpl and SessionImpl. It
+// shares the configuration of the module (P11NET_URL and the others, or
+// P11NET_BACKEND=sim), along with its key inventory cache and connection
+// pools. Keys are named by their NetHSM key identifier. RSA keys sign and
+// decrypt with PKCS #1 v1.5 padding and EC keys sign with ECDSA; operations
+// with other paddings are refused, since the NetHSM has no raw RSA action.
+// Built with WITH_OPENSSL_ENGINE, the engine must be loaded by the OpenSSL
+// the module is built against. Sample configuration:
+//    [engine_section]
+//    p11net = p11net_section
+//    [p11net_section]
+//    engine_id = p11net
+//    dynamic_path = /usr/local/lib/libp11net_engine.so
+//    init = 0
+// and for nginx:
+//    ssl_engine p11net;
+//    ssl_certificate_key engine:p11net:webserver;
+
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/macros.h>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+#include "handle_generator.h"
+#include "metrics.h"
+#include "net_utility.h"
+#include "object.h"
+#include "object_pool.h"
+#include "object_store.h"
+#include "p11net.h"
+#include "p11net_factory_impl.h"
+#include "p11net_utility.h"
+
+namespace p11net {
+
+namespace {
+
+const char kEngineId[] = "p11net";
+const char kEngineName[] = "p11net NetHSM engine";
+
+typedef std::shared_ptr<const KeyTarget> KeyTargetPtr;
+
+class CountingHandleGenerator : public HandleGenerator {
+ public:
+  CountingHandleGenerator() : next_handle_(1) {}
+  virtual int CreateHandle() { return next_handle_++; }
+
+ private:
+  std::atomic<int> next_handle_;
+};
+
+// The NetUtility of the engine and the object pool it lists the keys in.
+// There is one per process, created on first use.
+class EngineState {
+ public:
+  static EngineState* Get() {
+    static EngineState* const state = new EngineState();
+    return state;
+  }
+
+  // Connects to the NetHSM unless that was done already. Returns false on
+  // failure.
+  bool Init();
+
+  NetUtility* net_utility() const { return net_utility_.get(); }
+
+  // Loads the key 'key_id' and finds its private and public key objects.
+  // Returns false if the key has no private key object.
+  bool FindKey(const std::string& key_id,
+               const Object** private_key,
+               const Object** public_key);
+
+ private:
+  EngineState() {}
+
+  boost::mutex lock_;
+  std::shared_ptr<P11NetFactoryImpl> factory_;
+  std::shared_ptr<ObjectPool> pool_;
+  std::shared_ptr<NetUtility> net_utility_;
+
+  DISALLOW_COPY_AND_ASSIGN(EngineState);
+};
+
+bool EngineState::Init() {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  if (net_utility_)
+    return true;
+  logging::Init();
+  std::shared_ptr<P11NetFactoryImpl> factory(new P11NetFactoryImpl());
+  // The objects only mirror the NetHSM keys, so they need no store.
+  std::shared_ptr<ObjectPool> pool(factory->CreateObjectPool(
+      std::make_shared<CountingHandleGenerator>(),
+      std::unique_ptr<ObjectStore>()));
+  if (!pool) {
+    LOG(ERROR) << "Failed to create the engine's object pool.";
+    return false;
+  }
+  std::shared_ptr<NetUtility> net_utility(
+      factory->CreateNetUtility(pool, boost::filesystem::path(), 0));
+  if (!net_utility->Init()) {
+    LOG(ERROR) << "Failed to connect the engine to the NetHSM.";
+    return false;
+  }
+  Metrics::Get()->StartDumping();
+  factory_ = factory;
+  pool_ = pool;
+  net_utility_ = net_utility;
+  return true;
+}
+
+bool EngineState::FindKey(const std::string& key_id,
+                          const Object** private_key,
+                          const Object** public_key) {
+  std::unique_ptr<Object> search_template(factory_->CreateObject());
+  CHECK(search_template.get());
+  search_template->SetAttributeString(CKA_ID, key_id);
+  search_template->SetAttributeBool(CKA_TOKEN, true);
+  std::vector<const Object*> objects;
+  if (!net_utility_->LoadKeys(*search_template) ||
+      !pool_->Find(search_template.get(), &objects))
+    return false;
+  *private_key = NULL;
+  *public_key = NULL;
+  for (auto i = objects.begin(); i != objects.end(); ++i) {
+    if ((*i)->GetObjectClass() == CKO_PRIVATE_KEY)
+      *private_key = *i;
+    else if ((*i)->GetObjectClass() == CKO_PUBLIC_KEY)
+      *public_key = *i;
+  }
+  return *private_key != NULL;
+}
+
+// The methods of the engine, and the ex_data slots that hold the target of
+// each key, are created once when the engine is first bound.
+RSA_METHOD* g_rsa_method = NULL;
+int g_rsa_index = -1;
+int g_ec_index = -1;
+
+void FreeKeyTarget(void* parent,
+                   void* ptr,
+                   CRYPTO_EX_DATA* ad,
+                   int index,
+                   long argl,
+                   void* argp) {
+  delete static_cast<KeyTargetPtr*>(ptr);
+}
+
+std::string ToString(const unsigned char* data, int length) {
+  return std::string(reinterpret_cast<const char*>(data), length);
+}
+
+// Keys without a target, e.g. ones read from a file while the engine is the
+// default, are served by the methods of OpenSSL the engine's derive from.
+int DefaultRsaPrivateEncrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding);
+int DefaultRsaPrivateDecrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding);
+ECDSA_SIG* DefaultEcdsaSign(const unsigned char* digest,
+                            int length,
+                            const BIGNUM* inverse,
+                            const BIGNUM* r,
+                            EC_KEY* ec);
+
+int RsaPrivateEncrypt(int length,
+                      const unsigned char* from,
+                      unsigned char* to,
+                      RSA* rsa,
+                      int padding) {
+  const KeyTargetPtr* key =
+      static_cast<const KeyTargetPtr*>(RSA_get_ex_data(rsa, g_rsa_index));
+  if (!key)
+    return DefaultRsaPrivateEncrypt(length, from, to, rsa, padding);
+  if (padding != RSA_PKCS1_PADDING) {
+    LOG(ERROR) << "The NetHSM signs with PKCS #1 v1.5 padding only.";
+    return -1;
+  }
+  auto result = EngineState::Get()->net_utility()->Sign(
+      *key, ToString(from, length), kInteractivePriority);
+  const size_t size = RSA_size(rsa);
+  if (!result || result->size() > size)
+    return -1;
+  // Signatures are as long as the modulus.
+  memset(to, 0, size - result->size());
+  memcpy(to + size - result->size(), result->data(), result->size());
+  return size;
+}
+
+int RsaPrivateDecrypt(int length,
+                      const unsigned char* from,
+                      unsigned char* to,
+                      RSA* rsa,
+                      int padding) {
+  const KeyTargetPtr* key =
+      static_cast<const KeyTargetPtr*>(RSA_get_ex_data(rsa, g_rsa_index));
+  if (!key)
+    return DefaultRsaPrivateDecrypt(length, from, to, rsa, padding);
+  if (padding != RSA_PKCS1_PADDING) {
+    LOG(ERROR) << "The NetHSM decrypts with PKCS #1 v1.5 padding only.";
+    return -1;
+  }
+  auto result = EngineState::Get()->net_utility()->Decrypt(
+      *key, ToString(from, length), kInteractivePriority);
+  if (!result || result->size() > static_cast<size_t>(RSA_size(rsa)))
+    return -1;
+  memcpy(to, result->data(), result->size());
+  return result->size();
+}
+
+ECDSA_SIG* EcdsaSign(const unsigned char* digest,
+                     int length,
+                     const BIGNUM* inverse,
+                     const BIGNUM* r,
+                     EC_KEY* ec);
+
+// The OpenSSL 1.1 API hides the method structures; 1.0 has no accessors.
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+ECDSA_METHOD* g_ecdsa_method = NULL;
+
+int DefaultRsaPrivateEncrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding) {
+  return RSA_PKCS1_SSLeay()->rsa_priv_enc(length, from, to, rsa, padding);
+}
+
+int DefaultRsaPrivateDecrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding) {
+  return RSA_PKCS1_SSLeay()->rsa_priv_dec(length, from, to, rsa, padding);
+}
+
+ECDSA_SIG* DefaultEcdsaSign(const unsigned char* digest,
+                            int length,
+                            const BIGNUM* inverse,
+                            const BIGNUM* r,
+                            EC_KEY* ec) {
+  // ECDSA_METHOD is opaque in 1.0, so a copy of the key signs with the
+  // method of OpenSSL instead.
+  EC_KEY* copy = EC_KEY_dup(ec);
+  ECDSA_SIG* sig = NULL;
+  if (copy && ECDSA_set_method(copy, ECDSA_OpenSSL()))
+    sig = ECDSA_do_sign_ex(digest, length, inverse, r, copy);
+  EC_KEY_free(copy);
+  return sig;
+}
+
+void CreateMethods() {
+  static RSA_METHOD rsa_method = *RSA_PKCS1_SSLeay();
+  rsa_method.name = kEngineName;
+  rsa_method.rsa_priv_enc = &RsaPrivateEncrypt;
+  rsa_method.rsa_priv_dec = &RsaPrivateDecrypt;
+  // The private key stays on the NetHSM.
+  rsa_method.flags |= RSA_FLAG_EXT_PKEY;
+  g_rsa_method = &rsa_method;
+  g_ecdsa_method = ECDSA_METHOD_new(ECDSA_OpenSSL());
+  ECDSA_METHOD_set_name(g_ecdsa_method, const_cast<char*>(kEngineName));
+  ECDSA_METHOD_set_sign(g_ecdsa_method, &EcdsaSign);
+  g_rsa_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, &FreeKeyTarget);
+  g_ec_index = ECDSA_get_ex_new_index(0, NULL, NULL, NULL, &FreeKeyTarget);
+}
+
+bool SetEcMethod(ENGINE* engine) {
+  return ENGINE_set_ECDSA(engine, g_ecdsa_method);
+}
+
+bool SetRsaPublicKey(RSA* rsa, BIGNUM* modulus, BIGNUM* exponent) {
+  rsa->n = modulus;
+  rsa->e = exponent;
+  return true;
+}
+
+EC_KEY* NewEcKey(ENGINE* engine) {
+  EC_KEY* ec = EC_KEY_new();
+  if (ec && !ECDSA_set_method(ec, g_ecdsa_method)) {
+    EC_KEY_free(ec);
+    return NULL;
+  }
+  return ec;
+}
+
+bool SetEcKeyTarget(EC_KEY* ec, KeyTargetPtr* key) {
+  return ECDSA_set_ex_data(ec, g_ec_index, key);
+}
+
+const KeyTargetPtr* GetEcKeyTarget(EC_KEY* ec) {
+  return static_cast<const KeyTargetPtr*>(ECDSA_get_ex_data(ec, g_ec_index));
+}
+
+#else  // OPENSSL_VERSION_NUMBER
+
+EC_KEY_METHOD* g_ec_method = NULL;
+
+int DefaultRsaPrivateEncrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding) {
+  return RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(length, from, to, rsa,
+                                                    padding);
+}
+
+int DefaultRsaPrivateDecrypt(int length,
+                             const unsigned char* from,
+                             unsigned char* to,
+                             RSA* rsa,
+                             int padding) {
+  return RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())(length, from, to, rsa,
+                                                    padding);
+}
+
+ECDSA_SIG* DefaultEcdsaSign(const unsigned char* digest,
+                            int length,
+                            const BIGNUM* inverse,
+                            const BIGNUM* r,
+                            EC_KEY* ec) {
+  ECDSA_SIG* (*sign_sig)(const unsigned char*, int, const BIGNUM*,
+                         const BIGNUM*, EC_KEY*) = NULL;
+  EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), NULL, NULL, &sign_sig);
+  return sign_sig(digest, length, inverse, r, ec);
+}
+
+void CreateMethods() {
+  g_rsa_method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+  RSA_meth_set1_name(g_rsa_method, kEngineName);
+  RSA_meth_set_priv_enc(g_rsa_method, &RsaPrivateEncrypt);
+  RSA_meth_set_priv_dec(g_rsa_method, &RsaPrivateDecrypt);
+  // The private key stays on the NetHSM.
+  RSA_meth_set_flags(g_rsa_method,
+                     RSA_meth_get_flags(g_rsa_method) | RSA_FLAG_EXT_PKEY);
+  g_ec_method = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+  // The default sign function hands the digest to the sign_sig one.
+  int (*sign)(int, const unsigned char*, int, unsigned char*, unsigned int*,
+              const BIGNUM*, const BIGNUM*, EC_KEY*) = NULL;
+  int (*sign_setup)(EC_KEY*, BN_CTX*, BIGNUM**, BIGNUM**) = NULL;
+  EC_KEY_METHOD_get_sign(g_ec_method, &sign, &sign_setup, NULL);
+  EC_KEY_METHOD_set_sign(g_ec_method, sign, sign_setup, &EcdsaSign);
+  g_rsa_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, &FreeKeyTarget);
+  g_ec_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, &FreeKeyTarget);
+}
+
+bool SetEcMethod(ENGINE* engine) {
+  return ENGINE_set_EC(engine, g_ec_method);
+}
+
+bool SetRsaPublicKey(RSA* rsa, BIGNUM* modulus, BIGNUM* exponent) {
+  return RSA_set0_key(rsa, modulus, exponent, NULL);
+}
+
+EC_KEY* NewEcKey(ENGINE* engine) {
+  return EC_KEY_new_method(engine);
+}
+
+bool SetEcKeyTarget(EC_KEY* ec, KeyTargetPtr* key) {
+  return EC_KEY_set_ex_data(ec, g_ec_index, key);
+}
+
+const KeyTargetPtr* GetEcKeyTarget(EC_KEY* ec) {
+  return static_cast<const KeyTargetPtr*>(EC_KEY_get_ex_data(ec, g_ec_index));
+}
+
+#endif  // OPENSSL_VERSION_NUMBER
+
+ECDSA_SIG* EcdsaSign(const unsigned char* digest,
+                     int length,
+                     const BIGNUM* inverse,
+                     const BIGNUM* r,
+                     EC_KEY* ec) {
+  const KeyTargetPtr* key = GetEcKeyTarget(ec);
+  if (!key)
+    return DefaultEcdsaSign(digest, length, inverse, r, ec);
+  auto result = EngineState::Get()->net_utility()->ECDSASign(
+      *key, ToString(digest, length), kInteractivePriority);
+  if (!result)
+    return NULL;
+  // The NetHSM returns the DER-encoded ECDSA-Sig-Value OpenSSL wants.
+  const unsigned char* buffer = ConvertStringToByteBuffer(result->data());
+  ECDSA_SIG* sig = d2i_ECDSA_SIG(NULL, &buffer, result->length());
+  if (!sig)
+    LOG(ERROR) << "Malformed ECDSA signature: " << GetOpenSSLError();
+  return sig;
+}
+
+BIGNUM* ToBignum(const std::string& value) {
+  return BN_bin2bn(ConvertStringToByteBuffer(value.data()), value.length(),
+                   NULL);
+}
+
+EVP_PKEY* CreateRsaKey(ENGINE* engine,
+                       const Object* private_key,
+                       KeyTargetPtr* key) {
+  RSA* rsa = RSA_new_method(engine);
+  if (!rsa)
+    return NULL;
+  BIGNUM* modulus = ToBignum(private_key->GetAttributeString(CKA_MODULUS));
+  BIGNUM* exponent =
+      ToBignum(private_key->GetAttributeString(CKA_PUBLIC_EXPONENT));
+  EVP_PKEY* pkey = EVP_PKEY_new();
+  if (!modulus || !exponent || !SetRsaPublicKey(rsa, modulus, exponent)) {
+    BN_free(modulus);
+    BN_free(exponent);
+  } else if (pkey && RSA_set_ex_data(rsa, g_rsa_index, key) &&
+             EVP_PKEY_assign_RSA(pkey, rsa)) {
+    return pkey;
+  }
+  // The ex_data, if set, is freed along with the key.
+  if (RSA_get_ex_data(rsa, g_rsa_index) != key)
+    delete key;
+  RSA_free(rsa);
+  EVP_PKEY_free(pkey);
+  return NULL;
+}
+
+EVP_PKEY* CreateEcKey(ENGINE* engine,
+                      const Object* private_key,
+                      const Object* public_key,
+                      KeyTargetPtr* key) {
+  const int curve =
+      GetECCurve(private_key->GetAttributeString(CKA_EC_PARAMS));
+  EC_KEY* ec = curve == NID_undef ? NULL : NewEcKey(engine);
+  if (!ec || !SetEcKeyTarget(ec, key)) {
+    delete key;
+    EC_KEY_free(ec);
+    return NULL;
+  }
+  // The public point lets OpenSSL match the key to its certificate.
+  EC_GROUP* group = EC_GROUP_new_by_curve_name(curve);
+  EC_POINT* point = group ? EC_POINT_new(group) : NULL;
+  const std::string encoded_point =
+      public_key ? public_key->GetAttributeString(CKA_EC_POINT)
+                 : std::string();
+  const unsigned char* buffer = ConvertStringToByteBuffer(encoded_point.data());
+  ASN1_OCTET_STRING* octets =
+      d2i_ASN1_OCTET_STRING(NULL, &buffer, encoded_point.length());
+  EVP_PKEY* pkey = NULL;
+  if (point && octets &&
+      EC_POINT_oct2point(group, point, octets->data, octets->length, NULL) &&
+      EC_KEY_set_group(ec, group) && EC_KEY_set_public_key(ec, point)) {
+    pkey = EVP_PKEY_new();
+    if (pkey && !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+      EVP_PKEY_free(pkey);
+      pkey = NULL;
+    }
+  }
+  if (!pkey) {
+    LOG(ERROR) << "Invalid EC key: " << GetOpenSSLError();
+    EC_KEY_free(ec);
+  }
+  ASN1_OCTET_STRING_free(octets);
+  EC_POINT_free(point);
+  EC_GROUP_free(group);
+  return pkey;
+}
+
+EVP_PKEY* LoadPrivateKey(ENGINE* engine,
+                         const char* key_id,
+                         UI_METHOD* ui_method,
+                         void* callback_data) {
+  EngineState* state = EngineState::Get();
+  const Object* private_key = NULL;
+  const Object* public_key = NULL;
+  if (!key_id || !state->Init() ||
+      !state->FindKey(key_id, &private_key, &public_key)) {
+    LOG(ERROR) << "No NetHSM key " << (key_id ? key_id : "");
+    return NULL;
+  }
+  KeyTargetPtr* key = new KeyTargetPtr(std::make_shared<KeyTarget>(
+      private_key->GetAttributeString(kKeyLocationAttribute)));
+  if (private_key->GetAttributeInt(CKA_KEY_TYPE, -1) == CKK_EC)
+    return CreateEcKey(engine, private_key, public_key, key);
+  return CreateRsaKey(engine, private_key, key);
+}
+
+int InitEngine(ENGINE* engine) {
+  return EngineState::Get()->Init() ? 1 : 0;
+}
+
+int BindEngine(ENGINE* engine, const char* id) {
+  if (id && strcmp(id, kEngineId) != 0)
+    return 0;
+  static std::once_flag create_methods;
+  std::call_once(create_methods, &CreateMethods);
+  if (!ENGINE_set_id(engine, kEngineId) ||
+      !ENGINE_set_name(engine, kEngineName) ||
+      !ENGINE_set_init_function(engine, &InitEngine) ||
+      !ENGINE_set_load_privkey_function(engine, &LoadPrivateKey) ||
+      !ENGINE_set_RSA(engine, g_rsa_method) || !SetEcMethod(engine))
+    return 0;
+  return 1;
+}
+
+}  // namespace
+
+}  // namespace p11net
+
+extern "C" {
+IMPLEMENT_DYNAMIC_CHECK_FN()
+IMPLEMENT_DYNAMIC_BIND_FN(p11net::BindEngine)
+}
@@ -0,0 +1,227 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Vendor extensions of the P11Net PKCS #11 module. They are not part of the
+// standard function list; applications look them up with dlsym() on the
+// module and must cope with their absence in other modules.
+
+#ifndef P11NET_P11NET_EXT_H_
+#define P11NET_P11NET_EXT_H_
+
+#include "pkcs11/cryptoki.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copies the metrics of the module, in the Prometheus text exposition format,
+// to pMetrics. The text is not NUL-terminated. Follows the output buffer
+// convention of PKCS #11 section 11.2: if pMetrics is NULL only the length is
+// returned. The text grows as metrics are added, so callers retry on
+// CKR_BUFFER_TOO_SMALL. May be called whether or not the module is
+// initialized.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_GetMetrics)(CK_BYTE_PTR pMetrics,
+                                                CK_ULONG_PTR pulMetricsLen);
+typedef CK_RV (*CK_C_P11Net_GetMetrics)(CK_BYTE_PTR pMetrics,
+                                        CK_ULONG_PTR pulMetricsLen);
+
+// The priorities of C_P11Net_SetSessionPriority.
+#define P11NET_PRIORITY_INTERACTIVE 0UL
+#define P11NET_PRIORITY_BULK 1UL
+
+// Sets the priority of the NetHSM requests made by a session. When the module
+// limits the requests in flight to the NetHSM, see P11NET_MAX_INFLIGHT_ACTIONS,
+// interactive requests are served ahead of bulk ones, e.g. TLS handshake
+// signatures ahead of a batch re-signing job. Sessions start out interactive.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_SetSessionPriority)(
+    CK_SESSION_HANDLE hSession,
+    CK_ULONG ulPriority);
+typedef CK_RV (*CK_C_P11Net_SetSessionPriority)(CK_SESSION_HANDLE hSession,
+                                                CK_ULONG ulPriority);
+
+// One input of C_P11Net_SignBatch or C_P11Net_DecryptBatch. pOutput must have
+// room for the largest output of the key, i.e. the modulus length; on return
+// ulOutputLen holds the output length and rv the result of the item. An item
+// whose buffer is too small fails with CKR_BUFFER_TOO_SMALL.
+typedef struct CK_P11NET_BATCH_ITEM {
+  CK_BYTE_PTR pInput;
+  CK_ULONG ulInputLen;
+  CK_BYTE_PTR pOutput;
+  CK_ULONG ulOutputLen;
+  CK_RV rv;
+} CK_P11NET_BATCH_ITEM;
+typedef CK_P11NET_BATCH_ITEM CK_PTR CK_P11NET_BATCH_ITEM_PTR;
+
+// Signs or decrypts each of ulCount items with one RSA key and mechanism, as
+// C_Sign or C_Decrypt would after the matching init call. Operations on NetHSM
+// keys are sent to the NetHSM all at once, so a batch takes about as long as
+// its slowest item. The batch does not disturb an active operation of the
+// session. Returns CKR_OK if the key and mechanism are valid, in which case
+// the result of each item is in its rv.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_SignBatch)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_P11NET_BATCH_ITEM_PTR pItems,
+    CK_ULONG ulCount);
+typedef CK_RV (*CK_C_P11Net_SignBatch)(CK_SESSION_HANDLE hSession,
+                                       CK_MECHANISM_PTR pMechanism,
+                                       CK_OBJECT_HANDLE hKey,
+                                       CK_P11NET_BATCH_ITEM_PTR pItems,
+                                       CK_ULONG ulCount);
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_DecryptBatch)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_P11NET_BATCH_ITEM_PTR pItems,
+    CK_ULONG ulCount);
+typedef CK_RV (*CK_C_P11Net_DecryptBatch)(CK_SESSION_HANDLE hSession,
+                                          CK_MECHANISM_PTR pMechanism,
+                                          CK_OBJECT_HANDLE hKey,
+                                          CK_P11NET_BATCH_ITEM_PTR pItems,
+                                          CK_ULONG ulCount);
+
+// The result of C_P11Net_Collect for an operation that has not completed.
+#define CKR_P11NET_OPERATION_PENDING (CKR_VENDOR_DEFINED | 0x00000001UL)
+
+// Starts a single-part C_Sign or C_Decrypt with the given key and mechanism
+// and returns without waiting for the NetHSM. The id of the operation is
+// stored in pulOperation. When the operation completes, the descriptor of
+// C_P11Net_GetCompletionFd becomes readable and the result can be collected
+// with C_P11Net_Collect; every operation must be collected. Operations do not
+// depend on the session once submitted and do not disturb its active
+// operations. CKR_DEVICE_ERROR means the NetHSM is at its request limit.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_SignSubmit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_ULONG_PTR pulOperation);
+typedef CK_RV (*CK_C_P11Net_SignSubmit)(CK_SESSION_HANDLE hSession,
+                                        CK_MECHANISM_PTR pMechanism,
+                                        CK_OBJECT_HANDLE hKey,
+                                        CK_BYTE_PTR pData,
+                                        CK_ULONG ulDataLen,
+                                        CK_ULONG_PTR pulOperation);
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_DecryptSubmit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pEncryptedData,
+    CK_ULONG ulEncryptedDataLen,
+    CK_ULONG_PTR pulOperation);
+typedef CK_RV (*CK_C_P11Net_DecryptSubmit)(CK_SESSION_HANDLE hSession,
+                                           CK_MECHANISM_PTR pMechanism,
+                                           CK_OBJECT_HANDLE hKey,
+                                           CK_BYTE_PTR pEncryptedData,
+                                           CK_ULONG ulEncryptedDataLen,
+                                           CK_ULONG_PTR pulOperation);
+
+// Stores in pFd an eventfd that is readable while completed operations wait
+// to be taken with C_P11Net_GetCompleted. The descriptor belongs to the
+// module: add it to poll() or epoll, but do not read from or close it. A
+// forked child gets a descriptor of its own.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_GetCompletionFd)(int* pFd);
+typedef CK_RV (*CK_C_P11Net_GetCompletionFd)(int* pFd);
+
+// Stores the ids of up to *pulCount completed operations in pOperations and
+// their number in pulCount. Each id is returned once.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_GetCompleted)(CK_ULONG_PTR pOperations,
+                                                  CK_ULONG_PTR pulCount);
+typedef CK_RV (*CK_C_P11Net_GetCompleted)(CK_ULONG_PTR pOperations,
+                                          CK_ULONG_PTR pulCount);
+
+// Returns the result of a submitted operation and its output, following the
+// output buffer convention of PKCS #11 section 11.2, or
+// CKR_P11NET_OPERATION_PENDING if it has not completed. An operation is
+// forgotten once its output was copied or its error returned.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_Collect)(CK_ULONG ulOperation,
+                                             CK_BYTE_PTR pOutput,
+                                             CK_ULONG_PTR pulOutputLen);
+typedef CK_RV (*CK_C_P11Net_Collect)(CK_ULONG ulOperation,
+                                     CK_BYTE_PTR pOutput,
+                                     CK_ULONG_PTR pulOutputLen);
+
+// Reads the same attributes from each of ulObjectCount objects, as
+// C_GetAttributeValue would for each of them, but resolving the session only
+// once. pTemplates holds one template of ulAttributeCount attributes per
+// object, one after the other; the template of phObjects[i] starts at
+// pTemplates[i * ulAttributeCount] and is filled in place. pResults receives
+// the result of each object, which may be CKR_ATTRIBUTE_SENSITIVE,
+// CKR_ATTRIBUTE_TYPE_INVALID or CKR_BUFFER_TOO_SMALL with the template filled
+// as C_GetAttributeValue does. Returns CKR_OK if the session is valid.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_GetAttributeValues)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE_PTR phObjects,
+    CK_ULONG ulObjectCount,
+    CK_ATTRIBUTE_PTR pTemplates,
+    CK_ULONG ulAttributeCount,
+    CK_RV CK_PTR pResults);
+typedef CK_RV (*CK_C_P11Net_GetAttributeValues)(CK_SESSION_HANDLE hSession,
+                                                CK_OBJECT_HANDLE_PTR phObjects,
+                                                CK_ULONG ulObjectCount,
+                                                CK_ATTRIBUTE_PTR pTemplates,
+                                                CK_ULONG ulAttributeCount,
+                                                CK_RV CK_PTR pResults);
+
+// Continues a search started with C_FindObjectsInit like C_FindObjects and
+// reads the attributes of the objects found like C_P11Net_GetAttributeValues,
+// in one call. pTemplates and pResults have room for ulMaxObjectCount
+// objects; only the first *pulObjectCount are filled. An inventory of all
+// keys thus takes one call per ulMaxObjectCount keys.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_FindObjectsWithAttributes)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount,
+    CK_ULONG_PTR pulObjectCount,
+    CK_ATTRIBUTE_PTR pTemplates,
+    CK_ULONG ulAttributeCount,
+    CK_RV CK_PTR pResults);
+typedef CK_RV (*CK_C_P11Net_FindObjectsWithAttributes)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount,
+    CK_ULONG_PTR pulObjectCount,
+    CK_ATTRIBUTE_PTR pTemplates,
+    CK_ULONG ulAttributeCount,
+    CK_RV CK_PTR pResults);
+
+// The vendor extensions of the module in one table, so that applications
+// need a single dlsym() lookup next to C_GetFunctionList. Functions are only
+// ever appended; check the version before using later ones.
+#define P11NET_FUNCTION_LIST_VERSION_MAJOR 1
+#define P11NET_FUNCTION_LIST_VERSION_MINOR 2
+
+typedef struct CK_P11NET_FUNCTION_LIST {
+  CK_VERSION version;
+  CK_C_P11Net_GetMetrics C_P11Net_GetMetrics;
+  CK_C_P11Net_SetSessionPriority C_P11Net_SetSessionPriority;
+  CK_C_P11Net_SignBatch C_P11Net_SignBatch;
+  CK_C_P11Net_DecryptBatch C_P11Net_DecryptBatch;
+  // Version 1.1.
+  CK_C_P11Net_SignSubmit C_P11Net_SignSubmit;
+  CK_C_P11Net_DecryptSubmit C_P11Net_DecryptSubmit;
+  CK_C_P11Net_GetCompletionFd C_P11Net_GetCompletionFd;
+  CK_C_P11Net_GetCompleted C_P11Net_GetCompleted;
+  CK_C_P11Net_Collect C_P11Net_Collect;
+  // Version 1.2.
+  CK_C_P11Net_GetAttributeValues C_P11Net_GetAttributeValues;
+  CK_C_P11Net_FindObjectsWithAttributes C_P11Net_FindObjectsWithAttributes;
+} CK_P11NET_FUNCTION_LIST;
+typedef CK_P11NET_FUNCTION_LIST CK_PTR CK_P11NET_FUNCTION_LIST_PTR;
+typedef CK_P11NET_FUNCTION_LIST_PTR CK_PTR CK_P11NET_FUNCTION_LIST_PTR_PTR;
+
+// Returns the vendor function list. May be called whether or not the module
+// is initialized.
+CK_DECLARE_FUNCTION(CK_RV, C_P11Net_GetFunctionList)(
+    CK_P11NET_FUNCTION_LIST_PTR_PTR ppFunctionList);
+typedef CK_RV (*CK_C_P11Net_GetFunctionList)(
+    CK_P11NET_FUNCTION_LIST_PTR_PTR ppFunctionList);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // P11NET_P11NET_EXT_H_
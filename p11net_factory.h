@@ -33,12 +33,20 @@ class P11NetFactory {
                                  std::shared_ptr<NetUtility> net_utility,
                                  std::shared_ptr<HandleGenerator> handle_generator,
                                  bool is_read_only) = 0;
+  // Destroys a session returned by CreateSession. The factory may keep it to
+  // serve a later CreateSession.
+  virtual void DestroySession(Session* session) = 0;
   virtual ObjectPool* CreateObjectPool(std::shared_ptr<HandleGenerator> handle_generator,
                                        std::unique_ptr<ObjectStore> store) = 0;
+  // Creates a memory-only store if 'file_name' is empty.
   virtual ObjectStore* CreateObjectStore(const boost::filesystem::path& file_name) = 0;
   virtual Object* CreateObject() = 0;
   virtual ObjectPolicy* CreateObjectPolicy(CK_OBJECT_CLASS type) = 0;
-  virtual NetUtility* CreateNetUtility(std::shared_ptr<ObjectPool> token_object_pool) = 0;
+  // Creates the client of the NetHSM appliance with the given index; see
+  // NetUtilityImpl.
+  virtual NetUtility* CreateNetUtility(std::shared_ptr<ObjectPool> token_object_pool,
+                                      const boost::filesystem::path& token_path,
+                                      int appliance) = 0;
 };
 
 }  // namespace p11net
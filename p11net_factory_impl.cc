@@ -4,9 +4,12 @@
 
 #include "p11net_factory_impl.h"
 
+#include <stdlib.h>
+
 #include <string>
 
 #include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
 
 #include "object_impl.h"
 #include "object_policy_cert.h"
@@ -18,19 +21,50 @@
 #include "object_pool_impl.h"
 #include "object_store_fake.h"
 #include "object_store_impl.h"
+#include "object_store_memory.h"
 #include "session_impl.h"
 #include "net_utility_impl.h"
+#include "net_utility_sim.h"
 
 using boost::filesystem::path;
 using std::string;
 
 namespace p11net {
 
+namespace Env {
+  // Set to "sim" to serve the tokens from a simulated NetHSM.
+  const char* kBackend = "P11NET_BACKEND";
+}
+
+namespace {
+
+// The most closed sessions kept for reuse.
+const size_t kMaxFreeSessions = 64;
+
+}  // namespace
+
+P11NetFactoryImpl::P11NetFactoryImpl() {}
+
+P11NetFactoryImpl::~P11NetFactoryImpl() {}
+
 Session* P11NetFactoryImpl::CreateSession(int slot_id,
                                          std::shared_ptr<ObjectPool> token_object_pool,
                                          std::shared_ptr<NetUtility> net_utility,
                                          std::shared_ptr<HandleGenerator> handle_generator,
                                          bool is_read_only) {
+  std::unique_ptr<SessionImpl> session;
+  {
+    boost::lock_guard<boost::mutex> lock(free_sessions_lock_);
+    if (!free_sessions_.empty()) {
+      session = std::move(free_sessions_.back());
+      free_sessions_.pop_back();
+    }
+  }
+  if (session) {
+    session->Reset(slot_id, token_object_pool, net_utility, shared_from_this(),
+                   handle_generator, is_read_only);
+    return session.release();
+  }
   return new SessionImpl(slot_id,
                          token_object_pool,
                          net_utility,
@@ -39,6 +73,15 @@ Session* P11NetFactoryImpl::CreateSession(int slot_id,
                          is_read_only);
 }
 
+void P11NetFactoryImpl::DestroySession(Session* session) {
+  // Only sessions of this factory get here, and they are all SessionImpls.
+  std::unique_ptr<SessionImpl> closed(static_cast<SessionImpl*>(session));
+  closed->Recycle();
+  boost::lock_guard<boost::mutex> lock(free_sessions_lock_);
+  if (free_sessions_.size() < kMaxFreeSessions)
+    free_sessions_.push_back(std::move(closed));
+}
+
 ObjectPool* P11NetFactoryImpl::CreateObjectPool(
     std::shared_ptr<HandleGenerator> handle_generator,
     std::unique_ptr<ObjectStore> object_store) {
@@ -52,6 +95,9 @@ ObjectPool* P11NetFactoryImpl::CreateObjectPool(
 }
 
 ObjectStore* P11NetFactoryImpl::CreateObjectStore(const boost::filesystem::path& file_name) {
+  // Tokens without a path are not persisted.
+  if (file_name.empty())
+    return new ObjectStoreMemory();
   std::unique_ptr<ObjectStoreImpl> store(new ObjectStoreImpl());
   if (!store->Init(file_name)) {
     // The approach here is to limp along without a persistent object store so
@@ -85,10 +131,17 @@ ObjectPolicy* P11NetFactoryImpl::CreateObjectPolicy(CK_OBJECT_CLASS type) {
 }
 
 NetUtility* P11NetFactoryImpl::CreateNetUtility(
-  std::shared_ptr<ObjectPool> token_object_pool
+  std::shared_ptr<ObjectPool> token_object_pool,
+  const boost::filesystem::path& token_path,
+  int appliance
 ) {
+  const char* backend = getenv(Env::kBackend);
+  if (backend && string(backend) == "sim")
+    return new NetUtilitySim(token_object_pool, shared_from_this());
   return new NetUtilityImpl(token_object_pool,
-                            shared_from_this());
+                            shared_from_this(),
+                            token_path,
+                            appliance);
 }
 
 }  // namespace p11net
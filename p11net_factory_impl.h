@@ -7,28 +7,42 @@
 
 #include "p11net_factory.h"
 
+#include <memory>
+#include <vector>
+
 #include <base/macros.h>
+#include <boost/thread/mutex.hpp>
 
 namespace p11net {
 
+class SessionImpl;
+
 class P11NetFactoryImpl : public P11NetFactory,
                          public std::enable_shared_from_this<P11NetFactoryImpl> {
  public:
-  P11NetFactoryImpl() {}
-  virtual ~P11NetFactoryImpl() {}
+  P11NetFactoryImpl();
+  virtual ~P11NetFactoryImpl();
   virtual Session* CreateSession(int slot_id,
                                  std::shared_ptr<ObjectPool> token_object_pool,
                                  std::shared_ptr<NetUtility> net_utility,
                                  std::shared_ptr<HandleGenerator> handle_generator,
                                  bool is_read_only);
+  virtual void DestroySession(Session* session);
   virtual ObjectPool* CreateObjectPool(std::shared_ptr<HandleGenerator> handle_generator,
                                        std::unique_ptr<ObjectStore> store);
   virtual ObjectStore* CreateObjectStore(const boost::filesystem::path& file_name);
   virtual Object* CreateObject();
   virtual ObjectPolicy* CreateObjectPolicy(CK_OBJECT_CLASS type);
-  virtual NetUtility* CreateNetUtility(std::shared_ptr<ObjectPool> token_object_pool);
+  virtual NetUtility* CreateNetUtility(std::shared_ptr<ObjectPool> token_object_pool,
+                                      const boost::filesystem::path& token_path,
+                                      int appliance);
 
  private:
+  // Closed sessions kept for reuse, so that opening a session rarely
+  // allocates one.
+  std::vector<std::unique_ptr<SessionImpl>> free_sessions_;
+  boost::mutex free_sessions_lock_;
+
   DISALLOW_COPY_AND_ASSIGN(P11NetFactoryImpl);
 };
 
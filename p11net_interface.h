@@ -115,6 +115,48 @@ class P11NetInterface {
       uint64_t* state,
       uint64_t* flags,
       uint64_t* device_error) = 0;
+  // P11Net vendor extension, see p11net_ext.h.
+  virtual uint32_t SetSessionPriority(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t priority) = 0;
+  // P11Net vendor extension, see p11net_ext.h. On success 'results' holds the
+  // result of each input and 'outputs' the output of each successful one.
+  virtual uint32_t SignBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results) = 0;
+  virtual uint32_t DecryptBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results) = 0;
+  // P11Net vendor extension, see p11net_ext.h. The result is collected from
+  // the CompletionQueue under 'operation_id'.
+  virtual uint32_t SignSubmit(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              uint64_t mechanism_type,
+                              const std::vector<uint8_t>& mechanism_parameter,
+                              uint64_t key_handle,
+                              const std::vector<uint8_t>& data,
+                              uint64_t* operation_id) = 0;
+  virtual uint32_t DecryptSubmit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<uint8_t>& data,
+      uint64_t* operation_id) = 0;
   // PKCS #11 v2.20 section 11.6 page 121.
   virtual uint32_t GetOperationState(
       const brillo::SecureBlob& isolate_credential,
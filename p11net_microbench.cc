@@ -0,0 +1,359 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmarks of the data structures and codecs on the hot paths of the
+// module, built with -DWITH_MICROBENCHMARKS=ON. They give optimizations a
+// baseline and catch regressions. Sample usage:
+//    p11net_microbench --benchmark_filter=Find
+// The *Json benchmarks measure the generic nlohmann::json path that the
+// NetHSM codec replaced, for comparison with the codec benchmarks.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "attributes.h"
+#include "base64_simd.h"
+#include "cppcodec/base64_url.hpp"
+#include "handle_generator.h"
+#include "nethsm_codec.h"
+#include "nlohmann/json.hpp"
+#include "object.h"
+#include "object_pool_impl.h"
+#include "object_store.h"
+#include "p11net_factory_impl.h"
+#include "p11net_utility.h"
+#include "pkcs11/cryptoki.h"
+
+using std::string;
+using std::vector;
+
+namespace p11net {
+
+namespace {
+
+// The size of an RSA-2048 signature, the typical NetHSM payload.
+const size_t kPayloadSize = 256;
+
+class CountingHandleGenerator : public HandleGenerator {
+ public:
+  CountingHandleGenerator() : next_handle_(1) {}
+  virtual int CreateHandle() { return next_handle_++; }
+
+ private:
+  int next_handle_;
+};
+
+string MakePayload(size_t size) {
+  string payload(size, 0);
+  for (size_t i = 0; i < size; ++i)
+    payload[i] = static_cast<char>(i * 131 + 7);
+  return payload;
+}
+
+std::shared_ptr<P11NetFactoryImpl> GetFactory() {
+  static std::shared_ptr<P11NetFactoryImpl> factory(new P11NetFactoryImpl());
+  return factory;
+}
+
+// Creates a data object with a distinct label and application.
+Object* CreateDataObject(int index) {
+  Object* object = GetFactory()->CreateObject();
+  object->SetAttributeInt(CKA_CLASS, CKO_DATA);
+  object->SetAttributeBool(CKA_TOKEN, true);
+  object->SetAttributeString(CKA_LABEL, "label-" + std::to_string(index));
+  object->SetAttributeString(CKA_APPLICATION,
+                             "application-" + std::to_string(index));
+  object->SetAttributeString(CKA_VALUE, MakePayload(64));
+  CHECK_EQ(object->FinalizeNewObject(), static_cast<CK_RV>(CKR_OK));
+  return object;
+}
+
+// A pool of range(0) data objects without a store.
+class PoolFixture : public benchmark::Fixture {
+ public:
+  virtual void SetUp(const benchmark::State& state) {
+    pool_.reset(new ObjectPoolImpl(
+        GetFactory(), std::make_shared<CountingHandleGenerator>(),
+        std::unique_ptr<ObjectStore>()));
+    CHECK(pool_->Init());
+    handles_.clear();
+    for (int i = 0; i < state.range(0); ++i) {
+      Object* object = CreateDataObject(i);
+      CHECK(pool_->Insert(object));
+      handles_.push_back(object->handle());
+    }
+  }
+  virtual void TearDown(const benchmark::State& state) {
+    pool_.reset();
+  }
+
+ protected:
+  std::unique_ptr<ObjectPoolImpl> pool_;
+  vector<int> handles_;
+};
+
+}  // namespace
+
+// A search by an indexed attribute.
+BENCHMARK_DEFINE_F(PoolFixture, FindByLabel)(benchmark::State& state) {
+  std::unique_ptr<Object> search_template(GetFactory()->CreateObject());
+  search_template->SetAttributeString(
+      CKA_LABEL, "label-" + std::to_string(state.range(0) / 2));
+  vector<const Object*> matching_objects;
+  for (auto _ : state) {
+    matching_objects.clear();
+    pool_->Find(search_template.get(), &matching_objects);
+    benchmark::DoNotOptimize(matching_objects.data());
+  }
+}
+BENCHMARK_REGISTER_F(PoolFixture, FindByLabel)->Arg(10)->Arg(1000)->Arg(100000);
+
+// A search that has to match every object.
+BENCHMARK_DEFINE_F(PoolFixture, FindByApplication)(benchmark::State& state) {
+  std::unique_ptr<Object> search_template(GetFactory()->CreateObject());
+  search_template->SetAttributeString(
+      CKA_APPLICATION, "application-" + std::to_string(state.range(0) / 2));
+  vector<const Object*> matching_objects;
+  for (auto _ : state) {
+    matching_objects.clear();
+    pool_->Find(search_template.get(), &matching_objects);
+    benchmark::DoNotOptimize(matching_objects.data());
+  }
+}
+BENCHMARK_REGISTER_F(PoolFixture, FindByApplication)
+    ->Arg(10)->Arg(1000)->Arg(100000);
+
+BENCHMARK_DEFINE_F(PoolFixture, FindByHandle)(benchmark::State& state) {
+  size_t next = 0;
+  for (auto _ : state) {
+    const Object* object = NULL;
+    pool_->FindByHandle(handles_[next], &object);
+    benchmark::DoNotOptimize(object);
+    next = (next + 1) % handles_.size();
+  }
+}
+BENCHMARK_REGISTER_F(PoolFixture, FindByHandle)
+    ->Arg(10)->Arg(1000)->Arg(100000);
+
+namespace {
+
+// A typical C_FindObjectsInit template.
+class AttributesFixture : public benchmark::Fixture {
+ public:
+  AttributesFixture()
+      : key_class_(CKO_PRIVATE_KEY),
+        key_type_(CKK_RSA),
+        sign_(CK_TRUE),
+        id_("0123456789abcdef"),
+        label_("benchmark-key") {
+    CK_ATTRIBUTE attributes[] = {
+      {CKA_CLASS, &key_class_, sizeof(key_class_)},
+      {CKA_KEY_TYPE, &key_type_, sizeof(key_type_)},
+      {CKA_SIGN, &sign_, sizeof(sign_)},
+      {CKA_ID, const_cast<char*>(id_.data()), id_.size()},
+      {CKA_LABEL, const_cast<char*>(label_.data()), label_.size()},
+    };
+    attributes_.assign(std::begin(attributes), std::end(attributes));
+  }
+
+ protected:
+  CK_OBJECT_CLASS key_class_;
+  CK_KEY_TYPE key_type_;
+  CK_BBOOL sign_;
+  string id_;
+  string label_;
+  vector<CK_ATTRIBUTE> attributes_;
+};
+
+}  // namespace
+
+BENCHMARK_F(AttributesFixture, Serialize)(benchmark::State& state) {
+  Attributes attributes(attributes_.data(), attributes_.size());
+  vector<uint8_t> serialized;
+  for (auto _ : state) {
+    serialized.clear();
+    attributes.Serialize(&serialized);
+    benchmark::DoNotOptimize(serialized.data());
+  }
+}
+
+BENCHMARK_F(AttributesFixture, Parse)(benchmark::State& state) {
+  vector<uint8_t> serialized;
+  CHECK(Attributes(attributes_.data(), attributes_.size())
+            .Serialize(&serialized));
+  for (auto _ : state) {
+    Attributes parsed;
+    parsed.Parse(serialized);
+    benchmark::DoNotOptimize(parsed.attributes());
+  }
+}
+
+BENCHMARK_F(AttributesFixture, ParseAndFill)(benchmark::State& state) {
+  vector<uint8_t> serialized;
+  CHECK(Attributes(attributes_.data(), attributes_.size())
+            .Serialize(&serialized));
+  CK_OBJECT_CLASS key_class;
+  CK_KEY_TYPE key_type;
+  CK_BBOOL sign;
+  char id[16];
+  char label[13];
+  CK_ATTRIBUTE buffers[] = {
+    {CKA_CLASS, &key_class, sizeof(key_class)},
+    {CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+    {CKA_SIGN, &sign, sizeof(sign)},
+    {CKA_ID, id, sizeof(id)},
+    {CKA_LABEL, label, sizeof(label)},
+  };
+  Attributes filled(buffers, sizeof(buffers) / sizeof(buffers[0]));
+  for (auto _ : state) {
+    filled.ParseAndFill(serialized);
+    benchmark::DoNotOptimize(buffers);
+  }
+}
+
+BENCHMARK_F(AttributesFixture, SetAttributes)(benchmark::State& state) {
+  std::unique_ptr<Object> object(GetFactory()->CreateObject());
+  for (auto _ : state)
+    object->SetAttributes(attributes_.data(), attributes_.size());
+}
+
+BENCHMARK_F(AttributesFixture, GetAttributes)(benchmark::State& state) {
+  std::unique_ptr<Object> object(GetFactory()->CreateObject());
+  object->SetAttributes(attributes_.data(), attributes_.size());
+  CK_OBJECT_CLASS key_class;
+  CK_KEY_TYPE key_type;
+  CK_BBOOL sign;
+  char id[16];
+  char label[13];
+  CK_ATTRIBUTE buffers[] = {
+    {CKA_CLASS, &key_class, sizeof(key_class)},
+    {CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+    {CKA_SIGN, &sign, sizeof(sign)},
+    {CKA_ID, id, sizeof(id)},
+    {CKA_LABEL, label, sizeof(label)},
+  };
+  for (auto _ : state) {
+    object->GetAttributes(buffers, sizeof(buffers) / sizeof(buffers[0]));
+    benchmark::DoNotOptimize(buffers);
+  }
+}
+
+static void Base64EncodeCppcodec(benchmark::State& state) {
+  const string payload = MakePayload(kPayloadSize);
+  for (auto _ : state) {
+    string encoded = cppcodec::base64_url::encode(payload);
+    benchmark::DoNotOptimize(encoded.data());
+  }
+}
+BENCHMARK(Base64EncodeCppcodec);
+
+static void Base64DecodeCppcodec(benchmark::State& state) {
+  const string encoded =
+      cppcodec::base64_url::encode(MakePayload(kPayloadSize));
+  for (auto _ : state) {
+    vector<uint8_t> decoded = cppcodec::base64_url::decode(encoded);
+    benchmark::DoNotOptimize(decoded.data());
+  }
+}
+BENCHMARK(Base64DecodeCppcodec);
+
+static void Base64Encode(benchmark::State& state) {
+  const string payload = MakePayload(kPayloadSize);
+  for (auto _ : state) {
+    string encoded = Base64UrlEncode(payload);
+    benchmark::DoNotOptimize(encoded.data());
+  }
+}
+BENCHMARK(Base64Encode);
+
+static void Base64Decode(benchmark::State& state) {
+  const string encoded = Base64UrlEncode(MakePayload(kPayloadSize));
+  for (auto _ : state) {
+    string decoded = Base64UrlDecode(encoded);
+    benchmark::DoNotOptimize(decoded.data());
+  }
+}
+BENCHMARK(Base64Decode);
+
+static void EncodeSignRequest(benchmark::State& state) {
+  const string payload = MakePayload(51);
+  string body;
+  for (auto _ : state) {
+    EncodeActionRequest("message", payload, &body);
+    benchmark::DoNotOptimize(body.data());
+  }
+}
+BENCHMARK(EncodeSignRequest);
+
+static void EncodeSignRequestJson(benchmark::State& state) {
+  const string payload = MakePayload(51);
+  for (auto _ : state) {
+    nlohmann::json request;
+    request["message"] = cppcodec::base64_url::encode(payload);
+    string body = request.dump();
+    benchmark::DoNotOptimize(body.data());
+  }
+}
+BENCHMARK(EncodeSignRequestJson);
+
+static void DecodeSignResponse(benchmark::State& state) {
+  const string body = "{\"data\":{\"signedMessage\":\"" +
+                      Base64UrlEncode(MakePayload(kPayloadSize)) + "\"}}";
+  string output;
+  for (auto _ : state) {
+    DecodeActionResponse(body, "signedMessage", &output);
+    benchmark::DoNotOptimize(output.data());
+  }
+}
+BENCHMARK(DecodeSignResponse);
+
+static void DecodeSignResponseJson(benchmark::State& state) {
+  const string body = "{\"data\":{\"signedMessage\":\"" +
+                      Base64UrlEncode(MakePayload(kPayloadSize)) + "\"}}";
+  for (auto _ : state) {
+    vector<uint8_t> output = cppcodec::base64_url::decode(
+        nlohmann::json::parse(body).at("data").at("signedMessage")
+            .get<string>());
+    benchmark::DoNotOptimize(output.data());
+  }
+}
+BENCHMARK(DecodeSignResponseJson);
+
+// The cipher of ObjectStoreImpl::Encrypt and Decrypt, on a typical object.
+static void StoreEncrypt(benchmark::State& state) {
+  const brillo::SecureBlob key(32, 0x42);
+  const string blob = MakePayload(state.range(0));
+  const string aad(1, 2);
+  string sealed;
+  for (auto _ : state) {
+    RunAuthenticatedCipher(true, key, aad, blob, &sealed);
+    benchmark::DoNotOptimize(sealed.data());
+  }
+  state.SetBytesProcessed(state.iterations() * blob.size());
+}
+BENCHMARK(StoreEncrypt)->Arg(512)->Arg(4096);
+
+static void StoreDecrypt(benchmark::State& state) {
+  const brillo::SecureBlob key(32, 0x42);
+  const string aad(1, 2);
+  string sealed;
+  CHECK(RunAuthenticatedCipher(true, key, aad, MakePayload(state.range(0)),
+                               &sealed));
+  string blob;
+  for (auto _ : state) {
+    RunAuthenticatedCipher(false, key, aad, sealed, &blob);
+    benchmark::DoNotOptimize(blob.data());
+  }
+  state.SetBytesProcessed(state.iterations() * blob.size());
+}
+BENCHMARK(StoreDecrypt)->Arg(512)->Arg(4096);
+
+}  // namespace p11net
+
+BENCHMARK_MAIN();
@@ -0,0 +1,1000 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "p11net_proxy.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <boost/chrono.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "ipc_message.h"
+#include "p11net_utility.h"
+#include "pkcs11/cryptoki.h"
+#include "shm_channel.h"
+
+using brillo::SecureBlob;
+
+namespace p11net {
+
+namespace Env {
+
+// The UNIX socket of a p11netd daemon to forward all calls to. Unset, the
+// module talks to the NetHSM itself.
+const char* kDaemonSocket = "P11NET_DAEMON_SOCKET";
+// The most calls in flight to the daemon at once.
+const char* kDaemonChannels = "P11NET_DAEMON_CHANNELS";
+
+}  // namespace Env
+
+namespace {
+
+const int kDefaultDaemonChannels = 16;
+// How often the daemon is asked for slot events.
+const int kSlotEventPollMs = 1000;
+
+template <typename T>
+void ReadOutput(IpcReader* response, T* output) {
+  if (output) {
+    response->Read(output);
+  } else {
+    T ignored;
+    response->Read(&ignored);
+  }
+}
+
+}  // namespace
+
+P11NetProxyImpl::P11NetProxyImpl(const std::string& socket_path,
+                                 size_t max_channels)
+    : socket_path_(socket_path),
+      max_channels_(std::max<size_t>(max_channels, 1)),
+      open_channels_(0),
+      pid_(getpid()),
+      event_sequence_(0),
+      stopping_(false) {}
+
+P11NetProxyImpl::~P11NetProxyImpl() {
+  {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  stop_watching_.notify_all();
+  if (watcher_ && pid_ == getpid())
+    watcher_->join();
+  else
+    watcher_.release();  // The thread is the parent's.
+}
+
+std::string P11NetProxyImpl::GetDaemonSocket() {
+  const char* path = getenv(Env::kDaemonSocket);
+  return path ? path : "";
+}
+
+std::unique_ptr<P11NetProxyImpl> P11NetProxyImpl::Create() {
+  const int max_channels =
+      GetEnvInt(Env::kDaemonChannels, kDefaultDaemonChannels);
+  return std::unique_ptr<P11NetProxyImpl>(
+      new P11NetProxyImpl(GetDaemonSocket(), max_channels));
+}
+
+bool P11NetProxyImpl::Init() {
+  std::unique_ptr<ShmChannel> channel = AcquireChannel();
+  if (!channel)
+    return false;
+  ReleaseChannel(std::move(channel));
+  LOG(INFO) << "Forwarding calls to the daemon at " << socket_path_;
+  if (slot_event_callback_) {
+    // Events from before the module started are not reported.
+    if (GetSlotEvents(&event_sequence_, NULL) != CKR_OK)
+      return false;
+    boost::lock_guard<boost::mutex> lock(lock_);
+    StartWatcher();
+  }
+  return true;
+}
+
+template <typename... Outputs>
+uint32_t P11NetProxyImpl::Call(IpcWriter* request, Outputs*... outputs) {
+  IpcReader response;
+  uint32_t result = CKR_DEVICE_ERROR;
+  if (!Transact(*request, &response) || !response.Read(&result))
+    return CKR_DEVICE_ERROR;
+  // A call the daemon refused to run carries no outputs.
+  if (result != CKR_OK && response.IsComplete())
+    return result;
+  // Reads the outputs in order.
+  int unused[] = {0, (ReadOutput(&response, outputs), 0)...};
+  (void)unused;
+  if (!response.IsComplete()) {
+    LOG(ERROR) << "Malformed response from the daemon.";
+    return CKR_DEVICE_ERROR;
+  }
+  return result;
+}
+
+bool P11NetProxyImpl::Transact(const IpcWriter& request,
+                               IpcReader* response) {
+  std::unique_ptr<ShmChannel> channel = AcquireChannel();
+  if (!channel)
+    return false;
+  if (request.data().size() > channel->max_message_size()) {
+    LOG(ERROR) << "A request of " << request.data().size()
+               << " bytes exceeds the channel to the daemon.";
+    ReleaseChannel(std::move(channel));
+    return false;
+  }
+  if (!channel->Send(request.data()) || !channel->Receive(response->Reset())) {
+    LOG(ERROR) << "Lost the connection to the daemon at " << socket_path_;
+    ReleaseChannel(NULL);
+    return false;
+  }
+  ReleaseChannel(std::move(channel));
+  return true;
+}
+
+std::unique_ptr<ShmChannel> P11NetProxyImpl::AcquireChannel() {
+  boost::unique_lock<boost::mutex> lock(lock_);
+  if (pid_ != getpid()) {
+    // Closes this process's copies of the parent's channels only.
+    idle_channels_.clear();
+    open_channels_ = 0;
+    pid_ = getpid();
+    // The watcher did not survive the fork.
+    if (watcher_) {
+      watcher_.release();
+      StartWatcher();
+    }
+  }
+  while (idle_channels_.empty() && open_channels_ >= max_channels_)
+    channel_released_.wait(lock);
+  if (!idle_channels_.empty()) {
+    std::unique_ptr<ShmChannel> channel = std::move(idle_channels_.back());
+    idle_channels_.pop_back();
+    return channel;
+  }
+  ++open_channels_;
+  lock.unlock();
+  std::unique_ptr<ShmChannel> channel = ShmChannel::Connect(socket_path_);
+  if (!channel)
+    ReleaseChannel(NULL);
+  return channel;
+}
+
+void P11NetProxyImpl::ReleaseChannel(std::unique_ptr<ShmChannel> channel) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  if (pid_ != getpid())
+    return;
+  if (channel)
+    idle_channels_.push_back(std::move(channel));
+  else
+    --open_channels_;
+  channel_released_.notify_one();
+}
+
+uint32_t P11NetProxyImpl::GetSlotEvents(uint64_t* sequence,
+                                       std::vector<uint64_t>* slots) {
+  IpcWriter request(kIpcGetSlotEvents);
+  request.Write(SecureBlob(), *sequence);
+  return Call(&request, sequence, slots);
+}
+
+void P11NetProxyImpl::StartWatcher() {
+  watcher_.reset(
+      new boost::thread(&P11NetProxyImpl::WatchSlotEvents, this));
+}
+
+void P11NetProxyImpl::WatchSlotEvents() {
+  boost::unique_lock<boost::mutex> lock(lock_);
+  while (!stopping_) {
+    stop_watching_.wait_for(lock,
+                            boost::chrono::milliseconds(kSlotEventPollMs),
+                            [this] { return stopping_; });
+    if (stopping_)
+      break;
+    uint64_t sequence = event_sequence_;
+    lock.unlock();
+    std::vector<uint64_t> slots;
+    const bool ok = GetSlotEvents(&sequence, &slots) == CKR_OK;
+    for (auto i = slots.begin(); ok && i != slots.end(); ++i)
+      slot_event_callback_(static_cast<int>(*i));
+    lock.lock();
+    if (ok)
+      event_sequence_ = sequence;
+  }
+}
+
+uint32_t P11NetProxyImpl::GetSlotList(
+    const SecureBlob& isolate_credential,
+    bool token_present,
+    std::vector<uint64_t>* slot_list) {
+  IpcWriter request(kIpcGetSlotList);
+  request.Write(isolate_credential, token_present);
+  return Call(&request, slot_list);
+}
+
+uint32_t P11NetProxyImpl::GetSlotInfo(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    std::vector<uint8_t>* slot_description,
+    std::vector<uint8_t>* manufacturer_id,
+    uint64_t* flags,
+    uint8_t* hardware_version_major,
+    uint8_t* hardware_version_minor,
+    uint8_t* firmware_version_major,
+    uint8_t* firmware_version_minor) {
+  IpcWriter request(kIpcGetSlotInfo);
+  request.Write(isolate_credential, slot_id);
+  return Call(&request, slot_description, manufacturer_id, flags,
+              hardware_version_major, hardware_version_minor,
+              firmware_version_major, firmware_version_minor);
+}
+
+uint32_t P11NetProxyImpl::GetTokenInfo(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    std::vector<uint8_t>* label,
+    std::vector<uint8_t>* manufacturer_id,
+    std::vector<uint8_t>* model,
+    std::vector<uint8_t>* serial_number,
+    uint64_t* flags,
+    uint64_t* max_session_count,
+    uint64_t* session_count,
+    uint64_t* max_session_count_rw,
+    uint64_t* session_count_rw,
+    uint64_t* max_pin_len,
+    uint64_t* min_pin_len,
+    uint64_t* total_public_memory,
+    uint64_t* free_public_memory,
+    uint64_t* total_private_memory,
+    uint64_t* free_private_memory,
+    uint8_t* hardware_version_major,
+    uint8_t* hardware_version_minor,
+    uint8_t* firmware_version_major,
+    uint8_t* firmware_version_minor) {
+  IpcWriter request(kIpcGetTokenInfo);
+  request.Write(isolate_credential, slot_id);
+  return Call(&request, label, manufacturer_id, model, serial_number, flags,
+              max_session_count, session_count, max_session_count_rw,
+              session_count_rw, max_pin_len, min_pin_len, total_public_memory,
+              free_public_memory, total_private_memory, free_private_memory,
+              hardware_version_major, hardware_version_minor,
+              firmware_version_major, firmware_version_minor);
+}
+
+uint32_t P11NetProxyImpl::GetMechanismList(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    std::vector<uint64_t>* mechanism_list) {
+  IpcWriter request(kIpcGetMechanismList);
+  request.Write(isolate_credential, slot_id);
+  return Call(&request, mechanism_list);
+}
+
+uint32_t P11NetProxyImpl::GetMechanismInfo(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    uint64_t mechanism_type,
+    uint64_t* min_key_size,
+    uint64_t* max_key_size,
+    uint64_t* flags) {
+  IpcWriter request(kIpcGetMechanismInfo);
+  request.Write(isolate_credential, slot_id, mechanism_type);
+  return Call(&request, min_key_size, max_key_size, flags);
+}
+
+uint32_t P11NetProxyImpl::InitToken(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    const std::string* so_pin,
+    const std::vector<uint8_t>& label) {
+  IpcWriter request(kIpcInitToken);
+  request.Write(isolate_credential, slot_id, so_pin, label);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::InitPIN(const SecureBlob& isolate_credential,
+                                  uint64_t session_id,
+                                  const std::string* pin) {
+  IpcWriter request(kIpcInitPIN);
+  request.Write(isolate_credential, session_id, pin);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SetPIN(const SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::string* old_pin,
+                                 const std::string* new_pin) {
+  IpcWriter request(kIpcSetPIN);
+  request.Write(isolate_credential, session_id, old_pin, new_pin);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::OpenSession(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    uint64_t flags,
+    uint64_t* session) {
+  IpcWriter request(kIpcOpenSession);
+  request.Write(isolate_credential, slot_id, flags);
+  return Call(&request, session);
+}
+
+uint32_t P11NetProxyImpl::CloseSession(
+    const SecureBlob& isolate_credential,
+    uint64_t session) {
+  IpcWriter request(kIpcCloseSession);
+  request.Write(isolate_credential, session);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::CloseAllSessions(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id) {
+  IpcWriter request(kIpcCloseAllSessions);
+  request.Write(isolate_credential, slot_id);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::GetSessionInfo(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t* slot_id,
+    uint64_t* state,
+    uint64_t* flags,
+    uint64_t* device_error) {
+  IpcWriter request(kIpcGetSessionInfo);
+  request.Write(isolate_credential, session_id);
+  return Call(&request, slot_id, state, flags, device_error);
+}
+
+uint32_t P11NetProxyImpl::SetSessionPriority(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t priority) {
+  IpcWriter request(kIpcSetSessionPriority);
+  request.Write(isolate_credential, session_id, priority);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SignBatch(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const std::vector<std::vector<uint8_t>>& inputs,
+    std::vector<std::vector<uint8_t>>* outputs,
+    std::vector<uint32_t>* results) {
+  IpcWriter request(kIpcSignBatch);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle, inputs);
+  return Call(&request, outputs, results);
+}
+
+uint32_t P11NetProxyImpl::DecryptBatch(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const std::vector<std::vector<uint8_t>>& inputs,
+    std::vector<std::vector<uint8_t>>* outputs,
+    std::vector<uint32_t>* results) {
+  IpcWriter request(kIpcDecryptBatch);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle, inputs);
+  return Call(&request, outputs, results);
+}
+
+uint32_t P11NetProxyImpl::SignSubmit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const std::vector<uint8_t>& data,
+    uint64_t* operation_id) {
+  // Completions are collected from the CompletionQueue of the calling
+  // process, which the daemon cannot reach.
+  return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+uint32_t P11NetProxyImpl::DecryptSubmit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const std::vector<uint8_t>& data,
+    uint64_t* operation_id) {
+  // Completions are collected from the CompletionQueue of the calling
+  // process, which the daemon cannot reach.
+  return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+uint32_t P11NetProxyImpl::GetOperationState(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    std::vector<uint8_t>* operation_state) {
+  IpcWriter request(kIpcGetOperationState);
+  request.Write(isolate_credential, session_id);
+  return Call(&request, operation_state);
+}
+
+uint32_t P11NetProxyImpl::SetOperationState(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& operation_state,
+    uint64_t encryption_key_handle,
+    uint64_t authentication_key_handle) {
+  IpcWriter request(kIpcSetOperationState);
+  request.Write(isolate_credential, session_id, operation_state,
+                encryption_key_handle, authentication_key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Login(const SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                uint64_t user_type,
+                                const std::string* pin) {
+  IpcWriter request(kIpcLogin);
+  request.Write(isolate_credential, session_id, user_type, pin);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Logout(const SecureBlob& isolate_credential,
+                                 uint64_t session_id) {
+  IpcWriter request(kIpcLogout);
+  request.Write(isolate_credential, session_id);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::CreateObject(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& attributes,
+    uint64_t* new_object_handle) {
+  IpcWriter request(kIpcCreateObject);
+  request.Write(isolate_credential, session_id, attributes);
+  return Call(&request, new_object_handle);
+}
+
+uint32_t P11NetProxyImpl::CopyObject(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    const std::vector<uint8_t>& attributes,
+    uint64_t* new_object_handle) {
+  IpcWriter request(kIpcCopyObject);
+  request.Write(isolate_credential, session_id, object_handle, attributes);
+  return Call(&request, new_object_handle);
+}
+
+uint32_t P11NetProxyImpl::DestroyObject(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle) {
+  IpcWriter request(kIpcDestroyObject);
+  request.Write(isolate_credential, session_id, object_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::GetObjectSize(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    uint64_t* object_size) {
+  IpcWriter request(kIpcGetObjectSize);
+  request.Write(isolate_credential, session_id, object_handle);
+  return Call(&request, object_size);
+}
+
+uint32_t P11NetProxyImpl::GetAttributeValue(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    const std::vector<uint8_t>& attributes_in,
+    std::vector<uint8_t>* attributes_out) {
+  IpcWriter request(kIpcGetAttributeValue);
+  request.Write(isolate_credential, session_id, object_handle, attributes_in);
+  return Call(&request, attributes_out);
+}
+
+uint32_t P11NetProxyImpl::SetAttributeValue(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    const std::vector<uint8_t>& attributes) {
+  IpcWriter request(kIpcSetAttributeValue);
+  request.Write(isolate_credential, session_id, object_handle, attributes);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::FindObjectsInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& attributes) {
+  IpcWriter request(kIpcFindObjectsInit);
+  request.Write(isolate_credential, session_id, attributes);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::FindObjects(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t max_object_count,
+    std::vector<uint64_t>* object_list) {
+  IpcWriter request(kIpcFindObjects);
+  request.Write(isolate_credential, session_id, max_object_count);
+  return Call(&request, object_list);
+}
+
+uint32_t P11NetProxyImpl::FindObjectsFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id) {
+  IpcWriter request(kIpcFindObjectsFinal);
+  request.Write(isolate_credential, session_id);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::EncryptInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcEncryptInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Encrypt(const SecureBlob& isolate_credential,
+                                  uint64_t session_id,
+                                  const std::vector<uint8_t>& data_in,
+                                  uint64_t max_out_length,
+                                  uint64_t* actual_out_length,
+                                  std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcEncrypt);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::EncryptUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcEncryptUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::EncryptFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcEncryptFinal);
+  request.Write(isolate_credential, session_id, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+void P11NetProxyImpl::EncryptCancel(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id) {
+  IpcWriter request(kIpcEncryptCancel);
+  request.Write(isolate_credential, session_id);
+  Call(&request);
+}
+
+uint32_t P11NetProxyImpl::DecryptInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcDecryptInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Decrypt(const SecureBlob& isolate_credential,
+                                  uint64_t session_id,
+                                  const std::vector<uint8_t>& data_in,
+                                  uint64_t max_out_length,
+                                  uint64_t* actual_out_length,
+                                  std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDecrypt);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::DecryptUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDecryptUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::DecryptFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDecryptFinal);
+  request.Write(isolate_credential, session_id, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+void P11NetProxyImpl::DecryptCancel(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id) {
+  IpcWriter request(kIpcDecryptCancel);
+  request.Write(isolate_credential, session_id);
+  Call(&request);
+}
+
+uint32_t P11NetProxyImpl::DigestInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter) {
+  IpcWriter request(kIpcDigestInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Digest(const SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::vector<uint8_t>& data_in,
+                                 uint64_t max_out_length,
+                                 uint64_t* actual_out_length,
+                                 std::vector<uint8_t>* digest) {
+  IpcWriter request(kIpcDigest);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, digest);
+}
+
+uint32_t P11NetProxyImpl::DigestUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in) {
+  IpcWriter request(kIpcDigestUpdate);
+  request.Write(isolate_credential, session_id, data_in);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::DigestKey(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcDigestKey);
+  request.Write(isolate_credential, session_id, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::DigestFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* digest) {
+  IpcWriter request(kIpcDigestFinal);
+  request.Write(isolate_credential, session_id, max_out_length);
+  return Call(&request, actual_out_length, digest);
+}
+
+void P11NetProxyImpl::DigestCancel(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id) {
+  IpcWriter request(kIpcDigestCancel);
+  request.Write(isolate_credential, session_id);
+  Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SignInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcSignInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Sign(const SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               const std::vector<uint8_t>& data,
+                               uint64_t max_out_length,
+                               uint64_t* actual_out_length,
+                               std::vector<uint8_t>* signature) {
+  IpcWriter request(kIpcSign);
+  request.Write(isolate_credential, session_id, data, max_out_length);
+  return Call(&request, actual_out_length, signature);
+}
+
+uint32_t P11NetProxyImpl::SignUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_part) {
+  IpcWriter request(kIpcSignUpdate);
+  request.Write(isolate_credential, session_id, data_part);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SignFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* signature) {
+  IpcWriter request(kIpcSignFinal);
+  request.Write(isolate_credential, session_id, max_out_length);
+  return Call(&request, actual_out_length, signature);
+}
+
+void P11NetProxyImpl::SignCancel(const SecureBlob& isolate_credential,
+                                 uint64_t session_id) {
+  IpcWriter request(kIpcSignCancel);
+  request.Write(isolate_credential, session_id);
+  Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SignRecoverInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcSignRecoverInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::SignRecover(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* signature) {
+  IpcWriter request(kIpcSignRecover);
+  request.Write(isolate_credential, session_id, data, max_out_length);
+  return Call(&request, actual_out_length, signature);
+}
+
+uint32_t P11NetProxyImpl::VerifyInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcVerifyInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::Verify(const SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::vector<uint8_t>& data,
+                                 const std::vector<uint8_t>& signature) {
+  IpcWriter request(kIpcVerify);
+  request.Write(isolate_credential, session_id, data, signature);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::VerifyUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_part) {
+  IpcWriter request(kIpcVerifyUpdate);
+  request.Write(isolate_credential, session_id, data_part);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::VerifyFinal(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& signature) {
+  IpcWriter request(kIpcVerifyFinal);
+  request.Write(isolate_credential, session_id, signature);
+  return Call(&request);
+}
+
+void P11NetProxyImpl::VerifyCancel(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id) {
+  IpcWriter request(kIpcVerifyCancel);
+  request.Write(isolate_credential, session_id);
+  Call(&request);
+}
+
+uint32_t P11NetProxyImpl::VerifyRecoverInit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle) {
+  IpcWriter request(kIpcVerifyRecoverInit);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, key_handle);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::VerifyRecover(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& signature,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data) {
+  IpcWriter request(kIpcVerifyRecover);
+  request.Write(isolate_credential, session_id, signature, max_out_length);
+  return Call(&request, actual_out_length, data);
+}
+
+uint32_t P11NetProxyImpl::DigestEncryptUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDigestEncryptUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::DecryptDigestUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDecryptDigestUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::SignEncryptUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcSignEncryptUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::DecryptVerifyUpdate(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& data_in,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* data_out) {
+  IpcWriter request(kIpcDecryptVerifyUpdate);
+  request.Write(isolate_credential, session_id, data_in, max_out_length);
+  return Call(&request, actual_out_length, data_out);
+}
+
+uint32_t P11NetProxyImpl::GenerateKey(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    const std::vector<uint8_t>& attributes,
+    uint64_t* key_handle) {
+  IpcWriter request(kIpcGenerateKey);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, attributes);
+  return Call(&request, key_handle);
+}
+
+uint32_t P11NetProxyImpl::GenerateKeyPair(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    const std::vector<uint8_t>& public_attributes,
+    const std::vector<uint8_t>& private_attributes,
+    uint64_t* public_key_handle,
+    uint64_t* private_key_handle) {
+  IpcWriter request(kIpcGenerateKeyPair);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, public_attributes, private_attributes);
+  return Call(&request, public_key_handle, private_key_handle);
+}
+
+uint32_t P11NetProxyImpl::WrapKey(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t wrapping_key_handle,
+    uint64_t key_handle,
+    uint64_t max_out_length,
+    uint64_t* actual_out_length,
+    std::vector<uint8_t>* wrapped_key) {
+  IpcWriter request(kIpcWrapKey);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, wrapping_key_handle, key_handle,
+                max_out_length);
+  return Call(&request, actual_out_length, wrapped_key);
+}
+
+uint32_t P11NetProxyImpl::UnwrapKey(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t wrapping_key_handle,
+    const std::vector<uint8_t>& wrapped_key,
+    const std::vector<uint8_t>& attributes,
+    uint64_t* key_handle) {
+  IpcWriter request(kIpcUnwrapKey);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, wrapping_key_handle, wrapped_key,
+                attributes);
+  return Call(&request, key_handle);
+}
+
+uint32_t P11NetProxyImpl::DeriveKey(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const std::vector<uint8_t>& mechanism_parameter,
+    uint64_t base_key_handle,
+    const std::vector<uint8_t>& attributes,
+    uint64_t* key_handle) {
+  IpcWriter request(kIpcDeriveKey);
+  request.Write(isolate_credential, session_id, mechanism_type,
+                mechanism_parameter, base_key_handle, attributes);
+  return Call(&request, key_handle);
+}
+
+uint32_t P11NetProxyImpl::SeedRandom(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const std::vector<uint8_t>& seed) {
+  IpcWriter request(kIpcSeedRandom);
+  request.Write(isolate_credential, session_id, seed);
+  return Call(&request);
+}
+
+uint32_t P11NetProxyImpl::GenerateRandom(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t num_bytes,
+    std::vector<uint8_t>* random_data) {
+  IpcWriter request(kIpcGenerateRandom);
+  request.Write(isolate_credential, session_id, num_bytes);
+  return Call(&request, random_data);
+}
+
+}  // namespace p11net
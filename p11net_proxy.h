@@ -0,0 +1,475 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_P11NET_PROXY_H_
+#define P11NET_P11NET_PROXY_H_
+
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "p11net_interface.h"
+
+namespace p11net {
+
+class IpcReader;
+class IpcWriter;
+class ShmChannel;
+
+// P11NetProxyImpl forwards the calls of the module to the p11netd daemon, so
+// that the processes of a host share one set of NetHSM connections, key
+// inventory and caches. Each call leases a ShmChannel to the daemon and waits
+// for the response on it; calls from several threads use channels of their
+// own, up to a limit, and a channel is kept open for the next call. Sessions
+// belong to the daemon, which closes those of a process when its channels
+// go away. The non-blocking submit operations are not available through the
+// daemon, as their completions are collected in the calling process. Slot
+// events are polled from the daemon by a thread of the proxy.
+class P11NetProxyImpl : public P11NetInterface {
+ public:
+  //  socket_path - The UNIX socket the daemon listens on.
+  //  max_channels - The most channels calls may use at once.
+  P11NetProxyImpl(const std::string& socket_path, size_t max_channels);
+  virtual ~P11NetProxyImpl();
+
+  // Returns the daemon socket configured for the module, or an empty string
+  // if the module runs in-process.
+  static std::string GetDaemonSocket();
+  // Creates a proxy to the configured daemon.
+  static std::unique_ptr<P11NetProxyImpl> Create();
+
+  // Connects to the daemon. Returns false if it cannot be reached.
+  bool Init();
+
+  // Receives the identifier of a slot whose state changed.
+  typedef std::function<void(int)> SlotEventCallback;
+  // Sets the callback for the slot events of the daemon. It runs on a
+  // background thread. This must be called before Init.
+  void SetSlotEventCallback(const SlotEventCallback& callback) {
+    slot_event_callback_ = callback;
+  }
+
+  // P11NetInterface methods
+  virtual uint32_t GetSlotList(const brillo::SecureBlob& isolate_credential,
+                               bool token_present,
+                               std::vector<uint64_t>* slot_list);
+  virtual uint32_t GetSlotInfo(const brillo::SecureBlob& isolate_credential,
+                               uint64_t slot_id,
+                               std::vector<uint8_t>* slot_description,
+                               std::vector<uint8_t>* manufacturer_id,
+                               uint64_t* flags,
+                               uint8_t* hardware_version_major,
+                               uint8_t* hardware_version_minor,
+                               uint8_t* firmware_version_major,
+                               uint8_t* firmware_version_minor);
+  virtual uint32_t GetTokenInfo(const brillo::SecureBlob& isolate_credential,
+                                uint64_t slot_id,
+                                std::vector<uint8_t>* label,
+                                std::vector<uint8_t>* manufacturer_id,
+                                std::vector<uint8_t>* model,
+                                std::vector<uint8_t>* serial_number,
+                                uint64_t* flags,
+                                uint64_t* max_session_count,
+                                uint64_t* session_count,
+                                uint64_t* max_session_count_rw,
+                                uint64_t* session_count_rw,
+                                uint64_t* max_pin_len,
+                                uint64_t* min_pin_len,
+                                uint64_t* total_public_memory,
+                                uint64_t* free_public_memory,
+                                uint64_t* total_private_memory,
+                                uint64_t* free_private_memory,
+                                uint8_t* hardware_version_major,
+                                uint8_t* hardware_version_minor,
+                                uint8_t* firmware_version_major,
+                                uint8_t* firmware_version_minor);
+  virtual uint32_t GetMechanismList(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t slot_id,
+      std::vector<uint64_t>* mechanism_list);
+  virtual uint32_t GetMechanismInfo(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t slot_id,
+      uint64_t mechanism_type,
+      uint64_t* min_key_size,
+      uint64_t* max_key_size,
+      uint64_t* flags);
+  virtual uint32_t InitToken(const brillo::SecureBlob& isolate_credential,
+                             uint64_t slot_id,
+                             const std::string* so_pin,
+                             const std::vector<uint8_t>& label);
+  virtual uint32_t InitPIN(const brillo::SecureBlob& isolate_credential,
+                           uint64_t session_id, const std::string* pin);
+  virtual uint32_t SetPIN(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id,
+                          const std::string* old_pin,
+                          const std::string* new_pin);
+  virtual uint32_t OpenSession(const brillo::SecureBlob& isolate_credential,
+                               uint64_t slot_id, uint64_t flags,
+                               uint64_t* session);
+  virtual uint32_t CloseSession(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session);
+  virtual uint32_t CloseAllSessions(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t slot_id);
+  virtual uint32_t GetSessionInfo(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t* slot_id,
+      uint64_t* state,
+      uint64_t* flags,
+      uint64_t* device_error);
+  virtual uint32_t SetSessionPriority(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t priority);
+  virtual uint32_t SignBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results);
+  virtual uint32_t DecryptBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results);
+  virtual uint32_t SignSubmit(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              uint64_t mechanism_type,
+                              const std::vector<uint8_t>& mechanism_parameter,
+                              uint64_t key_handle,
+                              const std::vector<uint8_t>& data,
+                              uint64_t* operation_id);
+  virtual uint32_t DecryptSubmit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<uint8_t>& data,
+      uint64_t* operation_id);
+  virtual uint32_t GetOperationState(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      std::vector<uint8_t>* operation_state);
+  virtual uint32_t SetOperationState(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& operation_state,
+      uint64_t encryption_key_handle,
+      uint64_t authentication_key_handle);
+  virtual uint32_t Login(const brillo::SecureBlob& isolate_credential,
+                         uint64_t session_id,
+                         uint64_t user_type,
+                         const std::string* pin);
+  virtual uint32_t Logout(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id);
+  virtual uint32_t CreateObject(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                const std::vector<uint8_t>& attributes,
+                                uint64_t* new_object_handle);
+  virtual uint32_t CopyObject(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              uint64_t object_handle,
+                              const std::vector<uint8_t>& attributes,
+                              uint64_t* new_object_handle);
+  virtual uint32_t DestroyObject(const brillo::SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 uint64_t object_handle);
+  virtual uint32_t GetObjectSize(const brillo::SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 uint64_t object_handle,
+                                 uint64_t* object_size);
+  virtual uint32_t GetAttributeValue(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t object_handle,
+      const std::vector<uint8_t>& attributes_in,
+      std::vector<uint8_t>* attributes_out);
+  virtual uint32_t SetAttributeValue(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t object_handle,
+      const std::vector<uint8_t>& attributes);
+  virtual uint32_t FindObjectsInit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& attributes);
+  virtual uint32_t FindObjects(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               uint64_t max_object_count,
+                               std::vector<uint64_t>* object_list);
+  virtual uint32_t FindObjectsFinal(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id);
+  virtual uint32_t EncryptInit(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               uint64_t mechanism_type,
+                               const std::vector<uint8_t>& mechanism_parameter,
+                               uint64_t key_handle);
+  virtual uint32_t Encrypt(const brillo::SecureBlob& isolate_credential,
+                           uint64_t session_id,
+                           const std::vector<uint8_t>& data_in,
+                           uint64_t max_out_length,
+                           uint64_t* actual_out_length,
+                           std::vector<uint8_t>* data_out);
+  virtual uint32_t EncryptUpdate(const brillo::SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::vector<uint8_t>& data_in,
+                                 uint64_t max_out_length,
+                                 uint64_t* actual_out_length,
+                                 std::vector<uint8_t>* data_out);
+  virtual uint32_t EncryptFinal(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                uint64_t max_out_length,
+                                uint64_t* actual_out_length,
+                                std::vector<uint8_t>* data_out);
+  virtual void EncryptCancel(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id);
+  virtual uint32_t DecryptInit(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               uint64_t mechanism_type,
+                               const std::vector<uint8_t>& mechanism_parameter,
+                               uint64_t key_handle);
+  virtual uint32_t Decrypt(const brillo::SecureBlob& isolate_credential,
+                           uint64_t session_id,
+                           const std::vector<uint8_t>& data_in,
+                           uint64_t max_out_length,
+                           uint64_t* actual_out_length,
+                           std::vector<uint8_t>* data_out);
+  virtual uint32_t DecryptUpdate(const brillo::SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::vector<uint8_t>& data_in,
+                                 uint64_t max_out_length,
+                                 uint64_t* actual_out_length,
+                                 std::vector<uint8_t>* data_out);
+  virtual uint32_t DecryptFinal(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                uint64_t max_out_length,
+                                uint64_t* actual_out_length,
+                                std::vector<uint8_t>* data_out);
+  virtual void DecryptCancel(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id);
+  virtual uint32_t DigestInit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter);
+  virtual uint32_t Digest(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id,
+                          const std::vector<uint8_t>& data_in,
+                          uint64_t max_out_length,
+                          uint64_t* actual_out_length,
+                          std::vector<uint8_t>* digest);
+  virtual uint32_t DigestUpdate(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                const std::vector<uint8_t>& data_in);
+  virtual uint32_t DigestKey(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id,
+                             uint64_t key_handle);
+  virtual uint32_t DigestFinal(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               uint64_t max_out_length,
+                               uint64_t* actual_out_length,
+                               std::vector<uint8_t>* digest);
+  virtual void DigestCancel(const brillo::SecureBlob& isolate_credential,
+                            uint64_t session_id);
+  virtual uint32_t SignInit(const brillo::SecureBlob& isolate_credential,
+                            uint64_t session_id,
+                            uint64_t mechanism_type,
+                            const std::vector<uint8_t>& mechanism_parameter,
+                            uint64_t key_handle);
+  virtual uint32_t Sign(const brillo::SecureBlob& isolate_credential,
+                        uint64_t session_id,
+                        const std::vector<uint8_t>& data,
+                        uint64_t max_out_length,
+                        uint64_t* actual_out_length,
+                        std::vector<uint8_t>* signature);
+  virtual uint32_t SignUpdate(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              const std::vector<uint8_t>& data_part);
+  virtual uint32_t SignFinal(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id,
+                             uint64_t max_out_length,
+                             uint64_t* actual_out_length,
+                             std::vector<uint8_t>* signature);
+  virtual void SignCancel(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id);
+  virtual uint32_t SignRecoverInit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle);
+  virtual uint32_t SignRecover(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               const std::vector<uint8_t>& data,
+                               uint64_t max_out_length,
+                               uint64_t* actual_out_length,
+                               std::vector<uint8_t>* signature);
+  virtual uint32_t VerifyInit(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              uint64_t mechanism_type,
+                              const std::vector<uint8_t>& mechanism_parameter,
+                              uint64_t key_handle);
+  virtual uint32_t Verify(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id,
+                          const std::vector<uint8_t>& data,
+                          const std::vector<uint8_t>& signature);
+  virtual uint32_t VerifyUpdate(const brillo::SecureBlob& isolate_credential,
+                                uint64_t session_id,
+                                const std::vector<uint8_t>& data_part);
+  virtual uint32_t VerifyFinal(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               const std::vector<uint8_t>& signature);
+  virtual void VerifyCancel(const brillo::SecureBlob& isolate_credential,
+                            uint64_t session_id);
+  virtual uint32_t VerifyRecoverInit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle);
+  virtual uint32_t VerifyRecover(const brillo::SecureBlob& isolate_credential,
+                                 uint64_t session_id,
+                                 const std::vector<uint8_t>& signature,
+                                 uint64_t max_out_length,
+                                 uint64_t* actual_out_length,
+                                 std::vector<uint8_t>* data);
+  virtual uint32_t DigestEncryptUpdate(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& data_in,
+      uint64_t max_out_length,
+      uint64_t* actual_out_length,
+      std::vector<uint8_t>* data_out);
+  virtual uint32_t DecryptDigestUpdate(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& data_in,
+      uint64_t max_out_length,
+      uint64_t* actual_out_length,
+      std::vector<uint8_t>* data_out);
+  virtual uint32_t SignEncryptUpdate(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& data_in,
+      uint64_t max_out_length,
+      uint64_t* actual_out_length,
+      std::vector<uint8_t>* data_out);
+  virtual uint32_t DecryptVerifyUpdate(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const std::vector<uint8_t>& data_in,
+      uint64_t max_out_length,
+      uint64_t* actual_out_length,
+      std::vector<uint8_t>* data_out);
+  virtual uint32_t GenerateKey(const brillo::SecureBlob& isolate_credential,
+                               uint64_t session_id,
+                               uint64_t mechanism_type,
+                               const std::vector<uint8_t>& mechanism_parameter,
+                               const std::vector<uint8_t>& attributes,
+                               uint64_t* key_handle);
+  virtual uint32_t GenerateKeyPair(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      const std::vector<uint8_t>& public_attributes,
+      const std::vector<uint8_t>& private_attributes,
+      uint64_t* public_key_handle,
+      uint64_t* private_key_handle);
+  virtual uint32_t WrapKey(const brillo::SecureBlob& isolate_credential,
+                           uint64_t session_id,
+                           uint64_t mechanism_type,
+                           const std::vector<uint8_t>& mechanism_parameter,
+                           uint64_t wrapping_key_handle,
+                           uint64_t key_handle,
+                           uint64_t max_out_length,
+                           uint64_t* actual_out_length,
+                           std::vector<uint8_t>* wrapped_key);
+  virtual uint32_t UnwrapKey(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id,
+                             uint64_t mechanism_type,
+                             const std::vector<uint8_t>& mechanism_parameter,
+                             uint64_t wrapping_key_handle,
+                             const std::vector<uint8_t>& wrapped_key,
+                             const std::vector<uint8_t>& attributes,
+                             uint64_t* key_handle);
+  virtual uint32_t DeriveKey(const brillo::SecureBlob& isolate_credential,
+                             uint64_t session_id,
+                             uint64_t mechanism_type,
+                             const std::vector<uint8_t>& mechanism_parameter,
+                             uint64_t base_key_handle,
+                             const std::vector<uint8_t>& attributes,
+                             uint64_t* key_handle);
+  virtual uint32_t SeedRandom(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              const std::vector<uint8_t>& seed);
+  virtual uint32_t GenerateRandom(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t num_bytes,
+      std::vector<uint8_t>* random_data);
+
+ private:
+  // Sends 'request' and reads the result and then each output of the
+  // response. Outputs may be NULL. A failed call may come without outputs,
+  // which are then left alone. Returns CKR_DEVICE_ERROR if the daemon cannot
+  // be reached or responds with a malformed message.
+  template <typename... Outputs>
+  uint32_t Call(IpcWriter* request, Outputs*... outputs);
+  // Sends 'request' on a leased channel and receives the response.
+  bool Transact(const IpcWriter& request, IpcReader* response);
+  // Leases an idle channel or connects a new one, waiting while
+  // max_channels_ are in use. Returns NULL if the daemon cannot be reached.
+  std::unique_ptr<ShmChannel> AcquireChannel();
+  // Returns a channel to the pool; NULL if the lease failed or broke it.
+  void ReleaseChannel(std::unique_ptr<ShmChannel> channel);
+  // Returns the slots with events after 'sequence', which it advances to the
+  // daemon's. 'slots' may be NULL.
+  uint32_t GetSlotEvents(uint64_t* sequence, std::vector<uint64_t>* slots);
+  // Starts the thread that polls for slot events. Requires lock_.
+  void StartWatcher();
+  void WatchSlotEvents();
+
+  const std::string socket_path_;
+  const size_t max_channels_;
+  boost::mutex lock_;
+  boost::condition_variable channel_released_;
+  std::vector<std::unique_ptr<ShmChannel>> idle_channels_;
+  // The channels connected, leased or idle.
+  size_t open_channels_;
+  // The process the channels were opened by. A forked child connects its
+  // own, as the daemon pairs each channel with one caller at a time.
+  pid_t pid_;
+  SlotEventCallback slot_event_callback_;
+  // The sequence number of the last slot events reported.
+  uint64_t event_sequence_;
+  bool stopping_;
+  boost::condition_variable stop_watching_;
+  std::unique_ptr<boost::thread> watcher_;
+
+  DISALLOW_COPY_AND_ASSIGN(P11NetProxyImpl);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_P11NET_PROXY_H_
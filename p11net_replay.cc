@@ -0,0 +1,519 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// p11net_replay loads a PKCS #11 module and drives it with the calls of a call
+// trace recorded with P11NET_CALL_TRACE_FILE. Every recorded thread is
+// replayed on a thread of its own, and every call is issued at its recorded
+// time, so the replay has the concurrency and arrival pattern of the recorded
+// traffic. Sample usage:
+//    p11net_replay --module=./libp11net.so --trace=calls.trace --pin=1234
+//        --label=mykey --speed=2
+// A trace holds no data, so the replay signs, decrypts and digests generated
+// data of the recorded sizes with the key named by --label. Recorded sessions
+// are opened when they are first used; calls the replay cannot reproduce, e.g.
+// object creation, are counted and skipped.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "call_recorder.h"
+#include "pkcs11/cryptoki.h"
+
+using p11net::CallRecord;
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char kUsage[] =
+    "Usage: p11net_replay --module=PATH --trace=FILE [--speed=FACTOR]\n"
+    "           [--slot=ID] [--pin=PIN] [--label=LABEL]\n";
+
+// The largest output the replay provides room for.
+const CK_ULONG kMaxOutputSize = 16384;
+
+struct Options {
+  string module;
+  string trace;
+  double speed = 1;
+  CK_SLOT_ID slot = 0;
+  string pin;
+  string label;
+};
+
+struct Trace {
+  // Function names by id.
+  std::map<uint16_t, string> functions;
+  // The calls of every recorded thread, in order.
+  std::map<uint32_t, vector<CallRecord>> threads;
+  uint64_t num_calls = 0;
+};
+
+// The outcome of the calls of one function.
+struct FunctionResult {
+  // Latencies in microseconds.
+  vector<uint32_t> latencies;
+  uint64_t errors = 0;
+  uint64_t skipped = 0;
+  CK_RV last_error = CKR_OK;
+};
+
+struct ThreadResult {
+  std::map<string, FunctionResult> functions;
+  // How far the thread fell behind the recorded schedule.
+  Clock::duration max_lag = Clock::duration::zero();
+};
+
+CK_FUNCTION_LIST_PTR g_functions = NULL;
+
+// The sessions of the replay by recorded session handle.
+std::mutex g_sessions_lock;
+std::map<uint64_t, CK_SESSION_HANDLE> g_sessions;
+
+// Set up before the replay starts.
+CK_OBJECT_HANDLE g_private_key = CK_INVALID_HANDLE;
+CK_OBJECT_HANDLE g_public_key = CK_INVALID_HANDLE;
+vector<CK_BYTE> g_cipher_text;
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  std::map<string, string> values;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+      fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
+      return false;
+    }
+    values[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+  }
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    const string& name = it->first;
+    const string& value = it->second;
+    if (name == "module")
+      options->module = value;
+    else if (name == "trace")
+      options->trace = value;
+    else if (name == "speed")
+      options->speed = atof(value.c_str());
+    else if (name == "slot")
+      options->slot = strtoul(value.c_str(), NULL, 0);
+    else if (name == "pin")
+      options->pin = value;
+    else if (name == "label")
+      options->label = value;
+    else {
+      fprintf(stderr, "Unknown option: --%s\n", name.c_str());
+      return false;
+    }
+  }
+  return !options->module.empty() && !options->trace.empty() &&
+         options->speed > 0;
+}
+
+bool ReadTrace(const string& path, Trace* trace) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  char magic[sizeof(p11net::kCallTraceMagic)];
+  uint32_t version = 0;
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, p11net::kCallTraceMagic, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, file) != 1 ||
+      version != p11net::kCallTraceVersion) {
+    fprintf(stderr, "%s is not a call trace.\n", path.c_str());
+    fclose(file);
+    return false;
+  }
+  bool ok = true;
+  uint8_t type;
+  while (ok && fread(&type, sizeof(type), 1, file) == 1) {
+    if (type == p11net::kFunctionEntry) {
+      uint16_t id = 0;
+      uint16_t length = 0;
+      string name;
+      ok = fread(&id, sizeof(id), 1, file) == 1 &&
+           fread(&length, sizeof(length), 1, file) == 1;
+      if (ok) {
+        name.resize(length);
+        ok = length == 0 || fread(&name[0], length, 1, file) == 1;
+      }
+      trace->functions[id] = name;
+    } else if (type == p11net::kCallEntry) {
+      CallRecord record;
+      ok = fread(&record, sizeof(record), 1, file) == 1;
+      if (ok) {
+        trace->threads[record.thread].push_back(record);
+        ++trace->num_calls;
+      }
+    } else {
+      ok = false;
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    // A trace cut short by a crash is still worth replaying.
+    fprintf(stderr, "Ignoring the truncated end of %s.\n", path.c_str());
+  }
+  // Calls are recorded when they return; replay them in the order they began.
+  for (auto& thread : trace->threads) {
+    std::stable_sort(thread.second.begin(), thread.second.end(),
+                     [](const CallRecord& a, const CallRecord& b) {
+                       return a.start_ns < b.start_ns;
+                     });
+  }
+  return true;
+}
+
+bool LoadModule(const string& path) {
+  void* module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!module) {
+    fprintf(stderr, "Failed to load %s: %s\n", path.c_str(), dlerror());
+    return false;
+  }
+  CK_C_GetFunctionList get_function_list = reinterpret_cast<
+      CK_C_GetFunctionList>(dlsym(module, "C_GetFunctionList"));
+  if (!get_function_list || get_function_list(&g_functions) != CKR_OK) {
+    fprintf(stderr, "%s is not a PKCS #11 module.\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Check(CK_RV rv, const char* function) {
+  if (rv == CKR_OK)
+    return true;
+  fprintf(stderr, "%s failed: 0x%lx\n", function, rv);
+  return false;
+}
+
+// Finds the first key of the given class, with the label if one was given.
+CK_RV FindKey(const Options& options,
+              CK_SESSION_HANDLE session,
+              CK_OBJECT_CLASS key_class,
+              CK_OBJECT_HANDLE* key) {
+  CK_ATTRIBUTE search_template[] = {
+    {CKA_CLASS, &key_class, sizeof(key_class)},
+    {CKA_LABEL, const_cast<char*>(options.label.data()), options.label.size()},
+  };
+  const CK_ULONG num_attributes = options.label.empty() ? 1 : 2;
+  CK_RV rv = g_functions->C_FindObjectsInit(session, search_template,
+                                            num_attributes);
+  if (rv != CKR_OK)
+    return rv;
+  CK_ULONG count = 0;
+  rv = g_functions->C_FindObjects(session, key, 1, &count);
+  CK_RV final_rv = g_functions->C_FindObjectsFinal(session);
+  if (rv == CKR_OK && count == 0)
+    rv = CKR_KEY_HANDLE_INVALID;
+  return rv != CKR_OK ? rv : final_rv;
+}
+
+// Logs in and finds the keys the replayed operations use.
+bool Prepare(const Options& options) {
+  CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+  if (!Check(g_functions->C_OpenSession(options.slot, CKF_SERIAL_SESSION,
+                                        NULL, NULL, &session),
+             "C_OpenSession"))
+    return false;
+  if (!options.pin.empty()) {
+    CK_RV rv = g_functions->C_Login(
+        session, CKU_USER,
+        reinterpret_cast<CK_UTF8CHAR_PTR>(
+            const_cast<char*>(options.pin.data())),
+        options.pin.size());
+    if (rv != CKR_USER_ALREADY_LOGGED_IN && !Check(rv, "C_Login"))
+      return false;
+  }
+  if (!Check(FindKey(options, session, CKO_PRIVATE_KEY, &g_private_key),
+             "Finding the private key"))
+    return false;
+  // Decryption needs a valid cipher text; without a public key the recorded
+  // decryptions fail instead.
+  CK_MECHANISM mechanism = {CKM_RSA_PKCS, NULL, 0};
+  CK_BYTE message[32];
+  memset(message, 0x5a, sizeof(message));
+  CK_ULONG length = kMaxOutputSize;
+  g_cipher_text.resize(length);
+  if (FindKey(options, session, CKO_PUBLIC_KEY, &g_public_key) == CKR_OK &&
+      g_functions->C_EncryptInit(session, &mechanism, g_public_key) ==
+          CKR_OK &&
+      g_functions->C_Encrypt(session, message, sizeof(message),
+                             g_cipher_text.data(), &length) == CKR_OK) {
+    g_cipher_text.resize(length);
+  } else {
+    g_cipher_text.clear();
+  }
+  // The session stays open, and with it the login, until C_Finalize.
+  return true;
+}
+
+// Returns the replay's session for a recorded session, opening it on first
+// use.
+CK_RV GetSession(const Options& options,
+                 uint64_t recorded_session,
+                 CK_SESSION_HANDLE* session) {
+  std::lock_guard<std::mutex> lock(g_sessions_lock);
+  auto it = g_sessions.find(recorded_session);
+  if (it != g_sessions.end()) {
+    *session = it->second;
+    return CKR_OK;
+  }
+  CK_RV rv = g_functions->C_OpenSession(
+      options.slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, session);
+  if (rv == CKR_OK)
+    g_sessions[recorded_session] = *session;
+  return rv;
+}
+
+CK_RV CloseSession(uint64_t recorded_session) {
+  CK_SESSION_HANDLE session;
+  {
+    std::lock_guard<std::mutex> lock(g_sessions_lock);
+    auto it = g_sessions.find(recorded_session);
+    if (it == g_sessions.end())
+      return CKR_OK;
+    session = it->second;
+    g_sessions.erase(it);
+  }
+  return g_functions->C_CloseSession(session);
+}
+
+// The mechanism of a recorded operation, or 'default_mechanism' if none was
+// recorded.
+CK_MECHANISM GetMechanism(const CallRecord& record,
+                          CK_MECHANISM_TYPE default_mechanism) {
+  CK_MECHANISM mechanism = {
+      record.mechanism ? record.mechanism : default_mechanism, NULL, 0};
+  return mechanism;
+}
+
+// Issues the equivalent of a recorded call. Returns false if the call cannot
+// be replayed.
+bool ReplayCall(const Options& options,
+                const string& function,
+                const CallRecord& record,
+                CK_RV* rv) {
+  if (function == "C_OpenSession" || function == "C_Login" ||
+      function == "C_Logout") {
+    // Sessions are opened on first use and logged in during preparation.
+    *rv = CKR_OK;
+    return true;
+  }
+  if (function == "C_GetSlotInfo") {
+    CK_SLOT_INFO info;
+    *rv = g_functions->C_GetSlotInfo(options.slot, &info);
+    return true;
+  }
+  if (function == "C_GetTokenInfo") {
+    CK_TOKEN_INFO info;
+    *rv = g_functions->C_GetTokenInfo(options.slot, &info);
+    return true;
+  }
+  if (function == "C_CloseSession") {
+    *rv = CloseSession(record.handle);
+    return true;
+  }
+  CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+  *rv = GetSession(options, record.handle, &session);
+  if (*rv != CKR_OK)
+    return true;
+  vector<CK_BYTE> input(std::max<uint32_t>(record.input_size, 1), 0xa5);
+  vector<CK_BYTE> output(kMaxOutputSize);
+  CK_ULONG output_length = output.size();
+  if (function == "C_SignInit") {
+    CK_MECHANISM mechanism = GetMechanism(record, CKM_SHA256_RSA_PKCS);
+    *rv = g_functions->C_SignInit(session, &mechanism, g_private_key);
+  } else if (function == "C_Sign") {
+    *rv = g_functions->C_Sign(session, input.data(), record.input_size,
+                              output.data(), &output_length);
+  } else if (function == "C_SignUpdate") {
+    *rv = g_functions->C_SignUpdate(session, input.data(), record.input_size);
+  } else if (function == "C_SignFinal") {
+    *rv = g_functions->C_SignFinal(session, output.data(), &output_length);
+  } else if (function == "C_DecryptInit") {
+    CK_MECHANISM mechanism = GetMechanism(record, CKM_RSA_PKCS);
+    *rv = g_functions->C_DecryptInit(session, &mechanism, g_private_key);
+  } else if (function == "C_Decrypt") {
+    *rv = g_functions->C_Decrypt(session, g_cipher_text.data(),
+                                 g_cipher_text.size(), output.data(),
+                                 &output_length);
+  } else if (function == "C_DigestInit") {
+    CK_MECHANISM mechanism = GetMechanism(record, CKM_SHA256);
+    *rv = g_functions->C_DigestInit(session, &mechanism);
+  } else if (function == "C_Digest") {
+    *rv = g_functions->C_Digest(session, input.data(), record.input_size,
+                                output.data(), &output_length);
+  } else if (function == "C_DigestUpdate") {
+    *rv = g_functions->C_DigestUpdate(session, input.data(),
+                                      record.input_size);
+  } else if (function == "C_DigestFinal") {
+    *rv = g_functions->C_DigestFinal(session, output.data(), &output_length);
+  } else if (function == "C_FindObjectsInit") {
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE search_template[] = {
+      {CKA_CLASS, &key_class, sizeof(key_class)},
+      {CKA_LABEL, const_cast<char*>(options.label.data()),
+       options.label.size()},
+    };
+    *rv = g_functions->C_FindObjectsInit(session, search_template,
+                                         options.label.empty() ? 1 : 2);
+  } else if (function == "C_FindObjects") {
+    vector<CK_OBJECT_HANDLE> objects(std::max<uint32_t>(record.input_size, 1));
+    CK_ULONG count = 0;
+    *rv = g_functions->C_FindObjects(session, objects.data(), objects.size(),
+                                     &count);
+  } else if (function == "C_FindObjectsFinal") {
+    *rv = g_functions->C_FindObjectsFinal(session);
+  } else if (function == "C_GetAttributeValue") {
+    CK_ATTRIBUTE attributes[] = {
+      {CKA_LABEL, NULL, 0},
+      {CKA_ID, NULL, 0},
+      {CKA_MODULUS, NULL, 0},
+    };
+    *rv = g_functions->C_GetAttributeValue(
+        session, g_private_key, attributes,
+        std::min<CK_ULONG>(std::max<uint32_t>(record.input_size, 1), 3));
+  } else if (function == "C_GenerateRandom") {
+    *rv = g_functions->C_GenerateRandom(session, input.data(),
+                                        record.input_size);
+  } else if (function == "C_GetSessionInfo") {
+    CK_SESSION_INFO info;
+    *rv = g_functions->C_GetSessionInfo(session, &info);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void RunThread(const Options& options,
+               const Trace& trace,
+               const vector<CallRecord>& calls,
+               const Clock::time_point& start,
+               ThreadResult* result) {
+  for (const CallRecord& record : calls) {
+    const Clock::time_point scheduled =
+        start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double, std::nano>(
+                        record.start_ns / options.speed));
+    std::this_thread::sleep_until(scheduled);
+    auto name = trace.functions.find(record.function);
+    const string function =
+        name != trace.functions.end() ? name->second : "unknown";
+    FunctionResult& function_result = result->functions[function];
+    const Clock::time_point call_start = Clock::now();
+    result->max_lag = std::max(result->max_lag, call_start - scheduled);
+    CK_RV rv = CKR_OK;
+    if (!ReplayCall(options, function, record, &rv)) {
+      ++function_result.skipped;
+      continue;
+    }
+    if (rv == CKR_OK) {
+      function_result.latencies.push_back(static_cast<uint32_t>(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              Clock::now() - call_start).count()));
+    } else {
+      ++function_result.errors;
+      function_result.last_error = rv;
+    }
+  }
+}
+
+// Returns the latency at the given percentile (0-100) of sorted latencies.
+uint32_t GetPercentile(const vector<uint32_t>& sorted, double percentile) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = static_cast<size_t>(percentile / 100 * sorted.size());
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+void Report(const Trace& trace,
+            const vector<ThreadResult>& results,
+            const Clock::duration& elapsed) {
+  std::map<string, FunctionResult> functions;
+  Clock::duration max_lag = Clock::duration::zero();
+  for (const ThreadResult& result : results) {
+    for (const auto& function : result.functions) {
+      FunctionResult& total = functions[function.first];
+      total.latencies.insert(total.latencies.end(),
+                             function.second.latencies.begin(),
+                             function.second.latencies.end());
+      total.errors += function.second.errors;
+      total.skipped += function.second.skipped;
+      if (function.second.errors)
+        total.last_error = function.second.last_error;
+    }
+    max_lag = std::max(max_lag, result.max_lag);
+  }
+  printf("threads:  %zu\n", trace.threads.size());
+  printf("calls:    %llu\n", static_cast<unsigned long long>(trace.num_calls));
+  printf("elapsed:  %.3f s\n",
+         std::chrono::duration<double>(elapsed).count());
+  printf("max lag:  %lld us\n", static_cast<long long>(
+      std::chrono::duration_cast<std::chrono::microseconds>(max_lag).count()));
+  printf("%-22s %8s %7s %7s %9s %9s %9s\n", "function", "calls", "errors",
+         "skipped", "p50 us", "p99 us", "max us");
+  for (auto& function : functions) {
+    FunctionResult& result = function.second;
+    std::sort(result.latencies.begin(), result.latencies.end());
+    printf("%-22s %8zu %7llu %7llu %9u %9u %9u", function.first.c_str(),
+           result.latencies.size(),
+           static_cast<unsigned long long>(result.errors),
+           static_cast<unsigned long long>(result.skipped),
+           GetPercentile(result.latencies, 50),
+           GetPercentile(result.latencies, 99),
+           result.latencies.empty() ? 0 : result.latencies.back());
+    if (result.errors)
+      printf(" (last 0x%lx)", result.last_error);
+    printf("\n");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  Trace trace;
+  if (!ReadTrace(options.trace, &trace) || !LoadModule(options.module))
+    return 1;
+  if (!Check(g_functions->C_Initialize(NULL), "C_Initialize") ||
+      !Prepare(options))
+    return 1;
+
+  const Clock::time_point start = Clock::now();
+  vector<ThreadResult> results(trace.threads.size());
+  vector<std::thread> threads;
+  size_t index = 0;
+  for (const auto& thread : trace.threads) {
+    threads.push_back(std::thread(RunThread, std::cref(options),
+                                  std::cref(trace), std::cref(thread.second),
+                                  start, &results[index++]));
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+  const Clock::duration elapsed = Clock::now() - start;
+
+  g_functions->C_Finalize(NULL);
+  Report(trace, results, elapsed);
+  return 0;
+}
@@ -5,9 +5,13 @@
 #include <iostream>
 #include "p11net_service.h"
 
+#include <algorithm>
+#include <limits>
+
 #include <base/logging.h>
 
 #include "attributes.h"
+#include "completion_queue.h"
 #include "p11net.h"
 #include "p11net_utility.h"
 #include "object.h"
@@ -20,6 +24,26 @@ using brillo::SecureBlob;
 
 namespace p11net {
 
+namespace {
+
+// Returns true if the template reads an attribute of a certificate that is
+// only known once its value has been fetched.
+bool ReadsCertificateValue(const CK_ATTRIBUTE_PTR attributes,
+                           CK_ULONG num_attributes) {
+  for (CK_ULONG i = 0; i < num_attributes; ++i) {
+    switch (attributes[i].type) {
+      case CKA_VALUE:
+      case CKA_SUBJECT:
+      case CKA_ISSUER:
+      case CKA_SERIAL_NUMBER:
+        return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
 P11NetServiceImpl::P11NetServiceImpl(std::shared_ptr<SlotManager> slot_manager)
     : slot_manager_(slot_manager),
       init_(false) {
@@ -69,11 +93,10 @@ uint32_t P11NetServiceImpl::GetSlotInfo(const SecureBlob& isolate_credential,
       !firmware_version_major || !firmware_version_minor) {
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
   }
-  if (static_cast<int>(slot_id) >= slot_manager_->GetSlotCount() ||
-      !slot_manager_->IsTokenAccessible(isolate_credential, slot_id))
-    LOG_CK_RV_AND_RETURN(CKR_SLOT_ID_INVALID);
   CK_SLOT_INFO slot_info;
-  slot_manager_->GetSlotInfo(isolate_credential, slot_id, &slot_info);
+  uint32_t result = GetSlotInfoDirect(isolate_credential, slot_id, &slot_info);
+  if (result != CKR_OK)
+    return result;
   *slot_description =
       ConvertByteBufferToVector(slot_info.slotDescription,
                                 arraysize(slot_info.slotDescription));
@@ -118,14 +141,11 @@ uint32_t P11NetServiceImpl::GetTokenInfo(const SecureBlob& isolate_credential,
       !firmware_version_major || !firmware_version_minor) {
     LOG_CK_RV_AND_RETURN(CKR_ARGUMENTS_BAD);
   }
-  if (static_cast<int>(slot_id) >= slot_manager_->GetSlotCount() ||
-      !slot_manager_->IsTokenAccessible(isolate_credential, slot_id))
-    LOG_CK_RV_AND_RETURN(CKR_SLOT_ID_INVALID);
-  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->IsTokenPresent(isolate_credential,
-                                                         slot_id),
-                          CKR_TOKEN_NOT_PRESENT);
   CK_TOKEN_INFO token_info;
-  slot_manager_->GetTokenInfo(isolate_credential, slot_id, &token_info);
+  uint32_t result =
+      GetTokenInfoDirect(isolate_credential, slot_id, &token_info);
+  if (result != CKR_OK)
+    return result;
   *label =
       ConvertByteBufferToVector(token_info.label, arraysize(token_info.label));
   *manufacturer_id =
@@ -166,14 +186,62 @@ uint32_t P11NetServiceImpl::GetMechanismList(
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->IsTokenPresent(isolate_credential,
                                                          slot_id),
                           CKR_TOKEN_NOT_PRESENT);
-  const MechanismMap* mechanism_info =
-    slot_manager_->GetMechanismInfo(isolate_credential, slot_id);
-  CHECK(mechanism_info);
-  for (MechanismMapIterator it = mechanism_info->begin();
-       it != mechanism_info->end();
-       ++it) {
-    mechanism_list->push_back(it->first);
-  }
+  const MechanismList* mechanisms =
+    slot_manager_->GetMechanismList(isolate_credential, slot_id);
+  CHECK(mechanisms);
+  mechanism_list->assign(mechanisms->begin(), mechanisms->end());
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::GetSlotInfoDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    CK_SLOT_INFO* slot_info) {
+  LOG_CK_RV_AND_RETURN_IF(!slot_info, CKR_ARGUMENTS_BAD);
+  if (static_cast<int>(slot_id) >= slot_manager_->GetSlotCount() ||
+      !slot_manager_->IsTokenAccessible(isolate_credential, slot_id))
+    LOG_CK_RV_AND_RETURN(CKR_SLOT_ID_INVALID);
+  slot_manager_->GetSlotInfo(isolate_credential, slot_id, slot_info);
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::GetTokenInfoDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    CK_TOKEN_INFO* token_info) {
+  LOG_CK_RV_AND_RETURN_IF(!token_info, CKR_ARGUMENTS_BAD);
+  if (static_cast<int>(slot_id) >= slot_manager_->GetSlotCount() ||
+      !slot_manager_->IsTokenAccessible(isolate_credential, slot_id))
+    LOG_CK_RV_AND_RETURN(CKR_SLOT_ID_INVALID);
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->IsTokenPresent(isolate_credential,
+                                                         slot_id),
+                          CKR_TOKEN_NOT_PRESENT);
+  slot_manager_->GetTokenInfo(isolate_credential, slot_id, token_info);
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::GetMechanismListDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t slot_id,
+    CK_MECHANISM_TYPE_PTR mechanism_list,
+    CK_ULONG_PTR count) {
+  LOG_CK_RV_AND_RETURN_IF(!count, CKR_ARGUMENTS_BAD);
+  if (static_cast<int>(slot_id) >= slot_manager_->GetSlotCount() ||
+      !slot_manager_->IsTokenAccessible(isolate_credential, slot_id))
+    LOG_CK_RV_AND_RETURN(CKR_SLOT_ID_INVALID);
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->IsTokenPresent(isolate_credential,
+                                                         slot_id),
+                          CKR_TOKEN_NOT_PRESENT);
+  const MechanismList* mechanisms =
+    slot_manager_->GetMechanismList(isolate_credential, slot_id);
+  CHECK(mechanisms);
+  const size_t max_copy = static_cast<size_t>(*count);
+  *count = static_cast<CK_ULONG>(mechanisms->size());
+  if (!mechanism_list)
+    return CKR_OK;
+  LOG_CK_RV_AND_RETURN_IF(mechanisms->size() > max_copy,
+                          CKR_BUFFER_TOO_SMALL);
+  std::copy(mechanisms->begin(), mechanisms->end(), mechanism_list);
   return CKR_OK;
 }
 
@@ -316,6 +384,152 @@ uint32_t P11NetServiceImpl::GetSessionInfo(const SecureBlob& isolate_credential,
   return CKR_OK;
 }
 
+uint32_t P11NetServiceImpl::SetSessionPriority(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t priority) {
+  LOG_CK_RV_AND_RETURN_IF(priority >= kNumRequestPriorities,
+                          CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  session->SetPriority(static_cast<RequestPriority>(priority));
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::SignBatch(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<vector<uint8_t>>& inputs,
+    vector<vector<uint8_t>>* outputs,
+    vector<uint32_t>* results) {
+  return OperationBatch(isolate_credential, session_id, kSign, mechanism_type,
+                        mechanism_parameter, key_handle, inputs, outputs,
+                        results);
+}
+
+uint32_t P11NetServiceImpl::DecryptBatch(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<vector<uint8_t>>& inputs,
+    vector<vector<uint8_t>>* outputs,
+    vector<uint32_t>* results) {
+  return OperationBatch(isolate_credential, session_id, kDecrypt,
+                        mechanism_type, mechanism_parameter, key_handle,
+                        inputs, outputs, results);
+}
+
+uint32_t P11NetServiceImpl::SignSubmit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<uint8_t>& data,
+    uint64_t* operation_id) {
+  return OperationSubmit(isolate_credential, session_id, kSign,
+                         mechanism_type, mechanism_parameter, key_handle, data,
+                         operation_id);
+}
+
+uint32_t P11NetServiceImpl::DecryptSubmit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<uint8_t>& data,
+    uint64_t* operation_id) {
+  return OperationSubmit(isolate_credential, session_id, kDecrypt,
+                         mechanism_type, mechanism_parameter, key_handle, data,
+                         operation_id);
+}
+
+uint32_t P11NetServiceImpl::OperationSubmit(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    OperationType operation,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<uint8_t>& data,
+    uint64_t* operation_id) {
+  LOG_CK_RV_AND_RETURN_IF(!operation_id, CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  const Object* key = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!session->GetObject(key_handle, &key),
+                          CKR_KEY_HANDLE_INVALID);
+  CHECK(key);
+  CompletionQueue* queue = CompletionQueue::Get();
+  const uint64_t id = queue->Add();
+  CK_RV result = session->OperationAsync(
+      operation, mechanism_type,
+      ConvertByteVectorToString(mechanism_parameter), key,
+      ConvertByteVectorToString(data),
+      [queue, id](CK_RV result, const string& data_out) {
+        queue->Complete(id, result, data_out);
+      });
+  if (result != CKR_OK) {
+    queue->Discard(id);
+    return result;
+  }
+  *operation_id = id;
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::OperationBatch(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    OperationType operation,
+    uint64_t mechanism_type,
+    const vector<uint8_t>& mechanism_parameter,
+    uint64_t key_handle,
+    const vector<vector<uint8_t>>& inputs,
+    vector<vector<uint8_t>>* outputs,
+    vector<uint32_t>* results) {
+  LOG_CK_RV_AND_RETURN_IF(!outputs || !results, CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  const Object* key = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!session->GetObject(key_handle, &key),
+                          CKR_KEY_HANDLE_INVALID);
+  CHECK(key);
+  vector<string> data_in(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i)
+    data_in[i] = ConvertByteVectorToString(inputs[i]);
+  vector<string> data_out;
+  vector<CK_RV> item_results;
+  CK_RV result = session->OperationBatch(
+      operation, mechanism_type,
+      ConvertByteVectorToString(mechanism_parameter), key, data_in,
+      &data_out, &item_results);
+  if (result != CKR_OK)
+    return result;
+  outputs->resize(data_out.size());
+  for (size_t i = 0; i < data_out.size(); ++i)
+    (*outputs)[i] = ConvertByteStringToVector(data_out[i]);
+  results->assign(item_results.begin(), item_results.end());
+  return CKR_OK;
+}
+
 uint32_t P11NetServiceImpl::GetOperationState(
     const SecureBlob& isolate_credential,
     uint64_t session_id,
@@ -373,9 +587,8 @@ uint32_t P11NetServiceImpl::Login(const SecureBlob& isolate_credential,
   // operation (i.e. a null pin).
   const string legacy_pin("111111");
   LOG_CK_RV_AND_RETURN_IF(pin && *pin != legacy_pin, CKR_PIN_INCORRECT);
-  // After calling C_Login, applications will expect private objects to be
-  // available for queries. Wait for them to become available before returning.
-  session->WaitForPrivateObjects();
+  // Private objects are loaded by SetEncryptionKey, which the slot manager
+  // calls before the token is usable, so there is nothing to wait for here.
   // We could use CKR_USER_ALREADY_LOGGED_IN but that will cause some
   // applications to close all sessions and start from scratch which is
   // unnecessary.
@@ -397,6 +610,22 @@ uint32_t P11NetServiceImpl::CreateObject(const SecureBlob& isolate_credential,
                                         uint64_t session_id,
                                         const vector<uint8_t>& attributes,
                                         uint64_t* new_object_handle) {
+  Attributes parsed_attributes;
+  LOG_CK_RV_AND_RETURN_IF(!parsed_attributes.Parse(attributes),
+                          CKR_TEMPLATE_INCONSISTENT);
+  return CreateObjectDirect(isolate_credential,
+                            session_id,
+                            parsed_attributes.attributes(),
+                            parsed_attributes.num_attributes(),
+                            new_object_handle);
+}
+
+uint32_t P11NetServiceImpl::CreateObjectDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes,
+    uint64_t* new_object_handle) {
   LOG_CK_RV_AND_RETURN_IF(!new_object_handle, CKR_ARGUMENTS_BAD);
   Session* session = NULL;
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
@@ -404,12 +633,9 @@ uint32_t P11NetServiceImpl::CreateObject(const SecureBlob& isolate_credential,
                                                      &session),
                           CKR_SESSION_HANDLE_INVALID);
   CHECK(session);
-  Attributes parsed_attributes;
-  LOG_CK_RV_AND_RETURN_IF(!parsed_attributes.Parse(attributes),
-                          CKR_TEMPLATE_INCONSISTENT);
   return session->CreateObject(
-      parsed_attributes.attributes(),
-      parsed_attributes.num_attributes(),
+      attributes,
+      num_attributes,
       PreservedValue<uint64_t, int>(new_object_handle));
 }
 
@@ -418,6 +644,24 @@ uint32_t P11NetServiceImpl::CopyObject(const SecureBlob& isolate_credential,
                                       uint64_t object_handle,
                                       const vector<uint8_t>& attributes,
                                       uint64_t* new_object_handle) {
+  Attributes parsed_attributes;
+  LOG_CK_RV_AND_RETURN_IF(!parsed_attributes.Parse(attributes),
+                          CKR_TEMPLATE_INCONSISTENT);
+  return CopyObjectDirect(isolate_credential,
+                          session_id,
+                          object_handle,
+                          parsed_attributes.attributes(),
+                          parsed_attributes.num_attributes(),
+                          new_object_handle);
+}
+
+uint32_t P11NetServiceImpl::CopyObjectDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    const CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes,
+    uint64_t* new_object_handle) {
   LOG_CK_RV_AND_RETURN_IF(!new_object_handle, CKR_ARGUMENTS_BAD);
   Session* session = NULL;
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
@@ -425,11 +669,8 @@ uint32_t P11NetServiceImpl::CopyObject(const SecureBlob& isolate_credential,
                                                      &session),
                           CKR_SESSION_HANDLE_INVALID);
   CHECK(session);
-  Attributes parsed_attributes;
-  LOG_CK_RV_AND_RETURN_IF(!parsed_attributes.Parse(attributes),
-                          CKR_TEMPLATE_INCONSISTENT);
-  return session->CopyObject(parsed_attributes.attributes(),
-                             parsed_attributes.num_attributes(),
+  return session->CopyObject(attributes,
+                             num_attributes,
                              object_handle,
                              PreservedValue<uint64_t, int>(new_object_handle));
 }
@@ -472,27 +713,123 @@ uint32_t P11NetServiceImpl::GetAttributeValue(
     const vector<uint8_t>& attributes_in,
     vector<uint8_t>* attributes_out) {
   LOG_CK_RV_AND_RETURN_IF(!attributes_out, CKR_ARGUMENTS_BAD);
+  Attributes tmp;
+  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes_in), CKR_TEMPLATE_INCONSISTENT);
+  CK_RV result = GetAttributeValueDirect(isolate_credential,
+                                         session_id,
+                                         object_handle,
+                                         tmp.attributes(),
+                                         tmp.num_attributes());
+  if (result == CKR_OK ||
+      result == CKR_ATTRIBUTE_SENSITIVE ||
+      result == CKR_ATTRIBUTE_TYPE_INVALID ||
+      result == CKR_BUFFER_TOO_SMALL) {
+    LOG_CK_RV_AND_RETURN_IF(!tmp.Serialize(attributes_out),
+                            CKR_FUNCTION_FAILED);
+  }
+  return result;
+}
+
+uint32_t P11NetServiceImpl::GetAttributeValueDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes) {
+  LOG_CK_RV_AND_RETURN_IF(!attributes && num_attributes > 0,
+                          CKR_ARGUMENTS_BAD);
   Session* session = NULL;
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
                                                      session_id,
                                                      &session),
                           CKR_SESSION_HANDLE_INVALID);
   CHECK(session);
+  LOG_CK_RV_AND_RETURN_IF(
+      ReadsCertificateValue(attributes, num_attributes) &&
+          !session->LoadObjectValue(object_handle),
+      CKR_DEVICE_ERROR);
   const Object* object = NULL;
   LOG_CK_RV_AND_RETURN_IF(!session->GetObject(object_handle, &object),
                           CKR_OBJECT_HANDLE_INVALID);
   CHECK(object);
-  Attributes tmp;
-  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes_in), CKR_TEMPLATE_INCONSISTENT);
-  CK_RV result = object->GetAttributes(tmp.attributes(), tmp.num_attributes());
-  if (result == CKR_OK ||
-      result == CKR_ATTRIBUTE_SENSITIVE ||
-      result == CKR_ATTRIBUTE_TYPE_INVALID ||
-      result == CKR_BUFFER_TOO_SMALL) {
-    LOG_CK_RV_AND_RETURN_IF(!tmp.Serialize(attributes_out),
-                            CKR_FUNCTION_FAILED);
+  return object->GetAttributes(attributes, num_attributes);
+}
+
+uint32_t P11NetServiceImpl::GetAttributeValuesDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const CK_OBJECT_HANDLE* object_handles,
+    CK_ULONG num_objects,
+    CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes,
+    CK_RV* results) {
+  LOG_CK_RV_AND_RETURN_IF((!object_handles || !results) && num_objects > 0,
+                          CKR_ARGUMENTS_BAD);
+  LOG_CK_RV_AND_RETURN_IF(!attributes && num_attributes > 0,
+                          CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  GetAttributeValues(session, object_handles, num_objects, attributes,
+                     num_attributes, results);
+  return CKR_OK;
+}
+
+uint32_t P11NetServiceImpl::FindObjectsWithAttributesDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    CK_ULONG max_object_count,
+    CK_OBJECT_HANDLE_PTR object_handles,
+    CK_ULONG_PTR num_objects,
+    CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes,
+    CK_RV* results) {
+  LOG_CK_RV_AND_RETURN_IF(!object_handles || !num_objects || !results,
+                          CKR_ARGUMENTS_BAD);
+  LOG_CK_RV_AND_RETURN_IF(!attributes && num_attributes > 0,
+                          CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  vector<int> found;
+  CK_RV result = session->FindObjects(max_object_count, &found);
+  LOG_CK_RV_AND_RETURN_IF_ERR(result);
+  LOG_CK_RV_AND_RETURN_IF(found.size() > max_object_count, CKR_GENERAL_ERROR);
+  std::copy(found.begin(), found.end(), object_handles);
+  *num_objects = found.size();
+  GetAttributeValues(session, object_handles, *num_objects, attributes,
+                     num_attributes, results);
+  return CKR_OK;
+}
+
+void P11NetServiceImpl::GetAttributeValues(
+    Session* session,
+    const CK_OBJECT_HANDLE* object_handles,
+    CK_ULONG num_objects,
+    CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes,
+    CK_RV* results) {
+  const bool reads_value = ReadsCertificateValue(attributes, num_attributes);
+  for (CK_ULONG i = 0; i < num_objects; ++i) {
+    if (reads_value && !session->LoadObjectValue(object_handles[i])) {
+      results[i] = CKR_DEVICE_ERROR;
+      continue;
+    }
+    const Object* object = NULL;
+    if (!session->GetObject(object_handles[i], &object)) {
+      results[i] = CKR_OBJECT_HANDLE_INVALID;
+      continue;
+    }
+    CHECK(object);
+    results[i] = object->GetAttributes(&attributes[i * num_attributes],
+                                       num_attributes);
   }
-  return result;
 }
 
 uint32_t P11NetServiceImpl::SetAttributeValue(
@@ -500,6 +837,21 @@ uint32_t P11NetServiceImpl::SetAttributeValue(
     uint64_t session_id,
     uint64_t object_handle,
     const vector<uint8_t>& attributes) {
+  Attributes tmp;
+  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes), CKR_TEMPLATE_INCONSISTENT);
+  return SetAttributeValueDirect(isolate_credential,
+                                 session_id,
+                                 object_handle,
+                                 tmp.attributes(),
+                                 tmp.num_attributes());
+}
+
+uint32_t P11NetServiceImpl::SetAttributeValueDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    uint64_t object_handle,
+    const CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes) {
   Session* session = NULL;
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
                                                      session_id,
@@ -510,9 +862,7 @@ uint32_t P11NetServiceImpl::SetAttributeValue(
   LOG_CK_RV_AND_RETURN_IF(!session->GetModifiableObject(object_handle, &object),
                           CKR_OBJECT_HANDLE_INVALID);
   CHECK(object);
-  Attributes tmp;
-  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes), CKR_TEMPLATE_INCONSISTENT);
-  CK_RV result = object->SetAttributes(tmp.attributes(), tmp.num_attributes());
+  CK_RV result = object->SetAttributes(attributes, num_attributes);
   LOG_CK_RV_AND_RETURN_IF_ERR(result);
   LOG_CK_RV_AND_RETURN_IF(!session->FlushModifiableObject(object),
                           CKR_FUNCTION_FAILED);
@@ -523,15 +873,26 @@ uint32_t P11NetServiceImpl::FindObjectsInit(
     const SecureBlob& isolate_credential,
     uint64_t session_id,
     const vector<uint8_t>& attributes) {
+  Attributes tmp;
+  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes), CKR_TEMPLATE_INCONSISTENT);
+  return FindObjectsInitDirect(isolate_credential,
+                               session_id,
+                               tmp.attributes(),
+                               tmp.num_attributes());
+}
+
+uint32_t P11NetServiceImpl::FindObjectsInitDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    const CK_ATTRIBUTE_PTR attributes,
+    CK_ULONG num_attributes) {
   Session* session = NULL;
   LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
                                                      session_id,
                                                      &session),
                           CKR_SESSION_HANDLE_INVALID);
   CHECK(session);
-  Attributes tmp;
-  LOG_CK_RV_AND_RETURN_IF(!tmp.Parse(attributes), CKR_TEMPLATE_INCONSISTENT);
-  return session->FindObjectsInit(tmp.attributes(), tmp.num_attributes());
+  return session->FindObjectsInit(attributes, num_attributes);
 }
 
 uint32_t P11NetServiceImpl::FindObjects(const SecureBlob& isolate_credential,
@@ -1205,4 +1566,69 @@ uint32_t P11NetServiceImpl::GenerateRandom(const SecureBlob& isolate_credential,
   return CKR_OK;
 }
 
+uint32_t P11NetServiceImpl::EncryptDirect(const SecureBlob& isolate_credential,
+                                         uint64_t session_id,
+                                         const CK_BYTE* data_in,
+                                         CK_ULONG data_in_length,
+                                         CK_BYTE_PTR data_out,
+                                         CK_ULONG_PTR data_out_length) {
+  return OperationSinglePartDirect(isolate_credential, session_id, kEncrypt,
+                                   data_in, data_in_length,
+                                   data_out, data_out_length);
+}
+
+uint32_t P11NetServiceImpl::DecryptDirect(const SecureBlob& isolate_credential,
+                                         uint64_t session_id,
+                                         const CK_BYTE* data_in,
+                                         CK_ULONG data_in_length,
+                                         CK_BYTE_PTR data_out,
+                                         CK_ULONG_PTR data_out_length) {
+  return OperationSinglePartDirect(isolate_credential, session_id, kDecrypt,
+                                   data_in, data_in_length,
+                                   data_out, data_out_length);
+}
+
+uint32_t P11NetServiceImpl::SignDirect(const SecureBlob& isolate_credential,
+                                      uint64_t session_id,
+                                      const CK_BYTE* data_in,
+                                      CK_ULONG data_in_length,
+                                      CK_BYTE_PTR data_out,
+                                      CK_ULONG_PTR data_out_length) {
+  return OperationSinglePartDirect(isolate_credential, session_id, kSign,
+                                   data_in, data_in_length,
+                                   data_out, data_out_length);
+}
+
+uint32_t P11NetServiceImpl::OperationSinglePartDirect(
+    const SecureBlob& isolate_credential,
+    uint64_t session_id,
+    OperationType operation,
+    const CK_BYTE* data_in,
+    CK_ULONG data_in_length,
+    CK_BYTE_PTR data_out,
+    CK_ULONG_PTR data_out_length) {
+  LOG_CK_RV_AND_RETURN_IF(!data_out_length || (!data_in && data_in_length > 0),
+                          CKR_ARGUMENTS_BAD);
+  Session* session = NULL;
+  LOG_CK_RV_AND_RETURN_IF(!slot_manager_->GetSession(isolate_credential,
+                                                     session_id,
+                                                     &session),
+                          CKR_SESSION_HANDLE_INVALID);
+  CHECK(session);
+  int out_length = 0;
+  if (data_out) {
+    out_length = static_cast<int>(std::min<CK_ULONG>(
+        *data_out_length, std::numeric_limits<int>::max()));
+  }
+  CK_RV result = session->OperationSinglePartToBuffer(
+      operation,
+      string(reinterpret_cast<const char*>(data_in), data_in_length),
+      data_out,
+      &out_length);
+  *data_out_length = out_length;
+  if (result == CKR_BUFFER_TOO_SMALL && !data_out)
+    result = CKR_OK;
+  return result;
+}
+
 }  // namespace p11net
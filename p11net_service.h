@@ -10,6 +10,7 @@
 #include <memory>
 
 #include "p11net_interface.h"
+#include "session.h"
 #include "slot_manager.h"
 #include "pkcs11/cryptoki.h"
 
@@ -18,6 +19,21 @@ namespace p11net {
 // P11NetServiceImpl implements the P11Net IPC interface.  This class effectively
 // serves as the entry point to the P11Net daemon and is called directly by
 // P11NetAdaptor.
+//
+// Threading model: all methods may be called concurrently. As PKCS #11
+// requires, an application does not use one session from several threads at
+// once, so the state of an operation lives in its Session and is not locked.
+// The state shared between sessions is built so that concurrent signing and
+// decryption do not serialize on it:
+//  - Sessions are found in a sharded SessionTable under shared locks, and
+//    handles are allocated in per-thread blocks.
+//  - Object pools take a reader lock for lookups; only adding, changing or
+//    removing objects is exclusive.
+//  - Keys cached on objects are created once and then shared read-only.
+//  - NetHSM requests lease pooled HTTP clients, pick a cluster node and
+//    record latencies with atomic counters only.
+// Locks remain on the paths that change shared state: loading the key
+// inventory, creating objects and opening circuit breakers.
 class P11NetServiceImpl : public P11NetInterface {
  public:
   // P11NetServiceImpl does not take ownership of slot_manager and will not
@@ -96,6 +112,43 @@ class P11NetServiceImpl : public P11NetInterface {
       uint64_t* state,
       uint64_t* flags,
       uint64_t* device_error);
+  virtual uint32_t SetSessionPriority(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t priority);
+  virtual uint32_t SignBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results);
+  virtual uint32_t DecryptBatch(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<std::vector<uint8_t>>& inputs,
+      std::vector<std::vector<uint8_t>>* outputs,
+      std::vector<uint32_t>* results);
+  virtual uint32_t SignSubmit(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              uint64_t mechanism_type,
+                              const std::vector<uint8_t>& mechanism_parameter,
+                              uint64_t key_handle,
+                              const std::vector<uint8_t>& data,
+                              uint64_t* operation_id);
+  virtual uint32_t DecryptSubmit(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t mechanism_type,
+      const std::vector<uint8_t>& mechanism_parameter,
+      uint64_t key_handle,
+      const std::vector<uint8_t>& data,
+      uint64_t* operation_id);
   virtual uint32_t GetOperationState(
       const brillo::SecureBlob& isolate_credential,
       uint64_t session_id,
@@ -359,7 +412,136 @@ class P11NetServiceImpl : public P11NetInterface {
       uint64_t num_bytes,
       std::vector<uint8_t>* random_data);
 
+  // In-process variants of GetSlotInfo, GetTokenInfo and GetMechanismList.
+  // These copy the information the slot manager keeps for the slot straight
+  // into the caller's structures. GetMechanismListDirect follows the PKCS #11
+  // output conventions: if 'mechanism_list' is NULL only the number of
+  // mechanisms is returned in 'count'.
+  uint32_t GetSlotInfoDirect(const brillo::SecureBlob& isolate_credential,
+                             uint64_t slot_id,
+                             CK_SLOT_INFO* slot_info);
+  uint32_t GetTokenInfoDirect(const brillo::SecureBlob& isolate_credential,
+                              uint64_t slot_id,
+                              CK_TOKEN_INFO* token_info);
+  uint32_t GetMechanismListDirect(const brillo::SecureBlob& isolate_credential,
+                                  uint64_t slot_id,
+                                  CK_MECHANISM_TYPE_PTR mechanism_list,
+                                  CK_ULONG_PTR count);
+
+  // In-process variants of the attribute calls above. These work on the
+  // caller's CK_ATTRIBUTE array directly instead of a serialized attribute
+  // list; GetAttributeValueDirect fills the caller's array in place. Templates
+  // with nested attribute arrays must use the serialized calls.
+  uint32_t CreateObjectDirect(const brillo::SecureBlob& isolate_credential,
+                              uint64_t session_id,
+                              const CK_ATTRIBUTE_PTR attributes,
+                              CK_ULONG num_attributes,
+                              uint64_t* new_object_handle);
+  uint32_t CopyObjectDirect(const brillo::SecureBlob& isolate_credential,
+                            uint64_t session_id,
+                            uint64_t object_handle,
+                            const CK_ATTRIBUTE_PTR attributes,
+                            CK_ULONG num_attributes,
+                            uint64_t* new_object_handle);
+  uint32_t GetAttributeValueDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t object_handle,
+      CK_ATTRIBUTE_PTR attributes,
+      CK_ULONG num_attributes);
+  uint32_t SetAttributeValueDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      uint64_t object_handle,
+      const CK_ATTRIBUTE_PTR attributes,
+      CK_ULONG num_attributes);
+  uint32_t FindObjectsInitDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const CK_ATTRIBUTE_PTR attributes,
+      CK_ULONG num_attributes);
+
+  // Bulk variants of GetAttributeValueDirect for C_P11Net_GetAttributeValues
+  // and C_P11Net_FindObjectsWithAttributes. 'attributes' holds a template of
+  // 'num_attributes' for each object, one after the other, and 'results' the
+  // result of each object. FindObjectsWithAttributesDirect continues the
+  // active search of the session and stores the handles found and their
+  // number in 'object_handles' and 'num_objects'.
+  uint32_t GetAttributeValuesDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      const CK_OBJECT_HANDLE* object_handles,
+      CK_ULONG num_objects,
+      CK_ATTRIBUTE_PTR attributes,
+      CK_ULONG num_attributes,
+      CK_RV* results);
+  uint32_t FindObjectsWithAttributesDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      CK_ULONG max_object_count,
+      CK_OBJECT_HANDLE_PTR object_handles,
+      CK_ULONG_PTR num_objects,
+      CK_ATTRIBUTE_PTR attributes,
+      CK_ULONG num_attributes,
+      CK_RV* results);
+
+  // In-process variants of Encrypt, Decrypt and Sign. These read the input
+  // from the caller's buffer and write the output straight into 'data_out'
+  // following the PKCS #11 output conventions: if 'data_out' is NULL only the
+  // required length is returned in 'data_out_length'.
+  uint32_t EncryptDirect(const brillo::SecureBlob& isolate_credential,
+                         uint64_t session_id,
+                         const CK_BYTE* data_in,
+                         CK_ULONG data_in_length,
+                         CK_BYTE_PTR data_out,
+                         CK_ULONG_PTR data_out_length);
+  uint32_t DecryptDirect(const brillo::SecureBlob& isolate_credential,
+                         uint64_t session_id,
+                         const CK_BYTE* data_in,
+                         CK_ULONG data_in_length,
+                         CK_BYTE_PTR data_out,
+                         CK_ULONG_PTR data_out_length);
+  uint32_t SignDirect(const brillo::SecureBlob& isolate_credential,
+                      uint64_t session_id,
+                      const CK_BYTE* data_in,
+                      CK_ULONG data_in_length,
+                      CK_BYTE_PTR data_out,
+                      CK_ULONG_PTR data_out_length);
+
  private:
+  uint32_t OperationSubmit(const brillo::SecureBlob& isolate_credential,
+                           uint64_t session_id,
+                           OperationType operation,
+                           uint64_t mechanism_type,
+                           const std::vector<uint8_t>& mechanism_parameter,
+                           uint64_t key_handle,
+                           const std::vector<uint8_t>& data,
+                           uint64_t* operation_id);
+  uint32_t OperationBatch(const brillo::SecureBlob& isolate_credential,
+                          uint64_t session_id,
+                          OperationType operation,
+                          uint64_t mechanism_type,
+                          const std::vector<uint8_t>& mechanism_parameter,
+                          uint64_t key_handle,
+                          const std::vector<std::vector<uint8_t>>& inputs,
+                          std::vector<std::vector<uint8_t>>* outputs,
+                          std::vector<uint32_t>* results);
+  // Reads the attributes of each object for GetAttributeValuesDirect.
+  void GetAttributeValues(Session* session,
+                          const CK_OBJECT_HANDLE* object_handles,
+                          CK_ULONG num_objects,
+                          CK_ATTRIBUTE_PTR attributes,
+                          CK_ULONG num_attributes,
+                          CK_RV* results);
+  uint32_t OperationSinglePartDirect(
+      const brillo::SecureBlob& isolate_credential,
+      uint64_t session_id,
+      OperationType operation,
+      const CK_BYTE* data_in,
+      CK_ULONG data_in_length,
+      CK_BYTE_PTR data_out,
+      CK_ULONG_PTR data_out_length);
+
   std::shared_ptr<SlotManager> slot_manager_;
   bool init_;
 
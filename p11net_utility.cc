@@ -11,15 +11,18 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cstdlib>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include "brillo/secure_blob.h"
+#include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/objects.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
@@ -41,6 +44,7 @@ const CK_ATTRIBUTE_TYPE kKeyBlobAttribute = CKA_VENDOR_DEFINED + 1;
 const CK_ATTRIBUTE_TYPE kAuthDataAttribute = CKA_VENDOR_DEFINED + 2;
 const CK_ATTRIBUTE_TYPE kLegacyAttribute = CKA_VENDOR_DEFINED + 3;
 const CK_ATTRIBUTE_TYPE kKeyLocationAttribute = CKA_VENDOR_DEFINED + 4;
+const CK_ATTRIBUTE_TYPE kCertificateLocationAttribute = CKA_VENDOR_DEFINED + 5;
 
 // Some NSS-specific constants (from NSS' pkcs11n.h).
 #define NSSCK_VENDOR_NSS 0x4E534350
@@ -748,6 +752,120 @@ bool RunCipher(bool is_encrypt,
   return true;
 }
 
+bool RunAuthenticatedCipher(bool is_encrypt,
+                            const SecureBlob& key,
+                            const string& aad,
+                            const string& input,
+                            string* output) {
+  const size_t kAESKeySizeBytes = 32;
+  const size_t kIVSizeBytes = 12;
+  const size_t kTagSizeBytes = 16;
+  CHECK(key.size() == kAESKeySizeBytes);
+  string iv;
+  string tag;
+  string text;
+  if (is_encrypt) {
+    iv.resize(kIVSizeBytes);
+    if (1 != RAND_bytes(ConvertStringToByteBuffer(iv.data()), kIVSizeBytes)) {
+      LOG(ERROR) << "RAND_bytes failed: " << GetOpenSSLError();
+      return false;
+    }
+    text = input;
+  } else {
+    if (input.length() < kIVSizeBytes + kTagSizeBytes) {
+      LOG(ERROR) << "Decrypt: Invalid input.";
+      return false;
+    }
+    iv = input.substr(0, kIVSizeBytes);
+    tag = input.substr(input.length() - kTagSizeBytes);
+    text = input.substr(kIVSizeBytes,
+                        input.length() - kIVSizeBytes - kTagSizeBytes);
+  }
+  EVP_CIPHER_CTX cipher_context;
+  EVP_CIPHER_CTX_init(&cipher_context);
+  bool success = false;
+  string result(text.length(), 0);
+  int output_length = 0;
+  int final_length = 0;
+  do {
+    if (!EVP_CipherInit_ex(&cipher_context, EVP_aes_256_gcm(), NULL, NULL,
+                           NULL, is_encrypt) ||
+        !EVP_CIPHER_CTX_ctrl(&cipher_context, EVP_CTRL_GCM_SET_IVLEN,
+                             kIVSizeBytes, NULL) ||
+        !EVP_CipherInit_ex(&cipher_context, NULL, NULL, key.data(),
+                           ConvertStringToByteBuffer(iv.data()), is_encrypt)) {
+      LOG(ERROR) << "EVP_CipherInit_ex failed: " << GetOpenSSLError();
+      break;
+    }
+    if (!aad.empty() &&
+        !EVP_CipherUpdate(&cipher_context, NULL, &output_length,
+                          ConvertStringToByteBuffer(aad.data()),
+                          aad.length())) {
+      LOG(ERROR) << "EVP_CipherUpdate failed: " << GetOpenSSLError();
+      break;
+    }
+    output_length = 0;
+    if (!text.empty() &&
+        !EVP_CipherUpdate(&cipher_context,
+                          ConvertStringToByteBuffer(result.data()),
+                          &output_length,
+                          ConvertStringToByteBuffer(text.data()),
+                          text.length())) {
+      LOG(ERROR) << "EVP_CipherUpdate failed: " << GetOpenSSLError();
+      break;
+    }
+    if (!is_encrypt &&
+        !EVP_CIPHER_CTX_ctrl(&cipher_context, EVP_CTRL_GCM_SET_TAG,
+                             kTagSizeBytes,
+                             ConvertStringToByteBuffer(tag.data()))) {
+      LOG(ERROR) << "Failed to set the GCM tag: " << GetOpenSSLError();
+      break;
+    }
+    // GCM does not pad, so nothing is written here; on decryption this is
+    // where the tag is verified.
+    if (!EVP_CipherFinal_ex(&cipher_context,
+                            ConvertStringToByteBuffer(result.data()) +
+                                output_length,
+                            &final_length)) {
+      LOG(ERROR) << "Failed to verify blob integrity.";
+      break;
+    }
+    if (is_encrypt) {
+      tag.resize(kTagSizeBytes);
+      if (!EVP_CIPHER_CTX_ctrl(&cipher_context, EVP_CTRL_GCM_GET_TAG,
+                               kTagSizeBytes,
+                               ConvertStringToByteBuffer(tag.data()))) {
+        LOG(ERROR) << "Failed to get the GCM tag: " << GetOpenSSLError();
+        break;
+      }
+    }
+    success = true;
+  } while (false);
+  EVP_CIPHER_CTX_cleanup(&cipher_context);
+  ClearString(&text);
+  if (!success) {
+    ClearString(&result);
+    return false;
+  }
+  result.resize(output_length + final_length);
+  *output = is_encrypt ? iv + result + tag : result;
+  ClearString(&result);
+  return true;
+}
+
+int GetEnvInt(const char* name, int default_value) {
+  const char* value = std::getenv(name);
+  if (!value)
+    return default_value;
+  char* end = NULL;
+  long result = std::strtol(value, &end, 10);
+  if (end == value || *end != '\0' || result < 0) {
+    LOG(WARNING) << "Ignoring invalid value for " << name << ": " << value;
+    return default_value;
+  }
+  return static_cast<int>(result);
+}
+
 bool IsIntegralAttribute(CK_ATTRIBUTE_TYPE type) {
   switch (type) {
     case CKA_CLASS:
@@ -773,4 +891,53 @@ bool IsIntegralAttribute(CK_ATTRIBUTE_TYPE type) {
   return false;
 }
 
+std::string GetECParameters(int curve_nid) {
+  ASN1_OBJECT* curve = OBJ_nid2obj(curve_nid);
+  if (!curve)
+    return std::string();
+  int length = i2d_ASN1_OBJECT(curve, NULL);
+  if (length <= 0)
+    return std::string();
+  std::string ec_params(length, 0);
+  unsigned char* buffer = ConvertStringToByteBuffer(ec_params.data());
+  i2d_ASN1_OBJECT(curve, &buffer);
+  return ec_params;
+}
+
+int GetECCurve(const std::string& ec_params) {
+  const unsigned char* buffer = ConvertStringToByteBuffer(ec_params.data());
+  ASN1_OBJECT* curve = d2i_ASN1_OBJECT(NULL, &buffer, ec_params.length());
+  if (!curve)
+    return NID_undef;
+  int curve_nid = OBJ_obj2nid(curve);
+  ASN1_OBJECT_free(curve);
+  return curve_nid;
+}
+
+std::string EncodeECPoint(const std::string& point) {
+  ASN1_OCTET_STRING* octets = ASN1_OCTET_STRING_new();
+  CHECK(octets);
+  std::string der_point;
+  if (ASN1_OCTET_STRING_set(octets,
+                            ConvertStringToByteBuffer(point.data()),
+                            point.length())) {
+    der_point.resize(i2d_ASN1_OCTET_STRING(octets, NULL));
+    unsigned char* buffer = ConvertStringToByteBuffer(der_point.data());
+    i2d_ASN1_OCTET_STRING(octets, &buffer);
+  }
+  ASN1_OCTET_STRING_free(octets);
+  return der_point;
+}
+
+std::string DecodeECPoint(const std::string& der_point) {
+  const unsigned char* buffer = ConvertStringToByteBuffer(der_point.data());
+  ASN1_OCTET_STRING* octets =
+      d2i_ASN1_OCTET_STRING(NULL, &buffer, der_point.length());
+  if (!octets)
+    return std::string();
+  std::string point = ConvertByteBufferToString(octets->data, octets->length);
+  ASN1_OCTET_STRING_free(octets);
+  return point;
+}
+
 }  // namespace p11net
@@ -284,9 +284,37 @@ bool RunCipher(bool is_encrypt,
                const std::string& input,
                std::string* output);
 
+// Performs AES-256 authenticated encryption / decryption in GCM mode. On
+// encryption, a random IV is generated and the output is the IV, the cipher-
+// text and the authentication tag, in that order. On decryption, the input
+// must have that layout and the tag is verified. 'aad' is authenticated but not
+// encrypted. Uses AES-NI and PCLMULQDQ where OpenSSL supports them.
+bool RunAuthenticatedCipher(bool is_encrypt,
+                            const brillo::SecureBlob& key,
+                            const std::string& aad,
+                            const std::string& input,
+                            std::string* output);
+
+// Returns the value of the given environment variable as an integer, or
+// default_value if the variable is not set or not a positive number.
+int GetEnvInt(const char* name, int default_value);
+
 // Returns true if the given attribute type has an integral value.
 bool IsIntegralAttribute(CK_ATTRIBUTE_TYPE type);
 
+// Encodes the named curve with the given OpenSSL NID as DER ECParameters, the
+// form of CKA_EC_PARAMS. Returns an empty string on failure.
+std::string GetECParameters(int curve_nid);
+
+// Returns the OpenSSL NID of the named curve in a CKA_EC_PARAMS value, or
+// NID_undef if it names no curve.
+int GetECCurve(const std::string& ec_params);
+
+// Wraps an EC point in a DER OCTET STRING, the form of CKA_EC_POINT, and
+// unwraps it again. DecodeECPoint returns an empty string on failure.
+std::string EncodeECPoint(const std::string& point);
+std::string DecodeECPoint(const std::string& der_point);
+
 inline void ClearString(std::string* str) {
   brillo::SecureMemset(base::string_as_array(str), 0, str->length());
 }
@@ -0,0 +1,79 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// p11netd runs the module's service in a daemon of its own, so that the
+// processes of a host share one set of NetHSM connections, key inventory and
+// caches instead of each keeping its own. Modules forward their calls to it
+// when P11NET_DAEMON_SOCKET names its socket. Sample usage:
+//    P11NET_URL=https://nethsm:8443/api/v1 p11netd --socket=/run/p11net/socket
+//    P11NET_DAEMON_SOCKET=/run/p11net/socket nginx
+// The daemon reads the same configuration variables as the module does in
+// process. P11NET_DAEMON_RING_SIZE sets the size of the rings of a channel,
+// which bounds the size of requests and responses.
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+
+#include "base/logging.h"
+#include "metrics.h"
+#include "p11net_daemon.h"
+#include "p11net_factory_impl.h"
+#include "p11net_proxy.h"
+#include "p11net_service.h"
+#include "p11net_utility.h"
+#include "slot_manager_impl.h"
+
+namespace {
+
+const char kUsage[] = "Usage: p11netd [--socket=PATH]\n";
+const char kSocketOption[] = "--socket=";
+
+const char* kRingSizeEnv = "P11NET_DAEMON_RING_SIZE";
+const int kDefaultRingSize = 1 << 20;
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string socket_path = p11net::P11NetProxyImpl::GetDaemonSocket();
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], kSocketOption, strlen(kSocketOption)) == 0) {
+      socket_path = argv[i] + strlen(kSocketOption);
+    } else {
+      fputs(kUsage, stderr);
+      return 2;
+    }
+  }
+  if (socket_path.empty()) {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  logging::Init();
+  // A module that goes away mid-call must not take the daemon with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  std::shared_ptr<p11net::P11NetFactoryImpl> factory(
+      new p11net::P11NetFactoryImpl());
+  std::shared_ptr<p11net::SlotManagerImpl> slot_manager(
+      new p11net::SlotManagerImpl(factory, true));
+  p11net::P11NetServiceImpl service(slot_manager);
+  p11net::P11NetDaemon daemon(
+      &service, socket_path,
+      p11net::GetEnvInt(kRingSizeEnv, kDefaultRingSize));
+  slot_manager->SetSlotEventCallback(
+      [&daemon](int slot_id) { daemon.PostSlotEvent(slot_id); });
+  if (!slot_manager->Init())
+    return 1;
+  if (!service.Init())
+    return 1;
+  p11net::Metrics::Get()->StartDumping();
+
+  if (!daemon.Init())
+    return 1;
+  daemon.Run();
+  return 1;
+}
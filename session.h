@@ -5,11 +5,13 @@
 #ifndef P11NET_SESSION_H_
 #define P11NET_SESSION_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
 #include <base/macros.h>
 
+#include "net_utility.h"
 #include "pkcs11/cryptoki.h"
 
 namespace p11net {
@@ -31,12 +33,24 @@ enum OperationType {
 // executing all session-specific operations.
 class Session {
  public:
+  // Receives the result of an asynchronous operation and, on success, its
+  // output.
+  typedef std::function<void(CK_RV result, const std::string& data_out)>
+      OperationCallback;
+
   virtual ~Session() {}
   // General state management (see PKCS #11 v2.20: 11.6 C_GetSessionInfo).
   virtual int GetSlot() const = 0;
   virtual CK_STATE GetState() const = 0;
   virtual bool IsReadOnly() const = 0;
   virtual bool IsOperationActive(OperationType type) const = 0;
+  // Returns an estimate of the bytes held by the session, including its
+  // objects and the state of its operations and search.
+  virtual size_t GetMemoryUsage() = 0;
+  // The priority of the session's NetHSM requests. Sessions start out
+  // interactive.
+  virtual RequestPriority GetPriority() const = 0;
+  virtual void SetPriority(RequestPriority priority) = 0;
   // Object management (see PKCS #11 v2.20: 11.7).
   virtual CK_RV CreateObject(const CK_ATTRIBUTE_PTR attributes,
                              int num_attributes,
@@ -47,6 +61,10 @@ class Session {
                            int* new_object_handle) = 0;
   virtual CK_RV DestroyObject(int object_handle) = 0;
   virtual bool GetObject(int object_handle, const Object** object) = 0;
+  // Completes an object whose value is fetched from the NetHSM on first read,
+  // e.g. the certificate of a NetHSM key. Returns false if the NetHSM could
+  // not be reached.
+  virtual bool LoadObjectValue(int object_handle) = 0;
   virtual bool GetModifiableObject(int object_handle, Object** object) = 0;
   virtual bool FlushModifiableObject(Object* object) = 0;
   virtual CK_RV FindObjectsInit(const CK_ATTRIBUTE_PTR attributes,
@@ -105,6 +123,38 @@ class Session {
                                     const std::string& data_in,
                                     int* required_out_length,
                                     std::string* data_out) = 0;
+  // Like OperationSinglePart but writes the output into the 'data_out' buffer
+  // of '*data_out_length' bytes, which may be NULL if the length is zero. On
+  // return '*data_out_length' holds the output length. Ciphers given a buffer
+  // with room for the output write straight into it.
+  virtual CK_RV OperationSinglePartToBuffer(OperationType operation,
+                                            const std::string& data_in,
+                                            uint8_t* data_out,
+                                            int* data_out_length) = 0;
+  // Performs a single-part sign or decrypt operation on each of 'inputs' with
+  // one RSA key and mechanism. This leaves the session's active operations
+  // alone. Operations on NetHSM keys are sent to the NetHSM all at once rather
+  // than one after the other. Returns CKR_OK if the key and mechanism are
+  // valid; the output of each input is then in 'outputs' and its result in
+  // 'results'.
+  virtual CK_RV OperationBatch(OperationType operation,
+                               CK_MECHANISM_TYPE mechanism,
+                               const std::string& mechanism_parameter,
+                               const Object* key,
+                               const std::vector<std::string>& inputs,
+                               std::vector<std::string>* outputs,
+                               std::vector<CK_RV>* results) = 0;
+  // Starts a single-part sign or decrypt operation like OperationBatch and
+  // returns without waiting for the NetHSM. Returns an error, without invoking
+  // 'callback', if the operation cannot start; CKR_DEVICE_ERROR means the
+  // NetHSM is at its request limit. Otherwise 'callback' is invoked exactly
+  // once, possibly before OperationAsync returns or on another thread.
+  virtual CK_RV OperationAsync(OperationType operation,
+                               CK_MECHANISM_TYPE mechanism,
+                               const std::string& mechanism_parameter,
+                               const Object* key,
+                               const std::string& data_in,
+                               const OperationCallback& callback) = 0;
   // Key generation (see PKCS #11 v2.20: 11.14).
   virtual CK_RV GenerateKey(CK_MECHANISM_TYPE mechanism,
                             const std::string& mechanism_parameter,
@@ -122,8 +172,6 @@ class Session {
   // Random number generation (see PKCS #11 v2.20: 11.15).
   virtual CK_RV SeedRandom(const std::string& seed) = 0;
   virtual CK_RV GenerateRandom(int num_bytes, std::string* random_data) = 0;
-  // Waits for private objects to be loaded before returning.
-  virtual void WaitForPrivateObjects() = 0;
 };
 
 }  // namespace p11net
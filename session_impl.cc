@@ -4,6 +4,9 @@
 
 #include "session_impl.h"
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <limits>
 #include <map>
 #include <memory>
@@ -13,9 +16,13 @@
 #include <iostream>
 
 #include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
 #include <brillo/secure_blob.h>
 #include <openssl/bio.h>
 #include <openssl/des.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
@@ -25,10 +32,13 @@
 #include "p11net.h"
 #include "p11net_factory.h"
 #include "p11net_utility.h"
+#include "metrics.h"
+#include "multi_digest.h"
 #include "object.h"
 #include "object_pool.h"
 #include "object_store.h"
 #include "pkcs11/cryptoki.h"
+#include "tracing.h"
 
 using brillo::SecureBlob;
 using std::hex;
@@ -47,31 +57,258 @@ static const int kMinRSAKeyBits = 512;
 //static const int kMaxRSAKeyBitsHW = 2048;  // Max supported by the TPM.
 static const int kMaxRSAKeyBitsSW = kMaxRSAOutputBytes * 8;
 
+// The object GetObject found last on this thread. It keeps the object alive
+// for the rest of the PKCS #11 call should it leave its pool meanwhile, e.g.
+// because its NetHSM key is evicted.
+thread_local std::shared_ptr<const Object> g_found_object;
+
+// An OpenSSL key cached on the object it was built from. OpenSSL keeps the
+// Montgomery contexts of the modulus and primes in the key, so they are also
+// computed only once.
+class CachedRSAKey : public CachedKey {
+ public:
+  explicit CachedRSAKey(RSA* rsa) : rsa_(rsa) {}
+  virtual ~CachedRSAKey() { RSA_free(rsa_); }
+  RSA* rsa() const { return rsa_; }
+
+ private:
+  RSA* rsa_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachedRSAKey);
+};
+
+// Keyed OpenSSL contexts cached on a secret key object, one per cipher and
+// direction or per HMAC digest. Operations start from a copy of these, which
+// skips the cipher key schedule and the hashing of the padded HMAC key.
+class CachedSecretKey : public CachedKey {
+ public:
+  CachedSecretKey() {}
+  virtual ~CachedSecretKey();
+
+  // Initializes 'context' to run 'cipher' keyed with 'key_material' and the
+  // given IV. Returns false if OpenSSL rejects the key.
+  bool InitCipher(const EVP_CIPHER* cipher,
+                  const string& key_material,
+                  const string& iv,
+                  bool is_encrypt,
+                  EVP_CIPHER_CTX* context) const;
+  // Initializes 'context' to compute an HMAC with 'digest' keyed with
+  // 'key_material'.
+  bool InitHMAC(const EVP_MD* digest,
+                const string& key_material,
+                HMAC_CTX* context) const;
+
+ private:
+  typedef std::pair<const EVP_CIPHER*, bool> CipherKey;
+
+  mutable boost::mutex lock_;
+  mutable map<CipherKey, EVP_CIPHER_CTX*> ciphers_;
+  mutable map<const EVP_MD*, HMAC_CTX*> hmacs_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachedSecretKey);
+};
+
+// The NetHSM side of a key object: the request targets of the key on the
+// NetHSM and its sizes. Operations bind it when they start, so signing and
+// decrypting look up no attributes and build no request paths.
+class CachedNetHsmKey : public CachedKey {
+ public:
+  CachedNetHsmKey(const string& location, size_t modulus_bytes,
+                  int order_bytes)
+      : target_(std::make_shared<KeyTarget>(location)),
+        modulus_bytes_(modulus_bytes),
+        order_bytes_(order_bytes) {}
+  const std::shared_ptr<const KeyTarget>& target() const { return target_; }
+  // The length of the modulus of an RSA key, or zero.
+  size_t modulus_bytes() const { return modulus_bytes_; }
+  // The length of the curve order of an EC key, or zero.
+  int order_bytes() const { return order_bytes_; }
+
+ private:
+  std::shared_ptr<const KeyTarget> target_;
+  size_t modulus_bytes_;
+  int order_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachedNetHsmKey);
+};
+
+// A NetHSM operation started by OperationAsync. 'submitted' is set once the
+// request was handed to NetUtility; a result that arrives before is kept for
+// the submitter.
+struct PendingNetHsmOperation {
+  PendingNetHsmOperation() : submitted(false), completed(false) {}
+  boost::mutex lock;
+  bool submitted;
+  bool completed;
+  boost::optional<string> result;
+};
+
+CachedSecretKey::~CachedSecretKey() {
+  for (auto& entry : ciphers_) {
+    EVP_CIPHER_CTX_cleanup(entry.second);
+    delete entry.second;
+  }
+  for (auto& entry : hmacs_) {
+    HMAC_CTX_cleanup(entry.second);
+    delete entry.second;
+  }
+}
+
+bool CachedSecretKey::InitCipher(const EVP_CIPHER* cipher,
+                                 const string& key_material,
+                                 const string& iv,
+                                 bool is_encrypt,
+                                 EVP_CIPHER_CTX* context) const {
+  EVP_CIPHER_CTX_init(context);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  EVP_CIPHER_CTX*& keyed = ciphers_[CipherKey(cipher, is_encrypt)];
+  if (!keyed) {
+    std::unique_ptr<EVP_CIPHER_CTX> new_keyed(new EVP_CIPHER_CTX);
+    EVP_CIPHER_CTX_init(new_keyed.get());
+    if (!EVP_CipherInit_ex(new_keyed.get(),
+                           cipher,
+                           NULL,
+                           ConvertStringToByteBuffer(key_material.c_str()),
+                           NULL,
+                           is_encrypt)) {
+      EVP_CIPHER_CTX_cleanup(new_keyed.get());
+      ciphers_.erase(CipherKey(cipher, is_encrypt));
+      return false;
+    }
+    keyed = new_keyed.release();
+  }
+  if (!EVP_CIPHER_CTX_copy(context, keyed))
+    return false;
+  // Only the IV is set; the key schedule comes with the copy.
+  return EVP_CipherInit_ex(context,
+                           NULL,
+                           NULL,
+                           NULL,
+                           ConvertStringToByteBuffer(iv.c_str()),
+                           is_encrypt);
+}
+
+bool CachedSecretKey::InitHMAC(const EVP_MD* digest,
+                               const string& key_material,
+                               HMAC_CTX* context) const {
+  HMAC_CTX_init(context);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  HMAC_CTX*& keyed = hmacs_[digest];
+  if (!keyed) {
+    std::unique_ptr<HMAC_CTX> new_keyed(new HMAC_CTX);
+    HMAC_CTX_init(new_keyed.get());
+    if (!HMAC_Init_ex(new_keyed.get(),
+                      key_material.data(),
+                      key_material.length(),
+                      digest,
+                      NULL)) {
+      HMAC_CTX_cleanup(new_keyed.get());
+      hmacs_.erase(digest);
+      return false;
+    }
+    keyed = new_keyed.release();
+  }
+  return HMAC_CTX_copy(context, keyed);
+}
+
 SessionImpl::SessionImpl(int slot_id,
                          std::shared_ptr<ObjectPool> token_object_pool,
                          std::shared_ptr<NetUtility> net_utility,
                          std::shared_ptr<P11NetFactory> factory,
                          std::shared_ptr<HandleGenerator> handle_generator,
                          bool is_read_only)
-    : factory_(factory),
+    : find_pool_index_(0),
+      find_last_handle_(0),
       find_results_valid_(false),
       is_read_only_(is_read_only),
       slot_id_(slot_id),
-      token_object_pool_(token_object_pool),
-      net_utility_(net_utility),
+      priority_(kInteractivePriority),
       is_legacy_loaded_(false),
       private_root_key_(0),
-      public_root_key_(0) {
+      public_root_key_(0),
+      reported_state_bytes_(0),
+      peak_state_bytes_(0) {
+  Reset(slot_id, token_object_pool, net_utility, factory, handle_generator,
+        is_read_only);
+}
+
+SessionImpl::~SessionImpl() {
+  RecordMemoryUsage();
+}
+
+void SessionImpl::Reset(int slot_id,
+                        std::shared_ptr<ObjectPool> token_object_pool,
+                        std::shared_ptr<NetUtility> net_utility,
+                        std::shared_ptr<P11NetFactory> factory,
+                        std::shared_ptr<HandleGenerator> handle_generator,
+                        bool is_read_only) {
+  slot_id_ = slot_id;
+  token_object_pool_ = token_object_pool;
+  net_utility_ = net_utility;
+  factory_ = factory;
+  handle_generator_ = handle_generator;
+  is_read_only_ = is_read_only;
   CHECK(token_object_pool_);
   CHECK(net_utility_);
   CHECK(factory_);
-  session_object_pool_.reset(
-    factory_->CreateObjectPool(handle_generator,
-                               std::unique_ptr<ObjectStore>()));
-  CHECK(session_object_pool_.get());
 }
 
-SessionImpl::~SessionImpl() {
+void SessionImpl::Recycle() {
+  RecordMemoryUsage();
+  reported_state_bytes_ = 0;
+  peak_state_bytes_ = 0;
+  find_template_.reset();
+  find_pools_.clear();
+  find_pool_index_ = 0;
+  find_last_handle_ = 0;
+  find_results_valid_ = false;
+  object_tpm_handle_map_.clear();
+  // The contexts are kept for the next session; their buffers are not.
+  if (operation_context_) {
+    for (int i = 0; i < kNumOperationTypes; ++i) {
+      operation_context_[i].Clear();
+      operation_context_[i].data_.shrink_to_fit();
+      operation_context_[i].parameter_.shrink_to_fit();
+    }
+  }
+  // Destroys the session objects.
+  session_object_pool_.reset();
+  priority_ = kInteractivePriority;
+  is_legacy_loaded_ = false;
+  private_root_key_ = 0;
+  public_root_key_ = 0;
+  // Recycled sessions must not keep the token, or the factory holding them,
+  // alive.
+  token_object_pool_.reset();
+  net_utility_.reset();
+  factory_.reset();
+  handle_generator_.reset();
+}
+
+void SessionImpl::RecordMemoryUsage() {
+  static Gauge* const state_bytes = Metrics::Get()->GetGauge(
+      "p11net_session_state_bytes");
+  static Histogram* const peak_state_bytes = Metrics::Get()->GetHistogram(
+      "p11net_session_peak_state_bytes");
+  state_bytes->Add(-static_cast<int64_t>(reported_state_bytes_));
+  peak_state_bytes->Record(peak_state_bytes_);
+}
+
+SessionImpl::OperationContext* SessionImpl::GetOperationContext(
+    OperationType operation) {
+  if (!operation_context_)
+    operation_context_.reset(new OperationContext[kNumOperationTypes]);
+  return &operation_context_[operation];
+}
+
+std::shared_ptr<ObjectPool> SessionImpl::GetSessionObjectPool() {
+  if (!session_object_pool_) {
+    session_object_pool_.reset(
+      factory_->CreateObjectPool(handle_generator_,
+                                 std::unique_ptr<ObjectStore>()));
+    CHECK(session_object_pool_.get());
+  }
+  return session_object_pool_;
 }
 
 int SessionImpl::GetSlot() const {
@@ -86,9 +323,49 @@ bool SessionImpl::IsReadOnly() const {
   return is_read_only_;
 }
 
+size_t SessionImpl::GetMemoryUsage() {
+  size_t bytes = sizeof(*this) + GetStateBytes();
+  if (session_object_pool_)
+    bytes += session_object_pool_->GetMemoryUsage();
+  if (operation_context_)
+    bytes += kNumOperationTypes * sizeof(OperationContext);
+  return bytes;
+}
+
+RequestPriority SessionImpl::GetPriority() const {
+  return priority_;
+}
+
+void SessionImpl::SetPriority(RequestPriority priority) {
+  priority_ = priority;
+}
+
+size_t SessionImpl::GetStateBytes() const {
+  size_t bytes = 0;
+  for (int i = 0; operation_context_ && i < kNumOperationTypes; ++i) {
+    bytes += operation_context_[i].data_.capacity() +
+             operation_context_[i].parameter_.capacity();
+  }
+  if (find_template_)
+    bytes += find_template_->GetSize();
+  return bytes;
+}
+
+void SessionImpl::ReportMemoryUsage() {
+  static Gauge* const state_bytes = Metrics::Get()->GetGauge(
+      "p11net_session_state_bytes");
+  const size_t bytes = GetStateBytes();
+  if (bytes == reported_state_bytes_)
+    return;
+  state_bytes->Add(static_cast<int64_t>(bytes) -
+                   static_cast<int64_t>(reported_state_bytes_));
+  reported_state_bytes_ = bytes;
+  peak_state_bytes_ = std::max(peak_state_bytes_, bytes);
+}
+
 bool SessionImpl::IsOperationActive(OperationType type) const {
   CHECK(type < kNumOperationTypes);
-  return operation_context_[type].is_valid_;
+  return operation_context_ && operation_context_[type].is_valid_;
 }
 
 CK_RV SessionImpl::CreateObject(const CK_ATTRIBUTE_PTR attributes,
@@ -120,7 +397,7 @@ CK_RV SessionImpl::DestroyObject(int object_handle) {
     return CKR_OBJECT_HANDLE_INVALID;
   CHECK(object);
   std::shared_ptr<ObjectPool> pool = object->IsTokenObject() ? token_object_pool_
-      : session_object_pool_;
+      : GetSessionObjectPool();
   if (!pool->Delete(object))
     return CKR_GENERAL_ERROR;
   return CKR_OK;
@@ -128,9 +405,39 @@ CK_RV SessionImpl::DestroyObject(int object_handle) {
 
 bool SessionImpl::GetObject(int object_handle, const Object** object) {
   CHECK(object);
-  if (token_object_pool_->FindByHandle(object_handle, object))
-    return true;
-  return session_object_pool_->FindByHandle(object_handle, object);
+  P11NET_TRACE_SPAN("object lookup");
+  std::shared_ptr<const Object> found;
+  if (token_object_pool_->FindByHandle(object_handle, &found)) {
+    net_utility_->MarkKeyUsed(*found);
+  } else if (!session_object_pool_ ||
+             !session_object_pool_->FindByHandle(object_handle, &found)) {
+    // The handle may belong to a NetHSM key that was evicted from the pool.
+    if (!net_utility_->RestoreObject(object_handle) ||
+        !token_object_pool_->FindByHandle(object_handle, &found))
+      return false;
+  }
+  *object = found.get();
+  g_found_object.swap(found);
+  return true;
+}
+
+std::shared_ptr<const Object> SessionImpl::PinObject(const Object* object) {
+  if (g_found_object.get() == object)
+    return g_found_object;
+  std::shared_ptr<const Object> pinned;
+  if (token_object_pool_->FindByHandle(object->handle(), &pinned) &&
+      pinned.get() == object)
+    return pinned;
+  if (session_object_pool_ &&
+      session_object_pool_->FindByHandle(object->handle(), &pinned) &&
+      pinned.get() == object)
+    return pinned;
+  return std::shared_ptr<const Object>();
+}
+
+bool SessionImpl::LoadObjectValue(int object_handle) {
+  // Only NetHSM certificates in the token object pool are loaded lazily.
+  return net_utility_->LoadCertificate(object_handle);
 }
 
 bool SessionImpl::GetModifiableObject(int object_handle, Object** object) {
@@ -139,7 +446,7 @@ bool SessionImpl::GetModifiableObject(int object_handle, Object** object) {
   if (!GetObject(object_handle, &const_object))
     return false;
   std::shared_ptr<ObjectPool> pool = const_object->IsTokenObject() ? token_object_pool_
-      : session_object_pool_;
+      : GetSessionObjectPool();
   *object = pool->GetModifiableObject(const_object);
   return true;
 }
@@ -147,7 +454,7 @@ bool SessionImpl::GetModifiableObject(int object_handle, Object** object) {
 bool SessionImpl::FlushModifiableObject(Object* object) {
   CHECK(object);
   std::shared_ptr<ObjectPool> pool = object->IsTokenObject() ? token_object_pool_
-      : session_object_pool_;
+      : GetSessionObjectPool();
   return pool->Flush(object);
 }
 
@@ -155,34 +462,29 @@ CK_RV SessionImpl::FindObjectsInit(const CK_ATTRIBUTE_PTR attributes,
                                    int num_attributes) {
   if (find_results_valid_)
     return CKR_OPERATION_ACTIVE;
+  ScopedMemoryReport memory_report(this);
   std::unique_ptr<Object> search_template(factory_->CreateObject());
   CHECK(search_template.get());
   search_template->SetAttributes(attributes, num_attributes);
-  std::string key_id;
-  if (search_template->IsAttributePresent(CKA_ID)) {
-    key_id = search_template->GetAttributeString(CKA_ID);
-    VLOG(1) << "CKA_ID is set: " << key_id;
-  }
-
-  net_utility_->LoadKeys(key_id);
+  net_utility_->LoadKeys(*search_template);
 
-  vector<const Object*> objects;
+  // Matches are only collected as FindObjects asks for them. Each pool is
+  // walked in handle order, so every object is returned at most once; objects
+  // deleted before they are reached are skipped and objects added meanwhile
+  // are returned if they match.
+  find_pools_.clear();
   if (!search_template->IsAttributePresent(CKA_TOKEN) ||
-      search_template->IsTokenObject()) {
-    if (!token_object_pool_->Find(search_template.get(), &objects))
-      return CKR_GENERAL_ERROR;
-  }
-  if (!search_template->IsAttributePresent(CKA_TOKEN) ||
-      !search_template->IsTokenObject()) {
-    if (!session_object_pool_->Find(search_template.get(), &objects))
-      return CKR_GENERAL_ERROR;
-  }
-  find_results_.clear();
-  find_results_offset_ = 0;
+      search_template->IsTokenObject())
+    find_pools_.push_back(token_object_pool_);
+  // Sessions that never created an object have no pool to search.
+  if (session_object_pool_ &&
+      (!search_template->IsAttributePresent(CKA_TOKEN) ||
+       !search_template->IsTokenObject()))
+    find_pools_.push_back(session_object_pool_);
+  find_template_ = std::move(search_template);
+  find_pool_index_ = 0;
+  find_last_handle_ = 0;
   find_results_valid_ = true;
-  for (size_t i = 0; i < objects.size(); ++i) {
-    find_results_.push_back(objects[i]->handle());
-  }
   return CKR_OK;
 }
 
@@ -191,14 +493,26 @@ CK_RV SessionImpl::FindObjects(int max_object_count,
   CHECK(object_handles);
   if (!find_results_valid_)
     return CKR_OPERATION_NOT_INITIALIZED;
-  size_t end_offset = find_results_offset_ +
-      static_cast<size_t>(max_object_count);
-  if (end_offset > find_results_.size())
-    end_offset = find_results_.size();
-  for (size_t i = find_results_offset_; i < end_offset; ++i) {
-    object_handles->push_back(find_results_[i]);
-  }
-  find_results_offset_ += object_handles->size();
+  size_t remaining = max_object_count > 0 ?
+      static_cast<size_t>(max_object_count) : 0;
+  while (remaining > 0 && find_pool_index_ < find_pools_.size()) {
+    vector<const Object*> objects;
+    if (!find_pools_[find_pool_index_]->FindFrom(find_template_.get(),
+                                                 find_last_handle_,
+                                                 remaining,
+                                                 &objects))
+      return CKR_GENERAL_ERROR;
+    for (size_t i = 0; i < objects.size(); ++i)
+      object_handles->push_back(objects[i]->handle());
+    if (objects.size() < remaining) {
+      // This pool is exhausted; continue with the next one.
+      ++find_pool_index_;
+      find_last_handle_ = 0;
+    } else {
+      find_last_handle_ = objects.back()->handle();
+    }
+    remaining -= objects.size();
+  }
   return CKR_OK;
 }
 
@@ -206,6 +520,9 @@ CK_RV SessionImpl::FindObjectsFinal() {
   if (!find_results_valid_)
     return CKR_OPERATION_NOT_INITIALIZED;
   find_results_valid_ = false;
+  find_template_.reset();
+  find_pools_.clear();
+  ReportMemoryUsage();
   return CKR_OK;
 }
 
@@ -214,7 +531,8 @@ CK_RV SessionImpl::OperationInit(OperationType operation,
                                  const string& mechanism_parameter,
                                  const Object* key) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  ScopedMemoryReport memory_report(this);
+  OperationContext* context = GetOperationContext(operation);
   if (context->is_valid_) {
     LOG(ERROR) << "Operation is already active.";
     return CKR_OPERATION_ACTIVE;
@@ -222,60 +540,45 @@ CK_RV SessionImpl::OperationInit(OperationType operation,
   context->Clear();
   context->mechanism_ = mechanism;
   context->parameter_ = mechanism_parameter;
-  if (!IsValidMechanism(operation, mechanism)) {
-    LOG(ERROR) << "Mechanism not supported: 0x" << hex << mechanism;
-    return CKR_MECHANISM_INVALID;
-  }
-  if (operation != kDigest) {
-    // Make sure the key is valid for the mechanism.
-    CHECK(key);
-    if (!IsValidKeyType(operation,
-                        mechanism,
-                        key->GetObjectClass(),
-                        key->GetAttributeInt(CKA_KEY_TYPE, -1))) {
-      LOG(ERROR) << "Key type mismatch.";
-      return CKR_KEY_TYPE_INCONSISTENT;
-    }
-    if (!key->GetAttributeBool(GetRequiredKeyUsage(operation), false)) {
-      LOG(ERROR) << "Key function not permitted.";
-      return CKR_KEY_FUNCTION_NOT_PERMITTED;
-    }
-    if (IsRSA(mechanism)) {
-      int key_size = key->GetAttributeString(CKA_MODULUS).length() * 8;
-      if (key_size < kMinRSAKeyBits || key_size > kMaxRSAKeyBitsSW) {
-        LOG(ERROR) << "Key size not supported: " << key_size;
-        return CKR_KEY_SIZE_RANGE;
-      }
-    }
-  }
+  if (key)
+    context->key_ref_ = PinObject(key);
+  CK_RV result = CheckOperationKey(operation, mechanism, key,
+                                   &context->descriptor_);
+  if (result != CKR_OK)
+    return result;
+  const MechanismDescriptor& descriptor = *context->descriptor_;
   if (operation == kEncrypt || operation == kDecrypt) {
     if (mechanism == CKM_RSA_PKCS) {
       context->key_ = key;
+      context->net_key_ = GetNetHsmKey(key);
       context->is_valid_ = true;
     } else {
       return CipherInit((operation == kEncrypt),
-                        mechanism,
+                        descriptor,
                         mechanism_parameter,
                         key);
     }
   } else {
-    // It is valid for GetOpenSSLDigest to return NULL (e.g. CKM_RSA_PKCS).
-    const EVP_MD* digest = GetOpenSSLDigest(mechanism);
-    if (IsHMAC(mechanism)) {
+    // It is valid for the digest to be NULL (e.g. CKM_RSA_PKCS).
+    const EVP_MD* digest = descriptor.GetDigest();
+    if (descriptor.IsHMAC()) {
       string key_material = key->GetAttributeString(CKA_VALUE);
-      HMAC_CTX_init(&context->hmac_context_);
-      HMAC_Init_ex(&context->hmac_context_,
-                   key_material.data(),
-                   key_material.length(),
-                   digest,
-                   NULL);
+      if (!GetSecretKey(key)->InitHMAC(digest,
+                                       key_material,
+                                       &context->hmac_context_)) {
+        LOG(ERROR) << "HMAC_CTX_copy failed: " << GetOpenSSLError();
+        HMAC_CTX_cleanup(&context->hmac_context_);
+        return CKR_FUNCTION_FAILED;
+      }
       context->is_hmac_ = true;
     } else if (digest) {
       EVP_DigestInit(&context->digest_context_, digest);
       context->is_digest_ = true;
     }
-    if (IsRSA(mechanism))
+    if (descriptor.IsRSA() || descriptor.IsECDSA()) {
       context->key_ = key;
+      context->net_key_ = GetNetHsmKey(key);
+    }
     context->is_valid_ = true;
   }
   return CKR_OK;
@@ -286,7 +589,8 @@ CK_RV SessionImpl::OperationUpdate(OperationType operation,
                                    int* required_out_length,
                                    string* data_out) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  ScopedMemoryReport memory_report(this);
+  OperationContext* context = GetOperationContext(operation);
   if (!context->is_valid_) {
     LOG(ERROR) << "Operation is not initialized.";
     return CKR_OPERATION_NOT_INITIALIZED;
@@ -308,7 +612,7 @@ CK_RV SessionImpl::OperationUpdateInternal(OperationType operation,
                                            int* required_out_length,
                                            string* data_out) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  OperationContext* context = GetOperationContext(operation);
   if (context->is_cipher_) {
     CK_RV rv = CipherUpdate(context, data_in, required_out_length, data_out);
     if ((rv != CKR_OK) && (rv != CKR_BUFFER_TOO_SMALL))
@@ -323,7 +627,25 @@ CK_RV SessionImpl::OperationUpdateInternal(OperationType operation,
                 ConvertStringToByteBuffer(data_in.c_str()),
                 data_in.length());
   } else {
-    // We don't need to process now; just queue the data.
+    // We don't need to process now; just queue the data. Only raw RSA
+    // mechanisms get here and their input never exceeds the modulus, so
+    // refuse to buffer more than that.
+    if (context->key_ && context->descriptor_->IsRSA()) {
+      size_t max_length = GetModulusBytes(*context);
+      if (context->data_.length() + data_in.length() > max_length) {
+        LOG(ERROR) << "Data length exceeds the RSA modulus.";
+        OperationCancel(operation);
+        return CKR_DATA_LEN_RANGE;
+      }
+      context->data_.reserve(max_length);
+    } else if (context->descriptor_->IsECDSA() &&
+               context->data_.length() + data_in.length() >
+                   static_cast<size_t>(kMaxDigestOutputBytes)) {
+      // Raw ECDSA takes a digest.
+      LOG(ERROR) << "Data length exceeds the largest digest.";
+      OperationCancel(operation);
+      return CKR_DATA_LEN_RANGE;
+    }
     context->data_ += data_in;
   }
   if (required_out_length)
@@ -333,13 +655,16 @@ CK_RV SessionImpl::OperationUpdateInternal(OperationType operation,
 
 void SessionImpl::OperationCancel(OperationType operation) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  if (!operation_context_)
+    return;
+  OperationContext* context = GetOperationContext(operation);
   if (!context->is_valid_) {
     LOG(ERROR) << "Operation is not initialized.";
     return;
   }
   // Drop the context and any associated data.
   context->Clear();
+  ReportMemoryUsage();
 }
 
 CK_RV SessionImpl::OperationFinal(OperationType operation,
@@ -348,7 +673,8 @@ CK_RV SessionImpl::OperationFinal(OperationType operation,
   CHECK(required_out_length);
   CHECK(data_out);
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  ScopedMemoryReport memory_report(this);
+  OperationContext* context = GetOperationContext(operation);
   if (!context->is_valid_) {
     LOG(ERROR) << "Operation is not initialized.";
     return CKR_OPERATION_NOT_INITIALIZED;
@@ -359,6 +685,9 @@ CK_RV SessionImpl::OperationFinal(OperationType operation,
     return CKR_OPERATION_ACTIVE;
   }
   context->is_incremental_ = true;
+  if (!context->is_finished_ &&
+      IsLengthQuery(operation, *context, required_out_length))
+    return CKR_BUFFER_TOO_SMALL;
   return OperationFinalInternal(operation, required_out_length, data_out);
 }
 
@@ -366,7 +695,7 @@ CK_RV SessionImpl::OperationFinalInternal(OperationType operation,
                                           int* required_out_length,
                                           string* data_out) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  OperationContext* context = GetOperationContext(operation);
   context->is_valid_ = false;
   // Complete the operation if it has not already been done.
   if (!context->is_finished_) {
@@ -388,17 +717,22 @@ CK_RV SessionImpl::OperationFinalInternal(OperationType operation,
     }
     // Some RSA mechanisms use a digest so it's important to finish the digest
     // before finishing the RSA computation.
-    if (IsRSA(context->mechanism_)) {
+    if (context->descriptor_->IsRSA()) {
       if (operation == kEncrypt) {
         if (!RSAEncrypt(context))
           return CKR_FUNCTION_FAILED;
       } else if (operation == kDecrypt) {
         if (!RSADecrypt(context))
-          return CKR_FUNCTION_FAILED;
+          return context->is_rejected_ ? CKR_DEVICE_ERROR
+                                       : CKR_FUNCTION_FAILED;
       } else if (operation == kSign) {
         if (!RSASign(context))
-          return CKR_FUNCTION_FAILED;
+          return context->is_rejected_ ? CKR_DEVICE_ERROR
+                                       : CKR_FUNCTION_FAILED;
       }
+    } else if (context->descriptor_->IsECDSA() && operation == kSign) {
+      if (!ECDSASign(context))
+        return context->is_rejected_ ? CKR_DEVICE_ERROR : CKR_FUNCTION_FAILED;
     }
     context->is_finished_ = true;
   }
@@ -413,7 +747,7 @@ CK_RV SessionImpl::OperationFinalInternal(OperationType operation,
 }
 
 CK_RV SessionImpl::VerifyFinal(const string& signature) {
-  OperationContext* context = &operation_context_[kVerify];
+  OperationContext* context = GetOperationContext(kVerify);
   // Call the generic OperationFinal so any digest or HMAC computation gets
   // finalized.
   int max_out_length = std::numeric_limits<int>::max();
@@ -421,7 +755,7 @@ CK_RV SessionImpl::VerifyFinal(const string& signature) {
   CK_RV result = OperationFinal(kVerify, &max_out_length, &data_out);
   if (result != CKR_OK)
     return result;
-  // We only support two Verify mechanisms, HMAC and RSA.
+  // We support three kinds of Verify mechanisms, HMAC, RSA and ECDSA.
   if (context->is_hmac_) {
     // The data_out contents will be the computed HMAC. To verify an HMAC, it is
     // recomputed and literally compared.
@@ -431,6 +765,8 @@ CK_RV SessionImpl::VerifyFinal(const string& signature) {
                                     data_out.data(),
                                     signature.length()))
       return CKR_SIGNATURE_INVALID;
+  } else if (context->descriptor_->IsECDSA()) {
+    return ECDSAVerify(context, data_out, signature);
   } else {
     // The data_out contents will be the computed digest.
     return RSAVerify(context, data_out, signature);
@@ -443,7 +779,8 @@ CK_RV SessionImpl::OperationSinglePart(OperationType operation,
                                        int* required_out_length,
                                        string* data_out) {
   CHECK(operation < kNumOperationTypes);
-  OperationContext* context = &operation_context_[operation];
+  ScopedMemoryReport memory_report(this);
+  OperationContext* context = GetOperationContext(operation);
   if (!context->is_valid_) {
     LOG(ERROR) << "Operation is not initialized.";
     return CKR_OPERATION_NOT_INITIALIZED;
@@ -453,18 +790,26 @@ CK_RV SessionImpl::OperationSinglePart(OperationType operation,
     OperationCancel(operation);
     return CKR_OPERATION_ACTIVE;
   }
+  if (!context->is_finished_ &&
+      IsLengthQuery(operation, *context, required_out_length))
+    return CKR_BUFFER_TOO_SMALL;
   CK_RV result = CKR_OK;
   if (!context->is_finished_) {
     string update, final;
     int max = std::numeric_limits<int>::max();
-    result = OperationUpdateInternal(operation, data_in, &max, &update);
+    if (context->is_digest_ && MultiDigest::Get()->IsEnabled())
+      result = MultiDigestUpdate(context, data_in);
+    else
+      result = OperationUpdateInternal(operation, data_in, &max, &update);
     if (result != CKR_OK)
       return result;
     max = std::numeric_limits<int>::max();
     result = OperationFinalInternal(operation, &max, &final);
     if (result != CKR_OK)
       return result;
-    context->data_ = update + final;
+    // Usually only one of the parts holds output.
+    context->data_.swap(update);
+    context->data_.append(final);
     context->is_finished_ = true;
   }
   context->is_valid_ = false;
@@ -478,6 +823,279 @@ CK_RV SessionImpl::OperationSinglePart(OperationType operation,
   return result;
 }
 
+CK_RV SessionImpl::MultiDigestUpdate(OperationContext* context,
+                                     const string& data_in) {
+  // The whole message is known, so it can share the vector lanes with the
+  // digests of other sessions. OperationFinalInternal then finds the digest
+  // in data_ as if it had finished the EVP context.
+  const EVP_MD* digest = EVP_MD_CTX_md(&context->digest_context_);
+  EVP_MD_CTX_cleanup(&context->digest_context_);
+  context->is_digest_ = false;
+  if (!MultiDigest::Get()->Digest(digest, data_in, &context->data_)) {
+    LOG(ERROR) << "Digest failed: " << GetOpenSSLError();
+    context->Clear();
+    return CKR_FUNCTION_FAILED;
+  }
+  return CKR_OK;
+}
+
+CK_RV SessionImpl::OperationSinglePartToBuffer(OperationType operation,
+                                               const string& data_in,
+                                               uint8_t* data_out,
+                                               int* data_out_length) {
+  CHECK(data_out_length);
+  CHECK(operation < kNumOperationTypes);
+  OperationContext* context = GetOperationContext(operation);
+  // Cipher output is at most one block longer than the input.
+  int in_length = data_in.length();
+  if (data_out && context->is_valid_ && context->is_cipher_ &&
+      !context->is_incremental_ && !context->is_finished_ &&
+      *data_out_length - kMaxCipherBlockBytes >= in_length) {
+    int update_length = 0;
+    int final_length = 0;
+    bool success =
+        EVP_CipherUpdate(&context->cipher_context_,
+                         data_out,
+                         &update_length,
+                         ConvertStringToByteBuffer(data_in.data()),
+                         in_length) &&
+        EVP_CipherFinal(&context->cipher_context_,
+                        data_out + update_length,
+                        &final_length);
+    if (!success)
+      LOG(ERROR) << "EVP_Cipher failed: " << GetOpenSSLError();
+    EVP_CIPHER_CTX_cleanup(&context->cipher_context_);
+    context->is_finished_ = true;
+    context->Clear();
+    if (!success)
+      return CKR_FUNCTION_FAILED;
+    *data_out_length = update_length + final_length;
+    return CKR_OK;
+  }
+  string output;
+  CK_RV result = OperationSinglePart(operation,
+                                     data_in,
+                                     data_out_length,
+                                     &output);
+  if (result == CKR_OK && !output.empty()) {
+    CHECK(data_out);
+    memcpy(data_out, output.data(), output.length());
+  }
+  return result;
+}
+
+CK_RV SessionImpl::OperationBatch(OperationType operation,
+                                  CK_MECHANISM_TYPE mechanism,
+                                  const string& mechanism_parameter,
+                                  const Object* key,
+                                  const vector<string>& inputs,
+                                  vector<string>* outputs,
+                                  vector<CK_RV>* results) {
+  CHECK(outputs);
+  CHECK(results);
+  vector<string> data;
+  const MechanismDescriptor* descriptor = NULL;
+  CK_RV result = PrepareOperationInputs(operation, mechanism, key, &descriptor,
+                                        inputs, &data, results);
+  if (result != CKR_OK)
+    return result;
+  outputs->assign(inputs.size(), string());
+  if (IsNetHsmKey(key)) {
+    NetHsmOperationBatch(operation, GetNetHsmKey(key)->target(), data, outputs,
+                         results);
+    return CKR_OK;
+  }
+  for (size_t i = 0; i < data.size(); ++i) {
+    if ((*results)[i] != CKR_OK)
+      continue;
+    if (SoftwareOperation(operation, descriptor, key, &data[i]))
+      (*outputs)[i].swap(data[i]);
+    else
+      (*results)[i] = CKR_FUNCTION_FAILED;
+  }
+  return CKR_OK;
+}
+
+CK_RV SessionImpl::OperationAsync(OperationType operation,
+                                  CK_MECHANISM_TYPE mechanism,
+                                  const string& mechanism_parameter,
+                                  const Object* key,
+                                  const string& data_in,
+                                  const OperationCallback& callback) {
+  vector<string> data;
+  vector<CK_RV> results;
+  const MechanismDescriptor* descriptor = NULL;
+  CK_RV result = PrepareOperationInputs(operation, mechanism, key, &descriptor,
+                                        vector<string>(1, data_in), &data,
+                                        &results);
+  if (result != CKR_OK)
+    return result;
+  if (results[0] != CKR_OK)
+    return results[0];
+  if (!IsNetHsmKey(key)) {
+    if (!SoftwareOperation(operation, descriptor, key, &data[0]))
+      return CKR_FUNCTION_FAILED;
+    callback(CKR_OK, data[0]);
+    return CKR_OK;
+  }
+  // A request turned away at the NetHSM request limit completes before
+  // SignAsync or DecryptAsync returns. Hold back such an early result until
+  // LastCallRejected tells whether to fail the submission instead.
+  std::shared_ptr<PendingNetHsmOperation> pending =
+      std::make_shared<PendingNetHsmOperation>();
+  NetUtility::ResultCallback on_result =
+      [pending, callback](const boost::optional<string>& result) {
+        {
+          boost::lock_guard<boost::mutex> lock(pending->lock);
+          if (!pending->submitted) {
+            pending->completed = true;
+            pending->result = result;
+            return;
+          }
+        }
+        callback(result ? CKR_OK : CKR_FUNCTION_FAILED,
+                 result ? *result : string());
+      };
+  // target() refers into the cached key, so both are held by value.
+  const std::shared_ptr<const CachedNetHsmKey> net_key = GetNetHsmKey(key);
+  const std::shared_ptr<const KeyTarget> target = net_key->target();
+  if (operation == kSign)
+    net_utility_->SignAsync(target, data[0], priority_, on_result);
+  else
+    net_utility_->DecryptAsync(target, data[0], priority_, on_result);
+  const bool rejected = net_utility_->LastCallRejected();
+  boost::optional<string> early_result;
+  {
+    boost::lock_guard<boost::mutex> lock(pending->lock);
+    pending->submitted = true;
+    if (!pending->completed)
+      return CKR_OK;
+    early_result.swap(pending->result);
+  }
+  if (!early_result && rejected)
+    return CKR_DEVICE_ERROR;
+  callback(early_result ? CKR_OK : CKR_FUNCTION_FAILED,
+           early_result ? *early_result : string());
+  return CKR_OK;
+}
+
+bool SessionImpl::IsNetHsmKey(const Object* key) const {
+  return key->IsTokenObject() &&
+         key->IsAttributePresent(kKeyLocationAttribute);
+}
+
+CK_RV SessionImpl::PrepareOperationInputs(
+    OperationType operation,
+    CK_MECHANISM_TYPE mechanism,
+    const Object* key,
+    const MechanismDescriptor** descriptor,
+    const vector<string>& inputs,
+    vector<string>* data,
+    vector<CK_RV>* results) {
+  *descriptor = GetMechanismDescriptor(mechanism);
+  if ((operation != kSign && operation != kDecrypt) || !*descriptor ||
+      !(*descriptor)->IsRSA()) {
+    LOG(ERROR) << "Mechanism not supported in a batch: 0x" << hex << mechanism;
+    return CKR_MECHANISM_INVALID;
+  }
+  CK_RV result = CheckOperationKey(operation, mechanism, key, descriptor);
+  if (result != CKR_OK)
+    return result;
+  data->assign(inputs.size(), string());
+  results->assign(inputs.size(), CKR_OK);
+  // Bring each input into the form RSASign and RSADecrypt expect: digested
+  // for the hashing mechanisms, and no longer than the modulus otherwise.
+  // The NetHSM also needs the DigestInfo that RSASign would prepend.
+  const size_t max_length = key->GetAttributeString(CKA_MODULUS).length();
+  const EVP_MD* digest =
+      operation == kSign ? (*descriptor)->GetDigest() : NULL;
+  const string digest_info = (operation == kSign && IsNetHsmKey(key)) ?
+      (*descriptor)->GetDERDigestInfo() : string();
+  vector<string> digests;
+  if (digest && !MultiDigest::Get()->DigestAll(digest, inputs, &digests)) {
+    LOG(ERROR) << "Digest failed: " << GetOpenSSLError();
+    return CKR_FUNCTION_FAILED;
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    string& item = (*data)[i];
+    if (digest) {
+      item.swap(digests[i]);
+    } else if (inputs[i].length() > max_length) {
+      (*results)[i] = CKR_DATA_LEN_RANGE;
+      continue;
+    } else {
+      item = inputs[i];
+    }
+    item.insert(0, digest_info);
+  }
+  return CKR_OK;
+}
+
+bool SessionImpl::SoftwareOperation(OperationType operation,
+                                    const MechanismDescriptor* descriptor,
+                                    const Object* key,
+                                    string* data) {
+  OperationContext context;
+  context.mechanism_ = descriptor->type;
+  context.descriptor_ = descriptor;
+  context.key_ = key;
+  context.data_.swap(*data);
+  bool success = (operation == kSign) ? RSASign(&context)
+                                      : RSADecrypt(&context);
+  if (success)
+    data->swap(context.data_);
+  return success;
+}
+
+void SessionImpl::NetHsmOperationBatch(
+    OperationType operation,
+    const std::shared_ptr<const KeyTarget>& key,
+    const vector<string>& inputs,
+    vector<string>* outputs,
+    vector<CK_RV>* results) {
+  typedef std::promise<boost::optional<string>> ResultPromise;
+  // The batch waits for its results no longer than a single operation may
+  // take; a request still outstanding then fails, and its late result is
+  // dropped with the promise.
+  const std::chrono::milliseconds timeout =
+      net_utility_->GetOperationDeadline();
+  const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + timeout;
+  vector<std::future<boost::optional<string>>> pending(inputs.size());
+  vector<bool> rejected(inputs.size(), false);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if ((*results)[i] != CKR_OK)
+      continue;
+    std::shared_ptr<ResultPromise> promise = std::make_shared<ResultPromise>();
+    pending[i] = promise->get_future();
+    NetUtility::ResultCallback callback =
+        [promise](const boost::optional<string>& result) {
+          promise->set_value(result);
+        };
+    if (operation == kSign)
+      net_utility_->SignAsync(key, inputs[i], priority_, callback);
+    else
+      net_utility_->DecryptAsync(key, inputs[i], priority_, callback);
+    rejected[i] = net_utility_->LastCallRejected();
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!pending[i].valid())
+      continue;
+    if (timeout != std::chrono::milliseconds::zero() &&
+        pending[i].wait_until(deadline) != std::future_status::ready) {
+      LOG(WARNING) << "NetHSM operation exceeded its deadline of "
+                   << timeout.count() << "ms";
+      (*results)[i] = CKR_FUNCTION_FAILED;
+      continue;
+    }
+    boost::optional<string> result = pending[i].get();
+    if (result)
+      (*outputs)[i].swap(*result);
+    else
+      (*results)[i] = rejected[i] ? CKR_DEVICE_ERROR : CKR_FUNCTION_FAILED;
+  }
+}
+
 CK_RV SessionImpl::GenerateKey(CK_MECHANISM_TYPE mechanism,
                                const string& mechanism_parameter,
                                const CK_ATTRIBUTE_PTR attributes,
@@ -543,7 +1161,7 @@ CK_RV SessionImpl::GenerateKey(CK_MECHANISM_TYPE mechanism,
   if (result != CKR_OK)
     return result;
   std::shared_ptr<ObjectPool> pool = object->IsTokenObject() ? token_object_pool_
-      : session_object_pool_;
+      : GetSessionObjectPool();
   if (!pool->Insert(object.get()))
     return CKR_FUNCTION_FAILED;
   *new_key_handle = object.release()->handle();
@@ -589,38 +1207,23 @@ CK_RV SessionImpl::GenerateKeyPair(CK_MECHANISM_TYPE mechanism,
   if (modulus_bits < kMinRSAKeyBits || modulus_bits > kMaxRSAKeyBitsSW)
     return CKR_KEY_SIZE_RANGE;
   std::shared_ptr<ObjectPool> public_pool = (public_object->IsTokenObject() ?
-                             token_object_pool_ : session_object_pool_);
+                             token_object_pool_ : GetSessionObjectPool());
   std::shared_ptr<ObjectPool> private_pool = (private_object->IsTokenObject() ?
-                              token_object_pool_ : session_object_pool_);
-  // Check if we are able to back this key with the TPM.
-  // if (tpm_utility_ && tpm_utility_->IsTPMAvailable() &&
-  //     private_object->IsTokenObject() &&
-  //     modulus_bits <= kMaxRSAKeyBitsHW) {
-  //   string auth_data = GenerateRandomSoftware(kDefaultAuthDataBytes);
-  //   string key_blob;
-  //   int tpm_key_handle;
-  //   if (!tpm_utility_->GenerateKey(slot_id_,
-  //                                  modulus_bits,
-  //                                  public_exponent,
-  //                                  SecureBlob(auth_data.begin(),
-  //                                             auth_data.end()),
-  //                                  &key_blob,
-  //                                  &tpm_key_handle))
-  //     return CKR_FUNCTION_FAILED;
-  //   string modulus;
-  //   if (!tpm_utility_->GetPublicKey(tpm_key_handle, &public_exponent, &modulus))
-  //     return CKR_FUNCTION_FAILED;
-  //   public_object->SetAttributeString(CKA_MODULUS, modulus);
-  //   private_object->SetAttributeString(CKA_MODULUS, modulus);
-  //   private_object->SetAttributeString(kAuthDataAttribute, auth_data);
-  //   private_object->SetAttributeString(kKeyBlobAttribute, key_blob);
-  // } else {
-    if (!GenerateKeyPairSoftware(modulus_bits,
-                                 public_exponent,
-                                 public_object.get(),
-                                 private_object.get()))
-      return CKR_FUNCTION_FAILED;
-//  }
+                              token_object_pool_ : GetSessionObjectPool());
+  // Token key pairs live on the NetHSM, which only supports the default
+  // public exponent.
+  if (private_object->IsTokenObject() &&
+      public_exponent == string("\x01\x00\x01", 3)) {
+    return GenerateKeyPairNetHsm(modulus_bits,
+                                 private_object.get(),
+                                 new_public_key_handle,
+                                 new_private_key_handle);
+  }
+  if (!GenerateKeyPairSoftware(modulus_bits,
+                               public_exponent,
+                               public_object.get(),
+                               private_object.get()))
+    return CKR_FUNCTION_FAILED;
   public_object->SetAttributeInt(CKA_CLASS, CKO_PUBLIC_KEY);
   public_object->SetAttributeInt(CKA_KEY_TYPE, CKK_RSA);
   private_object->SetAttributeInt(CKA_CLASS, CKO_PRIVATE_KEY);
@@ -646,132 +1249,132 @@ CK_RV SessionImpl::GenerateKeyPair(CK_MECHANISM_TYPE mechanism,
   return CKR_OK;
 }
 
+CK_RV SessionImpl::GenerateKeyPairNetHsm(int modulus_bits,
+                                         const Object* private_object,
+                                         int* new_public_key_handle,
+                                         int* new_private_key_handle) {
+  // The NetHSM labels a key with its identifier, so a label in the template
+  // names the key unless it conflicts with CKA_ID.
+  string key_id;
+  if (private_object->IsAttributePresent(CKA_ID))
+    key_id = private_object->GetAttributeString(CKA_ID);
+  if (private_object->IsAttributePresent(CKA_LABEL)) {
+    const string label = private_object->GetAttributeString(CKA_LABEL);
+    if (!key_id.empty() && !label.empty() && label != key_id) {
+      LOG(ERROR) << "CKA_LABEL must match CKA_ID for a NetHSM key.";
+      return CKR_TEMPLATE_INCONSISTENT;
+    }
+    if (key_id.empty())
+      key_id = label;
+  }
+  bool for_signing = !private_object->GetAttributeBool(CKA_DECRYPT, false);
+  boost::optional<string> generated_id =
+      net_utility_->GenerateKeyPair(modulus_bits, key_id, for_signing);
+  if (!generated_id)
+    return CKR_FUNCTION_FAILED;
+  // The NetHSM utility has inserted both halves into the token pool.
+  if (!FindTokenKey(*generated_id, CKO_PUBLIC_KEY, new_public_key_handle) ||
+      !FindTokenKey(*generated_id, CKO_PRIVATE_KEY, new_private_key_handle)) {
+    LOG(ERROR) << "Generated key " << *generated_id << " was not loaded.";
+    return CKR_FUNCTION_FAILED;
+  }
+  return CKR_OK;
+}
+
+bool SessionImpl::FindTokenKey(const string& key_id,
+                               CK_OBJECT_CLASS object_class,
+                               int* handle) {
+  std::unique_ptr<Object> search_template(factory_->CreateObject());
+  CHECK(search_template.get());
+  search_template->SetAttributeString(CKA_ID, key_id);
+  search_template->SetAttributeInt(CKA_CLASS, object_class);
+  vector<const Object*> objects;
+  if (!token_object_pool_->Find(search_template.get(), &objects) ||
+      objects.empty())
+    return false;
+  *handle = objects[0]->handle();
+  return true;
+}
+
 CK_RV SessionImpl::SeedRandom(const string& seed) {
   RAND_seed(seed.data(), seed.length());
   return CKR_OK;
 }
 
 CK_RV SessionImpl::GenerateRandom(int num_bytes, string* random_data) {
-  *random_data = GenerateRandomSoftware(num_bytes);
+  if (!net_utility_->GenerateRandom(num_bytes, random_data))
+    *random_data = GenerateRandomSoftware(num_bytes);
   return CKR_OK;
 }
 
-void SessionImpl::WaitForPrivateObjects() {
-  std::unique_ptr<Object> all_private(factory_->CreateObject());
-  CHECK(all_private.get());
-  all_private->SetAttributeBool(CKA_PRIVATE, true);
-  vector<const Object*> found;
-  token_object_pool_->Find(all_private.get(), &found);
-}
-
 bool SessionImpl::IsValidKeyType(OperationType operation,
-                                 CK_MECHANISM_TYPE mechanism,
+                                 const MechanismDescriptor& descriptor,
                                  CK_OBJECT_CLASS object_class,
                                  CK_KEY_TYPE key_type) {
-  CK_KEY_TYPE expected_key_type = 0;
-  CK_OBJECT_CLASS expected_class = 0;
-  CK_OBJECT_CLASS asymmetric_class = CKO_PUBLIC_KEY;
-  if (operation == kSign || operation == kDecrypt)
-    asymmetric_class = CKO_PRIVATE_KEY;
-  switch (mechanism) {
-    case CKM_DES_ECB:
-    case CKM_DES_CBC:
-    case CKM_DES_CBC_PAD:
-      expected_key_type = CKK_DES;
-      expected_class = CKO_SECRET_KEY;
-      break;
-    case CKM_DES3_ECB:
-    case CKM_DES3_CBC:
-    case CKM_DES3_CBC_PAD:
-      expected_key_type = CKK_DES3;
-      expected_class = CKO_SECRET_KEY;
-      break;
-    case CKM_AES_ECB:
-    case CKM_AES_CBC:
-    case CKM_AES_CBC_PAD:
-      expected_key_type = CKK_AES;
-      expected_class = CKO_SECRET_KEY;
-      break;
-    case CKM_RSA_PKCS:
-    case CKM_MD5_RSA_PKCS:
-    case CKM_SHA1_RSA_PKCS:
-    case CKM_SHA256_RSA_PKCS:
-    case CKM_SHA384_RSA_PKCS:
-    case CKM_SHA512_RSA_PKCS:
-      expected_key_type = CKK_RSA;
-      expected_class = asymmetric_class;
-      break;
-    case CKM_MD5_HMAC:
-    case CKM_SHA_1_HMAC:
-    case CKM_SHA256_HMAC:
-    case CKM_SHA384_HMAC:
-    case CKM_SHA512_HMAC:
-      expected_key_type = CKK_GENERIC_SECRET;
-      expected_class = CKO_SECRET_KEY;
-      break;
-    default:
-      return false;
+  CK_OBJECT_CLASS expected_class = CKO_SECRET_KEY;
+  if (descriptor.IsRSA() || descriptor.IsECDSA()) {
+    expected_class = (operation == kSign || operation == kDecrypt) ?
+        CKO_PRIVATE_KEY : CKO_PUBLIC_KEY;
   }
-  return (key_type == expected_key_type &&
+  return (key_type == descriptor.key_type &&
           object_class == expected_class);
 }
 
-bool SessionImpl::IsValidMechanism(OperationType operation,
-                                   CK_MECHANISM_TYPE mechanism) {
-  if (operation == kEncrypt || operation == kDecrypt) {
-    switch (mechanism) {
-      case CKM_DES_ECB:
-      case CKM_DES_CBC:
-      case CKM_DES_CBC_PAD:
-      case CKM_DES3_ECB:
-      case CKM_DES3_CBC:
-      case CKM_DES3_CBC_PAD:
-      case CKM_AES_ECB:
-      case CKM_AES_CBC:
-      case CKM_AES_CBC_PAD:
-      case CKM_RSA_PKCS:
-        return true;
+CK_RV SessionImpl::CheckOperationKey(OperationType operation,
+                                     CK_MECHANISM_TYPE mechanism,
+                                     const Object* key,
+                                     const MechanismDescriptor** descriptor) {
+  *descriptor = GetMechanismDescriptor(mechanism);
+  if (!*descriptor || !(*descriptor)->Supports(operation)) {
+    LOG(ERROR) << "Mechanism not supported: 0x" << hex << mechanism;
+    return CKR_MECHANISM_INVALID;
+  }
+  if (operation == kDigest)
+    return CKR_OK;
+  // Make sure the key is valid for the mechanism.
+  CHECK(key);
+  if (!IsValidKeyType(operation,
+                      **descriptor,
+                      key->GetObjectClass(),
+                      key->GetAttributeInt(CKA_KEY_TYPE, -1))) {
+    LOG(ERROR) << "Key type mismatch.";
+    return CKR_KEY_TYPE_INCONSISTENT;
+  }
+  if (!key->GetAttributeBool(GetRequiredKeyUsage(operation), false)) {
+    LOG(ERROR) << "Key function not permitted.";
+    return CKR_KEY_FUNCTION_NOT_PERMITTED;
+  }
+  if ((*descriptor)->IsRSA()) {
+    int key_size = key->GetAttributeString(CKA_MODULUS).length() * 8;
+    if (key_size < kMinRSAKeyBits || key_size > kMaxRSAKeyBitsSW) {
+      LOG(ERROR) << "Key size not supported: " << key_size;
+      return CKR_KEY_SIZE_RANGE;
     }
-  } else if (operation == kSign || operation == kVerify) {
-    switch (mechanism) {
-      case CKM_RSA_PKCS:
-      case CKM_MD5_RSA_PKCS:
-      case CKM_SHA1_RSA_PKCS:
-      case CKM_SHA256_RSA_PKCS:
-      case CKM_SHA384_RSA_PKCS:
-      case CKM_SHA512_RSA_PKCS:
-      case CKM_MD5_HMAC:
-      case CKM_SHA_1_HMAC:
-      case CKM_SHA256_HMAC:
-      case CKM_SHA384_HMAC:
-      case CKM_SHA512_HMAC:
-        return true;
+  }
+  if ((*descriptor)->IsECDSA()) {
+    if (GetECOrderBytes(key) == 0) {
+      LOG(ERROR) << "Curve not supported.";
+      return CKR_KEY_SIZE_RANGE;
     }
-  } else {
-    switch (mechanism) {
-      case CKM_MD5:
-      case CKM_SHA_1:
-      case CKM_SHA256:
-      case CKM_SHA384:
-      case CKM_SHA512:
-        return true;
+    if (operation == kSign && !IsNetHsmKey(key)) {
+      LOG(ERROR) << "EC private keys are only supported on the NetHSM.";
+      return CKR_KEY_FUNCTION_NOT_PERMITTED;
     }
   }
-  return false;
+  return CKR_OK;
 }
 
 CK_RV SessionImpl::CipherInit(bool is_encrypt,
-                              CK_MECHANISM_TYPE mechanism,
+                              const MechanismDescriptor& descriptor,
                               const string& mechanism_parameter,
                               const Object* key) {
   OperationType operation = is_encrypt ? kEncrypt : kDecrypt;
-  EVP_CIPHER_CTX* context =
-      &operation_context_[operation].cipher_context_;
+  OperationContext* operation_context = GetOperationContext(operation);
+  EVP_CIPHER_CTX* context = &operation_context->cipher_context_;
   string key_material = key->GetAttributeString(CKA_VALUE);
-  const EVP_CIPHER* cipher_type = GetOpenSSLCipher(mechanism,
-                                                   key_material.size());
+  const EVP_CIPHER* cipher_type = descriptor.GetCipher(key_material.size());
   if (!cipher_type) {
-    LOG(ERROR) << "Mechanism not supported: 0x" << hex << mechanism;
+    LOG(ERROR) << "Mechanism not supported: 0x" << hex << descriptor.type;
     return CKR_MECHANISM_INVALID;
   }
   // The mechanism parameter is the IV for cipher modes which require an IV,
@@ -786,17 +1389,18 @@ CK_RV SessionImpl::CipherInit(bool is_encrypt,
     LOG(ERROR) << "Key size not supported: " << key_material.size();
     return CKR_KEY_SIZE_RANGE;
   }
-  if (!EVP_CipherInit(context,
-                      cipher_type,
-                      ConvertStringToByteBuffer(key_material.c_str()),
-                      ConvertStringToByteBuffer(mechanism_parameter.c_str()),
-                      is_encrypt)) {
+  if (!GetSecretKey(key)->InitCipher(cipher_type,
+                                     key_material,
+                                     mechanism_parameter,
+                                     is_encrypt,
+                                     context)) {
     LOG(ERROR) << "EVP_CipherInit failed: " << GetOpenSSLError();
+    EVP_CIPHER_CTX_cleanup(context);
     return CKR_FUNCTION_FAILED;
   }
-  EVP_CIPHER_CTX_set_padding(context, IsPaddingEnabled(mechanism));
-  operation_context_[operation].is_valid_ = true;
-  operation_context_[operation].is_cipher_ = true;
+  EVP_CIPHER_CTX_set_padding(context, descriptor.IsPaddingEnabled());
+  operation_context->is_valid_ = true;
+  operation_context->is_cipher_ = true;
   return CKR_OK;
 }
 
@@ -875,7 +1479,7 @@ CK_RV SessionImpl::CreateObjectInternal(const CK_ATTRIBUTE_PTR attributes,
     if (result != CKR_OK)
       return result;
   } else {
-    pool = session_object_pool_;
+    pool = GetSessionObjectPool();
   }
   if (!pool->Insert(object.get()))
     return CKR_GENERAL_ERROR;
@@ -935,23 +1539,6 @@ string SessionImpl::GenerateRandomSoftware(int num_bytes) {
   return random;
 }
 
-string SessionImpl::GetDERDigestInfo(CK_MECHANISM_TYPE mechanism) {
-  const EVP_MD* md = GetOpenSSLDigest(mechanism);
-  if (md == EVP_md5()) {
-    return GetDigestAlgorithmEncoding(DigestAlgorithm::MD5);
-  } else if (md == EVP_sha1()) {
-    return GetDigestAlgorithmEncoding(DigestAlgorithm::SHA1);
-  } else if (md == EVP_sha256()) {
-    return GetDigestAlgorithmEncoding(DigestAlgorithm::SHA256);
-  } else if (md == EVP_sha384()) {
-    return GetDigestAlgorithmEncoding(DigestAlgorithm::SHA384);
-  } else if (md == EVP_sha512()) {
-    return GetDigestAlgorithmEncoding(DigestAlgorithm::SHA512);
-  }
-  // This is valid in some cases (e.g. CKM_RSA_PKCS).
-  return string();
-}
-
 CK_RV SessionImpl::GetOperationOutput(OperationContext* context,
                                       int* required_out_length,
                                       string* data_out) {
@@ -960,11 +1547,55 @@ CK_RV SessionImpl::GetOperationOutput(OperationContext* context,
   *required_out_length = out_length;
   if (max_length < out_length)
     return CKR_BUFFER_TOO_SMALL;
-  *data_out = context->data_;
+  data_out->swap(context->data_);
   context->data_.clear();
   return CKR_OK;
 }
 
+bool SessionImpl::GetExpectedOutputLength(OperationType operation,
+                                          const OperationContext& context,
+                                          int* length,
+                                          bool* is_exact) {
+  *is_exact = true;
+  if (context.descriptor_->IsRSA()) {
+    if (operation != kEncrypt && operation != kDecrypt && operation != kSign)
+      return false;
+    *length = GetModulusBytes(context);
+    // PKCS #1 padding is stripped from decrypted data.
+    *is_exact = (operation != kDecrypt);
+    return *length > 0;
+  }
+  if (context.descriptor_->IsECDSA()) {
+    if (operation != kSign)
+      return false;
+    *length = 2 * (context.net_key_ ? context.net_key_->order_bytes()
+                                    : GetECOrderBytes(context.key_));
+    return *length > 0;
+  }
+  if (context.is_digest_ || context.is_hmac_) {
+    const EVP_MD* digest = context.descriptor_->GetDigest();
+    if (!digest)
+      return false;
+    *length = EVP_MD_size(digest);
+    return true;
+  }
+  return false;
+}
+
+bool SessionImpl::IsLengthQuery(OperationType operation,
+                                const OperationContext& context,
+                                int* required_out_length) {
+  int length = 0;
+  bool is_exact = false;
+  if (!GetExpectedOutputLength(operation, context, &length, &is_exact))
+    return false;
+  if (*required_out_length != 0 &&
+      (!is_exact || *required_out_length >= length))
+    return false;
+  *required_out_length = length;
+  return true;
+}
+
 CK_ATTRIBUTE_TYPE SessionImpl::GetRequiredKeyUsage(OperationType operation) {
   switch (operation) {
     case kEncrypt:
@@ -1055,41 +1686,6 @@ bool SessionImpl::LoadLegacyRootKeys() {
   // return true;
 }
 
-bool SessionImpl::IsHMAC(CK_MECHANISM_TYPE mechanism) {
-  switch (mechanism) {
-    case CKM_MD5_HMAC:
-    case CKM_SHA_1_HMAC:
-    case CKM_SHA256_HMAC:
-    case CKM_SHA384_HMAC:
-    case CKM_SHA512_HMAC:
-      return true;
-  }
-  return false;
-}
-
-bool SessionImpl::IsPaddingEnabled(CK_MECHANISM_TYPE mechanism) {
-  switch (mechanism) {
-    case CKM_DES_CBC_PAD:
-    case CKM_DES3_CBC_PAD:
-    case CKM_AES_CBC_PAD:
-      return true;
-  }
-  return false;
-}
-
-bool SessionImpl::IsRSA(CK_MECHANISM_TYPE mechanism) {
-  switch (mechanism) {
-    case CKM_RSA_PKCS:
-    case CKM_MD5_RSA_PKCS:
-    case CKM_SHA1_RSA_PKCS:
-    case CKM_SHA256_RSA_PKCS:
-    case CKM_SHA384_RSA_PKCS:
-    case CKM_SHA512_RSA_PKCS:
-      return true;
-  }
-  return false;
-}
-
 // Both PKCS #11 and OpenSSL use big-endian binary representations of big
 // integers.  To convert we can just use the OpenSSL converters.
 string SessionImpl::ConvertFromBIGNUM(const BIGNUM* bignum) {
@@ -1135,92 +1731,71 @@ RSA* SessionImpl::CreateKeyFromObject(const Object* key_object) {
   return rsa;
 }
 
-const EVP_CIPHER* SessionImpl::GetOpenSSLCipher(CK_MECHANISM_TYPE mechanism,
-                                                size_t key_size) {
-  switch (mechanism) {
-    case CKM_DES_ECB:
-      return EVP_des_ecb();
-    case CKM_DES_CBC:
-    case CKM_DES_CBC_PAD:
-      return EVP_des_cbc();
-    case CKM_DES3_ECB:
-      return EVP_des_ede3();
-    case CKM_DES3_CBC:
-    case CKM_DES3_CBC_PAD:
-      return EVP_des_ede3_cbc();
-    case CKM_AES_ECB:
-      switch (key_size) {
-        case 16:
-          return EVP_aes_128_ecb();
-        case 24:
-          return EVP_aes_192_ecb();
-        default:
-          return EVP_aes_256_ecb();
-      }
-      break;
-    case CKM_AES_CBC:
-    case CKM_AES_CBC_PAD:
-      switch (key_size) {
-        case 16:
-          return EVP_aes_128_cbc();
-        case 24:
-          return EVP_aes_192_cbc();
-        default:
-          return EVP_aes_256_cbc();
-      }
-      break;
-  }
-  return NULL;
+std::shared_ptr<RSA> SessionImpl::GetRSAKey(const Object* key_object) {
+  std::shared_ptr<const CachedKey> cached = key_object->GetCachedKey(
+      [this, key_object] {
+        return new CachedRSAKey(CreateKeyFromObject(key_object));
+      });
+  const CachedRSAKey* key = dynamic_cast<const CachedRSAKey*>(cached.get());
+  CHECK(key);
+  // Keep the cached key alive for as long as the caller uses it, even if the
+  // object changes in the meantime.
+  return std::shared_ptr<RSA>(cached, key->rsa());
 }
 
-const EVP_MD* SessionImpl::GetOpenSSLDigest(CK_MECHANISM_TYPE mechanism) {
-  switch (mechanism) {
-    case CKM_MD5:
-    case CKM_MD5_HMAC:
-    case CKM_MD5_RSA_PKCS:
-      return EVP_md5();
-    case CKM_SHA_1:
-    case CKM_SHA_1_HMAC:
-    case CKM_SHA1_RSA_PKCS:
-      return EVP_sha1();
-    case CKM_SHA256:
-    case CKM_SHA256_HMAC:
-    case CKM_SHA256_RSA_PKCS:
-      return EVP_sha256();
-    case CKM_SHA384:
-    case CKM_SHA384_HMAC:
-    case CKM_SHA384_RSA_PKCS:
-      return EVP_sha384();
-    case CKM_SHA512:
-    case CKM_SHA512_HMAC:
-    case CKM_SHA512_RSA_PKCS:
-      return EVP_sha512();
-  }
-  return NULL;
+std::shared_ptr<const CachedNetHsmKey> SessionImpl::GetNetHsmKey(
+    const Object* key_object) {
+  if (!IsNetHsmKey(key_object))
+    return std::shared_ptr<const CachedNetHsmKey>();
+  std::shared_ptr<const CachedNetHsmKey> key =
+      std::dynamic_pointer_cast<const CachedNetHsmKey>(
+          key_object->GetCachedKey([this, key_object] {
+            const bool is_ec =
+                key_object->GetAttributeInt(CKA_KEY_TYPE, -1) == CKK_EC;
+            return new CachedNetHsmKey(
+                key_object->GetAttributeString(kKeyLocationAttribute),
+                key_object->GetAttributeString(CKA_MODULUS).length(),
+                is_ec ? GetECOrderBytes(key_object) : 0);
+          }));
+  CHECK(key);
+  return key;
+}
+
+size_t SessionImpl::GetModulusBytes(const OperationContext& context) {
+  if (context.net_key_)
+    return context.net_key_->modulus_bytes();
+  return context.key_->GetAttributeString(CKA_MODULUS).length();
+}
+
+std::shared_ptr<const CachedSecretKey> SessionImpl::GetSecretKey(
+    const Object* key_object) {
+  std::shared_ptr<const CachedSecretKey> key =
+      std::dynamic_pointer_cast<const CachedSecretKey>(
+          key_object->GetCachedKey([] { return new CachedSecretKey(); }));
+  CHECK(key);
+  return key;
 }
 
 bool SessionImpl::RSADecrypt(OperationContext* context) {
-  if (context->key_->IsTokenObject() &&
-      context->key_->IsAttributePresent(kKeyLocationAttribute)) {
-    string encrypted_data = context->data_;
+  if (context->net_key_) {
+    auto decrypted = net_utility_->Decrypt(context->net_key_->target(),
+                                           context->data_, priority_);
     context->data_.clear();
-    string key_loc = context->key_->GetAttributeString(kKeyLocationAttribute);
-    if (auto decrypted = net_utility_->Decrypt(key_loc, encrypted_data)) {
-      context->data_ = *decrypted;
-    } else {
+    if (!decrypted) {
+      context->is_rejected_ = net_utility_->LastCallRejected();
       return false;
     }
+    context->data_.swap(*decrypted);
   } else {
-    RSA* rsa = CreateKeyFromObject(context->key_);
+    std::shared_ptr<RSA> rsa = GetRSAKey(context->key_);
     uint8_t buffer[kMaxRSAOutputBytes];
-    CHECK(RSA_size(rsa) <= kMaxRSAOutputBytes);
+    CHECK(RSA_size(rsa.get()) <= kMaxRSAOutputBytes);
     int length = RSA_private_decrypt(
         context->data_.length(),
         ConvertStringToByteBuffer(context->data_.data()),
         buffer,
-        rsa,
+        rsa.get(),
         RSA_PKCS1_PADDING);  // Strips PKCS #1 type 2 padding.
-    RSA_free(rsa);
     if (length == -1) {
       LOG(ERROR) << "RSA_private_decrypt failed: " << GetOpenSSLError();
       return false;
@@ -1231,16 +1806,15 @@ bool SessionImpl::RSADecrypt(OperationContext* context) {
 }
 
 bool SessionImpl::RSAEncrypt(OperationContext* context) {
-  RSA* rsa = CreateKeyFromObject(context->key_);
+  std::shared_ptr<RSA> rsa = GetRSAKey(context->key_);
   uint8_t buffer[kMaxRSAOutputBytes];
-  CHECK(RSA_size(rsa) <= kMaxRSAOutputBytes);
+  CHECK(RSA_size(rsa.get()) <= kMaxRSAOutputBytes);
   int length = RSA_public_encrypt(
       context->data_.length(),
       ConvertStringToByteBuffer(context->data_.data()),
       buffer,
-      rsa,
+      rsa.get(),
       RSA_PKCS1_PADDING);  // Adds PKCS #1 type 2 padding.
-  RSA_free(rsa);
   if (length == -1) {
     LOG(ERROR) << "RSA_public_encrypt failed: " << GetOpenSSLError();
     return false;
@@ -1250,35 +1824,36 @@ bool SessionImpl::RSAEncrypt(OperationContext* context) {
 }
 
 bool SessionImpl::RSASign(OperationContext* context) {
-  string data_to_sign = GetDERDigestInfo(context->mechanism_) + context->data_;
+  // Prefix the queued data with the DigestInfo in place.
+  string& data_to_sign = context->data_;
+  data_to_sign.insert(0, context->descriptor_->GetDERDigestInfo());
   string signature;
-  if (context->key_->IsTokenObject() &&
-      context->key_->IsAttributePresent(kKeyLocationAttribute)) {
+  if (context->net_key_) {
+    auto result = net_utility_->Sign(context->net_key_->target(), data_to_sign,
+                                     priority_);
     context->data_.clear();
-    string key_loc = context->key_->GetAttributeString(kKeyLocationAttribute);
-    if (auto result = net_utility_->Sign(key_loc, data_to_sign)) {
-      signature = *result;
-    } else {
+    if (!result) {
+      context->is_rejected_ = net_utility_->LastCallRejected();
       return false;
     }
+    signature.swap(*result);
   } else {
-    RSA* rsa = CreateKeyFromObject(context->key_);
-    CHECK(RSA_size(rsa) <= kMaxRSAOutputBytes);
+    std::shared_ptr<RSA> rsa = GetRSAKey(context->key_);
+    CHECK(RSA_size(rsa.get()) <= kMaxRSAOutputBytes);
     uint8_t buffer[kMaxRSAOutputBytes];
     int length = RSA_private_encrypt(
         data_to_sign.length(),
         ConvertStringToByteBuffer(data_to_sign.data()),
         buffer,
-        rsa,
+        rsa.get(),
         RSA_PKCS1_PADDING);  // Adds PKCS #1 type 1 padding.
-    RSA_free(rsa);
     if (length == -1) {
       LOG(ERROR) << "RSA_private_encrypt failed: " << GetOpenSSLError();
       return false;
     }
     signature = string(reinterpret_cast<char*>(buffer), length);
   }
-  context->data_ = signature;
+  context->data_.swap(signature);
   return true;
 }
 
@@ -1288,27 +1863,110 @@ CK_RV SessionImpl::RSAVerify(OperationContext* context,
   if (context->key_->GetAttributeString(CKA_MODULUS).length() !=
       signature.length())
     return CKR_SIGNATURE_LEN_RANGE;
-  RSA* rsa = CreateKeyFromObject(context->key_);
-  CHECK(RSA_size(rsa) <= kMaxRSAOutputBytes);
+  std::shared_ptr<RSA> rsa = GetRSAKey(context->key_);
+  CHECK(RSA_size(rsa.get()) <= kMaxRSAOutputBytes);
   uint8_t buffer[kMaxRSAOutputBytes];
   int length = RSA_public_decrypt(
       signature.length(),
       ConvertStringToByteBuffer(signature.data()),
       buffer,
-      rsa,
+      rsa.get(),
       RSA_PKCS1_PADDING);  // Strips PKCS #1 type 1 padding.
-  RSA_free(rsa);
   if (length == -1) {
     LOG(ERROR) << "RSA_public_decrypt failed: " << GetOpenSSLError();
     return CKR_SIGNATURE_INVALID;
   }
-  string signed_data = GetDERDigestInfo(context->mechanism_) + digest;
+  string signed_data = context->descriptor_->GetDERDigestInfo() + digest;
   if (static_cast<size_t>(length) != signed_data.length() ||
       0 != brillo::SecureMemcmp(buffer, signed_data.data(), length))
     return CKR_SIGNATURE_INVALID;
   return CKR_OK;
 }
 
+int SessionImpl::GetECOrderBytes(const Object* key) {
+  int curve_nid = GetECCurve(key->GetAttributeString(CKA_EC_PARAMS));
+  switch (curve_nid) {
+    case NID_X9_62_prime256v1:
+    case NID_secp384r1:
+    case NID_secp521r1:
+      break;
+    default:
+      return 0;
+  }
+  EC_GROUP* group = EC_GROUP_new_by_curve_name(curve_nid);
+  CHECK(group);
+  int order_bytes = (EC_GROUP_get_degree(group) + 7) / 8;
+  EC_GROUP_free(group);
+  return order_bytes;
+}
+
+bool SessionImpl::ECDSASign(OperationContext* context) {
+  CHECK(context->net_key_);
+  auto result = net_utility_->ECDSASign(context->net_key_->target(),
+                                        context->data_, priority_);
+  context->data_.clear();
+  if (!result) {
+    context->is_rejected_ = net_utility_->LastCallRejected();
+    return false;
+  }
+  // The NetHSM returns a DER-encoded ECDSA-Sig-Value; PKCS #11 wants r and s
+  // concatenated, each padded to the length of the curve order.
+  const int order_bytes = context->net_key_->order_bytes();
+  const unsigned char* buffer = ConvertStringToByteBuffer(result->data());
+  ECDSA_SIG* sig = d2i_ECDSA_SIG(NULL, &buffer, result->length());
+  if (!sig) {
+    LOG(ERROR) << "Malformed ECDSA signature: " << GetOpenSSLError();
+    return false;
+  }
+  bool success = (BN_num_bytes(sig->r) <= order_bytes &&
+                  BN_num_bytes(sig->s) <= order_bytes);
+  if (success) {
+    string signature(2 * order_bytes, 0);
+    uint8_t* out = ConvertStringToByteBuffer(signature.data());
+    BN_bn2bin(sig->r, out + order_bytes - BN_num_bytes(sig->r));
+    BN_bn2bin(sig->s, out + 2 * order_bytes - BN_num_bytes(sig->s));
+    context->data_.swap(signature);
+  } else {
+    LOG(ERROR) << "ECDSA signature exceeds the curve order.";
+  }
+  ECDSA_SIG_free(sig);
+  return success;
+}
+
+CK_RV SessionImpl::ECDSAVerify(OperationContext* context,
+                               const string& digest,
+                               const string& signature) {
+  const int order_bytes = GetECOrderBytes(context->key_);
+  if (signature.length() != static_cast<size_t>(2 * order_bytes))
+    return CKR_SIGNATURE_LEN_RANGE;
+  string point = DecodeECPoint(context->key_->GetAttributeString(CKA_EC_POINT));
+  std::unique_ptr<EC_KEY, void (*)(EC_KEY*)> ec_key(
+      EC_KEY_new_by_curve_name(
+          GetECCurve(context->key_->GetAttributeString(CKA_EC_PARAMS))),
+      EC_KEY_free);
+  CHECK(ec_key);
+  const EC_GROUP* group = EC_KEY_get0_group(ec_key.get());
+  std::unique_ptr<EC_POINT, void (*)(EC_POINT*)> public_point(
+      EC_POINT_new(group), EC_POINT_free);
+  CHECK(public_point);
+  if (!EC_POINT_oct2point(group, public_point.get(),
+                          ConvertStringToByteBuffer(point.data()),
+                          point.length(), NULL) ||
+      !EC_KEY_set_public_key(ec_key.get(), public_point.get())) {
+    LOG(ERROR) << "Invalid EC public key: " << GetOpenSSLError();
+    return CKR_KEY_HANDLE_INVALID;
+  }
+  ECDSA_SIG* sig = ECDSA_SIG_new();
+  CHECK(sig);
+  const uint8_t* in = ConvertStringToByteBuffer(signature.data());
+  BN_bin2bn(in, order_bytes, sig->r);
+  BN_bin2bn(in + order_bytes, order_bytes, sig->s);
+  int verified = ECDSA_do_verify(ConvertStringToByteBuffer(digest.data()),
+                                 digest.length(), sig, ec_key.get());
+  ECDSA_SIG_free(sig);
+  return (verified == 1) ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
 CK_RV SessionImpl::WrapPrivateKey(Object* object) {
   // if (!tpm_utility_ || !tpm_utility_->IsTPMAvailable() ||
   //     object->GetObjectClass() != CKO_PRIVATE_KEY ||
@@ -1361,7 +2019,9 @@ SessionImpl::OperationContext::OperationContext() : is_valid_(false),
                                                     is_digest_(false),
                                                     is_hmac_(false),
                                                     is_finished_(false),
-                                                    key_(NULL) {}
+                                                    is_rejected_(false),
+                                                    key_(NULL),
+                                                    descriptor_(NULL) {}
 
 SessionImpl::OperationContext::~OperationContext() {
   Clear();
@@ -1383,7 +2043,11 @@ void SessionImpl::OperationContext::Clear() {
   is_hmac_ = false;
   is_incremental_ = false;
   is_finished_ = false;
+  is_rejected_ = false;
   key_ = NULL;
+  key_ref_.reset();
+  net_key_.reset();
+  descriptor_ = NULL;
   data_.clear();
   parameter_.clear();
 }
@@ -15,6 +15,7 @@
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#include "mechanism_descriptor.h"
 #include "p11net_factory.h"
 #include "object.h"
 #include "object_pool.h"
@@ -23,6 +24,8 @@
 
 namespace p11net {
 
+class CachedNetHsmKey;
+class CachedSecretKey;
 class P11NetFactory;
 class ObjectPool;
 class NetUtility;
@@ -46,11 +49,26 @@ class SessionImpl : public Session {
               bool is_read_only);
   virtual ~SessionImpl();
 
+  // Rebinds a recycled session to the given slot, as if it were constructed
+  // with these arguments.
+  void Reset(int slot_id,
+             std::shared_ptr<ObjectPool> token_object_pool,
+             std::shared_ptr<NetUtility> net_utility,
+             std::shared_ptr<P11NetFactory> factory,
+             std::shared_ptr<HandleGenerator> handle_generator,
+             bool is_read_only);
+  // Discards the state of a closed session, including its session objects,
+  // so that it can be Reset for another one. The operation contexts are kept.
+  void Recycle();
+
   // General state management.
   virtual int GetSlot() const;
   virtual CK_STATE GetState() const;
   virtual bool IsReadOnly() const;
   virtual bool IsOperationActive(OperationType type) const;
+  virtual size_t GetMemoryUsage();
+  virtual RequestPriority GetPriority() const;
+  virtual void SetPriority(RequestPriority priority);
   // Object management.
   virtual CK_RV CreateObject(const CK_ATTRIBUTE_PTR attributes,
                              int num_attributes,
@@ -61,6 +79,7 @@ class SessionImpl : public Session {
                            int* new_object_handle);
   virtual CK_RV DestroyObject(int object_handle);
   virtual bool GetObject(int object_handle, const Object** object);
+  virtual bool LoadObjectValue(int object_handle);
   virtual bool GetModifiableObject(int object_handle, Object** object);
   virtual bool FlushModifiableObject(Object* object);
   virtual CK_RV FindObjectsInit(const CK_ATTRIBUTE_PTR attributes,
@@ -86,6 +105,23 @@ class SessionImpl : public Session {
                                     const std::string& data_in,
                                     int* required_out_length,
                                     std::string* data_out);
+  virtual CK_RV OperationSinglePartToBuffer(OperationType operation,
+                                            const std::string& data_in,
+                                            uint8_t* data_out,
+                                            int* data_out_length);
+  virtual CK_RV OperationBatch(OperationType operation,
+                               CK_MECHANISM_TYPE mechanism,
+                               const std::string& mechanism_parameter,
+                               const Object* key,
+                               const std::vector<std::string>& inputs,
+                               std::vector<std::string>* outputs,
+                               std::vector<CK_RV>* results);
+  virtual CK_RV OperationAsync(OperationType operation,
+                               CK_MECHANISM_TYPE mechanism,
+                               const std::string& mechanism_parameter,
+                               const Object* key,
+                               const std::string& data_in,
+                               const OperationCallback& callback);
   // Key generation.
   virtual CK_RV GenerateKey(CK_MECHANISM_TYPE mechanism,
                             const std::string& mechanism_parameter,
@@ -103,8 +139,6 @@ class SessionImpl : public Session {
   // Random number generation.
   virtual CK_RV SeedRandom(const std::string& seed);
   virtual CK_RV GenerateRandom(int num_bytes, std::string* random_data);
-  // Waits for private objects to be loaded before returning.
-  virtual void WaitForPrivateObjects();
 
  private:
   struct OperationContext {
@@ -114,6 +148,7 @@ class SessionImpl : public Session {
     bool is_hmac_;  // Set to true when hmac_context_ is valid.
     bool is_incremental_;  // Set when an incremental operation is performed.
     bool is_finished_;  // Set to true when the operation completes.
+    bool is_rejected_;  // Set when the NetHSM was at its request limit.
     union {
       EVP_CIPHER_CTX cipher_context_;
       EVP_MD_CTX digest_context_;
@@ -121,7 +156,14 @@ class SessionImpl : public Session {
     };
     std::string data_;  // This can be used to queue input or output.
     const Object* key_;
+    // Keeps key_ alive should it leave its pool during the operation, e.g.
+    // because its NetHSM key is evicted. NULL for keys outside the pools.
+    std::shared_ptr<const Object> key_ref_;
+    // The NetHSM side of key_, if the NetHSM performs the operation.
+    std::shared_ptr<const CachedNetHsmKey> net_key_;
     CK_MECHANISM_TYPE mechanism_;
+    // The descriptor of mechanism_, resolved when the operation starts.
+    const MechanismDescriptor* descriptor_;
     std::string parameter_;  // The mechanism parameter (if any).
 
     OperationContext();
@@ -130,11 +172,59 @@ class SessionImpl : public Session {
     void Clear();
   };
 
+  // Reports the session state to the memory gauge when it goes out of scope.
+  class ScopedMemoryReport {
+   public:
+    explicit ScopedMemoryReport(SessionImpl* session) : session_(session) {}
+    ~ScopedMemoryReport() { session_->ReportMemoryUsage(); }
+
+   private:
+    SessionImpl* session_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedMemoryReport);
+  };
+
+  // Returns the bytes held by the operation contexts and the search beyond
+  // the size of the session itself.
+  size_t GetStateBytes() const;
+  // Brings the session's share of p11net_session_state_bytes up to date.
+  void ReportMemoryUsage();
+
   bool IsValidKeyType(OperationType operation,
-                      CK_MECHANISM_TYPE mechanism,
+                      const MechanismDescriptor& descriptor,
                       CK_OBJECT_CLASS object_class,
                       CK_KEY_TYPE key_type);
-  bool IsValidMechanism(OperationType operation, CK_MECHANISM_TYPE mechanism);
+  // Checks that the mechanism is supported for the operation and that the
+  // key may be used with it. On success 'descriptor' holds the descriptor of
+  // the mechanism.
+  CK_RV CheckOperationKey(OperationType operation,
+                          CK_MECHANISM_TYPE mechanism,
+                          const Object* key,
+                          const MechanismDescriptor** descriptor);
+  // Returns true if operations with the key are performed by the NetHSM.
+  bool IsNetHsmKey(const Object* key) const;
+  // Checks a batch or asynchronous operation and brings its inputs into the
+  // form the RSA operations take. An input that cannot be used gets its error
+  // in 'results'.
+  CK_RV PrepareOperationInputs(OperationType operation,
+                               CK_MECHANISM_TYPE mechanism,
+                               const Object* key,
+                               const MechanismDescriptor** descriptor,
+                               const std::vector<std::string>& inputs,
+                               std::vector<std::string>* data,
+                               std::vector<CK_RV>* results);
+  // Signs or decrypts a prepared input with a software key in place.
+  bool SoftwareOperation(OperationType operation,
+                         const MechanismDescriptor* descriptor,
+                         const Object* key,
+                         std::string* data);
+  // Sends the prepared inputs of a batch to the NetHSM together and collects
+  // the outputs. Inputs whose result is already set are skipped.
+  void NetHsmOperationBatch(OperationType operation,
+                            const std::shared_ptr<const KeyTarget>& key,
+                            const std::vector<std::string>& inputs,
+                            std::vector<std::string>* outputs,
+                            std::vector<CK_RV>* results);
   CK_RV OperationUpdateInternal(OperationType operation,
                                 const std::string& data_in,
                                 int* required_out_length,
@@ -142,8 +232,12 @@ class SessionImpl : public Session {
   CK_RV OperationFinalInternal(OperationType operation,
                                int* required_out_length,
                                std::string* data_out);
+  // Digests the message of a single-part operation with MultiDigest instead
+  // of the EVP context, leaving the digest in the context's data.
+  CK_RV MultiDigestUpdate(OperationContext* context,
+                          const std::string& data_in);
   CK_RV CipherInit(bool is_encrypt,
-                   CK_MECHANISM_TYPE mechanism,
+                   const MechanismDescriptor& descriptor,
                    const std::string& mechanism_parameter,
                    const Object* key);
   CK_RV CipherUpdate(OperationContext* context,
@@ -160,8 +254,18 @@ class SessionImpl : public Session {
                                const std::string& public_exponent,
                                Object* public_object,
                                Object* private_object);
+  // Generates a token key pair on the NetHSM. Only the key identifier, or the
+  // label in its place, and usage are taken from the template; the NetHSM
+  // defines the other attributes.
+  CK_RV GenerateKeyPairNetHsm(int modulus_bits,
+                              const Object* private_object,
+                              int* new_public_key_handle,
+                              int* new_private_key_handle);
+  // Finds the handle of the token object of the given class for a NetHSM key.
+  bool FindTokenKey(const std::string& key_id,
+                    CK_OBJECT_CLASS object_class,
+                    int* handle);
   std::string GenerateRandomSoftware(int num_bytes);
-  std::string GetDERDigestInfo(CK_MECHANISM_TYPE mechanism);
   // Provides operation output and handles the buffer-too-small case.
   // The output data must be in context->data_.
   // required_out_length - In: The maximum number of bytes that can be received.
@@ -170,21 +274,40 @@ class SessionImpl : public Session {
   CK_RV GetOperationOutput(OperationContext* context,
                            int* required_out_length,
                            std::string* data_out);
+  // Determines the output length of an operation that has not run yet. Returns
+  // false if it is not known in advance, as for ciphers. 'is_exact' is false if
+  // 'length' is only an upper bound (as for RSA decryption).
+  bool GetExpectedOutputLength(OperationType operation,
+                               const OperationContext& context,
+                               int* length,
+                               bool* is_exact);
+  // Returns true, and sets 'required_out_length', if the caller's buffer cannot
+  // hold the output of the operation. This answers length queries without
+  // running the operation, which for token keys is a NetHSM request; the
+  // operation runs once the caller provides a buffer. Buffers of zero length
+  // are always treated as a query.
+  bool IsLengthQuery(OperationType operation,
+                     const OperationContext& context,
+                     int* required_out_length);
   // Returns the key usage flag that must be set in order to perform the given
   // operation (e.g. kEncrypt requires CKA_ENCRYPT to be TRUE).
   CK_ATTRIBUTE_TYPE GetRequiredKeyUsage(OperationType operation);
   bool GetTPMKeyHandle(const Object* key, int* key_handle);
   bool LoadLegacyRootKeys();
-  bool IsHMAC(CK_MECHANISM_TYPE mechanism);
-  // Returns true if the given cipher mechanism uses padding.
-  bool IsPaddingEnabled(CK_MECHANISM_TYPE mechanism);
-  bool IsRSA(CK_MECHANISM_TYPE mechanism);
   bool RSAEncrypt(OperationContext* context);
   bool RSADecrypt(OperationContext* context);
   bool RSASign(OperationContext* context);
   CK_RV RSAVerify(OperationContext* context,
                   const std::string& digest,
                   const std::string& signature);
+  // Returns the length of the curve order of an EC key in bytes, or zero if
+  // its curve is not supported. ECDSA signatures are twice as long.
+  int GetECOrderBytes(const Object* key);
+  // Signs on the NetHSM; EC private keys are never held in software.
+  bool ECDSASign(OperationContext* context);
+  CK_RV ECDSAVerify(OperationContext* context,
+                    const std::string& digest,
+                    const std::string& signature);
   // Wraps the given private key using the TPM and deletes all sensitive
   // attributes. This is called when a private key is imported. On success,
   // the private key can only be accessed by the TPM.
@@ -196,24 +319,53 @@ class SessionImpl : public Session {
   BIGNUM* ConvertToBIGNUM(const std::string& big_integer);
   // Always returns a non-NULL value.
   RSA* CreateKeyFromObject(const Object* key_object);
-  const EVP_CIPHER* GetOpenSSLCipher(CK_MECHANISM_TYPE mechanism,
-                                     size_t key_size);
-  const EVP_MD* GetOpenSSLDigest(CK_MECHANISM_TYPE mechanism);
+  // Returns the key cached on the given object, building it on first use. The
+  // key is shared read-only by all sessions until the object changes.
+  std::shared_ptr<RSA> GetRSAKey(const Object* key_object);
+  // Returns the NetHSM side of the given key object, resolving it on first
+  // use, or NULL if the key is not on the NetHSM.
+  std::shared_ptr<const CachedNetHsmKey> GetNetHsmKey(
+      const Object* key_object);
+  // Returns the length of the RSA modulus of the operation's key.
+  size_t GetModulusBytes(const OperationContext& context);
+  // Returns the keyed cipher and HMAC contexts cached on the given secret key.
+  std::shared_ptr<const CachedSecretKey> GetSecretKey(
+      const Object* key_object);
+  // Returns a reference that keeps 'object' alive after it leaves its pool,
+  // or NULL if it is in neither pool of the session.
+  std::shared_ptr<const Object> PinObject(const Object* object);
+  // Returns the context of 'operation', creating the contexts if needed.
+  OperationContext* GetOperationContext(OperationType operation);
+  // Returns the session object pool, creating it if needed.
+  std::shared_ptr<ObjectPool> GetSessionObjectPool();
+  // Removes the state of the session from the memory metrics.
+  void RecordMemoryUsage();
 
   std::shared_ptr<P11NetFactory> factory_;
-  std::vector<int> find_results_;
-  size_t find_results_offset_;
+  // The state of the active search: the template, the pools left to search
+  // and the handle of the last object returned from the current pool.
+  std::unique_ptr<Object> find_template_;
+  std::vector<std::shared_ptr<ObjectPool>> find_pools_;
+  size_t find_pool_index_;
+  int find_last_handle_;
   bool find_results_valid_;
   bool is_read_only_;
   std::map<const Object*, int> object_tpm_handle_map_;
-  OperationContext operation_context_[kNumOperationTypes];
+  // kNumOperationTypes contexts, created by the first operation.
+  std::unique_ptr<OperationContext[]> operation_context_;
   int slot_id_;
+  // Created along with the first session object.
   std::shared_ptr<ObjectPool> session_object_pool_;
+  std::shared_ptr<HandleGenerator> handle_generator_;
   std::shared_ptr<ObjectPool> token_object_pool_;
   std::shared_ptr<NetUtility> net_utility_;
+  RequestPriority priority_;
   bool is_legacy_loaded_;  // Tracks whether the legacy root keys are loaded.
   int private_root_key_;  // The legacy private root key.
   int public_root_key_;  // The legacy public root key.
+  // The state bytes last reported to the gauge, and the most ever reported.
+  size_t reported_state_bytes_;
+  size_t peak_state_bytes_;
 
   DISALLOW_COPY_AND_ASSIGN(SessionImpl);
 };
@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "session_table.h"
+
+#include <boost/thread/locks.hpp>
+
+#include "session.h"
+
+using std::shared_ptr;
+using std::vector;
+
+namespace p11net {
+
+const size_t SessionTable::kNumShards;
+
+SessionTable::SessionTable() {}
+
+SessionTable::~SessionTable() {}
+
+void SessionTable::Insert(int session_id,
+                          int slot_id,
+                          const brillo::SecureBlob& isolate_credential,
+                          const shared_ptr<Session>& session) {
+  // Declared before the lock so that a replaced session is destroyed after
+  // the lock is released.
+  shared_ptr<Session> replaced;
+  Shard& shard = GetShard(session_id);
+  boost::unique_lock<boost::shared_mutex> lock(shard.lock);
+  Entry& entry = shard.sessions[session_id];
+  replaced.swap(entry.session);
+  entry.slot_id = slot_id;
+  entry.isolate_credential = isolate_credential;
+  entry.session = session;
+}
+
+bool SessionTable::Find(int session_id,
+                        const brillo::SecureBlob& isolate_credential,
+                        int* slot_id,
+                        Session** session) const {
+  const Shard& shard = GetShard(session_id);
+  boost::shared_lock<boost::shared_mutex> lock(shard.lock);
+  std::unordered_map<int, Entry>::const_iterator it =
+      shard.sessions.find(session_id);
+  if (it == shard.sessions.end() ||
+      it->second.isolate_credential != isolate_credential)
+    return false;
+  if (slot_id)
+    *slot_id = it->second.slot_id;
+  if (session)
+    *session = it->second.session.get();
+  return true;
+}
+
+bool SessionTable::Erase(int session_id) {
+  // Destroyed after the lock is released, like in Insert.
+  shared_ptr<Session> removed;
+  Shard& shard = GetShard(session_id);
+  boost::unique_lock<boost::shared_mutex> lock(shard.lock);
+  std::unordered_map<int, Entry>::iterator it =
+      shard.sessions.find(session_id);
+  if (it == shard.sessions.end())
+    return false;
+  removed.swap(it->second.session);
+  shard.sessions.erase(it);
+  return true;
+}
+
+void SessionTable::EraseSlot(int slot_id) {
+  // Destroyed once all shards are unlocked.
+  vector<shared_ptr<Session>> removed;
+  for (size_t i = 0; i < kNumShards; ++i) {
+    Shard& shard = shards_[i];
+    boost::unique_lock<boost::shared_mutex> lock(shard.lock);
+    std::unordered_map<int, Entry>::iterator it = shard.sessions.begin();
+    while (it != shard.sessions.end()) {
+      if (it->second.slot_id == slot_id) {
+        removed.push_back(it->second.session);
+        it = shard.sessions.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+}  // namespace p11net
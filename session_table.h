@@ -0,0 +1,76 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_SESSION_TABLE_H_
+#define P11NET_SESSION_TABLE_H_
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace p11net {
+
+class Session;
+
+// SessionTable maps session handles to their sessions and slots. It is
+// thread-safe. Handles are spread over a fixed number of shards, each with its
+// own reader-writer lock, so lookups from different threads only share a lock
+// in read mode and opening or closing a session blocks one shard at most. The
+// table owns its sessions.
+// Each session records the isolate that opened it. A token belongs to a single
+// isolate and unloading it closes its sessions, so a session found under the
+// caller's isolate credential is accessible without consulting the isolates.
+class SessionTable {
+ public:
+  SessionTable();
+  virtual ~SessionTable();
+
+  // Adds 'session' under 'session_id', replacing any session already there.
+  void Insert(int session_id,
+              int slot_id,
+              const brillo::SecureBlob& isolate_credential,
+              const std::shared_ptr<Session>& session);
+  // Looks up a session opened through the given isolate. Either output may be
+  // NULL. Returns false if there is no such session.
+  bool Find(int session_id,
+            const brillo::SecureBlob& isolate_credential,
+            int* slot_id,
+            Session** session) const;
+  // Removes a session. Returns false if there was none.
+  bool Erase(int session_id);
+  // Removes all sessions of the given slot.
+  void EraseSlot(int slot_id);
+
+ private:
+  struct Entry {
+    int slot_id;
+    brillo::SecureBlob isolate_credential;
+    std::shared_ptr<Session> session;
+  };
+  struct Shard {
+    mutable boost::shared_mutex lock;
+    std::unordered_map<int, Entry> sessions;
+  };
+  static const size_t kNumShards = 16;
+
+  Shard& GetShard(int session_id) {
+    return shards_[static_cast<size_t>(session_id) % kNumShards];
+  }
+  const Shard& GetShard(int session_id) const {
+    return shards_[static_cast<size_t>(session_id) % kNumShards];
+  }
+
+  Shard shards_[kNumShards];
+
+  DISALLOW_COPY_AND_ASSIGN(SessionTable);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_SESSION_TABLE_H_
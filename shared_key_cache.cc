@@ -0,0 +1,169 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "shared_key_cache.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+
+#include <base/logging.h>
+
+namespace p11net {
+
+namespace {
+
+// A reader gives up after this many attempts that overlapped a publication.
+const int kMaxReadAttempts = 100;
+
+}  // namespace
+
+// The segment starts with this header and continues with the blob. A new
+// segment is zero-filled, which reads as "nothing published".
+struct SharedKeyCache::Header {
+  // Odd while the writer is publishing, zero before the first publication.
+  std::atomic<uint64_t> sequence;
+  uint64_t size;
+};
+
+SharedKeyCache::SharedKeyCache(const std::string& name, size_t capacity)
+    : name_(name),
+      capacity_(capacity),
+      fd_(-1),
+      segment_(MAP_FAILED),
+      owner_pid_(0),
+      is_writer_(false) {}
+
+SharedKeyCache::~SharedKeyCache() {
+  if (segment_ != MAP_FAILED)
+    munmap(segment_, capacity_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool SharedKeyCache::Open() {
+  if (capacity_ <= sizeof(Header)) {
+    LOG(ERROR) << "Shared key cache " << name_ << " is too small.";
+    return false;
+  }
+  if (!OpenDescriptor())
+    return false;
+  struct stat info;
+  if (fstat(fd_, &info) != 0) {
+    PLOG(ERROR) << "Failed to inspect shared key cache " << name_;
+    return false;
+  }
+  // Processes configured with a different size use the existing segment.
+  if (info.st_size == 0) {
+    if (ftruncate(fd_, capacity_) != 0) {
+      PLOG(ERROR) << "Failed to size shared key cache " << name_;
+      return false;
+    }
+  } else {
+    capacity_ = info.st_size;
+  }
+  if (capacity_ <= sizeof(Header)) {
+    LOG(ERROR) << "Shared key cache " << name_ << " is too small.";
+    return false;
+  }
+  segment_ = mmap(NULL, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (segment_ == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map shared key cache " << name_;
+    return false;
+  }
+  return true;
+}
+
+bool SharedKeyCache::OpenDescriptor() {
+  if (fd_ >= 0)
+    close(fd_);
+  // Only the user running the module may read or replace the inventory.
+  fd_ = shm_open(name_.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Failed to open shared key cache " << name_;
+    return false;
+  }
+  fcntl(fd_, F_SETFD, FD_CLOEXEC);
+  owner_pid_ = getpid();
+  is_writer_ = false;
+  return true;
+}
+
+bool SharedKeyCache::TryBecomeWriter() {
+  if (segment_ == MAP_FAILED)
+    return false;
+  // A forked child shares the lock of its parent's descriptor; it competes
+  // for the role with a descriptor of its own.
+  if (owner_pid_ != getpid() && !OpenDescriptor())
+    return false;
+  if (is_writer_)
+    return true;
+  if (flock(fd_, LOCK_EX | LOCK_NB) != 0)
+    return false;
+  LOG(INFO) << "Process " << owner_pid_ << " maintains shared key cache "
+            << name_;
+  is_writer_ = true;
+  return true;
+}
+
+bool SharedKeyCache::Publish(const std::string& blob) {
+  CHECK(is_writer_);
+  if (blob.size() > capacity_ - sizeof(Header)) {
+    LOG(WARNING) << "Key inventory of " << blob.size()
+                 << " bytes does not fit shared key cache " << name_;
+    return false;
+  }
+  Header* h = header();
+  // A writer that died while publishing left the sequence odd.
+  uint64_t sequence = h->sequence.load(std::memory_order_relaxed);
+  sequence += (sequence & 1) ? 2 : 1;
+  h->sequence.store(sequence, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(data(), blob.data(), blob.size());
+  h->size = blob.size();
+  h->sequence.store(sequence + 1, std::memory_order_release);
+  return true;
+}
+
+bool SharedKeyCache::Read(uint64_t* sequence, std::string* blob) const {
+  if (segment_ == MAP_FAILED)
+    return false;
+  const Header* h = header();
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    const uint64_t begin = h->sequence.load(std::memory_order_acquire);
+    if (begin == 0)
+      return false;
+    if (begin & 1) {
+      sched_yield();
+      continue;
+    }
+    const uint64_t size = h->size;
+    if (size > capacity_ - sizeof(Header))
+      continue;
+    blob->assign(data(), size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->sequence.load(std::memory_order_relaxed) == begin) {
+      *sequence = begin;
+      return true;
+    }
+  }
+  LOG(WARNING) << "Shared key cache " << name_ << " kept changing while read.";
+  return false;
+}
+
+SharedKeyCache::Header* SharedKeyCache::header() const {
+  return static_cast<Header*>(segment_);
+}
+
+char* SharedKeyCache::data() const {
+  return static_cast<char*>(segment_) + sizeof(Header);
+}
+
+}  // namespace p11net
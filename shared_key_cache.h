@@ -0,0 +1,75 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_SHARED_KEY_CACHE_H_
+#define P11NET_SHARED_KEY_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include <base/macros.h>
+
+namespace p11net {
+
+// SharedKeyCache publishes a serialized key inventory to other processes
+// through a named shared memory segment. One process at a time is the
+// writer: it holds an exclusive lock on the segment, refreshes the inventory
+// from the NetHSM and publishes it. The other processes only read the
+// segment, so the NetHSM sees the inventory traffic of a single process.
+// When the writer exits, its lock is released and the next process that
+// tries becomes the writer. Sample usage:
+//    SharedKeyCache cache("/p11net-keys", 4 << 20);
+//    if (cache.Open() && cache.TryBecomeWriter())
+//      cache.Publish(blob);
+//    uint64_t sequence;
+//    std::string blob;
+//    if (cache.Read(&sequence, &blob)) { ... }
+class SharedKeyCache {
+ public:
+  //  name - The shm_open name of the segment, e.g. "/p11net-keys".
+  //  capacity - The size of the segment in bytes, including its header.
+  SharedKeyCache(const std::string& name, size_t capacity);
+  virtual ~SharedKeyCache();
+
+  // Creates or maps the segment. Returns true on success.
+  bool Open();
+
+  // Returns true if this process is the writer, taking over the role if no
+  // other process holds it.
+  bool TryBecomeWriter();
+
+  // Replaces the published blob. Only the writer may call this. Returns false
+  // if the blob does not fit.
+  bool Publish(const std::string& blob);
+
+  // Copies the published blob. 'sequence' receives a number that changes
+  // with every publication. Returns false if nothing was published yet or the
+  // segment could not be read consistently.
+  bool Read(uint64_t* sequence, std::string* blob) const;
+
+ private:
+  struct Header;
+
+  // Opens a descriptor of the segment for this process.
+  bool OpenDescriptor();
+  Header* header() const;
+  char* data() const;
+
+  std::string name_;
+  size_t capacity_;
+  int fd_;
+  void* segment_;
+  // The process that opened fd_.
+  pid_t owner_pid_;
+  bool is_writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedKeyCache);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_SHARED_KEY_CACHE_H_
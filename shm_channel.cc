@@ -0,0 +1,371 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "shm_channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <base/logging.h>
+
+namespace p11net {
+
+namespace {
+
+const uint32_t kChannelMagic = 0x50314e43;  // "P1NC"
+const uint32_t kChannelVersion = 1;
+// The smallest ring a daemon creates.
+const size_t kMinCapacity = 4096;
+// The module's side of the handshake: the memory, the eventfd that wakes the
+// daemon and the one that wakes the module.
+const int kChannelDescriptors = 3;
+
+// Copies between a message and the ring data, wrapping at its end.
+void CopyToRing(uint8_t* ring, uint64_t capacity, uint64_t position,
+                const void* bytes, size_t size) {
+  const size_t offset = position % capacity;
+  const size_t first = std::min<size_t>(size, capacity - offset);
+  memcpy(ring + offset, bytes, first);
+  memcpy(ring, static_cast<const uint8_t*>(bytes) + first, size - first);
+}
+
+void CopyFromRing(const uint8_t* ring, uint64_t capacity, uint64_t position,
+                  void* bytes, size_t size) {
+  const size_t offset = position % capacity;
+  const size_t first = std::min<size_t>(size, capacity - offset);
+  memcpy(bytes, ring + offset, first);
+  memcpy(static_cast<uint8_t*>(bytes) + first, ring, size - first);
+}
+
+void CloseIfOpen(int fd) {
+  if (fd >= 0)
+    close(fd);
+}
+
+// Closes every descriptor passed in 'message', for when it is rejected.
+void CloseReceivedDescriptors(struct msghdr* message) {
+  for (struct cmsghdr* header = CMSG_FIRSTHDR(message); header;
+       header = CMSG_NXTHDR(message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+      continue;
+    const size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(fd));
+      close(fd);
+    }
+  }
+}
+
+}  // namespace
+
+// The positions only grow; they are taken modulo the capacity to index the
+// data. Each lives on a cache line of its own, as it is written by one end
+// and polled by the other.
+struct ShmChannel::Ring {
+  // The bytes the receiver has consumed.
+  alignas(64) std::atomic<uint64_t> head;
+  // The bytes the sender has published.
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+// The memory starts with this header and continues with the data of the ring
+// to the daemon and then of the ring to the module.
+struct ShmChannel::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  Ring to_daemon;
+  Ring to_module;
+};
+
+ShmChannel::ShmChannel(bool is_daemon, int socket)
+    : is_daemon_(is_daemon),
+      socket_(socket),
+      daemon_event_fd_(-1),
+      module_event_fd_(-1),
+      memory_(MAP_FAILED),
+      memory_size_(0),
+      capacity_(0) {}
+
+ShmChannel::~ShmChannel() {
+  if (memory_ != MAP_FAILED)
+    munmap(memory_, memory_size_);
+  CloseIfOpen(daemon_event_fd_);
+  CloseIfOpen(module_event_fd_);
+  CloseIfOpen(socket_);
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Connect(const std::string& path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "The daemon socket path is too long: " << path;
+    return NULL;
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd < 0) {
+    PLOG(ERROR) << "Failed to create a socket";
+    return NULL;
+  }
+  std::unique_ptr<ShmChannel> channel(new ShmChannel(false, socket_fd));
+  if (connect(socket_fd, reinterpret_cast<struct sockaddr*>(&address),
+              sizeof(address)) != 0) {
+    PLOG(ERROR) << "Failed to connect to the daemon at " << path;
+    return NULL;
+  }
+  uint64_t memory_size = 0;
+  struct iovec data = {&memory_size, sizeof(memory_size)};
+  union {
+    char buffer[CMSG_SPACE(kChannelDescriptors * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  ssize_t received;
+  do {
+    received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  struct cmsghdr* header = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+  if (!header || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS ||
+      header->cmsg_len != CMSG_LEN(kChannelDescriptors * sizeof(int))) {
+    LOG(ERROR) << "The daemon at " << path << " did not send a channel.";
+    if (received > 0)
+      CloseReceivedDescriptors(&message);
+    return NULL;
+  }
+  int fds[kChannelDescriptors];
+  memcpy(fds, CMSG_DATA(header), sizeof(fds));
+  channel->daemon_event_fd_ = fds[1];
+  channel->module_event_fd_ = fds[2];
+  if (received != sizeof(memory_size)) {
+    LOG(ERROR) << "The daemon at " << path << " sent a malformed channel.";
+    close(fds[0]);
+    return NULL;
+  }
+  if (!channel->Map(fds[0], memory_size))
+    return NULL;
+  return channel;
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Accept(int socket, size_t capacity) {
+  std::unique_ptr<ShmChannel> channel(new ShmChannel(true, socket));
+  capacity = std::max(capacity, kMinCapacity);
+  // The name only lives until the memory is mapped; the module gets the
+  // descriptor.
+  static std::atomic<uint32_t> next_id(0);
+  const std::string name = "/p11net-channel-" + std::to_string(getpid()) +
+                           "-" + std::to_string(next_id++);
+  int memory_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR);
+  if (memory_fd < 0) {
+    PLOG(ERROR) << "Failed to create the channel memory " << name;
+    return NULL;
+  }
+  shm_unlink(name.c_str());
+  const uint64_t memory_size = sizeof(Header) + 2 * capacity;
+  if (ftruncate(memory_fd, memory_size) != 0) {
+    PLOG(ERROR) << "Failed to size the channel memory";
+    close(memory_fd);
+    return NULL;
+  }
+  channel->daemon_event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  channel->module_event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (channel->daemon_event_fd_ < 0 || channel->module_event_fd_ < 0) {
+    PLOG(ERROR) << "Failed to create the channel eventfds";
+    close(memory_fd);
+    return NULL;
+  }
+  // The new memory is zero-filled, which reads as empty rings.
+  void* memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      memory_fd, 0);
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map the channel memory";
+    close(memory_fd);
+    return NULL;
+  }
+  Header* header = static_cast<Header*>(memory);
+  header->magic = kChannelMagic;
+  header->version = kChannelVersion;
+  header->capacity = capacity;
+  munmap(memory, memory_size);
+
+  const int fds[kChannelDescriptors] = {memory_fd, channel->daemon_event_fd_,
+                                        channel->module_event_fd_};
+  uint64_t size = memory_size;
+  struct iovec data = {&size, sizeof(size)};
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  struct cmsghdr* control_header = CMSG_FIRSTHDR(&message);
+  control_header->cmsg_level = SOL_SOCKET;
+  control_header->cmsg_type = SCM_RIGHTS;
+  control_header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(control_header), fds, sizeof(fds));
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent != sizeof(size)) {
+    PLOG(WARNING) << "Failed to send a channel to a module";
+    close(memory_fd);
+    return NULL;
+  }
+  if (!channel->Map(memory_fd, memory_size))
+    return NULL;
+  return channel;
+}
+
+bool ShmChannel::Map(int memory_fd, size_t size) {
+  struct stat info;
+  if (fstat(memory_fd, &info) != 0 || size < sizeof(Header) ||
+      static_cast<uint64_t>(info.st_size) != size) {
+    LOG(ERROR) << "The channel memory has an unexpected size.";
+    close(memory_fd);
+    return false;
+  }
+  memory_ = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+  close(memory_fd);
+  if (memory_ == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map the channel memory";
+    return false;
+  }
+  memory_size_ = size;
+  const Header* header = static_cast<const Header*>(memory_);
+  if (header->magic != kChannelMagic || header->version != kChannelVersion ||
+      header->capacity == 0 ||
+      header->capacity != (size - sizeof(Header)) / 2) {
+    LOG(ERROR) << "The channel memory has an unexpected format.";
+    return false;
+  }
+  // The other end could change the header; only this copy is trusted.
+  capacity_ = header->capacity;
+  return true;
+}
+
+bool ShmChannel::Send(const std::vector<uint8_t>& message) {
+  const uint64_t capacity = capacity_;
+  Ring* ring = outgoing();
+  uint8_t* data = GetRingData(ring);
+  const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  const uint64_t head = ring->head.load(std::memory_order_acquire);
+  const uint32_t length = message.size();
+  const uint64_t framed = sizeof(length) + message.size();
+  if (tail - head > capacity || framed > capacity - (tail - head)) {
+    LOG(ERROR) << "A message of " << message.size()
+               << " bytes does not fit the channel.";
+    return false;
+  }
+  CopyToRing(data, capacity, tail, &length, sizeof(length));
+  CopyToRing(data, capacity, tail + sizeof(length), message.data(),
+             message.size());
+  ring->tail.store(tail + framed, std::memory_order_release);
+  const uint64_t one = 1;
+  const int event_fd = is_daemon_ ? module_event_fd_ : daemon_event_fd_;
+  if (write(event_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+    PLOG(ERROR) << "Failed to signal the channel eventfd";
+    return false;
+  }
+  return true;
+}
+
+bool ShmChannel::Receive(std::vector<uint8_t>* message) {
+  const uint64_t capacity = capacity_;
+  Ring* ring = incoming();
+  const uint8_t* data = GetRingData(ring);
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  // A message published before the wait drained the eventfd is seen by the
+  // next load, so no wakeup is lost.
+  while (tail == head) {
+    if (!Wait(is_daemon_ ? daemon_event_fd_ : module_event_fd_))
+      return false;
+    tail = ring->tail.load(std::memory_order_acquire);
+  }
+  uint32_t length = 0;
+  if (tail - head < sizeof(length) || tail - head > capacity) {
+    LOG(ERROR) << "The channel ring is corrupt.";
+    return false;
+  }
+  CopyFromRing(data, capacity, head, &length, sizeof(length));
+  if (length > tail - head - sizeof(length)) {
+    LOG(ERROR) << "The channel ring is corrupt.";
+    return false;
+  }
+  message->resize(length);
+  CopyFromRing(data, capacity, head + sizeof(length), message->data(),
+               length);
+  ring->head.store(head + sizeof(length) + length, std::memory_order_release);
+  return true;
+}
+
+size_t ShmChannel::max_message_size() const {
+  return capacity_ - sizeof(uint32_t);
+}
+
+ShmChannel::Ring* ShmChannel::outgoing() const {
+  Header* header = static_cast<Header*>(memory_);
+  return is_daemon_ ? &header->to_module : &header->to_daemon;
+}
+
+ShmChannel::Ring* ShmChannel::incoming() const {
+  Header* header = static_cast<Header*>(memory_);
+  return is_daemon_ ? &header->to_daemon : &header->to_module;
+}
+
+uint8_t* ShmChannel::GetRingData(const Ring* ring) const {
+  Header* header = static_cast<Header*>(memory_);
+  uint8_t* data = static_cast<uint8_t*>(memory_) + sizeof(Header);
+  return ring == &header->to_daemon ? data : data + capacity_;
+}
+
+bool ShmChannel::Wait(int event_fd) const {
+  struct pollfd fds[2] = {{event_fd, POLLIN, 0}, {socket_, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      PLOG(ERROR) << "Failed to wait on the channel";
+      return false;
+    }
+    // Nothing is sent on the socket after the handshake, so it only becomes
+    // readable when the other end closes it.
+    if (fds[1].revents)
+      return false;
+    if (fds[0].revents & POLLIN) {
+      uint64_t count = 0;
+      if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return false;
+      return true;
+    }
+  }
+}
+
+}  // namespace p11net
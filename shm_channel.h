@@ -0,0 +1,83 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_SHM_CHANNEL_H_
+#define P11NET_SHM_CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace p11net {
+
+// ShmChannel carries messages between a module and the p11netd daemon through
+// shared memory. The daemon creates a channel for each connection to its UNIX
+// socket and passes the memory and two eventfds over the socket. The memory
+// holds a ring buffer in each direction; a message is copied into the ring
+// and the eventfd of the receiver is signaled, so a call costs two copies of
+// its data and two wakeups and no system call per byte. The socket stays
+// open to tell either end when the other one goes away. Each end must be
+// used by one thread at a time. Sample usage:
+//    std::unique_ptr<ShmChannel> channel = ShmChannel::Connect(path);
+//    if (!channel || !channel->Send(request) ||
+//        !channel->Receive(&response))
+//      return;  // The daemon is gone.
+class ShmChannel {
+ public:
+  ~ShmChannel();
+
+  // Connects to the daemon on the socket at 'path'.
+  static std::unique_ptr<ShmChannel> Connect(const std::string& path);
+  // Creates a channel with rings of 'capacity' bytes on a connection the
+  // daemon accepted and sends it to the module. Takes 'socket'.
+  static std::unique_ptr<ShmChannel> Accept(int socket, size_t capacity);
+
+  // Copies a message to the ring towards the other end and wakes it up.
+  // Returns false if the message does not fit the ring or the other end is
+  // gone.
+  bool Send(const std::vector<uint8_t>& message);
+  // Waits for the next message from the other end. Returns false if the
+  // other end is gone or sent a malformed message.
+  bool Receive(std::vector<uint8_t>* message);
+
+  // The largest message the rings can take.
+  size_t max_message_size() const;
+
+ private:
+  struct Header;
+  struct Ring;
+
+  ShmChannel(bool is_daemon, int socket);
+
+  // Maps the memory and checks its header. Takes 'memory_fd'.
+  bool Map(int memory_fd, size_t size);
+
+  Ring* outgoing() const;
+  Ring* incoming() const;
+  uint8_t* GetRingData(const Ring* ring) const;
+  // Blocks until 'event_fd' is signaled. Returns false if the socket hangs
+  // up first.
+  bool Wait(int event_fd) const;
+
+  const bool is_daemon_;
+  const int socket_;
+  // Signaled when a message is sent to the daemon and to the module.
+  int daemon_event_fd_;
+  int module_event_fd_;
+  void* memory_;
+  size_t memory_size_;
+  // The size of each ring.
+  uint64_t capacity_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmChannel);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_SHM_CHANNEL_H_
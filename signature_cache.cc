@@ -0,0 +1,105 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "signature_cache.h"
+
+#include <boost/thread/lock_guard.hpp>
+
+#include "metrics.h"
+
+namespace p11net {
+
+namespace {
+
+const char kAllKeys[] = "*";
+
+// Identifiers cannot contain NUL, so the key and input never run together.
+std::string GetCacheKey(const std::string& key_id, const std::string& input) {
+  std::string cache_key;
+  cache_key.reserve(key_id.length() + 1 + input.length());
+  cache_key.append(key_id).push_back('\0');
+  cache_key.append(input);
+  return cache_key;
+}
+
+}  // namespace
+
+SignatureCache::SignatureCache(size_t capacity,
+                               Clock::duration ttl,
+                               const std::set<std::string>& key_ids)
+    : capacity_(capacity),
+      ttl_(ttl),
+      key_ids_(key_ids),
+      all_keys_(key_ids.count(kAllKeys) > 0),
+      hits_(Metrics::Get()->GetCounter("p11net_signature_cache_hits_total")),
+      misses_(
+          Metrics::Get()->GetCounter("p11net_signature_cache_misses_total")),
+      entries_gauge_(
+          Metrics::Get()->GetGauge("p11net_signature_cache_entries")) {}
+
+SignatureCache::~SignatureCache() {
+  entries_gauge_->Add(-static_cast<int64_t>(entries_.size()));
+}
+
+bool SignatureCache::IsEnabled(const std::string& key_id) const {
+  return capacity_ > 0 && (all_keys_ || key_ids_.count(key_id) > 0);
+}
+
+boost::optional<std::string> SignatureCache::Lookup(
+    const std::string& key_id,
+    const std::string& input) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  auto it = index_.find(GetCacheKey(key_id, input));
+  if (it == index_.end()) {
+    misses_->Increment();
+    return boost::none;
+  }
+  if (it->second->expiry <= Clock::now()) {
+    Erase(it->second);
+    misses_->Increment();
+    return boost::none;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  hits_->Increment();
+  return entries_.front().signature;
+}
+
+void SignatureCache::Insert(const std::string& key_id,
+                            const std::string& input,
+                            const std::string& signature) {
+  if (capacity_ == 0)
+    return;
+  std::string cache_key = GetCacheKey(key_id, input);
+  boost::lock_guard<boost::mutex> lock(lock_);
+  auto it = index_.find(cache_key);
+  if (it != index_.end())
+    Erase(it->second);
+  while (entries_.size() >= capacity_)
+    Erase(std::prev(entries_.end()));
+  Entry entry;
+  entry.key_id = key_id;
+  entry.cache_key.swap(cache_key);
+  entry.signature = signature;
+  entry.expiry = Clock::now() + ttl_;
+  entries_.push_front(std::move(entry));
+  index_[entries_.front().cache_key] = entries_.begin();
+  entries_gauge_->Add(1);
+}
+
+void SignatureCache::EraseKey(const std::string& key_id) {
+  boost::lock_guard<boost::mutex> lock(lock_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    auto entry = it++;
+    if (entry->key_id == key_id)
+      Erase(entry);
+  }
+}
+
+void SignatureCache::Erase(EntryList::iterator entry) {
+  index_.erase(entry->cache_key);
+  entries_.erase(entry);
+  entries_gauge_->Add(-1);
+}
+
+}  // namespace p11net
@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_SIGNATURE_CACHE_H_
+#define P11NET_SIGNATURE_CACHE_H_
+
+#include <stddef.h>
+
+#include <chrono>
+#include <iterator>
+#include <list>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <base/macros.h>
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace p11net {
+
+class Counter;
+class Gauge;
+
+// SignatureCache remembers recent PKCS #1 v1.5 signatures. These are
+// deterministic, so a key that signs the same DigestInfo again produces the
+// same signature and the NetHSM round trip can be skipped. Entries are looked
+// up by key identifier and signed input, expire after 'ttl', and the least
+// recently used one is dropped once 'capacity' entries are held. Only keys
+// that were opted in are cached. Sample usage:
+//    SignatureCache cache(1024, std::chrono::seconds(60), {"ocsp"});
+//    if (cache.IsEnabled(key_id)) {
+//      boost::optional<std::string> signature = cache.Lookup(key_id, input);
+//      if (!signature) {
+//        ...sign on the NetHSM...
+//        cache.Insert(key_id, input, *signature);
+//      }
+//    }
+class SignatureCache {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  //  capacity - The maximum number of signatures held.
+  //  ttl - How long a signature is served from the cache.
+  //  key_ids - The identifiers of the keys whose signatures are cached; "*"
+  //            enables all keys.
+  SignatureCache(size_t capacity,
+                 Clock::duration ttl,
+                 const std::set<std::string>& key_ids);
+  virtual ~SignatureCache();
+
+  // Returns true if signatures of the key are cached.
+  bool IsEnabled(const std::string& key_id) const;
+  // Returns the cached signature of 'input' by the key, or an empty result.
+  boost::optional<std::string> Lookup(const std::string& key_id,
+                                      const std::string& input);
+  void Insert(const std::string& key_id,
+              const std::string& input,
+              const std::string& signature);
+  // Drops the signatures of a key, e.g. because it was deleted or replaced.
+  void EraseKey(const std::string& key_id);
+
+ private:
+  struct Entry {
+    std::string key_id;
+    std::string cache_key;
+    std::string signature;
+    Clock::time_point expiry;
+  };
+  typedef std::list<Entry> EntryList;
+
+  // Removes an entry. lock_ must be held.
+  void Erase(EntryList::iterator entry);
+
+  const size_t capacity_;
+  const Clock::duration ttl_;
+  const std::set<std::string> key_ids_;
+  const bool all_keys_;
+  Counter* hits_;
+  Counter* misses_;
+  Gauge* entries_gauge_;
+  boost::mutex lock_;
+  // Entries, most recently used first, and their index by key and input.
+  EntryList entries_;
+  std::unordered_map<std::string, EntryList::iterator> index_;
+
+  DISALLOW_COPY_AND_ASSIGN(SignatureCache);
+};
+
+}  // namespace p11net
+
+#endif  // P11NET_SIGNATURE_CACHE_H_
@@ -7,6 +7,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 
@@ -17,6 +18,7 @@ namespace p11net {
 typedef std::map<CK_MECHANISM_TYPE, CK_MECHANISM_INFO> MechanismMap;
 typedef std::map<CK_MECHANISM_TYPE, CK_MECHANISM_INFO>::const_iterator
     MechanismMapIterator;
+typedef std::vector<CK_MECHANISM_TYPE> MechanismList;
 
 class Session;
 
@@ -44,6 +46,10 @@ class SlotManager {
                             int slot_id, CK_TOKEN_INFO* token_info) const = 0;
   virtual const MechanismMap* GetMechanismInfo(
       const brillo::SecureBlob& isolate_credential, int slot_id) const = 0;
+  // Returns the mechanism types of GetMechanismInfo in ascending order, as
+  // C_GetMechanismList reports them.
+  virtual const MechanismList* GetMechanismList(
+      const brillo::SecureBlob& isolate_credential, int slot_id) const = 0;
   // Opens a new session with the token in the given slot. A token must be
   // present. A new and unique session identifier is returned.
   virtual int OpenSession(
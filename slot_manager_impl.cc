@@ -12,7 +12,6 @@
 #include <string>
 #include <vector>
 
-#include <boost/thread/lock_guard.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <base/logging.h>
@@ -20,7 +19,10 @@
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
+#include "mechanism_descriptor.h"
+#include "metrics.h"
 #include "p11net_utility.h"
+#include "tracing.h"
 #include "isolate.h"
 #include "object_store.h"
 #include "session.h"
@@ -35,6 +37,18 @@ using std::vector;
 
 namespace p11net {
 
+namespace Env {
+  // Set to "memory" to keep the system token in memory only. Nothing is read
+  // from or written to $HOME/.p11net, and the key inventory snapshot is not
+  // saved.
+  const char* kTokenStore = "P11NET_TOKEN_STORE";
+  // The number of NetHSM appliances, each served in a slot of its own.
+  // Appliance N > 0 keeps its token at $HOME/.p11net-N.
+  const char* kAppliances = "P11NET_APPLIANCES";
+  // The token label of appliance N is read from P11NET_LABEL_N.
+  const char* kLabel = "P11NET_LABEL";
+}
+
 namespace {
 
 // I18N Note: The descriptive strings are needed for PKCS #11 compliance but
@@ -48,6 +62,9 @@ const char kSlotDescription[] = "NetHSM Slot";
 //     FILE_PATH_LITERAL("/Users/sanders/.p11net");
 const char kSystemTokenAuthData[] = "000000";
 const char kSystemTokenLabel[] = "System NetHSM Token";
+const char kApplianceTokenLabel[] = "NetHSM Token ";
+// Identifies memory-only system tokens, which have no path of their own.
+const char kMemoryTokenPath[] = "memory";
 const char kTokenLabel[] = "User-Specific NetHSM Token";
 const char kTokenModel[] = "";
 const char kTokenSerialNumber[] = "Not Available";
@@ -56,43 +73,6 @@ const char kKeyPurposeEncrypt[] = "encrypt";
 const char kKeyPurposeMac[] = "mac";
 const char kAuthKeyMacInput[] = "arbitrary";
 
-const struct MechanismInfo {
-  CK_MECHANISM_TYPE type;
-  CK_MECHANISM_INFO info;
-} kDefaultMechanismInfo[] = {
-  {CKM_RSA_PKCS_KEY_PAIR_GEN, {512, 2048, CKF_GENERATE_KEY_PAIR | CKF_HW}},
-  {CKM_RSA_PKCS, {512, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN |
-      CKF_VERIFY}},
-  {CKM_MD5_RSA_PKCS, {512, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA1_RSA_PKCS, {512, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA256_RSA_PKCS, {512, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA384_RSA_PKCS, {512, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA512_RSA_PKCS, {512, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY}},
-  {CKM_MD5, {0, 0, CKF_DIGEST}},
-  {CKM_SHA_1, {0, 0, CKF_DIGEST}},
-  {CKM_SHA256, {0, 0, CKF_DIGEST}},
-  {CKM_SHA384, {0, 0, CKF_DIGEST}},
-  {CKM_SHA512, {0, 0, CKF_DIGEST}},
-  {CKM_GENERIC_SECRET_KEY_GEN, {8, 1024, CKF_GENERATE}},
-  {CKM_MD5_HMAC, {0, 0, CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA_1_HMAC, {0, 0, CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA256_HMAC, {0, 0, CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA512_HMAC, {0, 0, CKF_SIGN | CKF_VERIFY}},
-  {CKM_SHA384_HMAC, {0, 0, CKF_SIGN | CKF_VERIFY}},
-  {CKM_DES_KEY_GEN, {0, 0, CKF_GENERATE}},
-  {CKM_DES_ECB, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_DES_CBC, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_DES_CBC_PAD, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_DES3_KEY_GEN, {0, 0, CKF_GENERATE}},
-  {CKM_DES3_ECB, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_DES3_CBC, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_DES3_CBC_PAD, {0, 0, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_AES_KEY_GEN, {16, 32, CKF_GENERATE}},
-  {CKM_AES_ECB, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_AES_CBC, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}},
-  {CKM_AES_CBC_PAD, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}}
-};
-
 }  // namespace
 
 SlotManagerImpl::SlotManagerImpl(std::shared_ptr<P11NetFactory> factory,
@@ -107,10 +87,18 @@ SlotManagerImpl::SlotManagerImpl(std::shared_ptr<P11NetFactory> factory,
 SlotManagerImpl::~SlotManagerImpl() {}
 
 bool SlotManagerImpl::Init() {
+  ScopedStartupPhase startup_phase("SlotManagerImpl::Init");
   // Populate mechanism info.
-  for (size_t i = 0; i < arraysize(kDefaultMechanismInfo); ++i) {
-    mechanism_info_[kDefaultMechanismInfo[i].type] =
-        kDefaultMechanismInfo[i].info;
+  size_t num_descriptors = 0;
+  const MechanismDescriptor* descriptors =
+      GetMechanismDescriptors(&num_descriptors);
+  for (size_t i = 0; i < num_descriptors; ++i)
+    mechanism_info_[descriptors[i].type] = descriptors[i].info;
+  mechanism_list_.clear();
+  for (MechanismMapIterator it = mechanism_info_.begin();
+       it != mechanism_info_.end();
+       ++it) {
+    mechanism_list_.push_back(it->first);
   }
 
   // Add default isolate.
@@ -128,23 +116,52 @@ bool SlotManagerImpl::Init() {
 bool SlotManagerImpl::InitStage2() {
   if (is_initialized_)
     return true;
+  ScopedStartupPhase startup_phase("InitStage2");
   if (auto_load_system_token_) {
-    boost::filesystem::path token_path(std::getenv("HOME"));
-    token_path = token_path.append(".p11net");
-    if (!boost::filesystem::create_directory(token_path)) {
-      LOG(WARNING) << "System token not loaded because " <<
-        token_path << " does not exist.";
-    }
-    // Setup the system token.
-    int system_slot_id = 0;
-    if (!LoadTokenInternal(
-             IsolateCredentialManager::GetDefaultIsolateCredential(),
-             token_path,
-             SecureBlob(kSystemTokenAuthData),
-             kSystemTokenLabel,
-             &system_slot_id)) {
-      LOG(ERROR) << "Failed to load the system token.";
-      return false;
+    const char* token_store = std::getenv(Env::kTokenStore);
+    const bool persistent =
+        !token_store || std::string(token_store) != "memory";
+    const int num_appliances = GetEnvInt(Env::kAppliances, 1);
+    // Setup the system token of every appliance, starting with the first one
+    // in slot 0.
+    for (int appliance = 0; appliance < num_appliances; ++appliance) {
+      const string suffix =
+          appliance == 0 ? string() : "-" + std::to_string(appliance);
+      boost::filesystem::path token_path;
+      if (persistent) {
+        token_path = std::getenv("HOME");
+        token_path = token_path.append(".p11net" + suffix);
+        if (!boost::filesystem::create_directory(token_path)) {
+          LOG(WARNING) << "System token not loaded because " <<
+            token_path << " does not exist.";
+        }
+      } else {
+        token_path = kMemoryTokenPath + suffix;
+      }
+      string label = kSystemTokenLabel;
+      if (appliance > 0) {
+        const string label_name =
+            string(Env::kLabel) + "_" + std::to_string(appliance);
+        const char* appliance_label = std::getenv(label_name.c_str());
+        label = appliance_label ? appliance_label
+                                : kApplianceTokenLabel +
+                                      std::to_string(appliance);
+      }
+      int system_slot_id = 0;
+      if (!LoadTokenInternal(
+               IsolateCredentialManager::GetDefaultIsolateCredential(),
+               token_path,
+               SecureBlob(kSystemTokenAuthData),
+               label,
+               appliance,
+               persistent,
+               &system_slot_id)) {
+        LOG(ERROR) << "Failed to load the system token of appliance "
+                   << appliance << ".";
+        // The other appliances serve their tokens regardless.
+        if (appliance == 0)
+          return false;
+      }
     }
   }
   is_initialized_ = true;
@@ -202,37 +219,41 @@ const MechanismMap* SlotManagerImpl::GetMechanismInfo(
   return &mechanism_info_;
 }
 
+const MechanismList* SlotManagerImpl::GetMechanismList(
+    const SecureBlob& isolate_credential, int slot_id) const {
+  CHECK_LT(static_cast<size_t>(slot_id), slot_list_.size());
+  CHECK(IsTokenAccessible(isolate_credential, slot_id));
+  CHECK(IsTokenPresent(slot_id));
+
+  return &mechanism_list_;
+}
+
 int SlotManagerImpl::OpenSession(const SecureBlob& isolate_credential,
                                  int slot_id, bool is_read_only) {
   CHECK_LT(static_cast<size_t>(slot_id), slot_list_.size());
   CHECK(IsTokenAccessible(isolate_credential, slot_id));
   CHECK(IsTokenPresent(slot_id));
 
-  shared_ptr<Session> session(factory_->CreateSession(
-      slot_id,
-      slot_list_[slot_id].token_object_pool,
-      slot_list_[slot_id].net_utility,
-      shared_from_this(),
-      is_read_only));
+  // Closed sessions go back to the factory for reuse.
+  std::shared_ptr<P11NetFactory> factory = factory_;
+  shared_ptr<Session> session(
+      factory_->CreateSession(slot_id,
+                              slot_list_[slot_id].token_object_pool,
+                              slot_list_[slot_id].net_utility,
+                              shared_from_this(),
+                              is_read_only),
+      [factory](Session* closed) { factory->DestroySession(closed); });
   CHECK(session.get());
   int session_id = CreateHandle();
-  slot_list_[slot_id].sessions[session_id] = session;
-  session_slot_map_[session_id] = slot_id;
+  sessions_.Insert(session_id, slot_id, isolate_credential, session);
   return session_id;
 }
 
 bool SlotManagerImpl::CloseSession(const SecureBlob& isolate_credential,
                                    int session_id) {
-  Session* session = NULL;
-  if (!GetSession(isolate_credential, session_id, &session))
+  if (!sessions_.Find(session_id, isolate_credential, NULL, NULL))
     return false;
-  CHECK(session);
-  int slot_id = session_slot_map_[session_id];
-  CHECK_LT(static_cast<size_t>(slot_id), slot_list_.size());
-  CHECK(IsTokenAccessible(isolate_credential, slot_id));
-  session_slot_map_.erase(session_id);
-  slot_list_[slot_id].sessions.erase(session_id);
-  return true;
+  return sessions_.Erase(session_id);
 }
 
 void SlotManagerImpl::CloseAllSessions(const SecureBlob& isolate_credential,
@@ -240,37 +261,17 @@ void SlotManagerImpl::CloseAllSessions(const SecureBlob& isolate_credential,
   CHECK_LT(static_cast<size_t>(slot_id), slot_list_.size());
   CHECK(IsTokenAccessible(isolate_credential, slot_id));
 
-  for (map<int, shared_ptr<Session>>::iterator iter =
-           slot_list_[slot_id].sessions.begin();
-       iter != slot_list_[slot_id].sessions.end();
-       ++iter) {
-    session_slot_map_.erase(iter->first);
-  }
-  slot_list_[slot_id].sessions.clear();
+  sessions_.EraseSlot(slot_id);
 }
 
 bool SlotManagerImpl::GetSession(const SecureBlob& isolate_credential,
                                  int session_id, Session** session) const {
   CHECK(session);
+  P11NET_TRACE_SPAN("session lookup");
 
-  // Lookup which slot this session belongs to.
-  map<int, int>::const_iterator session_slot_iter =
-      session_slot_map_.find(session_id);
-  if (session_slot_iter == session_slot_map_.end())
-    return false;
-  int slot_id = session_slot_iter->second;
-  CHECK_LT(static_cast<size_t>(slot_id), slot_list_.size());
-  if (!IsTokenAccessible(isolate_credential, slot_id)) {
-    return false;
-  }
-
-  // Lookup the session instance.
-  map<int, shared_ptr<Session>>::const_iterator session_iter =
-      slot_list_[slot_id].sessions.find(session_id);
-  if (session_iter == slot_list_[slot_id].sessions.end())
-    return false;
-  *session = session_iter->second.get();
-  return true;
+  // The session table only returns sessions opened through this isolate, so
+  // the isolate map is not needed here.
+  return sessions_.Find(session_id, isolate_credential, NULL, session);
 }
 
 bool SlotManagerImpl::OpenIsolate(SecureBlob* isolate_credential,
@@ -330,16 +331,20 @@ bool SlotManagerImpl::LoadToken(const SecureBlob& isolate_credential,
                                 int* slot_id) {
   if (!InitStage2())
     return false;
-  return LoadTokenInternal(isolate_credential, path, auth_data, label, slot_id);
+  return LoadTokenInternal(isolate_credential, path, auth_data, label, 0, true,
+                           slot_id);
 }
 
 bool SlotManagerImpl::LoadTokenInternal(const SecureBlob& isolate_credential,
                                         const boost::filesystem::path& path,
                                         const SecureBlob& auth_data,
                                         const string& label,
+                                        int appliance,
+                                        bool persistent,
                                         int* slot_id) {
   CHECK(slot_id);
   VLOG(1) << "SlotManagerImpl::LoadToken enter";
+  ScopedStartupPhase startup_phase("LoadTokenInternal");
   if (isolate_map_.find(isolate_credential) == isolate_map_.end()) {
     LOG(ERROR) << "Invalid isolate credential for LoadToken.";
     return false;
@@ -356,19 +361,37 @@ bool SlotManagerImpl::LoadTokenInternal(const SecureBlob& isolate_credential,
   }
   // Setup the object pool.
   *slot_id = FindEmptySlot();
-  std::unique_ptr<ObjectStore> object_store(factory_->CreateObjectStore(path));
+  // An empty path selects a memory-only store.
+  const boost::filesystem::path store_path =
+      persistent ? path : boost::filesystem::path();
+  std::unique_ptr<ObjectStore> object_store(
+      factory_->CreateObjectStore(store_path));
   std::shared_ptr<ObjectPool> object_pool(
     factory_->CreateObjectPool(shared_from_this(), std::move(object_store)));
   CHECK(object_pool.get());
 
   // Load a software-only token.
   LOG(WARNING) << "Loading software-only token.";
-  if (!LoadSoftwareToken(auth_data, object_pool.get())) {
-    return false;
+  {
+    ScopedStartupPhase load_phase("LoadSoftwareToken");
+    if (!LoadSoftwareToken(auth_data, object_pool.get())) {
+      return false;
+    }
   }
 
-  shared_ptr<NetUtility> net_utility(factory_->CreateNetUtility(object_pool));
-  net_utility->Init();
+  shared_ptr<NetUtility> net_utility(
+      factory_->CreateNetUtility(object_pool, store_path, appliance));
+  if (slot_event_callback_) {
+    const SlotEventCallback callback = slot_event_callback_;
+    const int event_slot_id = *slot_id;
+    net_utility->SetReachabilityCallback([callback, event_slot_id](bool) {
+      callback(event_slot_id);
+    });
+  }
+  {
+    ScopedStartupPhase init_phase("NetUtility::Init");
+    net_utility->Init();
+  }
 
   // Insert the new token into the empty slot.
   slot_list_[*slot_id].token_object_pool = object_pool;
@@ -586,10 +609,13 @@ bool SlotManagerImpl::IsTokenPresent(int slot_id) const {
 }
 
 int SlotManagerImpl::CreateHandle() {
-  boost::lock_guard<boost::mutex> lock(handle_generator_lock_);
+  // One counter for all threads keeps handles in the order they were
+  // created, which FindObjects relies on to resume after the last handle.
+  const int64_t handle =
+      last_handle_.fetch_add(1, std::memory_order_relaxed) + 1;
   // If we use this many handles, we have a problem.
-  CHECK(last_handle_ < std::numeric_limits<int>::max());
-  return ++last_handle_;
+  CHECK(handle <= std::numeric_limits<int>::max());
+  return static_cast<int>(handle);
 }
 
 void SlotManagerImpl::GetDefaultInfo(CK_SLOT_INFO* slot_info,
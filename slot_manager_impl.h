@@ -5,17 +5,18 @@
 #ifndef P11NET_SLOT_MANAGER_IMPL_H_
 #define P11NET_SLOT_MANAGER_IMPL_H_
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
-#include <boost/thread/mutex.hpp>
-
 #include <base/macros.h>
 
 #include "handle_generator.h"
+#include "session_table.h"
 #include "slot_manager.h"
 #include "token_manager_interface.h"
 
@@ -43,9 +44,19 @@ class SlotManagerImpl : public SlotManager,
                   bool auto_load_system_token);
   virtual ~SlotManagerImpl();
 
+  // Receives the identifier of a slot whose state changed.
+  typedef std::function<void(int)> SlotEventCallback;
+
   // Initializes the slot manager. Returns true on success.
   virtual bool Init();
 
+  // Sets the callback invoked when the NetHSM behind a slot becomes reachable
+  // or unreachable. It runs on a background thread. This must be called
+  // before Init.
+  void SetSlotEventCallback(const SlotEventCallback& callback) {
+    slot_event_callback_ = callback;
+  }
+
   // SlotManager methods.
   virtual int GetSlotCount();
   virtual bool IsTokenAccessible(const brillo::SecureBlob& isolate_credential,
@@ -61,6 +72,9 @@ class SlotManagerImpl : public SlotManager,
   virtual const MechanismMap* GetMechanismInfo(
                             const brillo::SecureBlob& isolate_credential,
                             int slot_id) const;
+  virtual const MechanismList* GetMechanismList(
+                            const brillo::SecureBlob& isolate_credential,
+                            int slot_id) const;
   virtual int OpenSession(const brillo::SecureBlob& isolate_credential,
                           int slot_id,
                           bool is_read_only);
@@ -107,9 +121,6 @@ class SlotManagerImpl : public SlotManager,
     CK_TOKEN_INFO token_info;
     std::shared_ptr<ObjectPool> token_object_pool;
     std::shared_ptr<NetUtility> net_utility;
-    // Key: A session identifier.
-    // Value: The associated session object.
-    std::map<int, std::shared_ptr<Session>> sessions;
   };
 
   // Internal token presence check without isolate_credential check.
@@ -156,11 +167,15 @@ class SlotManagerImpl : public SlotManager,
   // prng and loading the system token.
   bool InitStage2();
 
-  // LoadToken for internal callers.
+  // LoadToken for internal callers. The token is served by the given NetHSM
+  // appliance. If 'persistent' is false, 'path' only identifies the token and
+  // nothing is stored there.
   bool LoadTokenInternal(const brillo::SecureBlob& isolate_credential,
                          const boost::filesystem::path& path,
                          const brillo::SecureBlob& auth_data,
                          const std::string& label,
+                         int appliance,
+                         bool persistent,
                          int* slot_id);
 
   // Loads the master key for a software-only token.
@@ -172,19 +187,22 @@ class SlotManagerImpl : public SlotManager,
                                ObjectPool* object_pool);
 
   std::shared_ptr<P11NetFactory> factory_;
-  int last_handle_;
+  // The last handle handed out, shared by all threads without a lock.
+  std::atomic<int64_t> last_handle_;
   MechanismMap mechanism_info_;
+  // The keys of mechanism_info_, built once by Init.
+  MechanismList mechanism_list_;
   // Key: A path to a token's storage directory.
   // Value: The identifier of the associated slot.
   std::map<boost::filesystem::path, int> path_slot_map_;
   std::vector<Slot> slot_list_;
-  // Key: A session identifier.
-  // Value: The identifier of the associated slot.
-  std::map<int, int> session_slot_map_;
+  // Maps session identifiers to their sessions and slots. Lookups from
+  // concurrent PKCS #11 calls do not serialize on it.
+  SessionTable sessions_;
   std::map<brillo::SecureBlob, Isolate> isolate_map_;
-  boost::mutex handle_generator_lock_;
   bool auto_load_system_token_;
   bool is_initialized_;
+  SlotEventCallback slot_event_callback_;
 
   DISALLOW_COPY_AND_ASSIGN(SlotManagerImpl);
 };
@@ -0,0 +1,249 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tracing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <random>
+
+#include <base/logging.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "p11net_utility.h"
+
+using std::string;
+
+namespace p11net {
+
+namespace Env {
+  // File that receives the spans, in the Trace Event format.
+  const char* kTraceFile = "P11NET_TRACE_FILE";
+  // Traced PKCS #11 calls per million.
+  const char* kTraceSampleRate = "P11NET_TRACE_SAMPLE_RATE";
+}
+
+namespace {
+
+const int kSampleRateScale = 1000000;
+// Spans are written to the trace file in chunks of this many.
+const size_t kMaxBufferedSpans = 256;
+
+// The span the calling thread is in.
+thread_local TraceSpan* g_current_span = NULL;
+
+struct TraceFile {
+  boost::mutex lock;
+  FILE* file = NULL;
+  int sample_rate = kSampleRateScale;
+  std::vector<string> buffered_spans;
+  // Whether a span was written since the file was opened.
+  bool has_spans = false;
+};
+
+TraceFile& GetTraceFile() {
+  // Never destroyed, so that threads may end spans during exit.
+  static TraceFile* trace_file = new TraceFile();
+  return *trace_file;
+}
+
+std::mt19937_64& GetRandomEngine() {
+  static thread_local std::mt19937_64 engine(std::random_device{}());
+  return engine;
+}
+
+long GetThreadId() {
+  static thread_local const long thread_id = syscall(SYS_gettid);
+  return thread_id;
+}
+
+string FormatId(uint64_t id) {
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%016llx",
+           static_cast<unsigned long long>(id));
+  return buffer;
+}
+
+// Appends 'value' to 'out' as a JSON string.
+void AppendJSONString(const string& value, string* out) {
+  out->push_back('"');
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+int64_t ToMicroseconds(const std::chrono::steady_clock::duration& duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      duration).count();
+}
+
+// Writes the buffered spans. The caller holds the trace file lock.
+void WriteBufferedSpans(TraceFile* trace_file) {
+  for (const string& span : trace_file->buffered_spans) {
+    if (trace_file->has_spans)
+      fputs(",\n", trace_file->file);
+    fputs(span.c_str(), trace_file->file);
+    trace_file->has_spans = true;
+  }
+  trace_file->buffered_spans.clear();
+  fflush(trace_file->file);
+}
+
+}  // namespace
+
+std::atomic<bool> Tracing::enabled_(false);
+
+TraceSpan::TraceSpan(const char* name, const TraceSpan* parent)
+    : name_(name),
+      span_id_(GetRandomEngine()()),
+      parent_span_id_(parent ? parent->span_id_ : 0),
+      start_(std::chrono::steady_clock::now()),
+      thread_id_(GetThreadId()),
+      ended_(false) {
+  if (parent) {
+    trace_id_high_ = parent->trace_id_high_;
+    trace_id_low_ = parent->trace_id_low_;
+  } else {
+    trace_id_high_ = GetRandomEngine()();
+    trace_id_low_ = GetRandomEngine()();
+  }
+}
+
+TraceSpan::~TraceSpan() {
+  End();
+}
+
+void TraceSpan::SetAttribute(const char* name, const string& value) {
+  attributes_.push_back(std::make_pair(name, value));
+}
+
+void TraceSpan::End() {
+  if (ended_)
+    return;
+  ended_ = true;
+  Tracing::Record(*this);
+}
+
+string TraceSpan::GetTraceParent() const {
+  return "00-" + FormatId(trace_id_high_) + FormatId(trace_id_low_) + "-" +
+         FormatId(span_id_) + "-01";
+}
+
+void Tracing::Start() {
+  TraceFile& trace_file = GetTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  if (trace_file.file)
+    return;
+  const char* path = getenv(Env::kTraceFile);
+  if (!path || !*path)
+    return;
+  trace_file.file = fopen(path, "w");
+  if (!trace_file.file) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return;
+  }
+  // The closing bracket is optional in the Trace Event format, so the file is
+  // readable even if the process never calls C_Finalize.
+  fputs("[\n", trace_file.file);
+  trace_file.has_spans = false;
+  trace_file.sample_rate = std::min(
+      GetEnvInt(Env::kTraceSampleRate, kSampleRateScale), kSampleRateScale);
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracing::Stop() {
+  TraceFile& trace_file = GetTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  enabled_.store(false, std::memory_order_relaxed);
+  if (!trace_file.file)
+    return;
+  WriteBufferedSpans(&trace_file);
+  fputs("\n]\n", trace_file.file);
+  fclose(trace_file.file);
+  trace_file.file = NULL;
+}
+
+const TraceSpan* Tracing::GetCurrentSpan() {
+  return g_current_span;
+}
+
+std::shared_ptr<TraceSpan> Tracing::StartAsyncSpan(const char* name) {
+  if (!g_current_span)
+    return std::shared_ptr<TraceSpan>();
+  return std::shared_ptr<TraceSpan>(new TraceSpan(name, g_current_span));
+}
+
+bool Tracing::ShouldSample() {
+  const int sample_rate = GetTraceFile().sample_rate;
+  if (sample_rate >= kSampleRateScale)
+    return true;
+  return std::uniform_int_distribution<int>(0, kSampleRateScale - 1)(
+      GetRandomEngine()) < sample_rate;
+}
+
+void Tracing::Record(const TraceSpan& span) {
+  if (!IsEnabled())
+    return;
+  const std::chrono::steady_clock::time_point end =
+      std::chrono::steady_clock::now();
+  string event = "{\"name\":";
+  AppendJSONString(span.name_, &event);
+  event += ",\"cat\":\"p11net\",\"ph\":\"X\",\"ts\":" +
+           std::to_string(ToMicroseconds(span.start_.time_since_epoch())) +
+           ",\"dur\":" + std::to_string(ToMicroseconds(end - span.start_)) +
+           ",\"pid\":" + std::to_string(getpid()) +
+           ",\"tid\":" + std::to_string(span.thread_id_) +
+           ",\"args\":{\"trace_id\":\"" + FormatId(span.trace_id_high_) +
+           FormatId(span.trace_id_low_) + "\",\"span_id\":\"" +
+           FormatId(span.span_id_) + "\"";
+  if (span.parent_span_id_)
+    event += ",\"parent_span_id\":\"" + FormatId(span.parent_span_id_) + "\"";
+  for (const auto& attribute : span.attributes_) {
+    event += ",";
+    AppendJSONString(attribute.first, &event);
+    event += ":";
+    AppendJSONString(attribute.second, &event);
+  }
+  event += "}}";
+
+  TraceFile& trace_file = GetTraceFile();
+  boost::lock_guard<boost::mutex> lock(trace_file.lock);
+  if (!trace_file.file)
+    return;
+  trace_file.buffered_spans.push_back(std::move(event));
+  if (trace_file.buffered_spans.size() >= kMaxBufferedSpans)
+    WriteBufferedSpans(&trace_file);
+}
+
+void ScopedTraceSpan::Begin(const char* name, bool is_root) {
+  if (g_current_span) {
+    // A root span within a trace, e.g. a nested entry point, is a child.
+  } else if (!is_root || !Tracing::ShouldSample()) {
+    return;
+  }
+  previous_ = g_current_span;
+  span_ = new TraceSpan(name, g_current_span);
+  g_current_span = span_;
+}
+
+void ScopedTraceSpan::Finish() {
+  g_current_span = previous_;
+  delete span_;
+}
+
+}  // namespace p11net
@@ -0,0 +1,135 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef P11NET_TRACING_H_
+#define P11NET_TRACING_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace p11net {
+
+// A timed operation within a trace. A trace starts with a root span for a
+// sampled PKCS #11 call and holds a child span for every traced step of the
+// call, e.g. a NetHSM request. A span is recorded when it ends or is
+// destroyed. Spans are only created through ScopedTraceSpan and
+// Tracing::StartAsyncSpan.
+class TraceSpan {
+ public:
+  ~TraceSpan();
+
+  // Attaches a value to the span, e.g. the HTTP status of a request.
+  void SetAttribute(const char* name, const std::string& value);
+  // Records the span. Later calls do nothing.
+  void End();
+
+  // The W3C Trace Context header value identifying the span.
+  std::string GetTraceParent() const;
+
+ private:
+  friend class ScopedTraceSpan;
+  friend class Tracing;
+
+  TraceSpan(const char* name, const TraceSpan* parent);
+
+  const char* name_;
+  uint64_t trace_id_high_;
+  uint64_t trace_id_low_;
+  uint64_t span_id_;
+  uint64_t parent_span_id_;
+  std::chrono::steady_clock::time_point start_;
+  // The thread the span started on.
+  long thread_id_;
+  std::vector<std::pair<const char*, std::string>> attributes_;
+  bool ended_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceSpan);
+};
+
+// Tracing writes the spans of sampled PKCS #11 calls to the file named by
+// P11NET_TRACE_FILE in the Trace Event format, which chrome://tracing and
+// Perfetto display. P11NET_TRACE_SAMPLE_RATE is the number of calls traced per
+// million, all of them by default. With tracing off, a span costs one relaxed
+// atomic load.
+class Tracing {
+ public:
+  // Opens the trace file if tracing is configured. Does nothing if it is
+  // already open.
+  static void Start();
+  // Writes the buffered spans to the trace file and closes it.
+  static void Stop();
+
+  static bool IsEnabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the span the calling thread is in, or NULL.
+  static const TraceSpan* GetCurrentSpan();
+
+  // Starts a child span of the current span that may end on another thread,
+  // e.g. in the continuation of an HTTP request. Returns NULL if the calling
+  // thread is not in a trace.
+  static std::shared_ptr<TraceSpan> StartAsyncSpan(const char* name);
+
+ private:
+  friend class ScopedTraceSpan;
+  friend class TraceSpan;
+
+  // Decides whether a new trace is sampled.
+  static bool ShouldSample();
+  // Buffers a finished span for the trace file.
+  static void Record(const TraceSpan& span);
+
+  static std::atomic<bool> enabled_;
+
+  DISALLOW_COPY_AND_ASSIGN(Tracing);
+};
+
+// Traces the lifetime of the object as a span of the calling thread. A root
+// span starts a new trace if sampled; a child span is only recorded within a
+// trace.
+class ScopedTraceSpan {
+ public:
+  ScopedTraceSpan(const char* name, bool is_root)
+      : span_(NULL), previous_(NULL) {
+    if (Tracing::IsEnabled())
+      Begin(name, is_root);
+  }
+  ~ScopedTraceSpan() {
+    if (span_)
+      Finish();
+  }
+
+  // The span, or NULL if it is not recorded.
+  TraceSpan* span() const { return span_; }
+
+ private:
+  void Begin(const char* name, bool is_root);
+  void Finish();
+
+  TraceSpan* span_;
+  TraceSpan* previous_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTraceSpan);
+};
+
+// Traces the enclosing PKCS #11 entry point as the root span of a trace.
+#define P11NET_TRACE_CALL() \
+  p11net::ScopedTraceSpan call_trace_span(__func__, true)
+
+// Traces the enclosing scope as a child span of the current trace.
+#define P11NET_TRACE_SPAN(name) \
+  p11net::ScopedTraceSpan trace_span(name, false)
+
+}  // namespace p11net
+
+#endif  // P11NET_TRACING_H_